@@ -21,10 +21,14 @@ include(${CMAKE_CURRENT_LIST_DIR}/compiler.cmake)
 check_cxx_symbol_exists(backtrace "execinfo.h" HAVE_BACKTRACE)
 check_cxx_symbol_exists(CLOCK_MONOTONIC_RAW "time.h" HAVE_CLOCK_MONOTONIC_RAW)
 check_cxx_symbol_exists(CLOCK_MONOTONIC "time.h" HAVE_CLOCK_MONOTONIC)
+check_cxx_symbol_exists(CLOCK_MONOTONIC_COARSE "time.h" HAVE_CLOCK_MONOTONIC_COARSE)
 check_cxx_symbol_exists(mach_absolute_time "mach/mach.h;mach/mach_time.h" HAVE_MACH_ABSOLUTE_TIME)
 check_cxx_symbol_exists(inotify_init "sys/inotify.h" HAVE_INOTIFY)
+check_cxx_symbol_exists(FAN_REPORT_DFID_NAME "sys/fanotify.h" HAVE_FANOTIFY)
 check_cxx_symbol_exists(kqueue "sys/types.h;sys/event.h" HAVE_KQUEUE)
 check_cxx_symbol_exists(epoll_wait "sys/epoll.h" HAVE_EPOLL)
+check_cxx_symbol_exists(eventfd "sys/eventfd.h" HAVE_EVENTFD)
+check_cxx_symbol_exists(timerfd_create "sys/timerfd.h" HAVE_TIMERFD)
 check_cxx_symbol_exists(select "sys/select.h" HAVE_SELECT)
 check_cxx_symbol_exists(FD_CLOEXEC "fcntl.h" HAVE_CLOEXEC)
 check_cxx_symbol_exists(SO_NOSIGPIPE "sys/types.h;sys/socket.h" HAVE_NOSIGPIPE)
@@ -32,6 +36,22 @@ check_cxx_symbol_exists(MSG_NOSIGNAL "sys/types.h;sys/socket.h" HAVE_NOSIGNAL)
 check_cxx_symbol_exists(GetLogicalProcessorInformation "windows.h" HAVE_PROCESSORINFORMATION)
 check_cxx_symbol_exists(SCHED_IDLE "pthread.h" HAVE_SCHEDIDLE)
 check_cxx_symbol_exists(SHM_DEST "sys/types.h;sys/ipc.h;sys/shm.h" HAVE_SHMDEST)
+check_cxx_symbol_exists(memfd_create "sys/mman.h" HAVE_MEMFD_CREATE)
+check_cxx_symbol_exists(SO_REUSEPORT "sys/types.h;sys/socket.h" HAVE_REUSEPORT)
+check_cxx_symbol_exists(recvmmsg "sys/types.h;sys/socket.h" HAVE_RECVMMSG)
+check_cxx_symbol_exists(sendmmsg "sys/types.h;sys/socket.h" HAVE_SENDMMSG)
+check_cxx_symbol_exists(accept4 "sys/types.h;sys/socket.h" HAVE_ACCEPT4)
+check_cxx_symbol_exists(sched_getaffinity "sched.h" HAVE_SCHED_GETAFFINITY)
+check_cxx_symbol_exists(posix_spawn "spawn.h" HAVE_POSIX_SPAWN)
+check_cxx_symbol_exists(SYS_pidfd_open "sys/syscall.h" HAVE_PIDFD_OPEN)
+check_cxx_symbol_exists(splice "fcntl.h" HAVE_SPLICE)
+check_cxx_symbol_exists(posix_spawn_file_actions_addchdir_np "spawn.h" HAVE_POSIX_SPAWN_CHDIR)
+check_cxx_symbol_exists(SYS_getdents64 "sys/syscall.h" HAVE_GETDENTS64)
+check_cxx_symbol_exists(statx "sys/stat.h" HAVE_STATX)
+check_cxx_symbol_exists(memmem "string.h" HAVE_MEMMEM)
+set(CMAKE_REQUIRED_LIBRARIES pthread)
+check_cxx_symbol_exists(pthread_setaffinity_np "pthread.h" HAVE_PTHREAD_SETAFFINITY)
+unset(CMAKE_REQUIRED_LIBRARIES)
 
 if (CYGWIN)
   message("-- Using win32 FileSystemWatcher")
@@ -63,6 +83,20 @@ check_cxx_source_compiles("
       return st.st_mtim.tv_sec;
   }" HAVE_STATMTIM)
 
+check_cxx_source_compiles("
+  #include <linux/io_uring.h>
+  #include <sys/syscall.h>
+  int main(int, char**) {
+      return __NR_io_uring_setup + IORING_OP_PROVIDE_BUFFERS + IOSQE_BUFFER_SELECT;
+  }" HAVE_IO_URING)
+
+set(CMAKE_REQUIRED_FLAGS "-std=c++11")
+check_cxx_source_compiles("
+  struct Value { ~Value() { } int value; };
+  Value &value() { static thread_local Value v; return v; }
+  int main(int, char **) { return value().value; }" HAVE_THREAD_LOCAL)
+unset(CMAKE_REQUIRED_FLAGS)
+
 if (NOT DEFINED RCT_INCLUDE_DIR)
   set(RCT_INCLUDE_DIR "${CMAKE_CURRENT_BINARY_DIR}/include/rct")
 endif ()
@@ -74,38 +108,66 @@ if (ZLIB_FOUND)
 else ()
     message("ZLIB Can't be found. Rct configured without zlib support")
 endif ()
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY zstd)
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_ZSTD)
+    include_directories(${ZSTD_INCLUDE_DIR})
+else ()
+    set(ZSTD_LIBRARY "")
+    message("zstd can't be found. Rct configured without zstd support")
+endif ()
 find_package(OpenSSL REQUIRED)
 
 include_directories(${CMAKE_CURRENT_LIST_DIR} ${RCT_INCLUDE_DIR} ${RCT_INCLUDE_DIR}/.. ${ZLIB_INCLUDE_DIRS} ${OPENSSL_INCLUDE_DIR})
 set(RCT_SOURCES
   ${RCT_SOURCES}
   ${CMAKE_CURRENT_LIST_DIR}/rct/AES256CBC.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Arena.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Atom.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/BinaryLog.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Buffer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Compressor.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Config.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Connection.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/CpuTopology.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/CpuUsage.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DataFile.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DnsResolver.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoop.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoopGroup.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/FastHash.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Futex.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/JSONParser.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Log.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/MappedFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MemoryMonitor.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Message.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/MessagePack.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MessageQueue.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Metrics.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Path.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Plugin.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Process.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ProcessPool.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Profiler.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Rct.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ReadWriteLock.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SHA256.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Semaphore.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ShardedReadWriteLock.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemory.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemoryChannel.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ShmRing.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketClient.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketServer.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/String.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Thread.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ThreadPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Timer.cpp
-  ${CMAKE_CURRENT_LIST_DIR}/rct/Value.cpp
-  ${CMAKE_CURRENT_LIST_DIR}/cJSON/cJSON.c)
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Trace.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Value.cpp)
 
 if (HAVE_INOTIFY EQUAL 1)
   list(APPEND RCT_SOURCES ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher_inotify.cpp)
@@ -117,6 +179,10 @@ elseif (HAVE_CHANGENOTIFICATION EQUAL 1)
   list(APPEND RCT_SOURCES ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher_win32.cpp)
 endif ()
 
+if (HAVE_IO_URING AND HAVE_EPOLL)
+  list(APPEND RCT_SOURCES ${CMAKE_CURRENT_LIST_DIR}/rct/IoUring.cpp)
+endif ()
+
 
 if (RCT_BUILD_SCRIPTENGINE)
   set(CMAKE_MODULE_PATH ${CMAKE_MODULE_PATH} "${CMAKE_CURRENT_LIST_DIR}/cmake/")
@@ -124,7 +190,9 @@ if (RCT_BUILD_SCRIPTENGINE)
   if (V8_FOUND STREQUAL "YES")
     set(HAVE_SCRIPTENGINE 1)
     message("Building ScriptEngine")
-    set(RCT_SOURCES ${RCT_SOURCES} ${CMAKE_CURRENT_LIST_DIR}/rct/ScriptEngine.cpp)
+    set(RCT_SOURCES ${RCT_SOURCES}
+      ${CMAKE_CURRENT_LIST_DIR}/rct/ScriptEngine.cpp
+      ${CMAKE_CURRENT_LIST_DIR}/rct/ScriptEnginePool.cpp)
     include_directories(${V8_INCLUDE_DIR})
   endif ()
 endif ()
@@ -162,7 +230,7 @@ if (CMAKE_SYSTEM_NAME MATCHES "Darwin")
   find_path(COREFOUNDATION_INCLUDE "CoreFoundation/CoreFoundation.h")
 endif ()
 
-set(RCT_LIBRARIES pthread ${ZLIB_LIBRARIES} ${OPENSSL_CRYPTO_LIBRARY})
+set(RCT_LIBRARIES pthread ${ZLIB_LIBRARIES} ${ZSTD_LIBRARY} ${OPENSSL_CRYPTO_LIBRARY})
 if (CMAKE_SYSTEM_NAME MATCHES "Linux")
   list(APPEND RCT_LIBRARIES dl rt)
 endif ()
@@ -179,6 +247,18 @@ if (NOT RCT_NO_INSTALL)
   install(TARGETS rct DESTINATION lib COMPONENT rct EXPORT rct)
 endif ()
 
+if (NOT RCT_NO_TOOLS)
+  add_executable(rct-logdecode ${CMAKE_CURRENT_LIST_DIR}/tools/rct-logdecode.cpp)
+  target_link_libraries(rct-logdecode rct)
+  if (NOT RCT_NO_INSTALL)
+    install(TARGETS rct-logdecode DESTINATION bin COMPONENT rct)
+  endif ()
+  add_executable(rct_bench ${CMAKE_CURRENT_LIST_DIR}/tools/rct_bench.cpp)
+  target_link_libraries(rct_bench rct)
+  add_executable(rct_loadgen ${CMAKE_CURRENT_LIST_DIR}/tools/rct_loadgen.cpp)
+  target_link_libraries(rct_loadgen rct)
+endif ()
+
 set(CMAKE_REQUIRED_FLAGS "-std=c++11")
 if (RCT_USE_LIBCXX)
   set(CMAKE_REQUIRED_LIBRARIES "${CMAKE_EXE_LINKER_FLAGS}")
@@ -226,21 +306,45 @@ if (NOT RCT_NO_INSTALL)
     ${CMAKE_CURRENT_BINARY_DIR}/include/rct/rct-config.h
     rct/AES256CBC.h
     rct/Apply.h
+    rct/Arena.h
+    rct/Atom.h
+    rct/BinaryLog.h
     rct/Buffer.h
+    rct/Compressor.h
     rct/Config.h
     rct/Connection.h
+    rct/Coroutine.h
+    rct/CpuTopology.h
+    rct/DataFile.h
+    rct/DnsResolver.h
     rct/EventLoop.h
+    rct/EventLoopGroup.h
+    rct/FastHash.h
     rct/FileSystemWatcher.h
+    rct/FlatHash.h
+    rct/FlatHashSet.h
+    rct/Futex.h
+    rct/FlatMap.h
+    rct/FlatSet.h
+    rct/IoUring.h
+    rct/JSONParser.h
     rct/List.h
     rct/Log.h
     rct/Map.h
+    rct/MappedFile.h
     rct/MemoryMonitor.h
     rct/Message.h
+    rct/MessageDispatcher.h
+    rct/MessagePack.h
     rct/MessageQueue.h
+    rct/Metrics.h
+    rct/NodePool.h
     rct/Path.h
     rct/Plugin.h
     rct/Point.h
     rct/Process.h
+    rct/ProcessPool.h
+    rct/Profiler.h
     rct/Rct.h
     rct/ReadLocker.h
     rct/ReadWriteLock.h
@@ -248,20 +352,28 @@ if (NOT RCT_NO_INSTALL)
     rct/ResponseMessage.h
     rct/SHA256.h
     rct/Semaphore.h
+    rct/SeqLock.h
     rct/Serializer.h
     rct/Set.h
+    rct/ShardedReadWriteLock.h
     rct/SharedMemory.h
+    rct/SharedMemoryChannel.h
+    rct/ShmRing.h
     rct/SignalSlot.h
     rct/Size.h
+    rct/SocketAddress.h
     rct/SocketClient.h
     rct/SocketServer.h
     rct/StopWatch.h
     rct/String.h
+    rct/StringView.h
     rct/Thread.h
     rct/ThreadLocal.h
     rct/ThreadPool.h
     rct/Timer.h
+    rct/Trace.h
     rct/Value.h
+    rct/ValueMessage.h
     rct/WriteLocker.h
     DESTINATION include/rct)
 
@@ -3,36 +3,46 @@
 #include <rct/Log.h>
 #ifdef OS_Darwin
 #include <CommonCrypto/CommonCryptor.h>
+#define AES_BLOCK_SIZE kCCBlockSizeAES128
 #else
 #include <openssl/evp.h>
 #include <openssl/aes.h>
+#include <openssl/crypto.h>
 #endif
 
 class AES256CBCPrivate
 {
 public:
-    AES256CBCPrivate() : inited(false) { }
+    AES256CBCPrivate() : inited(false), active(false), mode(AES256CBC::Encrypt) { }
     ~AES256CBCPrivate();
 
-    bool inited;
+    bool inited, active;
+    AES256CBC::Mode mode;
+    unsigned char key[32];
     unsigned char iv[32];
 #ifdef OS_Darwin
     CCCryptorRef ectx, dctx;
+    CCCryptorRef ctx() const { return mode == AES256CBC::Encrypt ? ectx : dctx; }
 #else
-    EVP_CIPHER_CTX ectx, dctx;
+    EVP_CIPHER_CTX *ectx, *dctx;
+    EVP_CIPHER_CTX *ctx() const { return mode == AES256CBC::Encrypt ? ectx : dctx; }
 #endif
 };
 
 AES256CBCPrivate::~AES256CBCPrivate()
 {
+#ifdef OS_Darwin
+    memset(key, 0, sizeof(key));
     if (!inited)
         return;
-#ifdef OS_Darwin
     CCCryptorRelease(ectx);
     CCCryptorRelease(dctx);
 #else
-    EVP_CIPHER_CTX_cleanup(&ectx);
-    EVP_CIPHER_CTX_cleanup(&dctx);
+    OPENSSL_cleanse(key, sizeof(key));
+    if (!inited)
+        return;
+    EVP_CIPHER_CTX_free(ectx);
+    EVP_CIPHER_CTX_free(dctx);
 #endif
 }
 
@@ -63,19 +73,26 @@ static void deriveKey(const String& key, unsigned char* outkey,
 AES256CBC::AES256CBC(const String& key, const unsigned char* salt)
     : priv(new AES256CBCPrivate)
 {
-    unsigned char outkey[32];
-
-    deriveKey(key, outkey, priv->iv, 100, salt);
+    deriveKey(key, priv->key, priv->iv, 100, salt);
 #ifdef OS_Darwin
-    CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
-                    outkey, kCCKeySizeAES256, priv->iv, &priv->ectx);
-    CCCryptorCreate(kCCDecrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
-                    outkey, kCCKeySizeAES256, priv->iv, &priv->dctx);
+    if (CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
+                        priv->key, kCCKeySizeAES256, priv->iv, &priv->ectx) != kCCSuccess)
+        return;
+    if (CCCryptorCreate(kCCDecrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
+                        priv->key, kCCKeySizeAES256, priv->iv, &priv->dctx) != kCCSuccess) {
+        CCCryptorRelease(priv->ectx);
+        return;
+    }
 #else
-    EVP_CIPHER_CTX_init(&priv->ectx);
-    EVP_EncryptInit_ex(&priv->ectx, EVP_aes_256_cbc(), NULL, outkey, priv->iv);
-    EVP_CIPHER_CTX_init(&priv->dctx);
-    EVP_DecryptInit_ex(&priv->dctx, EVP_aes_256_cbc(), NULL, outkey, priv->iv);
+    priv->ectx = EVP_CIPHER_CTX_new();
+    priv->dctx = EVP_CIPHER_CTX_new();
+    if (!priv->ectx || !priv->dctx
+        || !EVP_EncryptInit_ex(priv->ectx, EVP_aes_256_cbc(), NULL, priv->key, priv->iv)
+        || !EVP_DecryptInit_ex(priv->dctx, EVP_aes_256_cbc(), NULL, priv->key, priv->iv)) {
+        EVP_CIPHER_CTX_free(priv->ectx);
+        EVP_CIPHER_CTX_free(priv->dctx);
+        return;
+    }
 #endif
 
     priv->inited = true;
@@ -86,48 +103,110 @@ AES256CBC::~AES256CBC()
     delete priv;
 }
 
-String AES256CBC::encrypt(const String& data)
+bool AES256CBC::begin(Mode mode)
 {
     if (!priv->inited)
-        return String();
+        return false;
+    priv->mode = mode;
 #ifdef OS_Darwin
-    size_t flen;
-    String out(data.size() + kCCBlockSizeAES128, '\0');
-    CCCryptorUpdate(priv->ectx, data.constData(), data.size(), out.data(), out.size(), &flen);
-    CCCryptorFinal(priv->ectx, out.data(), flen, &flen);
-    CCCryptorReset(priv->ectx, priv->iv);
-    out.resize(flen);
+    priv->active = CCCryptorReset(priv->ctx(), priv->iv) == kCCSuccess;
 #else
-    int elen = data.size() + AES_BLOCK_SIZE, flen;
-    String out(elen, '\0');
-    EVP_EncryptInit_ex(&priv->ectx, NULL, NULL, NULL, NULL);
-    EVP_EncryptUpdate(&priv->ectx, reinterpret_cast<unsigned char*>(out.data()), &elen,
-                      reinterpret_cast<const unsigned char*>(data.constData()), data.size());
-    EVP_EncryptFinal_ex(&priv->ectx, reinterpret_cast<unsigned char*>(out.data()) + elen, &flen);
-    out.resize(elen + flen);
+    priv->active = EVP_CipherInit_ex(priv->ctx(), NULL, NULL, priv->key, priv->iv, mode == Encrypt ? 1 : 0);
 #endif
-    return out;
+    return priv->active;
 }
 
-String AES256CBC::decrypt(const String& data)
+int AES256CBC::update(const void* data, unsigned int size, unsigned char* out)
 {
-    if (!priv->inited)
-        return String();
+    if (!priv->active)
+        return -1;
+#ifdef OS_Darwin
+    size_t len;
+    if (CCCryptorUpdate(priv->ctx(), data, size, out, size + AES_BLOCK_SIZE, &len) != kCCSuccess) {
+        priv->active = false;
+        return -1;
+    }
+#else
+    int len;
+    if (!EVP_CipherUpdate(priv->ctx(), out, &len, static_cast<const unsigned char*>(data), size)) {
+        priv->active = false;
+        return -1;
+    }
+#endif
+    return len;
+}
+
+int AES256CBC::finish(unsigned char* out)
+{
+    if (!priv->active)
+        return -1;
+    priv->active = false;
 #ifdef OS_Darwin
-    size_t flen;
-    String out(data.size() + kCCBlockSizeAES128, '\0');
-    CCCryptorUpdate(priv->dctx, data.constData(), data.size(), out.data(), out.size(), &flen);
-    CCCryptorFinal(priv->dctx, out.data(), flen, &flen);
-    CCCryptorReset(priv->dctx, priv->iv);
-    out.resize(flen);
+    size_t len;
+    if (CCCryptorFinal(priv->ctx(), out, AES_BLOCK_SIZE, &len) != kCCSuccess)
+        return -1;
 #else
-    int dlen = data.size(), flen;
-    String out(dlen + AES_BLOCK_SIZE, '\0');
-    EVP_DecryptInit_ex(&priv->dctx, NULL, NULL, NULL, NULL);
-    EVP_DecryptUpdate(&priv->dctx, reinterpret_cast<unsigned char*>(out.data()), &dlen,
-                      reinterpret_cast<const unsigned char*>(data.constData()), data.size());
-    EVP_DecryptFinal_ex(&priv->dctx, reinterpret_cast<unsigned char*>(out.data()) + dlen, &flen);
-    out.resize(dlen + flen);
+    int len;
+    if (!EVP_CipherFinal_ex(priv->ctx(), out, &len))
+        return -1;
 #endif
+    return len;
+}
+
+bool AES256CBC::update(const void* data, unsigned int size, Buffer& out)
+{
+    const unsigned int pos = out.size();
+    out.reserve(pos + size + AES_BLOCK_SIZE);
+    const int len = update(data, size, out.end());
+    if (len < 0)
+        return false;
+    out.resize(pos + len);
+    return true;
+}
+
+bool AES256CBC::update(const String& data, String& out)
+{
+    const int pos = out.size();
+    out.resize(pos + data.size() + AES_BLOCK_SIZE);
+    const int len = update(data.constData(), data.size(), reinterpret_cast<unsigned char*>(out.data()) + pos);
+    out.resize(pos + std::max(len, 0));
+    return len >= 0;
+}
+
+bool AES256CBC::finish(Buffer& out)
+{
+    const unsigned int pos = out.size();
+    out.reserve(pos + AES_BLOCK_SIZE);
+    const int len = finish(out.end());
+    if (len < 0)
+        return false;
+    out.resize(pos + len);
+    return true;
+}
+
+bool AES256CBC::finish(String& out)
+{
+    const int pos = out.size();
+    out.resize(pos + AES_BLOCK_SIZE);
+    const int len = finish(reinterpret_cast<unsigned char*>(out.data()) + pos);
+    out.resize(pos + std::max(len, 0));
+    return len >= 0;
+}
+
+String AES256CBC::encrypt(const String& data)
+{
+    String out;
+    out.reserve(data.size() + AES_BLOCK_SIZE);
+    if (!begin(Encrypt) || !update(data, out) || !finish(out))
+        return String();
+    return out;
+}
+
+String AES256CBC::decrypt(const String& data)
+{
+    String out;
+    out.reserve(data.size() + AES_BLOCK_SIZE);
+    if (!begin(Decrypt) || !update(data, out) || !finish(out))
+        return String();
     return out;
 }
@@ -1,10 +1,13 @@
 #ifndef AES256CBC_H
 #define AES256CBC_H
 
+#include <rct/Buffer.h>
 #include <rct/String.h>
 
 class AES256CBCPrivate;
 
+// Through OpenSSL's EVP or CommonCrypto, which use AES-NI where the cpu
+// has it
 class AES256CBC
 {
 public:
@@ -14,8 +17,27 @@ public:
     String encrypt(const String& data);
     String decrypt(const String& data);
 
+    // encrypt() or decrypt() a chunk at a time: begin(), update() with
+    // each chunk and then finish(), which pads or checks the padding. The
+    // output is appended to out, it lags the input by up to a block.
+    // encrypt() and decrypt() start over whatever is in progress.
+    enum Mode { Encrypt, Decrypt };
+    bool begin(Mode mode);
+    bool update(const void* data, unsigned int size, Buffer& out);
+    bool update(const Buffer& data, Buffer& out) { return update(data.data(), data.size(), out); }
+    bool update(const String& data, String& out);
+    bool finish(Buffer& out);
+    bool finish(String& out);
+
 private:
+    // out has room for size plus a block, returns the bytes written or -1
+    int update(const void* data, unsigned int size, unsigned char* out);
+    int finish(unsigned char* out);
+
     AES256CBCPrivate* priv;
+
+    AES256CBC(const AES256CBC&) = delete;
+    AES256CBC& operator=(const AES256CBC&) = delete;
 };
 
 #endif
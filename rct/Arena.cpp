@@ -0,0 +1,82 @@
+#include "Arena.h"
+#include <algorithm>
+#include <string.h>
+
+Arena::Arena(size_t blockSize)
+    : mBlocks(0), mCurrent(0), mPos(0), mEnd(0), mBuffer(0), mBufferSize(0),
+      mBlockSize(std::max(blockSize, sizeof(Block) * 2)), mUsed(0), mReserved(0)
+{
+}
+
+Arena::Arena(void *buffer, size_t size, size_t blockSize)
+    : mBlocks(0), mCurrent(0), mPos(static_cast<char *>(buffer)), mEnd(static_cast<char *>(buffer) + size),
+      mBuffer(static_cast<char *>(buffer)), mBufferSize(size),
+      mBlockSize(std::max(blockSize, sizeof(Block) * 2)), mUsed(0), mReserved(size)
+{
+}
+
+Arena::~Arena()
+{
+    while (mBlocks) {
+        Block *next = mBlocks->next;
+        ::operator delete(mBlocks);
+        mBlocks = next;
+    }
+}
+
+void *Arena::allocateSlow(size_t size, size_t alignment)
+{
+    const size_t blockSize = sizeof(Block) + size + alignment;
+    if (blockSize > mBlockSize / 4) {
+        // a block of its own, what's left of the current one is still used
+        Block *block = static_cast<Block *>(::operator new(blockSize));
+        block->size = blockSize;
+        block->next = mBlocks;
+        mBlocks = block;
+        mReserved += blockSize;
+        mUsed += size;
+        const uintptr_t start = reinterpret_cast<uintptr_t>(block + 1);
+        return reinterpret_cast<void *>((start + alignment - 1) & ~(alignment - 1));
+    }
+    Block *block = static_cast<Block *>(::operator new(mBlockSize));
+    block->size = mBlockSize;
+    block->next = mBlocks;
+    mBlocks = mCurrent = block;
+    mReserved += mBlockSize;
+    mPos = reinterpret_cast<char *>(block + 1);
+    mEnd = reinterpret_cast<char *>(block) + mBlockSize;
+    return allocate(size, alignment);
+}
+
+StringView Arena::copy(const StringView &string)
+{
+    char *ret = static_cast<char *>(allocate(string.size() + 1, 1));
+    memcpy(ret, string.data(), string.size());
+    ret[string.size()] = '\0';
+    return StringView(ret, string.size());
+}
+
+void Arena::reset()
+{
+    // the caller's buffer first, otherwise the current block
+    Block *keep = mBuffer ? 0 : mCurrent;
+    while (mBlocks) {
+        Block *next = mBlocks->next;
+        if (mBlocks != keep)
+            ::operator delete(mBlocks);
+        mBlocks = next;
+    }
+    mUsed = 0;
+    if (keep) {
+        keep->next = 0;
+        mBlocks = mCurrent = keep;
+        mPos = reinterpret_cast<char *>(keep + 1);
+        mEnd = reinterpret_cast<char *>(keep) + keep->size;
+        mReserved = keep->size;
+    } else {
+        mCurrent = 0;
+        mPos = mBuffer;
+        mEnd = mBuffer + mBufferSize;
+        mReserved = mBufferSize;
+    }
+}
@@ -0,0 +1,177 @@
+#ifndef Arena_h
+#define Arena_h
+
+#include <rct/StringView.h>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <new>
+#include <scoped_allocator>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// Monotonic allocator. Allocations are carved out of blocks that only go
+// away, all at once, in reset() or the destructor, so building a tree of
+// Arena containers costs a pointer bump per allocation and throwing it
+// away costs a free() per block rather than one per node. Destructors of
+// what was created in the arena are not called by reset(), containers
+// that are destroyed normally before it are fine.
+//
+// Not thread safe, an arena belongs to whatever is building the tree.
+class Arena
+{
+public:
+    enum { DefaultBlockSize = 16 * 1024 };
+
+    Arena(size_t blockSize = DefaultBlockSize);
+    // Uses buffer before allocating any blocks, typically stack memory
+    Arena(void *buffer, size_t size, size_t blockSize = DefaultBlockSize);
+    ~Arena();
+
+    void *allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        const uintptr_t ret = (reinterpret_cast<uintptr_t>(mPos) + alignment - 1) & ~(alignment - 1);
+        const uintptr_t end = reinterpret_cast<uintptr_t>(mEnd);
+        if (ret > end || size > end - ret)
+            return allocateSlow(size, alignment);
+        mPos = reinterpret_cast<char *>(ret + size);
+        mUsed += size;
+        return reinterpret_cast<void *>(ret);
+    }
+
+    template <typename T, typename... Args>
+    T *create(Args &&...args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // A nul terminated copy of string
+    StringView copy(const StringView &string);
+
+    // Frees everything, keeping the last block to allocate from again
+    void reset();
+
+    // The bytes handed out and the bytes held, since the last reset()
+    size_t used() const { return mUsed; }
+    size_t reserved() const { return mReserved; }
+
+private:
+    void *allocateSlow(size_t size, size_t alignment);
+
+    struct Block
+    {
+        Block *next;
+        size_t size;
+    };
+
+    Block *mBlocks, *mCurrent;
+    char *mPos, *mEnd;
+    char *mBuffer;
+    size_t mBufferSize, mBlockSize, mUsed, mReserved;
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+};
+
+// Standard allocator on an Arena, deallocating is a no-op. Without an
+// arena it's the global allocator, so containers that are default
+// constructed still work. Moving or swapping a container moves its arena
+// along, copying one copies into the target's arena.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    ArenaAllocator(Arena *arena = 0) : mArena(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : mArena(other.arena()) {}
+
+    T *allocate(size_t count)
+    {
+        if (mArena)
+            return static_cast<T *>(mArena->allocate(count * sizeof(T), alignof(T)));
+        return static_cast<T *>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T *data, size_t)
+    {
+        if (!mArena)
+            ::operator delete(data);
+    }
+
+    Arena *arena() const { return mArena; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return mArena == other.arena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return mArena != other.arena(); }
+
+private:
+    Arena *mArena;
+};
+
+// Containers on an Arena. Elements that take an allocator, ArenaString
+// and the Arena containers themselves, get the container's, so a whole
+// tree lives in one arena:
+//
+//     Arena arena;
+//     ArenaMap<ArenaString, ArenaVector<ArenaString> > map(&arena);
+template <typename T>
+using ArenaScopedAllocator = std::scoped_allocator_adaptor<ArenaAllocator<T> >;
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaScopedAllocator<T> >;
+
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+using ArenaMap = std::map<Key, Value, Compare, ArenaScopedAllocator<std::pair<const Key, Value> > >;
+
+template <typename T, typename Compare = std::less<T> >
+using ArenaSet = std::set<T, Compare, ArenaScopedAllocator<T> >;
+
+template <typename Key, typename Value, typename Hasher = std::hash<Key> >
+using ArenaHash = std::unordered_map<Key, Value, Hasher, std::equal_to<Key>, ArenaScopedAllocator<std::pair<const Key, Value> > >;
+
+// T constructed with alloc if it takes one
+template <typename T, typename Alloc>
+inline T arenaConstruct(const Alloc &alloc, std::true_type)
+{
+    return T(alloc);
+}
+
+template <typename T, typename Alloc>
+inline T arenaConstruct(const Alloc &, std::false_type)
+{
+    return T();
+}
+
+template <typename T, typename Alloc>
+inline T arenaConstruct(const Alloc &alloc)
+{
+    return arenaConstruct<T>(alloc, std::uses_allocator<T, Alloc>());
+}
+
+namespace std
+{
+template <> struct hash<ArenaString>
+{
+    typedef ArenaString argument_type;
+    typedef size_t result_type;
+
+    size_t operator()(const ArenaString &value) const
+    {
+        return hash<StringView>()(StringView(value.data(), value.size()));
+    }
+};
+}
+
+#endif
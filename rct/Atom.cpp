@@ -0,0 +1,296 @@
+#include "Atom.h"
+#include "FlatHash.h"
+#include <assert.h>
+#include <atomic>
+#include <mutex>
+#include <string.h>
+
+namespace {
+// id -> Entry without locking. Segment k holds Base << k entries, so
+// segments never move once they're published and only the id counter is
+// shared between writers.
+template <typename Entry>
+class Entries
+{
+public:
+    Entries()
+        : mNext(1)
+    {
+        for (int i = 0; i < MaxSegments; ++i)
+            mSegments[i].store(0, std::memory_order_relaxed);
+    }
+
+    const Entry &at(uint32_t id) const
+    {
+        const int segment = segmentOf(id);
+        return mSegments[segment].load(std::memory_order_acquire)[id - firstId(segment)];
+    }
+
+    // A new id, the caller fills in its entry before handing it out
+    uint32_t add(const Entry &entry)
+    {
+        const uint32_t id = mNext.fetch_add(1, std::memory_order_relaxed);
+        assert(id != UINT32_MAX);
+        const int segment = segmentOf(id);
+        Entry *entries = mSegments[segment].load(std::memory_order_acquire);
+        if (!entries) {
+            Entry *created = new Entry[static_cast<size_t>(Base) << segment]();
+            if (mSegments[segment].compare_exchange_strong(entries, created, std::memory_order_acq_rel)) {
+                entries = created;
+            } else {
+                delete[] created;
+            }
+        }
+        entries[id - firstId(segment)] = entry;
+        return id;
+    }
+
+    uint32_t count() const { return mNext.load(std::memory_order_relaxed) - 1; }
+
+private:
+    enum { BaseBits = 10, Base = 1 << BaseBits, MaxSegments = 33 - BaseBits };
+
+    static int segmentOf(uint32_t id) { return 31 - __builtin_clz((id >> BaseBits) + 1); }
+    static uint64_t firstId(int segment) { return (static_cast<uint64_t>(Base) << segment) - Base; }
+
+    std::atomic<Entry*> mSegments[MaxSegments];
+    std::atomic<uint32_t> mNext;
+};
+
+enum { ShardCount = 16 };
+
+struct AtomEntry
+{
+    const char *data;
+    uint32_t size;
+};
+
+struct AtomShard
+{
+    AtomShard()
+        : block(0), left(0)
+    {}
+
+    // The strings are never freed, small ones are packed into blocks
+    const char *store(const StringView &string)
+    {
+        enum { BlockSize = 64 * 1024 };
+        const size_t size = string.size() + 1;
+        char *ret;
+        if (size > BlockSize / 16) {
+            ret = new char[size];
+        } else {
+            if (size > left) {
+                block = new char[BlockSize];
+                left = BlockSize;
+            }
+            ret = block;
+            block += size;
+            left -= size;
+        }
+        memcpy(ret, string.data(), string.size());
+        ret[string.size()] = '\0';
+        return ret;
+    }
+
+    std::mutex mutex;
+    FlatHash<StringView, uint32_t> ids;
+    char *block;
+    size_t left;
+};
+
+struct AtomTable
+{
+    Entries<AtomEntry> entries;
+    AtomShard shards[ShardCount];
+};
+
+struct PathEntry
+{
+    uint32_t parent, name, size;
+};
+
+struct PathShard
+{
+    std::mutex mutex;
+    FlatHash<uint64_t, uint32_t> ids;
+};
+
+struct PathTable
+{
+    Entries<PathEntry> entries;
+    PathShard shards[ShardCount];
+};
+
+// Never destroyed, atoms may be used by other statics' destructors
+AtomTable &atoms()
+{
+    static AtomTable *table = new AtomTable;
+    return *table;
+}
+
+PathTable &paths()
+{
+    static PathTable *table = new PathTable;
+    return *table;
+}
+
+AtomShard &atomShard(AtomTable &table, const StringView &string)
+{
+    return table.shards[std::hash<StringView>()(string) % ShardCount];
+}
+
+uint64_t pathKey(uint32_t parent, uint32_t name)
+{
+    return (static_cast<uint64_t>(parent) << 32) | name;
+}
+
+PathShard &pathShard(PathTable &table, uint64_t key)
+{
+    return table.shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+}
+
+// Calls visit with every name of path, see PathAtom, until it returns false
+template <typename Visit>
+bool visitNames(const StringView &path, Visit visit)
+{
+    int pos = 0;
+    while (pos < path.size()) {
+        const int slash = path.indexOf('/', pos);
+        const int end = slash == -1 ? path.size() : slash + 1;
+        if (!visit(path.mid(pos, end - pos)))
+            return false;
+        pos = end;
+    }
+    return true;
+}
+}
+
+uint32_t Atom::intern(const StringView &string)
+{
+    if (string.isEmpty())
+        return 0;
+    AtomTable &table = atoms();
+    AtomShard &shard = atomShard(table, string);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const FlatHash<StringView, uint32_t>::const_iterator it = shard.ids.find(string);
+    if (it != shard.ids.end())
+        return it->second;
+    const AtomEntry entry = { shard.store(string), static_cast<uint32_t>(string.size()) };
+    const uint32_t id = table.entries.add(entry);
+    shard.ids[StringView(entry.data, entry.size)] = id;
+    return id;
+}
+
+Atom Atom::find(const StringView &string)
+{
+    Atom ret;
+    if (!string.isEmpty()) {
+        AtomShard &shard = atomShard(atoms(), string);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ret.mId = shard.ids.value(string);
+    }
+    return ret;
+}
+
+StringView Atom::view() const
+{
+    if (!mId)
+        return StringView("", 0);
+    const AtomEntry &entry = atoms().entries.at(mId);
+    return StringView(entry.data, entry.size);
+}
+
+uint32_t Atom::count()
+{
+    return atoms().entries.count();
+}
+
+uint32_t PathAtom::intern(uint32_t parent, uint32_t name)
+{
+    if (!name)
+        return parent;
+    PathTable &table = paths();
+    const uint64_t key = pathKey(parent, name);
+    PathShard &shard = pathShard(table, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const FlatHash<uint64_t, uint32_t>::const_iterator it = shard.ids.find(key);
+    if (it != shard.ids.end())
+        return it->second;
+    const uint32_t size = (parent ? table.entries.at(parent).size : 0) + Atom::fromId(name).size();
+    const PathEntry entry = { parent, name, size };
+    const uint32_t id = table.entries.add(entry);
+    shard.ids[key] = id;
+    return id;
+}
+
+uint32_t PathAtom::intern(const StringView &path)
+{
+    uint32_t id = 0;
+    visitNames(path, [&id](const StringView &name) {
+            id = intern(id, Atom::intern(name));
+            return true;
+        });
+    return id;
+}
+
+PathAtom PathAtom::find(const StringView &path)
+{
+    PathTable &table = paths();
+    PathAtom ret;
+    const bool found = visitNames(path, [&](const StringView &name) {
+            const Atom atom = Atom::find(name);
+            if (atom.isNull())
+                return false;
+            const uint64_t key = pathKey(ret.mId, atom.mId);
+            PathShard &shard = pathShard(table, key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            ret.mId = shard.ids.value(key);
+            return ret.mId != 0;
+        });
+    if (!found)
+        ret.mId = 0;
+    return ret;
+}
+
+PathAtom PathAtom::parent() const
+{
+    PathAtom ret;
+    if (mId)
+        ret.mId = paths().entries.at(mId).parent;
+    return ret;
+}
+
+Atom PathAtom::fileName() const
+{
+    return mId ? Atom::fromId(paths().entries.at(mId).name) : Atom();
+}
+
+int PathAtom::size() const
+{
+    return mId ? paths().entries.at(mId).size : 0;
+}
+
+Path PathAtom::toPath() const
+{
+    Path ret;
+    if (!mId)
+        return ret;
+    const Entries<PathEntry> &entries = paths().entries;
+    ret.resize(entries.at(mId).size);
+    char *end = ret.data() + ret.size();
+    for (uint32_t id = mId; id; ) {
+        const PathEntry &entry = entries.at(id);
+        const StringView name = Atom::fromId(entry.name).view();
+        end -= name.size();
+        memcpy(end, name.data(), name.size());
+        id = entry.parent;
+    }
+    assert(end == ret.data());
+    return ret;
+}
+
+uint32_t PathAtom::count()
+{
+    return paths().entries.count();
+}
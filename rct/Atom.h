@@ -0,0 +1,121 @@
+#ifndef Atom_h
+#define Atom_h
+
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <functional>
+#include <stdint.h>
+
+// Interned string. Every distinct string is stored once, for the lifetime
+// of the process, and an Atom is its 32 bit id, so copying, comparing and
+// hashing atoms is doing it to an integer. Interning locks one of a number
+// of shards, getting the string of an atom locks nothing.
+//
+// The ids are only meaningful in the process that made them, atoms are
+// serialized as their strings.
+class Atom
+{
+public:
+    Atom() : mId(0) {}
+    explicit Atom(const StringView &string) : mId(intern(string)) {}
+
+    // The atom of string if it has been interned, the null atom otherwise
+    static Atom find(const StringView &string);
+
+    // The empty string is the null atom
+    bool isNull() const { return !mId; }
+    bool isEmpty() const { return !mId; }
+    uint32_t id() const { return mId; }
+
+    // Valid forever, and nul terminated
+    StringView view() const;
+    String toString() const { return view().toString(); }
+    int size() const { return view().size(); }
+
+    bool operator==(const Atom &other) const { return mId == other.mId; }
+    bool operator!=(const Atom &other) const { return mId != other.mId; }
+    // By id, which is the order the strings were interned in, not by content
+    bool operator<(const Atom &other) const { return mId < other.mId; }
+    bool operator>(const Atom &other) const { return mId > other.mId; }
+
+    // The number of distinct strings interned so far
+    static uint32_t count();
+
+private:
+    static uint32_t intern(const StringView &string);
+    static Atom fromId(uint32_t id)
+    {
+        Atom ret;
+        ret.mId = id;
+        return ret;
+    }
+
+    uint32_t mId;
+
+    friend class PathAtom;
+};
+
+// Interned Path. A path is a chain of (parent, name) pairs that are
+// interned like atoms, where a name is everything up to and including the
+// next slash, so "/usr/lib/libc.so" is "/", "usr/", "lib/" and "libc.so".
+// Paths that share a directory share its pairs, and a PathAtom is 32 bits
+// that compare like an Atom. toPath() gives back exactly the path that was
+// interned, redundant and trailing slashes included.
+class PathAtom
+{
+public:
+    PathAtom() : mId(0) {}
+    explicit PathAtom(const StringView &path) : mId(intern(path)) {}
+    PathAtom(const PathAtom &parent, const Atom &name) : mId(intern(parent.mId, name.mId)) {}
+
+    static PathAtom find(const StringView &path);
+
+    bool isNull() const { return !mId; }
+    bool isEmpty() const { return !mId; }
+    uint32_t id() const { return mId; }
+
+    // Everything before fileName(), which is Path::parentDir() unless the
+    // path ends with a slash
+    PathAtom parent() const;
+    Atom fileName() const;
+    // The length of toPath(), without building it
+    int size() const;
+
+    Path toPath() const;
+    String toString() const { return toPath(); }
+
+    bool operator==(const PathAtom &other) const { return mId == other.mId; }
+    bool operator!=(const PathAtom &other) const { return mId != other.mId; }
+    bool operator<(const PathAtom &other) const { return mId < other.mId; }
+    bool operator>(const PathAtom &other) const { return mId > other.mId; }
+
+    static uint32_t count();
+
+private:
+    static uint32_t intern(const StringView &path);
+    static uint32_t intern(uint32_t parent, uint32_t name);
+
+    uint32_t mId;
+};
+
+namespace std
+{
+template <> struct hash<Atom>
+{
+    typedef Atom argument_type;
+    typedef size_t result_type;
+
+    size_t operator()(const Atom &atom) const { return atom.id(); }
+};
+
+template <> struct hash<PathAtom>
+{
+    typedef PathAtom argument_type;
+    typedef size_t result_type;
+
+    size_t operator()(const PathAtom &path) const { return path.id(); }
+};
+}
+
+#endif
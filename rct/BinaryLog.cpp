@@ -0,0 +1,612 @@
+#include "BinaryLog.h"
+#include "FastHash.h"
+#include "Hash.h"
+#include "MappedFile.h"
+#include "Rct.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// File layout, everything 8 byte aligned:
+//
+// FileHeader
+// Record*, a record with size 0 ends the file
+//
+// Format records hold a uint32_t id and the null terminated format
+// string. Event records hold the id and the arguments the format says they
+// have: ints as int32_t or int64_t depending on their length modifier,
+// pointers as uint64_t, doubles and long doubles as themselves, strings as
+// a uint32_t length and the bytes. Text records hold the message. An
+// event can come before the definition of its format.
+namespace {
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+};
+
+struct Record
+{
+    uint32_t size;
+    uint8_t type;
+    int8_t level;
+    uint16_t reserved;
+    uint64_t time;
+};
+
+enum RecordType {
+    FormatRecord = 1,
+    EventRecord = 2,
+    TextRecord = 3
+};
+
+enum ArgType {
+    Int32,
+    Int64,
+    Pointer,
+    Double,
+    LongDouble,
+    CString
+};
+
+enum { Align = 8 };
+}
+
+static const char sMagic[8] = { 'R', 'C', 'T', 'B', 'L', 'O', 'G', '\0' };
+
+static inline uint32_t aligned(uint32_t size)
+{
+    return (size + Align - 1) & ~static_cast<uint32_t>(Align - 1);
+}
+
+// The argument types of a printf format, -1 for what can't be stored raw
+// like %n, %ls or too many arguments
+static int parseFormat(const char *format, unsigned char *types, int max)
+{
+    int count = 0;
+    for (const char *ch = format; *ch; ++ch) {
+        if (*ch != '%')
+            continue;
+        if (*++ch == '%')
+            continue;
+        while (*ch && strchr("-+ #0'", *ch))
+            ++ch;
+        if (*ch == '*') {
+            if (count == max)
+                return -1;
+            types[count++] = Int32;
+            ++ch;
+        }
+        while (*ch >= '0' && *ch <= '9')
+            ++ch;
+        if (*ch == '.') {
+            ++ch;
+            if (*ch == '*') {
+                if (count == max)
+                    return -1;
+                types[count++] = Int32;
+                ++ch;
+            }
+            while (*ch >= '0' && *ch <= '9')
+                ++ch;
+        }
+        int size = sizeof(int);
+        bool isLongDouble = false;
+        switch (*ch) {
+        case 'h':
+            ++ch;
+            if (*ch == 'h')
+                ++ch;
+            break;
+        case 'l':
+            ++ch;
+            size = sizeof(long);
+            if (*ch == 'l') {
+                ++ch;
+                size = sizeof(long long);
+            }
+            break;
+        case 'q':
+            ++ch;
+            size = sizeof(long long);
+            break;
+        case 'j':
+            ++ch;
+            size = sizeof(intmax_t);
+            break;
+        case 'z':
+            ++ch;
+            size = sizeof(size_t);
+            break;
+        case 't':
+            ++ch;
+            size = sizeof(ptrdiff_t);
+            break;
+        case 'L':
+            ++ch;
+            isLongDouble = true;
+            break;
+        }
+        if (count == max)
+            return -1;
+        switch (*ch) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            types[count++] = size == 8 ? Int64 : Int32;
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            types[count++] = isLongDouble ? LongDouble : Double;
+            break;
+        case 's':
+            if (size != sizeof(int))
+                return -1;
+            types[count++] = CString;
+            break;
+        case 'p':
+            types[count++] = Pointer;
+            break;
+        default:
+            return -1;
+        }
+        if (!*ch)
+            break;
+    }
+    return count;
+}
+
+static inline uint64_t now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+BinaryLogOutput::BinaryLogOutput(LogLevel level, size_t maxSize)
+    : LogOutput(level), mMaxSize(maxSize), mData(0), mWriters(0), mFd(-1), mOffset(0), mDropped(0),
+      mSlots(new Slot[FormatSlots])
+{
+    for (int i = 0; i < FormatSlots; ++i) {
+        mSlots[i].format = 0;
+        mSlots[i].argCount = -1;
+    }
+}
+
+BinaryLogOutput::~BinaryLogOutput()
+{
+    close();
+    clearSlots();
+    delete[] mSlots;
+}
+
+BinaryLogOutput::Writer::Writer(BinaryLogOutput *o)
+    : output(o)
+{
+    // close() clears mData before it waits for mWriters, one of the two
+    // of us sees the other
+    ++output->mWriters;
+    data = output->mData.load();
+}
+
+BinaryLogOutput::Writer::~Writer()
+{
+    --output->mWriters;
+}
+
+void BinaryLogOutput::clearSlots()
+{
+    for (int i = 0; i < FormatSlots; ++i) {
+        free(mSlots[i].format.exchange(0));
+        mSlots[i].argCount = -1;
+    }
+}
+
+bool BinaryLogOutput::open(const Path &path)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mData)
+        return false;
+    int fd;
+    eintrwrap(fd, ::open(path.constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd == -1)
+        return false;
+    // sparse, the blocks are only allocated as they're written
+    if (ftruncate(fd, mMaxSize) == -1) {
+        ::close(fd);
+        return false;
+    }
+    void *data = mmap(0, mMaxSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    mFd = fd;
+    FileHeader *header = static_cast<FileHeader *>(data);
+    memcpy(header->magic, sMagic, sizeof(sMagic));
+    header->version = 1;
+    header->headerSize = sizeof(FileHeader);
+    // nobody writes while mData is 0
+    clearSlots();
+    mOffset = aligned(sizeof(FileHeader));
+    mData = static_cast<char *>(data);
+    return true;
+}
+
+void BinaryLogOutput::close()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    char *data = mData.exchange(0);
+    if (!data)
+        return;
+    // writers are short, wait for the ones that got the mapping
+    while (mWriters.load())
+        sched_yield();
+    const uint64_t used = std::min<uint64_t>(mOffset, mMaxSize);
+    munmap(data, mMaxSize);
+    // leave room for the terminating empty record
+    if (ftruncate(mFd, std::min<uint64_t>(used + sizeof(Record), mMaxSize)) == -1)
+        error() << "BinaryLogOutput couldn't truncate" << Rct::strerror();
+    ::close(mFd);
+    mFd = -1;
+}
+
+uint64_t BinaryLogOutput::size() const
+{
+    return std::min<uint64_t>(mOffset, mMaxSize);
+}
+
+char *BinaryLogOutput::reserve(char *data, uint32_t size, int type, LogLevel level)
+{
+    const uint32_t total = aligned(sizeof(Record) + size);
+    const uint64_t offset = mOffset.fetch_add(total);
+    // keep a record's worth of zeroes at the end so there's always an end
+    if (offset + total + sizeof(Record) > mMaxSize) {
+        ++mDropped;
+        return 0;
+    }
+    Record *record = reinterpret_cast<Record *>(data + offset);
+    record->type = type;
+    record->level = static_cast<int8_t>(std::min(static_cast<int>(level), 127));
+    record->reserved = 0;
+    record->time = now();
+    // the size is set by commit() once the payload is written
+    return reinterpret_cast<char *>(record + 1);
+}
+
+static inline void commit(char *payload, uint32_t size)
+{
+    Record *record = reinterpret_cast<Record *>(payload) - 1;
+    __atomic_store_n(&record->size, aligned(sizeof(Record) + size), __ATOMIC_RELEASE);
+}
+
+int BinaryLogOutput::formatId(char *data, const char *format, unsigned char *types, int &argCount)
+{
+    // by content, the same format from two places is one id and a string
+    // that was unloaded can't be mistaken for another one at its address
+    const size_t length = strlen(format);
+    const uint64_t hash = FastHash::hash(format, length);
+    for (int i = 0; i < FormatSlots; ++i) {
+        const int idx = static_cast<int>((hash >> 20) + i) & (FormatSlots - 1);
+        Slot &slot = mSlots[idx];
+        char *existing = slot.format.load(std::memory_order_acquire);
+        if (!existing) {
+            char *copy = strdup(format);
+            if (slot.format.compare_exchange_strong(existing, copy)) {
+                argCount = parseFormat(format, slot.types, MaxArgs);
+                memcpy(types, slot.types, MaxArgs);
+                if (argCount >= 0) {
+                    const uint32_t len = length + 1;
+                    if (char *payload = reserve(data, sizeof(uint32_t) + len, FormatRecord, LogLevel::None)) {
+                        const uint32_t id = idx;
+                        memcpy(payload, &id, sizeof(id));
+                        memcpy(payload + sizeof(id), format, len);
+                        commit(payload, sizeof(uint32_t) + len);
+                    }
+                }
+                slot.argCount.store(argCount == -1 ? -2 : argCount, std::memory_order_release);
+                return idx;
+            }
+            // someone else took it, existing is theirs now
+            free(copy);
+        }
+        if (!strcmp(existing, format)) {
+            argCount = slot.argCount.load(std::memory_order_acquire);
+            if (argCount == -1) {
+                // the thread that took the slot is still parsing it
+                argCount = parseFormat(format, types, MaxArgs);
+            } else if (argCount >= 0) {
+                memcpy(types, slot.types, MaxArgs);
+            } else {
+                argCount = -1;
+            }
+            return idx;
+        }
+    }
+    argCount = -1;
+    return -1;
+}
+
+void BinaryLogOutput::writeText(char *data, const char *msg, int len)
+{
+    if (char *payload = reserve(data, len, TextRecord, LogLevel::None)) {
+        memcpy(payload, msg, len);
+        commit(payload, len);
+    }
+}
+
+void BinaryLogOutput::log(Flags<LogFlag>, const char *msg, int len)
+{
+    const Writer writer(this);
+    if (writer.data)
+        writeText(writer.data, msg, len);
+}
+
+void BinaryLogOutput::logFormat(LogLevel level, const char *format, va_list args)
+{
+    const Writer writer(this);
+    if (!writer.data)
+        return;
+    unsigned char types[MaxArgs];
+    int argCount;
+    const int id = formatId(writer.data, format, types, argCount);
+    if (argCount < 0) {
+        // nothing we can store as is, format it like everyone else
+        const String msg = String::format<1024>(format, args);
+        writeText(writer.data, msg.constData(), msg.size());
+        return;
+    }
+
+    // strings need their lengths before anything is reserved
+    uint32_t size = sizeof(uint32_t);
+    uint32_t lengths[MaxArgs];
+    {
+        va_list copy;
+        va_copy(copy, args);
+        for (int i = 0; i < argCount; ++i) {
+            switch (types[i]) {
+            case Int32: (void)va_arg(copy, int); size += sizeof(int32_t); break;
+            case Int64: (void)va_arg(copy, long long); size += sizeof(int64_t); break;
+            case Pointer: (void)va_arg(copy, void *); size += sizeof(uint64_t); break;
+            case Double: (void)va_arg(copy, double); size += sizeof(double); break;
+            case LongDouble: (void)va_arg(copy, long double); size += sizeof(long double); break;
+            case CString: {
+                const char *str = va_arg(copy, const char *);
+                lengths[i] = str ? strlen(str) : 0;
+                size += sizeof(uint32_t) + lengths[i];
+                break; }
+            }
+        }
+        va_end(copy);
+    }
+
+    char *payload = reserve(writer.data, size, EventRecord, level);
+    if (!payload)
+        return;
+    char *pos = payload;
+    const uint32_t formatId = id;
+    memcpy(pos, &formatId, sizeof(formatId));
+    pos += sizeof(formatId);
+    for (int i = 0; i < argCount; ++i) {
+        switch (types[i]) {
+        case Int32: {
+            const int32_t value = va_arg(args, int);
+            memcpy(pos, &value, sizeof(value));
+            pos += sizeof(value);
+            break; }
+        case Int64: {
+            const int64_t value = va_arg(args, long long);
+            memcpy(pos, &value, sizeof(value));
+            pos += sizeof(value);
+            break; }
+        case Pointer: {
+            const uint64_t value = reinterpret_cast<uintptr_t>(va_arg(args, void *));
+            memcpy(pos, &value, sizeof(value));
+            pos += sizeof(value);
+            break; }
+        case Double: {
+            const double value = va_arg(args, double);
+            memcpy(pos, &value, sizeof(value));
+            pos += sizeof(value);
+            break; }
+        case LongDouble: {
+            const long double value = va_arg(args, long double);
+            memcpy(pos, &value, sizeof(value));
+            pos += sizeof(value);
+            break; }
+        case CString: {
+            const char *str = va_arg(args, const char *);
+            memcpy(pos, &lengths[i], sizeof(uint32_t));
+            pos += sizeof(uint32_t);
+            if (lengths[i])
+                memcpy(pos, str, lengths[i]);
+            pos += lengths[i];
+            break; }
+        }
+    }
+    commit(payload, size);
+}
+
+// decoding
+
+template <typename T>
+static void appendArg(String &out, const String &spec, const int *stars, int starCount, T value)
+{
+    char buf[1024];
+    int n;
+    switch (starCount) {
+    case 0: n = snprintf(buf, sizeof(buf), spec.constData(), value); break;
+    case 1: n = snprintf(buf, sizeof(buf), spec.constData(), stars[0], value); break;
+    default: n = snprintf(buf, sizeof(buf), spec.constData(), stars[0], stars[1], value); break;
+    }
+    if (n > 0)
+        out.append(buf, std::min<int>(n, sizeof(buf) - 1));
+}
+
+template <typename T>
+static bool take(const char *&pos, const char *end, T &value)
+{
+    if (pos + sizeof(T) > end)
+        return false;
+    memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+static String formatEvent(const char *format, const char *pos, const char *end)
+{
+    unsigned char types[BinaryLogOutput::MaxArgs];
+    const int count = parseFormat(format, types, BinaryLogOutput::MaxArgs);
+    String out;
+    int arg = 0;
+    for (const char *ch = format; *ch; ) {
+        if (*ch != '%') {
+            const char *start = ch;
+            while (*ch && *ch != '%')
+                ++ch;
+            out.append(start, ch - start);
+            continue;
+        }
+        if (ch[1] == '%') {
+            out += '%';
+            ch += 2;
+            continue;
+        }
+        // one conversion at a time, with the stars it needs
+        const char *start = ch++;
+        int stars[2];
+        int starCount = 0;
+        while (*ch && !strchr("diuxXoceEfFgGaAspn", *ch)) {
+            if (*ch == '*' && starCount < 2 && arg < count) {
+                int32_t value = 0;
+                take(pos, end, value);
+                stars[starCount++] = value;
+                ++arg;
+            }
+            ++ch;
+        }
+        if (!*ch || arg >= count)
+            break;
+        const String spec(start, ch - start + 1);
+        ++ch;
+        switch (types[arg++]) {
+        case Int32: {
+            int32_t value = 0;
+            take(pos, end, value);
+            appendArg(out, spec, stars, starCount, value);
+            break; }
+        case Int64: {
+            int64_t value = 0;
+            take(pos, end, value);
+            appendArg(out, spec, stars, starCount, static_cast<long long>(value));
+            break; }
+        case Pointer: {
+            uint64_t value = 0;
+            take(pos, end, value);
+            appendArg(out, spec, stars, starCount, reinterpret_cast<void *>(static_cast<uintptr_t>(value)));
+            break; }
+        case Double: {
+            double value = 0;
+            take(pos, end, value);
+            appendArg(out, spec, stars, starCount, value);
+            break; }
+        case LongDouble: {
+            long double value = 0;
+            take(pos, end, value);
+            appendArg(out, spec, stars, starCount, value);
+            break; }
+        case CString: {
+            uint32_t len = 0;
+            take(pos, end, len);
+            const String str(pos, std::min<uint32_t>(len, end - pos));
+            pos += str.size();
+            appendArg(out, spec, stars, starCount, str.constData());
+            break; }
+        }
+    }
+    return out;
+}
+
+static const char *levelName(int level)
+{
+    switch (level) {
+    case static_cast<int>(LogLevel::Error): return "error";
+    case static_cast<int>(LogLevel::Warning): return "warning";
+    case static_cast<int>(LogLevel::Debug): return "debug";
+    case static_cast<int>(LogLevel::VerboseDebug): return "verbose";
+    }
+    return 0;
+}
+
+bool BinaryLogOutput::decode(const Path &path, FILE *out)
+{
+    const MappedFile contents(path);
+    if (contents.size() < sizeof(FileHeader)
+        || memcmp(contents.data(), sMagic, sizeof(sMagic))) {
+        return false;
+    }
+    const FileHeader *header = reinterpret_cast<const FileHeader *>(contents.data());
+    if (header->version != 1)
+        return false;
+    const char *begin = contents.data() + aligned(header->headerSize);
+    const char *end = contents.data() + contents.size();
+
+    Hash<uint32_t, const char *> formats;
+    for (int pass = 0; pass < 2; ++pass) {
+        const char *pos = begin;
+        while (pos + sizeof(Record) <= end) {
+            Record record;
+            memcpy(&record, pos, sizeof(Record));
+            if (record.size < sizeof(Record) || pos + record.size > end)
+                break;
+            const char *payload = pos + sizeof(Record);
+            const char *payloadEnd = pos + record.size;
+            pos += record.size;
+            if (record.type == FormatRecord) {
+                uint32_t id;
+                if (!pass && take(payload, payloadEnd, id))
+                    formats[id] = payload;
+                continue;
+            }
+            if (!pass)
+                continue;
+
+            const time_t secs = record.time / 1000000000ull;
+            struct tm tm;
+            localtime_r(&secs, &tm);
+            char stamp[64];
+            const size_t w = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            snprintf(stamp + w, sizeof(stamp) - w, ".%06u", static_cast<unsigned>((record.time % 1000000000ull) / 1000));
+
+            String msg;
+            if (record.type == TextRecord) {
+                msg.assign(payload, payloadEnd - payload);
+                while (msg.endsWith('\0'))
+                    msg.chop(1);
+            } else if (record.type == EventRecord) {
+                uint32_t id;
+                if (!take(payload, payloadEnd, id))
+                    continue;
+                const char *format = formats.value(id);
+                if (!format) {
+                    msg = String::format<64>("<unknown format %u>", id);
+                } else {
+                    msg = formatEvent(format, payload, payloadEnd);
+                }
+            } else {
+                continue;
+            }
+            if (const char *name = levelName(record.level)) {
+                fprintf(out, "%s %s: %s\n", stamp, name, msg.constData());
+            } else {
+                fprintf(out, "%s %s\n", stamp, msg.constData());
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef BinaryLog_h
+#define BinaryLog_h
+
+#include <rct/Log.h>
+#include <rct/Path.h>
+#include <atomic>
+#include <mutex>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A LogOutput that writes events to a memory mapped file without
+// formatting them. printf style calls like error("%s: %d", name, count)
+// record the id of the format string, a timestamp and the raw arguments.
+// Stream style ones have already been formatted and are stored as text.
+// rct-logdecode, or BinaryLogOutput::decode(), turns a file back into
+// text.
+//
+// The file is in the byte order and type sizes of the machine that wrote
+// it.
+class BinaryLogOutput : public LogOutput
+{
+public:
+    // maxSize bytes of address space are mapped at open(). The file
+    // only takes up what's been written and is cut down to that when it's
+    // closed. Events that don't fit are dropped.
+    BinaryLogOutput(LogLevel level = LogLevel::Max, size_t maxSize = 256 * 1024 * 1024);
+    virtual ~BinaryLogOutput();
+
+    bool open(const Path &path);
+    void close();
+    bool isOpen() const { return mData.load(); }
+
+    uint64_t size() const;
+    uint64_t dropped() const { return mDropped; }
+
+    virtual void log(Flags<LogFlag> flags, const char *msg, int len) override;
+    virtual bool supportsFormat() const override { return true; }
+    virtual void logFormat(LogLevel level, const char *format, va_list args) override;
+
+    // writes the events of a file as text, one per line
+    static bool decode(const Path &path, FILE *out);
+
+    enum {
+        MaxArgs = 16,
+        FormatSlots = 4096
+    };
+private:
+    struct Slot
+    {
+        // a copy, format strings are looked up by what they say
+        std::atomic<char *> format;
+        std::atomic<int> argCount;
+        unsigned char types[MaxArgs];
+    };
+
+    // Holds off close() from unmapping the file while it's written to,
+    // data is 0 when it isn't open
+    struct Writer
+    {
+        Writer(BinaryLogOutput *output);
+        ~Writer();
+
+        BinaryLogOutput *output;
+        char *data;
+    };
+
+    char *reserve(char *data, uint32_t size, int type, LogLevel level);
+    int formatId(char *data, const char *format, unsigned char *types, int &argCount);
+    void writeText(char *data, const char *msg, int len);
+    void clearSlots();
+
+    std::mutex mMutex;
+    const size_t mMaxSize;
+    std::atomic<char *> mData;
+    std::atomic<int> mWriters;
+    int mFd;
+    std::atomic<uint64_t> mOffset, mDropped;
+    Slot *mSlots;
+
+    BinaryLogOutput(const BinaryLogOutput &) = delete;
+    BinaryLogOutput &operator=(const BinaryLogOutput &) = delete;
+};
+
+#endif
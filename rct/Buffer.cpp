@@ -1,5 +1,89 @@
 #include "Buffer.h"
+#include "ThreadLocal.h"
 #include <stdio.h>
+#include <vector>
+
+namespace {
+enum { MinShift = 12, SlabClasses = 7 };
+static_assert((BufferPool::MinSlab << (SlabClasses - 1)) == BufferPool::MaxSlab, "slab classes don't add up");
+
+struct Slabs
+{
+    Slabs() : bytes(0) {}
+    ~Slabs() { trim(); }
+
+    void trim()
+    {
+        for (int i = 0; i < SlabClasses; ++i) {
+            for (unsigned char *data : lists[i]) {
+                Allocations::freed(Allocations::Buffers, BufferPool::MinSlab << i);
+                ::free(data);
+            }
+            lists[i].clear();
+        }
+        bytes = 0;
+    }
+
+    std::vector<unsigned char *> lists[SlabClasses];
+    unsigned int bytes;
+};
+
+int slabClass(unsigned int size)
+{
+    int index = 0;
+    while ((static_cast<unsigned int>(BufferPool::MinSlab) << index) < size)
+        ++index;
+    return index;
+}
+}
+
+void BufferPool::take(Buffer &buffer, unsigned int size)
+{
+    assert(!buffer.bufferData);
+    if (size > MaxSlab) {
+        buffer.reserve(size);
+        return;
+    }
+    const int index = slabClass(size);
+    const unsigned int slab = MinSlab << index;
+    if (StaticThreadLocal<Slabs>::isDestroyed()) {
+        // the thread is exiting and its slabs are gone
+        buffer.reserve(slab);
+        return;
+    }
+    Slabs &slabs = StaticThreadLocal<Slabs>::local();
+    if (!slabs.lists[index].empty()) {
+        buffer.bufferData = slabs.lists[index].back();
+        slabs.lists[index].pop_back();
+        slabs.bytes -= slab;
+    } else {
+        buffer.bufferData = static_cast<unsigned char *>(malloc(slab));
+        if (!buffer.bufferData)
+            abort();
+        Allocations::allocated(Allocations::Buffers, slab);
+    }
+    buffer.bufferSize = 0;
+    buffer.bufferReserved = slab;
+}
+
+bool BufferPool::recycle(unsigned char *data, unsigned int capacity)
+{
+    if (capacity < MinSlab || capacity > MaxSlab || (capacity & (capacity - 1)))
+        return false;
+    // only threads that take slabs keep them, and not once they're exiting
+    Slabs *slabs = StaticThreadLocal<Slabs>::get();
+    if (!slabs || slabs->bytes + capacity > MaxCachedBytes)
+        return false;
+    slabs->lists[slabClass(capacity)].push_back(data);
+    slabs->bytes += capacity;
+    return true;
+}
+
+void BufferPool::trim()
+{
+    if (Slabs *slabs = StaticThreadLocal<Slabs>::get())
+        slabs->trim();
+}
 
 bool Buffer::load(const String& filename)
 {
@@ -3,8 +3,28 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <rct/Metrics.h>
 #include <rct/String.h>
 
+class Buffer;
+
+// Receive slabs of a few power of two sizes, kept per thread, so that a
+// socket that reads all the time gets the memory of the Buffers its
+// earlier reads were handed out in back once they're gone rather than
+// starting from nothing every time.
+class BufferPool
+{
+public:
+    enum { MinSlab = 4096, MaxSlab = 256 * 1024, MaxCachedBytes = 1024 * 1024 };
+
+    // Gives a Buffer that has no memory a slab of at least size bytes
+    static void take(Buffer &buffer, unsigned int size);
+    // For Buffer, false if data wasn't kept and should be freed
+    static bool recycle(unsigned char *data, unsigned int capacity);
+    // Frees what the calling thread has kept
+    static void trim();
+};
+
 class Buffer
 {
 public:
@@ -23,12 +43,14 @@ public:
     }
     ~Buffer()
     {
-        if (bufferData)
-            free(bufferData);
+        release();
     }
 
     Buffer& operator=(Buffer&& other)
     {
+        if (this == &other)
+            return *this;
+        release();
         bufferData = other.bufferData;
         bufferSize = other.bufferSize;
         bufferReserved = other.bufferReserved;
@@ -44,7 +66,7 @@ public:
     {
         enum { ClearThreshold = 1024 * 512 };
         if (bufferSize >= ClearThreshold) {
-            free(bufferData);
+            release();
             bufferData = 0;
             bufferReserved = 0;
         }
@@ -58,6 +80,7 @@ public:
         bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
         if (!bufferData)
             abort();
+        Allocations::reallocated(Allocations::Buffers, bufferReserved, sz);
         bufferReserved = sz;
     }
 
@@ -74,6 +97,7 @@ public:
         bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
         if (!bufferData)
             abort();
+        Allocations::reallocated(Allocations::Buffers, bufferReserved, sz);
         bufferSize = bufferReserved = sz;
     }
 
@@ -87,9 +111,19 @@ public:
     bool load(const String& filename);
 
 private:
+    void release()
+    {
+        if (bufferData && !BufferPool::recycle(bufferData, bufferReserved)) {
+            Allocations::freed(Allocations::Buffers, bufferReserved);
+            free(bufferData);
+        }
+    }
+
     unsigned char* bufferData;
     unsigned int bufferSize, bufferReserved;
 
+    friend class BufferPool;
+
 private:
     Buffer(const Buffer& other) = delete;
     Buffer& operator=(const Buffer& other) = delete;
@@ -0,0 +1,403 @@
+#include "Compressor.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+#include <assert.h>
+#include <limits.h>
+#include <mutex>
+#include <string.h>
+#include <vector>
+#ifdef RCT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef RCT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+class CompressorPrivate
+{
+public:
+    CompressorPrivate(int l)
+        : level(l)
+#ifdef RCT_HAVE_ZLIB
+        , deflateReady(false), inflateReady(false)
+#endif
+#ifdef RCT_HAVE_ZSTD
+        , cctx(0), dctx(0)
+#endif
+    {
+#ifdef RCT_HAVE_ZLIB
+        memset(&deflater, 0, sizeof(deflater));
+        memset(&inflater, 0, sizeof(inflater));
+#endif
+    }
+
+    ~CompressorPrivate()
+    {
+#ifdef RCT_HAVE_ZLIB
+        if (deflateReady)
+            deflateEnd(&deflater);
+        if (inflateReady)
+            inflateEnd(&inflater);
+#endif
+#ifdef RCT_HAVE_ZSTD
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+#endif
+    }
+
+    int level;
+#ifdef RCT_HAVE_ZLIB
+    z_stream deflater, inflater;
+    bool deflateReady, inflateReady;
+#endif
+#ifdef RCT_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+#endif
+};
+
+Compressor::Compressor(int level)
+    : priv(new CompressorPrivate(level))
+{
+}
+
+Compressor::~Compressor()
+{
+    delete priv;
+}
+
+bool Compressor::isSupported(Codec codec)
+{
+    switch (codec) {
+    case Zlib:
+#ifdef RCT_HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case Zstd:
+#ifdef RCT_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+bool Compressor::compress(Codec codec, const char *data, int size, String &out)
+{
+    out.clear();
+    if (!size)
+        return true;
+    switch (codec) {
+    case Zlib: {
+#ifdef RCT_HAVE_ZLIB
+        z_stream &stream = priv->deflater;
+        if (!priv->deflateReady) {
+            if (deflateInit(&stream, priv->level == -1 ? Z_DEFAULT_COMPRESSION : priv->level) != Z_OK)
+                return false;
+            priv->deflateReady = true;
+        } else if (deflateReset(&stream) != Z_OK) {
+            return false;
+        }
+        // compress straight into out, deflateBound() is always enough
+        out.resize(deflateBound(&stream, size));
+        stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data));
+        stream.avail_in = size;
+        stream.next_out = reinterpret_cast<Bytef *>(out.data());
+        stream.avail_out = out.size();
+        if (::deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            out.clear();
+            return false;
+        }
+        out.resize(stream.total_out);
+        return true;
+#else
+        break;
+#endif
+    }
+    case Zstd: {
+#ifdef RCT_HAVE_ZSTD
+        if (!priv->cctx && !(priv->cctx = ZSTD_createCCtx()))
+            return false;
+        out.resize(ZSTD_compressBound(size));
+        const size_t ret = ZSTD_compressCCtx(priv->cctx, out.data(), out.size(), data, size,
+                                             priv->level == -1 ? 0 : priv->level); // 0 is zstd's default
+        if (ZSTD_isError(ret)) {
+            out.clear();
+            return false;
+        }
+        out.resize(ret);
+        return true;
+#else
+        break;
+#endif
+    }
+    }
+    (void)data;
+    return false;
+}
+
+bool Compressor::uncompress(Codec codec, const char *data, int size, String &out)
+{
+    out.clear();
+    if (!size)
+        return true;
+    switch (codec) {
+    case Zlib: {
+#ifdef RCT_HAVE_ZLIB
+        z_stream &stream = priv->inflater;
+        if (!priv->inflateReady) {
+            if (inflateInit(&stream) != Z_OK)
+                return false;
+            priv->inflateReady = true;
+        } else if (inflateReset(&stream) != Z_OK) {
+            return false;
+        }
+        stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data));
+        stream.avail_in = size;
+        out.resize(size * 3);
+        for (;;) {
+            stream.next_out = reinterpret_cast<Bytef *>(out.data() + stream.total_out);
+            stream.avail_out = out.size() - stream.total_out;
+            const int error = ::inflate(&stream, Z_SYNC_FLUSH);
+            if (error == Z_STREAM_END)
+                break;
+            if (error != Z_OK || (!stream.avail_in && stream.avail_out)) {
+                // bad or truncated
+                out.clear();
+                return false;
+            }
+            out.resize(out.size() * 2);
+        }
+        out.resize(stream.total_out);
+        return true;
+#else
+        break;
+#endif
+    }
+    case Zstd: {
+#ifdef RCT_HAVE_ZSTD
+        if (!priv->dctx && !(priv->dctx = ZSTD_createDCtx()))
+            return false;
+        const unsigned long long contentSize = ZSTD_getFrameContentSize(data, size);
+        if (contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+            // compress() always records the size
+            return false;
+        }
+        out.resize(contentSize);
+        const size_t ret = ZSTD_decompressDCtx(priv->dctx, out.data(), out.size(), data, size);
+        if (ZSTD_isError(ret) || ret != contentSize) {
+            out.clear();
+            return false;
+        }
+        return true;
+#else
+        break;
+#endif
+    }
+    }
+    (void)data;
+    return false;
+}
+
+// compressChunked() writes a ChunkedHeader, count ChunkEntries and then the
+// frames one after the other
+static const char sChunkedMagic[4] = { 'R', 'C', 'T', 'Z' };
+
+struct ChunkedHeader
+{
+    char magic[4];
+    uint32_t codec;
+    uint32_t count;
+    // the uncompressed size of every chunk but the last
+    uint32_t chunkSize;
+};
+
+struct ChunkEntry
+{
+    uint32_t compressed, uncompressed;
+    // of the compressed frame
+    uint64_t checksum;
+};
+
+// Compressors for the threads working on one call, a thread takes one for
+// a chunk and puts it back after
+class CompressorList
+{
+public:
+    CompressorList(int level)
+        : mLevel(level)
+    {}
+    ~CompressorList()
+    {
+        for (Compressor *compressor : mCompressors)
+            delete compressor;
+    }
+
+    Compressor *take()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mCompressors.empty())
+            return new Compressor(mLevel);
+        Compressor *ret = mCompressors.back();
+        mCompressors.pop_back();
+        return ret;
+    }
+
+    void put(Compressor *compressor)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCompressors.push_back(compressor);
+    }
+
+private:
+    const int mLevel;
+    std::mutex mMutex;
+    std::vector<Compressor *> mCompressors;
+};
+
+// Whether a frame of compressed bytes can hold uncompressed ones, so an
+// index that's been made up can't have out sized past what the data holds
+static bool fits(Compressor::Codec codec, const char *frame, uint32_t compressed, uint32_t uncompressed)
+{
+    switch (codec) {
+    case Compressor::Zlib:
+        // deflate doesn't get past 1032:1
+        return uncompressed <= static_cast<uint64_t>(compressed) * 1032;
+    case Compressor::Zstd:
+#ifdef RCT_HAVE_ZSTD
+        // compress() records the size in the frame
+        return ZSTD_getFrameContentSize(frame, compressed) == uncompressed;
+#else
+        break;
+#endif
+    }
+    (void)frame;
+    return false;
+}
+
+bool Compressor::isChunked(const char *data, int size)
+{
+    return size >= static_cast<int>(sizeof(ChunkedHeader)) && !memcmp(data, sChunkedMagic, sizeof(sChunkedMagic));
+}
+
+bool Compressor::compressChunked(Codec codec, const char *data, int size, String &out, int level, int chunkSize,
+                                 ThreadPool *pool)
+{
+    out.clear();
+    if (!isSupported(codec) || size < 0)
+        return false;
+    if (chunkSize <= 0)
+        chunkSize = DefaultChunkSize;
+    if (!pool)
+        pool = ThreadPool::instance();
+    const int count = size ? ((size - 1) / chunkSize) + 1 : 0;
+    std::vector<String> frames(count);
+    std::vector<char> ok(count, 0);
+    CompressorList compressors(level);
+    pool->parallelRun(count, [&](int chunk) {
+            const int offset = chunk * chunkSize;
+            Compressor *compressor = compressors.take();
+            ok[chunk] = compressor->compress(codec, data + offset, std::min(chunkSize, size - offset), frames[chunk]);
+            compressors.put(compressor);
+        });
+
+    const size_t tableSize = sizeof(ChunkedHeader) + (count * sizeof(ChunkEntry));
+    size_t total = tableSize;
+    for (int i = 0; i < count; ++i) {
+        if (!ok[i])
+            return false;
+        total += frames[i].size();
+    }
+    if (total > INT_MAX)
+        return false;
+    out.resize(total);
+    char *pos = out.data();
+    ChunkedHeader header;
+    memcpy(header.magic, sChunkedMagic, sizeof(sChunkedMagic));
+    header.codec = codec;
+    header.count = count;
+    header.chunkSize = chunkSize;
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
+    char *frame = out.data() + tableSize;
+    for (int i = 0; i < count; ++i) {
+        const ChunkEntry entry = {
+            static_cast<uint32_t>(frames[i].size()),
+            static_cast<uint32_t>(std::min(chunkSize, size - (i * chunkSize))),
+            Rct::checksum(frames[i].constData(), frames[i].size())
+        };
+        memcpy(pos, &entry, sizeof(entry));
+        pos += sizeof(entry);
+        memcpy(frame, frames[i].constData(), frames[i].size());
+        frame += frames[i].size();
+    }
+    return true;
+}
+
+bool Compressor::uncompressChunked(const char *data, int size, String &out, ThreadPool *pool)
+{
+    out.clear();
+    if (!isChunked(data, size))
+        return false;
+    ChunkedHeader header;
+    memcpy(&header, data, sizeof(header));
+    const Codec codec = static_cast<Codec>(header.codec);
+    if (!isSupported(codec) || header.count > (size - sizeof(header)) / sizeof(ChunkEntry))
+        return false;
+    const int count = header.count;
+    const char *table = data + sizeof(header);
+    std::vector<ChunkEntry> entries(count);
+    // where each frame starts in data and its contents in out
+    std::vector<size_t> frameOffsets(count), outOffsets(count);
+    size_t frameOffset = sizeof(header) + (count * sizeof(ChunkEntry));
+    size_t outOffset = 0;
+    for (int i = 0; i < count; ++i) {
+        memcpy(&entries[i], table + (i * sizeof(ChunkEntry)), sizeof(ChunkEntry));
+        // all chunks but the last are chunkSize
+        const uint32_t uncompressed = entries[i].uncompressed;
+        if (!uncompressed || uncompressed > header.chunkSize || (i + 1 < count && uncompressed != header.chunkSize))
+            return false;
+        frameOffsets[i] = frameOffset;
+        outOffsets[i] = outOffset;
+        frameOffset += entries[i].compressed;
+        outOffset += uncompressed;
+        if (frameOffset > static_cast<size_t>(size) || outOffset > INT_MAX)
+            return false;
+    }
+    if (frameOffset != static_cast<size_t>(size))
+        return false;
+    for (int i = 0; i < count; ++i) {
+        if (!fits(codec, data + frameOffsets[i], entries[i].compressed, entries[i].uncompressed))
+            return false;
+    }
+
+    if (!pool)
+        pool = ThreadPool::instance();
+    out.resize(outOffset);
+    std::vector<char> ok(count, 0);
+    CompressorList compressors(-1);
+    pool->parallelRun(count, [&](int chunk) {
+            const ChunkEntry &entry = entries[chunk];
+            const char *frame = data + frameOffsets[chunk];
+            if (Rct::checksum(frame, entry.compressed) != entry.checksum)
+                return;
+            Compressor *compressor = compressors.take();
+            String uncompressed;
+            if (compressor->uncompress(codec, frame, entry.compressed, uncompressed)
+                && uncompressed.size() == static_cast<int>(entry.uncompressed)) {
+                memcpy(out.data() + outOffsets[chunk], uncompressed.constData(), uncompressed.size());
+                ok[chunk] = 1;
+            }
+            compressors.put(compressor);
+        });
+    for (int i = 0; i < count; ++i) {
+        if (!ok[i]) {
+            out.clear();
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef Compressor_h
+#define Compressor_h
+
+#include <rct/String.h>
+
+class CompressorPrivate;
+class ThreadPool;
+
+// Compression contexts that are set up once and reset between payloads,
+// String::compress() and String::uncompress() pay for a new zlib stream
+// every time. One Compressor must not be used by several threads at once.
+class Compressor
+{
+public:
+    enum Codec { Zlib, Zstd };
+
+    // level -1 is the codec's default, Z_DEFAULT_COMPRESSION (6) for zlib
+    // and 3 for zstd, which is what Connection uses. Messages used to be
+    // compressed with String::compress(), which uses Z_BEST_COMPRESSION
+    // (9). 6 is several times faster and its output is typically only a
+    // few percent bigger, pass 9 for the old ratio.
+    Compressor(int level = -1);
+    ~Compressor();
+
+    static bool isSupported(Codec codec);
+
+    // Both replace the contents of out and return false when the data
+    // couldn't be (de)compressed or the codec isn't available
+    bool compress(Codec codec, const char *data, int size, String &out);
+    bool uncompress(Codec codec, const char *data, int size, String &out);
+
+    // For large payloads. data is cut into chunkSize pieces that are
+    // compressed as independent frames on pool, ThreadPool::instance() if
+    // it's null, and the calling thread. The frames follow an index with
+    // the codec and the sizes and checksum of each of them, so
+    // uncompressChunked() can check and uncompress them in parallel too.
+    enum { DefaultChunkSize = 1024 * 1024 };
+    static bool compressChunked(Codec codec, const char *data, int size, String &out, int level = -1,
+                                int chunkSize = DefaultChunkSize, ThreadPool *pool = 0);
+    static bool uncompressChunked(const char *data, int size, String &out, ThreadPool *pool = 0);
+    // whether data starts with the index compressChunked() writes
+    static bool isChunked(const char *data, int size);
+
+private:
+    CompressorPrivate *priv;
+
+    Compressor(const Compressor &) = delete;
+    Compressor &operator=(const Compressor &) = delete;
+};
+
+#endif
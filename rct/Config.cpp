@@ -2,6 +2,8 @@
 #include "Log.h"
 
 List<Config::OptionBase*> Config::sOptions;
+FlatHash<StringView, Config::OptionBase*> Config::sOptionsByName;
+Config::OptionBase *Config::sShortOptions[256];
 bool Config::sAllowsFreeArgs = false;
 List<Value> Config::sFreeArgs;
 
@@ -10,12 +12,44 @@ static inline Value createValue(Value::Type type, const char *val, bool *ok)
     return Value::create(val).convert(type, ok);
 }
 
+void Config::addOption(OptionBase *option)
+{
+    option->fromCommandLine = false;
+    option->update();
+    sOptions.append(option);
+    if (option->name)
+        sOptionsByName.insert(option->name, option);
+    OptionBase *&shortOption = sShortOptions[static_cast<unsigned char>(option->shortOption)];
+    if (option->shortOption && !shortOption)
+        shortOption = option;
+}
+
 bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
 {
-    String error;
     Rct::findExecutablePath(argv[0]);
     List<String> args;
     args << argv[0];
+    for (int i=1; i<argc; ++i)
+        args.append(argv[i]);
+
+    String error;
+    // the command line goes first so the rc files know what it set
+    const bool ok = (parseArguments(args, true, error)
+                     && parseRcFiles(argv[0], rcFiles, error));
+    if (!ok) {
+        if (!error.isEmpty()) {
+            showHelp(stderr);
+            fprintf(stderr, "%s\n", error.constData());
+        }
+        return false;
+    }
+    return true;
+}
+
+bool Config::parseRcFiles(const char *argv0, const List<Path> &rcFiles, String &error)
+{
+    List<String> args;
+    args << argv0;
     for (int i=0; i<rcFiles.size(); ++i) {
         FILE *f = fopen(rcFiles.at(i).constData(), "r");
         if (f) {
@@ -41,9 +75,11 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
             fclose(f);
         }
     }
-    for (int i=1; i<argc; ++i)
-        args.append(argv[i]);
+    return args.size() == 1 || parseArguments(args, false, error);
+}
 
+bool Config::parseArguments(const List<String> &args, bool commandLine, String &error)
+{
     // ::error() << "parsing" << args;
 
     char *a[args.size()];
@@ -68,6 +104,14 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
     const String shortOpts = Rct::shortOptions(options);
 
     bool ok = true;
+    List<Value> freeArgs;
+    // rc files are parsed after the command line
+#ifdef OS_Linux
+    optind = 0;
+#else
+    optreset = 1;
+    optind = 1;
+#endif
 
     while (true) {
         int idx = -1;
@@ -100,6 +144,10 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
             goto done;
         }
         ++opt->count;
+        // the command line wins, the rc files only count
+        const bool assign = commandLine || !opt->fromCommandLine;
+        if (commandLine)
+            opt->fromCommandLine = true;
         if (optarg) {
             Value val;
             const char *arg = optarg;
@@ -127,7 +175,6 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
                     }
                     ++optind;
                 }
-                opt->value = vals;
                 if (opt->listCount && vals.size() != opt->listCount) {
                     ok = false;
                     error = String::format<128>("Too few values specified for %s. Wanted %d, got %d",
@@ -135,28 +182,38 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
 
                     goto done;
                 }
-            } else {
-                opt->value = val;
+                val = vals;
             }
-            if (!opt->validate(error)) {
+            // a value that fails validation never takes effect
+            if (assign && !opt->validate(val, error)) {
                 ok = false;
                 goto done;
             }
+            if (assign)
+                opt->value = val;
         } else {
             assert(opt->defaultValue.type() == Value::Type_Boolean);
             // must be a toggle arg
-            opt->value = Value(!opt->defaultValue.toBool());
+            if (assign)
+                opt->value = Value(!opt->defaultValue.toBool());
         }
     }
 
 done:
     while (optind < args.size()) {
-        sFreeArgs << a[optind++];
+        freeArgs << a[optind++];
     }
-    if (!sAllowsFreeArgs && !sFreeArgs.isEmpty()) {
+    if (!sAllowsFreeArgs && !freeArgs.isEmpty()) {
         error = String::format<128>("Unexpected free args");
         ok = false;
     }
+    // the ones from rc files come first
+    if (commandLine) {
+        sFreeArgs += freeArgs;
+    } else {
+        freeArgs += sFreeArgs;
+        sFreeArgs = std::move(freeArgs);
+    }
 
     for (int i=0; i<args.size(); ++i) {
         free(a[i]);
@@ -164,12 +221,8 @@ done:
 
     delete[] options;
 
-    if (!ok) {
-        if (!error.isEmpty()) {
-            showHelp(stderr);
-            fprintf(stderr, "%s\n", error.constData());
-        }
-    }
+    for (OptionBase *opt : sOptions)
+        opt->update();
     return ok;
 }
 
@@ -208,6 +261,8 @@ void Config::showHelp(FILE *f)
 void Config::clear()
 {
     sOptions.deleteAll();
+    sOptionsByName.clear();
+    memset(sShortOptions, 0, sizeof(sShortOptions));
     sAllowsFreeArgs = false;
     sFreeArgs.clear();
 }
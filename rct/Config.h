@@ -2,19 +2,53 @@
 #define Config_h
 
 #include <stdio.h>
+#include <rct/FlatHash.h>
 #include <rct/Path.h>
 #include <rct/Rct.h>
 #include <rct/Value.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
 #include <getopt.h>
 
 class Config
 {
+private:
+    template <typename T> struct TypedOption;
 public:
+    // What's on the command line wins over what's in the rc files
     static bool parse(int argc, char **argv, const List<Path> &rcFiles = List<Path>());
 
+    // What the register functions return. Reading an option through one
+    // doesn't look anything up, and its value is converted only when the
+    // arguments are parsed, so don't read one while parse() runs. Valid
+    // until clear().
+    template <typename T>
+    class Handle
+    {
+    public:
+        Handle() : mOption(0) {}
+
+        bool isValid() const { return mOption; }
+        const T &value() const
+        {
+            assert(mOption);
+            return mOption->current;
+        }
+        int isEnabled() const
+        {
+            assert(mOption);
+            return mOption->value.toBool() ? mOption->count : 0;
+        }
+
+    private:
+        Handle(TypedOption<T> *option) : mOption(option) {}
+
+        TypedOption<T> *mOption;
+        friend class Config;
+    };
+
     template<typename T, int listCount = 0>
-    static void registerListOption(const char *name, const String &description, const char shortOpt = '\0',
+    static Handle<List<T> > registerListOption(const char *name, const String &description, const char shortOpt = '\0',
                                    const List<T> &defaultValue = List<T>(),
                                    const std::function<bool(const List<T>&, String &)> &validator = std::function<bool(const List<T>&, String &)>())
     {
@@ -29,11 +63,12 @@ public:
         option->type = type;
         option->count = 0;
         option->listCount = listCount;
-        sOptions.append(option);
+        addOption(option);
+        return Handle<List<T> >(option);
     }
 
     template <typename T>
-    static void registerOption(const char *name,
+    static Handle<T> registerOption(const char *name,
                                const String &description,
                                const char shortOpt = '\0',
                                const T &defaultValue = T(),
@@ -49,7 +84,8 @@ public:
         option->type = def.type();
         option->count = 0;
         option->listCount = 0;
-        sOptions.append(option);
+        addOption(option);
+        return Handle<T>(option);
     }
 
     static int isEnabled(const char *name)
@@ -155,27 +191,35 @@ private:
         Value value;
         Value::Type type;
         int count, listCount;
-        virtual bool validate(String &err) = 0;
+        // rc files don't override what's on the command line
+        bool fromCommandLine;
+        // of a value before it's assigned
+        virtual bool validate(const Value &value, String &err) = 0;
+        // converts value, or defaultValue, for Handle
+        virtual void update() = 0;
     };
     template <typename T>
-    struct Option : public OptionBase {
-        virtual bool validate(String &err) override
+    struct TypedOption : public OptionBase {
+        virtual void update() override
         {
-            if (validator) {
-                const T t = value.convert<T>();
-                if (!validator(t, err)) {
-                    value.clear();
-                    return false;
-                }
-            }
-            return true;
+            T t;
+            convert(value.isNull() ? defaultValue : value, t);
+            current = std::move(t);
+        }
+        T current;
+    };
+    template <typename T>
+    struct Option : public TypedOption<T> {
+        virtual bool validate(const Value &value, String &err) override
+        {
+            return !validator || validator(value.convert<T>(), err);
         }
         std::function<bool(const T &, String &err)> validator;
     };
 
     template <typename T>
-    struct ListOption : public OptionBase {
-        virtual bool validate(String &err) override
+    struct ListOption : public TypedOption<List<T> > {
+        virtual bool validate(const Value &value, String &err) override
         {
             if (validator) {
                 const List<Value> t = value.convert<List<Value> >();
@@ -183,28 +227,30 @@ private:
                 for (int i=0; i<t.size(); ++i) {
                     converted[i] = t.at(i).convert<T>();
                 }
-                if (!validator(converted, err)) {
-                    value.clear();
-                    return false;
-                }
+                return validator(converted, err);
             }
             return true;
         }
         std::function<bool(const List<T> &, String &err)> validator;
     };
 
+    static void addOption(OptionBase *option);
+    static bool parseArguments(const List<String> &args, bool commandLine, String &error);
+    static bool parseRcFiles(const char *argv0, const List<Path> &rcFiles, String &error);
+
     static List<OptionBase*> sOptions;
+    // the first option registered with a name or short option
+    static FlatHash<StringView, OptionBase*> sOptionsByName;
+    static OptionBase *sShortOptions[256];
     static bool sAllowsFreeArgs;
     static List<Value> sFreeArgs;
     static const OptionBase *findOption(const char *name)
     {
         assert(name);
-        const int len = strlen(name);
-        for (int i=0; i<sOptions.size(); ++i) {
-            if (!strcmp(sOptions.at(i)->name, name) || (len == 1 && *name == sOptions.at(i)->shortOption)) {
-                return sOptions.at(i);
-            }
-        }
+        if (OptionBase *option = sOptionsByName.value(name))
+            return option;
+        if (name[0] && !name[1])
+            return sShortOptions[static_cast<unsigned char>(name[0])];
         return 0;
     }
 };
@@ -2,15 +2,18 @@
 #include "EventLoop.h"
 #include "Serializer.h"
 #include "Message.h"
+#include "MessageDispatcher.h"
 #include "Timer.h"
-#include "StackBuffer.h"
+#include "Value.h"
 #include <assert.h>
 
 #include "Connection.h"
 
 Connection::Connection(int version)
-    : mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mFinishStatus(0),
-      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false)
+    : mReadOffset(0), mPendingWrite(0), mTimeoutTimer(0), mFinishStatus(0),
+      mVersion(version), mBytesRead(0), mBytesWritten(0), mMessagesReceived(0), mMessagesSent(0), mCodec(Compressor::Zlib), mBatch(0), mAutoBatch(false),
+      mHighWatermark(0), mLowWatermark(0), mPauseReads(false), mSilent(false),
+      mIsConnected(false), mWarned(false), mNextStreamId(1)
 {
 }
 
@@ -25,6 +28,8 @@ void Connection::connect(const SocketClient::SharedPtr &client)
 {
     mSocketClient = client;
     mIsConnected = true;
+    mNextStreamId = 2;
+    applyClientOptions();
     assert(client->isConnected());
     auto that = shared_from_this();
     mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
@@ -56,6 +61,7 @@ bool Connection::connectUnix(const Path &socketFile, int timeout)
         }, timeout, Timer::SingleShot);
     }
     mSocketClient.reset(new SocketClient);
+    applyClientOptions();
     auto that = shared_from_this();
     mSocketClient->connected().connect(std::bind(&Connection::onClientConnected, that, std::placeholders::_1));
     mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
@@ -81,6 +87,7 @@ bool Connection::connectTcp(const String &host, uint16_t port, int timeout)
         }, timeout, Timer::SingleShot);
     }
     mSocketClient.reset(new SocketClient);
+    applyClientOptions();
     auto that = shared_from_this();
     mSocketClient->connected().connect(std::bind(&Connection::onClientConnected, that, std::placeholders::_1));
     mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
@@ -99,80 +106,131 @@ int Connection::pendingWrite() const
     return mPendingWrite;
 }
 
-static inline unsigned int bufferSize(const LinkedList<Buffer>& buffers)
+Value Connection::metrics() const
 {
-    unsigned int sz = 0;
-    for (const Buffer& buffer: buffers) {
-        sz += buffer.size();
-    }
-    return sz;
+    Value ret;
+    ret["bytesRead"] = mBytesRead;
+    ret["bytesWritten"] = mBytesWritten;
+    ret["messagesReceived"] = mMessagesReceived;
+    ret["messagesSent"] = mMessagesSent;
+    ret["pendingWrite"] = mPendingWrite;
+    return ret;
 }
 
-static inline int bufferRead(LinkedList<Buffer>& buffers, char* out, unsigned int size)
+void Connection::applyClientOptions()
 {
-    if (!size)
-        return 0;
-    unsigned int num = 0, rem = size, cur;
-    LinkedList<Buffer>::iterator it = buffers.begin();
-    while (it != buffers.end()) {
-        cur = std::min(it->size(), rem);
-        memcpy(out + num, it->data(), cur);
-        rem -= cur;
-        num += cur;
-        if (cur == it->size()) {
-            // we've read the entire buffer, remove it
-            it = buffers.erase(it);
-        } else {
-            assert(!rem);
-            assert(it->size() > cur);
-            assert(cur > 0);
-            // we need to shrink & memmove the front buffer at this point
-            Buffer& front = *it;
-            memmove(front.data(), front.data() + cur, front.size() - cur);
-            front.resize(front.size() - cur);
-        }
-        if (!rem) {
-            assert(num == size);
-            return size;
-        }
-        assert(rem > 0);
-    }
-    return num;
+    if (mBatch)
+        mSocketClient->cork();
+    if (mHighWatermark)
+        mSocketClient->setWatermarks(mHighWatermark, mLowWatermark, mPauseReads);
+    std::weak_ptr<Connection> weak = shared_from_this();
+    mSocketClient->writeBufferFull().connect([weak](const SocketClient::SharedPtr&) {
+            if (auto strong = weak.lock())
+                strong->mWriteBufferFull(strong);
+        });
+    mSocketClient->writeBufferDrained().connect([weak](const SocketClient::SharedPtr&) {
+            if (auto strong = weak.lock())
+                strong->mWriteBufferDrained(strong);
+        });
+}
+
+void Connection::setWatermarks(unsigned int high, unsigned int low, bool pauseReads)
+{
+    mHighWatermark = high;
+    mLowWatermark = low;
+    mPauseReads = pauseReads;
+    if (mSocketClient)
+        mSocketClient->setWatermarks(high, low, pauseReads);
+}
+
+void Connection::beginBatch()
+{
+    if (!mBatch++ && mSocketClient)
+        mSocketClient->cork();
+}
+
+bool Connection::endBatch()
+{
+    assert(mBatch > 0);
+    if (--mBatch || !mSocketClient)
+        return mSocketClient && isConnected();
+    return mSocketClient->uncork();
+}
+
+void Connection::batch()
+{
+    if (mAutoBatch)
+        return;
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    mAutoBatch = true;
+    beginBatch();
+    std::weak_ptr<Connection> weak = shared_from_this();
+    loop->callLater([weak]() {
+            if (auto strong = weak.lock()) {
+                strong->mAutoBatch = false;
+                strong->endBatch();
+            }
+        });
 }
 
 void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
 {
-    while (true) {
-        if (!buf.isEmpty())
-            mBuffers.push_back(std::move(buf));
+    // Everything received goes into one contiguous buffer and messages are
+    // decoded straight out of it. Consumed bytes are skipped with
+    // mReadOffset, the rest is only moved down when the buffer has to grow.
+    mBytesRead += buf.size();
+    if (!buf.isEmpty()) {
+        if (mReadBuffer.isEmpty()) {
+            mReadBuffer = std::move(buf);
+        } else {
+            if (mReadOffset && mReadBuffer.size() + buf.size() > mReadBuffer.capacity())
+                compactRead();
+            mReadBuffer.reserve(mReadBuffer.size() + buf.size());
+            memcpy(mReadBuffer.end(), buf.data(), buf.size());
+            mReadBuffer.resize(mReadBuffer.size() + buf.size());
+            // the client reads into this again
+            buf.clear();
+        }
+    }
 
-        unsigned int available = bufferSize(mBuffers);
-        if (!available)
+    while (mSocketClient && mSocketClient->isConnected()) {
+        // callbacks below may end up in here again so nothing about the
+        // buffer is cached across them
+        const unsigned int available = mReadBuffer.size() - mReadOffset;
+        if (available < sizeof(uint32_t))
             break;
-        if (!mPendingRead) {
-            if (available < static_cast<int>(sizeof(uint32_t)))
-                break;
-            union {
-                char buf[sizeof(uint32_t)];
-                int pending;
-            };
-            const int read = bufferRead(mBuffers, buf, 4);
-            assert(read == 4);
-            mPendingRead = pending;
-            assert(mPendingRead > 0);
-            available -= 4;
-        }
-        assert(mPendingRead >= 0);
-        if (available < static_cast<unsigned int>(mPendingRead))
+        uint32_t size;
+        memcpy(&size, mReadBuffer.data() + mReadOffset, sizeof(uint32_t));
+        assert(size > 0);
+        if (available - sizeof(uint32_t) < size) {
+            // don't grow in steps while a large message trickles in
+            if (mReadBuffer.capacity() - mReadOffset < size + sizeof(uint32_t)) {
+                compactRead();
+                mReadBuffer.reserve(size + sizeof(uint32_t));
+            }
             break;
+        }
 
-        StackBuffer<1024 * 16> buffer(mPendingRead);
-        const int read = bufferRead(mBuffers, buffer, mPendingRead);
-        assert(read == mPendingRead);
-        mPendingRead = 0;
-        std::shared_ptr<Message> message = Message::create(mVersion, buffer, read);
+        const char *data = reinterpret_cast<const char*>(mReadBuffer.data() + mReadOffset + sizeof(uint32_t));
+        const unsigned int consumed = size + sizeof(uint32_t);
+        Message::Frame frame;
+        const bool parsed = Message::parse(mVersion, data, size, &mCompressor, mSocketClient.get(), frame);
+        if (parsed && mDispatcher && mDispatcher->handles(frame.id) && frame.id != FinishMessage::MessageId
+            && !(frame.streamId && isOwnStream(frame.streamId))) {
+            ++mMessagesReceived;
+            const std::shared_ptr<MessageDispatcher> dispatcher = mDispatcher;
+            dispatcher->dispatch(mVersion, frame, [this, consumed]() { consumeRead(consumed); }, shared_from_this());
+            continue;
+        }
+        std::shared_ptr<Message> message = parsed ? Message::create(mVersion, frame) : std::shared_ptr<Message>();
+        consumeRead(consumed);
         if (message) {
+            ++mMessagesReceived;
             auto that = shared_from_this();
+            if (message->streamId() && dispatchResponse(message))
+                continue;
             if (message->messageId() == FinishMessage::MessageId) {
                 mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
                 mFinished(that, mFinishStatus);
@@ -180,50 +238,167 @@ void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
                 newMessage()(message, that);
             }
         } else {
-            ::error() << "Unable to create message from data" << read;
-        }
-        if (!message)
+            ::error() << "Unable to create message from data" << size;
             mSocketClient->close();
-    // mClient->dataAvailable().disconnect(this, &Connection::dataAvailable);
+        }
     }
 }
 
+bool Connection::dispatchResponse(const std::shared_ptr<Message> &message)
+{
+    const auto it = mRequests.find(message->streamId());
+    if (it == mRequests.end()) {
+        // the rest of a request that's been cancelled isn't for anyone
+        return isOwnStream(message->streamId());
+    }
+    // the callbacks may make or cancel requests
+    if (message->messageId() == FinishMessage::MessageId) {
+        const std::function<void(int)> onFinished = std::move(it->second.onFinished);
+        mRequests.erase(it);
+        if (onFinished)
+            onFinished(std::static_pointer_cast<FinishMessage>(message)->status());
+    } else if (it->second.onMessage) {
+        const std::function<void(const std::shared_ptr<Message> &)> onMessage = it->second.onMessage;
+        onMessage(message);
+    }
+    return true;
+}
+
+void Connection::failRequests()
+{
+    Hash<uint32_t, Request> requests;
+    std::swap(requests, mRequests);
+    for (const auto &request : requests) {
+        if (request.second.onFinished)
+            request.second.onFinished(-1);
+    }
+}
+
+uint32_t Connection::request(const Message &message,
+                             std::function<void(const std::shared_ptr<Message> &)> &&onMessage,
+                             std::function<void(int)> &&onFinished)
+{
+    if (!(mVersion & Message::Multiplexed))
+        return 0;
+    const uint32_t streamId = mNextStreamId;
+    // 0 is no stream, odd ids wrap to 1 by themselves
+    mNextStreamId += 2;
+    if (!mNextStreamId)
+        mNextStreamId = 2;
+    Request &request = mRequests[streamId];
+    request.onMessage = std::move(onMessage);
+    request.onFinished = std::move(onFinished);
+    if (!send(message, streamId)) {
+        mRequests.remove(streamId);
+        return 0;
+    }
+    return streamId;
+}
+
+bool Connection::cancel(uint32_t streamId)
+{
+    return mRequests.remove(streamId);
+}
+
+void Connection::consumeRead(unsigned int size)
+{
+    mReadOffset += size;
+    if (mReadOffset == mReadBuffer.size()) {
+        mReadBuffer.clear();
+        mReadOffset = 0;
+    }
+}
+
+void Connection::compactRead()
+{
+    if (!mReadOffset)
+        return;
+    const unsigned int remaining = mReadBuffer.size() - mReadOffset;
+    if (remaining)
+        memmove(mReadBuffer.data(), mReadBuffer.data() + mReadOffset, remaining);
+    mReadBuffer.resize(remaining);
+    mReadOffset = 0;
+}
+
 void Connection::onDataWritten(const SocketClient::SharedPtr&, int bytes)
 {
     assert(mPendingWrite >= bytes);
     mPendingWrite -= bytes;
+    mBytesWritten += bytes;
     // ::error() << "wrote some bytes" << mPendingWrite << bytes;
     if (!mPendingWrite) {
         mSendFinished(shared_from_this());
     }
 }
 
+// Small serializer writes are collected and go out together with the next
+// large one, or at flush(), in a single SocketClient::writev(). The end of a
+// large segment is staged too and the writev() before it says more is
+// coming, so a message never ends in a short write that Nagle holds back
+// until the peer's delayed ack.
 class SocketClientBuffer : public Serializer::Buffer
 {
 public:
     SocketClientBuffer(const SocketClient::SharedPtr &client)
-        : mClient(client), mWritten(0)
+        : mClient(client), mWritten(0), mStaged(0)
     {}
 
     virtual bool write(const void *data, int len) override
     {
-        if (mClient->write(data, len)) {
-            mWritten += len;
-            return true;
+        if (len <= StageSize - mStaged) {
+            memcpy(mStage + mStaged, data, len);
+            mStaged += len;
+        } else if (len < StageSize) {
+            if (!flush())
+                return false;
+            memcpy(mStage, data, len);
+            mStaged = len;
+        } else {
+            // large segments are written from where they are
+            const int head = len - TailSize;
+            struct iovec vecs[2];
+            vecs[0].iov_base = mStage;
+            vecs[0].iov_len = mStaged;
+            vecs[1].iov_base = const_cast<void*>(data);
+            vecs[1].iov_len = head;
+            mStaged = 0;
+            if (!mClient->writev(vecs, 2, true))
+                return false;
+            memcpy(mStage, static_cast<const char*>(data) + head, TailSize);
+            mStaged = TailSize;
         }
-        return false;
+        mWritten += len;
+        return true;
     }
 
     virtual int pos() const override
     {
         return mWritten;
     }
+
+    bool flush()
+    {
+        if (!mStaged)
+            return true;
+        struct iovec vec;
+        vec.iov_base = mStage;
+        vec.iov_len = mStaged;
+        mStaged = 0;
+        return mClient->writev(&vec, 1);
+    }
 private:
+    enum { StageSize = 1024 * 4, TailSize = 1024 };
     SocketClient::SharedPtr mClient;
-    int mWritten;
+    int mWritten, mStaged;
+    char mStage[StageSize];
 };
 
 bool Connection::send(const Message &message)
+{
+    return send(message, 0);
+}
+
+bool Connection::send(const Message &message, uint32_t streamId)
 {
     // ::error() << getpid() << "sending message" << static_cast<int>(message.messageId());
     if (!mSocketClient || !mSocketClient->isConnected()) {
@@ -235,26 +410,49 @@ bool Connection::send(const Message &message)
     }
 
     mAboutToSend(shared_from_this(), &message);
+    ++mMessagesSent;
 
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     const int size = -1;
 #else
-    const int size = message.encodedSize();
+    // cached messages don't need the size, their frame is built once,
+    // and a message that has been sent before has its frame already.
+    // Attachments go out with the first byte of the frame.
+    const int size = ((message.mFlags & Message::MessageCache) || message.attachmentCount() || message.hasFrame(mVersion)
+                      ? -1 : message.encodedSize(mVersion));
 #endif
 
-    if (size == -1 || message.mFlags & Message::MessageCache) {
-        String header, value;
-        message.prepare(mVersion, header, value);
-        mPendingWrite += header.size() + value.size();
-        assert(size == -1 || size == (header.size() + value.size() - 4));
-        return (mSocketClient->write(header) && (value.isEmpty() || mSocketClient->write(value)));
+    if (size == -1) {
+        const std::shared_ptr<const String> frame = message.frame(mVersion, &mCompressor, mCodec);
+        mPendingWrite += frame->size();
+        const int count = message.attachmentCount();
+        if (!streamId || !(mVersion & Message::Multiplexed)) {
+            if (count)
+                return mSocketClient->writeFds(message.mAttachments->fds.data(), count, frame->constData(), frame->size());
+            return mSocketClient->write(frame);
+        }
+        // on another stream only the header is different
+        char header[Message::MaxFrameHeader];
+        const int headerSize = message.frameHeader(mVersion, *frame, streamId, header);
+        struct iovec vecs[2];
+        vecs[1].iov_base = const_cast<char*>(frame->constData()) + headerSize;
+        vecs[1].iov_len = frame->size() - headerSize;
+        if (count) {
+            return (mSocketClient->writeFds(message.mAttachments->fds.data(), count, header, headerSize)
+                    && mSocketClient->writev(vecs + 1, 1));
+        }
+        vecs[0].iov_base = header;
+        vecs[0].iov_len = headerSize;
+        return mSocketClient->writev(vecs, 2);
     } else {
         assert(size >= 0);
-        mPendingWrite += (size + Message::HeaderExtra) + sizeof(int);
-        Serializer serializer(std::unique_ptr<SocketClientBuffer>(new SocketClientBuffer(mSocketClient)));
-        message.encodeHeader(serializer, size, mVersion);
+        mPendingWrite += (size + Message::headerExtra(mVersion)) + sizeof(int);
+        SocketClientBuffer *buffer = new SocketClientBuffer(mSocketClient);
+        Serializer serializer((std::unique_ptr<SocketClientBuffer>(buffer)));
+        message.encodeHeader(serializer, size, mVersion, streamId);
+        serializer.setFlags(Message::serializerFlags(mVersion));
         message.encode(serializer);
-        return !serializer.hasError();
+        return !serializer.hasError() && buffer->flush();
     }
 }
 
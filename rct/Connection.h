@@ -2,6 +2,7 @@
 #define CONNECTION_H
 
 #include <rct/Buffer.h>
+#include <rct/Hash.h>
 #include <rct/Message.h>
 #include <rct/SocketClient.h>
 #include <rct/String.h>
@@ -12,8 +13,10 @@
 #include <rct/FinishMessage.h>
 
 class ConnectionPrivate;
+class MessageDispatcher;
 class SocketClient;
 class Event;
+class Value;
 class Connection : public std::enable_shared_from_this<Connection>
 {
 public:
@@ -32,6 +35,13 @@ public:
     void setVersion(int version) { mVersion = version; }
     int version() const { return mVersion; }
 
+    // Codec for sending Compressed messages, received ones say which codec
+    // they use. Zstd needs support on both ends so peers should only pick
+    // it through the version they agree on. Unsupported codecs fall back
+    // to zlib.
+    void setCodec(Compressor::Codec codec) { mCodec = codec; }
+    Compressor::Codec codec() const { return mCodec; }
+
     void setSilent(bool on) { mSilent = on; }
     bool isSilent() const { return mSilent; }
 
@@ -40,6 +50,26 @@ public:
 
     int pendingWrite() const;
 
+    // Traffic since the connection was created, what metrics() reports
+    // along with pendingWrite()
+    uint64_t bytesRead() const { return mBytesRead; }
+    uint64_t bytesWritten() const { return mBytesWritten; }
+    uint64_t messagesReceived() const { return mMessagesReceived; }
+    uint64_t messagesSent() const { return mMessagesSent; }
+    Value metrics() const;
+
+    // Messages sent between beginBatch() and the matching endBatch() are
+    // queued and go out together when the outermost batch ends. batch()
+    // starts one that ends once the event loop gets to its posted events,
+    // i.e. after the callback that is running now has returned.
+    void beginBatch();
+    bool endBatch();
+    void batch();
+
+    // See SocketClient::setWatermarks(), kept for clients that are
+    // connected later
+    void setWatermarks(unsigned int high, unsigned int low, bool pauseReads = false);
+
     bool send(const Message &message);
     template <int StaticBufSize>
     bool write(const char *format, ...)
@@ -82,42 +112,100 @@ public:
 
     int finishStatus() const { return mFinishStatus; }
 
+    // With Message::Multiplexed in the version of both ends any number of
+    // requests can be in flight at once. request() sends message on a new
+    // stream and returns its id, the messages the peer sends back on it go
+    // to onMessage and its FinishMessage to onFinished, which ends the
+    // stream. onFinished gets -1 if the connection goes away first. The
+    // peer sees the id in streamId() of the messages it gets through
+    // newMessage() and answers with send(message, streamId) and
+    // finishStream(). Returns 0 when there's no stream to send on.
+    uint32_t request(const Message &message,
+                     std::function<void(const std::shared_ptr<Message> &)> &&onMessage,
+                     std::function<void(int)> &&onFinished);
+    // Drops the callbacks of a request, whatever else comes for it is
+    // dropped too
+    bool cancel(uint32_t streamId);
+    int pendingRequests() const { return mRequests.size(); }
+    bool send(const Message &message, uint32_t streamId);
+    bool finishStream(uint32_t streamId, int status = 0) { return send(FinishMessage(status), streamId); }
+
     void close() { assert(mSocketClient); mSocketClient->close(); }
 
     bool isConnected() const { return mSocketClient->isConnected(); }
 
     Signal<std::function<void(std::shared_ptr<Connection>)> > &sendFinished() { return mSendFinished; }
+    Signal<std::function<void(std::shared_ptr<Connection>)> > &writeBufferFull() { return mWriteBufferFull; }
+    Signal<std::function<void(std::shared_ptr<Connection>)> > &writeBufferDrained() { return mWriteBufferDrained; }
     Signal<std::function<void(std::shared_ptr<Connection>)> > &connected() { return mConnected; }
     Signal<std::function<void(std::shared_ptr<Connection>)> > &disconnected() { return mDisconnected; }
     Signal<std::function<void(std::shared_ptr<Connection>)> > &error() { return mError; }
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > &finished() { return mFinished; }
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)> > &aboutToSend() { return mAboutToSend; }
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > &newMessage() { return mNewMessage; }
+    // Messages dispatcher has a handler for go to it instead of newMessage(),
+    // a dispatcher can be shared by many Connections
+    void setDispatcher(const std::shared_ptr<MessageDispatcher> &dispatcher) { mDispatcher = dispatcher; }
+    std::shared_ptr<MessageDispatcher> dispatcher() const { return mDispatcher; }
     SocketClient::SharedPtr client() const { return mSocketClient; }
 
 private:
     Connection(int version);
     void connect(const SocketClient::SharedPtr &client);
     void onClientConnected(const SocketClient::SharedPtr&) { mIsConnected = true; mConnected(shared_from_this()); }
-    void onClientDisconnected(const SocketClient::SharedPtr&) { mIsConnected = false; mDisconnected(shared_from_this()); }
+    void onClientDisconnected(const SocketClient::SharedPtr&)
+    {
+        mIsConnected = false;
+        failRequests();
+        mDisconnected(shared_from_this());
+    }
     void onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buffer);
     void onDataWritten(const SocketClient::SharedPtr&, int);
     void onSocketError(const SocketClient::SharedPtr&, SocketClient::Error error)
     {
         ::warning() << "Socket error" << error << errno << Rct::strerror();
         mError(shared_from_this());
+        failRequests();
         mDisconnected(shared_from_this());
     }
     void checkData();
+    // true if message was for one of our requests
+    bool dispatchResponse(const std::shared_ptr<Message> &message);
+    // streams of requests this end made, the peer's have the other parity
+    bool isOwnStream(uint32_t streamId) const { return (streamId & 1) == (mNextStreamId & 1); }
+    void failRequests();
+    void compactRead();
+    void consumeRead(unsigned int size);
+    void applyClientOptions();
 
     SocketClient::SharedPtr mSocketClient;
-    LinkedList<Buffer> mBuffers;
-    int mPendingRead, mPendingWrite, mTimeoutTimer, mFinishStatus, mVersion;
+    Buffer mReadBuffer;
+    unsigned int mReadOffset;
+    int mPendingWrite, mTimeoutTimer, mFinishStatus, mVersion;
+    uint64_t mBytesRead, mBytesWritten, mMessagesReceived, mMessagesSent;
+    Compressor mCompressor;
+    Compressor::Codec mCodec;
+    int mBatch;
+    bool mAutoBatch;
+    unsigned int mHighWatermark, mLowWatermark;
+    bool mPauseReads;
 
     bool mSilent, mIsConnected, mWarned;
 
+    struct Request
+    {
+        std::function<void(const std::shared_ptr<Message> &)> onMessage;
+        std::function<void(int)> onFinished;
+    };
+    Hash<uint32_t, Request> mRequests;
+    // odd on the side that connected, even on the one that accepted, so
+    // both can make requests without their ids running into each other
+    uint32_t mNextStreamId;
+
+    std::shared_ptr<MessageDispatcher> mDispatcher;
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > mNewMessage;
     Signal<std::function<void(std::shared_ptr<Connection>)> > mConnected, mDisconnected, mError, mSendFinished;
+    Signal<std::function<void(std::shared_ptr<Connection>)> > mWriteBufferFull, mWriteBufferDrained;
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > mFinished;
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)> > mAboutToSend;
 
@@ -0,0 +1,295 @@
+#ifndef Coroutine_h
+#define Coroutine_h
+
+// Coroutines on the EventLoop. rct itself is built as C++11 so all of this
+// is in the header and only there for code that's built as C++20.
+//
+//     Task<> handle(std::shared_ptr<Connection> connection)
+//     {
+//         ConnectionReader reader(connection);
+//         while (std::shared_ptr<Message> message = co_await reader.next()) {
+//             ...
+//             co_await Rct::sleep(10);
+//         }
+//     }
+//
+//     handle(connection).start();
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/Log.h>
+#include <rct/Message.h>
+#include <rct/NodePool.h>
+#include <rct/Process.h>
+#include <rct/Timer.h>
+#include <coroutine>
+#include <assert.h>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+template <typename T = void>
+class Task;
+
+namespace RctCoroutine {
+// Frames come from the NodePool of the thread, that is of the EventLoop,
+// so a coroutine started for every request doesn't go to malloc
+struct PromiseBase
+{
+    static void *operator new(size_t size) { return NodePool::allocate(size); }
+    static void operator delete(void *ptr, size_t size) { NodePool::free(ptr, size); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            PromiseBase &promise = handle.promise();
+            if (promise.continuation)
+                return promise.continuation;
+            if (promise.detached) {
+                if (promise.exception)
+                    ::error() << "Unhandled exception in a started Task";
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    bool detached = false;
+};
+
+template <typename T>
+struct Promise : public PromiseBase
+{
+    Task<T> get_return_object();
+    template <typename U>
+    void return_value(U &&u) { value.emplace(std::forward<U>(u)); }
+    T result()
+    {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct Promise<void> : public PromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+}
+
+// A coroutine that starts when it's awaited, which resumes the awaiter
+// with its result when it's done, or when start() is called, after which
+// it's on its own and frees itself at the end
+template <typename T>
+class Task
+{
+public:
+    typedef RctCoroutine::Promise<T> promise_type;
+
+    Task(Task &&other) : mHandle(std::exchange(other.mHandle, nullptr)) {}
+    Task &operator=(Task &&other)
+    {
+        if (this != &other) {
+            if (mHandle)
+                mHandle.destroy();
+            mHandle = std::exchange(other.mHandle, nullptr);
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if (mHandle)
+            mHandle.destroy();
+    }
+
+    bool isValid() const { return bool(mHandle); }
+    bool isDone() const { return mHandle && mHandle.done(); }
+
+    void start()
+    {
+        assert(mHandle);
+        std::coroutine_handle<promise_type> handle = std::exchange(mHandle, nullptr);
+        handle.promise().detached = true;
+        handle.resume();
+    }
+
+    bool await_ready() const { return !mHandle || mHandle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        mHandle.promise().continuation = awaiter;
+        return mHandle;
+    }
+    T await_resume() { return mHandle.promise().result(); }
+
+private:
+    Task(std::coroutine_handle<promise_type> handle) : mHandle(handle) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    std::coroutine_handle<promise_type> mHandle;
+
+    friend promise_type;
+};
+
+template <typename T>
+inline Task<T> RctCoroutine::Promise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+}
+
+inline Task<void> RctCoroutine::Promise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+}
+
+// Queues the messages of a Connection for a coroutine, next() resumes with
+// the next one, or null once the connection is gone. Messages that arrive
+// while nobody waits are kept rather than lost between two awaits.
+class ConnectionReader
+{
+public:
+    ConnectionReader(const std::shared_ptr<Connection> &connection)
+        : mConnection(connection), mDisconnected(!connection->isConnected())
+    {
+        mNewMessageKey = connection->newMessage().connect([this](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+                mMessages.push_back(message);
+                wake();
+            });
+        mDisconnectedKey = connection->disconnected().connect([this](const std::shared_ptr<Connection> &) {
+                mDisconnected = true;
+                wake();
+            });
+    }
+    ~ConnectionReader()
+    {
+        mConnection->newMessage().disconnect(mNewMessageKey);
+        mConnection->disconnected().disconnect(mDisconnectedKey);
+    }
+
+    std::shared_ptr<Connection> connection() const { return mConnection; }
+
+    struct Awaiter
+    {
+        bool await_ready() const { return !reader->mMessages.empty() || reader->mDisconnected; }
+        void await_suspend(std::coroutine_handle<> handle) { reader->mWaiting = handle; }
+        std::shared_ptr<Message> await_resume()
+        {
+            if (reader->mMessages.empty())
+                return std::shared_ptr<Message>();
+            std::shared_ptr<Message> ret = std::move(reader->mMessages.front());
+            reader->mMessages.pop_front();
+            return ret;
+        }
+
+        ConnectionReader *reader;
+    };
+    Awaiter next() { return Awaiter { this }; }
+
+private:
+    ConnectionReader(const ConnectionReader &) = delete;
+    ConnectionReader &operator=(const ConnectionReader &) = delete;
+
+    void wake()
+    {
+        if (std::coroutine_handle<> handle = std::exchange(mWaiting, nullptr))
+            handle.resume();
+    }
+
+    const std::shared_ptr<Connection> mConnection;
+    std::deque<std::shared_ptr<Message> > mMessages;
+    std::coroutine_handle<> mWaiting;
+    bool mDisconnected;
+    unsigned int mNewMessageKey, mDisconnectedKey;
+};
+
+namespace Rct {
+// Resumes on the current EventLoop after ms
+struct SleepAwaiter
+{
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        EventLoop::SharedPtr loop = EventLoop::eventLoop();
+        if (!loop)
+            return false;
+        loop->registerTimer([handle](int) { handle.resume(); }, ms, Timer::SingleShot);
+        return true;
+    }
+    void await_resume() {}
+
+    int ms;
+};
+inline SleepAwaiter sleep(int ms) { return SleepAwaiter { ms }; }
+
+// Resumes with the EventLoop::Mode flags once fd is readable or writable,
+// 0 if it couldn't be watched. For fds that aren't otherwise registered
+// with the loop.
+struct SocketAwaiter
+{
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        EventLoop::SharedPtr loop = EventLoop::eventLoop();
+        if (!loop)
+            return false;
+        std::weak_ptr<EventLoop> weak = loop;
+        return loop->registerSocket(fd, mode | EventLoop::SocketLevelTriggered, [this, handle, weak](int fd, unsigned int m) {
+                if (EventLoop::SharedPtr loop = weak.lock())
+                    loop->unregisterSocket(fd);
+                result = m;
+                handle.resume();
+            });
+    }
+    unsigned int await_resume() const { return result; }
+
+    int fd;
+    unsigned int mode, result;
+};
+inline SocketAwaiter readable(int fd) { return SocketAwaiter { fd, EventLoop::SocketRead, 0 }; }
+inline SocketAwaiter writable(int fd) { return SocketAwaiter { fd, EventLoop::SocketWrite, 0 }; }
+
+// Resumes with the return code once process has finished
+struct ProcessAwaiter
+{
+    bool await_ready() const { return process->isFinished(); }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        key = process->finished().connect([this, handle](Process *) {
+                process->finished().disconnect(key);
+                handle.resume();
+            });
+    }
+    int await_resume() const { return process->returnCode(); }
+
+    Process *process;
+    unsigned int key;
+};
+inline ProcessAwaiter finished(Process *process) { return ProcessAwaiter { process, 0 }; }
+}
+
+#endif // __cpp_impl_coroutine
+#endif // Coroutine_h
@@ -0,0 +1,166 @@
+#include "CpuTopology.h"
+#include "ThreadPool.h"
+#include "rct-config.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SCHED_GETAFFINITY
+#  include <sched.h>
+#endif
+
+#if defined(OS_Linux)
+// sysfs files report a size they don't have so Path::readAll() can't be
+// used for these
+static bool readLine(const char *path, char *buf, int size)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    const bool ok = fgets(buf, size, f) != 0;
+    fclose(f);
+    return ok;
+}
+
+static int readInt(const char *path, int defaultValue)
+{
+    char buf[32];
+    if (!readLine(path, buf, sizeof(buf)))
+        return defaultValue;
+    return atoi(buf);
+}
+
+// "0-3,8,10-11"
+static List<int> readCpuList(const char *path)
+{
+    List<int> ret;
+    char buf[4096];
+    if (!readLine(path, buf, sizeof(buf)))
+        return ret;
+    const char *ch = buf;
+    while (*ch >= '0' && *ch <= '9') {
+        char *end;
+        const int from = strtol(ch, &end, 10);
+        int to = from;
+        if (*end == '-')
+            to = strtol(end + 1, &end, 10);
+        for (int i = from; i <= to; ++i)
+            ret.append(i);
+        ch = (*end == ',') ? end + 1 : end;
+    }
+    return ret;
+}
+#endif
+
+CpuTopology::CpuTopology()
+    : mNodeCount(1)
+{
+#if defined(OS_Linux)
+#ifdef HAVE_SCHED_GETAFFINITY
+    cpu_set_t allowed;
+    const bool restricted = !sched_getaffinity(0, sizeof(allowed), &allowed);
+#endif
+    const List<int> online = readCpuList("/sys/devices/system/cpu/online");
+    char path[128];
+    for (int id : online) {
+#ifdef HAVE_SCHED_GETAFFINITY
+        if (restricted && !CPU_ISSET(id, &allowed))
+            continue;
+#endif
+        Cpu cpu = { id, id, 0, 0 };
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", id);
+        cpu.core = readInt(path, id);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", id);
+        cpu.package = readInt(path, 0);
+        mCpus.append(cpu);
+    }
+
+    // node ids can have holes, they're numbered from 0 here
+    const List<int> nodes = readCpuList("/sys/devices/system/node/online");
+    if (!nodes.isEmpty())
+        mNodeCount = nodes.size();
+    for (int i = 0; i < nodes.size(); ++i) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes.at(i));
+        for (int id : readCpuList(path)) {
+            for (Cpu &cpu : mCpus) {
+                if (cpu.id == id)
+                    cpu.node = i;
+            }
+        }
+    }
+#endif
+    if (mCpus.isEmpty()) {
+        const int count = ThreadPool::idealThreadCount();
+        for (int id = 0; id < count; ++id) {
+            const Cpu cpu = { id, id, 0, 0 };
+            mCpus.append(cpu);
+        }
+    }
+}
+
+const CpuTopology& CpuTopology::instance()
+{
+    static const CpuTopology topology;
+    return topology;
+}
+
+List<int> CpuTopology::nodeCpus(int node) const
+{
+    List<int> ret;
+    for (const Cpu &cpu : mCpus) {
+        if (cpu.node == node)
+            ret.append(cpu.id);
+    }
+    return ret;
+}
+
+static bool compactLessThan(const CpuTopology::Cpu &l, const CpuTopology::Cpu &r)
+{
+    if (l.node != r.node)
+        return l.node < r.node;
+    if (l.package != r.package)
+        return l.package < r.package;
+    if (l.core != r.core)
+        return l.core < r.core;
+    return l.id < r.id;
+}
+
+List<int> CpuTopology::compactOrder() const
+{
+    List<Cpu> cpus = mCpus;
+    std::sort(cpus.begin(), cpus.end(), compactLessThan);
+    List<int> ret;
+    ret.reserve(cpus.size());
+    for (const Cpu &cpu : cpus)
+        ret.append(cpu.id);
+    return ret;
+}
+
+List<int> CpuTopology::scatterOrder() const
+{
+    List<Cpu> cpus = mCpus;
+    std::sort(cpus.begin(), cpus.end(), compactLessThan);
+
+    // per node, the first thread of every core and then their siblings
+    List<List<int> > nodes(mNodeCount);
+    for (int pass = 0; pass < 2; ++pass) {
+        const Cpu *previous = 0;
+        for (const Cpu &cpu : cpus) {
+            const bool sibling = previous && previous->node == cpu.node
+                && previous->package == cpu.package && previous->core == cpu.core;
+            if (sibling == (pass == 1))
+                nodes[cpu.node].append(cpu.id);
+            previous = &cpu;
+        }
+    }
+
+    // then take one from each node in turn
+    List<int> ret;
+    ret.reserve(cpus.size());
+    for (int i = 0; ret.size() < cpus.size(); ++i) {
+        for (const List<int> &node : nodes) {
+            if (i < node.size())
+                ret.append(node.at(i));
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef CpuTopology_h
+#define CpuTopology_h
+
+#include <rct/List.h>
+
+// The cpus this process may run on and how they're laid out in cores,
+// packages and NUMA nodes. Read once from sysfs on Linux, elsewhere every
+// cpu is its own core on a single node.
+class CpuTopology
+{
+public:
+    struct Cpu
+    {
+        int id, core, package, node;
+    };
+
+    static const CpuTopology& instance();
+
+    const List<Cpu>& cpus() const { return mCpus; }
+    int cpuCount() const { return mCpus.size(); }
+    int nodeCount() const { return mNodeCount; }
+    List<int> nodeCpus(int node) const;
+
+    // Cpu ids in the order threads should be placed. Compact fills one
+    // node, and each core's hyperthreads, before moving on. Scatter
+    // spreads over nodes and packages first and doubles up on a core last.
+    List<int> compactOrder() const;
+    List<int> scatterOrder() const;
+
+private:
+    CpuTopology();
+
+    List<Cpu> mCpus;
+    int mNodeCount;
+};
+
+#endif
@@ -1,9 +1,11 @@
 #include "CpuUsage.h"
 #include "Rct.h"
-#include <thread>
 #include <mutex>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #ifdef OS_Darwin
 #include <sys/sysctl.h>
 #include <sys/types.h>
@@ -17,7 +19,6 @@
 struct CpuData
 {
     std::mutex mutex;
-    std::thread thread;
 
     uint32_t lastUsage;
     uint64_t lastTime;
@@ -68,38 +69,6 @@ static int64_t currentUsage()
 #endif
 }
 
-static void collectData()
-{
-    for (;;) {
-        const int64_t usage = currentUsage();
-        if (usage == -1)
-            break;
-        const uint64_t time = Rct::monoMs();
-
-        {
-            std::lock_guard<std::mutex> locker(sData.mutex);
-            assert(sData.lastTime < time);
-            if (sData.lastTime > 0) {
-                // did we wrap? if so, make load be 1 for now
-                if (sData.lastUsage > usage) {
-                    sData.usage = 0;
-                } else {
-#if defined(OS_Linux) || defined(OS_Darwin)
-                    const uint32_t deltaUsage = usage - sData.lastUsage;
-                    const uint64_t deltaTime = time - sData.lastTime;
-                    const float timeRatio = deltaTime / (SLEEP_TIME / 1000);
-                    sData.usage = (deltaUsage / sData.hz / sData.cores) / timeRatio;
-#endif
-                }
-            }
-            sData.lastUsage = usage;
-            sData.lastTime = time;
-        }
-
-        usleep(SLEEP_TIME);
-    }
-}
-
 float CpuUsage::usage()
 {
     std::call_once(sFlag, []() {
@@ -111,9 +80,183 @@ float CpuUsage::usage()
             sData.hz = sysconf(_SC_CLK_TCK);
             sData.cores = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
-            sData.thread = std::thread(collectData);
         });
 
     std::lock_guard<std::mutex> locker(sData.mutex);
+    const uint64_t time = Rct::monoMs();
+    if (sData.lastTime && time - sData.lastTime < SLEEP_TIME / 1000)
+        return 1. - sData.usage;
+    const int64_t usage = currentUsage();
+    if (usage == -1)
+        return 1. - sData.usage;
+    if (sData.lastTime > 0) {
+        // did we wrap? if so, make load be 1 for now
+        if (sData.lastUsage > usage) {
+            sData.usage = 0;
+        } else {
+#if defined(OS_Linux) || defined(OS_Darwin)
+            const uint32_t deltaUsage = usage - sData.lastUsage;
+            const uint64_t deltaTime = time - sData.lastTime;
+            const float timeRatio = deltaTime / (SLEEP_TIME / 1000.f);
+            sData.usage = (deltaUsage / sData.hz / sData.cores) / timeRatio;
+#endif
+        }
+    }
+    sData.lastUsage = usage;
+    sData.lastTime = time;
     return 1. - sData.usage;
 }
+
+static inline uint64_t toUs(const timeval &tv)
+{
+    return (static_cast<uint64_t>(tv.tv_sec) * 1000000) + tv.tv_usec;
+}
+
+static inline uint64_t toUs(const timespec &ts)
+{
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+uint64_t CpuUsage::processTime()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+    return toUs(usage.ru_utime) + toUs(usage.ru_stime);
+}
+
+uint64_t CpuUsage::threadTime()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    timespec ts;
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return toUs(ts);
+#endif
+    return 0;
+}
+
+// other threads' cpu clocks can be read where there's pthread_getcpuclockid
+#if defined(OS_Linux) || defined(OS_FreeBSD)
+#define HAVE_THREAD_CPU_CLOCK
+#endif
+
+struct RegisteredThread
+{
+    String name;
+    pthread_t thread;
+#ifdef HAVE_THREAD_CPU_CLOCK
+    clockid_t clock;
+#endif
+    int refs;
+};
+
+static std::mutex sThreadsMutex;
+static List<RegisteredThread> sThreads;
+
+static inline int indexOfThread(pthread_t thread)
+{
+    for (int i = 0; i < sThreads.size(); ++i) {
+        if (pthread_equal(sThreads.at(i).thread, thread))
+            return i;
+    }
+    return -1;
+}
+
+void CpuUsage::registerThread(const String &name)
+{
+    const pthread_t self = pthread_self();
+    std::lock_guard<std::mutex> lock(sThreadsMutex);
+    const int idx = indexOfThread(self);
+    if (idx != -1) {
+        ++sThreads[idx].refs;
+        return;
+    }
+    RegisteredThread thread;
+    thread.name = name;
+    thread.thread = self;
+#ifdef HAVE_THREAD_CPU_CLOCK
+    if (pthread_getcpuclockid(self, &thread.clock))
+        return;
+#endif
+    thread.refs = 1;
+    sThreads.append(thread);
+}
+
+void CpuUsage::unregisterThread()
+{
+    std::lock_guard<std::mutex> lock(sThreadsMutex);
+    const int idx = indexOfThread(pthread_self());
+    if (idx != -1 && !--sThreads[idx].refs)
+        sThreads.removeAt(idx);
+}
+
+void CpuUsage::setThreadName(pthread_t thread, const String &name)
+{
+    std::lock_guard<std::mutex> lock(sThreadsMutex);
+    const int idx = indexOfThread(thread);
+    if (idx != -1)
+        sThreads[idx].name = name;
+}
+
+List<CpuUsage::ThreadTime> CpuUsage::threadTimes()
+{
+    std::lock_guard<std::mutex> lock(sThreadsMutex);
+    List<ThreadTime> ret;
+    ret.reserve(sThreads.size());
+    for (const RegisteredThread &thread : sThreads) {
+        ThreadTime time = { thread.name, thread.thread, 0 };
+#ifdef HAVE_THREAD_CPU_CLOCK
+        timespec ts;
+        if (!clock_gettime(thread.clock, &ts))
+            time.time = toUs(ts);
+#endif
+        ret.append(time);
+    }
+    return ret;
+}
+
+CpuUsage::CpuUsage(int interval)
+    : mLastTime(Rct::monoUs()), mLastProcessTime(processTime()), mLastThreadTimes(threadTimes()),
+      mProcessUsage(0), mTimer(interval)
+{
+    mTimer.timeout().connect([this](Timer *) { sample(); });
+}
+
+void CpuUsage::sample()
+{
+    const uint64_t time = Rct::monoUs();
+    const uint64_t elapsed = time - mLastTime;
+    if (!elapsed)
+        return;
+    const uint64_t process = processTime();
+    List<ThreadTime> threads = threadTimes();
+    mProcessUsage = static_cast<float>(process - mLastProcessTime) / elapsed;
+    mThreadUsage.clear();
+    mThreadUsage.reserve(threads.size());
+    for (const ThreadTime &thread : threads) {
+        ThreadUsage usage = { thread.name, thread.thread, 0 };
+        // threads that registered since the last sample start out idle
+        for (const ThreadTime &last : mLastThreadTimes) {
+            if (pthread_equal(last.thread, thread.thread)) {
+                if (thread.time >= last.time)
+                    usage.usage = static_cast<float>(thread.time - last.time) / elapsed;
+                break;
+            }
+        }
+        mThreadUsage.append(usage);
+    }
+    mLastTime = time;
+    mLastProcessTime = process;
+    mLastThreadTimes = std::move(threads);
+    mSampled(this);
+}
+
+float CpuUsage::threadUsage(const String &prefix) const
+{
+    float ret = 0;
+    for (const ThreadUsage &thread : mThreadUsage) {
+        if (thread.name.startsWith(prefix))
+            ret += thread.usage;
+    }
+    return ret;
+}
@@ -1,19 +1,72 @@
 #ifndef CPUUSAGE_H
 #define CPUUSAGE_H
 
+#include <rct/List.h>
+#include <rct/SignalSlot.h>
+#include <rct/String.h>
+#include <rct/Timer.h>
 #include <cstdint>
-
-// CPU usage over the last couple of seconds, range from 0 (idle) to 1 (100%)
+#include <pthread.h>
 
 class CpuUsage
 {
 public:
+    // CPU usage of the machine over the last couple of seconds, range from
+    // 0 (idle) to 1 (100%). Sampled when it's called, at most once a second.
     static float usage();
 
+    // Cpu time, user and system, in microseconds, that this process and the
+    // calling thread have used
+    static uint64_t processTime();
+    static uint64_t threadTime();
+
+    // Registered threads can be sampled from other threads, ThreadPool and
+    // EventLoop threads register themselves. Registering again under the
+    // same name nests, the thread is taken off on the last unregister.
+    static void registerThread(const String &name);
+    static void unregisterThread();
+    static void setThreadName(pthread_t thread, const String &name);
+
+    struct ThreadTime
+    {
+        String name;
+        pthread_t thread;
+        // as in threadTime(), 0 where a thread's cpu clock can't be read
+        // from another thread
+        uint64_t time;
+    };
+    static List<ThreadTime> threadTimes();
+
+    // Samples the process and the registered threads every interval ms on
+    // the current EventLoop, usage in these is in cpus, 1 for one that was
+    // busy the whole interval
+    CpuUsage(int interval);
+
+    struct ThreadUsage
+    {
+        String name;
+        pthread_t thread;
+        float usage;
+    };
+    float processUsage() const { return mProcessUsage; }
+    const List<ThreadUsage> &threadUsage() const { return mThreadUsage; }
+    // Summed over the threads whose names start with prefix
+    float threadUsage(const String &prefix) const;
+
+    // Samples right away rather than on the timer
+    void sample();
+    Signal<std::function<void(CpuUsage *)> > &sampled() { return mSampled; }
+
 private:
-    CpuUsage() = delete;
     CpuUsage(const CpuUsage&) = delete;
     CpuUsage& operator=(const CpuUsage&) = delete;
+
+    uint64_t mLastTime, mLastProcessTime;
+    List<ThreadTime> mLastThreadTimes;
+    float mProcessUsage;
+    List<ThreadUsage> mThreadUsage;
+    Signal<std::function<void(CpuUsage *)> > mSampled;
+    Timer mTimer;
 };
 
 #endif
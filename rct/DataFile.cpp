@@ -0,0 +1,657 @@
+#include "DataFile.h"
+#include "Log.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Indexed files start with a Header and end with the section table. Every
+// section starts at a multiple of 8 so what's mapped can be used in place.
+static const char sMagic[8] = { 'R', 'C', 'T', 'D', 'A', 'T', 'A', '3' };
+
+struct Header
+{
+    enum Flag {
+        // the sections were written with Compressor::compressChunked()
+        Compressed = 0x1
+    };
+
+    char magic[8];
+    int32_t version;
+    uint32_t count;
+    uint64_t tableOffset;
+    uint64_t tableChecksum;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static const uint64_t sChecksumSeed = Rct::ChecksumSeed;
+
+// Writes to the file, and for Indexed files keeps the checksum of the
+// current section. The Serializer hands it what it has gathered, flush
+// that before looking at pos() or the checksum.
+class DataFileBuffer : public Serializer::Buffer
+{
+public:
+    DataFileBuffer(int fd, uint64_t *checksum)
+        : mFd(fd), mOffset(0), mChecksum(checksum), mCapture(0)
+    {}
+
+    virtual bool write(const void *data, int len) override
+    {
+        if (mCapture) {
+            mCapture->append(static_cast<const char *>(data), len);
+            return true;
+        }
+        if (mChecksum)
+            *mChecksum = Rct::checksum(data, len, *mChecksum);
+        return writeRaw(data, len);
+    }
+
+    virtual int pos() const override { return mCapture ? mCapture->size() : static_cast<int>(mOffset); }
+    uint64_t offset() const { return mOffset; }
+
+    // what's written goes to capture instead of the file until it's reset
+    void setCapture(String *capture) { mCapture = capture; }
+
+    bool writeRaw(const void *data, size_t len)
+    {
+        const char *bytes = static_cast<const char*>(data);
+        while (len) {
+            ssize_t w;
+            eintrwrap(w, ::write(mFd, bytes, len));
+            if (w <= 0)
+                return false;
+            bytes += w;
+            len -= w;
+            mOffset += w;
+        }
+        return true;
+    }
+
+    // Sections start at a multiple of 8
+    bool pad()
+    {
+        static const char zeroes[8] = { 0 };
+        const size_t padding = (8 - (mOffset % 8)) % 8;
+        return !padding || writeRaw(zeroes, padding);
+    }
+
+private:
+    const int mFd;
+    uint64_t mOffset;
+    uint64_t *mChecksum;
+    String *mCapture;
+};
+
+static bool pwriteAll(int fd, const void *data, size_t len, off_t offset)
+{
+    const char *bytes = static_cast<const char*>(data);
+    while (len) {
+        ssize_t w;
+        eintrwrap(w, ::pwrite(fd, bytes, len, offset));
+        if (w <= 0)
+            return false;
+        bytes += w;
+        len -= w;
+        offset += w;
+    }
+    return true;
+}
+
+bool DataFile::flush()
+{
+    bool ok = true;
+    if (mFormat == Indexed) {
+        ok = endSection() && mBuffer->pad();
+        String table;
+        {
+            Serializer serializer(table);
+            for (const Section &section : mSections)
+                serializer << section.name << section.offset << section.size << section.checksum;
+        }
+        Header header;
+        memcpy(header.magic, sMagic, sizeof(sMagic));
+        header.version = mVersion;
+        header.count = mSections.size();
+        header.tableOffset = mBuffer->offset();
+        header.tableChecksum = Rct::checksum(table.constData(), table.size());
+        header.flags = mCompressed ? Header::Compressed : 0;
+        header.reserved = 0;
+        ok = ok && mBuffer->writeRaw(table.constData(), table.size()) && pwriteAll(mFd, &header, sizeof(header), 0);
+    } else {
+        ok = mSerializer->flush();
+        String size;
+        {
+            Serializer serializer(size);
+            serializer << static_cast<int>(mBuffer->offset());
+        }
+        ok = ok && pwriteAll(mFd, size.constData(), size.size(), mSizeOffset);
+    }
+
+    if (ok && mSync && fsync(mFd))
+        ok = false;
+    if (::close(mFd))
+        ok = false;
+    mFd = -1;
+    delete mSerializer;
+    mSerializer = 0;
+    mBuffer = 0;
+    if (!ok) {
+        Path::rm(mTempFilePath);
+        mError = String::format<128>("write error: %d %s", errno, Rct::strerror().constData());
+        return false;
+    }
+    if (rename(mTempFilePath.constData(), mPath.constData())) {
+        Path::rm(mTempFilePath);
+        mError = String::format<128>("rename error: %d %s", errno, Rct::strerror().constData());
+        return false;
+    }
+    if (mSync) {
+        // the rename itself
+        const Path parent = mPath.parentDir();
+        int dir;
+        eintrwrap(dir, ::open(parent.isEmpty() ? "." : parent.constData(), O_RDONLY | O_CLOEXEC));
+        const bool synced = dir != -1 && !fsync(dir);
+        if (dir != -1)
+            ::close(dir);
+        if (!synced) {
+            mError = String::format<128>("directory sync error: %d %s", errno, Rct::strerror().constData());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DataFile::open(Mode mode)
+{
+    assert(mFd == -1);
+    if (mode == Write) {
+        if (!Path::mkdir(mPath.parentDir()))
+            return false;
+        mTempFilePath = mPath + "XXXXXX";
+        const int ret = mkstemp(&mTempFilePath[0]);
+        if (ret == -1) {
+            mError = String::format<128>("mkstemp failure %d (%s)", errno, Rct::strerror().constData());
+            return false;
+        }
+        mFd = ret;
+        mBuffer = new DataFileBuffer(mFd, mFormat == Indexed ? &mChecksum : 0);
+        mSerializer = new Serializer(std::unique_ptr<Serializer::Buffer>(mBuffer), Serializer::DefaultBufferSize);
+        if (mFormat == Indexed) {
+            // filled in by flush()
+            const Header header = Header();
+            mSections.clear();
+            mSection = -1;
+            return mBuffer->writeRaw(&header, sizeof(header));
+        }
+        operator<<(mVersion);
+        mSizeOffset = mSerializer->pos();
+        operator<<(static_cast<int>(0));
+        mSerializer->setFlags(mSerializerFlags);
+        return true;
+    } else if (mFormat == Indexed) {
+        return openIndexed();
+    } else {
+        // large files are mapped and deserialized in place
+        if (!mContents.open(mPath) || !mContents.size()) {
+            if (mPath.exists())
+                mError = "Read error " + mPath;
+            return false;
+        }
+        mDeserializer = new Deserializer(mContents.data(), mContents.size());
+        int version;
+        (*mDeserializer) >> version;
+        if (version != mVersion) {
+            mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
+                                         mVersion, version, mPath.constData());
+            return false;
+        }
+        int fs;
+        (*mDeserializer) >> fs;
+        if (fs != static_cast<int>(mContents.size())) {
+            mError = String::format<128>("%s seems to be corrupted. Size should have been %d but was %d",
+                                         mPath.constData(), static_cast<int>(mContents.size()), fs);
+            return false;
+        }
+        mDeserializer->setFlags(mSerializerFlags);
+        return true;
+    }
+}
+
+bool DataFile::openIndexed()
+{
+    // only what's used is read in
+    if (!mContents.open(mPath, MappedFile::None) || !mContents.size()) {
+        if (mPath.exists())
+            mError = "Read error " + mPath;
+        return false;
+    }
+    Header header;
+    if (mContents.size() < sizeof(header)) {
+        mError = String::format<128>("%s isn't an indexed data file", mPath.constData());
+        return false;
+    }
+    memcpy(&header, mContents.data(), sizeof(header));
+    if (memcmp(header.magic, sMagic, sizeof(sMagic))) {
+        mError = String::format<128>("%s isn't an indexed data file", mPath.constData());
+        return false;
+    }
+    if (header.version != mVersion) {
+        mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
+                                     mVersion, header.version, mPath.constData());
+        return false;
+    }
+    // the file says whether it's compressed, whatever the reader set
+    mCompressed = (header.flags & Header::Compressed);
+    const uint64_t size = mContents.size();
+    if (header.tableOffset < sizeof(header) || header.tableOffset > size
+        || size - header.tableOffset > INT_MAX
+        || Rct::checksum(mContents.data() + header.tableOffset, size - header.tableOffset) != header.tableChecksum) {
+        mError = String::format<128>("%s seems to be corrupted. The section table doesn't match its checksum",
+                                     mPath.constData());
+        return false;
+    }
+
+    mSections.clear();
+    mUncompressed.clear();
+    Deserializer deserializer(mContents.data() + header.tableOffset, size - header.tableOffset);
+    for (uint32_t i = 0; i < header.count; ++i) {
+        Section section;
+        deserializer >> section.name >> section.offset >> section.size >> section.checksum;
+        section.verified = false;
+        if (section.offset < sizeof(header) || section.offset > header.tableOffset
+            || section.size > header.tableOffset - section.offset) {
+            mError = String::format<128>("%s seems to be corrupted. Section %s is out of bounds",
+                                         mPath.constData(), section.name.constData());
+            mSections.clear();
+            return false;
+        }
+        mSections.append(section);
+    }
+    return true;
+}
+
+bool DataFile::beginSection(const String &name)
+{
+    assert(mFd != -1 && mFormat == Indexed);
+    if (!endSection() || !mBuffer->pad())
+        return false;
+    const Section section = { name, mBuffer->offset(), 0, 0, false };
+    mSections.append(section);
+    mSection = mSections.size() - 1;
+    mChecksum = sChecksumSeed;
+    if (mCompressed) {
+        mPending.clear();
+        mBuffer->setCapture(&mPending);
+    }
+    mSerializer->setFlags(mSerializerFlags);
+    return true;
+}
+
+bool DataFile::endSection()
+{
+    if (!mSerializer->flush())
+        return false;
+    if (mSection == -1)
+        return true;
+    Section &section = mSections[mSection];
+    mSection = -1;
+    if (mCompressed) {
+        mBuffer->setCapture(0);
+        String compressed;
+        const bool ok = Compressor::compressChunked(mCodec, mPending.constData(), mPending.size(), compressed, -1,
+                                                    Compressor::DefaultChunkSize, mPool);
+        mPending.clear();
+        if (!ok || !mBuffer->writeRaw(compressed.constData(), compressed.size()))
+            return false;
+        // the chunks have their own
+        mChecksum = 0;
+    }
+    section.size = mBuffer->offset() - section.offset;
+    section.checksum = mChecksum;
+    return true;
+}
+
+List<String> DataFile::sections() const
+{
+    List<String> ret;
+    ret.reserve(mSections.size());
+    for (const Section &section : mSections)
+        ret.append(section.name);
+    return ret;
+}
+
+int DataFile::indexOf(const String &name) const
+{
+    for (int i = 0; i < mSections.size(); ++i) {
+        if (mSections.at(i).name == name)
+            return i;
+    }
+    return -1;
+}
+
+bool DataFile::verify(Section &section)
+{
+    if (section.verified)
+        return true;
+    if (section.size > INT_MAX) {
+        mError = String::format<128>("Section %s of %s is too large", section.name.constData(), mPath.constData());
+        return false;
+    }
+    if (mCompressed) {
+        // uncompressChunked() checks the chunks
+        section.verified = true;
+        return true;
+    }
+    if (Rct::checksum(mContents.data() + section.offset, section.size) != section.checksum) {
+        mError = String::format<128>("%s seems to be corrupted. Section %s doesn't match its checksum",
+                                     mPath.constData(), section.name.constData());
+        return false;
+    }
+    section.verified = true;
+    return true;
+}
+
+bool DataFile::section(const String &name, const char *&data, int &size)
+{
+    assert(mFormat == Indexed);
+    const int idx = indexOf(name);
+    if (idx == -1) {
+        mError = String::format<128>("%s has no section %s", mPath.constData(), name.constData());
+        return false;
+    }
+    Section &section = mSections[idx];
+    if (!verify(section))
+        return false;
+    data = mContents.data() + section.offset;
+    size = static_cast<int>(section.size);
+    if (mCompressed) {
+        if (!mUncompressed.contains(idx)) {
+            String uncompressed;
+            if (!Compressor::uncompressChunked(data, size, uncompressed, mPool)) {
+                mError = String::format<128>("%s seems to be corrupted. Section %s can't be uncompressed",
+                                             mPath.constData(), section.name.constData());
+                return false;
+            }
+            mUncompressed[idx] = std::move(uncompressed);
+        }
+        const String &uncompressed = mUncompressed[idx];
+        data = uncompressed.constData();
+        size = uncompressed.size();
+    }
+    return true;
+}
+
+bool DataFile::seek(const String &name)
+{
+    const char *data;
+    int size;
+    if (!section(name, data, size))
+        return false;
+    delete mDeserializer;
+    mDeserializer = new Deserializer(data, size);
+    mDeserializer->setFlags(mSerializerFlags);
+    return true;
+}
+
+// Every journal segment starts with a JournalHeader, then come the records,
+// each a RecordHeader and size bytes of data.
+static const char sJournalMagic[8] = { 'R', 'C', 'T', 'J', 'R', 'N', 'L', '1' };
+
+struct JournalHeader
+{
+    char magic[8];
+    int32_t version;
+    uint32_t reserved;
+};
+
+struct RecordHeader
+{
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size) {
+        ssize_t w;
+        eintrwrap(w, ::write(fd, data, size));
+        if (w <= 0)
+            return false;
+        data += w;
+        size -= w;
+    }
+    return true;
+}
+
+DataJournal::DataJournal(const Path &path, int version)
+    : mPath(path), mVersion(version), mFd(-1), mSegment(0), mJournalSize(0), mCompacted(true)
+{
+}
+
+DataJournal::~DataJournal()
+{
+    close();
+}
+
+Path DataJournal::segmentPath(uint32_t segment) const
+{
+    return String::format<256>("%s.journal.%u", mPath.constData(), segment);
+}
+
+bool DataJournal::open(const Reader &snapshot, const Reader &record)
+{
+    close();
+    mError.clear();
+    // the segment the snapshot was written after
+    uint32_t covered = 0;
+    if (mPath.exists()) {
+        DataFile file(mPath, mVersion);
+        if (!file.open(DataFile::Read)) {
+            mError = file.error();
+            return false;
+        }
+        file >> covered;
+        if (snapshot)
+            snapshot(*file.mDeserializer);
+    }
+
+    // left behind if we died between the rename and the cleanup
+    for (uint32_t segment = covered; segment && Path::rm(segmentPath(segment)); --segment)
+        ;
+
+    uint32_t segment = covered + 1;
+    mJournalSize = 0;
+    while (segmentPath(segment).exists()) {
+        if (!replay(segment, record))
+            return false;
+        ++segment;
+    }
+    // append to the last one there is
+    return openSegment(segment > covered + 1 ? segment - 1 : segment);
+}
+
+bool DataJournal::replay(uint32_t segment, const Reader &record)
+{
+    const Path path = segmentPath(segment);
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        mError = file.error();
+        return false;
+    }
+    JournalHeader header;
+    if (file.size() < sizeof(header)) {
+        // nothing made it to disk, openSegment() starts it again
+        return true;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, sJournalMagic, sizeof(sJournalMagic)) || header.version != mVersion) {
+        mError = String::format<128>("%s isn't a journal of version %d", path.constData(), mVersion);
+        return false;
+    }
+    size_t pos = sizeof(header);
+    while (pos < file.size()) {
+        RecordHeader recordHeader;
+        if (file.size() - pos < sizeof(recordHeader))
+            break;
+        memcpy(&recordHeader, file.data() + pos, sizeof(recordHeader));
+        const char *data = file.data() + pos + sizeof(recordHeader);
+        if (file.size() - pos - sizeof(recordHeader) < recordHeader.size
+            || Rct::checksum(data, recordHeader.size) != recordHeader.checksum) {
+            break;
+        }
+        if (record) {
+            Deserializer deserializer(data, recordHeader.size);
+            record(deserializer);
+        }
+        pos += sizeof(recordHeader) + recordHeader.size;
+    }
+    if (pos < file.size()) {
+        warning() << "Dropping the last" << (file.size() - pos) << "bytes of" << path << "they were only partly written";
+        file.close();
+        if (truncate(path.constData(), pos)) {
+            mError = String::format<128>("Can't truncate %s (%d)", path.constData(), errno);
+            return false;
+        }
+    }
+    mJournalSize += pos - sizeof(header);
+    return true;
+}
+
+bool DataJournal::openSegment(uint32_t segment)
+{
+    const Path path = segmentPath(segment);
+    if (!Path::mkdir(path.parentDir(), Path::Recursive)) {
+        mError = String::format<128>("Can't create %s", path.parentDir().constData());
+        return false;
+    }
+    int fd;
+    eintrwrap(fd, ::open(path.constData(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+    if (fd == -1) {
+        mError = String::format<128>("Can't open %s (%d)", path.constData(), errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(JournalHeader))) {
+        JournalHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, sJournalMagic, sizeof(sJournalMagic));
+        header.version = mVersion;
+        if (ftruncate(fd, 0) || !writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header))) {
+            mError = String::format<128>("Can't write %s (%d)", path.constData(), errno);
+            ::close(fd);
+            return false;
+        }
+    }
+    if (mFd != -1)
+        ::close(mFd);
+    mFd = fd;
+    mSegment = segment;
+    return true;
+}
+
+void DataJournal::close()
+{
+    waitForCompaction();
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFd != -1) {
+        ::close(mFd);
+        mFd = -1;
+    }
+}
+
+bool DataJournal::appendRecord(const String &data)
+{
+    String buf(sizeof(RecordHeader) + data.size(), '\0');
+    RecordHeader header = { static_cast<uint32_t>(data.size()), 0, Rct::checksum(data.constData(), data.size()) };
+    memcpy(buf.data(), &header, sizeof(header));
+    if (!data.isEmpty())
+        memcpy(buf.data() + sizeof(header), data.constData(), data.size());
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFd == -1)
+        return false;
+    // one write so a record is either there or torn at the end
+    if (!writeAll(mFd, buf.constData(), buf.size())) {
+        mError = String::format<128>("Can't append to %s (%d)", segmentPath(mSegment).constData(), errno);
+        return false;
+    }
+    mJournalSize += buf.size();
+    return true;
+}
+
+bool DataJournal::sync()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+#ifdef __APPLE__
+    return mFd != -1 && !fsync(mFd);
+#else
+    return mFd != -1 && !fdatasync(mFd);
+#endif
+}
+
+bool DataJournal::compact(const Writer &writer, ThreadPool *pool)
+{
+    if (isCompacting())
+        return false;
+    waitForCompaction();
+
+    uint32_t covered;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFd == -1)
+            return false;
+        covered = mSegment;
+        // from here on records go to the next segment
+        if (!openSegment(covered + 1))
+            return false;
+        mJournalSize = 0;
+    }
+    if (!pool)
+        pool = ThreadPool::instance();
+    mCompaction = pool->submit([this, writer, covered]() {
+            DataFile file(mPath, mVersion);
+            // the segments it replaces go once it's on disk
+            file.setSync(true);
+            bool ok = file.open(DataFile::Write);
+            if (ok) {
+                file << covered;
+                writer(*file.mSerializer);
+                ok = file.flush();
+            }
+            if (!ok) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mError = file.error();
+                return false;
+            }
+            for (uint32_t segment = covered; segment && Path::rm(segmentPath(segment)); --segment)
+                ;
+            return true;
+        });
+    return true;
+}
+
+bool DataJournal::isCompacting() const
+{
+    return mCompaction.valid() && mCompaction.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool DataJournal::waitForCompaction()
+{
+    if (mCompaction.valid())
+        mCompacted = mCompaction.get();
+    return mCompacted;
+}
+
+String DataJournal::error() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mError;
+}
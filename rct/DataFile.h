@@ -1,99 +1,94 @@
 #ifndef DataFile_h
 #define DataFile_h
 
+#include <rct/Compressor.h>
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/MappedFile.h>
 #include <rct/Serializer.h>
 #include <rct/Path.h>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <stdio.h>
 
+class DataFileBuffer;
+class ThreadPool;
+
+// A file with a version and serialized contents, written to a temporary
+// file that replaces path on flush().
+//
+// Stream files are one blob that is read front to back. Indexed files are
+// made of named sections that are written one after the other and come
+// with a table of where they are and a checksum of each. Reading one maps
+// the file and only touches the table until a section is asked for, so a
+// reader pays for the sections it uses and nothing else.
 class DataFile
 {
 public:
-    DataFile(const Path &path, int version)
-        : mFile(0), mSizeOffset(-1), mSerializer(0), mDeserializer(0), mPath(path), mVersion(version)
+    enum Format {
+        Stream,
+        Indexed
+    };
+
+    DataFile(const Path &path, int version, Format format = Stream)
+        : mFd(-1), mSizeOffset(-1), mSerializer(0), mBuffer(0), mDeserializer(0), mPath(path), mVersion(version),
+          mFormat(format), mSection(-1), mSerializerFlags(0), mCompressed(false), mCodec(Compressor::Zlib), mPool(0),
+          mSync(false)
     {}
 
     ~DataFile()
     {
         delete mDeserializer;
-        if (mFile)
+        if (mFd != -1)
             flush();
     }
 
-    bool flush()
-    {
-        const int size = ftell(mFile);
-        fseek(mFile, mSizeOffset, SEEK_SET);
-        operator<<(size);
-
-        fclose(mFile);
-        mFile = 0;
-        delete mSerializer;
-        mSerializer = 0;
-        if (rename(mTempFilePath.constData(), mPath.constData())) {
-            Path::rm(mTempFilePath);
-            mError = String::format<128>("rename error: %d %s", errno, Rct::strerror().constData());
-            return false;
-        }
-        return true;
-    }
+    bool flush();
 
     enum Mode {
         Read,
         Write
     };
     String error() const { return mError; }
-    bool open(Mode mode)
+    // Serializer flags for the contents, set before open(). Readers have to
+    // use the same ones, so change the version along with them. Every
+    // section of an Indexed file has its own InternPaths table.
+    void setSerializerFlags(unsigned int flags) { mSerializerFlags = flags; }
+    unsigned int serializerFlags() const { return mSerializerFlags; }
+    // Indexed files, set before open(). Every section is held in memory
+    // until it ends and then written with Compressor::compressChunked() on
+    // pool, and uncompressed in parallel the first time it's read. The
+    // checksums of the chunks are checked then, instead of one over the
+    // whole section. The file's header records it, so readers don't need
+    // to set it, only to pick the pool to uncompress on.
+    void setCompression(Compressor::Codec codec, ThreadPool *pool = 0)
     {
-        assert(!mFile);
-        if (mode == Write) {
-            if (!Path::mkdir(mPath.parentDir()))
-                return false;
-            mTempFilePath = mPath + "XXXXXX";
-            const int ret = mkstemp(&mTempFilePath[0]);
-            if (ret == -1) {
-                mError = String::format<128>("mkstemp failure %d (%s)", errno, Rct::strerror().constData());
-                return false;
-            }
-            mFile = fdopen(ret, "w");
-            if (!mFile) {
-                mError = String::format<128>("fdopen failure %d (%s)", errno, Rct::strerror().constData());
-                close(ret);
-                return false;
-            }
-            mSerializer = new Serializer(mFile);
-            operator<<(mVersion);
-            mSizeOffset = ftell(mFile);
-            operator<<(static_cast<int>(0));
-            return true;
-        } else {
-            mContents = mPath.readAll();
-            if (mContents.isEmpty()) {
-                if (mPath.exists())
-                    mError = "Read error " + mPath;
-                return false;
-            }
-            mDeserializer = new Deserializer(mContents);
-            int version;
-            (*mDeserializer) >> version;
-            if (version != mVersion) {
-                mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
-                                             mVersion, version, mPath.constData());
-                return false;
-            }
-            int fs;
-            (*mDeserializer) >> fs;
-            if (fs != mContents.size()) {
-                mError = String::format<128>("%s seems to be corrupted. Size should have been %d but was %d",
-                                             mPath.constData(), mContents.size(), fs);
-                return false;
-            }
-            return true;
-        }
+        mCompressed = true;
+        mCodec = codec;
+        mPool = pool;
     }
+    bool isCompressed() const { return mCompressed; }
+    // With sync, flush() fsync()s the file before it's renamed into place
+    // and the directory after, so it's on disk once flush() returns
+    void setSync(bool sync) { mSync = sync; }
+    bool open(Mode mode);
+
+    // Indexed files. Writing, everything streamed in after beginSection()
+    // goes in that section, until the next one. Reading, seek() verifies a
+    // section's checksum and reads from its start, section() gives its raw
+    // bytes.
+    bool beginSection(const String &name);
+    List<String> sections() const;
+    bool hasSection(const String &name) const { return indexOf(name) != -1; }
+    bool seek(const String &name);
+    bool section(const String &name, const char *&data, int &size);
 
     template <typename T> DataFile &operator<<(const T &t)
     {
         assert(mSerializer);
+        if (mFormat == Indexed && mSection == -1)
+            beginSection(String());
         (*mSerializer) << t;
         return *this;
     }
@@ -104,13 +99,113 @@ public:
         return *this;
     }
 private:
-    FILE *mFile;
+    struct Section
+    {
+        String name;
+        uint64_t offset, size, checksum;
+        bool verified;
+    };
+
+    bool openIndexed();
+    bool endSection();
+    int indexOf(const String &name) const;
+    bool verify(Section &section);
+
+    int mFd;
     int mSizeOffset;
     Serializer *mSerializer;
+    // owned by mSerializer
+    DataFileBuffer *mBuffer;
     Deserializer *mDeserializer;
     Path mPath, mTempFilePath;
-    String mContents;
+    MappedFile mContents;
     String mError;
     const int mVersion;
+    const Format mFormat;
+    List<Section> mSections;
+    // the one being written
+    int mSection;
+    uint64_t mChecksum;
+    unsigned int mSerializerFlags;
+    bool mCompressed;
+    Compressor::Codec mCodec;
+    ThreadPool *mPool;
+    bool mSync;
+    // the contents of the section being written, or of the sections that
+    // have been read, when compressed
+    String mPending;
+    Map<int, String> mUncompressed;
+
+    DataFile(const DataFile &) = delete;
+    DataFile &operator=(const DataFile &) = delete;
+    friend class DataJournal;
+};
+
+// A snapshot in a DataFile at path and the changes made since, appended to
+// journal segments next to it, path.journal.<n>, one record at a time.
+// Saving a change costs the size of the change rather than the size of the
+// data. compact() writes a new snapshot on a ThreadPool while records go
+// to a new segment, and the segments it covers are removed once it's in
+// place. A record that was only partly written when the process died is
+// cut off the next time the journal is opened.
+class DataJournal
+{
+public:
+    DataJournal(const Path &path, int version);
+    ~DataJournal();
+
+    // Calls snapshot with the contents of the snapshot, if there is one,
+    // and record for every record appended after it, in order. Records are
+    // appended to the last segment from then on.
+    typedef std::function<void(Deserializer &deserializer)> Reader;
+    bool open(const Reader &snapshot, const Reader &record);
+    void close();
+    bool isOpen() const { return mFd != -1; }
+
+    template <typename T> bool append(const T &t)
+    {
+        String data;
+        {
+            Serializer serializer(data);
+            serializer << t;
+        }
+        return appendRecord(data);
+    }
+    bool appendRecord(const String &data);
+    // fdatasync() the current segment, append() leaves it to the kernel
+    bool sync();
+
+    // writer is called on pool, ThreadPool::instance() if none is given,
+    // and must serialize everything the records so far added up to without
+    // touching anything this thread changes meanwhile, usually a copy.
+    // Returns false if a compaction is already running.
+    typedef std::function<void(Serializer &serializer)> Writer;
+    bool compact(const Writer &writer, ThreadPool *pool = 0);
+    bool isCompacting() const;
+    // returns whether the last compaction succeeded
+    bool waitForCompaction();
+
+    // bytes appended since the last compaction started
+    uint64_t journalSize() const { return mJournalSize; }
+    String error() const;
+
+private:
+    Path segmentPath(uint32_t segment) const;
+    bool openSegment(uint32_t segment);
+    bool replay(uint32_t segment, const Reader &record);
+
+    const Path mPath;
+    const int mVersion;
+    int mFd;
+    // the one appended to
+    uint32_t mSegment;
+    uint64_t mJournalSize;
+    mutable std::mutex mMutex;
+    std::future<bool> mCompaction;
+    bool mCompacted;
+    String mError;
+
+    DataJournal(const DataJournal &) = delete;
+    DataJournal &operator=(const DataJournal &) = delete;
 };
 #endif
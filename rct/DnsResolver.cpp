@@ -0,0 +1,232 @@
+#include "DnsResolver.h"
+#include "EventLoop.h"
+#include "Hash.h"
+#include "List.h"
+#include "Rct.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string.h>
+#include <netdb.h>
+
+static bool parseNumeric(const String& host, DnsResolver::Address& address)
+{
+    address = SocketAddress::fromString(host);
+    return address.isValid();
+}
+
+static bool lookupHost(const String& host, DnsResolver::Address& address)
+{
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    address = SocketAddress();
+    if (getaddrinfo(host.constData(), NULL, &hints, &res) != 0)
+        return false;
+
+    for (addrinfo* p = res; p; p = p->ai_next) {
+        if (p->ai_family == AF_INET || p->ai_family == AF_INET6) {
+            address = SocketAddress(p->ai_addr, p->ai_addrlen);
+            break;
+        }
+    }
+    freeaddrinfo(res);
+    return address.isValid();
+}
+
+class DnsResolverPrivate
+{
+public:
+    DnsResolverPrivate()
+        : resolvedMs(60000), failedMs(5000), threads(0), idle(0)
+    {}
+
+    enum { MaxThreads = 4, MaxCacheSize = 1024 };
+
+    struct Entry
+    {
+        DnsResolver::Address address;
+        bool ok;
+        uint64_t expires;
+    };
+
+    struct Waiter
+    {
+        EventLoop::WeakPtr loop;
+        DnsResolver::Callback callback;
+    };
+
+    // callers hold mutex
+    DnsResolver::Result cached(const String& host, DnsResolver::Address& address)
+    {
+        Hash<String, Entry>::iterator it = cache.find(host);
+        if (it == cache.end())
+            return DnsResolver::Pending;
+        if (it->second.expires <= Rct::monoMs()) {
+            cache.erase(it);
+            return DnsResolver::Pending;
+        }
+        address = it->second.address;
+        return it->second.ok ? DnsResolver::Resolved : DnsResolver::Failed;
+    }
+
+    void store(const String& host, bool ok, const DnsResolver::Address& address)
+    {
+        const uint64_t now = Rct::monoMs();
+        if (cache.size() >= MaxCacheSize) {
+            for (Hash<String, Entry>::iterator it = cache.begin(); it != cache.end(); ) {
+                if (it->second.expires <= now) {
+                    it = cache.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (cache.size() >= MaxCacheSize)
+                cache.clear();
+        }
+        Entry& entry = cache[host];
+        entry.address = address;
+        entry.ok = ok;
+        entry.expires = now + (ok ? resolvedMs : failedMs);
+    }
+
+    void enqueue(const String& host)
+    {
+        queue.push_back(host);
+        if (!idle && threads < MaxThreads) {
+            ++threads;
+            // detached so that a lookup that hangs can't hold up exit,
+            // the resolver is never destroyed
+            std::thread(&DnsResolverPrivate::work, this).detach();
+        } else {
+            cond.notify_one();
+        }
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            while (queue.empty()) {
+                ++idle;
+                cond.wait(lock);
+                --idle;
+            }
+            const String host = queue.front();
+            queue.pop_front();
+            lock.unlock();
+
+            DnsResolver::Address address;
+            const bool ok = lookupHost(host, address);
+
+            lock.lock();
+            store(host, ok, address);
+            List<Waiter> waiters;
+            Hash<String, List<Waiter> >::iterator it = pending.find(host);
+            if (it != pending.end()) {
+                waiters = std::move(it->second);
+                pending.erase(it);
+            }
+            lock.unlock();
+            for (Waiter& waiter : waiters) {
+                if (EventLoop::SharedPtr loop = waiter.loop.lock()) {
+                    DnsResolver::Callback callback = std::move(waiter.callback);
+                    loop->callLater([callback, ok, address]() { callback(ok, address); });
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    Hash<String, Entry> cache;
+    Hash<String, List<Waiter> > pending;
+    std::deque<String> queue;
+    int resolvedMs, failedMs;
+    int threads, idle;
+};
+
+DnsResolver::DnsResolver()
+    : priv(new DnsResolverPrivate)
+{
+}
+
+DnsResolver::~DnsResolver()
+{
+}
+
+DnsResolver* DnsResolver::instance()
+{
+    static DnsResolver* resolver = new DnsResolver;
+    return resolver;
+}
+
+DnsResolver::Result DnsResolver::lookup(const String& host, Address& address)
+{
+    if (parseNumeric(host, address))
+        return Resolved;
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    return priv->cached(host, address);
+}
+
+bool DnsResolver::resolve(const String& host, Address& address)
+{
+    switch (lookup(host, address)) {
+    case Resolved:
+        return true;
+    case Failed:
+        return false;
+    case Pending:
+        break;
+    }
+    const bool ok = lookupHost(host, address);
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    priv->store(host, ok, address);
+    return ok;
+}
+
+void DnsResolver::resolve(const String& host, Callback&& callback)
+{
+    Address address;
+    if (parseNumeric(host, address)) {
+        callback(true, address);
+        return;
+    }
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        const bool ok = resolve(host, address);
+        callback(ok, address);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(priv->mutex);
+    const Result result = priv->cached(host, address);
+    if (result != Pending) {
+        lock.unlock();
+        callback(result == Resolved, address);
+        return;
+    }
+    List<DnsResolverPrivate::Waiter>& waiters = priv->pending[host];
+    waiters.append(DnsResolverPrivate::Waiter());
+    waiters.last().loop = loop;
+    waiters.last().callback = std::move(callback);
+    if (waiters.size() == 1)
+        priv->enqueue(host);
+}
+
+void DnsResolver::setCacheTime(int resolvedMs, int failedMs)
+{
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    priv->resolvedMs = resolvedMs;
+    priv->failedMs = failedMs;
+}
+
+void DnsResolver::clearCache()
+{
+    std::lock_guard<std::mutex> lock(priv->mutex);
+    priv->cache.clear();
+}
@@ -0,0 +1,55 @@
+#ifndef DnsResolver_h
+#define DnsResolver_h
+
+#include <rct/SocketAddress.h>
+#include <rct/String.h>
+#include <functional>
+#include <memory>
+
+class DnsResolverPrivate;
+
+// Host name lookups that don't block the event loop. getaddrinfo() runs on
+// the resolver's own threads and the result is handed back on the loop
+// that asked for it. Answers are cached, failures for a shorter time, and
+// concurrent lookups of the same name share one getaddrinfo() call.
+class DnsResolver
+{
+public:
+    typedef SocketAddress Address;
+
+    static DnsResolver* instance();
+
+    enum Result {
+        Resolved,
+        Failed,
+        Pending
+    };
+    // Numeric addresses and cached names, never blocks. Pending means
+    // the name has to be looked up.
+    Result lookup(const String& host, Address& address);
+
+    // Blocks the calling thread, for blocking sockets
+    bool resolve(const String& host, Address& address);
+
+    // callback is called on the calling thread's EventLoop, or right away
+    // if the answer is known. Without an EventLoop this blocks.
+    typedef std::function<void(bool, const Address&)> Callback;
+    void resolve(const String& host, Callback&& callback);
+
+    // getaddrinfo() doesn't report record TTLs so this is how long answers
+    // are trusted. Defaults are 60 seconds, 5 for failures.
+    void setCacheTime(int resolvedMs, int failedMs);
+    void clearCache();
+
+private:
+    DnsResolver();
+    ~DnsResolver();
+
+    std::unique_ptr<DnsResolverPrivate> priv;
+    friend class DnsResolverPrivate;
+
+    DnsResolver(const DnsResolver&) = delete;
+    DnsResolver& operator=(const DnsResolver&) = delete;
+};
+
+#endif
@@ -1,7 +1,13 @@
 #include "EventLoop.h"
+#include "CpuUsage.h"
+#include "Futex.h"
 #include "SocketClient.h"
 #include "Timer.h"
 #include "Rct.h"
+#include "MemoryMonitor.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Value.h"
 #include <algorithm>
 #include <atomic>
 #include <set>
@@ -17,9 +23,16 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <stdlib.h>
-#ifdef HAVE_MACH_ABSOLUTE_TIME
-#  include <mach/mach.h>
-#  include <mach/mach_time.h>
+#include <limits.h>
+#include <poll.h>
+#ifdef HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
+#ifdef RCT_EVENTLOOP_TIMERFD
+#  include <sys/timerfd.h>
+#endif
+#ifdef RCT_EVENTLOOP_IO_URING
+#  include "IoUring.h"
 #endif
 #if defined(RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD) && RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD > 0
 #  include "StopWatch.h"
@@ -36,6 +49,18 @@
 #define CALLBACK(op) op
 #endif
 
+// runs op and records how long it took when the loop keeps metrics
+#define TIMED(histogram, op)                                        \
+    do {                                                            \
+        if (stats) {                                                \
+            const uint64_t started = Rct::monoUs();                 \
+            op;                                                     \
+            stats->histogram.add(Rct::monoUs() - started);          \
+        } else {                                                    \
+            op;                                                     \
+        }                                                           \
+    } while (0)
+
 // EPOLL compitability hacks.
 // (see: https://github.com/kr/beanstalkd/issues/92).
 #if defined(HAVE_EPOLL)
@@ -55,6 +80,10 @@
 EventLoop::WeakPtr EventLoop::mainLoop;
 std::mutex EventLoop::mainMutex;
 static std::atomic<int> mainEventPipe;
+#ifdef HAVE_EVENTFD
+// an eventfd only carries a counter so the signal handler flags the quit here
+static volatile sig_atomic_t signalQuit = 0;
+#endif
 static std::once_flag mainOnce;
 static pthread_key_t eventLoopKey;
 
@@ -75,20 +104,47 @@ static EventLoop::WeakPtr& localEventLoop()
 
 static void signalHandler(int /*sig*/)
 {
-    char b = 'q';
     int w;
     const int pipe = mainEventPipe;
-    if (pipe != -1)
+    if (pipe != -1) {
+#ifdef HAVE_EVENTFD
+        signalQuit = 1;
+        const uint64_t b = 1;
+        eintrwrap(w, ::write(pipe, &b, sizeof(b)));
+#else
+        char b = 'q';
         eintrwrap(w, ::write(pipe, &b, 1));
+#endif
+    }
 }
 
+struct EventLoop::Metrics
+{
+    Metrics() : started(Rct::monoUs()), iterations(0), posted(0), busyPollHits(0), busyPollMisses(0) {}
+
+    const uint64_t started;
+    std::atomic<uint64_t> iterations, posted;
+    Histogram events, sockets, timers, timerLag, pollBatch, pollWait;
+    // busy polling, the time of every spin and whether it found something
+    Histogram busyPoll;
+    std::atomic<uint64_t> busyPollHits, busyPollMisses;
+};
+
 EventLoop::EventLoop()
-    :
+    : postedBacklog(false), busyPollTime(0), socketBusyPollTime(0), spinBudget(0),
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     pollFd(-1),
+#endif
+#if defined(RCT_EVENTLOOP_TIMERFD)
+    timerFd(-1), timerFdWhen(0),
 #endif
     nextTimerId(0), stop(false), timeout(false), flgs(0), inactivityTimeout(0)
 {
+    for (int i = 0; i < PriorityCount; ++i)
+        postedEvents[i].store(0, std::memory_order_relaxed);
+    postLimits[High] = 0;
+    postLimits[Normal] = DefaultNormalBudget;
+    postLimits[Idle] = DefaultIdleBudget;
     std::call_once(mainOnce, [](){
             mainEventPipe = -1;
             pthread_key_create(&eventLoopKey, 0);
@@ -105,8 +161,20 @@ void EventLoop::init(unsigned int flags)
 {
     std::lock_guard<std::mutex> locker(mutex);
     flgs = flags;
+    eventPool.reset(new EventPool);
+    if (flgs & EnableTimerWheel)
+        timerWheel.reset(new TimerWheel);
+    if (flgs & EnableMetrics)
+        stats.reset(new Metrics);
 
     threadId = std::this_thread::get_id();
+#if defined(HAVE_EVENTFD)
+    int e = eventPipe[0] = eventPipe[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (e == -1) {
+        cleanup();
+        return;
+    }
+#else
     int e = ::pipe(eventPipe);
     if (e == -1) {
         eventPipe[0] = -1;
@@ -118,6 +186,7 @@ void EventLoop::init(unsigned int flags)
         cleanup();
         return;
     }
+#endif
 
 #if defined(HAVE_EPOLL)
     pollFd = epoll_create1(0);
@@ -143,6 +212,28 @@ void EventLoop::init(unsigned int flags)
     ev.events = EPOLLIN | EPOLLET;
     ev.data.fd = eventPipe[0];
     e = epoll_ctl(pollFd, EPOLL_CTL_ADD, eventPipe[0], &ev);
+#  if defined(RCT_EVENTLOOP_TIMERFD)
+    if (e != -1) {
+        timerFd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd != -1) {
+            ev.data.fd = timerFd;
+            e = epoll_ctl(pollFd, EPOLL_CTL_ADD, timerFd, &ev);
+        }
+    }
+#  endif
+#  if defined(RCT_EVENTLOOP_IO_URING)
+    if (e != -1 && (flgs & EnableIoUring)) {
+        uring.reset(new IoUring);
+        if (uring->init()) {
+            // level triggered, readable for as long as there are completions
+            ev.events = EPOLLIN;
+            ev.data.fd = uring->fd();
+            e = epoll_ctl(pollFd, EPOLL_CTL_ADD, uring->fd(), &ev);
+        } else {
+            uring.reset();
+        }
+    }
+#  endif
 #elif defined(HAVE_KQUEUE)
     memset(&ev, '\0', sizeof(struct kevent));
     ev.ident = eventPipe[0];
@@ -191,16 +282,30 @@ void EventLoop::cleanup()
     std::lock_guard<std::mutex> locker(mutex);
     localEventLoop().reset();
 
-    while (!events.empty()) {
-        delete events.front();
-        events.pop();
+    for (int i = 0; i < PriorityCount; ++i) {
+        Event* event = postedEvents[i].exchange(0);
+        while (event) {
+            Event* next = event->next;
+            destroyEvent(event);
+            event = next;
+        }
+        event = postedQueues[i].head;
+        while (event) {
+            Event* next = event->next;
+            destroyEvent(event);
+            event = next;
+        }
+        postedQueues[i].head = postedQueues[i].tail = 0;
     }
+    postedBacklog = false;
 
     for (auto timer : timersById) {
         delete timer;
     }
     timersById.clear();
     timersByTime.clear();
+    if (timerWheel)
+        timerWheel->clear();
     nextTimerId = 0;
 
     if (flgs & (EnableSigIntHandler | EnableSigTermHandler)) {
@@ -221,10 +326,17 @@ void EventLoop::cleanup()
     if (pollFd != -1)
         ::close(pollFd);
 #endif
+#if defined(RCT_EVENTLOOP_TIMERFD)
+    if (timerFd != -1)
+        ::close(timerFd);
+#endif
+#if defined(RCT_EVENTLOOP_IO_URING)
+    uring.reset();
+#endif
 
     if (eventPipe[0] != -1)
         ::close(eventPipe[0]);
-    if (eventPipe[1] != -1)
+    if (eventPipe[1] != -1 && eventPipe[1] != eventPipe[0])
         ::close(eventPipe[1]);
     if (flgs & MainEventLoop)
         mainLoop.reset();
@@ -251,11 +363,51 @@ void EventLoop::error(const char* err)
     abort();
 }
 
-void EventLoop::post(Event* event)
+void EventLoop::post(Event* event, Priority priority)
+{
+    std::atomic<Event*>& stack = postedEvents[priority];
+    Event* head = stack.load(std::memory_order_relaxed);
+    do {
+        event->next = head;
+    } while (!stack.compare_exchange_weak(head, event, std::memory_order_release,
+                                          std::memory_order_relaxed));
+    if (stats)
+        stats->posted.fetch_add(1, std::memory_order_relaxed);
+    // Only the post that makes the queue non-empty needs to wake the
+    // loop, everything after that is picked up by the same drain.
+    if (!head)
+        wakeup();
+}
+
+void EventLoop::setPostBudget(Priority priority, unsigned int count)
 {
+    if (priority != High)
+        postLimits[priority] = count;
+}
+
+void EventLoop::setBusyPoll(int us, int socketUs)
+{
+    spinBudget = static_cast<uint64_t>(std::max(us, 0));
+    busyPollTime.store(spinBudget, std::memory_order_relaxed);
     std::lock_guard<std::mutex> locker(mutex);
-    events.push(event);
-    wakeup();
+    const bool changed = socketBusyPollTime != std::max(socketUs, 0);
+    socketBusyPollTime = std::max(socketUs, 0);
+    if (changed) {
+        for (const auto& socket : sockets)
+            applySocketBusyPoll(socket.first);
+    }
+}
+
+void EventLoop::applySocketBusyPoll(int fd)
+{
+#ifdef SO_BUSY_POLL
+    // raising it past net.core.busy_read takes CAP_NET_ADMIN, and fd
+    // needn't be a socket, it's a hint either way
+    const int us = socketBusyPollTime;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#else
+    (void)fd;
+#endif
 }
 
 void EventLoop::wakeup()
@@ -263,9 +415,14 @@ void EventLoop::wakeup()
     if (std::this_thread::get_id() == threadId)
         return;
 
-    char b = 'w';
     int w;
+#if defined(HAVE_EVENTFD)
+    const uint64_t b = 1;
+    eintrwrap(w, ::write(eventPipe[1], &b, sizeof(b)));
+#else
+    char b = 'w';
     eintrwrap(w, ::write(eventPipe[1], &b, 1));
+#endif
 }
 
 void EventLoop::quit()
@@ -275,52 +432,150 @@ void EventLoop::quit()
     wakeup();
 }
 
+Value EventLoop::metrics() const
+{
+    Value ret;
+    if (!stats)
+        return ret;
+    const uint64_t now = Rct::monoUs();
+    ret["time"] = now;
+    ret["uptime"] = now - stats->started;
+    ret["iterations"] = stats->iterations.load(std::memory_order_relaxed);
+    ret["posted"] = stats->posted.load(std::memory_order_relaxed);
+    ret["events"] = stats->events.toValue();
+    ret["sockets"] = stats->sockets.toValue();
+    ret["timers"] = stats->timers.toValue();
+    ret["timerLag"] = stats->timerLag.toValue();
+    ret["pollBatch"] = stats->pollBatch.toValue();
+    ret["pollWait"] = stats->pollWait.toValue();
+    if (busyPollTime.load(std::memory_order_relaxed)) {
+        // spinning is kept apart from pollWait and the callbacks
+        ret["busyPoll"] = stats->busyPoll.toValue();
+        ret["busyPollHits"] = stats->busyPollHits.load(std::memory_order_relaxed);
+        ret["busyPollMisses"] = stats->busyPollMisses.load(std::memory_order_relaxed);
+    }
+    ret["memory"] = MemoryMonitor::metrics();
+    std::lock_guard<std::mutex> locker(mutex);
+    ret["socketCount"] = static_cast<uint64_t>(sockets.size());
+    ret["timerCount"] = static_cast<uint64_t>(timersById.size());
+    return ret;
+}
+
+void EventLoop::takePostedEvents(Priority priority)
+{
+    Event* event = postedEvents[priority].exchange(0, std::memory_order_acquire);
+    if (!event)
+        return;
+    // reverse into posting order
+    Event* ordered = 0;
+    Event* last = event;
+    while (event) {
+        Event* next = event->next;
+        event->next = ordered;
+        ordered = event;
+        event = next;
+    }
+    PostedQueue& queue = postedQueues[priority];
+    if (queue.tail) {
+        queue.tail->next = ordered;
+    } else {
+        queue.head = ordered;
+    }
+    queue.tail = last;
+}
+
+// Runs up to budget events of the lane, all of them for 0, and the High
+// ones that are posted in between. Those don't count against the budget.
+// Returns how many ran.
+unsigned int EventLoop::runPostedEvents(Priority priority, unsigned int budget)
+{
+    PostedQueue& queue = postedQueues[priority];
+    unsigned int count = 0, high = 0;
+    for (;;) {
+        if (!queue.head) {
+            takePostedEvents(priority);
+            if (!queue.head)
+                break;
+        }
+        if (budget && count >= budget)
+            break;
+        if (priority != High && postedEvents[High].load(std::memory_order_relaxed))
+            high += runPostedEvents(High, 0);
+        Event* event = queue.head;
+        queue.head = event->next;
+        if (!queue.head)
+            queue.tail = 0;
+        {
+            RCT_TRACE("Event::exec");
+            TIMED(events, event->exec());
+        }
+        destroyEvent(event);
+        ++count;
+    }
+    return count + high;
+}
+
 inline bool EventLoop::sendPostedEvents()
 {
-    std::unique_lock<std::mutex> locker(mutex);
-    if (events.empty())
-        return false;
-    while (!events.empty()) {
-        auto event = events.front();
-        events.pop();
-        locker.unlock();
-        event->exec();
+    unsigned int count = runPostedEvents(High, 0);
+    count += runPostedEvents(Normal, postLimits[Normal]);
+    count += runPostedEvents(Idle, postLimits[Idle]);
+    // what's queued is left for the next round, after the sockets
+    postedBacklog = postedQueues[Normal].head || postedQueues[Idle].head;
+    return count > 0;
+}
+
+void EventLoop::destroyEvent(Event* event)
+{
+    if (eventPool && eventPool->owns(event)) {
+        event->~Event();
+        eventPool->release(event);
+    } else {
         delete event;
-        locker.lock();
     }
-    return true;
 }
 
-// milliseconds
-static inline uint64_t currentTime()
+EventLoop::EventPool::EventPool()
+    : blocks(new Block[Blocks]), head(1)
 {
-#if defined(HAVE_CLOCK_MONOTONIC_RAW) || defined(HAVE_CLOCK_MONOTONIC)
-    timespec now;
-#if defined(HAVE_CLOCK_MONOTONIC_RAW)
-    if (clock_gettime(CLOCK_MONOTONIC_RAW, &now) == -1)
-        return 0;
-#elif defined(HAVE_CLOCK_MONOTONIC)
-    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
-        return 0;
-#endif
-    const uint64_t t = (now.tv_sec * 1000LLU) + (now.tv_nsec / 1000000LLU);
-#elif defined(HAVE_MACH_ABSOLUTE_TIME)
-    static mach_timebase_info_data_t info;
-    static bool first = true;
-    uint64_t t = mach_absolute_time();
-    if (first) {
-        first = false;
-        mach_timebase_info(&info);
-    }
-    t = t * info.numer / (info.denom * 1000); // microseconds
-    t /= 1000; // milliseconds
-#else
-#error No time getting mechanism
-#endif
-    return t;
+    for (uint32_t i = 0; i < Blocks; ++i)
+        blocks[i].next = (i + 1 < Blocks) ? i + 2 : 0;
+}
+
+EventLoop::EventPool::~EventPool()
+{
+    delete[] blocks;
+}
+
+void* EventLoop::EventPool::allocate()
+{
+    uint64_t current = head.load(std::memory_order_acquire);
+    for (;;) {
+        const uint32_t index = static_cast<uint32_t>(current);
+        if (!index)
+            return 0;
+        // may be stale if someone else got the block first, the tag
+        // makes the exchange fail in that case
+        const uint64_t next = ((current >> 32) + 1) << 32 | blocks[index - 1].next;
+        if (head.compare_exchange_weak(current, next, std::memory_order_acquire, std::memory_order_acquire))
+            return blocks[index - 1].data;
+    }
+}
+
+void EventLoop::EventPool::release(void* ptr)
+{
+    Block* block = static_cast<Block*>(ptr);
+    const uint32_t index = (block - blocks) + 1;
+    uint64_t current = head.load(std::memory_order_relaxed);
+    for (;;) {
+        block->next = static_cast<uint32_t>(current);
+        const uint64_t next = ((current >> 32) + 1) << 32 | index;
+        if (head.compare_exchange_weak(current, next, std::memory_order_release, std::memory_order_relaxed))
+            return;
+    }
 }
 
-int EventLoop::registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags)
+int EventLoop::registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags, int slack)
 {
     std::lock_guard<std::mutex> locker(mutex);
     {
@@ -329,8 +584,15 @@ int EventLoop::registerTimer(std::function<void(int)>&& func, int timeout, unsig
             data.id = ++nextTimerId;
         } while (timersById.count(&data));
     }
-    TimerData* timer = new TimerData(currentTime() + timeout, nextTimerId, flags, timeout, std::forward<std::function<void(int)> >(func));
-    timersByTime.insert(timer);
+    const uint64_t scale = (flags & Timer::HighResolution) ? 1 : 1000;
+    const uint64_t interval = timeout * scale;
+    TimerData* timer = new TimerData(Rct::monoUs() + interval, nextTimerId, flags, interval,
+                                     std::max(slack, 0) * scale, std::forward<std::function<void(int)> >(func));
+    if (timerWheel && !(flags & Timer::HighResolution)) {
+        timerWheel->insert(timer);
+    } else {
+        timersByTime.insert(timer);
+    }
     timersById.insert(timer);
     assert(timersById.count(timer) == 1);
     wakeup();
@@ -361,6 +623,13 @@ void EventLoop::clearTimer(int id)
         assert(timersById.count(t) == 0);
     }
     assert(t);
+    if (timerWheel && !(t->flags & Timer::HighResolution)) {
+        // might already be unlinked if it's about to fire
+        if (t->wheelSlot != -1)
+            timerWheel->remove(t);
+        delete t;
+        return;
+    }
     const auto range = timersByTime.equal_range(t);
     auto timer = range.first;
     const auto end = range.second;
@@ -379,25 +648,28 @@ void EventLoop::clearTimer(int id)
 
 inline bool EventLoop::sendTimers()
 {
+    const bool wheelFired = timerWheel && sendWheelTimers();
     std::set<uint64_t> fired;
     std::unique_lock<std::mutex> locker(mutex);
-    const uint64_t now = currentTime();
+    const uint64_t now = Rct::cachedMonoUs();
     for (;;) {
         auto timer = timersByTime.begin();
         if (timer == timersByTime.end())
-            return !fired.empty();
+            return wheelFired || !fired.empty();
         TimerData* timerData = *timer;
         int currentId = timerData->id;
         while (fired.count(currentId)) {
             // already fired this round, ignore for now
             ++timer;
             if (timer == timersByTime.end())
-                return !fired.empty();
+                return wheelFired || !fired.empty();
             timerData = *timer;
             currentId = timerData->id;
         }
         if (timerData->when > now)
-            return !fired.empty();
+            return wheelFired || !fired.empty();
+        if (stats)
+            stats->timerLag.add(now - timerData->when);
         if (timerData->flags & Timer::SingleShot) {
             // remove the timer before firing
             std::function<void(int)> func = std::move(timerData->callback);
@@ -408,7 +680,7 @@ inline bool EventLoop::sendTimers()
 
             // fire
             locker.unlock();
-            CALLBACK(func(currentId));
+            TIMED(timers, CALLBACK(func(currentId)));
             locker.lock();
         } else {
             // silly std::set/multiset doesn't have a way of forcing a resort.
@@ -432,17 +704,226 @@ inline bool EventLoop::sendTimers()
 
             // fire
             locker.unlock();
-            CALLBACK(cb(currentId));
+            TIMED(timers, CALLBACK(cb(currentId)));
             locker.lock();
         }
     }
-    return !fired.empty();
+    return wheelFired || !fired.empty();
+}
+
+bool EventLoop::sendWheelTimers()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (timerWheel->isEmpty())
+        return false;
+    const uint64_t now = Rct::cachedMonoUs();
+    std::vector<uint32_t> expired;
+    timerWheel->expire(now, expired);
+    bool fired = false;
+    for (uint32_t id : expired) {
+        TimerData data;
+        data.id = id;
+        const auto timer = timersById.find(&data);
+        if (timer == timersById.end()) {
+            // unregistered by an earlier callback
+            continue;
+        }
+        TimerData* timerData = *timer;
+        fired = true;
+        if (stats)
+            stats->timerLag.add(now > timerData->when ? now - timerData->when : 0);
+        if (timerData->flags & Timer::SingleShot) {
+            std::function<void(int)> func = std::move(timerData->callback);
+            timersById.erase(timer);
+            delete timerData;
+
+            locker.unlock();
+            TIMED(timers, CALLBACK(func(id)));
+            locker.lock();
+        } else {
+            timerData->when += timerData->interval;
+            timerWheel->insert(timerData);
+
+            std::function<void(int)> cb = timerData->callback;
+            locker.unlock();
+            TIMED(timers, CALLBACK(cb(id)));
+            locker.lock();
+        }
+    }
+    return fired;
+}
+
+EventLoop::TimerWheel::TimerWheel()
+    : cursor(0), count(0)
+{
+    memset(slots, 0, sizeof(slots));
+    memset(used, 0, sizeof(used));
+}
+
+void EventLoop::TimerWheel::insert(TimerData* timer)
+{
+    assert(timer->wheelSlot == -1);
+    uint64_t tick = timer->when / Tick;
+    if (timer->slack >= Tick) {
+        // the tick in the window that's a multiple of the highest power of
+        // two, timers with overlapping windows end up in the same slot
+        const uint64_t last = (timer->when + timer->slack) / Tick;
+        uint64_t aligned = last;
+        for (uint64_t mask = ~1ULL; mask && (last & mask) >= tick; mask <<= 1)
+            aligned = last & mask;
+        tick = aligned;
+    }
+    // overdue timers go in the current slot so the next pass sees them
+    if (tick < cursor)
+        tick = cursor;
+    const int slot = tick % Slots;
+    timer->wheelSlot = slot;
+    timer->wheelPrev = 0;
+    timer->wheelNext = slots[slot];
+    if (slots[slot])
+        slots[slot]->wheelPrev = timer;
+    slots[slot] = timer;
+    used[slot / 64] |= (1ULL << (slot % 64));
+    ++count;
+}
+
+void EventLoop::TimerWheel::remove(TimerData* timer)
+{
+    const int slot = timer->wheelSlot;
+    assert(slot != -1);
+    if (timer->wheelPrev) {
+        timer->wheelPrev->wheelNext = timer->wheelNext;
+    } else {
+        assert(slots[slot] == timer);
+        slots[slot] = timer->wheelNext;
+        if (!slots[slot])
+            used[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    if (timer->wheelNext)
+        timer->wheelNext->wheelPrev = timer->wheelPrev;
+    timer->wheelSlot = -1;
+    timer->wheelPrev = timer->wheelNext = 0;
+    --count;
+}
+
+void EventLoop::TimerWheel::expire(uint64_t now, std::vector<uint32_t>& expired)
+{
+    const uint64_t nowTick = now / Tick;
+    // the cursor slot is visited again next time, it may hold timers
+    // that are due later within the same tick
+    const uint64_t ticks = std::min<uint64_t>(nowTick > cursor ? nowTick - cursor + 1 : 1, Slots);
+    for (uint64_t t = 0; t < ticks && count; ++t) {
+        const int slot = (cursor + t) % Slots;
+        TimerData* timer = slots[slot];
+        while (timer) {
+            TimerData* next = timer->wheelNext;
+            if (timer->when <= now) {
+                remove(timer);
+                expired.push_back(timer->id);
+            }
+            timer = next;
+        }
+    }
+    cursor = std::max(cursor, nowTick);
+}
+
+int EventLoop::TimerWheel::nextSlot(int slot) const
+{
+    // first used slot at or after slot, wrapping around
+    for (int i = 0; i <= Slots / 64; ++i) {
+        const int word = ((slot / 64) + i) % (Slots / 64);
+        uint64_t bits = used[word];
+        if (!i)
+            bits &= ~0ULL << (slot % 64);
+        if (bits)
+            return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+int64_t EventLoop::TimerWheel::wait(uint64_t now) const
+{
+    if (!count)
+        return -1;
+    const int current = cursor % Slots;
+    int64_t ret = -1;
+    // the current slot can hold timers due within this tick as well as
+    // ones a full revolution away, look at them individually
+    for (TimerData* timer = slots[current]; timer; timer = timer->wheelNext) {
+        const int64_t diff = timer->when > now ? timer->when - now : 0;
+        if (ret == -1 || diff < ret)
+            ret = diff;
+    }
+    const int slot = nextSlot((current + 1) % Slots);
+    if (slot != -1 && slot != current) {
+        const uint64_t due = (cursor + ((slot - current + Slots) % Slots)) * Tick;
+        const int64_t diff = due > now ? due - now : 0;
+        if (ret == -1 || diff < ret)
+            ret = diff;
+    }
+    return ret;
+}
+
+void EventLoop::TimerWheel::clear()
+{
+    memset(slots, 0, sizeof(slots));
+    memset(used, 0, sizeof(used));
+    count = 0;
+}
+
+// Called with mutex held. Returns the poll timeout in milliseconds for
+// the next timer, or -1 if the loop may block. High resolution timers
+// are handed to the timerfd instead where we have one.
+int EventLoop::timerWait()
+{
+    // fresh, a stale time would only make us sleep past the next timer
+    const uint64_t now = Rct::updateCachedTime();
+    int wheelWait = -1;
+    if (timerWheel) {
+        const int64_t usec = timerWheel->wait(now);
+        if (usec >= 0)
+            wheelWait = std::min<int64_t>((usec + 999) / 1000, INT_MAX);
+    }
+    const auto timer = timersByTime.begin();
+    if (timer == timersByTime.end())
+        return wheelWait;
+    // the earliest a timer has to fire, any timer due after that can't
+    // have an earlier deadline
+    uint64_t when = (*timer)->when + (*timer)->slack;
+    for (auto it = std::next(timer); it != timersByTime.end() && (*it)->when < when; ++it)
+        when = std::min(when, (*it)->when + (*it)->slack);
+#if defined(RCT_EVENTLOOP_TIMERFD)
+    if (timerFd != -1 && ((*timer)->flags & Timer::HighResolution)) {
+        if (timerFdWhen != when) {
+            itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            // a zero it_value disarms, make sure we always fire
+            const uint64_t usec = when > now ? when - now : 1;
+            spec.it_value.tv_sec = usec / 1000000;
+            spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+            if (::timerfd_settime(timerFd, 0, &spec, 0) == 0) {
+                timerFdWhen = when;
+            } else {
+                timerFdWhen = 0;
+                return 0;
+            }
+        }
+        return wheelWait;
+    }
+#endif
+    if (when <= now)
+        return 0;
+    // round up, waking up early just means spinning until the timer is due
+    const int wait = std::min<uint64_t>((when - now + 999) / 1000, INT_MAX);
+    return wheelWait == -1 ? wait : std::min(wait, wheelWait);
 }
 
 bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int, unsigned int)>&& func)
 {
     std::lock_guard<std::mutex> locker(mutex);
     sockets[fd] = std::make_pair(mode, std::forward<std::function<void(int, unsigned int)> >(func));
+    if (socketBusyPollTime)
+        applySocketBusyPoll(fd);
 
     int e;
 #if defined(HAVE_EPOLL)
@@ -603,69 +1084,103 @@ void EventLoop::unregisterSocket(int fd)
     }
 }
 
-unsigned int EventLoop::processSocket(int fd, int timeout)
+unsigned int EventLoop::processSockets(const int *fds, int count, int timeout)
 {
+    if (count <= 0)
+        return 0;
     int eventCount;
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
-    enum { MaxEvents = 2 };
-    NativeEvent events[MaxEvents];
+    // poll() on the fds rather than an epoll or kqueue fd of its own that
+    // would have to be created, filled and closed every time
+    enum { StackFds = 16 };
+    pollfd stackFds[StackFds];
+    std::vector<pollfd> heapFds;
+    pollfd *pfds = stackFds;
+    if (count > StackFds) {
+        heapFds.resize(count);
+        pfds = heapFds.data();
+    }
+    for (int i = 0; i < count; ++i) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN|POLLOUT;
+#ifdef POLLRDHUP
+        pfds[i].events |= POLLRDHUP;
 #endif
-
-#if defined(HAVE_EPOLL)
-    int processFd = epoll_create1(0);
-
-    epoll_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLET|EPOLLRDHUP|EPOLLIN|EPOLLOUT;
-    ev.data.fd = fd;
-    epoll_ctl(processFd, EPOLL_CTL_ADD, fd, &ev);
-
-    eintrwrap(eventCount, epoll_wait(processFd, events, MaxEvents, timeout));
-#elif defined(HAVE_KQUEUE)
-    int processFd = kqueue(), e;
-
-    const struct { int rf; int kf; } flags[] = {
-        { SocketRead, EVFILT_READ },
-        { SocketWrite, EVFILT_WRITE },
-        { 0, 0 }
-    };
-    for (int i = 0; flags[i].rf; ++i) {
-        struct kevent ev;
-        memset(&ev, '\0', sizeof(struct kevent));
-        ev.ident = fd;
-        ev.flags = EV_ADD|EV_ENABLE;
-        ev.filter = flags[i].kf;
-        eintrwrap(e, kevent(processFd, &ev, 1, 0, 0, 0));
+        pfds[i].revents = 0;
     }
+    eintrwrap(eventCount, ::poll(pfds, count, timeout));
+    if (eventCount == -1)
+        fprintf(stderr, "processSocket returned -1 (%d)\n", errno);
+    if (eventCount <= 0)
+        return 0;
 
-    timespec time;
-    if (timeout != -1) {
-        time.tv_sec = timeout / 1000;
-        time.tv_nsec = (timeout % 1000LLU) * 1000000;
+    // what the loop's own wait would have said about them
+    NativeEvent stackEvents[StackFds * 2];
+    std::vector<NativeEvent> heapEvents;
+    NativeEvent *events = stackEvents;
+    if (count > StackFds) {
+        heapEvents.resize(count * 2);
+        events = heapEvents.data();
+    }
+    eventCount = 0;
+    for (int i = 0; i < count; ++i) {
+        const short revents = pfds[i].revents;
+        if (!revents)
+            continue;
+#if defined(HAVE_EPOLL)
+        epoll_event &ev = events[eventCount++];
+        memset(&ev, 0, sizeof(ev));
+        ev.data.fd = pfds[i].fd;
+        if (revents & POLLIN)
+            ev.events |= EPOLLIN;
+        if (revents & POLLOUT)
+            ev.events |= EPOLLOUT;
+        if (revents & (POLLERR|POLLNVAL))
+            ev.events |= EPOLLERR;
+        if (revents & POLLHUP)
+            ev.events |= EPOLLHUP;
+#ifdef POLLRDHUP
+        if (revents & POLLRDHUP)
+            ev.events |= EPOLLRDHUP;
+#endif
+#else
+        if (revents & (POLLERR|POLLNVAL)) {
+            struct kevent &ev = events[eventCount++];
+            EV_SET(&ev, pfds[i].fd, EVFILT_READ, EV_ERROR, 0, (revents & POLLNVAL) ? EBADF : 0, 0);
+            continue;
+        }
+        if (revents & (POLLIN|POLLHUP)) {
+            struct kevent &ev = events[eventCount++];
+            EV_SET(&ev, pfds[i].fd, EVFILT_READ, 0, 0, 0, 0);
+        }
+        if (revents & POLLOUT) {
+            struct kevent &ev = events[eventCount++];
+            EV_SET(&ev, pfds[i].fd, EVFILT_WRITE, 0, 0, 0, 0);
+        }
+#endif
     }
-    eintrwrap(eventCount, kevent(processFd, 0, 0, events, MaxEvents, (timeout == -1) ? 0 : &time));
 #elif defined(HAVE_SELECT)
     fd_set rdfd, wrfd;
     FD_ZERO(&rdfd);
     FD_ZERO(&wrfd);
-    FD_SET(fd, &rdfd);
-    FD_SET(fd, &wrfd);
+    int maxFd = -1;
+    for (int i = 0; i < count; ++i) {
+        FD_SET(fds[i], &rdfd);
+        FD_SET(fds[i], &wrfd);
+        maxFd = std::max(maxFd, fds[i]);
+    }
 
     timeval time;
     if (timeout != -1) {
         time.tv_sec = timeout / 1000;
         time.tv_usec = (timeout % 1000LLU) * 1000;
     }
-    eintrwrap(eventCount, select(fd + 1, &rdfd, &wrfd, 0, (timeout == -1) ? 0 : &time));
-#endif
+    eintrwrap(eventCount, select(maxFd + 1, &rdfd, &wrfd, 0, (timeout == -1) ? 0 : &time));
     if (eventCount == -1)
         fprintf(stderr, "processSocket returned -1 (%d)\n", errno);
-    if (eventCount == 0)
+    if (eventCount <= 0)
         return 0;
 
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
-    ::close(processFd);
-#elif defined(HAVE_SELECT)
     NativeEvent event;
     event.rdfd = &rdfd;
     event.wrfd = &wrfd;
@@ -681,7 +1196,8 @@ unsigned int EventLoop::fireSocket(int fd, unsigned int mode)
     if (socket != sockets.end()) {
         const auto callback = socket->second.second;
         locker.unlock();
-        CALLBACK(callback(fd, mode));
+        RCT_TRACE("EventLoop socket callback");
+        TIMED(sockets, CALLBACK(callback(fd, mode)));
         return mode;
     }
     return 0;
@@ -805,6 +1321,16 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
 #endif
         if (mode) {
             if (fd == eventPipe[0]) {
+#if defined(HAVE_EVENTFD)
+                // reading resets the counter
+                uint64_t count;
+                eintrwrap(e, ::read(eventPipe[0], &count, sizeof(count)));
+                if (signalQuit && eventPipe[1] == mainEventPipe) {
+                    // signal caught, we need to shut down
+                    signalQuit = 0;
+                    return Success;
+                }
+#else
                 // drain the pipe
                 char q;
                 do {
@@ -814,11 +1340,24 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
                         return Success;
                     }
                 } while (e == 1);
+#endif
                 if (e == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
                     // error
                     fprintf(stderr, "Error reading from event pipe: %d (%s)\n", errno, Rct::strerror().constData());
                     return GeneralError;
                 }
+#if defined(RCT_EVENTLOOP_IO_URING)
+            } else if (uring && fd == uring->fd()) {
+                uring->processCompletions();
+#endif
+#if defined(RCT_EVENTLOOP_TIMERFD)
+            } else if (fd == timerFd) {
+                // expired, sendTimers() picks up the timer itself
+                uint64_t expirations;
+                eintrwrap(e, ::read(timerFd, &expirations, sizeof(expirations)));
+                std::lock_guard<std::mutex> locker(mutex);
+                timerFdWhen = 0;
+#endif
             } else {
                 all |= fireSocket(fd, mode);
             }
@@ -832,8 +1371,48 @@ void EventLoop::setInactivityTimeout(int timeout)
     inactivityTimeout = timeout;
 }
 
+#if defined(HAVE_EPOLL)
+// Polls without waiting until something comes in, the spin budget is used
+// up or the next timer is due, and takes what it spent off waitUntil
+int EventLoop::spin(NativeEvent* events, int maxEvents, int& waitUntil)
+{
+    uint64_t budget = spinBudget;
+    if (waitUntil != -1)
+        budget = std::min<uint64_t>(budget, static_cast<uint64_t>(waitUntil) * 1000);
+    const uint64_t started = Rct::monoUs();
+    uint64_t now = started;
+    int eventCount;
+    for (;;) {
+        eintrwrap(eventCount, epoll_wait(pollFd, events, maxEvents, 0));
+        if (eventCount)
+            break;
+        now = Rct::monoUs();
+        if (now - started >= budget)
+            break;
+        Futex::cpuRelax();
+    }
+    if (eventCount)
+        now = Rct::monoUs();
+    const uint64_t spun = now - started;
+    if (eventCount > 0) {
+        spinBudget = busyPollTime.load(std::memory_order_relaxed);
+    } else if (!eventCount && budget == spinBudget) {
+        // only spins that had all of their budget count as misses
+        spinBudget /= 2;
+    }
+    if (stats) {
+        stats->busyPoll.add(spun);
+        (eventCount > 0 ? stats->busyPollHits : stats->busyPollMisses).fetch_add(1, std::memory_order_relaxed);
+    }
+    if (waitUntil != -1)
+        waitUntil = std::max<int>(0, waitUntil - static_cast<int>(spun / 1000));
+    return eventCount;
+}
+#endif
+
 unsigned int EventLoop::exec(int timeoutTime)
 {
+    CpuUsage::registerThread(flgs & MainEventLoop ? "MainEventLoop" : "EventLoop");
     int quitTimerId = -1;
     if (timeoutTime != -1)
         quitTimerId = registerTimer([=](int) { timeout = true; quit(); }, timeoutTime, Timer::SingleShot);
@@ -846,9 +1425,19 @@ unsigned int EventLoop::exec(int timeoutTime)
 #endif
 
     for (;;) {
+        // timers are fired against the time read here, which is at worst
+        // as stale as the callbacks of this round are slow. Late, never early
+        Rct::updateCachedTime();
+        if (stats)
+            stats->iterations.fetch_add(1, std::memory_order_relaxed);
         for (;;) {
             if (!sendPostedEvents() && !sendTimers())
                 break;
+            if (postedBacklog) {
+                // a lane used up its budget, give the sockets a go
+                sendTimers();
+                break;
+            }
         }
         int waitUntil = -1;
         bool waitingForInactivityTimeout = false;
@@ -867,22 +1456,38 @@ unsigned int EventLoop::exec(int timeoutTime)
                 break;
             }
 
-            const auto timer = timersByTime.begin();
-            if (timer != timersByTime.end()) {
-                const uint64_t now = currentTime();
-                waitUntil = std::max<int>((*timer)->when - now, 0);
-            }
+            waitUntil = postedBacklog ? 0 : timerWait();
 
-            if (inactivityTimeout > 0) {
-                if (waitUntil < 0) {
+            if (inactivityTimeout > 0 && !postedBacklog) {
+                if (timersById.empty()) {
                     waitUntil = inactivityTimeout;
                     waitingForInactivityTimeout = true;
                 }
             }
         }
         int eventCount;
+#if defined(RCT_EVENTLOOP_IO_URING)
+        // everything queued since the last round goes out in one syscall
+        if (uring)
+            uring->submit();
+#endif
+#if defined(HAVE_EPOLL)
+        eventCount = 0;
+        if (spinBudget && waitUntil != 0)
+            eventCount = spin(events, MaxEvents, waitUntil);
+#endif
+        // after the spin, it's counted on its own
+        const uint64_t busyPollUs = busyPollTime.load(std::memory_order_relaxed);
+        const uint64_t polled = (stats || busyPollUs) ? Rct::monoUs() : 0;
 #if defined(HAVE_EPOLL)
-        eintrwrap(eventCount, epoll_wait(pollFd, events, MaxEvents, waitUntil));
+        if (!eventCount) {
+            eintrwrap(eventCount, epoll_wait(pollFd, events, MaxEvents, waitUntil));
+            // something soon after blocking, a spin would have caught it
+            if (busyPollUs && eventCount > 0 && spinBudget < busyPollUs
+                && Rct::monoUs() - polled <= busyPollUs * 2) {
+                spinBudget = busyPollUs;
+            }
+        }
 #elif defined(HAVE_KQUEUE)
         timespec timeout;
         timespec* timeptr = 0;
@@ -927,6 +1532,10 @@ unsigned int EventLoop::exec(int timeoutTime)
 
         eintrwrap(eventCount, select(max + 1, &rdfd, wrfdp, 0, timeptr));
 #endif
+        if (stats && eventCount >= 0) {
+            stats->pollWait.add(Rct::monoUs() - polled);
+            stats->pollBatch.add(eventCount);
+        }
         if (eventCount < 0) {
             // bad
             ret = GeneralError;
@@ -949,5 +1558,6 @@ unsigned int EventLoop::exec(int timeoutTime)
 
     if (quitTimerId != -1)
         clearTimer(quitTimerId);
+    CpuUsage::unregisterThread();
     return ret;
 }
@@ -1,12 +1,14 @@
 #ifndef EVENTLOOP_H // -*- mode:c++ -*-
 #define EVENTLOOP_H
 
+#include <atomic>
+#include <cstddef>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <thread>
 #include <tuple>
-#include <queue>
 #include <set>
 #include <unordered_set>
 #include <vector>
@@ -14,6 +16,12 @@
 #include "rct-config.h"
 #if defined(HAVE_EPOLL)
 #  include <sys/epoll.h>
+#  if defined(HAVE_TIMERFD)
+#    define RCT_EVENTLOOP_TIMERFD
+#  endif
+#  if defined(HAVE_IO_URING)
+#    define RCT_EVENTLOOP_IO_URING
+#  endif
 #elif defined(HAVE_KQUEUE)
 #  include <sys/types.h>
 #  include <sys/event.h>
@@ -22,11 +30,21 @@
 #  include <sys/select.h>
 #endif
 
+class IoUring;
+class Value;
+
 class Event
 {
 public:
+    Event() : next(0) { }
     virtual ~Event() { }
     virtual void exec() = 0;
+
+private:
+    // intrusive link for EventLoop's posted event queue
+    Event* next;
+
+    friend class EventLoop;
 };
 
 template<typename Object, typename... Args>
@@ -87,22 +105,66 @@ public:
         None = 0x0,
         MainEventLoop = 0x1,
         EnableSigIntHandler = 0x2,
-        EnableSigTermHandler = 0x4
+        EnableSigTermHandler = 0x4,
+        // keep millisecond timers in a hashed timing wheel, O(1)
+        // register/unregister at the cost of 1ms granularity
+        EnableTimerWheel = 0x8,
+        // completion based socket I/O through io_uring where the
+        // kernel supports it, see ioUring()
+        EnableIoUring = 0x10,
+        // keep the counters and histograms metrics() returns
+        EnableMetrics = 0x20
     };
     enum PostType {
         Move = 1,
         Async
     };
+    // Lanes of posted events. Every round of the loop runs all High
+    // events, then up to postBudget() Normal and Idle ones before it
+    // polls the sockets and fires the timers again, and a High event
+    // posted meanwhile runs before the next Normal one. Within a lane
+    // events run in the order they were posted.
+    enum Priority {
+        High,
+        Normal,
+        // deleteLater() and other housekeeping
+        Idle,
+        PriorityCount
+    };
+    enum { DefaultNormalBudget = 1024, DefaultIdleBudget = 64 };
+    // 0 is no limit, High always is
+    void setPostBudget(Priority priority, unsigned int count);
+    unsigned int postBudget(Priority priority) const { return postLimits[priority]; }
+
+    // For latency critical loops, epoll only. Before blocking the loop
+    // polls without waiting for up to us microseconds, which spares the
+    // wakeup when the next event comes in meanwhile. Spins that find
+    // nothing halve the next one until the loop blocks right away, one
+    // that finds something or an event soon after blocking brings the
+    // whole budget back. With socketUs, every registered socket gets
+    // SO_BUSY_POLL so the kernel polls the device queue as well when it's
+    // read. 0 turns it off. Call it on the loop's thread.
+    void setBusyPoll(int us, int socketUs = 0);
+    int busyPoll() const { return static_cast<int>(busyPollTime.load(std::memory_order_relaxed)); }
 
     void init(unsigned int flags = None);
 
     unsigned int flags() const { return flgs; }
 
+    // The loop's io_uring if it was initialized with EnableIoUring
+    // and the kernel supports it, null otherwise. Completions are
+    // delivered on the loop's thread.
+#if defined(RCT_EVENTLOOP_IO_URING)
+    IoUring* ioUring() const { return uring.get(); }
+#else
+    IoUring* ioUring() const { return 0; }
+#endif
+
     template<typename T>
     static void deleteLater(T* del)
     {
         if (EventLoop::SharedPtr loop = eventLoop()) {
-            loop->post(new DeleteLaterEvent<T>(del));
+            loop->post(loop->createEvent<DeleteLaterEvent<T> >(del), Idle);
         } else {
             error("No event loop!");
         }
@@ -110,24 +172,29 @@ public:
     template<typename Object, typename... Args>
     void post(Object& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(object, std::forward<Args>(args)...));
+        post(createEvent<SignalEvent<Object, Args...> >(object, std::forward<Args>(args)...));
     }
     template<typename Object, typename... Args>
     void postMove(Object& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(object, SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...));
+        post(createEvent<SignalEvent<Object, Args...> >(object, SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...));
     }
     template<typename Object, typename... Args>
     void callLater(Object&& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(std::forward<Object>(object), std::forward<Args>(args)...));
+        post(createEvent<SignalEvent<Object, Args...> >(std::forward<Object>(object), std::forward<Args>(args)...));
     }
     template<typename Object, typename... Args>
     void callLaterMove(Object&& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(std::forward<Object>(object), SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...));
+        post(createEvent<SignalEvent<Object, Args...> >(std::forward<Object>(object), SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...));
     }
-    void post(Event* event);
+    template<typename Object, typename... Args>
+    void callLaterWithPriority(Priority priority, Object&& object, Args&&... args)
+    {
+        post(createEvent<SignalEvent<Object, Args...> >(std::forward<Object>(object), std::forward<Args>(args)...), priority);
+    }
+    void post(Event* event, Priority priority = Normal);
     void wakeup();
 
     enum Mode {
@@ -140,10 +207,16 @@ public:
     bool registerSocket(int fd, unsigned int mode, std::function<void(int, unsigned int)>&& func);
     bool updateSocket(int fd, unsigned int mode);
     void unregisterSocket(int fd);
-    unsigned int processSocket(int fd, int timeout = -1);
-
-    // See Timer.h for the flags
-    int registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags = 0);
+    // Waits up to timeout ms for fd, or any of fds, to be readable or
+    // writable and calls their callbacks. One poll() and nothing to set
+    // up or tear down, for clients in blocking mode.
+    unsigned int processSocket(int fd, int timeout = -1) { return processSockets(&fd, 1, timeout); }
+    unsigned int processSockets(const int *fds, int count, int timeout = -1);
+
+    // See Timer.h for the flags. The timer may fire up to slack later than
+    // timeout, in the same unit, so that timers whose windows overlap are
+    // fired from one wakeup rather than each from their own.
+    int registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags = 0, int slack = 0);
     void unregisterTimer(int id);
 
     // Changes to the inactivity timeout while the loop is running may
@@ -156,6 +229,13 @@ public:
 
     //bool isRunning() const { std::lock_guard<std::mutex> locker(mutex); return !mExecStack.empty(); }
 
+    // What the loop has been doing since init(), for EnableMetrics loops.
+    // Times are in microseconds, the socket, timer and event histograms
+    // are per callback. Rates come from the difference between two
+    // snapshots and their "time". "memory" is MemoryMonitor::metrics().
+    // Can be called from any thread.
+    Value metrics() const;
+
     static EventLoop::SharedPtr mainEventLoop() { std::lock_guard<std::mutex> locker(mainMutex); return mainLoop.lock(); }
     static EventLoop::SharedPtr eventLoop();
 
@@ -173,9 +253,26 @@ private:
     };
 #endif
 
+    // Events made by the templated post functions come out of the
+    // loop's EventPool when they fit, anything else is a plain new
+    template<typename T, typename... Args>
+    T* createEvent(Args&&... args)
+    {
+        if (sizeof(T) <= EventPool::BlockSize && alignof(T) <= alignof(std::max_align_t) && eventPool) {
+            if (void* mem = eventPool->allocate())
+                return new (mem) T(std::forward<Args>(args)...);
+        }
+        return new T(std::forward<Args>(args)...);
+    }
+    void destroyEvent(Event* event);
+
     void clearTimer(int id);
+    int timerWait();
     bool sendPostedEvents();
+    void takePostedEvents(Priority priority);
+    unsigned int runPostedEvents(Priority priority, unsigned int budget);
     bool sendTimers();
+    bool sendWheelTimers();
     void cleanup();
     unsigned int processSocketEvents(NativeEvent* events, int eventCount);
     unsigned int fireSocket(int fd, unsigned int mode);
@@ -187,25 +284,88 @@ private:
     mutable std::mutex mutex;
     std::thread::id threadId;
 
-    std::queue<Event*> events;
+    // Lock-free multi-producer/single-consumer stacks of posted
+    // events, one per Priority. Producers push with a CAS, the loop
+    // takes a whole stack in one exchange and reverses it onto the
+    // lane's queue, which only the loop's thread touches.
+    std::atomic<Event*> postedEvents[PriorityCount];
+    struct PostedQueue
+    {
+        PostedQueue() : head(0), tail(0) { }
+        Event* head;
+        Event* tail;
+    } postedQueues[PriorityCount];
+    unsigned int postLimits[PriorityCount];
+    // events left in a lane past its budget, the loop polls without
+    // waiting until they've run
+    bool postedBacklog;
+
+    // metrics() reads it from other threads
+    std::atomic<uint64_t> busyPollTime;
+    int socketBusyPollTime;
+    // what the next spin may take, in us
+    uint64_t spinBudget;
+    void applySocketBusyPoll(int fd);
+#if defined(HAVE_EPOLL)
+    int spin(NativeEvent* events, int maxEvents, int& waitUntil);
+#endif
+
+    // Fixed slab of event sized blocks. The free list is indexed and
+    // tagged so any thread can allocate without ABA problems, the loop
+    // gives blocks back when the event has run.
+    class EventPool
+    {
+    public:
+        enum { BlockSize = 128, Blocks = 1024 };
+
+        EventPool();
+        ~EventPool();
+
+        void* allocate();
+        void release(void* ptr);
+        bool owns(const void* ptr) const
+        {
+            return ptr >= static_cast<const void*>(blocks) && ptr < static_cast<const void*>(blocks + Blocks);
+        }
+
+    private:
+        union Block {
+            uint32_t next;
+            std::max_align_t align;
+            unsigned char data[BlockSize];
+        };
+        Block* blocks;
+        // (tag << 32) | (index + 1), 0 when empty
+        std::atomic<uint64_t> head;
+    };
+    std::unique_ptr<EventPool> eventPool;
+    // with eventfd both ends are the same descriptor
     int eventPipe[2];
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     int pollFd;
 #endif
+#if defined(RCT_EVENTLOOP_TIMERFD)
+    int timerFd;
+    uint64_t timerFdWhen;
+#endif
+#if defined(RCT_EVENTLOOP_IO_URING)
+    std::unique_ptr<IoUring> uring;
+#endif
 
     std::map<int, std::pair<unsigned int, std::function<void(int, unsigned int)> > > sockets;
 
     class TimerData
     {
     public:
-        TimerData() { }
-        TimerData(uint64_t w, int i, unsigned int f, int in, std::function<void(int)>&& cb)
-            : when(w), id(i), flags(f), interval(in), callback(std::move(cb))
+        TimerData() : slack(0), wheelSlot(-1), wheelPrev(0), wheelNext(0) { }
+        TimerData(uint64_t w, int i, unsigned int f, uint64_t in, uint64_t sl, std::function<void(int)>&& cb)
+            : when(w), id(i), flags(f), interval(in), slack(sl), callback(std::move(cb)),
+              wheelSlot(-1), wheelPrev(0), wheelNext(0)
         {
         }
         TimerData(TimerData&& other)
             : when(other.when), id(other.id), flags(other.flags),
-              interval(other.interval), callback(std::move(other.callback))
+              interval(other.interval), slack(other.slack), callback(std::move(other.callback))
         {
         }
         TimerData& operator=(TimerData&& other)
@@ -214,6 +374,7 @@ private:
             id = other.id;
             flags = other.flags;
             interval = other.interval;
+            slack = other.slack;
             callback = std::move(other.callback);
             return *this;
         }
@@ -223,12 +384,21 @@ private:
             return when < other.when;
         }
 
+        // microseconds
         uint64_t when;
         uint32_t id;
         unsigned int flags;
-        int interval;
+        uint64_t interval;
+        // how late it may fire, the loop wakes up at the earliest
+        // when + slack and fires everything that's due by then
+        uint64_t slack;
         std::function<void(int)> callback;
 
+        // TimerWheel links, wheelSlot is -1 when not linked
+        int wheelSlot;
+        TimerData* wheelPrev;
+        TimerData* wheelNext;
+
     private:
         TimerData(const TimerData& other) = delete;
         TimerData& operator=(const TimerData& other) = delete;
@@ -248,6 +418,39 @@ private:
     typedef std::unordered_set<TimerData*, TimerDataHash, TimerDataHash> TimersById;
     TimersByTime timersByTime;
     TimersById timersById;
+
+    // Hashed timing wheel, Slots buckets of Tick microseconds each.
+    // A timer further away than one revolution just stays in its
+    // bucket until a later pass finds it due.
+    class TimerWheel
+    {
+    public:
+        enum { Slots = 4096, Tick = 1000 };
+
+        TimerWheel();
+
+        void insert(TimerData* timer);
+        void remove(TimerData* timer);
+        // unlinks every timer that is due at now
+        void expire(uint64_t now, std::vector<uint32_t>& expired);
+        // microseconds until the next timer may be due, -1 if empty
+        int64_t wait(uint64_t now) const;
+        void clear();
+        bool isEmpty() const { return !count; }
+
+    private:
+        int nextSlot(int slot) const;
+
+        TimerData* slots[Slots];
+        uint64_t used[Slots / 64];
+        uint64_t cursor;
+        size_t count;
+    };
+    // only allocated for EnableTimerWheel loops
+    std::unique_ptr<TimerWheel> timerWheel;
+    // and this for EnableMetrics ones
+    struct Metrics;
+    std::unique_ptr<Metrics> stats;
     uint32_t nextTimerId;
 
     bool stop;
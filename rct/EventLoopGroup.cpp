@@ -0,0 +1,174 @@
+#include "EventLoopGroup.h"
+#include "Thread.h"
+#include "ThreadPool.h"
+#include "Log.h"
+#include <condition_variable>
+#include <mutex>
+#include <assert.h>
+
+class EventLoopGroupThread : public Thread
+{
+public:
+    EventLoopGroupThread()
+        : mReady(false)
+    {
+        setAutoDelete(false);
+    }
+
+    EventLoop::SharedPtr waitForLoop()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mReady)
+            mCond.wait(lock);
+        return mLoop.lock();
+    }
+
+    EventLoop::SharedPtr loop() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mLoop.lock();
+    }
+
+    // only touched from this thread's loop
+    List<SocketServer::SharedPtr> servers;
+
+protected:
+    virtual void run() override
+    {
+        // the loop must die on this thread, EventLoop::cleanup() resets
+        // the thread local loop pointer of whichever thread runs it
+        EventLoop::SharedPtr loop(new EventLoop);
+        loop->init(EventLoop::None);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mLoop = loop;
+            mReady = true;
+            mCond.notify_all();
+        }
+        loop->exec();
+        std::lock_guard<std::mutex> lock(mMutex);
+        mLoop.reset();
+    }
+
+private:
+    mutable std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mReady;
+    EventLoop::WeakPtr mLoop;
+};
+
+EventLoopGroup::EventLoopGroup()
+    : mNext(0)
+{
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+    stop();
+}
+
+bool EventLoopGroup::start(int count, unsigned int flags)
+{
+    stop();
+    const int cpus = ThreadPool::idealThreadCount();
+    if (count <= 0)
+        count = cpus;
+    for (int i = 0; i < count; ++i) {
+        EventLoopGroupThread* thread = new EventLoopGroupThread;
+        mThreads.append(thread);
+        thread->start();
+        if (!thread->waitForLoop()) {
+            error() << "EventLoopGroup: failed to start loop" << i;
+            stop();
+            return false;
+        }
+        if (flags & PinThreads)
+            thread->setAffinity(i % cpus);
+    }
+    return true;
+}
+
+void EventLoopGroup::stop()
+{
+    if (mThreads.isEmpty())
+        return;
+    closeServers();
+    for (EventLoopGroupThread* thread : mThreads) {
+        if (EventLoop::SharedPtr loop = thread->loop())
+            loop->quit();
+        thread->join();
+        delete thread;
+    }
+    mThreads.clear();
+    mNext = 0;
+}
+
+EventLoop::SharedPtr EventLoopGroup::loop(int index) const
+{
+    if (index < 0 || index >= mThreads.size())
+        return EventLoop::SharedPtr();
+    return mThreads.at(index)->loop();
+}
+
+EventLoop::SharedPtr EventLoopGroup::next()
+{
+    if (mThreads.isEmpty())
+        return EventLoop::SharedPtr();
+    return mThreads.at(mNext++ % mThreads.size())->loop();
+}
+
+void EventLoopGroup::runOnEach(const std::function<void(int)>& func)
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    int remaining = 0;
+    for (int i = 0; i < mThreads.size(); ++i) {
+        EventLoop::SharedPtr loop = mThreads.at(i)->loop();
+        if (!loop)
+            continue;
+        assert(loop != EventLoop::eventLoop());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++remaining;
+        }
+        loop->callLater([&func, &mutex, &cond, &remaining, i]() {
+                func(i);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!--remaining)
+                    cond.notify_one();
+            });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while (remaining)
+        cond.wait(lock);
+}
+
+bool EventLoopGroup::listen(uint16_t port, unsigned int mode, const ServerCallback& callback)
+{
+    std::atomic<bool> ok(true);
+    runOnEach([&](int index) {
+            SocketServer::SharedPtr server(new SocketServer);
+            if (callback)
+                callback(index, server);
+            if (!server->listen(port, mode | SocketServer::ReusePort)) {
+                ok = false;
+                return;
+            }
+            mThreads.at(index)->servers.append(server);
+        });
+    if (!ok) {
+        error() << "EventLoopGroup: failed to listen on port" << port;
+        closeServers();
+    }
+    return ok;
+}
+
+void EventLoopGroup::closeServers()
+{
+    runOnEach([this](int index) {
+            List<SocketServer::SharedPtr>& servers = mThreads.at(index)->servers;
+            for (const SocketServer::SharedPtr& server : servers)
+                server->close();
+            servers.clear();
+        });
+}
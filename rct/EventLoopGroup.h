@@ -0,0 +1,61 @@
+#ifndef EventLoopGroup_h
+#define EventLoopGroup_h
+
+#include "EventLoop.h"
+#include "List.h"
+#include "SocketServer.h"
+#include <atomic>
+#include <functional>
+
+class EventLoopGroupThread;
+
+// Runs a number of EventLoops, each on its own thread. Thread affinity is
+// what keeps sockets on a loop: SocketServer and SocketClient register with
+// EventLoop::eventLoop(), so anything created through runOnEach() or
+// listen() stays on the loop it was created on.
+class EventLoopGroup
+{
+public:
+    EventLoopGroup();
+    ~EventLoopGroup();
+
+    enum Flag {
+        None = 0x0,
+        PinThreads = 0x1
+    };
+
+    // count <= 0 means one loop per cpu
+    bool start(int count = 0, unsigned int flags = PinThreads);
+    void stop();
+
+    bool isRunning() const { return !mThreads.isEmpty(); }
+    int size() const { return mThreads.size(); }
+
+    EventLoop::SharedPtr loop(int index) const;
+    // round-robin, for spreading work that isn't tied to a listener
+    EventLoop::SharedPtr next();
+
+    // Calls func(index) on the thread of every loop and waits until all of
+    // them have returned. Must not be called from one of the group's threads.
+    void runOnEach(const std::function<void(int)>& func);
+
+    // Opens one SO_REUSEPORT listener per loop so that the kernel spreads
+    // incoming connections across the loops. callback is invoked on the
+    // loop's thread before the server starts listening, which is where
+    // newConnection() should be connected. The servers are closed by stop().
+    typedef std::function<void(int, const SocketServer::SharedPtr&)> ServerCallback;
+    bool listen(uint16_t port, unsigned int mode, const ServerCallback& callback);
+
+private:
+    void closeServers();
+
+private:
+    List<EventLoopGroupThread*> mThreads;
+    std::atomic<unsigned int> mNext;
+
+private:
+    EventLoopGroup(const EventLoopGroup&) = delete;
+    EventLoopGroup& operator=(const EventLoopGroup&) = delete;
+};
+
+#endif
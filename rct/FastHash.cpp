@@ -0,0 +1,301 @@
+#include "FastHash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+
+namespace {
+const uint64_t Prime1 = 0x9E3779B185EBCA87ull;
+const uint64_t Prime2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t Prime3 = 0x165667B19E3779F9ull;
+const uint64_t Prime4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t Prime5 = 0x27D4EB2F165667C5ull;
+
+const uint64_t MurmurC1 = 0x87c37b91114253d5ull;
+const uint64_t MurmurC2 = 0x4cf5ad432745937full;
+
+// both hashes are defined on little endian words
+inline uint64_t read64(const unsigned char *data)
+{
+    uint64_t ret;
+    memcpy(&ret, data, sizeof(ret));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    ret = __builtin_bswap64(ret);
+#endif
+    return ret;
+}
+
+inline uint32_t read32(const unsigned char *data)
+{
+    uint32_t ret;
+    memcpy(&ret, data, sizeof(ret));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    ret = __builtin_bswap32(ret);
+#endif
+    return ret;
+}
+
+inline uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t xxRound(uint64_t acc, uint64_t input)
+{
+    acc += input * Prime2;
+    acc = rotl(acc, 31);
+    return acc * Prime1;
+}
+
+inline uint64_t xxMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxRound(0, value);
+    return acc * Prime1 + Prime4;
+}
+
+// Consumes the 32 byte stripes of data, returns where the tail starts
+inline const unsigned char *xxStripes(uint64_t *v, const unsigned char *data, const unsigned char *end)
+{
+    while (end - data >= 32) {
+        v[0] = xxRound(v[0], read64(data));
+        v[1] = xxRound(v[1], read64(data + 8));
+        v[2] = xxRound(v[2], read64(data + 16));
+        v[3] = xxRound(v[3], read64(data + 24));
+        data += 32;
+    }
+    return data;
+}
+
+uint64_t xxFinish(const uint64_t *v, uint64_t seed, uint64_t total, const unsigned char *tail, size_t size)
+{
+    uint64_t h;
+    if (total >= 32) {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxMerge(h, v[i]);
+    } else {
+        h = seed + Prime5;
+    }
+    h += total;
+    const unsigned char *end = tail + size;
+    for (; end - tail >= 8; tail += 8) {
+        h ^= xxRound(0, read64(tail));
+        h = rotl(h, 27) * Prime1 + Prime4;
+    }
+    if (end - tail >= 4) {
+        h ^= static_cast<uint64_t>(read32(tail)) * Prime1;
+        h = rotl(h, 23) * Prime2 + Prime3;
+        tail += 4;
+    }
+    for (; tail < end; ++tail) {
+        h ^= *tail * Prime5;
+        h = rotl(h, 11) * Prime1;
+    }
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+inline void xxInit(uint64_t *v, uint64_t seed)
+{
+    v[0] = seed + Prime1 + Prime2;
+    v[1] = seed + Prime2;
+    v[2] = seed;
+    v[3] = seed - Prime1;
+}
+
+inline uint64_t fmix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+inline const unsigned char *murmurBlocks(uint64_t &h1, uint64_t &h2, const unsigned char *data, const unsigned char *end)
+{
+    while (end - data >= 16) {
+        uint64_t k1 = read64(data);
+        uint64_t k2 = read64(data + 8);
+        k1 *= MurmurC1;
+        k1 = rotl(k1, 31);
+        k1 *= MurmurC2;
+        h1 ^= k1;
+        h1 = rotl(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= MurmurC2;
+        k2 = rotl(k2, 33);
+        k2 *= MurmurC1;
+        h2 ^= k2;
+        h2 = rotl(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+        data += 16;
+    }
+    return data;
+}
+
+Hash128 murmurFinish(uint64_t h1, uint64_t h2, uint64_t total, const unsigned char *tail, size_t size)
+{
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = size; i > 8; --i)
+        k2 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+    if (size > 8) {
+        k2 *= MurmurC2;
+        k2 = rotl(k2, 33);
+        k2 *= MurmurC1;
+        h2 ^= k2;
+    }
+    for (size_t i = std::min<size_t>(size, 8); i > 0; --i)
+        k1 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+    if (size) {
+        k1 *= MurmurC1;
+        k1 = rotl(k1, 31);
+        k1 *= MurmurC2;
+        h1 ^= k1;
+    }
+    h1 ^= total;
+    h2 ^= total;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    Hash128 ret = { h1, h2 };
+    return ret;
+}
+
+template <typename Hasher, typename Result>
+bool hashFile(const String &path, Result *hash, uint64_t seed)
+{
+    int fd;
+    do {
+        fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1)
+        return false;
+    enum { BufferSize = 64 * 1024 };
+    std::unique_ptr<unsigned char[]> buffer(new unsigned char[BufferSize]);
+    Hasher hasher(seed);
+    bool ok = false;
+    for (;;) {
+        const ssize_t r = ::read(fd, buffer.get(), BufferSize);
+        if (r > 0) {
+            hasher.update(buffer.get(), r);
+        } else if (!r) {
+            *hash = hasher.hash();
+            ok = true;
+            break;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+}
+
+String Hash128::toHex() const
+{
+    return String::format<40>("%016llx%016llx", static_cast<unsigned long long>(high), static_cast<unsigned long long>(low));
+}
+
+void FastHash::reset(uint64_t seed)
+{
+    xxInit(mV, seed);
+    mSeed = seed;
+    mTotal = 0;
+    mBuffered = 0;
+}
+
+void FastHash::update(const void *data, size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    const unsigned char *end = bytes + size;
+    mTotal += size;
+    if (mBuffered) {
+        const size_t fill = std::min<size_t>(size, sizeof(mBuffer) - mBuffered);
+        memcpy(mBuffer + mBuffered, bytes, fill);
+        mBuffered += fill;
+        bytes += fill;
+        if (mBuffered < sizeof(mBuffer))
+            return;
+        xxStripes(mV, mBuffer, mBuffer + sizeof(mBuffer));
+        mBuffered = 0;
+    }
+    bytes = xxStripes(mV, bytes, end);
+    memcpy(mBuffer, bytes, end - bytes);
+    mBuffered = end - bytes;
+}
+
+uint64_t FastHash::hash() const
+{
+    return xxFinish(mV, mSeed, mTotal, mBuffer, mBuffered);
+}
+
+uint64_t FastHash::hash(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    uint64_t v[4];
+    xxInit(v, seed);
+    const unsigned char *tail = xxStripes(v, bytes, bytes + size);
+    return xxFinish(v, seed, size, tail, bytes + size - tail);
+}
+
+bool FastHash::hashFile(const String &path, uint64_t *hash, uint64_t seed)
+{
+    return ::hashFile<FastHash>(path, hash, seed);
+}
+
+void FastHash128::reset(uint64_t seed)
+{
+    mH1 = mH2 = seed;
+    mTotal = 0;
+    mBuffered = 0;
+}
+
+void FastHash128::update(const void *data, size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    const unsigned char *end = bytes + size;
+    mTotal += size;
+    if (mBuffered) {
+        const size_t fill = std::min<size_t>(size, sizeof(mBuffer) - mBuffered);
+        memcpy(mBuffer + mBuffered, bytes, fill);
+        mBuffered += fill;
+        bytes += fill;
+        if (mBuffered < sizeof(mBuffer))
+            return;
+        murmurBlocks(mH1, mH2, mBuffer, mBuffer + sizeof(mBuffer));
+        mBuffered = 0;
+    }
+    bytes = murmurBlocks(mH1, mH2, bytes, end);
+    memcpy(mBuffer, bytes, end - bytes);
+    mBuffered = end - bytes;
+}
+
+Hash128 FastHash128::hash() const
+{
+    return murmurFinish(mH1, mH2, mTotal, mBuffer, mBuffered);
+}
+
+Hash128 FastHash128::hash(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    uint64_t h1 = seed, h2 = seed;
+    const unsigned char *tail = murmurBlocks(h1, h2, bytes, bytes + size);
+    return murmurFinish(h1, h2, size, tail, bytes + size - tail);
+}
+
+bool FastHash128::hashFile(const String &path, Hash128 *hash, uint64_t seed)
+{
+    return ::hashFile<FastHash128>(path, hash, seed);
+}
@@ -0,0 +1,99 @@
+#ifndef FastHash_h
+#define FastHash_h
+
+#include <rct/Buffer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <functional>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fast hashes for hash tables, deduplication and content fingerprints,
+// not for anything that needs a cryptographic hash, see SHA256 for that.
+// FastHash is XXH64 and FastHash128 MurmurHash3 x64_128, so they match
+// other implementations of those given the same seed. Data can be hashed
+// in one go or added in pieces, which hash the same.
+
+struct Hash128
+{
+    uint64_t low, high;
+
+    bool operator==(const Hash128 &other) const { return low == other.low && high == other.high; }
+    bool operator!=(const Hash128 &other) const { return !operator==(other); }
+    bool operator<(const Hash128 &other) const { return high < other.high || (high == other.high && low < other.low); }
+
+    String toHex() const;
+};
+
+class FastHash
+{
+public:
+    FastHash(uint64_t seed = 0) { reset(seed); }
+
+    void reset(uint64_t seed = 0);
+    void update(const void *data, size_t size);
+    void update(const StringView &data) { update(data.data(), data.size()); }
+    void update(const Buffer &data) { update(data.data(), data.size()); }
+
+    // Of everything so far, more can be added afterwards
+    uint64_t hash() const;
+
+    static uint64_t hash(const void *data, size_t size, uint64_t seed = 0);
+    static uint64_t hash(const StringView &data, uint64_t seed = 0) { return hash(data.data(), data.size(), seed); }
+    // Of the contents of the file at path, false if it can't be read
+    static bool hashFile(const String &path, uint64_t *hash, uint64_t seed = 0);
+
+private:
+    uint64_t mV[4], mSeed, mTotal;
+    unsigned char mBuffer[32];
+    uint32_t mBuffered;
+};
+
+class FastHash128
+{
+public:
+    FastHash128(uint64_t seed = 0) { reset(seed); }
+
+    void reset(uint64_t seed = 0);
+    void update(const void *data, size_t size);
+    void update(const StringView &data) { update(data.data(), data.size()); }
+    void update(const Buffer &data) { update(data.data(), data.size()); }
+
+    Hash128 hash() const;
+
+    static Hash128 hash(const void *data, size_t size, uint64_t seed = 0);
+    static Hash128 hash(const StringView &data, uint64_t seed = 0) { return hash(data.data(), data.size(), seed); }
+    static bool hashFile(const String &path, Hash128 *hash, uint64_t seed = 0);
+
+private:
+    uint64_t mH1, mH2, mTotal;
+    unsigned char mBuffer[16];
+    uint32_t mBuffered;
+};
+
+// The default Hasher of FlatHash and FlatHashSet. Strings, Paths and
+// StringViews are hashed with FastHash, anything else with std::hash.
+struct FastStringHasher
+{
+    size_t operator()(const StringView &value) const { return FastHash::hash(value.data(), value.size()); }
+};
+
+template <typename T>
+struct FastHasher : public std::conditional<std::is_base_of<String, T>::value || std::is_same<StringView, T>::value,
+                                            FastStringHasher, std::hash<T> >::type
+{
+};
+
+namespace std
+{
+template <> struct hash<Hash128>
+{
+    typedef Hash128 argument_type;
+    typedef size_t result_type;
+
+    size_t operator()(const Hash128 &value) const { return static_cast<size_t>(value.low); }
+};
+}
+
+#endif
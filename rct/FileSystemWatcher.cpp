@@ -1,7 +1,83 @@
 #include "FileSystemWatcher.h"
+#include "DataFile.h"
+#include "Rct.h"
+#include <string.h>
+
+namespace {
+enum { SnapshotVersion = 1 };
+
+struct SnapshotEntry
+{
+    SnapshotEntry()
+        : type(Path::Invalid), lastModifiedMs(0), inode(0), size(-1)
+    {}
+    SnapshotEntry(const Path::Stat &stat)
+        : type(stat.type), lastModifiedMs(stat.lastModifiedMs), inode(stat.inode), size(stat.size)
+    {}
+
+    bool operator==(const SnapshotEntry &other) const
+    {
+        return type == other.type && lastModifiedMs == other.lastModifiedMs && inode == other.inode && size == other.size;
+    }
+
+    Path::Type type;
+    uint64_t lastModifiedMs, inode;
+    int64_t size;
+};
+
+Path snapshotKey(const Path &path, Path::Type type)
+{
+    if (type == Path::Directory && !path.endsWith('/'))
+        return path + '/';
+    return path;
+}
+}
+
+template <>
+inline Serializer &operator<<(Serializer &s, const SnapshotEntry &entry)
+{
+    s << static_cast<uint8_t>(entry.type) << entry.lastModifiedMs << entry.inode << entry.size;
+    return s;
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, SnapshotEntry &entry)
+{
+    uint8_t type;
+    s >> type >> entry.lastModifiedMs >> entry.inode >> entry.size;
+    entry.type = static_cast<Path::Type>(type);
+    return s;
+}
 
 void FileSystemWatcher::processChanges(const Changes &changes)
 {
+    if (Path::isStatCacheEnabled()) {
+        // before anyone hears about it, also while the changes are coalesced
+        for (const Set<Path> *paths : { &changes.added, &changes.removed, &changes.modified }) {
+            for (const Path &path : *paths)
+                Path::invalidateStat(path);
+        }
+    }
+
+    if (mCoalesce > 0) {
+        if (changes.isEmpty())
+            return;
+        const uint64_t now = Rct::monoMs();
+        if (mPending.isEmpty())
+            mPendingSince = now;
+        mPending.add(changes);
+        const uint64_t deadline = mPendingSince + (mCoalesce * 4);
+        if (now >= deadline) {
+            flushChanges();
+        } else {
+            mCoalesceTimer.restart(std::min<uint64_t>(mCoalesce, deadline - now), Timer::SingleShot);
+        }
+        return;
+    }
+
+    if (!mChanged.isEmpty() && !changes.isEmpty())
+        mChanged(changes);
+
     struct {
         Signal<std::function<void(const Path&)> > &signal;
         const Set<Path> &paths;
@@ -18,3 +94,222 @@ void FileSystemWatcher::processChanges(const Changes &changes)
         }
     }
 }
+
+void FileSystemWatcher::setCoalesce(int ms)
+{
+    if (mCoalesceTimer.timeout().isEmpty())
+        mCoalesceTimer.timeout().connect([this](Timer *) { flushChanges(); });
+    mCoalesce = ms;
+    if (ms <= 0)
+        flushChanges();
+}
+
+void FileSystemWatcher::flushChanges()
+{
+    mCoalesceTimer.stop();
+    if (mPending.isEmpty())
+        return;
+    Changes changes;
+    std::swap(changes, mPending);
+    mChanged(changes);
+}
+
+Path::VisitResult FileSystemWatcher::watchRecursive(const Path &path, void *userData)
+{
+    if (!path.isDir())
+        return Path::Continue;
+    FileSystemWatcher *watcher = static_cast<FileSystemWatcher*>(userData);
+    Path dir = path;
+    if (!dir.endsWith('/'))
+        dir.append('/');
+    watcher->watch(dir);
+    watcher->mRecursive.insert(dir);
+    return Path::Recurse;
+}
+
+bool FileSystemWatcher::watch(const Path &p, unsigned int flags)
+{
+    if (!(flags & Recursive) || !p.isDir())
+        return watch(p);
+    Path path = p;
+    if (!path.endsWith('/'))
+        path.append('/');
+#if defined(HAVE_INOTIFY) && defined(HAVE_FANOTIFY)
+    if ((mFlags & Fanotify) && fanotifyWatch(path)) {
+        mRecursive.insert(path);
+        return true;
+    }
+#endif
+    if (!watch(path))
+        return false;
+    mRecursive.insert(path);
+#ifndef HAVE_FSEVENTS
+    // FSEvents streams already cover everything under their paths
+    path.visit(watchRecursive, this);
+#endif
+    return true;
+}
+
+bool FileSystemWatcher::unwatch(const Path &p, unsigned int flags)
+{
+    if (!(flags & Recursive))
+        return unwatch(p);
+    Path path = p;
+    if (!path.endsWith('/'))
+        path.append('/');
+    bool ret = false;
+    Set<Path>::iterator it = mRecursive.lower_bound(path);
+    while (it != mRecursive.end() && it->startsWith(path)) {
+        unwatch(*it);
+        mRecursive.erase(it++);
+        ret = true;
+    }
+    return ret;
+}
+
+bool FileSystemWatcher::saveSnapshot(const Path &file) const
+{
+    DataFile data(file, SnapshotVersion);
+    data.setSerializerFlags(Serializer::Compact | Serializer::InternPaths);
+    if (!data.open(DataFile::Write)) {
+        error("Can't open %s: %s", file.constData(), data.error().constData());
+        return false;
+    }
+    // every watched path and what's directly in the watched directories,
+    // which covers the whole tree of a Recursive watch
+    const Set<Path> watched = watchedPaths();
+    Map<Path, SnapshotEntry> entries;
+    // Not through the stat cache, an entry whose change is still waiting to
+    // be read from the kernel hasn't been invalidated yet. The next process
+    // compares against this, so it has to be what's on disk.
+    for (const Path &path : watched) {
+        const Path::Stat stat = path.statAll(false);
+        if (!stat.exists())
+            continue;
+        entries[snapshotKey(path, stat.type)] = stat;
+        if (stat.type == Path::Directory) {
+            for (const Path &child : path.files()) {
+                const Path::Stat childStat = child.statAll(false);
+                if (childStat.exists())
+                    entries[snapshotKey(child, childStat.type)] = childStat;
+            }
+        }
+    }
+    data << watched << mRecursive << entries;
+    if (!data.flush()) {
+        error("Can't write %s: %s", file.constData(), data.error().constData());
+        return false;
+    }
+    return true;
+}
+
+bool FileSystemWatcher::loadSnapshot(const Path &file)
+{
+    DataFile data(file, SnapshotVersion);
+    data.setSerializerFlags(Serializer::Compact | Serializer::InternPaths);
+    if (!data.open(DataFile::Read))
+        return false;
+    Set<Path> watched, recursive;
+    Map<Path, SnapshotEntry> entries;
+    data >> watched >> recursive >> entries;
+
+    Changes changes;
+    // a path that's gone takes what was under it along
+    auto removeTree = [&changes, &entries](const Path &path) {
+        changes.add(Changes::Remove, path);
+        if (!path.endsWith('/'))
+            return;
+        for (auto it = entries.lower_bound(path); it != entries.end() && it->first.startsWith(path); ++it)
+            changes.add(Changes::Remove, it->first);
+    };
+    auto compare = [&changes](const Path &path, const SnapshotEntry &old, const Path::Stat &stat) {
+        if (old.type != stat.type) {
+            changes.add(Changes::Remove, path);
+            changes.add(Changes::Add, snapshotKey(path, stat.type));
+        } else if (!(old == SnapshotEntry(stat))) {
+            changes.add(Changes::Modified, path);
+        }
+    };
+
+    // what's on disk, like saveSnapshot() wrote
+    for (const Path &path : watched) {
+        const Path::Stat stat = path.statAll(false);
+        const Path key = snapshotKey(path, stat.type);
+        const auto old = entries.find(key);
+        if (!stat.exists() || (old != entries.end() && old->second.type != stat.type)) {
+            removeTree(old != entries.end() ? old->first : path);
+            continue;
+        }
+        // only this path, the directories under it are in watched already
+        if (!watch(path))
+            continue;
+        const bool isRecursive = recursive.contains(key);
+        if (isRecursive)
+            mRecursive.insert(key);
+        if (stat.type != Path::Directory) {
+            if (old != entries.end())
+                compare(path, old->second, stat);
+            continue;
+        }
+
+        Map<Path, SnapshotEntry> children;
+        for (auto it = entries.upper_bound(key); it != entries.end() && it->first.startsWith(key); ++it) {
+            const char *rest = it->first.constData() + key.size();
+            const char *slash = strchr(rest, '/');
+            if (!slash || !slash[1])
+                children[it->first] = it->second;
+        }
+        if (old != entries.end() && old->second == SnapshotEntry(stat)) {
+            // nothing came or went, the files could still have been written to
+            for (const auto &child : children) {
+                if (child.second.type == Path::Directory)
+                    continue;
+                const Path::Stat childStat = child.first.statAll(false);
+                if (!childStat.exists()) {
+                    removeTree(child.first);
+                } else {
+                    compare(child.first, child.second, childStat);
+                }
+            }
+            continue;
+        }
+
+        Set<Path> seen;
+        for (const Path &child : path.files()) {
+            const Path::Stat childStat = child.statAll(false);
+            if (!childStat.exists())
+                continue;
+            const Path childKey = snapshotKey(child, childStat.type);
+            seen.insert(childKey);
+            const auto it = children.find(childKey);
+            if (it != children.end()) {
+                if (childStat.type != Path::Directory)
+                    compare(childKey, it->second, childStat);
+                continue;
+            }
+            changes.add(Changes::Add, childKey);
+            if (childStat.type == Path::Directory && isRecursive) {
+                // new since the snapshot, watched and reported like a
+                // directory that's created while we run
+#ifndef HAVE_FSEVENTS
+                watch(childKey, Recursive);
+#endif
+                for (const Path &sub : childKey.files(Path::All, -1, true))
+                    changes.add(Changes::Add, snapshotKey(sub, sub.type()));
+            }
+        }
+        for (const auto &child : children) {
+            if (!seen.contains(child.first))
+                removeTree(child.first);
+        }
+    }
+
+    // Fanotify roots aren't in watched, they were never scanned either
+    for (const Path &path : recursive) {
+        if (!watched.contains(path) && path.isDir())
+            watch(path, Recursive);
+    }
+
+    processChanges(changes);
+    return true;
+}
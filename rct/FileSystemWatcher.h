@@ -28,20 +28,86 @@ class WatcherData;
 class FileSystemWatcher
 {
 public:
-    FileSystemWatcher();
+    enum Flag {
+        None = 0x0,
+        // Recursive watches mark the whole filesystem through fanotify
+        // instead of adding a watch per directory. Needs CAP_SYS_ADMIN and
+        // Linux 5.9, inotify is used when it can't be had.
+        Fanotify = 0x1
+    };
+    FileSystemWatcher(unsigned int flags = None);
     ~FileSystemWatcher();
 
+    enum WatchFlag {
+        // the directories under it too, including ones created later
+        Recursive = 0x1
+    };
     bool watch(const Path &path);
+    bool watch(const Path &path, unsigned int flags);
     bool unwatch(const Path &path);
+    bool unwatch(const Path &path, unsigned int flags);
     Signal<std::function<void(const Path &)> > &removed() { return mRemoved; }
     Signal<std::function<void(const Path &)> > &added() { return mAdded; }
     Signal<std::function<void(const Path &)> > &modified() { return mModified; }
     void clear();
+
+    struct Changes {
+        enum Type {
+            Add,
+            Remove,
+            Modified
+        };
+        void add(Type type, const Path &path)
+        {
+            switch (type) {
+            case Add:
+                if (!removed.remove(path))
+                    added.insert(path);
+                break;
+            case Remove:
+                if (!added.remove(path))
+                    removed.insert(path);
+                break;
+            case Modified:
+                modified.insert(path);
+                break;
+            }
+        }
+        void add(const Changes &other)
+        {
+            for (const Path &path : other.added)
+                add(Add, path);
+            for (const Path &path : other.removed)
+                add(Remove, path);
+            modified.unite(other.modified);
+        }
+        bool isEmpty() const { return added.isEmpty() && removed.isEmpty() && modified.isEmpty(); }
+        Set<Path> added, removed, modified;
+    };
+
+    // With a window, changes are held until none have come in for ms
+    // milliseconds (or 4 * ms since the first one) and then delivered as
+    // one changed() instead of an added/removed/modified per path. A path
+    // that came and went in between isn't reported at all. Without one
+    // changed() is emitted for every batch, before the per path signals.
+    void setCoalesce(int ms);
+    int coalesce() const { return mCoalesce; }
+    Signal<std::function<void(const Changes &)> > &changed() { return mChanged; }
 #if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
     Set<Path> watchedPaths() const;
 #else
     Set<Path> watchedPaths() const { return mWatchedByPath.keys().toSet(); } // ### slow
 #endif
+
+    // The watched paths and the mtime, inode and size of everything
+    // directly in them, for a restart that doesn't have to scan the whole
+    // tree. loadSnapshot() watches the same paths again, without visiting
+    // them, and reports what changed in the meantime through the usual
+    // signals. Only directories whose own mtime changed are listed, the
+    // others just have their files stat'ed. Returns false if file can't be
+    // read or is from another version, watch() everything as usual then.
+    bool saveSnapshot(const Path &file) const;
+    bool loadSnapshot(const Path &file);
 private:
 #if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
     WatcherData* mWatcher;
@@ -69,33 +135,27 @@ private:
 
     bool isWatching(const Path& path) const;
 #endif
+#endif
+#if defined(HAVE_INOTIFY) && defined(HAVE_FANOTIFY)
+    bool fanotifyWatch(const Path &path);
+    void fanotifyReadyRead();
+    int mFanotifyFd;
+    // a directory fd on every marked filesystem, for open_by_handle_at()
+    Map<uint64_t, int> mFanotifyMounts;
 #endif
     Signal<std::function<void(const Path&)> > mRemoved, mModified, mAdded;
+    Signal<std::function<void(const Changes &)> > mChanged;
+
+    unsigned int mFlags;
+    int mCoalesce;
+    uint64_t mPendingSince;
+    Changes mPending;
+    Timer mCoalesceTimer;
+    // directories that were watched with Recursive
+    Set<Path> mRecursive;
+    static Path::VisitResult watchRecursive(const Path &path, void *userData);
 
-    struct Changes {
-        enum Type {
-            Add,
-            Remove,
-            Modified
-        };
-        void add(Type type, const Path &path)
-        {
-            switch (type) {
-            case Add:
-                if (!removed.remove(path))
-                    added.insert(path);
-                break;
-            case Remove:
-                if (!added.remove(path))
-                    removed.insert(path);
-                break;
-            case Modified:
-                modified.insert(path);
-                break;
-            }
-        }
-        Set<Path> added, removed, modified;
-    };
     void processChanges(const Changes &changes);
+    void flushChanges();
 };
 #endif
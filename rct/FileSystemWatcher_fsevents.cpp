@@ -250,8 +250,8 @@ void WatcherData::notifyCallback(ConstFSEventStreamRef streamRef,
     }
 }
 
-FileSystemWatcher::FileSystemWatcher()
-    : mWatcher(new WatcherData(this))
+FileSystemWatcher::FileSystemWatcher(unsigned int flags)
+    : mWatcher(new WatcherData(this)), mFlags(flags), mCoalesce(0), mPendingSince(0)
 {
     mWatcher->waitForStarted();
 }
@@ -321,21 +321,21 @@ bool FileSystemWatcher::unwatch(const Path &p)
 
 void FileSystemWatcher::pathsAdded(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        mAdded(path);
-    }
+    Changes changes;
+    changes.added = paths;
+    processChanges(changes);
 }
 
 void FileSystemWatcher::pathsRemoved(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        mRemoved(path);
-    }
+    Changes changes;
+    changes.removed = paths;
+    processChanges(changes);
 }
 
 void FileSystemWatcher::pathsModified(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        mModified(path);
-    }
+    Changes changes;
+    changes.modified = paths;
+    processChanges(changes);
 }
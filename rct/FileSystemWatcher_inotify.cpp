@@ -7,8 +7,18 @@
 #include "StackBuffer.h"
 #include "Rct.h"
 #include <errno.h>
+#ifdef HAVE_FANOTIFY
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#endif
 
-FileSystemWatcher::FileSystemWatcher()
+FileSystemWatcher::FileSystemWatcher(unsigned int flags)
+    :
+#ifdef HAVE_FANOTIFY
+      mFanotifyFd(-1),
+#endif
+      mFlags(flags), mCoalesce(0), mPendingSince(0)
 {
     mTimer.timeout().connect([this](Timer *) {
             notifyReadyRead(); });
@@ -27,6 +37,14 @@ FileSystemWatcher::~FileSystemWatcher()
         inotify_rm_watch(mFd, it->second);
     }
     close(mFd);
+#ifdef HAVE_FANOTIFY
+    if (mFanotifyFd != -1) {
+        EventLoop::eventLoop()->unregisterSocket(mFanotifyFd);
+        close(mFanotifyFd);
+    }
+    for (const auto &mount : mFanotifyMounts)
+        close(mount.second);
+#endif
 }
 
 void FileSystemWatcher::clear()
@@ -36,6 +54,7 @@ void FileSystemWatcher::clear()
     }
     mWatchedByPath.clear();
     mWatchedById.clear();
+    mRecursive.clear();
 }
 
 bool FileSystemWatcher::watch(const Path &p)
@@ -124,10 +143,17 @@ static inline void foolishness2();
 static inline void foolishness() { dump(0); foolishness2(); }
 static inline void foolishness2() { foolishness(); }
 
+static Path::VisitResult addCreated(const Path &path, void *userData)
+{
+    static_cast<FileSystemWatcher::Changes*>(userData)->add(FileSystemWatcher::Changes::Add, path);
+    return Path::Recurse;
+}
+
 void FileSystemWatcher::notifyReadyRead()
 {
     // printf("notifyReadyRead\n");
     Changes changes;
+    List<Path> createdDirs;
     {
         std::lock_guard<std::mutex> lock(mMutex);
         int s = 0;
@@ -152,10 +178,14 @@ void FileSystemWatcher::notifyReadyRead()
 
             if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT)) {
                 changes.add(Changes::Remove, path);
+                mRecursive.remove(path);
             } else if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
+                const bool recursive = (event->mask & IN_ISDIR) && mRecursive.contains(path);
                 if (isDir)
                     path.append(event->name);
                 changes.add(Changes::Add, path);
+                if (recursive)
+                    createdDirs.append(path);
             } else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
                 if (isDir)
                     path.append(event->name);
@@ -167,5 +197,114 @@ void FileSystemWatcher::notifyReadyRead()
             }
         }
     }
+    for (const Path &dir : createdDirs) {
+        // whatever was created in it before it was being watched
+        watch(dir, Recursive);
+        dir.visit(addCreated, &changes);
+    }
+    processChanges(changes);
+}
+
+#ifdef HAVE_FANOTIFY
+// statfs() and fanotify have their own fsid types, both are two ints
+static uint64_t fsidKey(const int *val)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(val[0])) << 32) | static_cast<uint32_t>(val[1]);
+}
+
+bool FileSystemWatcher::fanotifyWatch(const Path &path)
+{
+    if (mFanotifyFd == -1) {
+        mFanotifyFd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_NONBLOCK|FAN_CLOEXEC, O_RDONLY|O_LARGEFILE);
+        if (mFanotifyFd == -1) {
+            debug() << "FileSystemWatcher: no fanotify" << Rct::strerror();
+            mFlags &= ~Fanotify;
+            return false;
+        }
+        EventLoop::eventLoop()->registerSocket(mFanotifyFd, EventLoop::SocketRead, [this](int, unsigned int) {
+                fanotifyReadyRead();
+            });
+    }
+
+    struct statfs fs;
+    if (statfs(path.constData(), &fs))
+        return false;
+    const uint64_t key = fsidKey(fs.f_fsid.__val);
+    if (mFanotifyMounts.contains(key))
+        return true;
+    const int mountFd = open(path.constData(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (mountFd == -1)
+        return false;
+    const uint64_t mask = FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_ATTRIB|FAN_CLOSE_WRITE|FAN_DELETE_SELF|FAN_ONDIR;
+    if (fanotify_mark(mFanotifyFd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, mask, AT_FDCWD, path.constData())) {
+        debug() << "FileSystemWatcher: can't mark the filesystem of" << path << Rct::strerror();
+        close(mountFd);
+        return false;
+    }
+    mFanotifyMounts[key] = mountFd;
+    return true;
+}
+
+void FileSystemWatcher::fanotifyReadyRead()
+{
+    // events for the whole filesystem come in, only those under a
+    // recursive watch are reported
+    Changes changes;
+    char buf[16384] __attribute__((aligned(__alignof__(fanotify_event_metadata))));
+    char link[64], resolved[PATH_MAX];
+    for (;;) {
+        ssize_t len;
+        eintrwrap(len, ::read(mFanotifyFd, buf, sizeof(buf)));
+        if (len <= 0)
+            break;
+        for (const fanotify_event_metadata *event = reinterpret_cast<const fanotify_event_metadata*>(buf);
+             FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION || event->event_len <= event->metadata_len)
+                continue;
+            const fanotify_event_info_fid *fid = reinterpret_cast<const fanotify_event_info_fid*>(event + 1);
+            if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+                continue;
+            const int mountFd = mFanotifyMounts.value(fsidKey(fid->fsid.val), -1);
+            if (mountFd == -1)
+                continue;
+            file_handle *handle = const_cast<file_handle*>(reinterpret_cast<const file_handle*>(fid->handle));
+            // the directory may be gone already, then there's nothing to say where it was
+            const int dirFd = open_by_handle_at(mountFd, handle, O_PATH|O_CLOEXEC);
+            if (dirFd == -1)
+                continue;
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", dirFd);
+            const ssize_t w = readlink(link, resolved, sizeof(resolved) - 1);
+            close(dirFd);
+            if (w <= 0)
+                continue;
+            Path path(resolved, w);
+            if (!path.endsWith('/'))
+                path.append('/');
+            if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                const char *name = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+                if (strcmp(name, "."))
+                    path.append(name);
+            }
+            bool watched = false;
+            for (const Path &root : mRecursive) {
+                if (path.startsWith(root)) {
+                    watched = true;
+                    break;
+                }
+            }
+            if (!watched)
+                continue;
+
+            // events for the same path get merged, a create and a
+            // close_write can come as one
+            if (event->mask & (FAN_CREATE|FAN_MOVED_TO))
+                changes.add(Changes::Add, path);
+            if (event->mask & (FAN_ATTRIB|FAN_CLOSE_WRITE))
+                changes.add(Changes::Modified, path);
+            if (event->mask & (FAN_DELETE|FAN_MOVED_FROM|FAN_DELETE_SELF))
+                changes.add(Changes::Remove, path);
+        }
+    }
     processChanges(changes);
 }
+#endif
@@ -10,7 +10,8 @@
 #include <fcntl.h>
 #include <errno.h>
 
-FileSystemWatcher::FileSystemWatcher()
+FileSystemWatcher::FileSystemWatcher(unsigned int flags)
+    : mFlags(flags), mCoalesce(0), mPendingSince(0)
 {
     mFd = kqueue();
     assert(mFd != -1);
@@ -284,28 +285,17 @@ void FileSystemWatcher::notifyReadyRead()
                     p.visit(updateFiles, &data);
                     //printf("after updateFiles, added %d, modified %d, removed %d\n",
                     //       data.added.size(), data.modified.size(), data.all.size());
-
-                    lock.unlock();
-                    struct {
-                        Signal<std::function<void(const Path&)> > &signal;
-                        const Set<Path> &paths;
-                    } signals[] = {
-                        { mModified, data.modified },
-                        { mAdded, data.added }
-                    };
-                    const unsigned int count = sizeof(signals) / sizeof(signals[0]);
-                    for (unsigned i=0; i<count; ++i) {
-                        for (Set<Path>::const_iterator it = signals[i].paths.begin(); it != signals[i].paths.end(); ++it) {
-                            signals[i].signal(*it);
-                        }
-                    }
                 }
 
                 if (lock.owns_lock())
                     lock.unlock();
-                for (Set<Path>::const_iterator it = data.all.begin(); it != data.all.end(); ++it) {
-                    mRemoved(*it);
+                Changes changes;
+                if (!(event.fflags & (NOTE_DELETE|NOTE_REVOKE|NOTE_RENAME))) {
+                    changes.modified = data.modified;
+                    changes.added = data.added;
                 }
+                changes.removed = data.all;
+                processChanges(changes);
             }
         }
     }
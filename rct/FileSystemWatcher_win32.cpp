@@ -317,8 +317,8 @@ void WatcherData::stop()
     changes.clear();
 }
 
-FileSystemWatcher::FileSystemWatcher()
-    : mWatcher(new WatcherData(this))
+FileSystemWatcher::FileSystemWatcher(unsigned int flags)
+    : mWatcher(new WatcherData(this)), mFlags(flags), mCoalesce(0), mPendingSince(0)
 {
     mWatcher->wakeupHandle = CreateEvent(NULL, FALSE, FALSE, NULL);
     mWatcher->thread = std::thread(std::bind(&WatcherData::run, mWatcher));
@@ -368,24 +368,21 @@ bool FileSystemWatcher::unwatch(const Path& p)
 
 void FileSystemWatcher::pathsAdded(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        //printf("really added %s\n", path.constData());
-        mAdded(path);
-    }
+    Changes changes;
+    changes.added = paths;
+    processChanges(changes);
 }
 
 void FileSystemWatcher::pathsRemoved(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        //printf("really removed %s\n", path.constData());
-        mRemoved(path);
-    }
+    Changes changes;
+    changes.removed = paths;
+    processChanges(changes);
 }
 
 void FileSystemWatcher::pathsModified(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        //printf("really modified %s\n", path.constData());
-        mModified(path);
-    }
+    Changes changes;
+    changes.modified = paths;
+    processChanges(changes);
 }
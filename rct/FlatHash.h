@@ -0,0 +1,524 @@
+#ifndef FlatHash_h
+#define FlatHash_h
+
+#include <rct/FastHash.h>
+#include <rct/List.h>
+#include <rct/Set.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <new>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The control bytes of one group of 16 slots, each either Empty, Deleted
+// or the low 7 bits of the hash of the key in the slot. The matches are
+// bitmasks with bit n set for slot n.
+struct FlatGroup
+{
+    enum { Size = 16 };
+    enum { Empty = -128, Deleted = -2 };
+
+    static inline uint32_t match(const int8_t *ctrl, int8_t h2)
+    {
+#ifdef __SSE2__
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), group));
+#else
+        uint32_t ret = 0;
+        for (int i = 0; i < Size; ++i)
+            ret |= static_cast<uint32_t>(ctrl[i] == h2) << i;
+        return ret;
+#endif
+    }
+
+    static inline uint32_t matchEmpty(const int8_t *ctrl) { return match(ctrl, Empty); }
+
+    static inline uint32_t matchEmptyOrDeleted(const int8_t *ctrl)
+    {
+#ifdef __SSE2__
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+        return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), group));
+#else
+        uint32_t ret = 0;
+        for (int i = 0; i < Size; ++i)
+            ret |= static_cast<uint32_t>(ctrl[i] < -1) << i;
+        return ret;
+#endif
+    }
+};
+
+template <typename Key, typename Slot>
+struct FlatSlot
+{
+    static const Key &key(const Slot &slot) { return slot.first; }
+};
+
+template <typename Key>
+struct FlatSlot<Key, Key>
+{
+    static const Key &key(const Key &key) { return key; }
+};
+
+// Open addressing table of Slots, in the style of Abseil's Swiss tables.
+// The slots are one array next to their control bytes, a lookup compares
+// the 7 bit hashes of a group of 16 slots at a time and only looks at the
+// slots that match, until it reaches a group with an empty slot. At most
+// 7/8 of the slots are in use, so an entry costs sizeof(Slot) * 8 / 7 + 1
+// bytes at worst and there is no allocation per entry.
+//
+// Erasing doesn't move other slots, so iterators and pointers to the
+// other entries stay valid. Inserting may rehash, which invalidates all of
+// them.
+template <typename Key, typename Slot, typename Hasher>
+class FlatTable
+{
+public:
+    FlatTable()
+        : mSlots(0), mCtrl(0), mCapacity(0), mSize(0), mGrowthLeft(0)
+    {}
+
+    FlatTable(const FlatTable &other)
+        : mSlots(0), mCtrl(0), mCapacity(0), mSize(0), mGrowthLeft(0)
+    {
+        reserve(other.mSize);
+        for (size_t i = 0; i < other.mCapacity; ++i) {
+            if (other.mCtrl[i] >= 0)
+                insertNew(hashOf(FlatSlot<Key, Slot>::key(other.mSlots[i])), other.mSlots[i]);
+        }
+    }
+
+    FlatTable(FlatTable &&other)
+        : mSlots(other.mSlots), mCtrl(other.mCtrl), mCapacity(other.mCapacity),
+          mSize(other.mSize), mGrowthLeft(other.mGrowthLeft)
+    {
+        other.mSlots = 0;
+        other.mCtrl = 0;
+        other.mCapacity = other.mSize = other.mGrowthLeft = 0;
+    }
+
+    ~FlatTable()
+    {
+        destroy();
+    }
+
+    FlatTable &operator=(const FlatTable &other)
+    {
+        if (this != &other) {
+            FlatTable copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    FlatTable &operator=(FlatTable &&other)
+    {
+        if (this != &other) {
+            clear();
+            swap(other);
+        }
+        return *this;
+    }
+
+    void swap(FlatTable &other)
+    {
+        std::swap(mSlots, other.mSlots);
+        std::swap(mCtrl, other.mCtrl);
+        std::swap(mCapacity, other.mCapacity);
+        std::swap(mSize, other.mSize);
+        std::swap(mGrowthLeft, other.mGrowthLeft);
+    }
+
+    template <typename T>
+    class Iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef T *pointer;
+        typedef T &reference;
+
+        Iterator() : mTable(0), mIndex(0) {}
+        // iterator to const_iterator
+        template <typename Other>
+        Iterator(const Iterator<Other> &other) : mTable(other.mTable), mIndex(other.mIndex) {}
+
+        T &operator*() const { return mTable->mSlots[mIndex]; }
+        T *operator->() const { return mTable->mSlots + mIndex; }
+        Iterator &operator++()
+        {
+            while (++mIndex < mTable->mCapacity && mTable->mCtrl[mIndex] < 0) {}
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            Iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const Iterator &other) const { return mIndex == other.mIndex; }
+        bool operator!=(const Iterator &other) const { return mIndex != other.mIndex; }
+    private:
+        Iterator(const FlatTable *table, size_t index) : mTable(table), mIndex(index) {}
+
+        const FlatTable *mTable;
+        size_t mIndex;
+
+        friend class FlatTable;
+        template <typename> friend class Iterator;
+    };
+    typedef Iterator<Slot> iterator;
+    typedef Iterator<const Slot> const_iterator;
+
+    iterator begin() { return iterator(this, firstIndex()); }
+    iterator end() { return iterator(this, mCapacity); }
+    const_iterator begin() const { return const_iterator(this, firstIndex()); }
+    const_iterator end() const { return const_iterator(this, mCapacity); }
+    const_iterator constBegin() const { return begin(); }
+    const_iterator constEnd() const { return end(); }
+
+    iterator find(const Key &key) { return iterator(this, findIndex(key, hashOf(key))); }
+    const_iterator find(const Key &key) const { return const_iterator(this, findIndex(key, hashOf(key))); }
+    bool contains(const Key &key) const { return findIndex(key, hashOf(key)) != mCapacity; }
+
+    // Returns the iterator to the entry after it
+    iterator erase(const_iterator it)
+    {
+        assert(it.mIndex < mCapacity && mCtrl[it.mIndex] >= 0);
+        eraseIndex(it.mIndex);
+        iterator ret(this, it.mIndex);
+        return ++ret;
+    }
+
+    bool erase(const Key &key)
+    {
+        const size_t index = findIndex(key, hashOf(key));
+        if (index == mCapacity)
+            return false;
+        eraseIndex(index);
+        return true;
+    }
+
+    int size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    bool empty() const { return !mSize; }
+    size_t capacity() const { return mCapacity; }
+
+    void clear()
+    {
+        destroy();
+        mSlots = 0;
+        mCtrl = 0;
+        mCapacity = mSize = mGrowthLeft = 0;
+    }
+
+    // Room for count entries without rehashing
+    void reserve(size_t count)
+    {
+        size_t capacity = FlatGroup::Size;
+        while (maxLoad(capacity) < count)
+            capacity *= 2;
+        if (capacity > mCapacity)
+            rehash(capacity);
+    }
+
+protected:
+    // The entry for key, constructing the slot from args if there isn't one
+    template <typename... Args>
+    std::pair<Slot*, bool> insertSlot(const Key &key, Args &&...args)
+    {
+        const size_t hash = hashOf(key);
+        const size_t index = findIndex(key, hash);
+        if (index != mCapacity)
+            return std::make_pair(mSlots + index, false);
+        return std::make_pair(insertNew(hash, std::forward<Args>(args)...), true);
+    }
+
+private:
+    static size_t maxLoad(size_t capacity) { return capacity - (capacity / 8); }
+
+    static size_t hashOf(const Key &key)
+    {
+        // std::hash, which FastHasher uses for anything but strings, is the
+        // identity for integers, mixed so the 7 bits of the control byte
+        // and the group index come from all of it
+        const uint64_t hash = static_cast<uint64_t>(Hasher()(key)) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+
+    size_t firstIndex() const
+    {
+        size_t index = 0;
+        while (index < mCapacity && mCtrl[index] < 0)
+            ++index;
+        return index;
+    }
+
+    size_t findIndex(const Key &key, size_t hash) const
+    {
+        if (!mSize)
+            return mCapacity;
+        const int8_t h2 = static_cast<int8_t>(hash & 0x7f);
+        const size_t mask = (mCapacity / FlatGroup::Size) - 1;
+        size_t group = (hash >> 7) & mask;
+        // triangular probing visits every group once
+        for (size_t step = 1; ; ++step) {
+            const int8_t *ctrl = mCtrl + (group * FlatGroup::Size);
+            uint32_t matches = FlatGroup::match(ctrl, h2);
+            while (matches) {
+                const size_t index = (group * FlatGroup::Size) + __builtin_ctz(matches);
+                if (FlatSlot<Key, Slot>::key(mSlots[index]) == key)
+                    return index;
+                matches &= matches - 1;
+            }
+            if (FlatGroup::matchEmpty(ctrl))
+                return mCapacity;
+            group = (group + step) & mask;
+        }
+    }
+
+    // The first empty or deleted slot on the probe sequence of hash
+    size_t findFree(size_t hash) const
+    {
+        const size_t mask = (mCapacity / FlatGroup::Size) - 1;
+        size_t group = (hash >> 7) & mask;
+        for (size_t step = 1; ; ++step) {
+            const uint32_t free = FlatGroup::matchEmptyOrDeleted(mCtrl + (group * FlatGroup::Size));
+            if (free)
+                return (group * FlatGroup::Size) + __builtin_ctz(free);
+            group = (group + step) & mask;
+        }
+    }
+
+    // For a key that isn't in the table
+    template <typename... Args>
+    Slot *insertNew(size_t hash, Args &&...args)
+    {
+        size_t index = mCapacity ? findFree(hash) : 0;
+        if (!mGrowthLeft && (!mCapacity || mCtrl[index] == FlatGroup::Empty)) {
+            // reusing deleted slots doesn't use up growth, when that's
+            // more than half of it a rehash at the same size is enough
+            rehash(!mCapacity ? static_cast<size_t>(FlatGroup::Size) : mSize * 2 <= maxLoad(mCapacity) ? mCapacity : mCapacity * 2);
+            index = findFree(hash);
+        }
+        Slot *slot = new (mSlots + index) Slot(std::forward<Args>(args)...);
+        if (mCtrl[index] == FlatGroup::Empty)
+            --mGrowthLeft;
+        mCtrl[index] = static_cast<int8_t>(hash & 0x7f);
+        ++mSize;
+        return slot;
+    }
+
+    void eraseIndex(size_t index)
+    {
+        mSlots[index].~Slot();
+        --mSize;
+        // No lookup has probed past a group that had an empty slot when it
+        // was inserted, and a full group only gets empty slots back by
+        // rehashing, so its slots have to become tombstones
+        if (FlatGroup::matchEmpty(mCtrl + (index & ~static_cast<size_t>(FlatGroup::Size - 1)))) {
+            mCtrl[index] = FlatGroup::Empty;
+            ++mGrowthLeft;
+        } else {
+            mCtrl[index] = FlatGroup::Deleted;
+        }
+    }
+
+    void rehash(size_t capacity)
+    {
+        Slot *slots = mSlots;
+        int8_t *ctrl = mCtrl;
+        const size_t oldCapacity = mCapacity;
+
+        char *memory = static_cast<char*>(::operator new(capacity * (sizeof(Slot) + 1)));
+        mSlots = reinterpret_cast<Slot*>(memory);
+        mCtrl = reinterpret_cast<int8_t*>(memory + (capacity * sizeof(Slot)));
+        memset(mCtrl, FlatGroup::Empty, capacity);
+        mCapacity = capacity;
+        mGrowthLeft = maxLoad(capacity) - mSize;
+
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (ctrl[i] >= 0) {
+                const size_t hash = hashOf(FlatSlot<Key, Slot>::key(slots[i]));
+                const size_t index = findFree(hash);
+                new (mSlots + index) Slot(std::move(slots[i]));
+                mCtrl[index] = static_cast<int8_t>(hash & 0x7f);
+                slots[i].~Slot();
+            }
+        }
+        ::operator delete(slots);
+    }
+
+    void destroy()
+    {
+        for (size_t i = 0; i < mCapacity; ++i) {
+            if (mCtrl[i] >= 0)
+                mSlots[i].~Slot();
+        }
+        ::operator delete(mSlots);
+    }
+
+    Slot *mSlots;
+    int8_t *mCtrl;
+    size_t mCapacity, mSize, mGrowthLeft;
+};
+
+// Hash with open addressing, see FlatTable. Iterating gives
+// std::pair<Key, Value>, whose key mustn't be changed.
+template <typename Key, typename Value, typename Hasher = FastHasher<Key> >
+class FlatHash : public FlatTable<Key, std::pair<Key, Value>, Hasher>
+{
+public:
+    typedef FlatTable<Key, std::pair<Key, Value>, Hasher> Base;
+
+    FlatHash() {}
+
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0) const
+    {
+        typename Base::const_iterator it = Base::find(key);
+        if (it == Base::end()) {
+            if (ok)
+                *ok = false;
+            return defaultValue;
+        }
+        if (ok)
+            *ok = true;
+        return it->second;
+    }
+
+    void deleteAll()
+    {
+        for (typename Base::iterator it = Base::begin(); it != Base::end(); ++it)
+            delete it->second;
+        Base::clear();
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool removed = remove(key, &ret);
+        if (ok)
+            *ok = removed;
+        return ret;
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        typename Base::iterator it = Base::find(key);
+        if (it != Base::end()) {
+            if (value)
+                *value = std::move(it->second);
+            Base::erase(it);
+            return true;
+        }
+        if (value)
+            *value = Value();
+        return false;
+    }
+
+    int remove(std::function<bool(const Key &key)> match)
+    {
+        int ret = 0;
+        typename Base::iterator it = Base::begin();
+        while (it != Base::end()) {
+            if (match(it->first)) {
+                it = Base::erase(it);
+                ++ret;
+            } else {
+                ++it;
+            }
+        }
+        return ret;
+    }
+
+    bool insert(const Key &key, const Value &value)
+    {
+        return Base::insertSlot(key, key, value).second;
+    }
+
+    Value &operator[](const Key &key)
+    {
+        return Base::insertSlot(key, key, Value()).first->second;
+    }
+
+    const Value &operator[](const Key &key) const
+    {
+        assert(Base::contains(key));
+        return Base::find(key)->second;
+    }
+
+    FlatHash &unite(const FlatHash &other, int *count = 0)
+    {
+        for (typename Base::const_iterator it = other.begin(); it != other.end(); ++it) {
+            const std::pair<std::pair<Key, Value>*, bool> slot = Base::insertSlot(it->first, *it);
+            if (slot.second) {
+                if (count)
+                    ++*count;
+            } else if (!(slot.first->second == it->second)) {
+                slot.first->second = it->second;
+                if (count)
+                    ++*count;
+            }
+        }
+        return *this;
+    }
+
+    FlatHash &subtract(const FlatHash &other)
+    {
+        for (typename Base::const_iterator it = other.begin(); it != other.end(); ++it)
+            Base::erase(it->first);
+        return *this;
+    }
+
+    FlatHash &operator+=(const FlatHash &other) { return unite(other); }
+    FlatHash &operator-=(const FlatHash &other) { return subtract(other); }
+
+    List<Key> keys() const
+    {
+        List<Key> keys;
+        keys.reserve(Base::size());
+        for (typename Base::const_iterator it = Base::begin(); it != Base::end(); ++it)
+            keys.append(it->first);
+        return keys;
+    }
+
+    Set<Key> keysAsSet() const
+    {
+        Set<Key> keys;
+        for (typename Base::const_iterator it = Base::begin(); it != Base::end(); ++it)
+            keys.insert(it->first);
+        return keys;
+    }
+
+    List<Value> values() const
+    {
+        List<Value> values;
+        values.reserve(Base::size());
+        for (typename Base::const_iterator it = Base::begin(); it != Base::end(); ++it)
+            values.append(it->second);
+        return values;
+    }
+};
+
+template <typename Key, typename Value, typename Hasher>
+inline const FlatHash<Key, Value, Hasher> operator+(const FlatHash<Key, Value, Hasher> &l, const FlatHash<Key, Value, Hasher> &r)
+{
+    FlatHash<Key, Value, Hasher> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename Hasher>
+inline const FlatHash<Key, Value, Hasher> operator-(const FlatHash<Key, Value, Hasher> &l, const FlatHash<Key, Value, Hasher> &r)
+{
+    FlatHash<Key, Value, Hasher> ret = l;
+    ret -= r;
+    return ret;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef FlatHashSet_h
+#define FlatHashSet_h
+
+#include <rct/FlatHash.h>
+
+// Unordered set with open addressing, see FlatTable
+template <typename T, typename Hasher = FastHasher<T> >
+class FlatHashSet : public FlatTable<T, T, Hasher>
+{
+public:
+    typedef FlatTable<T, T, Hasher> Base;
+    // changing an entry would lose it
+    typedef typename Base::const_iterator iterator;
+    typedef typename Base::const_iterator const_iterator;
+
+    FlatHashSet() {}
+
+    const_iterator begin() const { return Base::begin(); }
+    const_iterator end() const { return Base::end(); }
+    const_iterator find(const T &t) const { return Base::find(t); }
+
+    bool insert(const T &t)
+    {
+        return Base::insertSlot(t, t).second;
+    }
+
+    bool remove(const T &t)
+    {
+        return Base::erase(t);
+    }
+
+    int remove(std::function<bool(const T &t)> match)
+    {
+        int ret = 0;
+        const_iterator it = begin();
+        while (it != end()) {
+            if (match(*it)) {
+                it = Base::erase(it);
+                ++ret;
+            } else {
+                ++it;
+            }
+        }
+        return ret;
+    }
+
+    List<T> toList() const
+    {
+        List<T> ret;
+        ret.reserve(Base::size());
+        for (const_iterator it = begin(); it != end(); ++it)
+            ret.append(*it);
+        return ret;
+    }
+
+    void deleteAll()
+    {
+        for (const_iterator it = begin(); it != end(); ++it)
+            delete *it;
+        Base::clear();
+    }
+
+    FlatHashSet &unite(const FlatHashSet &other, int *count = 0)
+    {
+        int c = 0;
+        for (const_iterator it = other.begin(); it != other.end(); ++it) {
+            if (insert(*it))
+                ++c;
+        }
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    FlatHashSet &unite(const List<T> &other, int *count = 0)
+    {
+        int c = 0;
+        for (const T &t : other) {
+            if (insert(t))
+                ++c;
+        }
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    FlatHashSet &subtract(const FlatHashSet &other, int *count = 0)
+    {
+        int c = 0;
+        for (const_iterator it = other.begin(); it != other.end(); ++it) {
+            if (remove(*it))
+                ++c;
+        }
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    bool intersects(const FlatHashSet &other) const
+    {
+        const FlatHashSet &smaller = Base::size() <= other.size() ? *this : other;
+        const FlatHashSet &larger = &smaller == this ? other : *this;
+        for (const_iterator it = smaller.begin(); it != smaller.end(); ++it) {
+            if (larger.contains(*it))
+                return true;
+        }
+        return false;
+    }
+
+    bool operator==(const FlatHashSet &other) const
+    {
+        if (Base::size() != other.size())
+            return false;
+        for (const_iterator it = begin(); it != end(); ++it) {
+            if (!other.contains(*it))
+                return false;
+        }
+        return true;
+    }
+    bool operator!=(const FlatHashSet &other) const { return !operator==(other); }
+
+    FlatHashSet &operator+=(const FlatHashSet &other) { return unite(other); }
+    FlatHashSet &operator+=(const T &t) { insert(t); return *this; }
+    FlatHashSet &operator+=(const List<T> &other) { return unite(other); }
+    FlatHashSet &operator<<(const T &t) { insert(t); return *this; }
+    FlatHashSet &operator<<(const List<T> &t) { return unite(t); }
+    FlatHashSet &operator<<(const FlatHashSet &t) { return unite(t); }
+    FlatHashSet &operator-=(const FlatHashSet &other) { return subtract(other); }
+};
+
+template <typename T, typename Hasher>
+inline const FlatHashSet<T, Hasher> operator+(const FlatHashSet<T, Hasher> &l, const FlatHashSet<T, Hasher> &r)
+{
+    FlatHashSet<T, Hasher> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename T, typename Hasher>
+inline const FlatHashSet<T, Hasher> operator-(const FlatHashSet<T, Hasher> &l, const FlatHashSet<T, Hasher> &r)
+{
+    FlatHashSet<T, Hasher> ret = l;
+    ret -= r;
+    return ret;
+}
+
+#endif
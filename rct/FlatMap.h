@@ -0,0 +1,285 @@
+#ifndef FlatMap_h
+#define FlatMap_h
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Set.h>
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+// Map on a vector of pairs sorted by key, see FlatSet. Iterating gives
+// std::pair<Key, Value>, whose key mustn't be changed.
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FlatMap
+{
+public:
+    typedef std::pair<Key, Value> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+    FlatMap() {}
+    FlatMap(std::initializer_list<value_type> init) : mEntries(init) { sort(); }
+    // Takes the entries in any order, where a key repeats the last one wins
+    explicit FlatMap(std::vector<value_type> &&entries) : mEntries(std::move(entries)) { sort(); }
+    explicit FlatMap(const Map<Key, Value, Compare> &map) : mEntries(map.begin(), map.end()) {}
+
+    iterator begin() { return mEntries.begin(); }
+    iterator end() { return mEntries.end(); }
+    const_iterator begin() const { return mEntries.begin(); }
+    const_iterator end() const { return mEntries.end(); }
+    const_iterator constBegin() const { return mEntries.begin(); }
+    const_iterator constEnd() const { return mEntries.end(); }
+
+    iterator lower_bound(const Key &key)
+    {
+        return std::lower_bound(mEntries.begin(), mEntries.end(), key, KeyCompare());
+    }
+    const_iterator lower_bound(const Key &key) const
+    {
+        return std::lower_bound(mEntries.begin(), mEntries.end(), key, KeyCompare());
+    }
+    iterator upper_bound(const Key &key)
+    {
+        return std::upper_bound(mEntries.begin(), mEntries.end(), key, KeyCompare());
+    }
+    const_iterator upper_bound(const Key &key) const
+    {
+        return std::upper_bound(mEntries.begin(), mEntries.end(), key, KeyCompare());
+    }
+
+    iterator find(const Key &key)
+    {
+        const iterator it = lower_bound(key);
+        return it != end() && !Compare()(key, it->first) ? it : end();
+    }
+    const_iterator find(const Key &key) const
+    {
+        const const_iterator it = lower_bound(key);
+        return it != end() && !Compare()(key, it->first) ? it : end();
+    }
+
+    bool contains(const Key &key) const { return find(key) != end(); }
+    bool isEmpty() const { return mEntries.empty(); }
+    bool empty() const { return mEntries.empty(); }
+    int size() const { return mEntries.size(); }
+    void clear() { mEntries.clear(); }
+    void reserve(int count) { mEntries.reserve(count); }
+
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0) const
+    {
+        const const_iterator it = find(key);
+        if (it == end()) {
+            if (ok)
+                *ok = false;
+            return defaultValue;
+        }
+        if (ok)
+            *ok = true;
+        return it->second;
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool removed = remove(key, &ret);
+        if (ok)
+            *ok = removed;
+        return ret;
+    }
+
+    iterator erase(const_iterator it)
+    {
+        return mEntries.erase(mEntries.begin() + (it - constBegin()));
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        const iterator it = find(key);
+        if (it != end()) {
+            if (value)
+                *value = std::move(it->second);
+            erase(it);
+            return true;
+        }
+        if (value)
+            *value = Value();
+        return false;
+    }
+
+    int remove(std::function<bool(const Key &key)> match)
+    {
+        const iterator it = std::remove_if(mEntries.begin(), mEntries.end(),
+                                           [&match](const value_type &entry) { return match(entry.first); });
+        const int ret = mEntries.end() - it;
+        mEntries.erase(it, mEntries.end());
+        return ret;
+    }
+
+    void deleteAll()
+    {
+        for (const value_type &entry : mEntries)
+            delete entry.second;
+        mEntries.clear();
+    }
+
+    bool insert(const Key &key, const Value &value)
+    {
+        const iterator it = lower_bound(key);
+        if (it != end() && !Compare()(key, it->first))
+            return false;
+        mEntries.insert(it, value_type(key, value));
+        return true;
+    }
+
+    Value &operator[](const Key &key)
+    {
+        iterator it = lower_bound(key);
+        if (it == end() || Compare()(key, it->first))
+            it = mEntries.insert(it, value_type(key, Value()));
+        return it->second;
+    }
+
+    const Value &operator[](const Key &key) const
+    {
+        assert(contains(key));
+        return find(key)->second;
+    }
+
+    // other's value wins for keys in both, the number of keys that were
+    // added or changed is added to count, like Map::unite() does
+    FlatMap &unite(const FlatMap &other, int *count = 0)
+    {
+        int c = 0;
+        if (other.isEmpty()) {
+        } else if (isEmpty()) {
+            mEntries = other.mEntries;
+            c = other.size();
+        } else if (Compare()(mEntries.back().first, other.mEntries.front().first)) {
+            mEntries.insert(mEntries.end(), other.mEntries.begin(), other.mEntries.end());
+            c = other.size();
+        } else {
+            std::vector<value_type> merged;
+            merged.reserve(mEntries.size() + other.mEntries.size());
+            const Compare less = Compare();
+            const_iterator a = constBegin(), b = other.begin();
+            while (a != constEnd() && b != other.end()) {
+                if (less(a->first, b->first)) {
+                    merged.push_back(*a++);
+                } else if (less(b->first, a->first)) {
+                    merged.push_back(*b++);
+                    ++c;
+                } else {
+                    if (!(a->second == b->second))
+                        ++c;
+                    merged.push_back(*b++);
+                    ++a;
+                }
+            }
+            merged.insert(merged.end(), a, constEnd());
+            c += other.end() - b;
+            merged.insert(merged.end(), b, other.end());
+            mEntries.swap(merged);
+        }
+        if (count)
+            *count += c;
+        return *this;
+    }
+
+    FlatMap &subtract(const FlatMap &other)
+    {
+        const Compare less = Compare();
+        const_iterator b = other.begin();
+        remove([&](const Key &key) {
+                while (b != other.end() && less(b->first, key))
+                    ++b;
+                return b != other.end() && !less(key, b->first);
+            });
+        return *this;
+    }
+
+    FlatMap &operator+=(const FlatMap &other) { return unite(other); }
+    FlatMap &operator-=(const FlatMap &other) { return subtract(other); }
+
+    List<Key> keys() const
+    {
+        List<Key> keys;
+        keys.reserve(size());
+        for (const value_type &entry : mEntries)
+            keys.append(entry.first);
+        return keys;
+    }
+
+    Set<Key> keysAsSet() const
+    {
+        Set<Key> keys;
+        for (const value_type &entry : mEntries)
+            keys.std::set<Key>::insert(keys.end(), entry.first);
+        return keys;
+    }
+
+    List<Value> values() const
+    {
+        List<Value> values;
+        values.reserve(size());
+        for (const value_type &entry : mEntries)
+            values.append(entry.second);
+        return values;
+    }
+
+    Map<Key, Value, Compare> toMap() const
+    {
+        Map<Key, Value, Compare> ret;
+        for (const value_type &entry : mEntries)
+            ret.std::map<Key, Value, Compare>::insert(ret.end(), entry);
+        return ret;
+    }
+
+private:
+    struct KeyCompare
+    {
+        bool operator()(const value_type &entry, const Key &key) const { return Compare()(entry.first, key); }
+        bool operator()(const Key &key, const value_type &entry) const { return Compare()(key, entry.first); }
+    };
+
+    void sort()
+    {
+        const Compare less = Compare();
+        const auto byKey = [&less](const value_type &a, const value_type &b) { return less(a.first, b.first); };
+        if (!std::is_sorted(mEntries.begin(), mEntries.end(), byKey))
+            std::stable_sort(mEntries.begin(), mEntries.end(), byKey);
+        // keep the last of every run of equal keys
+        size_t out = 0;
+        for (size_t i = 0; i < mEntries.size(); ++i) {
+            if (i + 1 < mEntries.size() && !less(mEntries[i].first, mEntries[i + 1].first))
+                continue;
+            if (out != i)
+                mEntries[out] = std::move(mEntries[i]);
+            ++out;
+        }
+        mEntries.erase(mEntries.begin() + out, mEntries.end());
+    }
+
+    std::vector<value_type> mEntries;
+};
+
+template <typename Key, typename Value, typename Compare>
+inline const FlatMap<Key, Value, Compare> operator+(const FlatMap<Key, Value, Compare> &l, const FlatMap<Key, Value, Compare> &r)
+{
+    FlatMap<Key, Value, Compare> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename Compare>
+inline const FlatMap<Key, Value, Compare> operator-(const FlatMap<Key, Value, Compare> &l, const FlatMap<Key, Value, Compare> &r)
+{
+    FlatMap<Key, Value, Compare> ret = l;
+    ret -= r;
+    return ret;
+}
+
+#endif
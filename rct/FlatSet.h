@@ -0,0 +1,248 @@
+#ifndef FlatSet_h
+#define FlatSet_h
+
+#include <rct/List.h>
+#include <rct/Set.h>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+// Set on a sorted vector. Lookups are binary searches over contiguous
+// memory and unite(), subtract() and intersected() are linear merges, but
+// inserting or removing a single value moves everything after it. Meant
+// for sets that are built once, in bulk, and queried many times.
+template <typename T, typename Compare = std::less<T> >
+class FlatSet
+{
+public:
+    typedef T value_type;
+    typedef typename std::vector<T>::const_iterator iterator;
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    FlatSet() {}
+    FlatSet(std::initializer_list<T> init) : mValues(init) { sort(); }
+    // Takes the values in any order, duplicates are dropped
+    explicit FlatSet(std::vector<T> &&values) : mValues(std::move(values)) { sort(); }
+    explicit FlatSet(const List<T> &values) : mValues(values) { sort(); }
+    explicit FlatSet(const Set<T> &set) : mValues(set.begin(), set.end()) { sort(); }
+
+    const_iterator begin() const { return mValues.begin(); }
+    const_iterator end() const { return mValues.end(); }
+    const_iterator constBegin() const { return mValues.begin(); }
+    const_iterator constEnd() const { return mValues.end(); }
+
+    const_iterator lower_bound(const T &t) const { return std::lower_bound(mValues.begin(), mValues.end(), t, Compare()); }
+    const_iterator upper_bound(const T &t) const { return std::upper_bound(mValues.begin(), mValues.end(), t, Compare()); }
+
+    const_iterator find(const T &t) const
+    {
+        const const_iterator it = lower_bound(t);
+        return it != end() && !Compare()(t, *it) ? it : end();
+    }
+
+    bool contains(const T &t) const { return find(t) != end(); }
+    bool isEmpty() const { return mValues.empty(); }
+    bool empty() const { return mValues.empty(); }
+    int size() const { return mValues.size(); }
+    void clear() { mValues.clear(); }
+    void reserve(int count) { mValues.reserve(count); }
+
+    // The sorted values
+    const std::vector<T> &values() const { return mValues; }
+
+    bool insert(const T &t)
+    {
+        const const_iterator it = lower_bound(t);
+        if (it != end() && !Compare()(t, *it))
+            return false;
+        mValues.insert(mValues.begin() + (it - begin()), t);
+        return true;
+    }
+
+    const_iterator erase(const_iterator it)
+    {
+        return mValues.erase(mValues.begin() + (it - begin()));
+    }
+
+    bool remove(const T &t)
+    {
+        const const_iterator it = find(t);
+        if (it == end())
+            return false;
+        erase(it);
+        return true;
+    }
+
+    int remove(std::function<bool(const T &t)> match)
+    {
+        const typename std::vector<T>::iterator it = std::remove_if(mValues.begin(), mValues.end(), match);
+        const int ret = mValues.end() - it;
+        mValues.erase(it, mValues.end());
+        return ret;
+    }
+
+    List<T> toList() const
+    {
+        return List<T>(mValues.begin(), mValues.end());
+    }
+
+    Set<T> toSet() const
+    {
+        Set<T> ret;
+        for (const T &t : mValues)
+            ret.std::set<T>::insert(ret.end(), t);
+        return ret;
+    }
+
+    void deleteAll()
+    {
+        for (const T &t : mValues)
+            delete t;
+        mValues.clear();
+    }
+
+    FlatSet &unite(const FlatSet &other, int *count = 0)
+    {
+        int c = 0;
+        if (other.isEmpty()) {
+        } else if (isEmpty()) {
+            mValues = other.mValues;
+            c = other.size();
+        } else if (Compare()(mValues.back(), other.mValues.front())) {
+            mValues.insert(mValues.end(), other.mValues.begin(), other.mValues.end());
+            c = other.size();
+        } else {
+            std::vector<T> merged;
+            merged.reserve(mValues.size() + other.mValues.size());
+            const Compare less = Compare();
+            const_iterator a = begin(), b = other.begin();
+            while (a != end() && b != other.end()) {
+                if (less(*a, *b)) {
+                    merged.push_back(*a++);
+                } else if (less(*b, *a)) {
+                    merged.push_back(*b++);
+                    ++c;
+                } else {
+                    merged.push_back(*a++);
+                    ++b;
+                }
+            }
+            merged.insert(merged.end(), a, end());
+            c += other.end() - b;
+            merged.insert(merged.end(), b, other.end());
+            mValues.swap(merged);
+        }
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    FlatSet &unite(const List<T> &other, int *count = 0)
+    {
+        return unite(FlatSet(other), count);
+    }
+
+    FlatSet &subtract(const FlatSet &other, int *count = 0)
+    {
+        const Compare less = Compare();
+        const_iterator b = other.begin();
+        const int before = size();
+        remove([&](const T &t) {
+                while (b != other.end() && less(*b, t))
+                    ++b;
+                return b != other.end() && !less(t, *b);
+            });
+        if (count)
+            *count = before - size();
+        return *this;
+    }
+
+    bool intersects(const FlatSet &other) const
+    {
+        const Compare less = Compare();
+        const_iterator a = begin(), b = other.begin();
+        while (a != end() && b != other.end()) {
+            if (less(*a, *b)) {
+                ++a;
+            } else if (less(*b, *a)) {
+                ++b;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    FlatSet intersected(const FlatSet &other) const
+    {
+        FlatSet ret;
+        std::set_intersection(begin(), end(), other.begin(), other.end(),
+                              std::back_inserter(ret.mValues), Compare());
+        return ret;
+    }
+
+    FlatSet &operator+=(const FlatSet &other) { return unite(other); }
+    FlatSet &operator+=(const T &t) { insert(t); return *this; }
+    FlatSet &operator+=(const List<T> &other) { return unite(other); }
+    FlatSet &operator<<(const T &t) { insert(t); return *this; }
+    FlatSet &operator<<(const List<T> &t) { return unite(t); }
+    FlatSet &operator<<(const FlatSet &t) { return unite(t); }
+    FlatSet &operator-=(const FlatSet &other) { return subtract(other); }
+
+    int compare(const FlatSet &other) const
+    {
+        const int me = size();
+        const int him = other.size();
+        if (me < him) {
+            return -1;
+        } else if (me > him) {
+            return 1;
+        }
+        const Compare less = Compare();
+        for (int i = 0; i < me; ++i) {
+            if (less(mValues[i], other.mValues[i])) {
+                return -1;
+            } else if (less(other.mValues[i], mValues[i])) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    bool operator==(const FlatSet &other) const { return !compare(other); }
+    bool operator!=(const FlatSet &other) const { return compare(other); }
+    bool operator<(const FlatSet &other) const { return compare(other) < 0; }
+    bool operator>(const FlatSet &other) const { return compare(other) > 0; }
+
+private:
+    void sort()
+    {
+        const Compare less = Compare();
+        if (!std::is_sorted(mValues.begin(), mValues.end(), less))
+            std::sort(mValues.begin(), mValues.end(), less);
+        mValues.erase(std::unique(mValues.begin(), mValues.end(),
+                                  [&less](const T &a, const T &b) { return !less(a, b); }),
+                      mValues.end());
+    }
+
+    std::vector<T> mValues;
+};
+
+template <typename T, typename Compare>
+inline const FlatSet<T, Compare> operator+(const FlatSet<T, Compare> &l, const FlatSet<T, Compare> &r)
+{
+    FlatSet<T, Compare> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename T, typename Compare>
+inline const FlatSet<T, Compare> operator-(const FlatSet<T, Compare> &l, const FlatSet<T, Compare> &r)
+{
+    FlatSet<T, Compare> ret = l;
+    ret -= r;
+    return ret;
+}
+
+#endif
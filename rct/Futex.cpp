@@ -0,0 +1,256 @@
+#include "Futex.h"
+#include "Rct.h"
+#ifdef OS_Linux
+# include <errno.h>
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <time.h>
+# include <unistd.h>
+#else
+# include <chrono>
+# include <condition_variable>
+# include <mutex>
+#endif
+
+#ifndef OS_Linux
+namespace {
+// Waiters on words that hash to the same bucket share it, wake() wakes all
+// of them and those whose word didn't change go back to sleep
+struct Bucket
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+enum { BucketCount = 64 };
+Bucket sBuckets[BucketCount];
+
+Bucket &bucket(const void *word)
+{
+    return sBuckets[(reinterpret_cast<uintptr_t>(word) >> 2) % BucketCount];
+}
+}
+#endif
+
+bool Futex::wait(std::atomic<uint32_t> *word, uint32_t value, int maxTime)
+{
+#ifdef OS_Linux
+    timespec timeout;
+    if (maxTime > 0) {
+        timeout.tv_sec = maxTime / 1000;
+        timeout.tv_nsec = (maxTime % 1000) * 1000000;
+    }
+    const long ret = syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+                             value, maxTime > 0 ? &timeout : 0, 0, 0);
+    return ret == 0 || errno != ETIMEDOUT;
+#else
+    Bucket &b = bucket(word);
+    std::unique_lock<std::mutex> lock(b.mutex);
+    if (word->load(std::memory_order_acquire) != value)
+        return true;
+    if (maxTime <= 0) {
+        b.cond.wait(lock);
+        return true;
+    }
+    return b.cond.wait_for(lock, std::chrono::milliseconds(maxTime)) == std::cv_status::no_timeout;
+#endif
+}
+
+void Futex::wake(std::atomic<uint32_t> *word, int count)
+{
+#ifdef OS_Linux
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, 0, 0, 0);
+#else
+    (void)count;
+    // the lock orders this after a waiter's check of the word
+    Bucket &b = bucket(word);
+    std::lock_guard<std::mutex> lock(b.mutex);
+    b.cond.notify_all();
+#endif
+}
+
+void Futex::cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+namespace {
+uint64_t deadline(int maxTime)
+{
+    return maxTime > 0 ? Rct::monoMs() + maxTime : 0;
+}
+
+// 0 for no deadline, otherwise the time left, -1 once it's passed
+int remaining(uint64_t deadline)
+{
+    if (!deadline)
+        return 0;
+    const uint64_t now = Rct::monoMs();
+    return now >= deadline ? -1 : static_cast<int>(deadline - now);
+}
+
+template <typename Ready>
+bool spin(int spinCount, Ready ready)
+{
+    for (int i = 0; i < spinCount; ++i) {
+        if (ready())
+            return true;
+        Futex::cpuRelax();
+    }
+    return ready();
+}
+}
+
+LightSemaphore::LightSemaphore(int count, int spinCount)
+    : mCount(count > 0 ? count : 0), mWaiters(0), mSpinCount(spinCount)
+{
+}
+
+bool LightSemaphore::tryAcquire()
+{
+    uint32_t count = mCount.load(std::memory_order_relaxed);
+    while (count) {
+        if (mCount.compare_exchange_weak(count, count - 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+bool LightSemaphore::acquire(int maxTime)
+{
+    if (spin(mSpinCount, [this]() { return tryAcquire(); }))
+        return true;
+    const uint64_t end = deadline(maxTime);
+    mWaiters.fetch_add(1, std::memory_order_relaxed);
+    // pairs with the one in release(), either it sees this waiter or this
+    // sees what it released
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool ret = true;
+    while (!tryAcquire()) {
+        const int timeout = remaining(end);
+        if (timeout < 0) {
+            ret = false;
+            break;
+        }
+        Futex::wait(&mCount, 0, timeout);
+    }
+    mWaiters.fetch_sub(1, std::memory_order_relaxed);
+    return ret;
+}
+
+void LightSemaphore::release(int count)
+{
+    if (count <= 0)
+        return;
+    mCount.fetch_add(count, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mWaiters.load(std::memory_order_relaxed))
+        Futex::wake(&mCount, count);
+}
+
+OneShotEvent::OneShotEvent(int spinCount)
+    : mState(Unset), mSpinCount(spinCount)
+{
+}
+
+void OneShotEvent::set()
+{
+    if (mState.exchange(Set, std::memory_order_acq_rel) == Waiting)
+        Futex::wake(&mState);
+}
+
+void OneShotEvent::reset()
+{
+    uint32_t state = Set;
+    mState.compare_exchange_strong(state, Unset, std::memory_order_relaxed);
+}
+
+bool OneShotEvent::wait(int maxTime)
+{
+    if (spin(mSpinCount, [this]() { return isSet(); }))
+        return true;
+    const uint64_t end = deadline(maxTime);
+    for (;;) {
+        uint32_t state = mState.load(std::memory_order_acquire);
+        if (state == Set)
+            return true;
+        // set() only goes to the kernel once someone said they're waiting
+        if (state == Unset && !mState.compare_exchange_weak(state, Waiting, std::memory_order_acquire))
+            continue;
+        const int timeout = remaining(end);
+        if (timeout < 0)
+            return false;
+        Futex::wait(&mState, Waiting, timeout);
+    }
+}
+
+Latch::Latch(int count, int spinCount)
+    : mCount(count > 0 ? count : 0), mWaiters(0), mSpinCount(spinCount)
+{
+}
+
+void Latch::countDown(int count)
+{
+    uint32_t current = mCount.load(std::memory_order_relaxed);
+    uint32_t next;
+    do {
+        if (!current)
+            return;
+        next = current > static_cast<uint32_t>(count) ? current - count : 0;
+    } while (!mCount.compare_exchange_weak(current, next, std::memory_order_acq_rel));
+    if (next)
+        return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mWaiters.load(std::memory_order_relaxed))
+        Futex::wake(&mCount);
+}
+
+bool Latch::wait(int maxTime)
+{
+    if (spin(mSpinCount, [this]() { return isReady(); }))
+        return true;
+    const uint64_t end = deadline(maxTime);
+    mWaiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool ret = true;
+    for (;;) {
+        const uint32_t count = mCount.load(std::memory_order_acquire);
+        if (!count)
+            break;
+        const int timeout = remaining(end);
+        if (timeout < 0) {
+            ret = false;
+            break;
+        }
+        // only the last countDown() wakes, the word changing before that
+        // just has this go around again
+        Futex::wait(&mCount, count, timeout);
+    }
+    mWaiters.fetch_sub(1, std::memory_order_relaxed);
+    return ret;
+}
+
+Barrier::Barrier(int count, int spinCount)
+    : mThreads(count > 0 ? count : 1), mArrived(0), mGeneration(0), mSpinCount(spinCount)
+{
+}
+
+bool Barrier::arriveAndWait()
+{
+    const uint32_t generation = mGeneration.load(std::memory_order_acquire);
+    if (mArrived.fetch_add(1, std::memory_order_acq_rel) + 1 == mThreads) {
+        // nobody arrives for the next round before they've seen this
+        mArrived.store(0, std::memory_order_relaxed);
+        mGeneration.fetch_add(1, std::memory_order_release);
+        Futex::wake(&mGeneration);
+        return true;
+    }
+    if (spin(mSpinCount, [this, generation]() { return mGeneration.load(std::memory_order_acquire) != generation; }))
+        return false;
+    while (mGeneration.load(std::memory_order_acquire) == generation)
+        Futex::wait(&mGeneration, generation);
+    return false;
+}
@@ -0,0 +1,108 @@
+#ifndef Futex_h
+#define Futex_h
+
+#include <atomic>
+#include <stdint.h>
+
+// Waiting on a 32 bit word within a process. A futex on Linux, elsewhere
+// the waiter sleeps on one of a table of condition variables picked by the
+// word's address. wait() returns when the word may have changed from value,
+// spuriously or when maxTime ms have passed, 0 waits forever. Returns false
+// on timeout.
+namespace Futex {
+bool wait(std::atomic<uint32_t> *word, uint32_t value, int maxTime = 0);
+void wake(std::atomic<uint32_t> *word, int count = 0x7fffffff);
+void cpuRelax();
+}
+
+// The primitives below take the word with a compare and swap when nobody
+// waits, and only go to the kernel for the threads that have to sleep or
+// to wake them. With a spin count they first try that many times before
+// they sleep, which is cheaper when the other thread is about to get there
+// and just wastes cpu when it isn't. maxTime is in ms, 0 waits forever.
+
+// Counting semaphore, unlike Semaphore only within a process
+class LightSemaphore
+{
+public:
+    LightSemaphore(int count = 0, int spinCount = 0);
+
+    bool acquire(int maxTime = 0);
+    bool tryAcquire();
+    void release(int count = 1);
+    int available() const { return static_cast<int>(mCount.load(std::memory_order_relaxed)); }
+
+    void setSpinCount(int spinCount) { mSpinCount = spinCount; }
+    int spinCount() const { return mSpinCount; }
+
+private:
+    std::atomic<uint32_t> mCount, mWaiters;
+    int mSpinCount;
+
+    LightSemaphore(const LightSemaphore &) = delete;
+    LightSemaphore &operator=(const LightSemaphore &) = delete;
+};
+
+// Set once, after which every wait() returns right away until reset()
+class OneShotEvent
+{
+public:
+    OneShotEvent(int spinCount = 0);
+
+    void set();
+    void reset();
+    bool isSet() const { return mState.load(std::memory_order_acquire) == Set; }
+    bool wait(int maxTime = 0);
+
+    void setSpinCount(int spinCount) { mSpinCount = spinCount; }
+
+private:
+    enum { Unset, Set, Waiting };
+    std::atomic<uint32_t> mState;
+    int mSpinCount;
+
+    OneShotEvent(const OneShotEvent &) = delete;
+    OneShotEvent &operator=(const OneShotEvent &) = delete;
+};
+
+// Waits for count countDown()s, once it's reached zero it stays there
+class Latch
+{
+public:
+    Latch(int count, int spinCount = 0);
+
+    void countDown(int count = 1);
+    bool isReady() const { return !mCount.load(std::memory_order_acquire); }
+    bool wait(int maxTime = 0);
+
+    void setSpinCount(int spinCount) { mSpinCount = spinCount; }
+
+private:
+    std::atomic<uint32_t> mCount, mWaiters;
+    int mSpinCount;
+
+    Latch(const Latch &) = delete;
+    Latch &operator=(const Latch &) = delete;
+};
+
+// count threads meet in arriveAndWait(), after which it can be used again.
+// It returns true in exactly one of them.
+class Barrier
+{
+public:
+    Barrier(int count, int spinCount = 0);
+
+    bool arriveAndWait();
+
+    void setSpinCount(int spinCount) { mSpinCount = spinCount; }
+
+private:
+    const uint32_t mThreads;
+    std::atomic<uint32_t> mArrived, mGeneration;
+    int mSpinCount;
+
+    Barrier(const Barrier &) = delete;
+    Barrier &operator=(const Barrier &) = delete;
+};
+
+#endif
@@ -0,0 +1,471 @@
+#include "IoUring.h"
+#include "Log.h"
+#include "Rct.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <assert.h>
+
+static inline unsigned loadAcquire(const unsigned* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(unsigned* p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+static inline T* ringPointer(void* ring, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<unsigned char*>(ring) + offset);
+}
+
+IoUring::IoUring()
+    : mFd(-1), mSqRing(MAP_FAILED), mCqRing(MAP_FAILED), mSqRingSize(0), mCqRingSize(0),
+      mSqes(static_cast<io_uring_sqe*>(MAP_FAILED)), mSqesSize(0), mSqHead(0), mSqTail(0),
+      mSqMask(0), mSqFlags(0), mSqArray(0), mSqEntries(0), mCqHead(0), mCqTail(0), mCqMask(0),
+      mCqes(0), mPending(0), mBuffers(0), mBufferCount(0), mBufferSize(0), mNextKey(InternalKey)
+{
+}
+
+IoUring::~IoUring()
+{
+    cleanup();
+}
+
+void IoUring::cleanup()
+{
+    // nothing is in flight for these, there's no completion to wait for
+    for (const std::vector<uint64_t>* idle : { &mStalled, &mWaitingForBuffers }) {
+        for (uint64_t key : *idle)
+            mOperations.erase(key);
+    }
+    if (mFd != -1 && mCqes && !mOperations.empty()) {
+        // the kernel may still be writing into our buffers, cancel
+        // everything and wait for it to let go
+        for (const auto& op : mOperations) {
+            if (!prepareCancel(op.first))
+                break;
+        }
+        enter(mPending, 0, 0);
+        enum { MaxAttempts = 16 };
+        for (int i = 0; i < MaxAttempts && !mOperations.empty(); ++i) {
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+            unsigned head = *mCqHead;
+            const unsigned tail = loadAcquire(mCqTail);
+            while (head != tail) {
+                mOperations.erase(mCqes[head & *mCqMask].user_data);
+                storeRelease(mCqHead, ++head);
+            }
+        }
+    }
+    if (mSqes != MAP_FAILED)
+        munmap(mSqes, mSqesSize);
+    if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+        munmap(mCqRing, mCqRingSize);
+    if (mSqRing != MAP_FAILED)
+        munmap(mSqRing, mSqRingSize);
+    mSqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    mSqRing = mCqRing = MAP_FAILED;
+    if (mFd != -1) {
+        ::close(mFd);
+        mFd = -1;
+    }
+    // only safe to release once the ring, and any reads into it, are gone
+    free(mBuffers);
+    mBuffers = 0;
+    mOperations.clear();
+    mStalled.clear();
+    mStalledCancels.clear();
+    mWaitingForBuffers.clear();
+    mStalledBuffers.clear();
+}
+
+bool IoUring::init(unsigned int entries, unsigned int bufferCount, unsigned int bufferSize)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    assert(mFd == -1);
+    mThread = std::this_thread::get_id();
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    mFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (mFd == -1)
+        return false;
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        cleanup();
+        return false;
+    }
+
+    mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+    mSqRing = mmap(0, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mSqRing == MAP_FAILED) {
+        cleanup();
+        return false;
+    }
+    if (single) {
+        mCqRing = mSqRing;
+    } else {
+        mCqRing = mmap(0, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (mCqRing == MAP_FAILED) {
+            cleanup();
+            return false;
+        }
+    }
+    mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    mSqes = static_cast<io_uring_sqe*>(mmap(0, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            mFd, IORING_OFF_SQES));
+    if (mSqes == MAP_FAILED) {
+        cleanup();
+        return false;
+    }
+
+    mSqHead = ringPointer<unsigned>(mSqRing, params.sq_off.head);
+    mSqTail = ringPointer<unsigned>(mSqRing, params.sq_off.tail);
+    mSqMask = ringPointer<unsigned>(mSqRing, params.sq_off.ring_mask);
+    mSqFlags = ringPointer<unsigned>(mSqRing, params.sq_off.flags);
+    mSqArray = ringPointer<unsigned>(mSqRing, params.sq_off.array);
+    mSqEntries = params.sq_entries;
+    mCqHead = ringPointer<unsigned>(mCqRing, params.cq_off.head);
+    mCqTail = ringPointer<unsigned>(mCqRing, params.cq_off.tail);
+    mCqMask = ringPointer<unsigned>(mCqRing, params.cq_off.ring_mask);
+    mCqes = ringPointer<io_uring_cqe>(mCqRing, params.cq_off.cqes);
+
+    mBufferCount = bufferCount;
+    mBufferSize = bufferSize;
+    mBuffers = static_cast<unsigned char*>(malloc(static_cast<size_t>(bufferCount) * bufferSize));
+    if (!mBuffers) {
+        cleanup();
+        return false;
+    }
+
+    // Provide the buffer pool and wait for the result, this also tells
+    // us whether the kernel is recent enough for buffer selection.
+    provideBuffers(0, mBufferCount);
+    enter(mPending, 1, IORING_ENTER_GETEVENTS);
+    const unsigned head = *mCqHead;
+    if (head == loadAcquire(mCqTail)) {
+        cleanup();
+        return false;
+    }
+    const int res = mCqes[head & *mCqMask].res;
+    storeRelease(mCqHead, head + 1);
+    if (res < 0) {
+        cleanup();
+        return false;
+    }
+    return true;
+}
+
+io_uring_sqe* IoUring::nextSqe()
+{
+    unsigned tail = *mSqTail;
+    if (tail - loadAcquire(mSqHead) >= mSqEntries) {
+        // full, without SQPOLL the kernel consumes everything we submit
+        enter(mPending, 0, 0);
+        if (tail - loadAcquire(mSqHead) >= mSqEntries)
+            return 0;
+    }
+    const unsigned index = tail & *mSqMask;
+    io_uring_sqe* sqe = mSqes + index;
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    mSqArray[index] = index;
+    return sqe;
+}
+
+void IoUring::commitSqe()
+{
+    storeRelease(mSqTail, *mSqTail + 1);
+    ++mPending;
+}
+
+void IoUring::enter(unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    int ret;
+    eintrwrap(ret, syscall(__NR_io_uring_enter, mFd, submit, wait, flags, 0, 0));
+    if (ret >= 0) {
+        assert(static_cast<unsigned>(ret) <= mPending);
+        mPending -= ret;
+    } else if (errno != EAGAIN && errno != EBUSY) {
+        error() << "io_uring_enter failed" << Rct::strerror();
+    }
+}
+
+bool IoUring::provideBuffers(int id, int count)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        // init() provides them all at once, with an empty queue
+        assert(count == 1);
+        mStalledBuffers.push_back(id);
+        return false;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = reinterpret_cast<uint64_t>(mBuffers + static_cast<size_t>(id) * mBufferSize);
+    sqe->len = mBufferSize;
+    sqe->off = id;
+    sqe->buf_group = 0;
+    sqe->user_data = InternalKey;
+    commitSqe();
+    return true;
+}
+
+bool IoUring::prepareRead(uint64_t key, const Operation& op)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = op.fd;
+    sqe->len = mBufferSize;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = key;
+    commitSqe();
+    return true;
+}
+
+bool IoUring::prepareWrite(uint64_t key, const Operation& op)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return false;
+    assert(op.written < op.data.size());
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = op.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(op.data.data() + op.written);
+    sqe->len = op.data.size() - op.written;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = key;
+    commitSqe();
+    return true;
+}
+
+bool IoUring::prepareCancel(uint64_t key)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = key;
+    sqe->user_data = InternalKey;
+    commitSqe();
+    return true;
+}
+
+void IoUring::retryStalled()
+{
+    std::vector<int> buffers;
+    std::swap(buffers, mStalledBuffers);
+    for (int buffer : buffers)
+        provideBuffers(buffer, 1);
+
+    std::vector<uint64_t> cancels;
+    std::swap(cancels, mStalledCancels);
+    for (uint64_t key : cancels) {
+        // it may have finished meanwhile
+        if (mOperations.count(key) && !prepareCancel(key))
+            mStalledCancels.push_back(key);
+    }
+
+    std::vector<uint64_t> stalled;
+    std::swap(stalled, mStalled);
+    for (uint64_t key : stalled) {
+        auto it = mOperations.find(key);
+        if (it == mOperations.end())
+            continue;
+        const Operation& op = it->second;
+        if (!op.readCallback && !op.writeCallback) {
+            // cancelled, and nothing has it
+            mOperations.erase(it);
+            continue;
+        }
+        const bool ok = op.type == Operation::Read ? prepareRead(key, op) : prepareWrite(key, op);
+        if (!ok)
+            mStalled.push_back(key);
+    }
+}
+
+void IoUring::rearmWaitingReads()
+{
+    std::vector<uint64_t> waiting;
+    std::swap(waiting, mWaitingForBuffers);
+    for (uint64_t key : waiting) {
+        auto it = mOperations.find(key);
+        if (it == mOperations.end())
+            continue;
+        if (!it->second.readCallback) {
+            mOperations.erase(it);
+        } else if (!prepareRead(key, it->second)) {
+            mStalled.push_back(key);
+        }
+    }
+}
+
+void IoUring::flushIfForeign()
+{
+    // the loop submits right before it goes to sleep, anyone else has
+    // to do it themselves
+    if (mPending && std::this_thread::get_id() != mThread)
+        enter(mPending, 0, 0);
+}
+
+uint64_t IoUring::read(int fd, ReadCallback&& callback)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFd == -1)
+        return 0;
+    const uint64_t key = ++mNextKey;
+    Operation& op = mOperations[key];
+    op.type = Operation::Read;
+    op.fd = fd;
+    op.readCallback = std::move(callback);
+    if (!prepareRead(key, op)) {
+        mOperations.erase(key);
+        return 0;
+    }
+    flushIfForeign();
+    return key;
+}
+
+uint64_t IoUring::write(int fd, Buffer&& data, WriteCallback&& callback)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFd == -1 || data.isEmpty())
+        return 0;
+    const uint64_t key = ++mNextKey;
+    Operation& op = mOperations[key];
+    op.type = Operation::Write;
+    op.fd = fd;
+    op.writeCallback = std::move(callback);
+    op.data = std::move(data);
+    if (!prepareWrite(key, op)) {
+        data = std::move(op.data);
+        mOperations.erase(key);
+        return 0;
+    }
+    flushIfForeign();
+    return key;
+}
+
+void IoUring::cancel(uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mOperations.find(key);
+    if (it == mOperations.end())
+        return;
+    for (std::vector<uint64_t>* idle : { &mStalled, &mWaitingForBuffers }) {
+        const auto pos = std::find(idle->begin(), idle->end(), key);
+        if (pos != idle->end()) {
+            // the kernel doesn't know about it
+            idle->erase(pos);
+            mOperations.erase(it);
+            return;
+        }
+    }
+    // the record has to live until the kernel is done with it
+    it->second.readCallback = ReadCallback();
+    it->second.writeCallback = WriteCallback();
+    if (!prepareCancel(key))
+        mStalledCancels.push_back(key);
+    flushIfForeign();
+}
+
+void IoUring::submit()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mPending)
+        enter(mPending, 0, 0);
+    if (!mStalled.empty() || !mStalledCancels.empty() || !mStalledBuffers.empty()) {
+        retryStalled();
+        if (mPending)
+            enter(mPending, 0, 0);
+    }
+}
+
+void IoUring::processCompletions()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mFd == -1)
+        return;
+    // reads that got ENOBUFS are only tried again once a buffer is back,
+    // right away they'd just get it again
+    bool buffersBack = false;
+    for (;;) {
+        unsigned head = *mCqHead;
+        const unsigned tail = loadAcquire(mCqTail);
+        if (head == tail) {
+            if (!(loadAcquire(mSqFlags) & IORING_SQ_CQ_OVERFLOW))
+                break;
+            // the kernel kept completions that didn't fit, get them flushed
+            enter(0, 0, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        while (head != tail) {
+            const io_uring_cqe& cqe = mCqes[head & *mCqMask];
+            const uint64_t key = cqe.user_data;
+            const int res = cqe.res;
+            const int buffer = (cqe.flags & IORING_CQE_F_BUFFER) ? (cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+            storeRelease(mCqHead, ++head);
+            if (key == InternalKey) {
+                // a provided buffer or a cancel, which may have freed one
+                buffersBack = true;
+                continue;
+            }
+            auto it = mOperations.find(key);
+            if (it == mOperations.end())
+                continue;
+            Operation& op = it->second;
+            if (op.type == Operation::Write) {
+                if (res > 0 && op.written + res < op.data.size() && op.writeCallback) {
+                    op.written += res;
+                    if (!prepareWrite(key, op))
+                        mStalled.push_back(key);
+                    continue;
+                }
+                WriteCallback callback = std::move(op.writeCallback);
+                const int result = res > 0 ? static_cast<int>(op.written + res) : (res ? res : -EPIPE);
+                mOperations.erase(it);
+                if (callback) {
+                    lock.unlock();
+                    callback(result);
+                    lock.lock();
+                }
+            } else {
+                if (res == -ENOBUFS && op.readCallback) {
+                    // every buffer is in use, try again once some came back
+                    mWaitingForBuffers.push_back(key);
+                    continue;
+                }
+                ReadCallback callback = std::move(op.readCallback);
+                mOperations.erase(it);
+                if (callback) {
+                    lock.unlock();
+                    callback(res, buffer != -1 ? mBuffers + static_cast<size_t>(buffer) * mBufferSize : 0);
+                    lock.lock();
+                }
+                if (buffer != -1) {
+                    provideBuffers(buffer, 1);
+                    buffersBack = true;
+                }
+            }
+        }
+    }
+    if (buffersBack && !mWaitingForBuffers.empty())
+        rearmWaitingReads();
+}
@@ -0,0 +1,109 @@
+#ifndef IoUring_h
+#define IoUring_h
+
+#include <rct/Buffer.h>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Minimal io_uring ring backing EventLoop::ioUring(). Reads take one of
+// a pool of buffers provided to the kernel when data arrives, so pending
+// reads on idle sockets don't pin any memory.
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    bool init(unsigned int entries = 256, unsigned int bufferCount = 256, unsigned int bufferSize = 16 * 1024);
+    int fd() const { return mFd; }
+
+    // result is the number of bytes or -errno. data is only valid
+    // during the callback
+    typedef std::function<void(int, const unsigned char*)> ReadCallback;
+    typedef std::function<void(int)> WriteCallback;
+
+    // These return a key for cancel() or 0 on failure
+    uint64_t read(int fd, ReadCallback&& callback);
+    // short writes are resubmitted, callback gets the total
+    uint64_t write(int fd, Buffer&& data, WriteCallback&& callback);
+    // the operation's callback won't be called after this
+    void cancel(uint64_t key);
+
+    // hands queued submissions to the kernel, and whatever couldn't be
+    // queued earlier because the submission queue was full
+    void submit();
+    // runs callbacks for finished operations, loop thread only
+    void processCompletions();
+
+private:
+    struct Operation
+    {
+        Operation() : type(Read), fd(-1), written(0) { }
+
+        enum Type { Read, Write } type;
+        int fd;
+        ReadCallback readCallback;
+        WriteCallback writeCallback;
+        Buffer data;
+        unsigned int written;
+    };
+
+    io_uring_sqe* nextSqe();
+    void commitSqe();
+    void enter(unsigned int submit, unsigned int wait, unsigned int flags);
+    // false when there's no room in the submission queue
+    bool prepareRead(uint64_t key, const Operation& op);
+    bool prepareWrite(uint64_t key, const Operation& op);
+    bool prepareCancel(uint64_t key);
+    bool provideBuffers(int id, int count);
+    void retryStalled();
+    void rearmWaitingReads();
+    void flushIfForeign();
+    void cleanup();
+
+    enum { InternalKey = 0 };
+
+    int mFd;
+    void* mSqRing;
+    void* mCqRing;
+    size_t mSqRingSize, mCqRingSize;
+    io_uring_sqe* mSqes;
+    size_t mSqesSize;
+    unsigned* mSqHead;
+    unsigned* mSqTail;
+    unsigned* mSqMask;
+    unsigned* mSqFlags;
+    unsigned* mSqArray;
+    unsigned mSqEntries;
+    unsigned* mCqHead;
+    unsigned* mCqTail;
+    unsigned* mCqMask;
+    io_uring_cqe* mCqes;
+    unsigned mPending;
+
+    unsigned char* mBuffers;
+    unsigned int mBufferCount, mBufferSize;
+
+    std::mutex mMutex;
+    std::thread::id mThread;
+    uint64_t mNextKey;
+    std::unordered_map<uint64_t, Operation> mOperations;
+    // Operations with nothing in flight. Stalled ones, cancels and
+    // buffers didn't get a submission queue entry and are tried again on
+    // submit(), the reads that got ENOBUFS wait for a buffer to come back.
+    std::vector<uint64_t> mStalled, mStalledCancels, mWaitingForBuffers;
+    std::vector<int> mStalledBuffers;
+
+private:
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+};
+
+#endif
@@ -0,0 +1,352 @@
+#include "JSONParser.h"
+#include "MappedFile.h"
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline const char *skipWhitespace(const char *pos, const char *end)
+{
+    while (pos < end && static_cast<unsigned char>(*pos) <= 32)
+        ++pos;
+    return pos;
+}
+
+// The first quote or backslash at or after pos, or end
+static inline const char *findStringSpecial(const char *pos, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (end - pos >= 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                        _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif
+    while (pos < end && *pos != '"' && *pos != '\\')
+        ++pos;
+    return pos;
+}
+
+// 0 if there aren't four hex digits
+static inline unsigned parseHex4(const char *pos, const char *end)
+{
+    if (end - pos < 4)
+        return 0;
+    unsigned ret = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char ch = pos[i];
+        ret <<= 4;
+        if (ch >= '0' && ch <= '9') {
+            ret += ch - '0';
+        } else if (ch >= 'A' && ch <= 'F') {
+            ret += 10 + ch - 'A';
+        } else if (ch >= 'a' && ch <= 'f') {
+            ret += 10 + ch - 'a';
+        } else {
+            return 0;
+        }
+    }
+    return ret;
+}
+
+static inline void appendUtf8(String &out, unsigned uc)
+{
+    char buf[4];
+    int len = 4;
+    if (uc < 0x80) {
+        len = 1;
+    } else if (uc < 0x800) {
+        len = 2;
+    } else if (uc < 0x10000) {
+        len = 3;
+    }
+    static const unsigned char firstByteMark[5] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0 };
+    for (int i = len - 1; i > 0; --i) {
+        buf[i] = static_cast<char>((uc | 0x80) & 0xBF);
+        uc >>= 6;
+    }
+    buf[0] = static_cast<char>(uc | firstByteMark[len]);
+    out.append(buf, len);
+}
+
+bool JSONParser::fail(const char *pos, const char *error)
+{
+    mOffset = pos - mBegin;
+    if (mError.isEmpty())
+        mError = String::format<64>("%s at offset %d", error, mOffset);
+    return false;
+}
+
+const char *JSONParser::parseString(const char *pos, bool key)
+{
+    const char *p = pos + 1;
+    const char *special = findStringSpecial(p, mEnd);
+    if (special == mEnd || *special == '"') {
+        // nothing to unescape, an unterminated string ends with the document
+        if (!(key ? mHandler->onKey(p, special - p) : mHandler->onString(p, special - p)))
+            return 0;
+        return special == mEnd ? special : special + 1;
+    }
+
+    mScratch.clear();
+    mScratch.append(p, special - p);
+    p = special;
+    while (p < mEnd && *p != '"') {
+        if (*p != '\\') {
+            special = findStringSpecial(p, mEnd);
+            mScratch.append(p, special - p);
+            p = special;
+            continue;
+        }
+        if (++p == mEnd)
+            break;
+        switch (*p) {
+        case 'b': mScratch.append('\b'); break;
+        case 'f': mScratch.append('\f'); break;
+        case 'n': mScratch.append('\n'); break;
+        case 'r': mScratch.append('\r'); break;
+        case 't': mScratch.append('\t'); break;
+        case 'u': {
+            // invalid sequences are dropped
+            unsigned uc = parseHex4(p + 1, mEnd);
+            p = std::min(p + 4, mEnd - 1);
+            if ((uc >= 0xDC00 && uc <= 0xDFFF) || !uc)
+                break;
+            if (uc >= 0xD800 && uc <= 0xDBFF) {
+                if (mEnd - p < 3 || p[1] != '\\' || p[2] != 'u')
+                    break;
+                const unsigned uc2 = parseHex4(p + 3, mEnd);
+                p = std::min(p + 6, mEnd - 1);
+                if (uc2 < 0xDC00 || uc2 > 0xDFFF)
+                    break;
+                uc = 0x10000 + (((uc & 0x3FF) << 10) | (uc2 & 0x3FF));
+            }
+            appendUtf8(mScratch, uc);
+            break; }
+        default:
+            mScratch.append(*p);
+            break;
+        }
+        ++p;
+    }
+    if (!(key ? mHandler->onKey(mScratch.constData(), mScratch.size())
+          : mHandler->onString(mScratch.constData(), mScratch.size()))) {
+        return 0;
+    }
+    return p == mEnd ? p : p + 1;
+}
+
+const char *JSONParser::parseNumber(const char *pos)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *p = pos;
+    const bool negative = *p == '-';
+    if (negative)
+        ++p;
+    // the mantissa both as an integer, while it's exact, and the way
+    // cJSON added it up for when it isn't
+    uint64_t mantissa = 0;
+    double n = 0;
+    int digits = 0, scale = 0;
+    bool integer = true;
+    // leading zeros are skipped
+    while (p < mEnd && *p == '0')
+        ++p;
+    while (p < mEnd && *p >= '0' && *p <= '9') {
+        mantissa = (mantissa * 10) + (*p - '0');
+        n = (n * 10.0) + (*p++ - '0');
+        ++digits;
+    }
+    if (p + 1 < mEnd && *p == '.' && p[1] >= '0' && p[1] <= '9') {
+        integer = false;
+        ++p;
+        while (p < mEnd && *p >= '0' && *p <= '9') {
+            mantissa = (mantissa * 10) + (*p - '0');
+            n = (n * 10.0) + (*p++ - '0');
+            ++digits;
+            --scale;
+        }
+    }
+    int exponent = 0;
+    if (p < mEnd && (*p == 'e' || *p == 'E')) {
+        integer = false;
+        bool negativeExponent = false;
+        if (++p < mEnd && (*p == '+' || *p == '-'))
+            negativeExponent = *p++ == '-';
+        while (p < mEnd && *p >= '0' && *p <= '9') {
+            if (exponent < 100000)
+                exponent = (exponent * 10) + (*p - '0');
+            ++p;
+        }
+        if (negativeExponent)
+            exponent = -exponent;
+    }
+
+    if (integer && digits <= 18) {
+        const int64_t value = static_cast<int64_t>(mantissa);
+        return mHandler->onInteger(negative ? -value : value) ? p : 0;
+    }
+
+    exponent += scale;
+    double value;
+    if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+        // both exact, so the result is correctly rounded
+        value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+    } else {
+        value = n * pow(10.0, exponent);
+    }
+    return mHandler->onDouble(negative ? -value : value) ? p : 0;
+}
+
+bool JSONParser::parse(const char *json, int length)
+{
+    mError.clear();
+    mStack.clear();
+    // the document ends at the first null byte either way
+    if (length < 0) {
+        length = strlen(json);
+    } else if (const void *nul = memchr(json, '\0', length)) {
+        length = static_cast<const char*>(nul) - json;
+    }
+    mBegin = json;
+    mEnd = json + length;
+
+    const char *p = skipWhitespace(mBegin, mEnd);
+    for (;;) {
+        // a value
+        if (p == mEnd)
+            return fail(p, "Unexpected end of document");
+        switch (*p) {
+        case '{':
+            if (!mHandler->onBeginMap())
+                return fail(p, "Stopped");
+            p = skipWhitespace(p + 1, mEnd);
+            if (p < mEnd && *p == '}') {
+                if (!mHandler->onEndMap())
+                    return fail(p, "Stopped");
+                ++p;
+                break;
+            }
+            mStack.push_back(true);
+            if (p == mEnd || *p != '"')
+                return fail(p, "Expected a key");
+            if (const char *next = parseString(p, true)) {
+                p = next;
+            } else {
+                return fail(p, "Stopped");
+            }
+            p = skipWhitespace(p, mEnd);
+            if (p == mEnd || *p != ':')
+                return fail(p, "Expected ':'");
+            p = skipWhitespace(p + 1, mEnd);
+            continue;
+        case '[':
+            if (!mHandler->onBeginList())
+                return fail(p, "Stopped");
+            p = skipWhitespace(p + 1, mEnd);
+            if (p < mEnd && *p == ']') {
+                if (!mHandler->onEndList())
+                    return fail(p, "Stopped");
+                ++p;
+                break;
+            }
+            mStack.push_back(false);
+            continue;
+        case '"':
+            if (const char *next = parseString(p, false)) {
+                p = next;
+            } else {
+                return fail(p, "Stopped");
+            }
+            break;
+        case 'n':
+            if (mEnd - p < 4 || strncmp(p, "null", 4))
+                return fail(p, "Unexpected character");
+            if (!mHandler->onNull())
+                return fail(p, "Stopped");
+            p += 4;
+            break;
+        case 't':
+            if (mEnd - p < 4 || strncmp(p, "true", 4))
+                return fail(p, "Unexpected character");
+            if (!mHandler->onBoolean(true))
+                return fail(p, "Stopped");
+            p += 4;
+            break;
+        case 'f':
+            if (mEnd - p < 5 || strncmp(p, "false", 5))
+                return fail(p, "Unexpected character");
+            if (!mHandler->onBoolean(false))
+                return fail(p, "Stopped");
+            p += 5;
+            break;
+        default: {
+            if (*p != '-' && (*p < '0' || *p > '9'))
+                return fail(p, "Unexpected character");
+            if (const char *next = parseNumber(p)) {
+                p = next;
+            } else {
+                return fail(p, "Stopped");
+            }
+            break; }
+        }
+
+        // and what follows it, closing every container that ends here
+        for (;;) {
+            if (mStack.empty()) {
+                mOffset = p - mBegin;
+                return true;
+            }
+            p = skipWhitespace(p, mEnd);
+            if (p == mEnd)
+                return fail(p, "Unexpected end of document");
+            const bool map = mStack.back();
+            if (*p == ',') {
+                p = skipWhitespace(p + 1, mEnd);
+                if (map) {
+                    if (p == mEnd || *p != '"')
+                        return fail(p, "Expected a key");
+                    if (const char *next = parseString(p, true)) {
+                        p = next;
+                    } else {
+                        return fail(p, "Stopped");
+                    }
+                    p = skipWhitespace(p, mEnd);
+                    if (p == mEnd || *p != ':')
+                        return fail(p, "Expected ':'");
+                    p = skipWhitespace(p + 1, mEnd);
+                }
+                break;
+            } else if (*p == (map ? '}' : ']')) {
+                mStack.pop_back();
+                if (!(map ? mHandler->onEndMap() : mHandler->onEndList()))
+                    return fail(p, "Stopped");
+                ++p;
+            } else {
+                return fail(p, map ? "Expected ',' or '}'" : "Expected ',' or ']'");
+            }
+        }
+    }
+}
+
+bool JSONParser::parseFile(const Path &path)
+{
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        mOffset = 0;
+        mError = file.error();
+        return false;
+    }
+    return parse(file.data(), file.size());
+}
@@ -0,0 +1,70 @@
+#ifndef JSONParser_h
+#define JSONParser_h
+
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <stdint.h>
+#include <vector>
+
+// Single pass JSON parser that reports what it finds to a Handler as it
+// goes instead of building a tree, so a document of any size can be
+// processed with the memory its handler chooses to keep. Value::fromJSON()
+// is built on it.
+//
+// It accepts what the cJSON parser it replaced did: the document ends at
+// the first null byte, anything after the first value is ignored, and
+// nesting is only limited by memory.
+class JSONParser
+{
+public:
+    // Returning false from any of these stops the parse, which then fails
+    class Handler
+    {
+    public:
+        virtual ~Handler() {}
+
+        virtual bool onNull() = 0;
+        virtual bool onBoolean(bool value) = 0;
+        // Numbers without a fraction or exponent that fit, the rest are
+        // doubles
+        virtual bool onInteger(int64_t value) = 0;
+        virtual bool onDouble(double value) = 0;
+        // Unescaped. Not null terminated and only valid during the call,
+        // it points into the document when there was nothing to unescape
+        virtual bool onString(const char *string, int length) = 0;
+        virtual bool onKey(const char *key, int length) = 0;
+        virtual bool onBeginMap() = 0;
+        virtual bool onEndMap() = 0;
+        virtual bool onBeginList() = 0;
+        virtual bool onEndList() = 0;
+    };
+
+    JSONParser(Handler *handler)
+        : mHandler(handler), mOffset(0)
+    {}
+
+    bool parse(const char *json, int length = -1);
+    bool parse(const String &json) { return parse(json.constData(), json.size()); }
+    // Reads the file through a MappedFile
+    bool parseFile(const Path &path);
+
+    // Where the parse ended, just past the value when it succeeded
+    int offset() const { return mOffset; }
+    String errorString() const { return mError; }
+
+private:
+    bool fail(const char *pos, const char *error);
+    const char *parseString(const char *pos, bool key);
+    const char *parseNumber(const char *pos);
+
+    Handler *mHandler;
+    const char *mBegin, *mEnd;
+    int mOffset;
+    String mError;
+    // unescaped strings
+    String mScratch;
+    // true for the maps we're in, false for lists
+    std::vector<bool> mStack;
+};
+
+#endif
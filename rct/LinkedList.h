@@ -1,62 +1,70 @@
 #ifndef LinkedList_h
 #define LinkedList_h
 
+#include <rct/NodePool.h>
 #include <list>
 #include <algorithm>
+#include <assert.h>
+#include <memory>
 
-template<typename T>
-class LinkedList : public std::list<T>
+template<typename T, typename Allocator = std::allocator<T> >
+class LinkedList : public std::list<T, Allocator>
 {
 public:
-    LinkedList() : std::list<T>() { }
-    LinkedList(int size) : std::list<T>(size) { }
+    LinkedList() : std::list<T, Allocator>() { }
+    LinkedList(int size) : std::list<T, Allocator>(size) { }
 
-    bool isEmpty() const { return std::list<T>::empty(); }
+    bool isEmpty() const { return std::list<T, Allocator>::empty(); }
 
-    int size() const { return std::list<T>::size(); }
-    void append(const T &t) { std::list<T>::push_back(t); }
-    void append(T &&t) { std::list<T>::push_back(std::move(t)); }
-    void prepend(const T &t) { std::list<T>::push_front(t); }
-    void prepend(T &&t) { std::list<T>::push_front(std::move(t)); }
+    int size() const { return std::list<T, Allocator>::size(); }
+    void append(const T &t) { std::list<T, Allocator>::push_back(t); }
+    void append(T &&t) { std::list<T, Allocator>::push_back(std::move(t)); }
+    void prepend(const T &t) { std::list<T, Allocator>::push_front(t); }
+    void prepend(T &&t) { std::list<T, Allocator>::push_front(std::move(t)); }
 
-    T &first() { return std::list<T>::front(); }
-    const T &first() const { return std::list<T>::front(); }
+    T &first() { return std::list<T, Allocator>::front(); }
+    const T &first() const { return std::list<T, Allocator>::front(); }
 
-    T &last() { return std::list<T>::back(); }
-    const T &last() const { return std::list<T>::back(); }
+    T &last() { return std::list<T, Allocator>::back(); }
+    const T &last() const { return std::list<T, Allocator>::back(); }
 
-    T takeFirst() { assert(!isEmpty()); const T t = first(); std::list<T>::pop_front(); return t; }
-    T takeLast() { assert(!isEmpty()); const T t = last(); std::list<T>::pop_back(); return t; }
+    T takeFirst() { assert(!isEmpty()); const T t = first(); std::list<T, Allocator>::pop_front(); return t; }
+    T takeLast() { assert(!isEmpty()); const T t = last(); std::list<T, Allocator>::pop_back(); return t; }
 
-    bool contains(const T& t) const { return std::find(std::list<T>::begin(), std::list<T>::end(), t) != std::list<T>::end(); }
+    bool contains(const T& t) const { return std::find(std::list<T, Allocator>::begin(), std::list<T, Allocator>::end(), t) != std::list<T, Allocator>::end(); }
 
-    typename std::list<T>::iterator find(const T &t)
+    typename std::list<T, Allocator>::iterator find(const T &t)
     {
-        for (auto it = std::list<T>::begin(); it != std::list<T>::end(); ++it) {
+        for (auto it = std::list<T, Allocator>::begin(); it != std::list<T, Allocator>::end(); ++it) {
             if (*it == t)
                 return it;
         }
-        return std::list<T>::end();
+        return std::list<T, Allocator>::end();
     }
 
-    typename std::list<T>::const_iterator find(const T &t) const
+    typename std::list<T, Allocator>::const_iterator find(const T &t) const
     {
-        for (auto it = std::list<T>::begin(); it != std::list<T>::end(); ++it) {
+        for (auto it = std::list<T, Allocator>::begin(); it != std::list<T, Allocator>::end(); ++it) {
             if (*it == t)
                 return it;
         }
-        return std::list<T>::end();
+        return std::list<T, Allocator>::end();
     }
 
     void deleteAll()
     {
-        typename std::list<T>::iterator it = std::list<T>::begin();
-        while (it != std::list<T>::end()) {
+        typename std::list<T, Allocator>::iterator it = std::list<T, Allocator>::begin();
+        while (it != std::list<T, Allocator>::end()) {
             delete *it;
             ++it;
         }
-        std::list<T>::clear();
+        std::list<T, Allocator>::clear();
     }
 };
 
+// For queues that see a push and a pop for everything that goes through
+// them, the nodes come from the thread's NodePool rather than malloc
+template<typename T>
+using PooledLinkedList = LinkedList<T, PoolAllocator<T> >;
+
 #endif
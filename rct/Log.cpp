@@ -1,12 +1,18 @@
 #include "Log.h"
 #include "Path.h"
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include "StopWatch.h"
 #include <stdarg.h>
 #include <syslog.h>
 #include "StackBuffer.h"
+#include "SeqLock.h"
 
 static Flags<LogFileFlag> sFlags;
 static StopWatch sStart;
@@ -14,12 +20,45 @@ static Set<std::shared_ptr<LogOutput> > sOutputs;
 static std::mutex sOutputsMutex;
 static LogLevel sLevel = LogLevel::Error;
 static const bool sTimedLogs = getenv("RCT_LOG_TIME");
+static std::atomic<int> sAsyncOutputs(0), sSyncOutputs(0), sFormatOutputs(0);
+// bit level + 1 is set if some output takes level, for None to VerboseDebug
+enum { CachedLevels = 5 };
+static std::atomic<unsigned int> sLevels((1u << CachedLevels) - 1);
+// the same for the outputs that want text, and the ones that don't
+static std::atomic<unsigned int> sTextLevels((1u << CachedLevels) - 1);
+static std::shared_ptr<const List<std::shared_ptr<LogOutput> > > sFormatList;
+
+static bool inAsyncWriter();
+
+// the RCT_LOG_TIME prefix only changes once a second, no need to run
+// localtime_r() and strftime() for every line
+struct TimePrefix
+{
+    time_t time;
+    int length;
+    char text[16];
+};
+static SeqLock<TimePrefix> sTimePrefix;
+
+static TimePrefix timePrefix()
+{
+    const time_t now = ::time(0);
+    TimePrefix prefix = sTimePrefix.load();
+    if (prefix.time != now) {
+        tm tm;
+        localtime_r(&now, &tm);
+        prefix.time = now;
+        prefix.length = strftime(prefix.text, sizeof(prefix.text), "%H:%M:%S", &tm);
+        sTimePrefix.store(prefix);
+    }
+    return prefix;
+}
 
 static inline void writeLog(FILE *f, const char *msg, int len, Flags<LogOutput::LogFlag> flags)
 {
     if (sTimedLogs) {
-        const String time = String::formatTime(::time(0), String::Time);
-        fwrite(time.constData(), time.size(), 1, f);
+        const TimePrefix prefix = timePrefix();
+        fwrite(prefix.text, prefix.length, 1, f);
     }
     fwrite(msg, len, 1, f);
     if (flags & LogOutput::TrailingNewLine)
@@ -41,8 +80,11 @@ public:
     virtual void log(Flags<LogOutput::LogFlag> flags, const char *msg, int len) override
     {
         writeLog(file, msg, len, flags);
-        fflush(file);
+        if (!inAsyncWriter())
+            fflush(file);
     }
+    virtual bool supportsAsync() const override { return true; }
+    virtual void flush() override { fflush(file); }
     FILE *file;
 };
 
@@ -54,8 +96,29 @@ public:
     {}
     virtual void log(Flags<LogOutput::LogFlag> flags, const char *msg, int len) override
     {
-        writeLog(stderr, msg, len, flags);
+        if (!inAsyncWriter()) {
+            writeLog(stderr, msg, len, flags);
+            return;
+        }
+        // stderr isn't buffered, a batch goes out in one write
+        if (sTimedLogs) {
+            const TimePrefix prefix = timePrefix();
+            mBatch.append(prefix.text, prefix.length);
+        }
+        mBatch.append(msg, len);
+        if (flags & LogOutput::TrailingNewLine)
+            mBatch += '\n';
     }
+    virtual bool supportsAsync() const override { return true; }
+    virtual void flush() override
+    {
+        if (!mBatch.isEmpty()) {
+            fwrite(mBatch.constData(), mBatch.size(), 1, stderr);
+            mBatch.clear();
+        }
+    }
+private:
+    String mBatch;
 };
 
 class SyslogOutput : public LogOutput
@@ -74,6 +137,7 @@ public:
     {
         ::syslog(LOG_NOTICE, "%s", msg);
     }
+    virtual bool supportsAsync() const override { return true; }
 };
 
 void restartTime()
@@ -102,11 +166,34 @@ static inline String prettyTimeSinceStarted()
 }
 #endif
 
+static void dispatch(LogLevel level, const char *msg, int len, Flags<LogOutput::LogFlag> flags, bool skipFormat);
+
 static void log(LogLevel level, const char *format, va_list v)
 {
     if (!testLog(level))
         return;
 
+    bool skipFormat = false;
+    if (sFormatOutputs) {
+        std::shared_ptr<const List<std::shared_ptr<LogOutput> > > outputs;
+        {
+            std::lock_guard<std::mutex> lock(sOutputsMutex);
+            outputs = sFormatList;
+        }
+        for (const auto &output : *outputs) {
+            if (output->testLog(level)) {
+                va_list copy;
+                va_copy(copy, v);
+                output->logFormat(level, format, copy);
+                va_end(copy);
+            }
+        }
+        const unsigned int idx = static_cast<unsigned int>(static_cast<int>(level) + 1);
+        if (idx < CachedLevels && !(sTextLevels & (1u << idx)))
+            return;
+        skipFormat = true;
+    }
+
     va_list v2;
     va_copy(v2, v);
     enum { Size = 16384 };
@@ -123,12 +210,26 @@ static void log(LogLevel level, const char *format, va_list v)
         n = vsnprintf(buf, n + 1, format, v2);
     }
 
-    logDirect(level, buf, n);
+    dispatch(level, buf, n, LogOutput::DefaultFlags, skipFormat);
     va_end(v2);
 }
 
+static void enqueue(LogLevel level, Flags<LogOutput::LogFlag> flags, const char *msg, int len);
+static std::atomic<bool> sAsync(false);
+
 void logDirect(LogLevel level, const char *msg, int len, Flags<LogOutput::LogFlag> flags)
 {
+    dispatch(level, msg, len, flags, false);
+}
+
+static void dispatch(LogLevel level, const char *msg, int len, Flags<LogOutput::LogFlag> flags, bool skipFormat)
+{
+    const bool async = sAsync && sAsyncOutputs;
+    if (async) {
+        enqueue(level, flags, msg, len);
+        if (!sSyncOutputs)
+            return;
+    }
     Set<std::shared_ptr<LogOutput> > logs;
     {
         std::lock_guard<std::mutex> lock(sOutputsMutex);
@@ -140,6 +241,8 @@ void logDirect(LogLevel level, const char *msg, int len, Flags<LogOutput::LogFla
             fwrite("\n", 1, 1, stdout);
     } else {
         for (const auto &output : logs) {
+            if ((async && output->supportsAsync()) || (skipFormat && output->supportsFormat()))
+                continue;
             if (output->testLog(level)) {
                 output->log(flags, msg, len);
             }
@@ -199,9 +302,8 @@ void error(const char *format, ...)
     va_end(v);
 }
 
-bool testLog(LogLevel level)
+static bool testOutputs(LogLevel level)
 {
-    std::lock_guard<std::mutex> lock(sOutputsMutex);
     if (sOutputs.isEmpty())
         return true;
     for (const auto &output : sOutputs) {
@@ -211,6 +313,15 @@ bool testLog(LogLevel level)
     return false;
 }
 
+bool testLog(LogLevel level)
+{
+    const unsigned int idx = static_cast<unsigned int>(static_cast<int>(level) + 1);
+    if (idx < CachedLevels)
+        return sLevels.load(std::memory_order_relaxed) & (1u << idx);
+    std::lock_guard<std::mutex> lock(sOutputsMutex);
+    return testOutputs(level);
+}
+
 LogLevel logLevel()
 {
     return sLevel;
@@ -251,22 +362,394 @@ bool initLogging(const char* ident, Flags<LogMode> mode, LogLevel level, const P
     return true;
 }
 
+static void countOutputs()
+{
+    unsigned int levels = 0, textLevels = 0;
+    for (int i = 0; i < CachedLevels; ++i) {
+        const LogLevel level = static_cast<LogLevel>(i - 1);
+        if (testOutputs(level))
+            levels |= (1u << i);
+        for (const auto &output : sOutputs) {
+            if (!output->supportsFormat() && output->testLog(level)) {
+                textLevels |= (1u << i);
+                break;
+            }
+        }
+    }
+    sLevels = levels;
+    sTextLevels = textLevels;
+    std::shared_ptr<List<std::shared_ptr<LogOutput> > > formatList(new List<std::shared_ptr<LogOutput> >);
+
+    int async = 0, format = 0;
+    for (const auto &output : sOutputs) {
+        if (output->supportsAsync())
+            ++async;
+        if (output->supportsFormat()) {
+            ++format;
+            formatList->append(output);
+        }
+    }
+    sFormatList = formatList;
+    sAsyncOutputs = async;
+    sFormatOutputs = format;
+    sSyncOutputs = sOutputs.size() - async;
+}
+
+void logOutputsChanged()
+{
+    std::lock_guard<std::mutex> lock(sOutputsMutex);
+    countOutputs();
+}
+
 void cleanupLogging()
 {
+    stopAsyncLogging();
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     sOutputs.clear();
+    countOutputs();
 }
 
-Log::Log(String *out)
+// Async logging. Every thread that logs gets a LogRing that only it
+// writes to and only the writer thread reads from, so producers never
+// take a lock unless they have to wake the writer up.
+namespace {
+struct LogRecord
 {
-    assert(out);
-    mData.reset(new Data(out));
+    uint32_t length;
+    uint32_t flags;
+    int level;
+};
+
+enum {
+    Wrap = 0xffffffff,
+    // the message goes on in the next record
+    Continued = 0x80000000,
+    RecordAlign = 8,
+    CacheLine = 64
+};
+
+struct LogRing
+{
+    LogRing(uint64_t s)
+        : data(new char[s]), size(s), counted(Allocations::isEnabled()), head(0), tail(0), orphaned(false)
+    {
+        if (counted)
+            Allocations::add(Allocations::Logs, s);
+    }
+    ~LogRing()
+    {
+        if (counted)
+            Allocations::remove(Allocations::Logs, size);
+        delete[] data;
+    }
+
+    char *const data;
+    const uint64_t size;
+    const bool counted;
+    std::atomic<uint64_t> head;
+    char padding[CacheLine];
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> orphaned;
+    // writer only, a message that came in pieces
+    String partial;
+};
+}
+
+static LogOverflow sOverflow = LogOverflow::Drop;
+static uint64_t sRingSize = 0;
+static std::mutex sAsyncMutex;
+// sRings, and what the writer sleeps on
+static std::mutex sRingsMutex;
+static List<LogRing*> sRings;
+static std::condition_variable sWriterCond, sSpaceCond;
+static std::atomic<bool> sWriterSleeping(false), sWriterStop(false);
+static std::atomic<int> sWaiting(0);
+static std::atomic<uint64_t> sDropped(0);
+static std::thread *sWriter = 0;
+static std::thread::id sWriterId;
+static pthread_key_t sRingKey;
+static std::once_flag sRingKeyOnce;
+
+static bool inAsyncWriter()
+{
+    return std::this_thread::get_id() == sWriterId;
+}
+
+static inline uint64_t recordSize(uint32_t length)
+{
+    // the message is null terminated in the ring for syslog's sake
+    return (sizeof(LogRecord) + length + 1 + RecordAlign - 1) & ~static_cast<uint64_t>(RecordAlign - 1);
+}
+
+static LogRing *threadRing()
+{
+    std::call_once(sRingKeyOnce, []() {
+            pthread_key_create(&sRingKey, [](void *ring) { static_cast<LogRing*>(ring)->orphaned = true; });
+        });
+    LogRing *ring = static_cast<LogRing*>(pthread_getspecific(sRingKey));
+    if (!ring) {
+        ring = new LogRing(sRingSize);
+        pthread_setspecific(sRingKey, ring);
+        std::lock_guard<std::mutex> lock(sRingsMutex);
+        sRings.append(ring);
+    }
+    return ring;
+}
+
+static bool push(LogRing *ring, LogLevel level, uint32_t flags, const char *msg, uint32_t len)
+{
+    const uint64_t size = recordSize(len);
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    uint64_t offset = head % ring->size;
+    const uint64_t toEnd = ring->size - offset;
+    // records don't wrap, the end of the ring is skipped instead
+    const uint64_t needed = size <= toEnd ? size : size + toEnd;
+    if (ring->size - (head - tail) < needed)
+        return false;
+    uint64_t pos = head;
+    if (size > toEnd) {
+        reinterpret_cast<LogRecord*>(ring->data + offset)->length = Wrap;
+        pos += toEnd;
+        offset = 0;
+    }
+    LogRecord *record = reinterpret_cast<LogRecord*>(ring->data + offset);
+    record->length = len;
+    record->flags = flags;
+    record->level = static_cast<int>(level);
+    char *data = reinterpret_cast<char*>(record + 1);
+    memcpy(data, msg, len);
+    data[len] = '\0';
+    ring->head.store(pos + size, std::memory_order_release);
+    return true;
+}
+
+static void waitForWriter(std::unique_lock<std::mutex> &lock)
+{
+    ++sWaiting;
+    sWriterCond.notify_one();
+    sSpaceCond.wait_for(lock, std::chrono::milliseconds(10));
+    --sWaiting;
 }
 
-Log::Log(LogLevel level, Flags<LogOutput::LogFlag> flags)
+static void enqueue(LogLevel level, Flags<LogOutput::LogFlag> flags, const char *msg, int len)
 {
-    if (testLog(level))
-        mData.reset(new Data(level, flags));
+    LogRing *ring = threadRing();
+    // a message too big for the ring goes in pieces, and has to wait for
+    // room whatever the policy is
+    const int chunk = ring->size / 4;
+    const bool block = sOverflow == LogOverflow::Block || len > chunk;
+    do {
+        const int n = std::min(len, chunk);
+        const uint32_t f = (static_cast<uint32_t>(static_cast<LogOutput::LogFlag>(flags))
+                            | (n < len ? static_cast<uint32_t>(Continued) : 0u));
+        while (!push(ring, level, f, msg, n)) {
+            if (!block || !sAsync) {
+                ++sDropped;
+                return;
+            }
+            std::unique_lock<std::mutex> lock(sRingsMutex);
+            waitForWriter(lock);
+        }
+        msg += n;
+        len -= n;
+    } while (len > 0);
+    // the writer sets sWriterSleeping before it checks the rings and we
+    // check it after writing to one, so one of us sees the other
+    if (sWriterSleeping) {
+        std::lock_guard<std::mutex> lock(sRingsMutex);
+        sWriterCond.notify_one();
+    }
+}
+
+static void writeAsync(const List<std::shared_ptr<LogOutput> > &outputs, LogLevel level,
+                       Flags<LogOutput::LogFlag> flags, const char *msg, int len)
+{
+    for (const auto &output : outputs) {
+        if (output->testLog(level))
+            output->log(flags, msg, len);
+    }
+}
+
+// returns where the ring's tail goes once the outputs are flushed
+static uint64_t drain(LogRing *ring, const List<std::shared_ptr<LogOutput> > &outputs)
+{
+    const uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    while (tail != head) {
+        const uint64_t offset = tail % ring->size;
+        const LogRecord *record = reinterpret_cast<const LogRecord*>(ring->data + offset);
+        if (record->length == Wrap) {
+            tail += ring->size - offset;
+            continue;
+        }
+        const char *msg = reinterpret_cast<const char*>(record + 1);
+        const LogLevel level = static_cast<LogLevel>(record->level);
+        const Flags<LogOutput::LogFlag> flags = static_cast<LogOutput::LogFlag>(record->flags & ~static_cast<uint32_t>(Continued));
+        if ((record->flags & Continued) || !ring->partial.isEmpty()) {
+            ring->partial.append(msg, record->length);
+            if (!(record->flags & Continued)) {
+                writeAsync(outputs, level, flags, ring->partial.constData(), ring->partial.size());
+                ring->partial.clear();
+            }
+        } else {
+            writeAsync(outputs, level, flags, msg, record->length);
+        }
+        tail += recordSize(record->length);
+    }
+    return tail;
+}
+
+static bool hasPending()
+{
+    for (const LogRing *ring : sRings) {
+        if (ring->head.load() != ring->tail.load(std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+static void asyncWriter()
+{
+    uint64_t reported = 0;
+    List<LogRing*> rings;
+    List<uint64_t> tails;
+    List<std::shared_ptr<LogOutput> > outputs;
+    for (;;) {
+        const bool stop = sWriterStop;
+        {
+            std::lock_guard<std::mutex> lock(sRingsMutex);
+            rings = sRings;
+        }
+        outputs.clear();
+        {
+            std::lock_guard<std::mutex> lock(sOutputsMutex);
+            for (const auto &output : sOutputs) {
+                if (output->supportsAsync())
+                    outputs.append(output);
+            }
+        }
+        bool wrote = false;
+        tails.resize(rings.size());
+        for (int i = 0; i < rings.size(); ++i) {
+            tails[i] = drain(rings.at(i), outputs);
+            if (tails.at(i) != rings.at(i)->tail.load(std::memory_order_relaxed))
+                wrote = true;
+        }
+        const uint64_t dropped = sDropped;
+        if (dropped != reported) {
+            const String msg = String::format<64>("Dropped %llu log messages",
+                                                  static_cast<unsigned long long>(dropped - reported));
+            writeAsync(outputs, LogLevel::Error, LogOutput::DefaultFlags, msg.constData(), msg.size());
+            reported = dropped;
+            wrote = true;
+        }
+        if (wrote) {
+            for (const auto &output : outputs)
+                output->flush();
+            for (int i = 0; i < rings.size(); ++i)
+                rings.at(i)->tail.store(tails.at(i), std::memory_order_release);
+        }
+
+        std::unique_lock<std::mutex> lock(sRingsMutex);
+        if (wrote)
+            sSpaceCond.notify_all();
+        if (!sWaiting) {
+            // rings of threads that have exited
+            for (int i = 0; i < sRings.size(); ) {
+                LogRing *ring = sRings.at(i);
+                if (ring->orphaned && ring->head == ring->tail) {
+                    delete ring;
+                    sRings.removeAt(i);
+                } else {
+                    ++i;
+                }
+            }
+        }
+        if (stop)
+            break;
+        if (!wrote) {
+            sWriterSleeping = true;
+            if (!hasPending() && !sWriterStop && !sWaiting)
+                sWriterCond.wait_for(lock, std::chrono::seconds(1));
+            sWriterSleeping = false;
+        }
+    }
+}
+
+bool startAsyncLogging(size_t bufferSize, LogOverflow overflow)
+{
+    std::lock_guard<std::mutex> lock(sAsyncMutex);
+    if (sWriter)
+        return false;
+    if (!sRingSize) {
+        // rings that exist keep their size
+        sRingSize = std::max<uint64_t>(4096, (bufferSize + RecordAlign - 1) & ~static_cast<uint64_t>(RecordAlign - 1));
+    }
+    sOverflow = overflow;
+    sWriterStop = false;
+    sWriter = new std::thread(asyncWriter);
+    sWriterId = sWriter->get_id();
+    static std::once_flag once;
+    std::call_once(once, []() { atexit(stopAsyncLogging); });
+    sAsync = true;
+    return true;
+}
+
+void stopAsyncLogging()
+{
+    std::lock_guard<std::mutex> lock(sAsyncMutex);
+    if (!sWriter)
+        return;
+    sAsync = false;
+    {
+        std::lock_guard<std::mutex> ringsLock(sRingsMutex);
+        sWriterStop = true;
+        sWriterCond.notify_one();
+    }
+    sWriter->join();
+    delete sWriter;
+    sWriter = 0;
+    sWriterId = std::thread::id();
+}
+
+bool isAsyncLogging()
+{
+    return sAsync;
+}
+
+void flushLogs()
+{
+    if (!sAsync)
+        return;
+    std::unique_lock<std::mutex> lock(sRingsMutex);
+    List<std::pair<LogRing*, uint64_t> > targets;
+    for (LogRing *ring : sRings)
+        targets.append(std::make_pair(ring, ring->head.load()));
+    // sWaiting keeps the rings from being deleted under us
+    for (;;) {
+        bool done = true;
+        for (const auto &target : targets) {
+            if (target.first->tail.load() < target.second) {
+                done = false;
+                break;
+            }
+        }
+        if (done || !sAsync)
+            break;
+        waitForWriter(lock);
+    }
+}
+
+uint64_t droppedLogMessages()
+{
+    return sDropped;
+}
+
+Log::Log(String *out)
+{
+    assert(out);
+    mData.reset(new Data(out));
 }
 
 Log::Log(const Log &other)
@@ -293,10 +776,12 @@ void LogOutput::add()
 {
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     sOutputs.insert(shared_from_this());
+    countOutputs();
 }
 
 void LogOutput::remove()
 {
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     sOutputs.remove(shared_from_this());
+    countOutputs();
 }
@@ -5,6 +5,7 @@
 #include <rct/List.h>
 #include <rct/Map.h>
 #include <rct/Hash.h>
+#include <rct/Metrics.h>
 #include <rct/Path.h>
 #include <rct/Set.h>
 #include <rct/Flags.h>
@@ -16,6 +17,12 @@
 
 class Path;
 
+// Levels more verbose than RCT_LOG_LEVEL are compiled out, e.g.
+// -DRCT_LOG_LEVEL=1 keeps errors and warnings only.
+#ifndef RCT_LOG_LEVEL
+#define RCT_LOG_LEVEL 3
+#endif
+
 enum class LogLevel {
     None = -1,
     Error = 0,
@@ -46,6 +53,15 @@ public:
         DefaultFlags = TrailingNewLine
     };
     virtual void log(Flags<LogFlag> /*flags*/, const char */*msg*/, int /*len*/) { }
+    // Outputs that return true are written from the background thread
+    // while async logging is on. log() and flush() are then only called
+    // from that thread, flush() after each batch.
+    virtual bool supportsAsync() const { return false; }
+    virtual void flush() { }
+    // Outputs that return true get printf style messages before they're
+    // formatted, through logFormat() instead of log()
+    virtual bool supportsFormat() const { return false; }
+    virtual void logFormat(LogLevel /*level*/, const char */*format*/, va_list /*args*/) { }
     void log(const String &msg) { log(Flags<LogFlag>(DefaultFlags), msg.constData(), msg.length()); }
     template <int StaticBufSize = 256>
     void log(const char *format, ...)
@@ -83,7 +99,25 @@ inline void logDirect(LogLevel level, const String &out, Flags<LogOutput::LogFla
 }
 void log(const std::function<void(const std::shared_ptr<LogOutput> &)> &func);
 
+// Whether any output takes level. Answered from a table that's built when
+// outputs are added or removed, call logOutputsChanged() if an output's
+// testLog() starts answering differently.
 bool testLog(LogLevel level);
+void logOutputsChanged();
+
+static inline bool logEnabled(LogLevel level)
+{
+    return static_cast<int>(level) <= RCT_LOG_LEVEL && testLog(level);
+}
+
+// Stream forms that don't evaluate their arguments at all when the level is
+// off, RCT_DEBUG() << expensive() costs a table lookup, or nothing if
+// debug is compiled out
+#define RCT_LOG(level) if (!logEnabled(level)) {} else Log(level)
+#define RCT_ERROR() RCT_LOG(LogLevel::Error)
+#define RCT_WARNING() RCT_LOG(LogLevel::Warning)
+#define RCT_DEBUG() RCT_LOG(LogLevel::Debug)
+#define RCT_VERBOSE_DEBUG() RCT_LOG(LogLevel::VerboseDebug)
 enum LogMode {
     LogStderr = 0x1,
     LogSyslog = 0x2
@@ -102,13 +136,37 @@ bool initLogging(const char* ident,
                  const Path &logFile = Path(),
                  Flags<LogFileFlag> = Flags<LogFileFlag>());
 void cleanupLogging();
+
+enum class LogOverflow {
+    Drop,
+    Block
+};
+// Makes logging calls copy the message into a ring buffer of bufferSize
+// bytes owned by the calling thread and return. A background thread
+// writes the rings to the outputs that supportsAsync() in batches, the
+// other outputs are still written by the caller. When a thread's ring is
+// full its messages are dropped and counted, or it waits for the writer.
+// Messages from one thread keep their order, messages from different
+// threads only roughly.
+bool startAsyncLogging(size_t bufferSize = 64 * 1024, LogOverflow overflow = LogOverflow::Drop);
+// writes what's queued and goes back to logging synchronously
+void stopAsyncLogging();
+bool isAsyncLogging();
+// returns once everything logged before the call has been written
+void flushLogs();
+uint64_t droppedLogMessages();
+
 LogLevel logLevel();
 void restartTime();
 class Log
 {
 public:
     Log(String *out);
-    Log(LogLevel level = LogLevel::Error, Flags<LogOutput::LogFlag> flags = LogOutput::DefaultFlags);
+    Log(LogLevel level = LogLevel::Error, Flags<LogOutput::LogFlag> flags = LogOutput::DefaultFlags)
+    {
+        if (logEnabled(level))
+            mData.reset(new Data(level, flags));
+    }
     Log(const Log &other);
     Log &operator=(const Log &other);
 #if defined(OS_Darwin)
@@ -185,6 +243,8 @@ public:
     {
         return mData && mData->spacing;
     }
+    // false for a stream whose level is off, everything written is dropped
+    bool isEnabled() const { return mData.get(); }
     template <typename T>
     static String toString(const T &t)
     {
@@ -206,7 +266,7 @@ private:
         }
         return *this;
     }
-    class Data
+    class Data : public CountedObject<Allocations::Logs>
     {
     public:
         Data(String *string)
@@ -253,6 +313,8 @@ template <typename T> inline String typeName()
 template <typename T>
 inline Log operator<<(Log stream, const std::shared_ptr<T> &ptr)
 {
+    if (!stream.isEnabled())
+        return stream;
     stream << ("std::shared_ptr<" + typeName<T>() + ">") << ptr.get();
     return stream;
 }
@@ -260,6 +322,8 @@ inline Log operator<<(Log stream, const std::shared_ptr<T> &ptr)
 template <typename T>
 inline Log operator<<(Log stream, const List<T> &list)
 {
+    if (!stream.isEnabled())
+        return stream;
     stream << "List<";
     bool old = stream.setSpacing(false);
     stream << typeName<T>() << ">(";
@@ -284,6 +348,8 @@ inline Log operator<<(Log stream, const List<T> &list)
 template <typename T1, typename T2>
 inline Log operator<<(Log stream, const std::pair<T1, T2> &pair)
 {
+    if (!stream.isEnabled())
+        return stream;
     stream << "pair<";
     const bool old = stream.setSpacing(false);
     stream << typeName<T1>() << ", " << typeName<T2>() << ">(";
@@ -295,6 +361,8 @@ inline Log operator<<(Log stream, const std::pair<T1, T2> &pair)
 template <typename T>
 inline Log operator<<(Log stream, const Set<T> &list)
 {
+    if (!stream.isEnabled())
+        return stream;
     stream << "Set<";
     bool old = stream.setSpacing(false);
     stream << typeName<T>() << ">(";
@@ -319,6 +387,8 @@ inline Log operator<<(Log stream, const Set<T> &list)
 template <typename Key, typename Value>
 inline Log operator<<(Log stream, const Map<Key, Value> &map)
 {
+    if (!stream.isEnabled())
+        return stream;
     stream << "Map<";
     bool old = stream.setSpacing(false);
     stream << typeName<Key>() << ", " << typeName<Value>() << ">(";
@@ -348,6 +418,8 @@ inline Log operator<<(Log stream, const Map<Key, Value> &map)
 template <typename Key, typename Value>
 inline Log operator<<(Log stream, const Hash<Key, Value> &map)
 {
+    if (!stream.isEnabled())
+        return stream;
     stream << "Hash<";
     bool old = stream.setSpacing(false);
     stream << typeName<Key>() << ", " << typeName<Value>() << ">(";
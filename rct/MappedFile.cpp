@@ -0,0 +1,108 @@
+#include "MappedFile.h"
+#include "Rct.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(MappedFile &&other)
+    : mData(0), mSize(0), mOpen(false), mMapped(false)
+{
+    *this = std::move(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other)
+{
+    if (this == &other)
+        return *this;
+    close();
+    mOpen = other.mOpen;
+    mMapped = other.mMapped;
+    mSize = other.mSize;
+    mError = std::move(other.mError);
+    if (mMapped) {
+        mData = other.mData;
+    } else {
+        mContents = std::move(other.mContents);
+        mData = mContents.isEmpty() ? 0 : mContents.constData();
+    }
+    other.mData = 0;
+    other.mSize = 0;
+    other.mOpen = other.mMapped = false;
+    other.mContents.clear();
+    return *this;
+}
+
+bool MappedFile::open(const Path &path, unsigned int flags)
+{
+    close();
+    int fd;
+    eintrwrap(fd, ::open(path.constData(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        mError = String::format<128>("Can't open %s (%d)", path.constData(), errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        mError = String::format<128>("Can't stat %s (%d)", path.constData(), errno);
+        ::close(fd);
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size >= MapThreshold) {
+        void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            if (flags & Sequential)
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+            if (flags & WillNeed)
+                madvise(data, st.st_size, MADV_WILLNEED);
+#endif
+            ::close(fd);
+            mData = static_cast<const char*>(data);
+            mSize = st.st_size;
+            mOpen = mMapped = true;
+            return true;
+        }
+        // some file systems can't be mapped, read it instead
+    }
+
+    // st_size is only a hint, read until the end
+    size_t size = 0;
+    mContents.resize(S_ISREG(st.st_mode) && st.st_size > 0 ? st.st_size + 1 : 4096);
+    for (;;) {
+        if (size == static_cast<size_t>(mContents.size()))
+            mContents.resize(mContents.size() * 2);
+        ssize_t r;
+        eintrwrap(r, ::read(fd, mContents.data() + size, mContents.size() - size));
+        if (r < 0) {
+            mError = String::format<128>("Can't read %s (%d)", path.constData(), errno);
+            mContents.clear();
+            ::close(fd);
+            return false;
+        } else if (!r) {
+            break;
+        }
+        size += r;
+    }
+    ::close(fd);
+    mContents.resize(size);
+    mSize = size;
+    mData = size ? mContents.constData() : 0;
+    mOpen = true;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mMapped)
+        munmap(const_cast<char*>(mData), mSize);
+    mData = 0;
+    mSize = 0;
+    mOpen = mMapped = false;
+    mContents.clear();
+    mError.clear();
+}
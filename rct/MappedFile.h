@@ -0,0 +1,57 @@
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <rct/Path.h>
+#include <rct/String.h>
+
+// The contents of a file, for reading. Regular files of at least
+// MapThreshold bytes are mapped, the pages are read in as they're touched,
+// ahead of time with WillNeed. Anything smaller, and files like those in
+// /proc and /sys whose size can't be trusted, are read into memory the
+// MappedFile owns. Either way data() stays valid until it's closed, so a
+// Deserializer can read from it directly.
+class MappedFile
+{
+public:
+    enum { MapThreshold = 64 * 1024 };
+    enum Flag {
+        None = 0x0,
+        // MADV_SEQUENTIAL, pages can be dropped once they have been read
+        Sequential = 0x1,
+        // MADV_WILLNEED, start reading the whole file right away
+        WillNeed = 0x2
+    };
+
+    MappedFile() : mData(0), mSize(0), mOpen(false), mMapped(false) {}
+    MappedFile(const Path &path, unsigned int flags = Sequential|WillNeed)
+        : mData(0), mSize(0), mOpen(false), mMapped(false)
+    {
+        open(path, flags);
+    }
+    MappedFile(MappedFile &&other);
+    MappedFile &operator=(MappedFile &&other);
+    ~MappedFile() { close(); }
+
+    bool open(const Path &path, unsigned int flags = Sequential|WillNeed);
+    void close();
+
+    // an empty file is open but has no data
+    bool isOpen() const { return mOpen; }
+    bool isMapped() const { return mMapped; }
+    const char *data() const { return mData; }
+    size_t size() const { return mSize; }
+    String toString() const { return String(mData, mSize); }
+    String error() const { return mError; }
+
+private:
+    const char *mData;
+    size_t mSize;
+    bool mOpen, mMapped;
+    String mContents;
+    String mError;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+#endif
@@ -2,11 +2,15 @@
 #include "String.h"
 #include "List.h"
 #include "Log.h"
+#include "Metrics.h"
+#include "Value.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <mutex>
 #ifdef OS_Darwin
 # include <mutex>
 # include <mach/mach_traps.h>
@@ -16,10 +20,6 @@
 #endif
 
 
-MemoryMonitor::MemoryMonitor()
-{
-}
-
 #if defined(OS_Linux) || defined(__CYGWIN__ )
 typedef bool (*LineVisitor)(char*, void*);
 static void visitLine(FILE* stream, LineVisitor visitor, void* userData)
@@ -47,9 +47,8 @@ static bool lineVisitor(char* line, void* userData)
     return true;
 }
 
-static inline uint64_t usageLinux()
+static inline uint64_t smapsLinux(pid_t pid)
 {
-    const pid_t pid = getpid();
     FILE* file = fopen(("/proc/" + String::number(pid) + "/smaps").constData(), "r");
     if (!file)
         return 0;
@@ -61,6 +60,99 @@ static inline uint64_t usageLinux()
 
     return total;
 }
+
+// Reads all of a proc file from the start, a seq_file is generated anew
+// every time it's read from offset 0, so the fd can be kept around
+static int readProc(int fd, char *buffer, int size)
+{
+    int total = 0;
+    while (total < size - 1) {
+        const ssize_t r = ::pread(fd, buffer + total, size - 1 - total, total);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!r)
+            break;
+        total += r;
+    }
+    buffer[total] = '\0';
+    return total;
+}
+
+static uint64_t rollupLinux(int fd)
+{
+    enum { BufferSize = 4096 };
+    char buffer[BufferSize];
+    if (readProc(fd, buffer, BufferSize) <= 0)
+        return 0;
+    uint64_t total = 0;
+    char *line = buffer;
+    while (line) {
+        lineVisitor(line, &total);
+        line = strchr(line, '\n');
+        if (line)
+            ++line;
+    }
+    return total;
+}
+
+// /proc/self resolves when it's opened, a child after fork() would read
+// its parent's files through the fds it inherited so it opens its own
+static std::mutex selfFdsMutex;
+static pid_t selfFdsPid = 0;
+static int selfRollupFd = -1, selfStatmFd = -1;
+
+static inline void selfFds(int &rollup, int &statm)
+{
+    const pid_t pid = getpid();
+    std::lock_guard<std::mutex> lock(selfFdsMutex);
+    if (selfFdsPid != pid) {
+        if (selfRollupFd != -1)
+            ::close(selfRollupFd);
+        if (selfStatmFd != -1)
+            ::close(selfStatmFd);
+        selfRollupFd = ::open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+        selfStatmFd = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+        selfFdsPid = pid;
+    }
+    rollup = selfRollupFd;
+    statm = selfStatmFd;
+}
+
+static inline uint64_t usageLinux(pid_t pid)
+{
+    if (pid == getpid()) {
+        int rollup, statm;
+        selfFds(rollup, statm);
+        if (rollup != -1)
+            return rollupLinux(rollup);
+        return smapsLinux(pid);
+    }
+    const int fd = ::open(("/proc/" + String::number(pid) + "/smaps_rollup").constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return smapsLinux(pid);
+    const uint64_t ret = rollupLinux(fd);
+    ::close(fd);
+    return ret;
+}
+
+static inline uint64_t residentLinux()
+{
+    int rollup, statm;
+    selfFds(rollup, statm);
+    enum { BufferSize = 128 };
+    char buffer[BufferSize];
+    if (statm == -1 || readProc(statm, buffer, BufferSize) <= 0)
+        return usageLinux(getpid());
+    // size resident shared text lib data dt, in pages
+    const char *resident = strchr(buffer, ' ');
+    if (!resident)
+        return 0;
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    return strtoull(resident + 1, 0, 10) * pageSize;
+}
 #elif defined(OS_FreeBSD)
 static inline uint64_t usageFreeBSD()
 {
@@ -111,7 +203,7 @@ static inline uint64_t usageOSX()
 uint64_t MemoryMonitor::usage()
 {
 #if defined(OS_Linux) || defined(__CYGWIN__)
-    return usageLinux();
+    return usageLinux(getpid());
 #elif defined(OS_FreeBSD)
     return usageFreeBSD();
 #elif defined(OS_Darwin)
@@ -120,3 +212,72 @@ uint64_t MemoryMonitor::usage()
 #error "MemoryMonitor does not support this system"
 #endif
 }
+
+uint64_t MemoryMonitor::usage(pid_t pid)
+{
+#if defined(OS_Linux) || defined(__CYGWIN__)
+    return usageLinux(pid);
+#else
+    return pid == getpid() ? usage() : 0;
+#endif
+}
+
+uint64_t MemoryMonitor::residentSize()
+{
+#if defined(OS_Linux) || defined(__CYGWIN__)
+    return residentLinux();
+#else
+    return usage();
+#endif
+}
+
+Value MemoryMonitor::metrics()
+{
+    Value ret;
+    ret["usage"] = usage();
+    ret["resident"] = residentSize();
+    ret["allocations"] = Allocations::toValue();
+    return ret;
+}
+
+MemoryMonitor::MemoryMonitor(int interval, Method method)
+    : mMethod(method), mLastSample(0), mHighWaterMark(0), mTimer(interval)
+{
+    mTimer.timeout().connect([this](Timer *) { sample(); });
+}
+
+void MemoryMonitor::addThreshold(uint64_t bytes)
+{
+    mThresholds[bytes] = mLastSample > bytes;
+}
+
+void MemoryMonitor::removeThreshold(uint64_t bytes)
+{
+    mThresholds.remove(bytes);
+}
+
+uint64_t MemoryMonitor::sample()
+{
+    const uint64_t current = mMethod == Resident ? residentSize() : usage();
+    mLastSample = current;
+    mHighWaterMark = std::max(mHighWaterMark, current);
+    // a slot may change the thresholds
+    List<std::pair<uint64_t, bool> > thresholds;
+    thresholds.reserve(mThresholds.size());
+    for (const auto &threshold : mThresholds)
+        thresholds.append(threshold);
+    for (const auto &threshold : thresholds) {
+        const bool above = current > threshold.first;
+        if (above == threshold.second)
+            continue;
+        auto it = mThresholds.find(threshold.first);
+        if (it != mThresholds.end())
+            it->second = above;
+        if (above) {
+            mThresholdExceeded(current, threshold.first);
+        } else {
+            mThresholdCleared(current, threshold.first);
+        }
+    }
+    return current;
+}
@@ -1,15 +1,62 @@
 #ifndef MEMORYMONITOR_H
 #define MEMORYMONITOR_H
 
+#include <rct/Map.h>
+#include <rct/SignalSlot.h>
+#include <rct/Timer.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+class Value;
 
 class MemoryMonitor
 {
 public:
+    // The private memory of this process. On Linux that's smaps_rollup,
+    // one record the kernel sums up, through an fd that's kept open, and
+    // the whole of smaps on kernels that don't have it.
     static uint64_t usage();
+    // Another process, only supported on Linux, 0 elsewhere
+    static uint64_t usage(pid_t pid);
+    // The resident set, shared pages included, from statm on Linux. The
+    // cheapest there is, usage() elsewhere.
+    static uint64_t residentSize();
+    // { usage, resident, allocations }, the last is Allocations::toValue()
+    static Value metrics();
+
+    enum Method {
+        Private,
+        Resident
+    };
+
+    // Samples usage() or residentSize() every interval ms on the current
+    // EventLoop. A sample above a threshold that the one before wasn't
+    // emits thresholdExceeded(usage, threshold), and the first one below
+    // it again thresholdCleared(usage, threshold).
+    MemoryMonitor(int interval, Method method = Private);
+
+    void addThreshold(uint64_t bytes);
+    void removeThreshold(uint64_t bytes);
+
+    // Samples right away rather than on the timer
+    uint64_t sample();
+    uint64_t lastSample() const { return mLastSample; }
+    // The highest sample so far
+    uint64_t highWaterMark() const { return mHighWaterMark; }
+
+    Signal<std::function<void(uint64_t, uint64_t)> > &thresholdExceeded() { return mThresholdExceeded; }
+    Signal<std::function<void(uint64_t, uint64_t)> > &thresholdCleared() { return mThresholdCleared; }
 
 private:
-    MemoryMonitor();
+    MemoryMonitor(const MemoryMonitor &) = delete;
+    MemoryMonitor &operator=(const MemoryMonitor &) = delete;
+
+    const Method mMethod;
+    uint64_t mLastSample, mHighWaterMark;
+    // whether the last sample was above it
+    Map<uint64_t, bool> mThresholds;
+    Signal<std::function<void(uint64_t, uint64_t)> > mThresholdExceeded, mThresholdCleared;
+    Timer mTimer;
 };
 
 #endif
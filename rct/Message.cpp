@@ -1,41 +1,169 @@
 #include "Message.h"
 #include "ResponseMessage.h"
+#include "SocketClient.h"
 #include "FinishMessage.h"
+#include "Metrics.h"
 #include "Serializer.h"
 #include "QuitMessage.h"
+#include "ValueMessage.h"
+#include "Trace.h"
 #include <assert.h>
 #include <cstdlib>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
 std::mutex Message::sMutex;
-Map<uint8_t, Message::MessageCreatorBase *> Message::sFactory;
+std::atomic<Message::MessageCreatorBase *> Message::sFactory[256];
+std::once_flag Message::sInitOnce;
 
-void Message::prepare(int version, String &header, String &value) const
+void Message::init()
 {
-    if (mHeader.isEmpty() || version != mVersion) {
-        if (version != mVersion) {
-            mHeader.clear();
-            mValue.clear();
-        }
-        {
-            Serializer s(mValue);
-            encode(s);
-        }
+    std::call_once(sInitOnce, []() {
+            atexit(Message::cleanup);
+            sFactory[ResponseMessage::MessageId].store(new MessageCreator<ResponseMessage>(), std::memory_order_release);
+            sFactory[FinishMessage::MessageId].store(new MessageCreator<FinishMessage>(), std::memory_order_release);
+            sFactory[QuitMessage::MessageId].store(new MessageCreator<QuitMessage>(), std::memory_order_release);
+            sFactory[ValueMessage::MessageId].store(new MessageCreator<ValueMessage>(), std::memory_order_release);
+        });
+}
+
+std::shared_ptr<const String> Message::frame(int version, Compressor *compressor, Compressor::Codec codec) const
+{
+    if (!(mFlags & Compressed) || !Compressor::isSupported(codec))
+        codec = Compressor::Zlib;
+    const std::shared_ptr<const FrameCache> cached = std::atomic_load(&mFrameCache);
+    if (cached && cached->version == version && cached->codec == codec)
+        return cached->frame;
+    String data;
+    {
+        Serializer s(data);
         if (mFlags & Compressed) {
-            mValue = mValue.compress();
+            String value;
+            {
+                Serializer vs(value);
+                vs.setFlags(serializerFlags(version));
+                encode(vs);
+            }
+            uint8_t wireFlags = codec == Compressor::Zstd ? Zstd : 0;
+            String compressed;
+            bool ok;
+            if ((version & ChunkedCompression) && value.size() >= ChunkedSize) {
+                // on every core rather than the one sending it
+                ok = Compressor::compressChunked(codec, value.constData(), value.size(), compressed);
+                wireFlags |= Chunked;
+            } else {
+                std::unique_ptr<Compressor> temporary;
+                if (!compressor) {
+                    temporary.reset(new Compressor);
+                    compressor = temporary.get();
+                }
+                ok = compressor->compress(codec, value.constData(), value.size(), compressed);
+            }
+            if (!ok)
+                error("Failed to compress message %d", mMessageId);
+            encodeHeader(s, compressed.size(), version, 0, wireFlags);
+            s.write(compressed);
+        } else {
+            // encoded once, straight into the frame, the size is filled
+            // in afterwards
+            encodeHeader(s, 0, version);
+            s.setFlags(serializerFlags(version));
+            encode(s);
         }
-        Serializer s(mHeader);
-        encodeHeader(s, mValue.size(), version);
-        mVersion = version;
     }
-    value = mValue;
-    header = mHeader;
+    if (!(mFlags & Compressed)) {
+        const uint32_t size = data.size() - Serializer::sizeOf<uint32_t>();
+        memcpy(data.data(), &size, sizeof(size));
+    }
+    std::shared_ptr<String> frame;
+    if (Allocations::isEnabled()) {
+        const int size = data.size();
+        Allocations::add(Allocations::Messages, size);
+        frame.reset(new String(std::move(data)), [size](String *str) {
+                Allocations::remove(Allocations::Messages, size);
+                delete str;
+            });
+    } else {
+        frame = std::make_shared<String>(std::move(data));
+    }
+    // threads that race here each build one, the last one stays
+    std::shared_ptr<FrameCache> cache = std::make_shared<FrameCache>();
+    cache->version = version;
+    cache->codec = codec;
+    cache->frame = frame;
+    std::atomic_store(&mFrameCache, std::shared_ptr<const FrameCache>(std::move(cache)));
+    return frame;
+}
+
+int Message::frameHeader(int version, const String &frame, uint32_t streamId, char *header) const
+{
+    const int size = (Serializer::sizeOf<uint32_t>() + headerExtra(version)
+                      + (attachmentCount() ? Serializer::sizeOf<uint8_t>() : 0));
+    assert(size <= MaxFrameHeader && frame.size() >= size);
+    memcpy(header, frame.constData(), size);
+    if (version & Multiplexed)
+        memcpy(header + Serializer::sizeOf<uint32_t>() + HeaderExtra, &streamId, sizeof(streamId));
+    return size;
+}
+
+Message::AttachmentList::~AttachmentList()
+{
+    for (int fd : fds) {
+        if (fd != -1)
+            ::close(fd);
+    }
+}
+
+bool Message::attach(int fd)
+{
+    if (attachmentCount() >= SocketClient::MaxFds)
+        return false;
+    const int copy = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy == -1)
+        return false;
+    if (!mAttachments)
+        mAttachments = std::make_shared<AttachmentList>();
+    mAttachments->fds.append(copy);
+    std::atomic_store(&mFrameCache, std::shared_ptr<const FrameCache>());
+    return true;
+}
+
+int Message::takeAttachment(int idx)
+{
+    const int fd = mAttachments->fds.at(idx);
+    mAttachments->fds[idx] = -1;
+    return fd;
+}
+
+int Message::encodedSize() const
+{
+    if (mFlags & Compressed)
+        return -1;
+    Serializer serializer(std::unique_ptr<Serializer::Buffer>(new Serializer::SizeBuffer));
+    encode(serializer);
+    return serializer.pos();
+}
+
+int Message::encodedSize(int version) const
+{
+    const unsigned int flags = serializerFlags(version);
+    if (!flags)
+        return encodedSize();
+    if (mFlags & Compressed)
+        return -1;
+    Serializer serializer(std::unique_ptr<Serializer::Buffer>(new Serializer::SizeBuffer));
+    serializer.setFlags(flags);
+    encode(serializer);
+    return serializer.pos();
 }
 
-std::shared_ptr<Message> Message::create(int version, const char *data, int size)
+bool Message::parse(int version, const char *data, int size, Compressor *compressor, SocketClient *client, Frame &frame)
 {
+    RCT_TRACE("Message::parse");
     if (!size || !data) {
         error("Can't create message from empty data");
-        return std::shared_ptr<Message>();
+        return false;
     }
     Deserializer ds(data, Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>());
     int ver;
@@ -52,7 +180,7 @@ std::shared_ptr<Message> Message::create(int version, const char *data, int size
             error("Invalid message version. Got %d, expected %d", ver, version);
             error() << String::toHex(data, std::min(size, 1024));
         }
-        return std::shared_ptr<Message>();
+        return false;
     }
     size -= Serializer::sizeOf(version);
     data += Serializer::sizeOf(version);
@@ -64,28 +192,96 @@ std::shared_ptr<Message> Message::create(int version, const char *data, int size
     ds >> flags;
     data += Serializer::sizeOf(flags);
     size -= Serializer::sizeOf(flags);
-    String uncompressed;
-    if (flags & Compressed) {
-        uncompressed = String::uncompress(data, size);
-        data = uncompressed.constData();
-        size = uncompressed.size();
+    uint32_t streamId = 0;
+    if (version & Multiplexed) {
+        if (size < static_cast<int>(sizeof(streamId))) {
+            error("Message id: %d is missing its stream id", id);
+            return false;
+        }
+        memcpy(&streamId, data, sizeof(streamId));
+        data += sizeof(streamId);
+        size -= sizeof(streamId);
     }
-    std::lock_guard<std::mutex> lock(sMutex);
-    if (!sFactory.contains(ResponseMessage::MessageId)) {
-        atexit(Message::cleanup);
-        sFactory[ResponseMessage::MessageId] = new MessageCreator<ResponseMessage>();
-        sFactory[FinishMessage::MessageId] = new MessageCreator<FinishMessage>();
-        sFactory[QuitMessage::MessageId] = new MessageCreator<QuitMessage>();
+    std::shared_ptr<AttachmentList> attachments;
+    if (flags & Attachments) {
+        // they have to be taken even if the message can't be made
+        const uint8_t count = size > 0 ? static_cast<uint8_t>(*data) : 0;
+        ++data;
+        --size;
+        attachments = std::make_shared<AttachmentList>();
+        if (client)
+            attachments->fds = client->takeFds(count);
+        if (!count || attachments->fds.size() != count) {
+            error("Message id: %d is missing attachments, got %d of %d", id, attachments->fds.size(), count);
+            return false;
+        }
+    }
+    if (flags & Compressed) {
+        // straight out of the receive buffer into uncompressed
+        bool ok;
+        if (flags & Chunked) {
+            // a peer without ChunkedCompression can't have meant it
+            ok = (version & ChunkedCompression) && Compressor::uncompressChunked(data, size, frame.uncompressed);
+        } else {
+            std::unique_ptr<Compressor> temporary;
+            if (!compressor) {
+                temporary.reset(new Compressor);
+                compressor = temporary.get();
+            }
+            ok = compressor->uncompress(flags & Zstd ? Compressor::Zstd : Compressor::Zlib, data, size, frame.uncompressed);
+        }
+        if (!ok) {
+            error("Can't uncompress message id: %d, data: %d bytes", id, size);
+            return false;
+        }
+        data = frame.uncompressed.constData();
+        size = frame.uncompressed.size();
     }
+    frame.id = id;
+    frame.streamId = streamId;
+    frame.data = data;
+    frame.size = size;
+    frame.attachments = std::move(attachments);
+    return true;
+}
+
+std::shared_ptr<Message> Message::create(int version, const char *data, int size, Compressor *compressor, SocketClient *client)
+{
+    Frame frame;
+    if (!parse(version, data, size, compressor, client, frame))
+        return std::shared_ptr<Message>();
+    return create(version, frame);
+}
 
-    MessageCreatorBase *base = sFactory.value(id);
+std::shared_ptr<Message> Message::create(int version, Frame &frame)
+{
+    const uint8_t id = frame.id;
+    const char *data = frame.data;
+    const int size = frame.size;
+    init();
+    MessageCreatorBase *base = sFactory[id].load(std::memory_order_acquire);
     if (!base) {
         error("Invalid message id %d, data: %d bytes, factory %p", id, size, &sFactory);
         return std::shared_ptr<Message>();
     }
-    std::shared_ptr<Message> message(base->create(data, size));
+    std::shared_ptr<Message> message;
+    if (Allocations::isEnabled()) {
+        // counted as the size of what it was decoded from
+        if (Message *created = base->create(data, size, serializerFlags(version))) {
+            Allocations::add(Allocations::Messages, size);
+            message.reset(created, [size](Message *msg) {
+                    Allocations::remove(Allocations::Messages, size);
+                    delete msg;
+                });
+        }
+    } else {
+        message.reset(base->create(data, size, serializerFlags(version)));
+    }
     if (!message) {
         error("Can't create message from data id: %d, data: %d bytes", id, size);
+    } else {
+        message->mAttachments = std::move(frame.attachments);
+        message->mStreamId = frame.streamId;
     }
     return message;
 }
@@ -93,7 +289,6 @@ std::shared_ptr<Message> Message::create(int version, const char *data, int size
 void Message::cleanup()
 {
     std::lock_guard<std::mutex> lock(sMutex);
-    for (Map<uint8_t, MessageCreatorBase *>::const_iterator it = sFactory.begin(); it != sFactory.end(); ++it)
-        delete it->second;
-    sFactory.clear();
+    for (std::atomic<MessageCreatorBase *> &creator : sFactory)
+        delete creator.exchange(0);
 }
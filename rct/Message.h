@@ -2,18 +2,41 @@
 #define MESSAGE_H
 
 #include <rct/Serializer.h>
+#include <rct/Compressor.h>
+#include <rct/List.h>
+#include <atomic>
+#include <memory>
 #include <mutex>
+
+class SocketClient;
 class Message
 {
 public:
     enum {
         ResponseId = 1,
         FinishMessageId = 2,
-        QuitMessageId = 3
+        QuitMessageId = 3,
+        ValueMessageId = 4
     };
 
+    // Or'ed into the version of the Connections on both ends, the payload
+    // is then encoded with Serializer::Compact and InternPaths. Versions
+    // have to match, so a peer that doesn't use it is turned away.
+    enum { CompactEncoding = 0x40000000 };
+    // Or'ed into the version as well, every header then has the id of the
+    // stream the message belongs to, so many requests can be in flight on
+    // one Connection, see Connection::request()
+    enum { Multiplexed = 0x20000000 };
+    // Or'ed into the version too, large Compressed payloads are then
+    // compressed in chunks in parallel, see Chunked
+    enum { ChunkedCompression = 0x10000000 };
+    static unsigned int serializerFlags(int version)
+    {
+        return (version & CompactEncoding) ? (Serializer::Compact | Serializer::InternPaths) : Serializer::None;
+    }
+
     Message(uint8_t id, uint8_t flags = None)
-        : mMessageId(id), mFlags(flags), mVersion(0)
+        : mMessageId(id), mFlags(flags), mStreamId(0)
     {}
     virtual ~Message()
     {}
@@ -21,25 +44,81 @@ public:
     enum Flag {
         None = 0x0,
         Compressed = 0x1,
-        MessageCache = 0x2
+        // encode once and share the encoded frame between sends, use this
+        // for messages that are broadcast to many connections
+        MessageCache = 0x2,
+        // set on the wire with Compressed when the payload is zstd
+        Zstd = 0x4,
+        // set on the wire when the header has the number of attachments
+        Attachments = 0x8,
+        // set on the wire with Compressed when the payload was compressed
+        // in chunks on the ThreadPool, see Compressor::compressChunked().
+        // Only with ChunkedCompression in the version.
+        Chunked = 0x10
     };
+    // Compressed payloads of at least this many bytes are chunked when the
+    // version has ChunkedCompression
+    enum { ChunkedSize = 4 * Compressor::DefaultChunkSize };
 
     uint8_t flags() const { return mFlags; }
     uint8_t messageId() const { return mMessageId; }
+    // The stream a received message came in on, 0 unless the version is
+    // Multiplexed and it's part of a request
+    uint32_t streamId() const { return mStreamId; }
+
+    // File descriptors that go along with the message, over UNIX socket
+    // Connections only. A memfd from SharedMemory::create() or an open
+    // file hands the peer a large payload without copying it through the
+    // socket, the peer maps it with SharedMemory::fromFd(). attach() takes
+    // a dup() of fd, the copies a message has are closed with the last
+    // copy of it unless they're taken.
+    bool attach(int fd);
+    int attachmentCount() const { return mAttachments ? mAttachments->fds.size() : 0; }
+    int attachment(int idx) const { return mAttachments->fds.at(idx); }
+    int takeAttachment(int idx);
 
     virtual void encode(Serializer &/* serializer */) const = 0;
     virtual void decode(Deserializer &/* deserializer */) = 0;
 
-    virtual int encodedSize() const { return -1; }
-    static std::shared_ptr<Message> create(int version, const char *data, int size);
+    // Size of what encode() writes, which lets Connection encode straight
+    // to the socket. The default counts it with a dry run of encode(),
+    // messages that know their size cheaply should override it. Returns -1
+    // for compressed messages, their size isn't known before compressing.
+    virtual int encodedSize() const;
+    // compressor is used for Compressed messages, a temporary one is
+    // created when it's null. Attachments are taken from client.
+    static std::shared_ptr<Message> create(int version, const char *data, int size, Compressor *compressor = 0,
+                                           SocketClient *client = 0);
+
+    struct AttachmentList
+    {
+        ~AttachmentList();
+        List<int> fds;
+    };
+    // A received message with its header taken apart and its payload
+    // uncompressed, create() in two steps. data points into what was parsed
+    // or uncompressed and is only good as long as that is.
+    struct Frame
+    {
+        Frame() : id(0), streamId(0), data(0), size(0) {}
+
+        uint8_t id;
+        uint32_t streamId;
+        const char *data;
+        int size;
+        String uncompressed;
+        std::shared_ptr<AttachmentList> attachments;
+    };
+    static bool parse(int version, const char *data, int size, Compressor *compressor, SocketClient *client,
+                      Frame &frame);
+    static std::shared_ptr<Message> create(int version, Frame &frame);
     template<typename T> static void registerMessage()
     {
         const uint8_t id = T::MessageId;
+        init();
         std::lock_guard<std::mutex> lock(sMutex);
-        MessageCreatorBase *&base = sFactory[id];
-        if (!base) {
-            base = new MessageCreator<T>();
-        }
+        if (!sFactory[id].load(std::memory_order_relaxed))
+            sFactory[id].store(new MessageCreator<T>(), std::memory_order_release);
     }
     static void cleanup();
 private:
@@ -47,40 +126,88 @@ private:
     {
     public:
         virtual ~MessageCreatorBase() {}
-        virtual Message *create(const char *data, int size) = 0;
+        virtual Message *create(const char *data, int size, unsigned int flags) = 0;
     };
 
     template <typename T>
     class MessageCreator : public MessageCreatorBase
     {
     public:
-        virtual Message *create(const char *data, int size) override
+        virtual Message *create(const char *data, int size, unsigned int flags) override
         {
             T *t = new T;
             Deserializer deserializer(data, size);
+            deserializer.setFlags(flags);
             t->decode(deserializer);
             return t;
         }
     };
 
-    void prepare(int version, String &header, String &value) const;
     enum { HeaderExtra = Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>() };
-    inline void encodeHeader(Serializer &serializer, uint32_t size, int version) const
+    // The whole encoded message, header included, on stream 0. It's built
+    // once per version and codec and shared by every Connection it's sent
+    // to, from any thread. Another stream only needs its own header, see
+    // frameHeader().
+    std::shared_ptr<const String> frame(int version, Compressor *compressor = 0,
+                                        Compressor::Codec codec = Compressor::Zlib) const;
+    // whether frame() has one for version already
+    bool hasFrame(int version) const
+    {
+        const std::shared_ptr<const FrameCache> cached = std::atomic_load(&mFrameCache);
+        return cached && cached->version == version;
+    }
+    // Copies the header of frame into header with streamId in it, returns
+    // its size. What follows it in frame is the same for every stream.
+    enum { MaxFrameHeader = Serializer::sizeOf<uint32_t>() * 2 + HeaderExtra + Serializer::sizeOf<uint8_t>() };
+    int frameHeader(int version, const String &frame, uint32_t streamId, char *header) const;
+    // encodedSize() for the encoding version uses
+    int encodedSize(int version) const;
+    static int headerExtra(int version)
+    {
+        return HeaderExtra + ((version & Multiplexed) ? Serializer::sizeOf<uint32_t>() : 0);
+    }
+    inline void encodeHeader(Serializer &serializer, uint32_t size, int version, uint32_t streamId = 0,
+                             uint8_t extraFlags = 0) const
     {
-        size += HeaderExtra;
+        const uint8_t attachments = attachmentCount();
+        size += headerExtra(version);
+        if (attachments) {
+            size += Serializer::sizeOf<uint8_t>();
+            extraFlags |= Attachments;
+        }
         serializer.write(&size, sizeof(size));
-        serializer << version << static_cast<uint8_t>(mMessageId) << mFlags;
+        serializer << version << static_cast<uint8_t>(mMessageId) << static_cast<uint8_t>(mFlags | extraFlags);
+        if (version & Multiplexed)
+            serializer << streamId;
+        if (attachments)
+            serializer << attachments;
     }
     friend class Connection;
+    friend class MessageDispatcher;
+    friend class SharedMemoryChannel;
 
     uint8_t mMessageId;
     uint8_t mFlags;
-    mutable int mVersion;
-    mutable String mHeader;
-    mutable String mValue;
+    uint32_t mStreamId;
+    struct FrameCache
+    {
+        int version;
+        Compressor::Codec codec;
+        std::shared_ptr<const String> frame;
+    };
+    // what frame() built last, only touched with std::atomic_load() and
+    // std::atomic_store() since a message may be sent from several threads
+    mutable std::shared_ptr<const FrameCache> mFrameCache;
+    // shared by copies of the message
+    std::shared_ptr<AttachmentList> mAttachments;
+
+    static void init();
 
-    static Map<uint8_t, MessageCreatorBase *> sFactory;
+    // Indexed by message id. Written under sMutex when registering, read
+    // without locking by create()
+    static std::atomic<MessageCreatorBase *> sFactory[256];
     static std::mutex sMutex;
+    static std::once_flag sInitOnce;
 
 };
 
@@ -0,0 +1,80 @@
+#ifndef MessageDispatcher_h
+#define MessageDispatcher_h
+
+#include <rct/Message.h>
+#include <assert.h>
+#include <functional>
+#include <memory>
+
+class Connection;
+
+// Typed handlers for what a Connection receives, in a table indexed by
+// message id. A message that has a handler is decoded into a T on the stack
+// and the handler gets it by reference, there's no allocation, no
+// shared_ptr and no newMessage() for it. T needs what registerMessage()
+// needs, but doesn't have to be registered. Messages without a handler,
+// FinishMessages and what's sent back for a request() go the usual way.
+class MessageDispatcher
+{
+public:
+    MessageDispatcher() {}
+
+    template <typename T>
+    void on(std::function<void(T &message, const std::shared_ptr<Connection> &connection)> &&handler)
+    {
+        Entry &entry = mEntries[T::MessageId];
+        entry.dispatch = &MessageDispatcher::dispatchAs<T>;
+        entry.handler = std::make_shared<Handler<T> >(std::move(handler));
+    }
+    void remove(uint8_t id) { mEntries[id] = Entry(); }
+    bool handles(uint8_t id) const { return mEntries[id].dispatch; }
+
+private:
+    template <typename T>
+    using Handler = std::function<void(T &, const std::shared_ptr<Connection> &)>;
+    typedef void (*Dispatch)(const void *handler, int version, Message::Frame &frame, const std::function<void()> &decoded,
+                             const std::shared_ptr<Connection> &connection);
+    struct Entry
+    {
+        Entry() : dispatch(0) {}
+
+        Dispatch dispatch;
+        std::shared_ptr<void> handler;
+    };
+
+    // decoded is called when frame isn't needed anymore, before the handler
+    void dispatch(int version, Message::Frame &frame, const std::function<void()> &decoded,
+                  const std::shared_ptr<Connection> &connection) const
+    {
+        const Entry &entry = mEntries[frame.id];
+        assert(entry.dispatch);
+        // the handler can replace itself
+        const std::shared_ptr<void> handler = entry.handler;
+        entry.dispatch(handler.get(), version, frame, decoded, connection);
+    }
+
+    template <typename T>
+    static void dispatchAs(const void *handler, int version, Message::Frame &frame, const std::function<void()> &decoded,
+                           const std::shared_ptr<Connection> &connection)
+    {
+        T message;
+        {
+            Deserializer deserializer(frame.data, frame.size);
+            deserializer.setFlags(Message::serializerFlags(version));
+            message.decode(deserializer);
+        }
+        message.mStreamId = frame.streamId;
+        message.mAttachments = std::move(frame.attachments);
+        decoded();
+        (*static_cast<const Handler<T> *>(handler))(message, connection);
+    }
+
+    Entry mEntries[256];
+
+    friend class Connection;
+
+    MessageDispatcher(const MessageDispatcher &) = delete;
+    MessageDispatcher &operator=(const MessageDispatcher &) = delete;
+};
+
+#endif
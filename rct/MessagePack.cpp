@@ -0,0 +1,378 @@
+#include "MessagePack.h"
+#include <limits.h>
+#include <string.h>
+
+template <typename T>
+void MessagePackWriter::writeBigEndian(unsigned char code, T value)
+{
+    char buf[sizeof(T) + 1];
+    buf[0] = static_cast<char>(code);
+    for (size_t i = 0; i < sizeof(T); ++i)
+        buf[sizeof(T) - i] = static_cast<char>((static_cast<uint64_t>(value) >> (i * 8)) & 0xff);
+    mOut.append(buf, sizeof(buf));
+}
+
+void MessagePackWriter::writeNil()
+{
+    mOut.append(static_cast<char>(0xc0));
+}
+
+void MessagePackWriter::writeBoolean(bool value)
+{
+    mOut.append(static_cast<char>(value ? 0xc3 : 0xc2));
+}
+
+void MessagePackWriter::writeInteger(int64_t value)
+{
+    if (value >= 0) {
+        writeUnsigned(value);
+    } else if (value >= -32) {
+        mOut.append(static_cast<char>(value));
+    } else if (value >= INT8_MIN) {
+        writeBigEndian<int8_t>(0xd0, value);
+    } else if (value >= INT16_MIN) {
+        writeBigEndian<int16_t>(0xd1, value);
+    } else if (value >= INT32_MIN) {
+        writeBigEndian<int32_t>(0xd2, value);
+    } else {
+        writeBigEndian<int64_t>(0xd3, value);
+    }
+}
+
+void MessagePackWriter::writeUnsigned(uint64_t value)
+{
+    if (value < 0x80) {
+        mOut.append(static_cast<char>(value));
+    } else if (value <= UINT8_MAX) {
+        writeBigEndian<uint8_t>(0xcc, value);
+    } else if (value <= UINT16_MAX) {
+        writeBigEndian<uint16_t>(0xcd, value);
+    } else if (value <= UINT32_MAX) {
+        writeBigEndian<uint32_t>(0xce, value);
+    } else {
+        writeBigEndian<uint64_t>(0xcf, value);
+    }
+}
+
+void MessagePackWriter::writeDouble(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeBigEndian<uint64_t>(0xcb, bits);
+}
+
+void MessagePackWriter::writeHeader(unsigned char small, unsigned char code8, unsigned char code16,
+                                    unsigned char code32, uint32_t size)
+{
+    if (small && size < (small == 0xa0 ? 32u : 16u)) {
+        mOut.append(static_cast<char>(small | size));
+    } else if (code8 && size <= UINT8_MAX) {
+        writeBigEndian<uint8_t>(code8, size);
+    } else if (size <= UINT16_MAX) {
+        writeBigEndian<uint16_t>(code16, size);
+    } else {
+        writeBigEndian<uint32_t>(code32, size);
+    }
+}
+
+void MessagePackWriter::writeString(const char *string, int length)
+{
+    writeHeader(0xa0, 0xd9, 0xda, 0xdb, length);
+    mOut.append(string, length);
+}
+
+void MessagePackWriter::writeBinary(const void *data, int length)
+{
+    writeHeader(0, 0xc4, 0xc5, 0xc6, length);
+    mOut.append(static_cast<const char*>(data), length);
+}
+
+void MessagePackWriter::beginList(uint32_t count)
+{
+    writeHeader(0x90, 0, 0xdc, 0xdd, count);
+}
+
+void MessagePackWriter::beginMap(uint32_t count)
+{
+    writeHeader(0x80, 0, 0xde, 0xdf, count);
+}
+
+void MessagePackWriter::write(const Value &value)
+{
+    switch (value.type()) {
+    case Value::Type_Boolean:
+        writeBoolean(value.toBool());
+        break;
+    case Value::Type_Integer:
+        if (value.mUnsigned) {
+            writeUnsigned(value.toUInt64());
+        } else {
+            writeInteger(value.toInt64());
+        }
+        break;
+    case Value::Type_Double:
+        writeDouble(value.toDouble());
+        break;
+    case Value::Type_String:
+        writeString(value.stringData(), value.stringSize());
+        break;
+    case Value::Type_List: {
+        const List<Value> &list = *value.listPtr();
+        beginList(list.size());
+        for (const Value &v : list)
+            write(v);
+        break; }
+    case Value::Type_Map: {
+        const Map<String, Value> &map = *value.mapPtr();
+        beginMap(map.size());
+        for (const auto &it : map) {
+            writeString(it.first.constData(), it.first.size());
+            write(it.second);
+        }
+        break; }
+    case Value::Type_Invalid:
+    case Value::Type_Undefined:
+    case Value::Type_Custom:
+        writeNil();
+        break;
+    }
+}
+
+String MessagePackWriter::encode(const Value &value)
+{
+    String ret;
+    MessagePackWriter writer(ret);
+    writer.write(value);
+    return ret;
+}
+
+template <typename T>
+bool MessagePackReader::readBigEndian(T &value)
+{
+    if (mSize - mPos < static_cast<int>(sizeof(T)))
+        return false;
+    uint64_t ret = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        ret = (ret << 8) | static_cast<unsigned char>(mData[mPos++]);
+    value = static_cast<T>(ret);
+    return true;
+}
+
+MessagePackReader::Type MessagePackReader::readData(Type type, uint32_t size)
+{
+    if (type == Extension) {
+        int8_t extensionType;
+        if (!readBigEndian(extensionType))
+            return mType = Error;
+        mExtensionType = extensionType;
+    }
+    if (static_cast<uint32_t>(mSize - mPos) < size)
+        return mType = Error;
+    mString = mData + mPos;
+    mCount = size;
+    mPos += size;
+    return mType = type;
+}
+
+MessagePackReader::Type MessagePackReader::next()
+{
+    if (mPos >= mSize)
+        return mType = Error;
+    const unsigned char code = static_cast<unsigned char>(mData[mPos++]);
+    if (code < 0x80 || code >= 0xe0) {
+        mInteger = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int8_t>(code)));
+        return mType = Integer;
+    } else if (code < 0x90) {
+        mCount = code & 0x0f;
+        return mType = Map;
+    } else if (code < 0xa0) {
+        mCount = code & 0x0f;
+        return mType = List;
+    } else if (code < 0xc0) {
+        return readData(String, code & 0x1f);
+    }
+
+    bool ok = true;
+    switch (code) {
+    case 0xc0: return mType = Nil;
+    case 0xc2:
+    case 0xc3:
+        mInteger = code == 0xc3;
+        return mType = Boolean;
+    case 0xcc: { uint8_t v; ok = readBigEndian(v); mInteger = v; break; }
+    case 0xcd: { uint16_t v; ok = readBigEndian(v); mInteger = v; break; }
+    case 0xce: { uint32_t v; ok = readBigEndian(v); mInteger = v; break; }
+    case 0xcf: {
+        uint64_t v;
+        if (!readBigEndian(v))
+            return mType = Error;
+        mInteger = v;
+        return mType = v > static_cast<uint64_t>(INT64_MAX) ? Unsigned : Integer; }
+    case 0xd0: { int8_t v; ok = readBigEndian(v); mInteger = static_cast<uint64_t>(static_cast<int64_t>(v)); break; }
+    case 0xd1: { int16_t v; ok = readBigEndian(v); mInteger = static_cast<uint64_t>(static_cast<int64_t>(v)); break; }
+    case 0xd2: { int32_t v; ok = readBigEndian(v); mInteger = static_cast<uint64_t>(static_cast<int64_t>(v)); break; }
+    case 0xd3: { int64_t v; ok = readBigEndian(v); mInteger = static_cast<uint64_t>(v); break; }
+    case 0xca: {
+        uint32_t bits;
+        float f;
+        if (!readBigEndian(bits))
+            return mType = Error;
+        memcpy(&f, &bits, sizeof(f));
+        mDouble = f;
+        return mType = Double; }
+    case 0xcb: {
+        uint64_t bits;
+        if (!readBigEndian(bits))
+            return mType = Error;
+        memcpy(&mDouble, &bits, sizeof(mDouble));
+        return mType = Double; }
+    case 0xd9: case 0xc4: case 0xc7: {
+        uint8_t size;
+        if (!readBigEndian(size))
+            return mType = Error;
+        return readData(code == 0xd9 ? String : code == 0xc4 ? Binary : Extension, size); }
+    case 0xda: case 0xc5: case 0xc8: {
+        uint16_t size;
+        if (!readBigEndian(size))
+            return mType = Error;
+        return readData(code == 0xda ? String : code == 0xc5 ? Binary : Extension, size); }
+    case 0xdb: case 0xc6: case 0xc9: {
+        uint32_t size;
+        if (!readBigEndian(size))
+            return mType = Error;
+        return readData(code == 0xdb ? String : code == 0xc6 ? Binary : Extension, size); }
+    case 0xd4: return readData(Extension, 1);
+    case 0xd5: return readData(Extension, 2);
+    case 0xd6: return readData(Extension, 4);
+    case 0xd7: return readData(Extension, 8);
+    case 0xd8: return readData(Extension, 16);
+    case 0xdc: case 0xde: {
+        uint16_t count;
+        ok = readBigEndian(count);
+        mCount = count;
+        return mType = ok ? (code == 0xdc ? List : Map) : Error; }
+    case 0xdd: case 0xdf: {
+        uint32_t count;
+        ok = readBigEndian(count);
+        mCount = count;
+        return mType = ok ? (code == 0xdd ? List : Map) : Error; }
+    default:
+        // 0xc1 is never used
+        return mType = Error;
+    }
+    return mType = ok ? Integer : Error;
+}
+
+bool MessagePackReader::read(Value &value)
+{
+    return read(value, 0);
+}
+
+bool MessagePackReader::read(Value &value, int depth)
+{
+    value.clear();
+    switch (next()) {
+    case Error:
+        return false;
+    case Nil:
+    case Extension:
+        return true;
+    case Boolean:
+        value = boolean();
+        return true;
+    case Integer: {
+        const int64_t v = integer();
+        if (v >= INT_MIN && v <= INT_MAX) {
+            value = static_cast<int>(v);
+        } else {
+            value = v;
+        }
+        return true; }
+    case Unsigned:
+        value = unsignedInteger();
+        return true;
+    case Double:
+        value = mDouble;
+        return true;
+    case String:
+    case Binary:
+        value = Value(mString, static_cast<int>(mCount));
+        return true;
+    case List: {
+        // every element takes at least a byte
+        const uint32_t count = mCount;
+        if (depth == MaxDepth || count > static_cast<uint32_t>(mSize - mPos))
+            return false;
+        ::List<Value> list(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!read(list[i], depth + 1))
+                return false;
+        }
+        value = Value(std::move(list));
+        return true; }
+    case Map: {
+        const uint32_t count = mCount;
+        if (depth == MaxDepth || count > static_cast<uint32_t>(mSize - mPos) / 2)
+            return false;
+        ::Map< ::String, Value> map;
+        for (uint32_t i = 0; i < count; ++i) {
+            ::String key;
+            switch (next()) {
+            case String:
+            case Binary:
+                key.assign(mString, mCount);
+                break;
+            case Integer:
+                key = ::String::number(integer());
+                break;
+            case Unsigned:
+                key = ::String::number(unsignedInteger());
+                break;
+            default:
+                return false;
+            }
+            if (!read(map[key], depth + 1))
+                return false;
+        }
+        value = Value(std::move(map));
+        return true; }
+    }
+    return false;
+}
+
+bool MessagePackReader::skip()
+{
+    return skip(0);
+}
+
+bool MessagePackReader::skip(int depth)
+{
+    switch (next()) {
+    case Error:
+        return false;
+    case List:
+    case Map: {
+        if (depth == MaxDepth)
+            return false;
+        const uint64_t count = mType == Map ? static_cast<uint64_t>(mCount) * 2 : mCount;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (!skip(depth + 1))
+                return false;
+        }
+        return true; }
+    default:
+        return true;
+    }
+}
+
+Value MessagePackReader::decode(const char *data, int size, bool *ok)
+{
+    MessagePackReader reader(data, size);
+    Value ret;
+    const bool read = reader.read(ret);
+    if (ok)
+        *ok = read;
+    if (!read)
+        ret.clear();
+    return ret;
+}
@@ -0,0 +1,118 @@
+#ifndef MessagePack_h
+#define MessagePack_h
+
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <rct/Value.h>
+#include <stdint.h>
+
+// MessagePack (https://msgpack.org), a compact binary encoding of the
+// same data as JSON that most languages can read and write.
+//
+// Values map to it as you'd expect:
+// - invalid, undefined and Custom values are written as nil;
+// - integers are written in the smallest encoding that fits, as uint64
+//   when a uint64_t doesn't fit in an int64;
+// - doubles are written as float64.
+// Decoding, integers that don't fit in an int become int64_t values, binary
+// data becomes a string, extension types become invalid values and integer
+// map keys become their decimal strings.
+class MessagePackWriter
+{
+public:
+    MessagePackWriter(String &out)
+        : mOut(out)
+    {}
+
+    void writeNil();
+    void writeBoolean(bool value);
+    void writeInteger(int64_t value);
+    void writeUnsigned(uint64_t value);
+    void writeDouble(double value);
+    void writeString(const char *string, int length);
+    void writeString(const StringView &string) { writeString(string.data(), string.size()); }
+    void writeBinary(const void *data, int length);
+    // followed by count values, or count keys and values
+    void beginList(uint32_t count);
+    void beginMap(uint32_t count);
+    void write(const Value &value);
+
+    static String encode(const Value &value);
+
+private:
+    void writeHeader(unsigned char small, unsigned char code8, unsigned char code16,
+                     unsigned char code32, uint32_t size);
+    template <typename T> void writeBigEndian(unsigned char code, T value);
+
+    String &mOut;
+};
+
+// Reads MessagePack from memory without copying it, strings are views
+// into the data
+class MessagePackReader
+{
+public:
+    enum Type {
+        Error,
+        Nil,
+        Boolean,
+        // Unsigned only when it doesn't fit in an int64_t
+        Integer,
+        Unsigned,
+        Double,
+        String,
+        Binary,
+        Extension,
+        List,
+        Map
+    };
+
+    MessagePackReader(const char *data, int size)
+        : mData(data), mSize(size), mPos(0), mType(Error), mCount(0), mInteger(0),
+          mDouble(0), mString(0), mExtensionType(0)
+    {}
+
+    // Reads the next item. For List and Map that's only the header,
+    // count() values or key and value pairs follow.
+    Type next();
+    Type type() const { return mType; }
+
+    bool boolean() const { return mInteger != 0; }
+    int64_t integer() const { return static_cast<int64_t>(mInteger); }
+    uint64_t unsignedInteger() const { return mInteger; }
+    double toDouble() const { return mDouble; }
+    // String, Binary and Extension data, valid for as long as the data
+    StringView string() const { return StringView(mString, mCount); }
+    int extensionType() const { return mExtensionType; }
+    uint32_t count() const { return mCount; }
+
+    // The next value and everything it contains
+    bool read(Value &value);
+    bool skip();
+
+    int pos() const { return mPos; }
+    bool atEnd() const { return mPos == mSize; }
+
+    static Value decode(const char *data, int size, bool *ok = 0);
+    static Value decode(const ::String &data, bool *ok = 0) { return decode(data.constData(), data.size(), ok); }
+
+private:
+    enum { MaxDepth = 512 };
+
+    bool read(Value &value, int depth);
+    bool skip(int depth);
+    template <typename T> bool readBigEndian(T &value);
+    Type readData(Type type, uint32_t size);
+
+    const char *mData;
+    const int mSize;
+    int mPos;
+    Type mType;
+    uint32_t mCount;
+    uint64_t mInteger;
+    double mDouble;
+    const char *mString;
+    int mExtensionType;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "Metrics.h"
+#include "Value.h"
+#include <algorithm>
+
+uint64_t Histogram::percentile(double p) const
+{
+    uint64_t counts[Buckets];
+    uint64_t total = 0;
+    for (int i = 0; i < Buckets; ++i) {
+        counts[i] = mBuckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (!total)
+        return 0;
+    const uint64_t rank = static_cast<uint64_t>(p * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < Buckets; ++i) {
+        seen += counts[i];
+        if (seen > rank) {
+            if (!i)
+                return 0;
+            // the max is a better bound for the last bucket
+            const uint64_t upper = i == 64 ? UINT64_MAX : (1ull << i) - 1;
+            return std::min(upper, max());
+        }
+    }
+    return max();
+}
+
+void Histogram::reset()
+{
+    for (int i = 0; i < Buckets; ++i)
+        mBuckets[i].store(0, std::memory_order_relaxed);
+    mCount.store(0, std::memory_order_relaxed);
+    mSum.store(0, std::memory_order_relaxed);
+    mMax.store(0, std::memory_order_relaxed);
+}
+
+Value Histogram::toValue() const
+{
+    Value ret;
+    const uint64_t c = count(), s = sum();
+    ret["count"] = c;
+    ret["sum"] = s;
+    ret["mean"] = c ? static_cast<double>(s) / c : 0.0;
+    ret["max"] = max();
+    ret["p50"] = percentile(0.5);
+    ret["p90"] = percentile(0.9);
+    ret["p99"] = percentile(0.99);
+    return ret;
+}
+
+std::atomic<bool> Allocations::sEnabled(false);
+Allocations::Counter Allocations::sCounters[CategoryCount];
+
+Allocations::Counts Allocations::counts(Category category)
+{
+    const Counter &counter = sCounters[category];
+    Counts ret;
+    ret.count = counter.count.load(std::memory_order_relaxed);
+    ret.bytes = counter.bytes.load(std::memory_order_relaxed);
+    // below zero when more was freed than was seen being allocated
+    ret.current = std::max<int64_t>(0, counter.current.load(std::memory_order_relaxed));
+    ret.peak = std::max<int64_t>(0, counter.peak.load(std::memory_order_relaxed));
+    return ret;
+}
+
+void Allocations::reset()
+{
+    for (Counter &counter : sCounters) {
+        counter.count.store(0, std::memory_order_relaxed);
+        counter.bytes.store(0, std::memory_order_relaxed);
+        counter.current.store(0, std::memory_order_relaxed);
+        counter.peak.store(0, std::memory_order_relaxed);
+    }
+}
+
+Value Allocations::toValue()
+{
+    static const char *names[] = { "buffers", "messages", "values", "logs" };
+    static_assert(sizeof(names) / sizeof(names[0]) == CategoryCount, "a category without a name");
+    Value ret;
+    for (int i = 0; i < CategoryCount; ++i) {
+        const Counts c = counts(static_cast<Category>(i));
+        Value value;
+        value["count"] = c.count;
+        value["bytes"] = c.bytes;
+        value["current"] = c.current;
+        value["peak"] = c.peak;
+        ret[names[i]] = value;
+    }
+    return ret;
+}
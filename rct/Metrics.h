@@ -0,0 +1,192 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+class Value;
+
+// Distribution of some value, in power of two buckets. add() is a handful
+// of relaxed atomic operations so any thread can record into it and
+// toValue() can be called while that's going on. Percentiles are the
+// upper bound of the bucket they fall in, i.e. within a factor of two.
+class Histogram
+{
+public:
+    // bucket 0 holds 0, bucket n holds [2^(n-1), 2^n)
+    enum { Buckets = 65 };
+
+    Histogram() { reset(); }
+
+    void add(uint64_t value)
+    {
+        const int bucket = value ? 64 - __builtin_clzll(value) : 0;
+        mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+        mSum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = mMax.load(std::memory_order_relaxed);
+        while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return mSum.load(std::memory_order_relaxed); }
+    uint64_t max() const { return mMax.load(std::memory_order_relaxed); }
+    uint64_t percentile(double p) const;
+
+    void reset();
+
+    // { count, sum, mean, max, p50, p90, p99 }
+    Value toValue() const;
+
+private:
+    std::atomic<uint64_t> mBuckets[Buckets];
+    std::atomic<uint64_t> mCount, mSum, mMax;
+
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+};
+
+// Heap memory by the subsystem that asked for it, for finding out where
+// memory goes before reaching for pools. Off until setEnabled(true), a
+// relaxed load is all it costs then. Values, messages and log rings know
+// whether they were counted and may be freed with counting on or off.
+// Buffers and log streams don't, so enable it early: what they allocated
+// before and free after is taken off what's current anyway.
+class Allocations
+{
+public:
+    enum Category {
+        // Buffer and the slabs BufferPool keeps
+        Buffers,
+        // frames Message encodes and what it decodes
+        Messages,
+        // the strings, maps and lists of Value
+        Values,
+        // log streams and the rings of async logging
+        Logs,
+        CategoryCount
+    };
+
+    static void setEnabled(bool on) { sEnabled.store(on, std::memory_order_relaxed); }
+    static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+    static void allocated(Category category, size_t bytes)
+    {
+        if (isEnabled())
+            add(category, bytes);
+    }
+    static void freed(Category category, size_t bytes)
+    {
+        if (isEnabled())
+            remove(category, bytes);
+    }
+    // For owners that remember whether they were counted: add() what's
+    // allocated while isEnabled() and remove() it when it's freed, whether
+    // counting is still on or not
+    static void add(Category category, size_t bytes)
+    {
+        Counter &counter = sCounters[category];
+        counter.count.fetch_add(1, std::memory_order_relaxed);
+        counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        counter.raise(counter.current.fetch_add(bytes, std::memory_order_relaxed) + static_cast<int64_t>(bytes));
+    }
+    static void remove(Category category, size_t bytes)
+    {
+        sCounters[category].current.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    // realloc(), counts as an allocation of the difference when it grows
+    static void reallocated(Category category, size_t from, size_t to)
+    {
+        if (!isEnabled() || from == to)
+            return;
+        Counter &counter = sCounters[category];
+        counter.count.fetch_add(1, std::memory_order_relaxed);
+        if (to > from) {
+            counter.bytes.fetch_add(to - from, std::memory_order_relaxed);
+            counter.raise(counter.current.fetch_add(to - from, std::memory_order_relaxed) + static_cast<int64_t>(to - from));
+        } else {
+            counter.current.fetch_sub(from - to, std::memory_order_relaxed);
+        }
+    }
+
+    struct Counts
+    {
+        // allocations and the bytes they asked for, ever
+        uint64_t count, bytes;
+        // what's allocated now, and the most that ever was
+        uint64_t current, peak;
+    };
+    static Counts counts(Category category);
+    static void reset();
+
+    // { buffers: { count, bytes, current, peak }, messages, values, logs }
+    static Value toValue();
+
+private:
+    struct alignas(64) Counter
+    {
+        std::atomic<uint64_t> count, bytes;
+        std::atomic<int64_t> current, peak;
+
+        void raise(int64_t value)
+        {
+            int64_t max = peak.load(std::memory_order_relaxed);
+            while (value > max && !peak.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+        }
+    };
+
+    static std::atomic<bool> sEnabled;
+    static Counter sCounters[CategoryCount];
+};
+
+// Allocator that counts what it hands out under category, e.g. for
+// std::allocate_shared(). It counts whether counting is on or not, so only
+// use it for what's made while Allocations::isEnabled().
+template <typename T, Allocations::Category category>
+class CountingAllocator
+{
+public:
+    typedef T value_type;
+    template <typename U>
+    struct rebind { typedef CountingAllocator<U, category> other; };
+
+    CountingAllocator() {}
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U, category> &) {}
+
+    T *allocate(size_t count)
+    {
+        Allocations::add(category, count * sizeof(T));
+        return static_cast<T *>(::operator new(count * sizeof(T)));
+    }
+    void deallocate(T *ptr, size_t count)
+    {
+        Allocations::remove(category, count * sizeof(T));
+        ::operator delete(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U, category> &) const { return true; }
+    template <typename U>
+    bool operator!=(const CountingAllocator<U, category> &) const { return false; }
+};
+
+// Derive from this to have new and delete of a class counted under category
+template <Allocations::Category category>
+class CountedObject
+{
+public:
+    static void *operator new(size_t size)
+    {
+        Allocations::allocated(category, size);
+        return ::operator new(size);
+    }
+    static void operator delete(void *ptr, size_t size)
+    {
+        Allocations::freed(category, size);
+        ::operator delete(ptr);
+    }
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef NodePool_h
+#define NodePool_h
+
+#include <rct/ThreadLocal.h>
+#include <new>
+#include <stddef.h>
+#include <string.h>
+
+// Free lists of small blocks per thread, in size classes of 16 bytes up to
+// 2k, for containers and objects that are allocated and freed all the
+// time. A block freed on another thread than the one that allocated it
+// goes to that thread's list. Every list keeps at most MaxCached blocks,
+// the rest go back to the heap.
+class NodePool
+{
+public:
+    enum { Granularity = 16, MaxSize = 2048, MaxCached = 256 };
+
+    static void *allocate(size_t size)
+    {
+        if (!size || size > MaxSize)
+            return ::operator new(size);
+        const size_t index = sizeClass(size);
+        // straight from the heap once the thread's lists are destroyed,
+        // new ones would never be
+        if (StaticThreadLocal<Lists>::isDestroyed())
+            return ::operator new((index + 1) * Granularity);
+        Lists &lists = StaticThreadLocal<Lists>::local();
+        if (Block *block = lists.heads[index]) {
+            lists.heads[index] = block->next;
+            --lists.counts[index];
+            return block;
+        }
+        return ::operator new((index + 1) * Granularity);
+    }
+
+    static void free(void *ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+        if (size && size <= MaxSize) {
+            const size_t index = sizeClass(size);
+            // null when the thread is past destroying its lists
+            Lists *lists = StaticThreadLocal<Lists>::get();
+            if (lists && lists->counts[index] < MaxCached) {
+                Block *block = static_cast<Block *>(ptr);
+                block->next = lists->heads[index];
+                lists->heads[index] = block;
+                ++lists->counts[index];
+                return;
+            }
+        }
+        ::operator delete(ptr);
+    }
+
+    // Returns what the calling thread has cached to the heap
+    static void trim()
+    {
+        if (Lists *lists = StaticThreadLocal<Lists>::get())
+            lists->trim();
+    }
+
+private:
+    enum { SizeClasses = MaxSize / Granularity };
+    static size_t sizeClass(size_t size) { return (size - 1) / Granularity; }
+
+    struct Block
+    {
+        Block *next;
+    };
+
+    struct Lists
+    {
+        Lists()
+        {
+            memset(heads, 0, sizeof(heads));
+            memset(counts, 0, sizeof(counts));
+        }
+        ~Lists() { trim(); }
+
+        void trim()
+        {
+            for (int i = 0; i < SizeClasses; ++i) {
+                while (Block *block = heads[i]) {
+                    heads[i] = block->next;
+                    ::operator delete(block);
+                }
+                counts[i] = 0;
+            }
+        }
+
+        Block *heads[SizeClasses];
+        unsigned short counts[SizeClasses];
+    };
+};
+
+// Allocator for node based containers, LinkedList, std::map and the like,
+// that takes their nodes from NodePool
+template <typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t count) { return static_cast<T *>(NodePool::allocate(count * sizeof(T))); }
+    void deallocate(T *ptr, size_t count) { NodePool::free(ptr, count * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+// Derive nodes from this to have new and delete go to NodePool, e.g. the
+// nodes of an EmbeddedLinkedList of pointers, which it deletes itself.
+// For lists of shared_ptr, std::allocate_shared() with a PoolAllocator
+// does the same.
+template <typename T>
+class PooledObject
+{
+public:
+    static void *operator new(size_t size) { return NodePool::allocate(size); }
+    static void operator delete(void *ptr, size_t size) { NodePool::free(ptr, size); }
+};
+
+#endif
@@ -1,10 +1,22 @@
 #include "Path.h"
 #include "Log.h"
+#include "Map.h"
 #include "Rct.h"
+#include "ThreadPool.h"
 #include "rct-config.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_GETDENTS64
+#include <sys/syscall.h>
+#endif
 #include <utime.h>
 #include <dirent.h>
 #include <fts.h>
@@ -30,23 +42,145 @@ Path Path::parentDir() const
     return copy;
 }
 
-Path::Type Path::type() const
+static Path::Type modeType(mode_t mode)
 {
-    struct stat st;
-    if (stat(constData(), &st) == -1)
-        return Invalid;
-
-    switch (st.st_mode & S_IFMT) {
-    case S_IFBLK: return BlockDevice;
-    case S_IFCHR: return CharacterDevice;
-    case S_IFDIR: return Directory;
-    case S_IFIFO: return NamedPipe;
-    case S_IFREG: return File;
-    case S_IFSOCK: return Socket;
+    switch (mode & S_IFMT) {
+    case S_IFBLK: return Path::BlockDevice;
+    case S_IFCHR: return Path::CharacterDevice;
+    case S_IFDIR: return Path::Directory;
+    case S_IFIFO: return Path::NamedPipe;
+    case S_IFREG: return Path::File;
+    case S_IFSOCK: return Path::Socket;
     default:
         break;
     }
-    return Invalid;
+    return Path::Invalid;
+}
+
+struct StatCache
+{
+    StatCache() : enabled(false), maxAge(0), generation(0) {}
+
+    struct Entry
+    {
+        Path::Stat stat;
+        uint64_t time;
+    };
+
+    std::atomic<bool> enabled;
+    std::mutex mutex;
+    int maxAge;
+    // bumped by every invalidation, a stat that was made across one may be
+    // stale and isn't kept
+    uint64_t generation;
+    Map<Path, Entry> entries;
+};
+
+static StatCache &statCache()
+{
+    static StatCache cache;
+    return cache;
+}
+
+static Path::Stat statPath(const Path &path)
+{
+    Path::Stat ret;
+    struct stat st;
+    if (stat(path.constData(), &st) == -1)
+        return ret;
+    ret.type = modeType(st.st_mode);
+    ret.mode = st.st_mode;
+    ret.size = st.st_size;
+    ret.lastModified = st.st_mtime;
+    ret.lastAccess = st.st_atime;
+#ifdef HAVE_STATMTIM
+    ret.lastModifiedMs = st.st_mtim.tv_sec * static_cast<uint64_t>(1000) + st.st_mtim.tv_nsec / static_cast<uint64_t>(1000000);
+#else
+    ret.lastModifiedMs = st.st_mtime * static_cast<uint64_t>(1000);
+#endif
+    ret.device = st.st_dev;
+    ret.inode = st.st_ino;
+    return ret;
+}
+
+Path::Stat Path::statAll(bool cached) const
+{
+    StatCache &cache = statCache();
+    if (!cached || !cache.enabled)
+        return statPath(*this);
+
+    const uint64_t now = Rct::monoMs();
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        const Map<Path, StatCache::Entry>::const_iterator it = cache.entries.find(*this);
+        if (it != cache.entries.end() && (!cache.maxAge || now - it->second.time < static_cast<uint64_t>(cache.maxAge)))
+            return it->second.stat;
+        generation = cache.generation;
+    }
+    // not under the lock, a stat can take a while on a network mount
+    const StatCache::Entry entry = { statPath(*this), now };
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.enabled && cache.generation == generation)
+        cache.entries[*this] = entry;
+    return entry.stat;
+}
+
+void Path::setStatCacheEnabled(bool enabled, int maxAge)
+{
+    StatCache &cache = statCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.enabled = enabled;
+    cache.maxAge = std::max(0, maxAge);
+    if (!enabled) {
+        cache.entries.clear();
+        ++cache.generation;
+    }
+}
+
+bool Path::isStatCacheEnabled()
+{
+    return statCache().enabled;
+}
+
+void Path::invalidateStat(const Path &path)
+{
+    StatCache &cache = statCache();
+    if (!cache.enabled || path.isEmpty())
+        return;
+    Path dir = path;
+    if (!dir.endsWith('/'))
+        dir.append('/');
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    ++cache.generation;
+    cache.entries.remove(dir);
+    dir.chop(1);
+    cache.entries.remove(dir);
+    // whatever's in it
+    dir.append('/');
+    Map<Path, StatCache::Entry>::iterator it = cache.entries.lower_bound(dir);
+    while (it != cache.entries.end() && it->first.startsWith(dir))
+        cache.entries.erase(it++);
+    // and the directory it's in, its mtime changes with its entries
+    const Path parent = path.parentDir();
+    if (!parent.isEmpty() && parent != path) {
+        cache.entries.remove(parent);
+        if (parent.size() > 1 && parent.endsWith('/'))
+            cache.entries.remove(Path(parent.left(parent.size() - 1)));
+    }
+}
+
+void Path::clearStatCache()
+{
+    StatCache &cache = statCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries.clear();
+    ++cache.generation;
+}
+
+Path::Type Path::type() const
+{
+    return statAll().type;
 }
 
 bool Path::isSymLink() const
@@ -60,47 +194,41 @@ bool Path::isSymLink() const
 
 mode_t Path::mode() const
 {
-    struct stat st;
-    if (stat(constData(), &st) == -1)
-        return 0;
-
-    return st.st_mode;
+    return statAll().mode;
 }
 
 
 time_t Path::lastModified() const
 {
-    struct stat st;
-    if (stat(constData(), &st) == -1) {
+    const Stat st = statAll();
+    if (!st.exists()) {
         warning("Stat failed for %s", constData());
         return 0;
     }
-    return st.st_mtime;
+    return st.lastModified;
 }
 
 time_t Path::lastAccess() const
 {
-    struct stat st;
-    if (stat(constData(), &st) == -1) {
+    const Stat st = statAll();
+    if (!st.exists()) {
         warning("Stat failed for %s", constData());
         return 0;
     }
-    return st.st_atime;
+    return st.lastAccess;
 }
 
 bool Path::setLastModified(time_t lastModified) const
 {
     const struct utimbuf buf = { lastAccess(), lastModified };
-    return !utime(constData(), &buf);
+    const bool ret = !utime(constData(), &buf);
+    invalidateStat(*this);
+    return ret;
 }
 
 int64_t Path::fileSize() const
 {
-    struct stat st;
-    if (!stat(constData(), &st)) {// && st.st_mode == S_IFREG)
-        return st.st_size;
-    }
-    return -1;
+    return statAll().size;
 }
 
 Path Path::resolved(const String &path, ResolveMode mode, const Path &cwd, bool *ok)
@@ -334,8 +462,10 @@ bool Path::mksubdir(const String &path) const
 bool Path::mkdir(const Path &path, MkDirMode mkdirMode, mode_t permissions)
 {
     errno = 0;
-    if (!::mkdir(path.constData(), permissions) || errno == EEXIST || errno == EISDIR)
+    if (!::mkdir(path.constData(), permissions) || errno == EEXIST || errno == EISDIR) {
+        invalidateStat(path);
         return true;
+    }
     if (mkdirMode == Single)
         return false;
     if (path.size() > PATH_MAX)
@@ -355,6 +485,7 @@ bool Path::mkdir(const Path &path, MkDirMode mkdirMode, mode_t permissions)
             const int r = ::mkdir(buf, permissions);
             if (r && errno != EEXIST && errno != EISDIR)
                 return false;
+            invalidateStat(Path(buf));
             buf[i] = '/';
         }
     }
@@ -368,7 +499,9 @@ bool Path::mkdir(MkDirMode mkdirMode, mode_t permissions) const
 
 bool Path::rm(const Path &file)
 {
-    return !unlink(file.constData());
+    const bool ret = !unlink(file.constData());
+    invalidateStat(file);
+    return ret;
 }
 
 static inline Path::Type ftsType(uint16_t type)
@@ -407,66 +540,378 @@ bool Path::rmdir(const Path& dir)
         }
     }
     fts_close(fdir);
-    return !::rmdir(dir.constData());
+    const bool ret = !::rmdir(dir.constData());
+    invalidateStat(dir);
+    return ret;
+}
+
+namespace {
+// One directory's entries, names are stored back to back in names
+struct Listing
+{
+    enum State {
+        Queued,
+        Reading,
+        Read
+    };
+
+    Listing(const Path &d) : dir(d), state(Queued), ok(false), device(0), inode(0) {}
+
+    struct Entry
+    {
+        int name;
+        Path::Type type;
+    };
+
+    Path dir;
+    String names;
+    List<Entry> entries;
+    State state;
+    bool ok;
+    uint64_t device, inode;
+};
 }
 
-static void visitorWrapper(Path path, Path::VisitCallback callback, Set<Path> &seen, void *userData)
+#ifdef HAVE_GETDENTS64
+// what the kernel fills in, glibc doesn't always declare it
+struct LinuxDirent64
 {
-    if (!seen.insert(path.resolved())) {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+#endif
+
+#if defined(HAVE_GETDENTS64) || defined(_DIRENT_HAVE_D_TYPE)
+static Path::Type direntType(unsigned char type)
+{
+    switch (type) {
+    case DT_BLK: return Path::BlockDevice;
+    case DT_CHR: return Path::CharacterDevice;
+    case DT_DIR: return Path::Directory;
+    case DT_FIFO: return Path::NamedPipe;
+    case DT_REG: return Path::File;
+    case DT_SOCK: return Path::Socket;
+    default:
+        break;
+    }
+    // DT_LNK and DT_UNKNOWN, symlinks are followed like type() does
+    return Path::Invalid;
+}
+#endif
+
+static Path::Type statType(int dirFd, const char *name)
+{
+#ifdef HAVE_STATX
+    struct statx stx;
+    if (!statx(dirFd, name, 0, STATX_TYPE, &stx))
+        return modeType(stx.stx_mode);
+    if (errno != ENOSYS)
+        return Path::Invalid;
+#endif
+    struct stat st;
+    if (fstatat(dirFd, name, &st, 0) == -1)
+        return Path::Invalid;
+    return modeType(st.st_mode);
+}
+
+static void addEntry(Listing &listing, int dirFd, const char *name, bool known, Path::Type type)
+{
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        return;
+    if (!known || type == Path::Invalid)
+        type = statType(dirFd, name);
+    const Listing::Entry entry = { listing.names.size(), type };
+    listing.names.append(name, strlen(name) + 1);
+    listing.entries.append(entry);
+}
+
+static void readListing(Listing &listing)
+{
+    const int fd = ::open(listing.dir.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        ::close(fd);
         return;
     }
-    DIR *d = opendir(path.constData());
-    if (!d)
+    listing.ok = true;
+    listing.device = st.st_dev;
+    listing.inode = st.st_ino;
+#ifdef HAVE_GETDENTS64
+    char buf[32768];
+    for (;;) {
+        const long read = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (read <= 0)
+            break;
+        for (long pos = 0; pos < read; ) {
+            const LinuxDirent64 *dirent = reinterpret_cast<const LinuxDirent64*>(buf + pos);
+            addEntry(listing, fd, dirent->d_name, true, direntType(dirent->d_type));
+            pos += dirent->d_reclen;
+        }
+    }
+    ::close(fd);
+#else
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        ::close(fd);
         return;
+    }
+    while (dirent *p = readdir(d)) {
+#ifdef _DIRENT_HAVE_D_TYPE
+        addEntry(listing, fd, p->d_name, true, direntType(p->d_type));
+#else
+        addEntry(listing, fd, p->d_name, false, Path::Invalid);
+#endif
+    }
+    closedir(d);
+#endif
+}
 
-    char buf[PATH_MAX + sizeof(dirent) + 1];
-    dirent *dbuf = reinterpret_cast<dirent*>(buf);
+static void sortListing(Listing &listing)
+{
+    const char *names = listing.names.constData();
+    std::sort(listing.entries.begin(), listing.entries.end(), [names](const Listing::Entry &l, const Listing::Entry &r) {
+            return strcmp(names + l.name, names + r.name) < 0;
+        });
+}
 
-    dirent *p;
-    if (!path.endsWith('/'))
-        path.append('/');
+// Calls callback for every entry, children gets the directories it wants
+// to recurse into. Symlinks can make a directory show up more than once,
+// seen has the ones that were listed already.
+static bool visitListing(const Listing &listing, const Path::WalkCallback &callback,
+                         Set<std::pair<uint64_t, uint64_t> > &seen, List<Path> &children)
+{
+    if (!listing.ok || !seen.insert(std::make_pair(listing.device, listing.inode)))
+        return true;
+    Path path = listing.dir;
     const int s = path.size();
     path.reserve(s + 128);
-    List<String> recurseDirs;
-    while (!readdir_r(d, dbuf, &p) && p) {
-        if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-            continue;
+    for (const Listing::Entry &entry : listing.entries) {
         path.truncate(s);
-        path.append(p->d_name);
-#if defined(_DIRENT_HAVE_D_TYPE) && defined(_BSD_SOURCE)
-        if (p->d_type == DT_DIR)
-            path.append('/');
-#else
-        if (path.isDir())
+        path.append(listing.names.constData() + entry.name);
+        if (entry.type == Path::Directory)
             path.append('/');
-#endif
-        switch (callback(path, userData)) {
+        switch (callback(path, entry.type)) {
         case Path::Abort:
-            p = 0;
-            break;
+            return false;
         case Path::Recurse:
-            if (path.isDir())
-                recurseDirs.append(p->d_name);
+            if (entry.type == Path::Directory)
+                children.append(path);
             break;
         case Path::Continue:
             break;
         }
     }
-    closedir(d);
-    const int count = recurseDirs.size();
-    for (int i=0; i<count; ++i) {
-        path.truncate(s);
-        path.append(recurseDirs.at(i));
-        visitorWrapper(path, callback, seen, userData);
+    return true;
+}
+
+static bool visitDirectory(const Path &dir, const Path::WalkCallback &callback, Set<std::pair<uint64_t, uint64_t> > &seen)
+{
+    List<Path> children;
+    {
+        Listing listing(dir);
+        readListing(listing);
+        if (!visitListing(listing, callback, seen, children))
+            return false;
     }
+    for (const Path &child : children) {
+        if (!visitDirectory(child, callback, seen))
+            return false;
+    }
+    return true;
+}
+
+static Path::VisitResult visitAdapter(Path::VisitCallback callback, void *userData, const Path &path, Path::Type)
+{
+    return callback(path, userData);
 }
 
 void Path::visit(VisitCallback callback, void *userData) const
 {
     if (!callback || !isDir())
         return;
-    Set<Path> seenDirs;
-    visitorWrapper(*this, callback, seenDirs, userData);
+    Path dir = *this;
+    if (!dir.endsWith('/'))
+        dir.append('/');
+    Set<std::pair<uint64_t, uint64_t> > seen;
+    visitDirectory(dir, std::bind(visitAdapter, callback, userData, std::placeholders::_1, std::placeholders::_2), seen);
+}
+
+namespace {
+// The listings that are waiting to be read and, unless the walk is sorted,
+// those that have been. Pool jobs read them until there are none left, the
+// walking thread reads one itself rather than wait for a busy pool. A job
+// can start after the walk is over, so they share this rather than the
+// Walker.
+struct WalkState
+{
+    WalkState(bool s) : sorted(s), helpers(0), reading(0), done(false) {}
+
+    // called with the lock held
+    void read(const std::shared_ptr<Listing> &listing, std::unique_lock<std::mutex> &lock)
+    {
+        listing->state = Listing::Reading;
+        ++reading;
+        lock.unlock();
+        readListing(*listing);
+        if (sorted)
+            sortListing(*listing);
+        lock.lock();
+        --reading;
+        listing->state = Listing::Read;
+        if (!sorted)
+            finished.push_back(listing);
+        condition.notify_all();
+    }
+
+    static void help(const std::shared_ptr<WalkState> &state)
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (!state->done && !state->queue.empty()) {
+            const std::shared_ptr<Listing> listing = state->queue.front();
+            state->queue.pop_front();
+            if (listing->state == Listing::Queued)
+                state->read(listing, lock);
+        }
+        --state->helpers;
+    }
+
+    // Once this returns no listing is read anymore
+    void finish()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done = true;
+        while (reading)
+            condition.wait(lock);
+        queue.clear();
+        finished.clear();
+    }
+
+    const bool sorted;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::shared_ptr<Listing> > queue, finished;
+    int helpers, reading;
+    bool done;
+};
+
+class Walker
+{
+public:
+    Walker(const Path::WalkCallback &callback, unsigned int flags, ThreadPool *pool)
+        : mCallback(callback), mPool(pool), mMaxHelpers(ThreadPool::idealThreadCount()),
+          mState(std::make_shared<WalkState>(flags & Path::Sorted))
+    {}
+
+    void walk(const Path &dir)
+    {
+        const std::shared_ptr<Listing> root = std::make_shared<Listing>(dir);
+        if (mState->sorted) {
+            walkSorted(root);
+        } else {
+            walkUnsorted(root);
+        }
+        mState->finish();
+    }
+
+private:
+    void schedule(const std::shared_ptr<Listing> &listing)
+    {
+        std::unique_lock<std::mutex> lock(mState->mutex);
+        mState->queue.push_back(listing);
+        if (mState->helpers < mMaxHelpers) {
+            ++mState->helpers;
+            lock.unlock();
+            std::shared_ptr<WalkState> state = mState;
+            mPool->submit([state]() { WalkState::help(state); });
+        }
+    }
+
+    void walkUnsorted(const std::shared_ptr<Listing> &root)
+    {
+        size_t outstanding = 1;
+        schedule(root);
+        List<Path> children;
+        while (outstanding) {
+            std::shared_ptr<Listing> listing;
+            {
+                std::unique_lock<std::mutex> lock(mState->mutex);
+                while (mState->finished.empty()) {
+                    while (!mState->queue.empty() && mState->queue.front()->state != Listing::Queued)
+                        mState->queue.pop_front();
+                    if (mState->queue.empty()) {
+                        mState->condition.wait(lock);
+                    } else {
+                        const std::shared_ptr<Listing> next = mState->queue.front();
+                        mState->queue.pop_front();
+                        mState->read(next, lock);
+                    }
+                }
+                listing = mState->finished.front();
+                mState->finished.pop_front();
+            }
+            --outstanding;
+            children.clear();
+            if (!visitListing(*listing, mCallback, mSeen, children))
+                return;
+            for (const Path &child : children) {
+                ++outstanding;
+                schedule(std::make_shared<Listing>(child));
+            }
+        }
+    }
+
+    bool walkSorted(const std::shared_ptr<Listing> &listing)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mState->mutex);
+            if (listing->state == Listing::Queued) {
+                mState->read(listing, lock);
+            } else {
+                while (listing->state != Listing::Read)
+                    mState->condition.wait(lock);
+            }
+        }
+        List<Path> paths;
+        if (!visitListing(*listing, mCallback, mSeen, paths))
+            return false;
+        // read ahead while the ones before them are walked
+        List<std::shared_ptr<Listing> > children;
+        children.reserve(paths.size());
+        for (const Path &path : paths) {
+            children.append(std::make_shared<Listing>(path));
+            schedule(children.last());
+        }
+        for (std::shared_ptr<Listing> &child : children) {
+            if (!walkSorted(child))
+                return false;
+            child.reset();
+        }
+        return true;
+    }
+
+    const Path::WalkCallback &mCallback;
+    ThreadPool *mPool;
+    const int mMaxHelpers;
+    std::shared_ptr<WalkState> mState;
+    // only used by the walking thread
+    Set<std::pair<uint64_t, uint64_t> > mSeen;
+};
+}
+
+void Path::walk(const WalkCallback &callback, unsigned int flags, ThreadPool *pool) const
+{
+    if (!callback || !isDir())
+        return;
+    Path dir = *this;
+    if (!dir.endsWith('/'))
+        dir.append('/');
+    Walker walker(callback, flags, pool ? pool : ThreadPool::instance());
+    walker.walk(dir);
 }
 
 Path Path::followLink(bool *ok) const
@@ -529,6 +974,7 @@ bool Path::write(const Path& path, const String& data, WriteMode mode)
         return false;
     const int ret = fwrite(data.constData(), sizeof(char), data.size(), f);
     fclose(f);
+    invalidateStat(path);
     return ret == data.size();
 }
 
@@ -565,46 +1011,36 @@ Path Path::pwd()
     }
     return Path();
 }
-struct FilesUserData
+List<Path> Path::files(unsigned int filter, int max, bool recurse, ThreadPool *pool) const
 {
-    unsigned int filter;
-    int max;
-    bool recurse;
+    assert(max != 0);
     List<Path> paths;
-};
-static Path::VisitResult filesVisitor(const Path &path, void *userData)
-{
-    FilesUserData &u = *reinterpret_cast<FilesUserData*>(userData);
-    if (u.max > 0)
-        --u.max;
-    if (path.type() & u.filter) {
-        u.paths.append(path);
+    const WalkCallback callback = [filter, &max, recurse, &paths](const Path &path, Type type) {
+        if (max > 0)
+            --max;
+        if (type & filter)
+            paths.append(path);
+        if (!max)
+            return Abort;
+        return recurse ? Recurse : Continue;
+    };
+    if (recurse && pool) {
+        walk(callback, Sorted, pool);
+    } else if (isDir()) {
+        Path dir = *this;
+        if (!dir.endsWith('/'))
+            dir.append('/');
+        Set<std::pair<uint64_t, uint64_t> > seen;
+        visitDirectory(dir, callback, seen);
     }
-    if (!u.max)
-        return Path::Abort;
-    return u.recurse ? Path::Recurse : Path::Continue;
-}
-
-List<Path> Path::files(unsigned int filter, int max, bool recurse) const
-{
-    assert(max != 0);
-    FilesUserData userData = { filter, max, recurse, List<Path>() };
-    visit(::filesVisitor, &userData);
-    return userData.paths;
+    return paths;
 }
 
 uint64_t Path::lastModifiedMs() const
 {
-    struct stat st;
-    if (stat(constData(), &st) == -1) {
-        return 0;
-    }
-#ifdef HAVE_STATMTIM
-    return st.st_mtim.tv_sec * static_cast<uint64_t>(1000) + st.st_mtim.tv_nsec / static_cast<uint64_t>(1000000);
-#else
-    return st.st_mtime * static_cast<uint64_t>(1000);
-#endif
+    return statAll().lastModifiedMs;
 }
+
 const char *Path::typeName(Type type)
 {
     switch (type) {
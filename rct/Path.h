@@ -8,8 +8,12 @@
 #include <unistd.h>
 #include <rct/Set.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
+#include <functional>
 #include <string>
 
+class ThreadPool;
+
 class Path : public String
 {
 public:
@@ -59,6 +63,38 @@ public:
         All = File|Directory|CharacterDevice|BlockDevice|NamedPipe|Socket
     };
 
+    // Everything type(), mode(), fileSize() and the time functions return,
+    // from one stat()
+    struct Stat
+    {
+        Stat()
+            : type(Invalid), mode(0), size(-1), lastModified(0), lastAccess(0),
+              lastModifiedMs(0), device(0), inode(0)
+        {}
+
+        bool exists() const { return mode != 0; }
+
+        Type type;
+        mode_t mode;
+        int64_t size;
+        time_t lastModified, lastAccess;
+        uint64_t lastModifiedMs;
+        uint64_t device, inode;
+    };
+    // cached false goes to the file system and leaves the cache alone
+    Stat statAll(bool cached = true) const;
+
+    // A process wide cache that statAll() and the functions above go
+    // through. Entries are kept until they're invalidated, or for maxAge ms
+    // if that's not 0. A FileSystemWatcher invalidates the paths it reports
+    // and so do the functions here that change files; changes made any
+    // other way need an invalidateStat(). A directory takes everything
+    // under it along.
+    static void setStatCacheEnabled(bool enabled, int maxAge = 0);
+    static bool isStatCacheEnabled();
+    static void invalidateStat(const Path &path);
+    static void clearStatCache();
+
     inline bool exists() const { return type() != Invalid; }
     inline bool isDir() const { return type() == Directory; }
     inline bool isFile() const { return type() == File; }
@@ -100,6 +136,8 @@ public:
     bool isHeader() const;
     static bool isHeader(const char *extension);
     Path parentDir() const;
+    // The names between the slashes, as views into this path
+    StringSplit components() const { return StringSplit(*this, '/', SkipEmpty); }
     Type type() const;
     mode_t mode() const;
     enum ResolveMode {
@@ -127,6 +165,7 @@ public:
     {
         if (FILE *f = fopen(constData(), "a")) {
             fclose(f);
+            invalidateStat(*this);
             return true;
         }
         return false;
@@ -149,13 +188,33 @@ public:
     typedef VisitResult (*VisitCallback)(const Path &path, void *userData);
     void visit(VisitCallback callback, void *userData = 0) const;
 
-    List<Path> files(unsigned int filter = All, int max = -1, bool recurse = false) const;
+    // Like visit() but the directories are read on pool, ThreadPool::instance()
+    // if none is given, while callback is called on this thread. It's told
+    // the type of every entry so it doesn't have to stat it. Entries come
+    // in no particular order unless flags has Sorted, then the entries of
+    // every directory are sorted by name and the order is the one visit()
+    // would use.
+    enum WalkFlag {
+        WalkDefault = 0x0,
+        Sorted = 0x1
+    };
+    typedef std::function<VisitResult(const Path &path, Type type)> WalkCallback;
+    void walk(const WalkCallback &callback, unsigned int flags = WalkDefault, ThreadPool *pool = 0) const;
+
+    // Lists the directory, and its subdirectories with recurse, in the
+    // order visit() uses. With recurse and a pool the directories are read
+    // on pool like walk() does with Sorted, then the entries of every
+    // directory are sorted by name too.
+    List<Path> files(unsigned int filter = All, int max = -1, bool recurse = false, ThreadPool *pool = 0) const;
 };
 
 namespace std
 {
-template <> struct hash<Path> : public unary_function<Path, size_t>
+template <> struct hash<Path>
 {
+    typedef Path argument_type;
+    typedef size_t result_type;
+
     size_t operator()(const Path& value) const
     {
         std::hash<std::string> h;
@@ -1,5 +1,8 @@
 #include "Plugin.h"
+#include "ThreadPool.h"
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace Rct {
 
@@ -26,4 +29,22 @@ char* pluginError()
     return dlerror();
 }
 
+void loadPlugins(const List<Path>& fileNames, const std::function<void(int)>& load, ThreadPool* pool)
+{
+    if (!pool)
+        pool = ThreadPool::instance();
+    // glibc's dlopen() holds a process wide lock, the part that overlaps
+    // is reading the files in, so all of them are asked for up front
+    for (const Path& fileName : fileNames) {
+        const int fd = ::open(fileName.constData(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+#ifdef POSIX_FADV_WILLNEED
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+            ::close(fd);
+        }
+    }
+    pool->parallelRun(fileNames.size(), load);
+}
+
 } // namespace RctPlugin
@@ -1,32 +1,52 @@
 #ifndef PLUGIN_H
 #define PLUGIN_H
 
+#include <rct/List.h>
 #include <rct/Path.h>
 #include <rct/String.h>
 #include <assert.h>
+#include <functional>
+
+class ThreadPool;
 
 namespace Rct {
 void* loadPlugin(const Path& fileName);
 void  unloadPlugin(void* handle);
 void* resolveSymbol(void* handle, const char* symbol);
 char* pluginError();
+// load(i) for every file on pool, ThreadPool::instance() if it's null
+void loadPlugins(const List<Path>& fileNames, const std::function<void(int)>& load, ThreadPool* pool);
 }
 
+// Nothing is loaded until the first instance(), create() or load(). The
+// file is opened with RTLD_LAZY, so functions are bound when they're first
+// called rather than all of them up front, and createInstance is looked up
+// once and kept.
 template<typename T>
 class Plugin
 {
 public:
-    Plugin() : mHandle(0), mInstance(0) { }
-    Plugin(const Path& fileName) : mFileName(fileName), mHandle(0), mInstance(0) { }
+    Plugin() : mHandle(0), mCreate(0), mInstance(0) { }
+    Plugin(const Path& fileName) : mFileName(fileName), mHandle(0), mCreate(0), mInstance(0) { }
     ~Plugin() { clear(); }
 
-    void clear() { if (mHandle) { deleteInstance(); Rct::unloadPlugin(mHandle); mHandle = 0; } }
+    void clear() { if (mHandle) { deleteInstance(); Rct::unloadPlugin(mHandle); mHandle = 0; mCreate = 0; } }
     void deleteInstance() { delete mInstance; mInstance = 0; }
 
     void setFileName(const Path& fileName) { clear(); mFileName = fileName; }
     Path fileName() const { return mFileName; }
 
+    bool load();
+    bool isLoaded() const { return mCreate; }
+    // For when they're all going to be used anyway, loads plugins in
+    // parallel on pool. Returns false if any of them couldn't be, their
+    // error() says why.
+    static bool load(const List<Plugin<T>*>& plugins, ThreadPool* pool = 0);
+
+    // The shared one, created the first time
     T* instance();
+    // A new one every time, owned by the caller
+    T* create();
 
     String error() const { return mError; }
 
@@ -34,31 +54,68 @@ private:
     Plugin(const Plugin &);
     Plugin &operator=(const Plugin &);
 
+    typedef T *(*CreateInstance)();
+
     String mError;
     Path mFileName;
     void* mHandle;
+    CreateInstance mCreate;
     T* mInstance;
 };
 
 template<typename T>
-inline T* Plugin<T>::instance()
+inline bool Plugin<T>::load()
 {
+    if (mCreate)
+        return true;
     if (!mHandle) {
         mHandle = Rct::loadPlugin(mFileName);
         if (!mHandle) {
             mError = Rct::pluginError();
-            return 0;
-        }
-        typedef T *(*CreateInstance)();
-        CreateInstance create = reinterpret_cast<CreateInstance>(Rct::resolveSymbol(mHandle, "createInstance"));
-        if (create)
-            mInstance = create();
-        if (!mInstance) {
-            mError = Rct::pluginError();
-            clear();
+            return false;
         }
     }
+    mCreate = reinterpret_cast<CreateInstance>(Rct::resolveSymbol(mHandle, "createInstance"));
+    if (!mCreate) {
+        mError = Rct::pluginError();
+        clear();
+        return false;
+    }
+    return true;
+}
+
+template<typename T>
+inline bool Plugin<T>::load(const List<Plugin<T>*>& plugins, ThreadPool* pool)
+{
+    List<Path> fileNames;
+    fileNames.reserve(plugins.size());
+    for (const Plugin<T>* plugin : plugins)
+        fileNames.append(plugin->fileName());
+    List<char> loaded(plugins.size(), 0);
+    Rct::loadPlugins(fileNames, [&plugins, &loaded](int idx) { loaded[idx] = plugins.at(idx)->load(); }, pool);
+    return !loaded.contains(0);
+}
+
+template<typename T>
+inline T* Plugin<T>::instance()
+{
+    if (!mInstance && load()) {
+        mInstance = mCreate();
+        if (!mInstance)
+            mError = "createInstance failed for " + mFileName;
+    }
     return mInstance;
 }
 
+template<typename T>
+inline T* Plugin<T>::create()
+{
+    if (!load())
+        return 0;
+    T* ret = mCreate();
+    if (!ret)
+        mError = "createInstance failed for " + mFileName;
+    return ret;
+}
+
 #endif
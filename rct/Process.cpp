@@ -11,12 +11,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #ifdef OS_Darwin
 #include <crt_externs.h>
 #endif
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+#ifdef HAVE_PIDFD_OPEN
+#include <sys/syscall.h>
+#endif
 
 static std::once_flag sProcessHandler;
 
@@ -24,6 +32,7 @@ class ProcessThread : public Thread
 {
 public:
     static void installProcessHandler();
+    static void ensureProcessHandler() { std::call_once(sProcessHandler, installProcessHandler); }
     static void addPid(pid_t pid, Process* process, bool async);
     static void shutdown();
     static void setPending(int pending);
@@ -40,6 +49,7 @@ private:
     static void wakeup(Signal sig);
 
     static void processSignalHandler(int sig);
+    static void reapManaged(std::unique_lock<std::mutex> &lock);
 private:
     static ProcessThread* sProcessThread;
     static int sProcessPipe[2];
@@ -83,6 +93,9 @@ ProcessThread::ProcessThread()
 
 void ProcessThread::setPending(int pending)
 {
+    // there's no waitpid(0) to catch a child that isn't known yet
+    if (Process::hasPidFds())
+        return;
     std::lock_guard<std::mutex> lock(sProcessMutex);
     sPending += pending;
     assert(sPending >= 0);
@@ -93,6 +106,13 @@ void ProcessThread::setPending(int pending)
 void ProcessThread::addPid(pid_t pid, Process* process, bool async)
 {
     std::lock_guard<std::mutex> lock(sProcessMutex);
+    if (Process::hasPidFds()) {
+        // only ever waits for the pids it has, the child may have exited
+        // before it got here so look right away
+        sProcesses[pid] = { process, async ? EventLoop::eventLoop() : EventLoop::SharedPtr() };
+        wakeup(Child);
+        return;
+    }
     sPending -= 1;
 
     if (!sPendingPids.empty()) {
@@ -128,6 +148,9 @@ void ProcessThread::run()
         if (r == 1) {
             if (ch == 's') {
                 break;
+            } else if (Process::hasPidFds()) {
+                std::unique_lock<std::mutex> lock(sProcessMutex);
+                reapManaged(lock);
             } else {
                 int ret;
                 pid_t p;
@@ -150,11 +173,7 @@ void ProcessThread::run()
                         break;
                     default:
                         //printf("successfully waited for pid (got %d)\n", p);
-                        if (WIFEXITED(ret)) {
-                            ret = WEXITSTATUS(ret);
-                        } else {
-                            ret = Process::ReturnCrashed;
-                        }
+                        ret = Process::exitCode(ret);
                         auto proc = sProcesses.find(p);
                         if (proc != sProcesses.end()) {
                             Process *process = proc->second.proc;
@@ -183,6 +202,36 @@ void ProcessThread::run()
     //printf("process thread died for some reason\n");
 }
 
+// Processes that didn't get a pidfd. Other children are left alone, they
+// belong to a Process with a pidfd or to someone else.
+void ProcessThread::reapManaged(std::unique_lock<std::mutex> &lock)
+{
+    List<pid_t> pids;
+    for (const auto &it : sProcesses)
+        pids.append(it.first);
+    for (pid_t pid : pids) {
+        int status;
+        pid_t p;
+        eintrwrap(p, ::waitpid(pid, &status, WNOHANG));
+        if (p != pid)
+            continue;
+        auto proc = sProcesses.find(pid);
+        if (proc == sProcesses.end())
+            continue;
+        Process *process = proc->second.proc;
+        EventLoop::SharedPtr loop = proc->second.loop.lock();
+        sProcesses.erase(proc);
+        const int ret = Process::exitCode(status);
+        lock.unlock();
+        if (loop) {
+            loop->callLater([process, ret]() { process->finish(ret); });
+        } else {
+            process->finish(ret);
+        }
+        lock.lock();
+    }
+}
+
 void ProcessThread::shutdown()
 {
     // called from static destructor, can't use mutex
@@ -220,10 +269,11 @@ void ProcessThread::installProcessHandler()
 }
 
 Process::Process()
-    : mPid(-1), mReturn(ReturnUnset), mStdInIndex(0), mStdOutIndex(0), mStdErrIndex(0),
+    : mPid(-1), mPidFd(-1), mReturn(ReturnUnset), mStdInIndex(0), mStdOutIndex(0), mStdErrIndex(0),
       mWantStdInClosed(false), mMode(Sync)
 {
-    std::call_once(sProcessHandler, ProcessThread::installProcessHandler);
+    if (!hasPidFds())
+        ProcessThread::ensureProcessHandler();
 
     mStdIn[0] = mStdIn[1] = -1;
     mStdOut[0] = mStdOut[1] = -1;
@@ -246,6 +296,7 @@ Process::~Process()
     closeStdIn(CloseForce);
     closeStdOut();
     closeStdErr();
+    closePidFd();
 
     int w;
     if (mSync[0] != -1)
@@ -267,6 +318,7 @@ void Process::clear()
     closeStdIn(CloseForce);
     closeStdOut();
     closeStdErr();
+    closePidFd();
 
     int w;
     if (mSync[0] != -1)
@@ -296,15 +348,60 @@ Path Process::findCommand(const String &command, const char *path)
     if (!path)
         return Path();
     bool ok;
-    const List<String> paths = String(path).split(':');
-    for (List<String>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
-        const Path ret = Path::resolved(command, Path::RealPath, *it, &ok);
+    for (const StringView &dir : StringView(path).split(':')) {
+        const Path ret = Path::resolved(command, Path::RealPath, Path(dir.data(), dir.size()), &ok);
         if (ok && !access(ret.nullTerminated(), R_OK | X_OK))
             return ret;
     }
     return Path();
 }
 
+static char **currentEnviron()
+{
+#ifdef OS_Darwin
+    return *_NSGetEnviron();
+#else
+    extern char** environ;
+    return environ;
+#endif
+}
+
+#ifdef HAVE_POSIX_SPAWN
+// Does what the child side of the fork() in startInternal does, without
+// copying the page tables of a large parent. Returns 0 or an errno, exec
+// failures included.
+static int spawnProcess(pid_t *pid, const Path &cmd, const char **args, const char **env, const Path &cwd,
+                        int closeFd, const int stdIn[2], const int stdOut[2], const int stdErr[2])
+{
+    posix_spawn_file_actions_t actions;
+    int ret = posix_spawn_file_actions_init(&actions);
+    if (ret)
+        return ret;
+    posix_spawn_file_actions_addclose(&actions, closeFd);
+    posix_spawn_file_actions_addclose(&actions, stdIn[1]);
+    posix_spawn_file_actions_addclose(&actions, stdOut[0]);
+    posix_spawn_file_actions_addclose(&actions, stdErr[0]);
+    const int fds[] = { stdIn[0], stdOut[1], stdErr[1] };
+    for (int i = 0; i < 3; ++i)
+        posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] > STDERR_FILENO)
+            posix_spawn_file_actions_addclose(&actions, fds[i]);
+    }
+#ifdef HAVE_POSIX_SPAWN_CHDIR
+    if (!cwd.isEmpty())
+        posix_spawn_file_actions_addchdir_np(&actions, cwd.constData());
+#else
+    assert(cwd.isEmpty());
+    (void)cwd;
+#endif
+    ret = ::posix_spawn(pid, cmd.constData(), &actions, 0, const_cast<char* const*>(args),
+                        env ? const_cast<char* const*>(env) : currentEnviron());
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+}
+#endif
+
 Process::ExecState Process::startInternal(const Path &command, const List<String> &a, const List<String> &environ,
                                           int timeout, unsigned int execFlags)
 {
@@ -341,6 +438,14 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
     eintrwrap(err, ::pipe(mStdIn));
     eintrwrap(err, ::pipe(mStdOut));
     eintrwrap(err, ::pipe(mStdErr));
+#ifdef F_SETPIPE_SZ
+    // output that isn't kept is read in bigger chunks from a bigger pipe,
+    // the kernel caps this at /proc/sys/fs/pipe-max-size
+    if (mStdOutOutput.mode != Buffered)
+        fcntl(mStdOut[0], F_SETPIPE_SZ, 1024 * 1024);
+    if (mStdErrOutput.mode != Buffered)
+        fcntl(mStdErr[0], F_SETPIPE_SZ, 1024 * 1024);
+#endif
     if (mMode == Sync)
         eintrwrap(err, ::pipe(mSync));
 
@@ -372,7 +477,25 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
 
     ProcessThread::setPending(1);
 
-    mPid = ::fork();
+    bool spawned = false;
+#ifdef HAVE_POSIX_SPAWN
+    // posix_spawn can't chroot, and can only chdir with the _np extension
+# ifdef HAVE_POSIX_SPAWN_CHDIR
+    if (mChRoot.isEmpty()) {
+# else
+    if (mChRoot.isEmpty() && mCwd.isEmpty()) {
+# endif
+        spawned = true;
+        const int ret = spawnProcess(&mPid, cmd, args, hasEnviron ? env : 0, mCwd,
+                                     closePipe[0], mStdIn, mStdOut, mStdErr);
+        if (ret) {
+            mPid = -1;
+            mErrorString = "Process failed to start";
+        }
+    }
+#endif
+    if (!spawned)
+        mPid = ::fork();
     if (mPid == -1) {
         //printf("fork, something horrible has happened %d\n", errno);
         // bail out
@@ -387,7 +510,8 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
         eintrwrap(err, ::close(mStdErr[0]));
         eintrwrap(err, ::close(closePipe[1]));
         eintrwrap(err, ::close(closePipe[0]));
-        mErrorString = "Fork failed";
+        if (!spawned)
+            mErrorString = "Fork failed";
         delete[] env;
         delete[] args;
         return Error;
@@ -476,66 +600,86 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
             }
         }
 
-        ProcessThread::addPid(mPid, this, (mMode == Async));
+#ifdef HAVE_PIDFD_OPEN
+        // with a pidfd the exit is waited for by the event loop or the
+        // select below, and the ProcessThread isn't involved
+        if (hasPidFds()) {
+            eintrwrap(mPidFd, static_cast<int>(::syscall(SYS_pidfd_open, mPid, 0)));
+            if (mMode == Async && !EventLoop::eventLoop())
+                closePidFd();
+        }
+#endif
+        if (mPidFd == -1) {
+            ProcessThread::ensureProcessHandler();
+            ProcessThread::addPid(mPid, this, (mMode == Async));
+        }
 
         //printf("fork, about to add fds: stdin=%d, stdout=%d, stderr=%d\n", mStdIn[1], mStdOut[0], mStdErr[0]);
         if (mMode == Async) {
             if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
                 loop->registerSocket(mStdOut[0], EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
                 loop->registerSocket(mStdErr[0], EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
+                if (mPidFd != -1)
+                    loop->registerSocket(mPidFd, EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
             }
         } else {
-            // select and stuff
-            timeval started, now, *selecttime = 0;
-            if (timeout > 0) {
-                Rct::gettime(&started);
-                now = started;
-                selecttime = &now;
-                Rct::timevalAdd(selecttime, timeout);
-            }
+            // a monotonic deadline, the wall clock may jump
+            const uint64_t deadline = timeout > 0 ? Rct::monoMs() + timeout : 0;
             if (!(execFlags & NoCloseStdIn)) {
                 closeStdIn(CloseForce);
                 mWantStdInClosed = false;
             }
+            // nobody's waiting for the pipes in between, so read as much
+            // as the child has written right away
+            mStdOutOutput.chunk = std::max<int>(mStdOutOutput.chunk, SyncChunk);
+            mStdErrOutput.chunk = std::max<int>(mStdErrOutput.chunk, SyncChunk);
+            bool stdOutOpen = true, stdErrOpen = true;
             for (;;) {
-                // set up all the select crap
-                fd_set rfds, wfds;
-                FD_ZERO(&rfds);
-                FD_ZERO(&wfds);
-                int max = 0;
-                FD_SET(mStdOut[0], &rfds);
-                max = std::max(max, mStdOut[0]);
-                FD_SET(mStdErr[0], &rfds);
-                max = std::max(max, mStdErr[0]);
-                FD_SET(mSync[0], &rfds);
-                max = std::max(max, mSync[0]);
-                if (mStdIn[1] != -1) {
-                    FD_SET(mStdIn[1], &wfds);
-                    max = std::max(max, mStdIn[1]);
+                enum { StdOut, StdErr, SyncPipe, PidFd, StdIn, Count };
+                pollfd fds[Count];
+                memset(fds, 0, sizeof(fds));
+                // closed pipes stay readable, a negative fd is skipped
+                fds[StdOut].fd = stdOutOpen ? mStdOut[0] : -1;
+                fds[StdErr].fd = stdErrOpen ? mStdErr[0] : -1;
+                fds[SyncPipe].fd = mSync[0];
+                fds[PidFd].fd = mPidFd;
+                fds[StdIn].fd = (mStdIn[1] != -1 && (!mStdInBuffer.empty() || mWantStdInClosed)) ? mStdIn[1] : -1;
+                for (int i = 0; i < StdIn; ++i)
+                    fds[i].events = POLLIN;
+                fds[StdIn].events = POLLOUT;
+                int wait = -1;
+                if (deadline) {
+                    const uint64_t now = Rct::monoMs();
+                    wait = now < deadline ? static_cast<int>(deadline - now) : 0;
                 }
                 int ret;
-                eintrwrap(ret, ::select(max + 1, &rfds, &wfds, 0, selecttime));
+                eintrwrap(ret, ::poll(fds, Count, wait));
                 if (ret == -1) { // ow
-                    mErrorString = "Sync select failed: ";
+                    mErrorString = "Sync poll failed: ";
                     mErrorString += Rct::strerror();
                     return Error;
                 }
-                // check fds and stuff
-                if (FD_ISSET(mStdOut[0], &rfds))
-                    handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-                if (FD_ISSET(mStdErr[0], &rfds))
-                    handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
-                if (mStdIn[1] != -1 && FD_ISSET(mStdIn[1], &wfds))
+                // POLLHUP without POLLIN is a pipe whose writer is gone
+                const short readable = POLLIN | POLLHUP | POLLERR;
+                if (fds[StdOut].revents & readable)
+                    stdOutOpen = handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut, mStdOutOutput);
+                if (fds[StdErr].revents & readable)
+                    stdErrOpen = handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr, mStdErrOutput);
+                if (fds[StdIn].revents & (POLLOUT | POLLERR | POLLHUP))
                     handleInput(mStdIn[1]);
-                if (FD_ISSET(mSync[0], &rfds)) {
+                if (fds[PidFd].revents & readable)
+                    reapPidFd();
+                if (fds[SyncPipe].revents & readable) {
                     // we're done
                     {
                         std::lock_guard<std::mutex> lock(mMutex);
                         assert(mSync[1] == -1);
 
                         // try to read all remaining data on stdout and stderr
-                        handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-                        handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+                        if (stdOutOpen)
+                            handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut, mStdOutOutput);
+                        if (stdErrOpen)
+                            handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr, mStdErrOutput);
 
                         closeStdOut();
                         closeStdErr();
@@ -547,18 +691,17 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
                     mFinished(this);
                     return Done;
                 }
-                if (timeout) {
-                    assert(selecttime);
-                    Rct::gettime(selecttime);
-                    const int lasted = Rct::timevalDiff(selecttime, &started);
-                    if (lasted >= timeout) {
-                        // timeout, we're done
-                        kill(); // attempt to kill
-                        mErrorString = "Timed out";
-                        return TimedOut;
+                if (deadline && Rct::monoMs() >= deadline) {
+                    // timeout, we're done
+                    kill(); // attempt to kill
+                    if (mPidFd != -1) {
+                        // nobody's polling it anymore
+                        closePidFd();
+                        ProcessThread::ensureProcessHandler();
+                        ProcessThread::addPid(mPid, this, false);
                     }
-                    *selecttime = started;
-                    Rct::timevalAdd(selecttime, timeout);
+                    mErrorString = "Timed out";
+                    return TimedOut;
                 }
             }
         }
@@ -634,6 +777,22 @@ void Process::closeStdErr()
     mStdErr[0] = -1;
 }
 
+void Process::setStdOutMode(OutputMode mode, int fd)
+{
+    assert(mPid == -1);
+    assert((mode == Forwarded) == (fd != -1));
+    mStdOutOutput.mode = mode;
+    mStdOutOutput.fd = fd;
+}
+
+void Process::setStdErrMode(OutputMode mode, int fd)
+{
+    assert(mPid == -1);
+    assert((mode == Forwarded) == (fd != -1));
+    mStdErrOutput.mode = mode;
+    mStdErrOutput.fd = fd;
+}
+
 String Process::readAllStdOut()
 {
     String out;
@@ -659,9 +818,63 @@ void Process::processCallback(int fd, int mode)
     if (fd == mStdIn[1])
         handleInput(fd);
     else if (fd == mStdOut[0])
-        handleOutput(fd, mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
+        handleOutput(fd, mStdOutBuffer, mStdOutIndex, mReadyReadStdOut, mStdOutOutput);
     else if (fd == mStdErr[0])
-        handleOutput(fd, mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+        handleOutput(fd, mStdErrBuffer, mStdErrIndex, mReadyReadStdErr, mStdErrOutput);
+    else if (fd == mPidFd)
+        reapPidFd();
+}
+
+bool Process::hasPidFds()
+{
+#ifdef HAVE_PIDFD_OPEN
+    // pidfd_open needs Linux 5.3
+    static const bool sHasPidFds = []() {
+        const int fd = static_cast<int>(::syscall(SYS_pidfd_open, ::getpid(), 0));
+        if (fd == -1)
+            return false;
+        int err;
+        eintrwrap(err, ::close(fd));
+        return true;
+    }();
+    return sHasPidFds;
+#else
+    return false;
+#endif
+}
+
+int Process::exitCode(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : ReturnCrashed;
+}
+
+void Process::reapPidFd()
+{
+    int status;
+    pid_t p;
+    eintrwrap(p, ::waitpid(mPid, &status, WNOHANG));
+    if (!p)
+        return;
+    closePidFd();
+    if (p == -1) {
+        // someone else waited for it
+        error() << "waitpid error" << errno;
+        finish(ReturnCrashed);
+        return;
+    }
+    finish(exitCode(status));
+}
+
+void Process::closePidFd()
+{
+    if (mPidFd == -1)
+        return;
+
+    if (EventLoop::SharedPtr eventLoop = EventLoop::eventLoop())
+        eventLoop->unregisterSocket(mPidFd);
+    int err;
+    eintrwrap(err, ::close(mPidFd));
+    mPidFd = -1;
 }
 
 void Process::finish(int returnCode)
@@ -676,8 +889,8 @@ void Process::finish(int returnCode)
 
         if (mMode == Async) {
             // try to read all remaining data on stdout and stderr
-            handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-            handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+            handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut, mStdOutOutput);
+            handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr, mStdErrOutput);
 
             closeStdOut();
             closeStdErr();
@@ -698,14 +911,20 @@ void Process::finish(int returnCode)
 
 void Process::handleInput(int fd)
 {
-    assert(EventLoop::eventLoop());
-    EventLoop::eventLoop()->unregisterSocket(fd);
+    // a synchronous exec() polls stdin itself
+    EventLoop::SharedPtr loop = mMode == Async ? EventLoop::eventLoop() : EventLoop::SharedPtr();
+    assert(loop || mMode == Sync);
+    if (loop)
+        loop->unregisterSocket(fd);
 
     //static int ting = 0;
     //printf("Process::handleInput (cnt=%d)\n", ++ting);
     for (;;) {
-        if (mStdInBuffer.empty())
+        if (mStdInBuffer.empty()) {
+            if (mWantStdInClosed)
+                closeStdIn(CloseForce);
             return;
+        }
 
         //printf("Process::handleInput in loop\n");
         int w, want;
@@ -718,12 +937,14 @@ void Process::handleInput(int fd)
             eintrwrap(w, ::write(fd, front.constData(), want));
         }
         if (w == -1) {
-            EventLoop::eventLoop()->registerSocket(fd, EventLoop::SocketWrite, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
+            if (loop)
+                loop->registerSocket(fd, EventLoop::SocketWrite, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
             break;
         } else if (w == want) {
             mStdInBuffer.pop_front();
             if (mStdInBuffer.empty() && mWantStdInClosed) {
-                EventLoop::eventLoop()->unregisterSocket(mStdIn[1]);
+                if (loop)
+                    loop->unregisterSocket(mStdIn[1]);
                 int err;
                 eintrwrap(err, ::close(mStdIn[1]));
                 mStdIn[1] = -1;
@@ -735,49 +956,111 @@ void Process::handleInput(int fd)
     }
 }
 
-void Process::handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal)
+// Writes all of data to a fd that's meant to be blocking, and waits for it
+// when it isn't
+static bool writeAll(int fd, const char *data, int size)
+{
+    while (size > 0) {
+        int w;
+        eintrwrap(w, ::write(fd, data, size));
+        if (w == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            pollfd wait = { fd, POLLOUT, 0 };
+            eintrwrap(w, ::poll(&wait, 1, -1));
+            continue;
+        }
+        data += w;
+        size -= w;
+    }
+    return true;
+}
+
+bool Process::handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal, Output &output)
 {
     //printf("Process::handleOutput %d\n", fd);
-    enum { BufSize = 1024, MaxSize = (1024 * 1024 * 16) };
-    char buf[BufSize];
+    // reads start small and grow while the child keeps the pipe full
+    enum { MaxChunk = 256 * 1024, MaxSize = (1024 * 1024 * 16) };
     int total = 0;
+    bool open = true;
+#ifdef HAVE_SPLICE
+    if (output.mode == Forwarded && output.splice) {
+        for (;;) {
+            ssize_t r;
+            eintrwrap(r, ::splice(fd, 0, output.fd, 0, MaxChunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+            if (r == -1) {
+                if (errno == EINVAL || errno == ENOSYS) {
+                    // not something the kernel can splice to
+                    output.splice = false;
+                    break;
+                }
+                return true;
+            } else if (!r) {
+                if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                    loop->unregisterSocket(fd);
+                return false;
+            }
+        }
+    }
+#endif
     for (;;) {
         int r;
-        eintrwrap(r, ::read(fd, buf, BufSize));
+        if (output.mode == Buffered) {
+            // straight into the buffer, it's trimmed to what was read
+            const int sz = buffer.size();
+            buffer.resize(sz + output.chunk);
+            eintrwrap(r, ::read(fd, buffer.data() + sz, output.chunk));
+            buffer.resize(sz + std::max(r, 0));
+        } else {
+            output.pending.reserve(output.chunk);
+            eintrwrap(r, ::read(fd, output.pending.data(), output.chunk));
+        }
         if (r == -1) {
             //printf("Process::handleOutput %d returning -1, errno %d %s\n", fd, errno, Rct::strerror().constData());
             break;
         } else if (r == 0) { // file descriptor closed, remove it
             //printf("Process::handleOutput %d returning 0\n", fd);
-            EventLoop::eventLoop()->unregisterSocket(fd);
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                loop->unregisterSocket(fd);
+            open = false;
             break;
+        }
+        //printf("Process::handleOutput in loop %d\n", fd);
+        total += r;
+        const bool full = r == output.chunk;
+        if (full && output.chunk < MaxChunk)
+            output.chunk *= 2;
+
+        if (output.mode == Streamed) {
+            output.pending.resize(r);
+            output.data(this, std::move(output.pending));
+        } else if (output.mode == Forwarded) {
+            if (!writeAll(output.fd, reinterpret_cast<const char*>(output.pending.data()), r))
+                error() << "Process::handleOutput, failed to forward output" << Rct::strerror();
         } else {
-            //printf("Process::handleOutput in loop %d\n", fd);
-            //printf("data: '%s'\n", String(buf, r).constData());
-            int sz = buffer.size();
-            if (sz + r > MaxSize) {
-                if (sz + r - index > MaxSize) {
+            const int sz = buffer.size();
+            if (sz > MaxSize) {
+                if (sz - index > MaxSize) {
                     error("Process::handleOutput, buffer too big, dropping data");
                     buffer.clear();
-                    index = sz = 0;
+                    index = 0;
                 } else {
-                    sz = buffer.size() - index;
-                    memmove(buffer.data(), buffer.data() + index, sz);
-                    buffer.resize(sz);
+                    const int remaining = sz - index;
+                    memmove(buffer.data(), buffer.data() + index, remaining);
+                    buffer.resize(remaining);
                     index = 0;
                 }
             }
-            buffer.resize(sz + r);
-            memcpy(buffer.data() + sz, buf, r);
-
-            total += r;
         }
+        if (!full)
+            break;
     }
 
     //printf("total data '%s'\n", buffer.nullTerminated());
 
-    if (total)
+    if (total && output.mode == Buffered)
         signal(this);
+    return open;
 }
 
 void Process::kill(int sig)
@@ -791,12 +1074,7 @@ void Process::kill(int sig)
 
 List<String> Process::environment()
 {
-#ifdef OS_Darwin
-    char **cur = *_NSGetEnviron();
-#else
-    extern char** environ;
-    char** cur = environ;
-#endif
+    char **cur = currentEnviron();
     List<String> env;
     while (*cur) {
         env.push_back(*cur);
@@ -1,6 +1,7 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#include <rct/Buffer.h>
 #include <rct/String.h>
 #include <rct/Path.h>
 #include <rct/List.h>
@@ -40,6 +41,16 @@ public:
     enum CloseStdInFlag { CloseNormal, CloseForce };
     void closeStdIn(CloseStdInFlag flag = CloseNormal);
 
+    enum OutputMode {
+        Buffered, // kept for readAllStdOut()/readAllStdErr(), up to 16MB
+        Streamed, // handed to stdOutData()/stdErrData() as it's read, never kept
+        Forwarded // written to fd, with splice() where the kernel can
+    };
+    // Must be called before the process is started. A Forwarded fd should
+    // be blocking, a file or a socket, and stays owned by the caller.
+    void setStdOutMode(OutputMode mode, int fd = -1);
+    void setStdErrMode(OutputMode mode, int fd = -1);
+
     String readAllStdOut();
     String readAllStdErr();
 
@@ -51,6 +62,8 @@ public:
     Signal<std::function<void(Process*)> > &readyReadStdOut() { return mReadyReadStdOut; }
     Signal<std::function<void(Process*)> > &readyReadStdErr() { return mReadyReadStdErr; }
     Signal<std::function<void(Process*)> > &finished() { return mFinished; }
+    Signal<std::function<void(Process*, Buffer&&)> > &stdOutData() { return mStdOutOutput.data; }
+    Signal<std::function<void(Process*, Buffer&&)> > &stdErrData() { return mStdErrOutput.data; }
 
     static List<String> environment();
 
@@ -64,11 +77,31 @@ private:
     void finish(int returnCode);
     void processCallback(int fd, int mode);
 
+    // Linux can hand out a pidfd for the child that becomes readable when
+    // it exits, those aren't waited for by the ProcessThread
+    static bool hasPidFds();
+    static int exitCode(int status);
+    void reapPidFd();
+    void closePidFd();
+
     void closeStdOut();
     void closeStdErr();
 
     void handleInput(int fd);
-    void handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal);
+    struct Output
+    {
+        Output() : mode(Buffered), fd(-1), chunk(4096), splice(true) {}
+
+        OutputMode mode;
+        int fd, chunk;
+        bool splice;
+        Buffer pending;
+        Signal<std::function<void(Process*, Buffer&&)> > data;
+    };
+    // false once fd is at its end
+    bool handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal, Output &output);
+    // the first read of a synchronous exec()
+    enum { SyncChunk = 64 * 1024 };
 
     ExecState startInternal(const Path &command, const List<String> &arguments,
                             const List<String> &environ, int timeout = 0, unsigned int flags = 0);
@@ -82,12 +115,14 @@ private:
 
     mutable std::mutex mMutex;
     pid_t mPid;
+    int mPidFd;
     enum { ReturnCrashed = -1, ReturnUnset = -2, ReturnKilled = -3 };
     int mReturn;
 
     std::deque<String> mStdInBuffer;
     String mStdOutBuffer, mStdErrBuffer;
     int mStdInIndex, mStdOutIndex, mStdErrIndex;
+    Output mStdOutOutput, mStdErrOutput;
     bool mWantStdInClosed;
 
     Path mCwd, mChRoot;
@@ -0,0 +1,290 @@
+#include "ProcessPool.h"
+#include "EventLoop.h"
+#include "Log.h"
+#include "MemoryMonitor.h"
+#include "Process.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char *sSocketVariable = "RCT_PROCESSPOOL_SOCKET";
+static const char *sIdVariable = "RCT_PROCESSPOOL_ID";
+
+ProcessPool::ProcessPool(const Path &command, const List<String> &arguments, const List<String> &environ)
+    : mCommand(command), mArguments(arguments), mEnviron(environ), mCount(0), mMaxJobs(0),
+      mRecycled(0), mNextId(0), mMaxMemory(0)
+{
+}
+
+ProcessPool::~ProcessPool()
+{
+    stop();
+}
+
+bool ProcessPool::start()
+{
+    assert(!mServer);
+    static std::atomic<int> sPools(0);
+    mSocketFile = String::format<128>("/tmp/rct-processpool.%d.%d", getpid(), sPools++);
+    Path::rm(mSocketFile);
+    mServer.reset(new SocketServer);
+    mServer->newConnection().connect(std::bind(&ProcessPool::onNewConnection, this));
+    if (!mServer->listen(mSocketFile)) {
+        error() << "ProcessPool can't listen on" << mSocketFile;
+        mServer.reset();
+        return false;
+    }
+    const int count = mCount > 0 ? mCount : ThreadPool::idealThreadCount();
+    for (int i = 0; i < count; ++i)
+        spawn();
+    if (mWorkers.isEmpty()) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void ProcessPool::stop()
+{
+    if (!mServer)
+        return;
+    mServer.reset();
+    Path::rm(mSocketFile);
+
+    // the workers are ours, there's nothing for them to finish
+    List<ReplyCallback> callbacks;
+    for (const auto &it : mWorkers) {
+        Worker *worker = it.second;
+        if (worker->busy)
+            callbacks.append(std::move(worker->callback));
+        if (worker->connection)
+            worker->connection->close();
+        const pid_t pid = worker->process->pid();
+        if (pid != -1) {
+            worker->process->kill(SIGKILL);
+            int status;
+            pid_t ret;
+            eintrwrap(ret, ::waitpid(pid, &status, 0));
+        }
+        delete worker->process;
+        delete worker;
+    }
+    mWorkers.clear();
+    for (const auto &connection : mConnecting)
+        connection->close();
+    mConnecting.clear();
+    for (const Job &job : mQueue)
+        callbacks.append(job.callback);
+    mQueue.clear();
+    for (const ReplyCallback &callback : callbacks)
+        callback(std::shared_ptr<Message>());
+}
+
+int ProcessPool::busy() const
+{
+    int ret = 0;
+    for (const auto &it : mWorkers) {
+        if (it.second->busy)
+            ++ret;
+    }
+    return ret;
+}
+
+void ProcessPool::submit(const std::shared_ptr<Message> &request, const ReplyCallback &callback)
+{
+    if (!mServer) {
+        callback(std::shared_ptr<Message>());
+        return;
+    }
+    mQueue.push_back({ request, callback });
+    for (const auto &it : mWorkers) {
+        Worker *worker = it.second;
+        if (!worker->busy && worker->connection && !worker->retired) {
+            dispatch(worker);
+            break;
+        }
+    }
+}
+
+void ProcessPool::spawn()
+{
+    Worker *worker = new Worker;
+    worker->id = ++mNextId;
+    worker->process = new Process;
+    worker->jobs = 0;
+    worker->busy = worker->retired = false;
+
+    Process *process = worker->process;
+    process->readyReadStdOut().connect([](Process *p) {
+            const String out = p->readAllStdOut();
+            debug() << "ProcessPool worker" << p->pid() << out;
+        });
+    process->readyReadStdErr().connect([](Process *p) {
+            const String err = p->readAllStdErr();
+            warning() << "ProcessPool worker" << p->pid() << err;
+        });
+    process->finished().connect(std::bind(&ProcessPool::onFinished, this, std::placeholders::_1));
+
+    List<String> environ = mEnviron.isEmpty() ? Process::environment() : mEnviron;
+    environ.append(String::format<256>("%s=%s", sSocketVariable, mSocketFile.constData()));
+    environ.append(String::format<64>("%s=%d", sIdVariable, worker->id));
+    if (!process->start(mCommand, mArguments, environ)) {
+        error() << "ProcessPool couldn't start" << mCommand << process->errorString();
+        delete process;
+        delete worker;
+        return;
+    }
+    mWorkers[worker->id] = worker;
+}
+
+void ProcessPool::onNewConnection()
+{
+    while (SocketClient::SharedPtr client = mServer->nextConnection()) {
+        std::shared_ptr<Connection> connection = Connection::create(client);
+        connection->newMessage().connect(std::bind(&ProcessPool::onMessage, this,
+                                                   std::placeholders::_1, std::placeholders::_2));
+        mConnecting.append(connection);
+    }
+}
+
+void ProcessPool::onMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection)
+{
+    Worker *worker = 0;
+    for (const auto &it : mWorkers) {
+        if (it.second->connection == connection) {
+            worker = it.second;
+            break;
+        }
+    }
+    if (!worker) {
+        // the first thing a worker sends is its id
+        const auto it = std::find(mConnecting.begin(), mConnecting.end(), connection);
+        if (it == mConnecting.end() || message->messageId() != ResponseMessage::MessageId)
+            return;
+        mConnecting.erase(it);
+        const int id = atoi(std::static_pointer_cast<ResponseMessage>(message)->data().constData());
+        worker = mWorkers.value(id);
+        if (!worker || worker->connection) {
+            connection->close();
+            return;
+        }
+        worker->connection = connection;
+        dispatch(worker);
+        return;
+    }
+
+    if (!worker->busy) {
+        warning() << "ProcessPool worker" << worker->process->pid() << "sent a message it wasn't asked for";
+        return;
+    }
+    const ReplyCallback callback = std::move(worker->callback);
+    worker->callback = nullptr;
+    worker->busy = false;
+    ++worker->jobs;
+    // before the callback so it can't submit to a worker on its way out
+    const bool recycle = ((mMaxJobs > 0 && worker->jobs >= mMaxJobs)
+                          || (mMaxMemory && MemoryMonitor::usage(worker->process->pid()) > mMaxMemory));
+    if (recycle)
+        retire(worker);
+    callback(message);
+    if (!recycle && mWorkers.contains(worker->id))
+        dispatch(worker);
+}
+
+void ProcessPool::dispatch(Worker *worker)
+{
+    if (worker->busy || worker->retired || !worker->connection || mQueue.empty())
+        return;
+    Job job = std::move(mQueue.front());
+    mQueue.pop_front();
+    worker->busy = true;
+    worker->callback = std::move(job.callback);
+    worker->connection->send(*job.request);
+}
+
+void ProcessPool::retire(Worker *worker)
+{
+    // it exits once its connection is gone, the replacement warms up
+    // in the meantime
+    ++mRecycled;
+    worker->retired = true;
+    worker->connection->close();
+    spawn();
+}
+
+void ProcessPool::onFinished(Process *process)
+{
+    Worker *worker = 0;
+    for (const auto &it : mWorkers) {
+        if (it.second->process == process) {
+            worker = it.second;
+            break;
+        }
+    }
+    if (!worker)
+        return;
+    mWorkers.erase(worker->id);
+    // not while its finished() is being emitted
+    EventLoop::eventLoop()->callLater([process]() { delete process; });
+
+    if (!worker->retired) {
+        if (worker->busy) {
+            warning() << "ProcessPool worker" << mCommand << "exited with a request" << process->returnCode();
+        } else if (!worker->connection) {
+            error() << "ProcessPool worker" << mCommand << "exited before it connected" << process->returnCode();
+        }
+    }
+    const bool respawn = !worker->retired && worker->connection && mServer;
+    const ReplyCallback callback = worker->busy ? std::move(worker->callback) : ReplyCallback();
+    if (worker->connection && worker->connection->isConnected())
+        worker->connection->close();
+    delete worker;
+
+    if (respawn)
+        spawn();
+    if (mWorkers.isEmpty()) {
+        // nothing left to run them, a command that can't start isn't retried
+        std::deque<Job> queue;
+        std::swap(queue, mQueue);
+        for (const Job &job : queue)
+            job.callback(std::shared_ptr<Message>());
+    }
+    if (callback)
+        callback(std::shared_ptr<Message>());
+}
+
+bool ProcessPool::exec(const RequestHandler &handler)
+{
+    const char *socketFile = getenv(sSocketVariable);
+    const char *id = getenv(sIdVariable);
+    if (!socketFile || !id)
+        return false;
+    const Path path = socketFile;
+    const String hello = id;
+    // not for the worker's own children
+    unsetenv(sSocketVariable);
+    unsetenv(sIdVariable);
+
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        loop = std::make_shared<EventLoop>();
+        loop->init(EventLoop::MainEventLoop);
+    }
+    std::shared_ptr<Connection> connection = Connection::create();
+    connection->connected().connect([hello](const std::shared_ptr<Connection> &conn) {
+            conn->send(ResponseMessage(hello));
+        });
+    connection->newMessage().connect([&handler](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+            handler(message, conn);
+        });
+    connection->disconnected().connect([loop](const std::shared_ptr<Connection> &) { loop->quit(); });
+    if (!connection->connectUnix(path)) {
+        error() << "ProcessPool worker can't connect to" << path;
+        return false;
+    }
+    loop->exec();
+    return true;
+}
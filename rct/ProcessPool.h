@@ -0,0 +1,106 @@
+#ifndef ProcessPool_h
+#define ProcessPool_h
+
+#include <rct/Connection.h>
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Message.h>
+#include <rct/Path.h>
+#include <rct/SignalSlot.h>
+#include <rct/SocketServer.h>
+#include <rct/String.h>
+#include <deque>
+#include <functional>
+#include <memory>
+
+class Process;
+
+// Keeps a number of worker processes running the same command and hands
+// them requests as Messages over a Unix socket, so the exec and startup
+// cost is paid once per worker instead of once per job. Workers are
+// replaced after maxJobs requests or once they use more than maxMemory
+// bytes (MemoryMonitor::usage()), and when they exit.
+//
+// The worker binary calls ProcessPool::exec() from main() with a handler
+// that sends exactly one reply for every request it's given. A pool must be
+// used on the thread of the EventLoop it was started on.
+class ProcessPool
+{
+public:
+    ProcessPool(const Path &command, const List<String> &arguments = List<String>(),
+                const List<String> &environ = List<String>());
+    ~ProcessPool();
+
+    // Must be called before start()
+    void setCount(int count) { mCount = count; }
+    int count() const { return mCount; }
+    // 0 is never
+    void setMaxJobs(int jobs) { mMaxJobs = jobs; }
+    int maxJobs() const { return mMaxJobs; }
+    void setMaxMemory(uint64_t bytes) { mMaxMemory = bytes; }
+    uint64_t maxMemory() const { return mMaxMemory; }
+
+    // count <= 0 means one worker per cpu
+    bool start();
+    void stop();
+    bool isRunning() const { return mServer != nullptr; }
+
+    // reply is null if the worker died before it answered or the pool was
+    // stopped first. Requests are queued while every worker is busy.
+    typedef std::function<void(const std::shared_ptr<Message> &reply)> ReplyCallback;
+    void submit(const std::shared_ptr<Message> &request, const ReplyCallback &callback);
+
+    int pending() const { return mQueue.size(); }
+    int busy() const;
+    // workers that were replaced, for maxJobs and maxMemory
+    int recycled() const { return mRecycled; }
+
+    // For the worker's main(). Connects to the pool that started this
+    // process and calls handler for every request until the pool goes
+    // away. Returns false if the process wasn't started by a ProcessPool.
+    typedef std::function<void(const std::shared_ptr<Message> &request,
+                               const std::shared_ptr<Connection> &connection)> RequestHandler;
+    static bool exec(const RequestHandler &handler);
+
+private:
+    struct Job
+    {
+        std::shared_ptr<Message> request;
+        ReplyCallback callback;
+    };
+
+    struct Worker
+    {
+        int id;
+        Process *process;
+        std::shared_ptr<Connection> connection;
+        int jobs;
+        bool busy, retired;
+        ReplyCallback callback;
+    };
+
+    void spawn();
+    void onNewConnection();
+    void onMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection);
+    void onFinished(Process *process);
+    void dispatch(Worker *worker);
+    void retire(Worker *worker);
+    void remove(Worker *worker);
+
+    const Path mCommand;
+    const List<String> mArguments, mEnviron;
+    int mCount, mMaxJobs, mRecycled, mNextId;
+    uint64_t mMaxMemory;
+    Path mSocketFile;
+    SocketServer::SharedPtr mServer;
+    Hash<int, Worker*> mWorkers;
+    // not yet told which worker they are
+    List<std::shared_ptr<Connection> > mConnecting;
+    std::deque<Job> mQueue;
+
+private:
+    ProcessPool(const ProcessPool &) = delete;
+    ProcessPool &operator=(const ProcessPool &) = delete;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "Profiler.h"
+#include "Connection.h"
+#include "Hash.h"
+#include "Log.h"
+#include "Map.h"
+#include "ResponseMessage.h"
+#include "ValueMessage.h"
+#include "rct-config.h"
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <mutex>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_BACKTRACE
+# include <cxxabi.h>
+# include <dlfcn.h>
+# include <execinfo.h>
+#endif
+#ifdef OS_Linux
+# include <sys/syscall.h>
+#endif
+
+namespace {
+enum {
+    MaxDepth = 64,
+    // the handler and the signal trampoline
+    SkipFrames = 2
+};
+
+struct Sample
+{
+    // set once the rest has been written
+    std::atomic<bool> ready;
+    int depth;
+    int thread;
+    void *frames[MaxDepth];
+};
+
+// Samples go into one array that the handler claims slots of with an
+// atomic increment, which is lock free and safe in a signal handler
+// however many threads are interrupted at once. A handler may still be
+// running after stop(), so the array only grows and an outgrown one is
+// never freed. sLimit is how much of it is used, stored after sSamples.
+std::mutex sMutex;
+std::atomic<Sample *> sSamples(0);
+int sCapacity = 0;
+std::atomic<int> sLimit(0);
+int sPeriod = 0;
+std::atomic<int> sNext(0);
+std::atomic<uint64_t> sDropped(0);
+std::atomic<bool> sRunning(false);
+// the handler stays once installed, SIGPROF's default action would kill
+// the process for a signal that's still pending after stop()
+bool sInstalled = false;
+
+int currentThread()
+{
+#ifdef OS_Linux
+    return static_cast<int>(syscall(SYS_gettid));
+#else
+    return getpid();
+#endif
+}
+
+#ifdef HAVE_BACKTRACE
+void onSignal(int, siginfo_t *, void *)
+{
+    if (!sRunning.load(std::memory_order_relaxed))
+        return;
+    const int saved = errno;
+    const int limit = sLimit.load(std::memory_order_acquire);
+    const int index = sNext.fetch_add(1, std::memory_order_relaxed);
+    if (index >= limit) {
+        sNext.fetch_sub(1, std::memory_order_relaxed);
+        sDropped.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        Sample &sample = sSamples.load(std::memory_order_acquire)[index];
+        sample.depth = ::backtrace(sample.frames, MaxDepth);
+        sample.thread = currentThread();
+        sample.ready.store(true, std::memory_order_release);
+    }
+    errno = saved;
+}
+
+String symbol(void *address)
+{
+    Dl_info info;
+    if (dladdr(address, &info) && info.dli_sname) {
+        int status;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+        if (demangled) {
+            String ret(demangled);
+            free(demangled);
+            return ret;
+        }
+        return info.dli_sname;
+    }
+    return String::format<32>("%p", address);
+}
+#endif
+
+String threadName(int thread)
+{
+#ifdef OS_Linux
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", thread);
+    if (FILE *f = fopen(path, "r")) {
+        char name[64];
+        const bool ok = fgets(name, sizeof(name), f);
+        fclose(f);
+        if (ok) {
+            const size_t length = strcspn(name, "\n");
+            if (length)
+                return String(name, length) + '-' + String::number(thread);
+        }
+    }
+#endif
+    return String::number(thread);
+}
+
+struct Stack
+{
+    int thread;
+    List<void *> frames;
+
+    bool operator<(const Stack &other) const
+    {
+        if (thread != other.thread)
+            return thread < other.thread;
+        return std::lexicographical_compare(frames.begin(), frames.end(), other.frames.begin(), other.frames.end());
+    }
+};
+
+// Identical stacks counted, copied out under sMutex
+void collect(Map<Stack, int> &ret)
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    const int count = std::min(sNext.load(std::memory_order_acquire), sLimit.load());
+    const Sample *samples = sSamples.load();
+    for (int i = 0; i < count; ++i) {
+        const Sample &sample = samples[i];
+        if (!sample.ready.load(std::memory_order_acquire) || sample.depth <= SkipFrames)
+            continue;
+        Stack stack;
+        stack.thread = sample.thread;
+        stack.frames.assign(sample.frames + SkipFrames, sample.frames + sample.depth);
+        ++ret[std::move(stack)];
+    }
+}
+}
+
+bool Profiler::start(int frequency, int maxSamples)
+{
+#ifdef HAVE_BACKTRACE
+    if (frequency <= 0 || maxSamples <= 0)
+        return false;
+    std::lock_guard<std::mutex> lock(sMutex);
+    if (sRunning.load())
+        return true;
+    // the first backtrace() loads the unwinder, which can't happen in the
+    // signal handler
+    void *frames[2];
+    ::backtrace(frames, 2);
+    if (maxSamples > sCapacity) {
+        Sample *samples = new Sample[maxSamples];
+        for (int i = 0; i < maxSamples; ++i)
+            samples[i].ready.store(false, std::memory_order_relaxed);
+        sSamples.store(samples, std::memory_order_release);
+        sCapacity = maxSamples;
+    }
+    if (maxSamples != sLimit.load()) {
+        Sample *samples = sSamples.load();
+        for (int i = 0; i < sCapacity; ++i)
+            samples[i].ready.store(false, std::memory_order_relaxed);
+        sNext.store(0);
+        sLimit.store(maxSamples, std::memory_order_release);
+    }
+    sPeriod = std::max(1, 1000000 / frequency);
+
+    if (!sInstalled) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = onSignal;
+        action.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, 0))
+            return false;
+        sInstalled = true;
+    }
+    sRunning.store(true);
+
+    itimerval timer;
+    timer.it_interval.tv_sec = sPeriod / 1000000;
+    timer.it_interval.tv_usec = sPeriod % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, 0)) {
+        sRunning.store(false);
+        return false;
+    }
+    return true;
+#else
+    (void)frequency;
+    (void)maxSamples;
+    return false;
+#endif
+}
+
+void Profiler::stop()
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    if (!sRunning.load())
+        return;
+    itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, 0);
+    // a signal that's already pending goes to the handler, which finds
+    // sRunning false
+    sRunning.store(false);
+}
+
+bool Profiler::isRunning()
+{
+    return sRunning.load();
+}
+
+void Profiler::clear()
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    const bool running = sRunning.exchange(false);
+    const int count = std::min(sNext.load(), sLimit.load());
+    Sample *samples = sSamples.load();
+    for (int i = 0; i < count; ++i)
+        samples[i].ready.store(false, std::memory_order_relaxed);
+    sNext.store(0);
+    sDropped.store(0);
+    sRunning.store(running);
+}
+
+int Profiler::sampleCount()
+{
+    return std::min(sNext.load(), sLimit.load());
+}
+
+uint64_t Profiler::droppedCount()
+{
+    return sDropped.load();
+}
+
+bool Profiler::write(FILE *f, Format format)
+{
+#ifdef HAVE_BACKTRACE
+    Map<Stack, int> stacks;
+    collect(stacks);
+    if (format == Collapsed) {
+        // stacks that only differ in where in a function they were, are
+        // the same line
+        Map<String, int> lines;
+        Hash<void *, String> symbols;
+        Hash<int, String> threads;
+        for (const auto &stack : stacks) {
+            String &thread = threads[stack.first.thread];
+            if (thread.isEmpty())
+                thread = threadName(stack.first.thread);
+            String line = thread;
+            // root first, the frames are leaf first
+            for (int i = stack.first.frames.size() - 1; i >= 0; --i) {
+                void *address = stack.first.frames.at(i);
+                String &name = symbols[address];
+                if (name.isEmpty()) {
+                    // return addresses point past the call
+                    name = symbol(static_cast<char *>(address) - 1);
+                    name.replace(";", ":");
+                }
+                line << ';' << name;
+            }
+            lines[line] += stack.second;
+        }
+        for (const auto &line : lines) {
+            if (fprintf(f, "%s %d\n", line.first.constData(), line.second) < 0)
+                return false;
+        }
+        return true;
+    }
+
+    auto word = [f](uintptr_t value) { return fwrite(&value, sizeof(value), 1, f) == 1; };
+    int period;
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        period = sPeriod;
+    }
+    bool ok = word(0) && word(3) && word(0) && word(period) && word(0);
+    for (const auto &stack : stacks) {
+        ok = ok && word(stack.second) && word(stack.first.frames.size());
+        for (void *address : stack.first.frames)
+            ok = ok && word(reinterpret_cast<uintptr_t>(address));
+    }
+    ok = ok && word(0) && word(1) && word(0);
+    if (FILE *maps = fopen("/proc/self/maps", "r")) {
+        char buf[4096];
+        size_t read;
+        while (ok && (read = fread(buf, 1, sizeof(buf), maps)) > 0)
+            ok = fwrite(buf, 1, read, f) == read;
+        fclose(maps);
+    }
+    return ok;
+#else
+    (void)f;
+    (void)format;
+    return false;
+#endif
+}
+
+bool Profiler::write(const Path &path, Format format)
+{
+    FILE *f = fopen(path.constData(), "w");
+    if (!f)
+        return false;
+    const bool ret = write(f, format);
+    return fclose(f) == 0 && ret;
+}
+
+bool Profiler::handleMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection)
+{
+    if (!message || message->messageId() != ValueMessage::MessageId)
+        return false;
+    const Value &value = static_cast<const ValueMessage *>(message.get())->value();
+    if (!value.isMap() || !value.contains("profiler"))
+        return false;
+    const String command = value["profiler"].toString();
+    const uint32_t streamId = message->streamId();
+    String response;
+    int status = 0;
+    if (command == "start") {
+        const int frequency = value.contains("frequency") ? value["frequency"].toInteger() : 99;
+        const int maxSamples = value.contains("samples") ? value["samples"].toInteger() : 100000;
+        if (!start(frequency, maxSamples)) {
+            response = "Couldn't start the profiler";
+            status = 1;
+        }
+    } else if (command == "stop") {
+        stop();
+        response = String::format<64>("%d samples, %llu dropped", sampleCount(),
+                                      static_cast<unsigned long long>(droppedCount()));
+    } else if (command == "write") {
+        // sent back rather than written to a path the peer picks
+        const Format format = value["format"].toString() == "pprof" ? Pprof : Collapsed;
+        char *data = 0;
+        size_t size = 0;
+        if (FILE *f = open_memstream(&data, &size)) {
+            const bool ok = write(f, format);
+            fclose(f);
+            if (ok) {
+                response.assign(data, size);
+            } else {
+                response = "Couldn't write the profile";
+                status = 1;
+            }
+            free(data);
+        }
+    } else {
+        response = "Unknown profiler command " + command;
+        status = 1;
+    }
+    if (!response.isEmpty()) {
+        // setData() keeps a trailing newline, which a pprof profile can't lose
+        ResponseMessage message;
+        message.setData(response);
+        connection->send(message, streamId);
+    }
+    connection->send(FinishMessage(status), streamId);
+    return true;
+}
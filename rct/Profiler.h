@@ -0,0 +1,49 @@
+#ifndef Profiler_h
+#define Profiler_h
+
+#include <rct/Path.h>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+
+class Connection;
+class Message;
+
+// Sampling cpu profiler. While it runs, SIGPROF interrupts whichever
+// thread is using the cpu frequency times a second of cpu time and its
+// stack is stored as raw return addresses, nothing is looked up or
+// allocated in the signal handler. Symbols are resolved when the profile
+// is written, or later by pprof from the maps the profile ends with.
+// Needs HAVE_BACKTRACE, start() fails without it.
+class Profiler
+{
+public:
+    // Keeps up to maxSamples stacks, the ones after that are dropped
+    static bool start(int frequency = 99, int maxSamples = 100000);
+    static void stop();
+    static bool isRunning();
+    static void clear();
+
+    static int sampleCount();
+    static uint64_t droppedCount();
+
+    enum Format {
+        // one line per distinct stack, thread;root;...;leaf count, what
+        // flamegraph.pl and speedscope read, symbolized with dladdr()
+        Collapsed,
+        // the legacy binary cpu profile of gperftools, addresses followed by
+        // /proc/self/maps, for pprof <binary> <profile>
+        Pprof
+    };
+    static bool write(const Path &path, Format format = Collapsed);
+    static bool write(FILE *f, Format format = Collapsed);
+
+    // For daemons, answers a ValueMessage of the form
+    // { "profiler": "start", "frequency": 99 }, { "profiler": "stop" } or
+    // { "profiler": "write", "format": "pprof" } on connection and returns
+    // true, false for any other message. The profile is sent back as a
+    // ResponseMessage, collapsed stacks unless the format is pprof.
+    static bool handleMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection);
+};
+
+#endif
@@ -11,6 +11,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include "StackBuffer.h"
+#include <atomic>
 #ifdef OS_Darwin
 # include <mach-o/dyld.h>
 #elif OS_FreeBSD
@@ -226,11 +227,13 @@ void findExecutablePath(const char *argv0)
         }
     }
     const char *path = getenv("PATH");
-    const List<String> paths = String(path).split(':');
-    for (int i=0; i<paths.size(); ++i) {
-        const Path p = (paths.at(i) + "/") + argv0;
-        if (p.isFile()) {
-            sExecutablePath = p;
+    Path candidate;
+    for (const StringView &dir : StringView(path).split(':')) {
+        candidate.assign(dir.data(), dir.size());
+        candidate += '/';
+        candidate += argv0;
+        if (candidate.isFile()) {
+            sExecutablePath = candidate;
             return;
         }
     }
@@ -347,19 +350,17 @@ String backtrace(int)
 #endif
 
 
-bool gettime(timeval* time)
+uint64_t monoUs()
 {
 #if defined(HAVE_MACH_ABSOLUTE_TIME)
     static mach_timebase_info_data_t info;
     static bool first = true;
-    uint64_t machtime = mach_absolute_time();
+    const uint64_t machtime = mach_absolute_time();
     if (first) {
         first = false;
         mach_timebase_info(&info);
     }
-    machtime = machtime * info.numer / (info.denom * 1000); // microseconds
-    time->tv_sec = machtime / 1000000;
-    time->tv_usec = machtime % 1000000;
+    return machtime * info.numer / (info.denom * 1000);
 #elif defined(HAVE_CLOCK_MONOTONIC_RAW) || defined(HAVE_CLOCK_MONOTONIC)
     timespec spec;
 #if defined(HAVE_CLOCK_MONOTONIC_RAW)
@@ -367,26 +368,56 @@ bool gettime(timeval* time)
 #else
     const clockid_t cid = CLOCK_MONOTONIC;
 #endif
-    const int ret = ::clock_gettime(cid, &spec);
-    if (ret == -1) {
+    if (::clock_gettime(cid, &spec) == -1)
+        return 0;
+    return (spec.tv_sec * static_cast<uint64_t>(1000000)) + (spec.tv_nsec / 1000);
+#else
+#error No Rct::monoUs() implementation
+#endif
+}
+
+bool gettime(timeval* time)
+{
+    const uint64_t us = monoUs();
+    if (!us) {
         memset(time, 0, sizeof(timeval));
         return false;
     }
-    time->tv_sec = spec.tv_sec;
-    time->tv_usec = spec.tv_nsec / 1000;
-#else
-#error No EventLoop::gettime() implementation
-#endif
+    time->tv_sec = us / 1000000;
+    time->tv_usec = us % 1000000;
     return true;
 }
 
 uint64_t monoMs()
 {
-    timeval time;
-    if (gettime(&time)) {
-        return (time.tv_sec * static_cast<uint64_t>(1000)) + (time.tv_usec / static_cast<uint64_t>(1000));
-    }
-    return 0;
+    return monoUs() / 1000;
+}
+
+uint64_t coarseMonoMs()
+{
+#if defined(HAVE_CLOCK_MONOTONIC_COARSE)
+    timespec spec;
+    if (!::clock_gettime(CLOCK_MONOTONIC_COARSE, &spec))
+        return (spec.tv_sec * static_cast<uint64_t>(1000)) + (spec.tv_nsec / 1000000);
+#endif
+    return monoMs();
+}
+
+static std::atomic<uint64_t> sCachedTime(0);
+
+uint64_t updateCachedTime()
+{
+    const uint64_t now = monoUs();
+    // several event loops can be updating it, it never goes backwards
+    uint64_t cached = sCachedTime.load(std::memory_order_relaxed);
+    while (cached < now && !sCachedTime.compare_exchange_weak(cached, now, std::memory_order_relaxed)) {}
+    return now;
+}
+
+uint64_t cachedMonoUs()
+{
+    const uint64_t cached = sCachedTime.load(std::memory_order_relaxed);
+    return cached ? cached : updateCachedTime();
 }
 
 uint64_t currentTimeMs()
@@ -559,6 +590,16 @@ String nameLookup(const String& name, LookupMode mode, bool *ok)
     return out;
 }
 
+uint64_t checksum(const void *data, size_t len, uint64_t hash)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 String strerror(int error)
 {
 #ifdef _GNU_SOURCE
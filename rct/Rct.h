@@ -71,7 +71,18 @@ void findExecutablePath(const char *argv0);
 Path executablePath();
 String backtrace(int maxFrames = -1);
 bool gettime(timeval* time);
+uint64_t monoUs();
 uint64_t monoMs();
+// CLOCK_MONOTONIC_COARSE where there is one. It only moves once per kernel
+// tick but is read without a syscall or even a cpu counter read. It's not
+// quite the same clock as monoMs() so don't mix the two.
+uint64_t coarseMonoMs();
+// monoUs() as of the last updateCachedTime(). Every EventLoop updates it
+// once per iteration so it's at most one iteration behind while a loop is
+// running. updateCachedTime() returns the fresh value.
+uint64_t updateCachedTime();
+uint64_t cachedMonoUs();
+inline uint64_t cachedMonoMs() { return cachedMonoUs() / 1000; }
 uint64_t currentTimeMs();
 String hostName();
 
@@ -144,6 +155,16 @@ inline int timevalDiff(timeval* a, timeval* b)
     return ams - bms;
 }
 
+// The next place in string where a * in a pattern can continue, found
+// with the C library's vectorized search for the character after it
+static inline const char *wildCmpNext(const char *string, char ch, String::CaseSensitivity cs)
+{
+    if (cs == String::CaseSensitive)
+        return strchr(string, ch);
+    const char chars[] = { static_cast<char>(tolower(ch)), static_cast<char>(toupper(ch)), '\0' };
+    return strpbrk(string, chars);
+}
+
 static inline bool wildCmp(const char *wild, const char *string, String::CaseSensitivity cs = String::CaseSensitive)
 {
     // Written by Jack Handy - Found here: http://www.codeproject.com/Articles/1088/Wildcard-string-compare-globbing
@@ -163,14 +184,20 @@ static inline bool wildCmp(const char *wild, const char *string, String::CaseSen
                 return true;
             }
             mp = wild;
-            cp = string+1;
+            cp = string;
         } else if (*wild == '?' || *wild == *string || (cs == String::CaseInsensitive && tolower(*wild) == tolower(*string))) {
             wild++;
             string++;
+            continue;
         } else {
             wild = mp;
-            string = cp++;
         }
+        // retry the text after the * from the next place it can match,
+        // without a literal there that's every position
+        string = cp;
+        if (*mp != '?' && *mp != '*' && !(string = wildCmpNext(cp, *mp, cs)))
+            return false;
+        cp = string + 1;
     }
 
     while (*wild == '*') {
@@ -179,6 +206,10 @@ static inline bool wildCmp(const char *wild, const char *string, String::CaseSen
     return !*wild;
 }
 
+// FNV-1a, what DataFile sections and Compressor's chunks are checked with
+constexpr uint64_t ChecksumSeed = 14695981039346656037ull;
+uint64_t checksum(const void *data, size_t len, uint64_t hash = ChecksumSeed);
+
 String strerror(int error = errno);
 }
 
@@ -2,24 +2,35 @@
 #define READLOCKER_H
 
 #include <rct/ReadWriteLock.h>
+#include <rct/ShardedReadWriteLock.h>
 
 class ReadLocker
 {
 public:
     ReadLocker(ReadWriteLock* lock)
-        : mLock(lock)
+        : mLock(lock), mSharded(0), mShard(-1)
     {
         if (mLock && !mLock->lockForRead())
             mLock = 0;
     }
+    ReadLocker(ShardedReadWriteLock* lock)
+        : mLock(0), mSharded(lock), mShard(-1)
+    {
+        if (mSharded && (mShard = mSharded->lockForRead()) == -1)
+            mSharded = 0;
+    }
     ~ReadLocker()
     {
         if (mLock)
             mLock->unlock();
+        else if (mSharded)
+            mSharded->unlockRead(mShard);
     }
 
 private:
     ReadWriteLock* mLock;
+    ShardedReadWriteLock* mSharded;
+    int mShard;
 };
 
 #endif
@@ -1,20 +1,72 @@
 #include "SHA256.h"
+#include "ThreadPool.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
 #ifdef OS_Darwin
 #include "CommonCrypto/CommonDigest.h"
-#define SHA256_Update        CC_SHA256_Update
-#define SHA256_Init          CC_SHA256_Init
-#define SHA256_Final         CC_SHA256_Final
-#define SHA256_CTX           CC_SHA256_CTX
 #define SHA256_DIGEST_LENGTH CC_SHA256_DIGEST_LENGTH
 #else
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
 #endif
 
 class SHA256Private
 {
 public:
-    SHA256_CTX ctx;
+    SHA256Private()
+    {
+#ifndef OS_Darwin
+        ctx = EVP_MD_CTX_new();
+#endif
+        init();
+    }
+    ~SHA256Private()
+    {
+#ifndef OS_Darwin
+        EVP_MD_CTX_free(ctx);
+#endif
+    }
+
+    void init()
+    {
+        finalized = false;
+#ifdef OS_Darwin
+        CC_SHA256_Init(&ctx);
+#else
+        EVP_DigestInit_ex(ctx, EVP_sha256(), 0);
+#endif
+    }
+    void update(const void* data, size_t size)
+    {
+        finalized = false;
+#ifdef OS_Darwin
+        CC_SHA256_Update(&ctx, data, size);
+#else
+        EVP_DigestUpdate(ctx, data, size);
+#endif
+    }
+    void final()
+    {
+#ifdef OS_Darwin
+        CC_SHA256_Final(hash, &ctx);
+#else
+        EVP_DigestFinal_ex(ctx, hash, 0);
+#endif
+        init();
+        finalized = true;
+    }
+
+#ifdef OS_Darwin
+    CC_SHA256_CTX ctx;
+#else
+    EVP_MD_CTX* ctx;
+#endif
     unsigned char hash[SHA256_DIGEST_LENGTH];
     bool finalized;
 };
@@ -22,7 +74,6 @@ public:
 SHA256::SHA256()
     : priv(new SHA256Private)
 {
-    reset();
 }
 
 SHA256::~SHA256()
@@ -34,32 +85,29 @@ void SHA256::update(const char *data, unsigned int size)
 {
     if (!size)
         return;
-    if (priv->finalized)
-        priv->finalized = false;
-    SHA256_Update(&priv->ctx, data, size);
+    priv->update(data, size);
 }
 
 void SHA256::update(const String &data)
 {
     if (data.isEmpty())
         return;
-    if (priv->finalized)
-        priv->finalized = false;
-    SHA256_Update(&priv->ctx, data.constData(), data.size());
+    priv->update(data.constData(), data.size());
 }
 
 void SHA256::reset()
 {
-    priv->finalized = false;
-    SHA256_Init(&priv->ctx);
+    priv->init();
 }
 
 static const char* const hexLookup = "0123456789abcdef";
 
-static inline String hashToHex(SHA256Private* priv)
+static inline String hashToString(const unsigned char* hash, SHA256::MapType type)
 {
+    if (type == SHA256::Raw)
+        return String(reinterpret_cast<const char*>(hash), SHA256_DIGEST_LENGTH);
     String out(SHA256_DIGEST_LENGTH * 2, '\0');
-    const unsigned char* get = priv->hash;
+    const unsigned char* get = hash;
     char* put = out.data();
     const char* const end = out.data() + out.size();
     for (; put != end; ++get) {
@@ -71,14 +119,9 @@ static inline String hashToHex(SHA256Private* priv)
 
 String SHA256::hash(MapType type) const
 {
-    if (!priv->finalized) {
-        SHA256_Final(priv->hash, &priv->ctx);
-        SHA256_Init(&priv->ctx);
-        priv->finalized = true;
-    }
-    if (type == Hex)
-        return hashToHex(priv);
-    return String(reinterpret_cast<char*>(priv->hash), SHA256_DIGEST_LENGTH);
+    if (!priv->finalized)
+        priv->final();
+    return hashToString(priv->hash, type);
 }
 
 String SHA256::hash(const String& data, MapType type)
@@ -88,11 +131,65 @@ String SHA256::hash(const String& data, MapType type)
 
 String SHA256::hash(const char* data, unsigned int size, MapType type)
 {
-    SHA256Private priv;
-    SHA256_Init(&priv.ctx);
-    SHA256_Update(&priv.ctx, data, size);
-    SHA256_Final(priv.hash, &priv.ctx);
-    if (type == Hex)
-        return hashToHex(&priv);
-    return String(reinterpret_cast<char*>(priv.hash), SHA256_DIGEST_LENGTH);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+#ifdef OS_Darwin
+    CC_SHA256(data, size, hash);
+#else
+    EVP_Digest(data, size, hash, 0, EVP_sha256(), 0);
+#endif
+    return hashToString(hash, type);
+}
+
+// Each chunk of inputs is hashed with one context, creating one costs
+// more than hashing a short input
+enum { InputGrain = 64 };
+
+List<String> SHA256::hash(const List<String>& inputs, MapType type, ThreadPool* pool)
+{
+    List<String> ret(inputs.size());
+    if (!pool)
+        pool = ThreadPool::instance();
+    const int chunks = (inputs.size() + InputGrain - 1) / InputGrain;
+    pool->parallelFor(0, chunks, 1, [&](int chunk) {
+            SHA256Private priv;
+            const int end = std::min<int>(inputs.size(), (chunk + 1) * InputGrain);
+            for (int i = chunk * InputGrain; i < end; ++i) {
+                priv.update(inputs.at(i).constData(), inputs.at(i).size());
+                priv.final();
+                ret[i] = hashToString(priv.hash, type);
+            }
+        });
+    return ret;
+}
+
+List<String> SHA256::hashFiles(const List<Path>& files, MapType type, ThreadPool* pool)
+{
+    List<String> ret(files.size());
+    if (!pool)
+        pool = ThreadPool::instance();
+    pool->parallelFor(0, files.size(), 1, [&](int i) {
+            int fd;
+            do {
+                fd = ::open(files.at(i).constData(), O_RDONLY | O_CLOEXEC);
+            } while (fd == -1 && errno == EINTR);
+            if (fd == -1)
+                return;
+            enum { BufferSize = 64 * 1024 };
+            std::unique_ptr<char[]> buffer(new char[BufferSize]);
+            SHA256Private priv;
+            for (;;) {
+                const ssize_t r = ::read(fd, buffer.get(), BufferSize);
+                if (r > 0) {
+                    priv.update(buffer.get(), r);
+                } else if (!r) {
+                    priv.final();
+                    ret[i] = hashToString(priv.hash, type);
+                    break;
+                } else if (errno != EINTR) {
+                    break;
+                }
+            }
+            ::close(fd);
+        });
+    return ret;
 }
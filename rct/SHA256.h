@@ -1,10 +1,16 @@
 #ifndef SHA256_H
 #define SHA256_H
 
+#include <rct/Buffer.h>
+#include <rct/List.h>
+#include <rct/Path.h>
 #include <rct/String.h>
 
 class SHA256Private;
+class ThreadPool;
 
+// Through OpenSSL's EVP or CommonCrypto, which use the cpu's SHA
+// extensions where there are any
 class SHA256
 {
 public:
@@ -15,16 +21,26 @@ public:
 
     void update(const String& data);
     void update(const char* data, unsigned int size);
+    void update(const Buffer& data) { update(reinterpret_cast<const char*>(data.data()), data.size()); }
 
     void reset();
 
+    // Finishes the hash, update() starts a new one afterwards
     String hash(MapType type = Hex) const;
 
     static String hash(const String& data, MapType type = Hex);
     static String hash(const char* data, unsigned int size, MapType type = Hex);
 
+    // The hash of each of inputs or files, worked through on pool, the
+    // global one if it's null. Files that can't be read get an empty hash.
+    static List<String> hash(const List<String>& inputs, MapType type = Hex, ThreadPool* pool = 0);
+    static List<String> hashFiles(const List<Path>& files, MapType type = Hex, ThreadPool* pool = 0);
+
 private:
     SHA256Private* priv;
+
+    SHA256(const SHA256&) = delete;
+    SHA256& operator=(const SHA256&) = delete;
 };
 
 #endif // SHA256_H
@@ -3,7 +3,12 @@
 #ifdef HAVE_SCRIPTENGINE
 
 #include <v8.h>
+#include <rct/DataFile.h>
 #include <rct/EventLoop.h>
+#include <rct/FastHash.h>
+#include <rct/StringView.h>
+#include <mutex>
+#include <pthread.h>
 
 static String toString(v8::Handle<v8::Value> value);
 static v8::Handle<v8::Value> toV8(v8::Isolate* isolate, const Value& value);
@@ -15,7 +20,9 @@ enum CustomType {
     CustomType_Object,
     CustomType_Function,
     CustomType_AdoptedFunction,
-    CustomType_ClassObject
+    CustomType_ClassObject,
+    CustomType_ArrayBuffer,
+    CustomType_LazyMap
 };
 
 struct ScriptEnginePrivate
@@ -23,6 +30,13 @@ struct ScriptEnginePrivate
     v8::Persistent<v8::Context> context;
     v8::Isolate *isolate;
 
+    // the cache as it is on disk and the code compiled since it was read
+    Path codeCachePath;
+    std::unique_ptr<DataFile> codeCache;
+    Hash<String, String> compiledCode;
+
+    v8::Persistent<v8::ObjectTemplate> lazyMapTemplate;
+
     static ScriptEnginePrivate *get(ScriptEngine *engine) { return engine->mPrivate; }
 };
 
@@ -58,6 +72,224 @@ struct ScriptEngineCustom : public Value::Custom
     ScriptEngine::Object::SharedPtr scriptObject;
 };
 
+// V8 allocates the memory of the ArrayBuffers scripts create with this, so
+// that once one is externalized it can be freed with free()
+class ArrayBufferAllocator : public v8::ArrayBuffer::Allocator
+{
+public:
+    virtual void *Allocate(size_t length) override { return calloc(length, 1); }
+    virtual void *AllocateUninitialized(size_t length) override { return malloc(length); }
+    virtual void Free(void *data, size_t) override { free(data); }
+};
+
+// The memory of ArrayBuffers, either a Buffer from ScriptEngine::fromBuffer()
+// or what V8 allocated for an ArrayBuffer a script made, externalized the
+// first time it's converted. The ArrayBuffers on it and the Values of it
+// share it.
+struct ArrayBufferData
+{
+    ArrayBufferData(Buffer &&b)
+        : buffer(std::move(b)), contents(0), data(buffer.data()), size(buffer.size())
+    {
+    }
+    ArrayBufferData(void *c, size_t s)
+        : contents(c), data(static_cast<unsigned char *>(c)), size(s)
+    {
+    }
+    ~ArrayBufferData()
+    {
+        free(contents);
+    }
+
+    Buffer buffer;
+    void *contents;
+    unsigned char *data;
+    const size_t size;
+};
+
+struct ArrayBufferCustom : public Value::Custom
+{
+    ArrayBufferCustom(const std::shared_ptr<ArrayBufferData> &d, size_t o, size_t l)
+        : Value::Custom(CustomType_ArrayBuffer), data(d), offset(o), length(l)
+    {
+    }
+
+    const std::shared_ptr<ArrayBufferData> data;
+    // of the typed array it came from
+    const size_t offset, length;
+};
+
+// Keeps the memory alive until the ArrayBuffer is collected
+struct ArrayBufferHandle
+{
+    v8::Persistent<v8::ArrayBuffer> handle;
+    std::shared_ptr<ArrayBufferData> data;
+};
+
+static void ArrayBufferWeak(const v8::WeakCallbackData<v8::ArrayBuffer, ArrayBufferHandle>& data)
+{
+    ArrayBufferHandle *handle = data.GetParameter();
+    handle->handle.Reset();
+    delete handle;
+}
+
+static inline void attachArrayBufferData(v8::Isolate *isolate, v8::Handle<v8::ArrayBuffer> buffer,
+                                         const std::shared_ptr<ArrayBufferData> &data)
+{
+    ArrayBufferHandle *handle = new ArrayBufferHandle;
+    handle->data = data;
+    handle->handle.Reset(isolate, buffer);
+    handle->handle.SetWeak(handle, ArrayBufferWeak);
+    buffer->SetHiddenValue(v8::String::NewFromUtf8(isolate, "rctBuffer"), v8::External::New(isolate, handle));
+}
+
+static inline v8::Local<v8::Value> arrayBufferToV8(v8::Isolate *isolate, const ArrayBufferCustom &custom)
+{
+    v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(isolate, custom.data->data, custom.data->size);
+    attachArrayBufferData(isolate, buffer, custom.data);
+    if (!custom.offset && custom.length == custom.data->size)
+        return buffer;
+    return v8::Uint8Array::New(buffer, custom.offset, custom.length);
+}
+
+static inline Value arrayBufferFromV8(v8::Isolate *isolate, v8::Handle<v8::Value> value)
+{
+    v8::Handle<v8::ArrayBuffer> buffer;
+    size_t offset = 0, length;
+    if (value->IsArrayBufferView()) {
+        v8::Handle<v8::ArrayBufferView> view = v8::Handle<v8::ArrayBufferView>::Cast(value);
+        buffer = view->Buffer();
+        offset = view->ByteOffset();
+        length = view->ByteLength();
+    } else {
+        buffer = v8::Handle<v8::ArrayBuffer>::Cast(value);
+        length = buffer->ByteLength();
+    }
+
+    std::shared_ptr<ArrayBufferData> data;
+    v8::Handle<v8::Value> ext = buffer->GetHiddenValue(v8::String::NewFromUtf8(isolate, "rctBuffer"));
+    if (!ext.IsEmpty() && ext->IsExternal()) {
+        data = static_cast<ArrayBufferHandle*>(v8::Handle<v8::External>::Cast(ext)->Value())->data;
+    } else if (!buffer->IsExternal()) {
+        // it's ours to free from now on
+        const v8::ArrayBuffer::Contents contents = buffer->Externalize();
+        data = std::make_shared<ArrayBufferData>(contents.Data(), contents.ByteLength());
+        attachArrayBufferData(isolate, buffer, data);
+    } else {
+        error() << "ArrayBuffer externalized elsewhere in fromV8";
+        return Value();
+    }
+    return Value(std::make_shared<ArrayBufferCustom>(data, offset, length));
+}
+
+// Strings at least this long are handed to V8 as they are rather than
+// copied, if they're ASCII which is all an external one byte string can
+// hold. The String lives as long as the script's string does.
+enum { ExternalStringSize = 4096 };
+
+class ExternalString : public v8::String::ExternalOneByteStringResource
+{
+public:
+    ExternalString(const std::shared_ptr<const String> &string)
+        : mString(string)
+    {
+    }
+
+    virtual const char *data() const override { return mString->constData(); }
+    virtual size_t length() const override { return mString->size(); }
+
+private:
+    const std::shared_ptr<const String> mString;
+};
+
+static inline bool isAscii(const String &string)
+{
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(string.constData());
+    const unsigned char *end = data + string.size();
+    unsigned char bits = 0;
+    while (data != end)
+        bits |= *data++;
+    return !(bits & 0x80);
+}
+
+// Maps with at least this many entries go to scripts as objects that
+// convert a property when it's read rather than all of them up front
+enum { LazyMapSize = 64 };
+
+struct LazyMap
+{
+    Value map;
+    v8::Persistent<v8::Object> handle;
+};
+
+template <typename T>
+static inline LazyMap *lazyMap(const v8::PropertyCallbackInfo<T>& info)
+{
+    return static_cast<LazyMap*>(v8::Handle<v8::External>::Cast(info.Holder()->GetInternalField(0))->Value());
+}
+
+static void LazyMapGetter(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info)
+{
+    const Value &map = lazyMap(info)->map;
+    const String key = toString(property);
+    if (map.contains(key))
+        info.GetReturnValue().Set(toV8(info.GetIsolate(), map[key]));
+}
+
+static void LazyMapSetter(v8::Local<v8::String> property, v8::Local<v8::Value> value,
+                          const v8::PropertyCallbackInfo<v8::Value>& info)
+{
+    // the map is the script's own copy
+    lazyMap(info)->map[toString(property)] = fromV8(info.GetIsolate(), value);
+    info.GetReturnValue().Set(value);
+}
+
+static void LazyMapQuery(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Integer>& info)
+{
+    if (lazyMap(info)->map.contains(toString(property)))
+        info.GetReturnValue().Set(v8::Integer::New(info.GetIsolate(), v8::None));
+}
+
+static void LazyMapEnumerator(const v8::PropertyCallbackInfo<v8::Array>& info)
+{
+    v8::Isolate *iso = info.GetIsolate();
+    const Value &map = lazyMap(info)->map;
+    v8::Local<v8::Array> keys = v8::Array::New(iso, map.count());
+    int idx = 0;
+    const auto end = map.end();
+    for (auto it = map.begin(); it != end; ++it)
+        keys->Set(idx++, v8::String::NewFromUtf8(iso, it->first.constData(), v8::String::kNormalString, it->first.size()));
+    info.GetReturnValue().Set(keys);
+}
+
+static void LazyMapWeak(const v8::WeakCallbackData<v8::Object, LazyMap>& data)
+{
+    LazyMap *map = data.GetParameter();
+    map->handle.Reset();
+    delete map;
+}
+
+static inline v8::Local<v8::Object> lazyMapToV8(v8::Isolate *isolate, const Value &value)
+{
+    ScriptEnginePrivate *engine = ScriptEnginePrivate::get(ScriptEngine::instance());
+    assert(engine->isolate == isolate);
+    if (engine->lazyMapTemplate.IsEmpty()) {
+        v8::Handle<v8::ObjectTemplate> templ = v8::ObjectTemplate::New(isolate);
+        templ->SetInternalFieldCount(1);
+        templ->SetNamedPropertyHandler(LazyMapGetter, LazyMapSetter, LazyMapQuery, 0, LazyMapEnumerator);
+        engine->lazyMapTemplate.Reset(isolate, templ);
+    }
+    v8::Local<v8::ObjectTemplate> templ = v8::Local<v8::ObjectTemplate>::New(isolate, engine->lazyMapTemplate);
+    v8::Local<v8::Object> object = templ->NewInstance();
+    LazyMap *map = new LazyMap;
+    map->map = value;
+    map->handle.Reset(isolate, object);
+    map->handle.SetWeak(map, LazyMapWeak);
+    object->SetInternalField(0, v8::External::New(isolate, map));
+    object->SetHiddenValue(v8::String::NewFromUtf8(isolate, "rct"), v8::Int32::New(isolate, CustomType_LazyMap));
+    return object;
+}
+
 class ObjectPrivate
 {
 public:
@@ -325,16 +557,50 @@ void ObjectPrivate::initProperty(const String& name, PropertyData& data, unsigne
     }
 }
 
-ScriptEngine *ScriptEngine::sInstance = 0;
+// sadly GCC < 4.8 doesn't support thread_local
+static pthread_key_t currentEngineKey;
+static std::once_flag currentEngineOnce;
+
+static inline void setCurrentEngine(ScriptEngine *engine)
+{
+    std::call_once(currentEngineOnce, []() { pthread_key_create(&currentEngineKey, 0); });
+    pthread_setspecific(currentEngineKey, engine);
+}
+
+ScriptEngine *ScriptEngine::instance()
+{
+    std::call_once(currentEngineOnce, []() { pthread_key_create(&currentEngineKey, 0); });
+    return static_cast<ScriptEngine*>(pthread_getspecific(currentEngineKey));
+}
+
 ScriptEngine::ScriptEngine()
-    : mPrivate(new ScriptEnginePrivate)
+    : mPrivate(new ScriptEnginePrivate), mPool(0)
 {
-    assert(!sInstance);
-    sInstance = this;
+    if (!instance())
+        setCurrentEngine(this);
+    init();
+}
 
+ScriptEngine::ScriptEngine(ScriptEnginePool *pool)
+    : mPrivate(new ScriptEnginePrivate), mPool(pool)
+{
+    init();
+}
+
+void ScriptEngine::init()
+{
+    static std::once_flag allocatorOnce;
+    std::call_once(allocatorOnce, []() {
+            static ArrayBufferAllocator allocator;
+            v8::V8::SetArrayBufferAllocator(&allocator);
+        });
     v8::V8::Initialize();
 
     mPrivate->isolate = v8::Isolate::New();
+    // once an isolate has been locked it has to be every time it's used
+    std::unique_ptr<v8::Locker> locker;
+    if (mPool)
+        locker.reset(new v8::Locker(mPrivate->isolate));
     const v8::Isolate::Scope isolateScope(mPrivate->isolate);
     v8::HandleScope handleScope(mPrivate->isolate);
     v8::Handle<v8::ObjectTemplate> globalObjectTemplate = v8::ObjectTemplate::New();
@@ -355,8 +621,25 @@ ScriptEngine::ScriptEngine()
 
 ScriptEngine::~ScriptEngine()
 {
-    assert(sInstance == this);
-    sInstance = 0;
+    if (!mPrivate->compiledCode.isEmpty())
+        saveCodeCache();
+    if (instance() == this)
+        setCurrentEngine(0);
+}
+
+ScriptEngine::Scope::Scope(ScriptEngine *engine)
+    : mPrevious(instance())
+{
+    assert(engine);
+    if (engine->mPool)
+        mLocker.reset(new v8::Locker(engine->mPrivate->isolate));
+    setCurrentEngine(engine);
+}
+
+ScriptEngine::Scope::~Scope()
+{
+    setCurrentEngine(mPrevious);
+    mLocker.reset();
 }
 
 static inline bool catchError(v8::TryCatch &tryCatch, const char *header, String *error)
@@ -380,13 +663,12 @@ static inline v8::Handle<v8::Value> findFunction(v8::Isolate* isolate, const v8:
 {
     // find the function object
     v8::Handle<v8::Value> val = ctx->Global();
-    List<String> list = function.split('.');
-    for (const String& f : list) {
+    for (const StringView &f : StringView(function).split('.')) {
         if (val.IsEmpty() || !val->IsObject())
             return v8::Handle<v8::Value>();
         if (that)
             *that = val;
-        val = v8::Handle<v8::Object>::Cast(val)->Get(v8::String::NewFromUtf8(isolate, f.constData()));
+        val = v8::Handle<v8::Object>::Cast(val)->Get(v8::String::NewFromUtf8(isolate, f.data(), v8::String::kNormalString, f.size()));
     }
     return val;
 }
@@ -445,6 +727,51 @@ Value ScriptEngine::call(const String &function, std::initializer_list<Value> ar
     return fromV8(mPrivate->isolate, val);
 }
 
+// bump when the way entries are stored changes
+enum { CodeCacheVersion = 1 };
+static const char *codeCacheVersionSection = "version";
+
+static inline String codeCacheKey(const String &source, const Path &path)
+{
+    FastHash128 hash;
+    hash.update(path);
+    hash.update("", 1);
+    hash.update(source);
+    return hash.hash().toHex();
+}
+
+static v8::Handle<v8::Script> compile(ScriptEnginePrivate *engine, const String &source, const Path &path,
+                                      v8::Handle<v8::String> src, v8::Handle<v8::String> fn)
+{
+    if (engine->codeCachePath.isEmpty())
+        return v8::Script::Compile(src, fn);
+
+    const String key = codeCacheKey(source, path);
+    const v8::ScriptOrigin origin(fn);
+    String code = engine->compiledCode.value(key);
+    if (code.isEmpty() && engine->codeCache && engine->codeCache->seek(key))
+        *engine->codeCache >> code;
+    if (!code.isEmpty()) {
+        v8::ScriptCompiler::Source cached(src, origin,
+                                          new v8::ScriptCompiler::CachedData(reinterpret_cast<const uint8_t *>(code.constData()),
+                                                                             code.size()));
+        v8::Handle<v8::Script> script = v8::ScriptCompiler::Compile(engine->isolate, &cached, v8::ScriptCompiler::kConsumeCodeCache);
+        const v8::ScriptCompiler::CachedData *data = cached.GetCachedData();
+        if (script.IsEmpty() || !data || !data->rejected)
+            return script;
+        // V8 compiled it from source since the code is stale, from another
+        // build of V8 or for other flags. Compiled again below so the entry
+        // is replaced rather than rejected every time.
+    }
+
+    v8::ScriptCompiler::Source uncached(src, origin);
+    v8::Handle<v8::Script> script = v8::ScriptCompiler::Compile(engine->isolate, &uncached, v8::ScriptCompiler::kProduceCodeCache);
+    const v8::ScriptCompiler::CachedData *data = uncached.GetCachedData();
+    if (!script.IsEmpty() && data && data->length > 0)
+        engine->compiledCode[key] = String(reinterpret_cast<const char *>(data->data), data->length);
+    return script;
+}
+
 Value ScriptEngine::evaluate(const String &source, const Path &path, String *error)
 {
     const v8::Isolate::Scope isolateScope(mPrivate->isolate);
@@ -455,7 +782,7 @@ Value ScriptEngine::evaluate(const String &source, const Path &path, String *err
     v8::Handle<v8::String> fn = v8::String::NewFromUtf8(mPrivate->isolate, path.constData());
 
     v8::TryCatch tryCatch;
-    v8::Handle<v8::Script> script = v8::Script::Compile(src, fn);
+    v8::Handle<v8::Script> script = compile(mPrivate, source, path, src, fn);
     if (catchError(tryCatch, "Compile error", error) || script.IsEmpty())
         return Value();
     v8::Handle<v8::Value> val = script->Run();
@@ -464,6 +791,69 @@ Value ScriptEngine::evaluate(const String &source, const Path &path, String *err
     return fromV8(mPrivate->isolate, val);
 }
 
+bool ScriptEngine::setCodeCache(const Path &path)
+{
+    if (!mPrivate->compiledCode.isEmpty())
+        saveCodeCache();
+    mPrivate->codeCachePath = path;
+    mPrivate->codeCache.reset();
+    mPrivate->compiledCode.clear();
+    if (path.isEmpty())
+        return true;
+
+    std::unique_ptr<DataFile> file(new DataFile(path, CodeCacheVersion, DataFile::Indexed));
+    if (!file->open(DataFile::Read))
+        return !path.exists();
+    String version;
+    if (!file->seek(codeCacheVersionSection))
+        return false;
+    *file >> version;
+    if (version != v8::V8::GetVersion())
+        return false;
+    mPrivate->codeCache = std::move(file);
+    return true;
+}
+
+bool ScriptEngine::saveCodeCache()
+{
+    if (mPrivate->codeCachePath.isEmpty())
+        return false;
+    if (mPrivate->compiledCode.isEmpty())
+        return true;
+
+    DataFile file(mPrivate->codeCachePath, CodeCacheVersion, DataFile::Indexed);
+    if (!file.open(DataFile::Write)) {
+        error() << "Can't open code cache" << mPrivate->codeCachePath << file.error();
+        return false;
+    }
+    file.beginSection(codeCacheVersionSection);
+    file << String(v8::V8::GetVersion());
+    if (DataFile *old = mPrivate->codeCache.get()) {
+        for (const String &name : old->sections()) {
+            String code;
+            if (name == codeCacheVersionSection || mPrivate->compiledCode.contains(name) || !old->seek(name))
+                continue;
+            *old >> code;
+            file.beginSection(name);
+            file << code;
+        }
+    }
+    for (const auto &code : mPrivate->compiledCode) {
+        file.beginSection(code.first);
+        file << code.second;
+    }
+    if (!file.flush()) {
+        error() << "Can't write code cache" << mPrivate->codeCachePath << file.error();
+        return false;
+    }
+    // the new file has all of it
+    mPrivate->compiledCode.clear();
+    mPrivate->codeCache.reset(new DataFile(mPrivate->codeCachePath, CodeCacheVersion, DataFile::Indexed));
+    if (!mPrivate->codeCache->open(DataFile::Read))
+        mPrivate->codeCache.reset();
+    return true;
+}
+
 void ScriptEngine::throwExceptionInternal(const Value& exception)
 {
     v8::Isolate* iso = mPrivate->isolate;
@@ -624,18 +1014,49 @@ Value ScriptEngine::fromObject(const Object::SharedPtr& object)
 
 ScriptEngine::Object::SharedPtr ScriptEngine::toObject(const Value &value) const
 {
-    const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(value.toCustom());
-    if (!custom || custom->object.IsEmpty()) {
+    const std::shared_ptr<Value::Custom> base = value.toCustom();
+    if (!base || base->type == CustomType_ArrayBuffer)
+        return ScriptEngine::Object::SharedPtr();
+    const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(base);
+    if (custom->object.IsEmpty()) {
         return ScriptEngine::Object::SharedPtr();
     }
     return custom->scriptObject;
 }
 
+Value ScriptEngine::fromBuffer(Buffer &&buffer)
+{
+    const size_t size = buffer.size();
+    return Value(std::make_shared<ArrayBufferCustom>(std::make_shared<ArrayBufferData>(std::move(buffer)), 0, size));
+}
+
+bool ScriptEngine::isBuffer(const Value &value) const
+{
+    const std::shared_ptr<Value::Custom> custom = value.toCustom();
+    return custom && custom->type == CustomType_ArrayBuffer;
+}
+
+bool ScriptEngine::toBuffer(const Value &value, unsigned char **data, size_t *size) const
+{
+    const std::shared_ptr<Value::Custom> custom = value.toCustom();
+    if (!custom || custom->type != CustomType_ArrayBuffer)
+        return false;
+    const ArrayBufferCustom &buffer = static_cast<const ArrayBufferCustom &>(*custom);
+    *data = buffer.data->data + buffer.offset;
+    *size = buffer.length;
+    return true;
+}
+
 static String toString(v8::Handle<v8::Value> value)
 {
     if (value->IsString()) {
-        v8::String::Utf8Value strValue(value);
-        return String(*strValue);
+        // straight into the String rather than through a Utf8Value
+        v8::Handle<v8::String> string = v8::Handle<v8::String>::Cast(value);
+        String ret;
+        ret.resize(string->Utf8Length());
+        if (!ret.isEmpty())
+            string->WriteUtf8(ret.data(), ret.size(), 0, v8::String::NO_NULL_TERMINATION);
+        return ret;
     }
     return String();
 }
@@ -644,6 +1065,8 @@ static Value fromV8(v8::Isolate *isolate, v8::Handle<v8::Value> value)
 {
     if (value->IsString()) {
         return toString(value);
+    } else if (value->IsArrayBuffer() || value->IsArrayBufferView()) {
+        return arrayBufferFromV8(isolate, value);
     } else if (value->IsArray()) {
         v8::Handle<v8::Array> array = v8::Handle<v8::Array>::Cast(value);
         List<Value> result(array->Length());
@@ -653,7 +1076,9 @@ static Value fromV8(v8::Isolate *isolate, v8::Handle<v8::Value> value)
     } else if (value->IsObject()) {
         v8::Handle<v8::Object> object = v8::Handle<v8::Object>::Cast(value);
         v8::Handle<v8::Value> rct = object->GetHiddenValue(v8::String::NewFromUtf8(isolate, "rct"));
-        if (!rct.IsEmpty() && rct->IsInt32()) {
+        if (!rct.IsEmpty() && rct->IsInt32() && rct->Int32Value() == CustomType_LazyMap) {
+            return static_cast<LazyMap*>(v8::Handle<v8::External>::Cast(object->GetInternalField(0))->Value())->map;
+        } else if (!rct.IsEmpty() && rct->IsInt32()) {
             return Value(std::make_shared<ScriptEngineCustom>(rct->ToInt32()->Value(), isolate,
                                                               object, objectFromV8Object(object)));
         } else if (object->IsFunction()) {
@@ -685,9 +1110,14 @@ static inline v8::Local<v8::Value> toV8_helper(v8::Isolate* isolate, const Value
 {
     v8::Local<v8::Value> result;
     switch (value.type()) {
-    case Value::Type_String:
-        result = v8::String::NewFromUtf8(isolate, value.toString().constData());
-        break;
+    case Value::Type_String: {
+        const std::shared_ptr<const String> string = value.toSharedString();
+        if (string->size() >= ExternalStringSize && isAscii(*string)) {
+            result = v8::String::NewExternal(isolate, new ExternalString(string));
+        } else {
+            result = v8::String::NewFromUtf8(isolate, string->constData(), v8::String::kNormalString, string->size());
+        }
+        break; }
     case Value::Type_List: {
         const int sz = value.count();
         v8::Handle<v8::Array> array = v8::Array::New(isolate, sz);
@@ -699,6 +1129,10 @@ static inline v8::Local<v8::Value> toV8_helper(v8::Isolate* isolate, const Value
         result = array;
         break; }
     case Value::Type_Map: {
+        if (value.count() >= LazyMapSize) {
+            result = lazyMapToV8(isolate, value);
+            break;
+        }
         v8::Handle<v8::Object> object = v8::Object::New(isolate);
         const auto end = value.end();
         for (auto it = value.begin(); it != end; ++it)
@@ -706,7 +1140,12 @@ static inline v8::Local<v8::Value> toV8_helper(v8::Isolate* isolate, const Value
         result = object;
         break; }
     case Value::Type_Custom: {
-        const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(value.toCustom());
+        const std::shared_ptr<Value::Custom> base = value.toCustom();
+        if (base && base->type == CustomType_ArrayBuffer) {
+            result = arrayBufferToV8(isolate, static_cast<const ArrayBufferCustom &>(*base));
+            break;
+        }
+        const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(base);
         if (!custom || custom->object.IsEmpty()) {
             result = v8::Undefined(isolate);
         } else {
@@ -4,14 +4,20 @@
 #include "rct-config.h"
 
 #ifdef HAVE_SCRIPTENGINE
+#include <rct/Buffer.h>
 #include <rct/Log.h>
 #include <rct/String.h>
 #include <rct/Value.h>
 #include <rct/Hash.h>
 #include <memory>
 
+namespace v8 {
+class Locker;
+}
+
 class ObjectPrivate;
 class ClassPrivate;
+class ScriptEnginePool;
 struct ScriptEnginePrivate;
 class ScriptEngine
 {
@@ -19,9 +25,35 @@ public:
     ScriptEngine();
     ~ScriptEngine();
 
-    static ScriptEngine *instance() { return sInstance; }
+    // The calling thread's engine, the first one it created or the one of
+    // the Scope it's in
+    static ScriptEngine *instance();
+
+    // Makes engine the calling thread's instance() until it goes out of
+    // scope and, for engines of a ScriptEnginePool, holds the lock of its
+    // isolate. Those can be used from any thread, but only inside a Scope.
+    class Scope
+    {
+    public:
+        Scope(ScriptEngine *engine);
+        ~Scope();
+    private:
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ScriptEngine *mPrevious;
+        std::unique_ptr<v8::Locker> mLocker;
+    };
 
     Value evaluate(const String &source, const Path &path = String(), String *error = 0);
+
+    // Keeps the code V8 compiles for the scripts evaluate() runs in an
+    // Indexed DataFile at path. A script that's evaluated again, by this
+    // engine or one in a later process, is loaded from there rather than
+    // compiled. What's new is written by saveCodeCache() and on
+    // destruction. A cache from another version of V8 is ignored.
+    bool setCodeCache(const Path &path);
+    bool saveCodeCache();
     Value call(const String &function, String *error = 0);
     Value call(const String &function, std::initializer_list<Value> arguments, String *error = 0);
 
@@ -160,17 +192,34 @@ public:
         friend class ObjectPrivate;
     };
 
+    // A Buffer goes to scripts as an ArrayBuffer on its memory and the
+    // ArrayBuffers and typed arrays they return come back on theirs, the
+    // memory lives as long as a script or a Value holds on to it. Long
+    // ASCII strings aren't copied either, and big maps are converted a
+    // property at a time as scripts read them.
+    Value fromBuffer(Buffer &&buffer);
+    bool isBuffer(const Value &value) const;
+    // Valid for as long as value is
+    bool toBuffer(const Value &value, unsigned char **data, size_t *size) const;
+
     Value fromObject(const Object::SharedPtr& object);
     Object::SharedPtr toObject(const Value &value) const;
     bool isFunction(const Value &value) const;
     Object::SharedPtr globalObject() const { return mGlobalObject; }
 private:
+    // A pooled engine, it never becomes a thread's instance() by itself
+    ScriptEngine(ScriptEnginePool *pool);
+    ScriptEngine(const ScriptEngine&) = delete;
+    ScriptEngine& operator=(const ScriptEngine&) = delete;
+
+    void init();
     void throwExceptionInternal(const Value &exception);
-    static ScriptEngine *sInstance;
     ScriptEnginePrivate *mPrivate;
     Object::SharedPtr mGlobalObject;
+    ScriptEnginePool *mPool;
 
     friend struct ScriptEnginePrivate;
+    friend class ScriptEnginePool;
 };
 
 template<typename T>
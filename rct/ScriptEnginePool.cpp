@@ -0,0 +1,58 @@
+#include "ScriptEnginePool.h"
+
+#ifdef HAVE_SCRIPTENGINE
+
+ScriptEnginePool::ScriptEnginePool(int count, const Setup &setup, ThreadPool *pool)
+    : mThreadPool(pool ? pool : ThreadPool::instance())
+{
+    if (count <= 0)
+        count = ThreadPool::idealThreadCount();
+    mEngines.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        ScriptEngine *engine = new ScriptEngine(this);
+        if (setup) {
+            const ScriptEngine::Scope scope(engine);
+            setup(engine);
+        }
+        mEngines.append(engine);
+    }
+    mIdle = mEngines;
+}
+
+ScriptEnginePool::~ScriptEnginePool()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCondition.wait(lock, [this]() { return mIdle.size() == mEngines.size(); });
+    for (ScriptEngine *engine : mEngines) {
+        const ScriptEngine::Scope scope(engine);
+        delete engine;
+    }
+}
+
+ScriptEngine *ScriptEnginePool::acquire()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCondition.wait(lock, [this]() { return !mIdle.isEmpty(); });
+    return mIdle.takeLast();
+}
+
+void ScriptEnginePool::release(ScriptEngine *engine)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mIdle.append(engine);
+    }
+    // the destructor waits for all of them
+    mCondition.notify_all();
+}
+
+std::future<ScriptEnginePool::Result> ScriptEnginePool::evaluate(const String &source, const Path &path, int priority)
+{
+    return run([source, path](ScriptEngine *engine) -> Result {
+            Result result;
+            result.value = engine->evaluate(source, path, &result.error);
+            return result;
+        }, priority);
+}
+
+#endif
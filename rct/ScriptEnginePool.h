@@ -0,0 +1,80 @@
+#ifndef ScriptEnginePool_h
+#define ScriptEnginePool_h
+
+#include "rct-config.h"
+
+#ifdef HAVE_SCRIPTENGINE
+#include <rct/List.h>
+#include <rct/ScriptEngine.h>
+#include <rct/ThreadPool.h>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <type_traits>
+
+// A number of ScriptEngines with their own isolates that run scripts on
+// the threads of a ThreadPool. setup is called for every engine, inside
+// its Scope, so the Classes and functions it registers are the same in
+// all of them.
+//
+// A job takes whichever engine is free and waits on its thread when none
+// is. Scripts don't share state with each other, or with the engine that
+// may be the instance() of the thread that made the pool, and what they
+// return has to be a plain Value, not an Object of the engine.
+class ScriptEnginePool
+{
+public:
+    typedef std::function<void(ScriptEngine *engine)> Setup;
+
+    // count 0 is one engine per cpu, pool 0 is ThreadPool::instance()
+    ScriptEnginePool(int count, const Setup &setup, ThreadPool *pool = 0);
+    // Waits for the jobs that are running
+    ~ScriptEnginePool();
+
+    int count() const { return mEngines.size(); }
+
+    struct Result
+    {
+        Value value;
+        String error;
+    };
+    std::future<Result> evaluate(const String &source, const Path &path = Path(), int priority = 0);
+
+    // Runs func(engine) on the ThreadPool, in the engine's Scope
+    template <typename Func>
+    std::future<typename std::result_of<Func(ScriptEngine*)>::type> run(Func&& func, int priority = 0)
+    {
+        typedef typename std::result_of<Func(ScriptEngine*)>::type ReturnType;
+        typename std::decay<Func>::type fn(std::forward<Func>(func));
+        return mThreadPool->submit([this, fn]() mutable -> ReturnType {
+                const Lease lease(this);
+                const ScriptEngine::Scope scope(lease.engine);
+                return fn(lease.engine);
+            }, priority);
+    }
+
+private:
+    ScriptEnginePool(const ScriptEnginePool&) = delete;
+    ScriptEnginePool& operator=(const ScriptEnginePool&) = delete;
+
+    ScriptEngine *acquire();
+    void release(ScriptEngine *engine);
+
+    struct Lease
+    {
+        Lease(ScriptEnginePool *p) : pool(p), engine(p->acquire()) {}
+        ~Lease() { pool->release(engine); }
+
+        ScriptEnginePool *pool;
+        ScriptEngine *engine;
+    };
+
+    ThreadPool *mThreadPool;
+    List<ScriptEngine*> mEngines, mIdle;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+};
+
+#endif // HAVE_SCRIPTENGINE
+#endif // ScriptEnginePool_h
@@ -0,0 +1,79 @@
+#ifndef SeqLock_h
+#define SeqLock_h
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string.h>
+
+// Writer side of a SeqLock, what WriteLocker takes
+class SeqLockBase
+{
+public:
+    SeqLockBase() : mSequence(0) {}
+
+    bool lockForWrite(int maxTime = 0)
+    {
+        if (maxTime > 0) {
+            if (!mMutex.try_lock_for(std::chrono::milliseconds(maxTime)))
+                return false;
+        } else {
+            mMutex.lock();
+        }
+        // odd while a write is in progress
+        mSequence.store(mSequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+    void unlock()
+    {
+        mSequence.store(mSequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        mMutex.unlock();
+    }
+
+protected:
+    std::atomic<unsigned int> mSequence;
+
+private:
+    std::timed_mutex mMutex;
+};
+
+// Holds a small POD that's read without taking any lock. A reader copies
+// the value and tries again if a write happened while it was copying, so
+// readers never block writers or each other. T must be trivially copyable.
+template <typename T>
+class SeqLock : public SeqLockBase
+{
+public:
+    SeqLock() { memset(&mValue, 0, sizeof(T)); }
+    SeqLock(const T& value) { memcpy(&mValue, &value, sizeof(T)); }
+
+    T load() const
+    {
+        T ret;
+        for (;;) {
+            const unsigned int before = mSequence.load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+            memcpy(&ret, &mValue, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (mSequence.load(std::memory_order_relaxed) == before)
+                return ret;
+        }
+    }
+
+    void store(const T& value)
+    {
+        lockForWrite();
+        memcpy(&mValue, &value, sizeof(T));
+        unlock();
+    }
+
+    // only while locked for writing, e.g. through WriteLocker
+    T& value() { return mValue; }
+
+private:
+    T mValue;
+};
+
+#endif
@@ -3,15 +3,28 @@
 
 // #define RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
 #include <rct/String.h>
+#include <rct/Arena.h>
+#include <rct/Atom.h>
 #include <rct/List.h>
 #include <rct/Log.h>
 #include <rct/Map.h>
+#include <rct/FlatHash.h>
+#include <rct/FlatHashSet.h>
+#include <rct/FlatMap.h>
+#include <rct/FlatSet.h>
 #include <rct/Hash.h>
 #include <rct/Path.h>
 #include <rct/Set.h>
 #include <rct/Rct.h>
+#include <rct/StringView.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <list>
+#include <memory>
+#include <type_traits>
 
 class Serializer
 {
@@ -24,22 +37,46 @@ public:
         virtual int pos() const = 0;
     };
 
-    Serializer(std::unique_ptr<Buffer> &&buffer)
-        : mError(false), mBuffer(std::move(buffer))
-    {}
+    // With bufferSize, what's written is gathered in memory and handed to
+    // buffer bufferSize bytes at a time, call flush() before looking at
+    // what buffer has. The destructor flushes.
+    Serializer(std::unique_ptr<Buffer> &&buffer, int bufferSize = 0)
+        : mError(false), mFlags(None), mString(0), mBuffer(std::move(buffer))
+    {
+        initStage(bufferSize);
+    }
 
     Serializer(std::string &out)
-        : mError(false), mBuffer(new StringBuffer(out))
-    {}
+        : mError(false), mFlags(None), mString(&out)
+    {
+        initStage(0);
+    }
 
     Serializer(String &out)
-        : mError(false), mBuffer(new StringBuffer(out))
-    {}
+        : mError(false), mFlags(None), mString(&out.ref())
+    {
+        initStage(0);
+    }
 
     Serializer(FILE *f)
-        : mError(false), mBuffer(new FileBuffer(f))
+        : mError(false), mFlags(None), mString(0), mBuffer(new FileBuffer(f))
     {
         assert(f);
+        initStage(0);
+    }
+
+    // Writes to fd from the current offset, bufferSize bytes at a time
+    enum { DefaultBufferSize = 64 * 1024 };
+    Serializer(int fd, int bufferSize = DefaultBufferSize)
+        : mError(false), mFlags(None), mString(0), mBuffer(new FdBuffer(fd))
+    {
+        assert(fd != -1);
+        initStage(bufferSize);
+    }
+
+    ~Serializer()
+    {
+        flush();
     }
 
     bool write(const String &string)
@@ -52,19 +89,104 @@ public:
         assert(len > 0);
         if (mError)
             return false;
-        if (!mBuffer->write(data, len)) {
-            mError = true;
-            return false;
+        if (mString) {
+            mString->append(static_cast<const char*>(data), len);
+            return true;
         }
-        return true;
+        if (len <= mStageEnd - mStageCursor) {
+            memcpy(mStageCursor, data, len);
+            mStageCursor += len;
+            return true;
+        }
+        return writeBuffer(data, len);
+    }
+
+    // Hands what's gathered to the buffer
+    bool flush()
+    {
+        if (mStageCursor == mStage.get())
+            return !mError;
+        const int len = mStageCursor - mStage.get();
+        mStageCursor = mStage.get();
+        if (!mError && !mBuffer->write(mStage.get(), len))
+            mError = true;
+        return !mError;
     }
 
     int pos() const
     {
-        return mBuffer->pos();
+        if (mString)
+            return mString->size();
+        return mBuffer->pos() + (mStageCursor - mStage.get());
     }
 
     bool hasError() const { return mError; }
+
+    enum Flag {
+        None = 0x0,
+        // Integers wider than a byte, which includes every size and length,
+        // are written as LEB128 varints, signed ones zigzagged first
+        Compact = 0x1,
+        // Paths are written as the index of their directory in a table
+        // that's built as they're written, and their file name
+        InternPaths = 0x2
+    };
+    // A Deserializer must be given the same flags. Starts a new
+    // InternPaths table.
+    void setFlags(unsigned int flags)
+    {
+        mFlags = flags;
+        mDirectories.reset();
+    }
+    unsigned int flags() const { return mFlags; }
+    bool isCompact() const { return mFlags & Compact; }
+
+    bool writeVarint(uint64_t value)
+    {
+        unsigned char buf[10];
+        int len = 0;
+        while (value >= 0x80) {
+            buf[len++] = static_cast<unsigned char>(value) | 0x80;
+            value >>= 7;
+        }
+        buf[len++] = static_cast<unsigned char>(value);
+        return write(buf, len);
+    }
+
+    // Returns the index of dir in the InternPaths table and adds it if it
+    // isn't there, in which case isNew is set
+    uint32_t internDirectory(const String &dir, bool &isNew)
+    {
+        if (!mDirectories)
+            mDirectories.reset(new Hash<String, uint32_t>);
+        uint32_t &index = (*mDirectories)[dir];
+        isNew = !index;
+        if (isNew)
+            index = mDirectories->size();
+        // 1 based so 0 is a new one
+        return index - 1;
+    }
+
+    // Exact number of bytes operator<< produces for t, see EncodedSize
+    template <typename T> static size_t encodedSize(const T &t);
+
+    // Counts what is written without storing it
+    class SizeBuffer : public Buffer
+    {
+    public:
+        SizeBuffer()
+            : mSize(0)
+        {}
+
+        virtual bool write(const void *, int len) override
+        {
+            mSize += len;
+            return true;
+        }
+        virtual int pos() const override { return mSize; }
+    private:
+        int mSize;
+    };
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     template <typename T>
     bool encodeType()
@@ -78,25 +200,62 @@ public:
     template <typename T> bool encodeType() { return true; }
 #endif
 private:
-    class StringBuffer : public Buffer
+    class FdBuffer : public Buffer
     {
     public:
-        StringBuffer(std::string &out)
-            : mString(&out)
-        {}
-        StringBuffer(String &out)
-            : mString(&out.ref())
-        {}
+        FdBuffer(int fd)
+            : mFd(fd), mPos(lseek(fd, 0, SEEK_CUR))
+        {
+            if (mPos < 0)
+                mPos = 0;
+        }
 
         virtual bool write(const void *data, int len) override
         {
-            mString->append(static_cast<const char*>(data), len);
+            const char *bytes = static_cast<const char*>(data);
+            while (len > 0) {
+                ssize_t w;
+                eintrwrap(w, ::write(mFd, bytes, len));
+                if (w <= 0)
+                    return false;
+                bytes += w;
+                len -= w;
+                mPos += w;
+            }
             return true;
         }
-        virtual int pos() const override { return mString->size(); }
+
+        virtual int pos() const override { return static_cast<int>(mPos); }
     private:
-        std::string *mString;
+        const int mFd;
+        off_t mPos;
     };
+
+    void initStage(int size)
+    {
+        if (size > 0)
+            mStage.reset(new char[size]);
+        mStageCursor = mStage.get();
+        mStageEnd = mStageCursor + size;
+    }
+
+    bool writeBuffer(const void *data, int len)
+    {
+        if (!flush())
+            return false;
+        if (len < mStageEnd - mStage.get()) {
+            memcpy(mStageCursor, data, len);
+            mStageCursor += len;
+            return true;
+        }
+        // too big to be worth gathering
+        if (!mBuffer->write(data, len)) {
+            mError = true;
+            return false;
+        }
+        return true;
+    }
+
     class FileBuffer : public Buffer
     {
     public:
@@ -122,26 +281,43 @@ private:
     };
 
     bool mError;
+    unsigned int mFlags;
+    std::unique_ptr<Hash<String, uint32_t> > mDirectories;
+    // written to directly, without a Buffer
+    std::string *mString;
     std::unique_ptr<Buffer> mBuffer;
+    std::unique_ptr<char[]> mStage;
+    char *mStageCursor, *mStageEnd;
 };
 
 class Deserializer
 {
 public:
     Deserializer(const char *data, int length, const char *key = "")
-        : mData(data), mLength(length), mPos(0), mFile(0), mKey(key)
+        : mData(data), mLength(length), mPos(0), mFile(0), mFd(-1), mKey(key), mFlags(Serializer::None), mArena(0)
     {}
 
     Deserializer(const String &string, const char *key = "")
-        : mData(string.constData()), mLength(string.size()), mPos(0), mFile(0), mKey(key)
+        : mData(string.constData()), mLength(string.size()), mPos(0), mFile(0), mFd(-1), mKey(key), mFlags(Serializer::None), mArena(0)
     {}
 
     Deserializer(FILE *file, const char *key = "")
-        : mData(0), mLength(0), mFile(file), mKey(key)
+        : mData(0), mLength(0), mPos(0), mFile(file), mFd(-1), mKey(key), mFlags(Serializer::None), mArena(0)
     {
         assert(file);
     }
 
+    // Reads from fd's current offset, bufferSize bytes at a time
+    Deserializer(int fd, int bufferSize = Serializer::DefaultBufferSize, const char *key = "")
+        : mData(0), mLength(0), mPos(0), mFile(0), mFd(fd), mKey(key), mFlags(Serializer::None), mArena(0),
+          mFdBuffer(new char[std::max(bufferSize, 16)]), mFdCapacity(std::max(bufferSize, 16)),
+          mFdBufferPos(0), mFdBufferSize(0), mFdOffset(lseek(fd, 0, SEEK_CUR))
+    {
+        assert(fd != -1);
+        if (mFdOffset < 0)
+            mFdOffset = 0;
+    }
+
     int peek(char *target, int len)
     {
         if (len) {
@@ -149,6 +325,10 @@ public:
                 assert(mPos + len <= mLength);
                 memcpy(target, mData + mPos, len);
                 return len;
+            } else if (mFd != -1) {
+                const int available = fill(len);
+                memcpy(target, mFdBuffer.get() + mFdBufferPos, available);
+                return available;
             } else {
                 assert(mFile);
                 const int read = fread(target, sizeof(char), len, mFile);
@@ -175,6 +355,8 @@ public:
                 memcpy(target, mData + mPos, len);
                 mPos += len;
                 return len;
+            } else if (mFd != -1) {
+                return readFd(static_cast<char*>(target), len);
             } else {
                 assert(mFile);
                 return fread(target, sizeof(char), len, mFile);
@@ -183,10 +365,87 @@ public:
         return 0;
     }
 
-    bool atEnd() const { return mPos == mLength; }
+    // Returns len bytes of the source without copying them and moves past
+    // them. Memory backed deserializers hand out a pointer into their
+    // data, FILE backed ones read into storage the deserializer owns.
+    // Either way the pointer stays valid for as long as both the
+    // deserializer and the data it reads from, or the arena, see setArena().
+    const char *borrow(int len)
+    {
+        if (!len)
+            return "";
+        if (mData) {
+            assert(mPos + len <= mLength);
+            const char *ret = mData + mPos;
+            mPos += len;
+            return ret;
+        }
+        if (mArena) {
+            char *storage = static_cast<char *>(mArena->allocate(len, 1));
+            if (read(storage, len) != len)
+                memset(storage, 0, len);
+            return storage;
+        }
+        if (!mStorage)
+            mStorage.reset(new std::list<String>);
+        mStorage->push_back(String(len, '\0'));
+        String &storage = mStorage->back();
+        if (read(storage.data(), len) != len)
+            memset(storage.data(), 0, len);
+        return storage.constData();
+    }
+
+    bool atEnd() const { return mFd != -1 ? pos() == length() : mPos == mLength; }
+
+    // Arena containers that are decoded without an arena of their own get
+    // this one, and borrow() copies into it rather than into storage owned
+    // by the deserializer. The arena must outlive what's decoded.
+    void setArena(Arena *arena) { mArena = arena; }
+    Arena *arena() const { return mArena; }
 
-    int pos() const { return mFile ? ftell(mFile) : mPos; }
-    int length() const { return mFile ? Rct::fileSize(mFile) : mLength; }
+    // The Serializer flags the data was written with
+    void setFlags(unsigned int flags)
+    {
+        mFlags = flags;
+        mDirectories.clear();
+    }
+    unsigned int flags() const { return mFlags; }
+    bool isCompact() const { return mFlags & Serializer::Compact; }
+
+    uint64_t readVarint()
+    {
+        uint64_t ret = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char byte;
+            if (mData && mPos < mLength) {
+                byte = static_cast<unsigned char>(mData[mPos++]);
+            } else if (read(&byte, 1) != 1) {
+                break;
+            }
+            ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return ret;
+    }
+
+    // The table InternPaths builds, in the order it was written
+    List<String> &directories() { return mDirectories; }
+
+    int pos() const
+    {
+        if (mFd != -1)
+            return static_cast<int>(mFdOffset - (mFdBufferSize - mFdBufferPos));
+        return mFile ? ftell(mFile) : mPos;
+    }
+    int length() const
+    {
+        if (mFd != -1) {
+            struct stat st;
+            return fstat(mFd, &st) ? 0 : static_cast<int>(st.st_size);
+        }
+        return mFile ? Rct::fileSize(mFile) : mLength;
+    }
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     template <typename T>
     bool decodeType()
@@ -204,11 +463,68 @@ public:
     template <typename T> bool decodeType() { return true; }
 #endif
 private:
+    // Makes sure up to len bytes are buffered, returns how many are
+    int fill(int len)
+    {
+        if (mFdBufferSize - mFdBufferPos >= len)
+            return len;
+        if (mFdBufferPos) {
+            memmove(mFdBuffer.get(), mFdBuffer.get() + mFdBufferPos, mFdBufferSize - mFdBufferPos);
+            mFdBufferSize -= mFdBufferPos;
+            mFdBufferPos = 0;
+        }
+        const int wanted = std::min(len, mFdCapacity);
+        while (mFdBufferSize < wanted) {
+            ssize_t r;
+            eintrwrap(r, ::read(mFd, mFdBuffer.get() + mFdBufferSize, mFdCapacity - mFdBufferSize));
+            if (r <= 0)
+                break;
+            mFdBufferSize += r;
+            mFdOffset += r;
+        }
+        return std::min(len, mFdBufferSize);
+    }
+
+    int readFd(char *target, int len)
+    {
+        int ret = 0;
+        while (len > 0) {
+            const int available = mFdBufferSize - mFdBufferPos;
+            if (available) {
+                const int chunk = std::min(available, len);
+                memcpy(target + ret, mFdBuffer.get() + mFdBufferPos, chunk);
+                mFdBufferPos += chunk;
+                ret += chunk;
+                len -= chunk;
+            } else if (len >= mFdCapacity) {
+                // straight into target
+                ssize_t r;
+                eintrwrap(r, ::read(mFd, target + ret, len));
+                if (r <= 0)
+                    break;
+                mFdOffset += r;
+                ret += r;
+                len -= r;
+            } else if (!fill(len)) {
+                break;
+            }
+        }
+        return ret;
+    }
+
     const char *mData;
     const int mLength;
     int mPos;
     FILE *mFile;
+    int mFd;
     const char *mKey;
+    unsigned int mFlags;
+    Arena *mArena;
+    List<String> mDirectories;
+    std::unique_ptr<std::list<String> > mStorage;
+    std::unique_ptr<char[]> mFdBuffer;
+    int mFdCapacity, mFdBufferPos, mFdBufferSize;
+    off_t mFdOffset;
 };
 
 template <typename T>
@@ -230,14 +546,88 @@ struct FixedSize
 {
     static constexpr size_t value = 0;
 };
+
+// Integers that Compact writes as varints
+template <typename T>
+struct Varint
+{
+    static constexpr bool value = std::is_integral<T>::value && sizeof(T) > 1;
+
+    static uint64_t encode(T t)
+    {
+        if (std::is_signed<T>::value) {
+            const int64_t v = static_cast<int64_t>(t);
+            return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+        }
+        return static_cast<uint64_t>(t);
+    }
+
+    static T decode(uint64_t v)
+    {
+        if (std::is_signed<T>::value)
+            return static_cast<T>(static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1)));
+        return static_cast<T>(v);
+    }
+};
+
+// Element types whose arrays are written and read with a single memcpy,
+// the bytes of each element being its encoding. True for the native types
+// other than bool (a std::vector<bool> has no array) and for anything
+// declared with DECLARE_POD_TYPE.
+template <typename T>
+struct BulkCopy
+{
+    static constexpr bool value = false;
+};
+
+// EncodedSize<T>::size(t) is the number of bytes s << t writes without
+// Compact. It is computed directly for native types, strings and the
+// containers below, anything else is counted with a dry run through a
+// SizeBuffer.
+template <typename T>
+struct EncodedSize
+{
+    static size_t size(const T &t)
+    {
+        Serializer serializer(std::unique_ptr<Serializer::Buffer>(new Serializer::SizeBuffer));
+        serializer << t;
+        return serializer.pos();
+    }
+};
+
+template <typename T>
+inline size_t Serializer::encodedSize(const T &t)
+{
+    return EncodedSize<T>::size(t);
+}
+
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+// every element has its type byte
+#define RCT_SERIALIZER_BULK_NATIVE(T) false
+#else
+#define RCT_SERIALIZER_BULK_NATIVE(T) !std::is_same<T, bool>::value
+#endif
+
 #define DECLARE_NATIVE_TYPE(T)                                      \
     template <> struct FixedSize<T>                                 \
     {                                                               \
         static constexpr size_t value = sizeof(T);                  \
     };                                                              \
+    template <> struct BulkCopy<T>                                  \
+    {                                                               \
+        static constexpr bool value = RCT_SERIALIZER_BULK_NATIVE(T); \
+    };                                                              \
+    template <> struct EncodedSize<T>                               \
+    {                                                               \
+        static size_t size(const T &) { return Serializer::sizeOf<T>(); } \
+    };                                                              \
     template <> inline Serializer &operator<<(Serializer &s,        \
                                               const T &t)           \
     {                                                               \
+        if (Varint<T>::value && s.isCompact()) {                    \
+            s.writeVarint(Varint<T>::encode(t));                    \
+            return s;                                               \
+        }                                                           \
         s.encodeType<T>();                                          \
         union {                                                     \
             T orig;                                                 \
@@ -250,7 +640,9 @@ struct FixedSize
     template <> inline Deserializer &operator>>(Deserializer &s,    \
                                                 T &t)               \
     {                                                               \
-        if (s.decodeType<T>()) {                                    \
+        if (Varint<T>::value && s.isCompact()) {                    \
+            t = Varint<T>::decode(s.readVarint());                  \
+        } else if (s.decodeType<T>()) {                             \
             union {                                                 \
                 T value;                                            \
                 unsigned char buf[sizeof(T)];                       \
@@ -283,6 +675,195 @@ DECLARE_NATIVE_TYPE(time_t);
 DECLARE_NATIVE_TYPE(unsigned long long);
 #endif
 
+// Serializes T, a trivially copyable struct, as its memory. Lists, vectors
+// and Sets of it are then copied in one go. The encoding depends on the
+// layout and byte order of T so it's only for data that's read back by the
+// same build.
+#define DECLARE_POD_TYPE(T)                                         \
+    static_assert(std::is_trivially_copyable<T>::value,             \
+                  #T " isn't trivially copyable");                  \
+    template <> struct FixedSize<T>                                 \
+    {                                                               \
+        static constexpr size_t value = sizeof(T);                  \
+    };                                                              \
+    template <> struct BulkCopy<T>                                  \
+    {                                                               \
+        static constexpr bool value = true;                         \
+    };                                                              \
+    template <> struct EncodedSize<T>                               \
+    {                                                               \
+        static size_t size(const T &) { return sizeof(T); }         \
+    };                                                              \
+    template <> inline Serializer &operator<<(Serializer &s,        \
+                                              const T &t)           \
+    {                                                               \
+        s.write(&t, sizeof(T));                                     \
+        return s;                                                   \
+    }                                                               \
+    template <> inline Deserializer &operator>>(Deserializer &s,    \
+                                                T &t)               \
+    {                                                               \
+        s.read(&t, sizeof(T));                                      \
+        return s;                                                   \
+    }                                                               \
+    struct macrohack
+
+template <>
+struct EncodedSize<String>
+{
+    static size_t size(const String &string) { return Serializer::sizeOf<uint32_t>() + string.size(); }
+};
+
+template <>
+struct EncodedSize<Path>
+{
+    static size_t size(const Path &path) { return Serializer::sizeOf<uint32_t>() + path.size(); }
+};
+
+template <>
+struct EncodedSize<StringView>
+{
+    static size_t size(const StringView &string) { return Serializer::sizeOf<uint32_t>() + string.size(); }
+};
+
+template <>
+struct EncodedSize<Atom>
+{
+    static size_t size(const Atom &atom) { return Serializer::sizeOf<uint32_t>() + atom.size(); }
+};
+
+template <>
+struct EncodedSize<PathAtom>
+{
+    static size_t size(const PathAtom &path) { return Serializer::sizeOf<uint32_t>() + path.size(); }
+};
+
+template <typename First, typename Second>
+struct EncodedSize<std::pair<First, Second> >
+{
+    static size_t size(const std::pair<First, Second> &pair)
+    {
+        return EncodedSize<First>::size(pair.first) + EncodedSize<Second>::size(pair.second);
+    }
+};
+
+// Elements of a fixed size type aren't visited
+template <typename Container, typename T>
+inline size_t encodedContainerSize(const Container &container)
+{
+    size_t ret = Serializer::sizeOf<uint32_t>();
+    if (FixedSize<T>::value) {
+        ret += container.size() * EncodedSize<T>::size(T());
+    } else {
+        for (typename Container::const_iterator it = container.begin(); it != container.end(); ++it)
+            ret += EncodedSize<T>::size(*it);
+    }
+    return ret;
+}
+
+template <typename Container, typename Key, typename Value>
+inline size_t encodedMapSize(const Container &map)
+{
+    size_t ret = Serializer::sizeOf<uint32_t>();
+    if (FixedSize<Key>::value && FixedSize<Value>::value) {
+        ret += map.size() * (EncodedSize<Key>::size(Key()) + EncodedSize<Value>::size(Value()));
+    } else {
+        for (typename Container::const_iterator it = map.begin(); it != map.end(); ++it)
+            ret += EncodedSize<Key>::size(it->first) + EncodedSize<Value>::size(it->second);
+    }
+    return ret;
+}
+
+template <typename T>
+struct EncodedSize<List<T> >
+{
+    static size_t size(const List<T> &list) { return encodedContainerSize<List<T>, T>(list); }
+};
+
+template <typename T>
+struct EncodedSize<std::vector<T> >
+{
+    static size_t size(const std::vector<T> &vector) { return encodedContainerSize<std::vector<T>, T>(vector); }
+};
+
+template <typename T>
+struct EncodedSize<Set<T> >
+{
+    static size_t size(const Set<T> &set) { return encodedContainerSize<Set<T>, T>(set); }
+};
+
+template <typename Key, typename Value>
+struct EncodedSize<Map<Key, Value> >
+{
+    static size_t size(const Map<Key, Value> &map) { return encodedMapSize<Map<Key, Value>, Key, Value>(map); }
+};
+
+template <typename Key, typename Value>
+struct EncodedSize<std::multimap<Key, Value> >
+{
+    static size_t size(const std::multimap<Key, Value> &map) { return encodedMapSize<std::multimap<Key, Value>, Key, Value>(map); }
+};
+
+template <typename Key, typename Value>
+struct EncodedSize<Hash<Key, Value> >
+{
+    static size_t size(const Hash<Key, Value> &map) { return encodedMapSize<Hash<Key, Value>, Key, Value>(map); }
+};
+
+template <>
+struct EncodedSize<ArenaString>
+{
+    static size_t size(const ArenaString &string) { return Serializer::sizeOf<uint32_t>() + string.size(); }
+};
+
+template <typename T>
+struct EncodedSize<ArenaVector<T> >
+{
+    static size_t size(const ArenaVector<T> &vector) { return encodedContainerSize<ArenaVector<T>, T>(vector); }
+};
+
+template <typename T, typename Compare>
+struct EncodedSize<ArenaSet<T, Compare> >
+{
+    static size_t size(const ArenaSet<T, Compare> &set) { return encodedContainerSize<ArenaSet<T, Compare>, T>(set); }
+};
+
+template <typename Key, typename Value, typename Compare>
+struct EncodedSize<ArenaMap<Key, Value, Compare> >
+{
+    static size_t size(const ArenaMap<Key, Value, Compare> &map) { return encodedMapSize<ArenaMap<Key, Value, Compare>, Key, Value>(map); }
+};
+
+template <typename Key, typename Value, typename Hasher>
+struct EncodedSize<ArenaHash<Key, Value, Hasher> >
+{
+    static size_t size(const ArenaHash<Key, Value, Hasher> &map) { return encodedMapSize<ArenaHash<Key, Value, Hasher>, Key, Value>(map); }
+};
+
+template <typename Key, typename Value, typename Hasher>
+struct EncodedSize<FlatHash<Key, Value, Hasher> >
+{
+    static size_t size(const FlatHash<Key, Value, Hasher> &map) { return encodedMapSize<FlatHash<Key, Value, Hasher>, Key, Value>(map); }
+};
+
+template <typename T, typename Hasher>
+struct EncodedSize<FlatHashSet<T, Hasher> >
+{
+    static size_t size(const FlatHashSet<T, Hasher> &set) { return encodedContainerSize<FlatHashSet<T, Hasher>, T>(set); }
+};
+
+template <typename Key, typename Value, typename Compare>
+struct EncodedSize<FlatMap<Key, Value, Compare> >
+{
+    static size_t size(const FlatMap<Key, Value, Compare> &map) { return encodedMapSize<FlatMap<Key, Value, Compare>, Key, Value>(map); }
+};
+
+template <typename T, typename Compare>
+struct EncodedSize<FlatSet<T, Compare> >
+{
+    static size_t size(const FlatSet<T, Compare> &set) { return encodedContainerSize<FlatSet<T, Compare>, T>(set); }
+};
+
 template <>
 inline Serializer &operator<<(Serializer &s, const String &string)
 {
@@ -293,9 +874,41 @@ inline Serializer &operator<<(Serializer &s, const String &string)
     return s;
 }
 
+template <>
+inline Serializer &operator<<(Serializer &s, const StringView &string)
+{
+    const uint32_t size = string.size();
+    s << size;
+    if (size)
+        s.write(string.data(), size);
+    return s;
+}
+
 template <>
 inline Serializer &operator<<(Serializer &s, const Path &path)
 {
+    if (s.flags() & Serializer::InternPaths) {
+        // 0 for no directory, 1 for a new one that follows, 2 and up for
+        // the ones before it
+        const int slash = path.lastIndexOf('/');
+        if (slash == -1) {
+            s << static_cast<uint32_t>(0);
+        } else {
+            const String dir = path.left(slash + 1);
+            bool isNew;
+            const uint32_t index = s.internDirectory(dir, isNew);
+            if (isNew) {
+                s << static_cast<uint32_t>(1) << dir;
+            } else {
+                s << (index + 2);
+            }
+        }
+        const uint32_t size = path.size() - (slash + 1);
+        s << size;
+        if (size)
+            s.write(path.constData() + slash + 1, size);
+        return s;
+    }
     const uint32_t size = path.size();
     s << size;
     if (size)
@@ -303,15 +916,149 @@ inline Serializer &operator<<(Serializer &s, const Path &path)
     return s;
 }
 
+// Atoms are sent as their strings, the ids mean nothing to the reader
+template <>
+inline Serializer &operator<<(Serializer &s, const Atom &atom)
+{
+    return s << atom.view();
+}
+
+template <>
+inline Serializer &operator<<(Serializer &s, const PathAtom &path)
+{
+    return s << path.toPath();
+}
+
+
+// Writes and reads count elements, in one go where they're BulkCopy and
+// the flags don't ask for varints
+template <typename T, bool Bulk = BulkCopy<T>::value>
+struct ElementArray
+{
+    static void write(Serializer &s, const T *elements, uint32_t count)
+    {
+        for (uint32_t i=0; i<count; ++i)
+            s << elements[i];
+    }
+    static void read(Deserializer &s, T *elements, uint32_t count)
+    {
+        for (uint32_t i=0; i<count; ++i)
+            s >> elements[i];
+    }
+};
+
+template <typename T>
+struct ElementArray<T, true>
+{
+    static void write(Serializer &s, const T *elements, uint32_t count)
+    {
+        if (Varint<T>::value && s.isCompact()) {
+            ElementArray<T, false>::write(s, elements, count);
+        } else if (count) {
+            s.write(elements, count * sizeof(T));
+        }
+    }
+    static void read(Deserializer &s, T *elements, uint32_t count)
+    {
+        if (Varint<T>::value && s.isCompact()) {
+            ElementArray<T, false>::read(s, elements, count);
+        } else if (count) {
+            s.read(elements, count * sizeof(T));
+        }
+    }
+};
+
+// std::vector<bool> has no array to hand out
+template <typename T>
+struct VectorCoder
+{
+    static void write(Serializer &s, const std::vector<T> &vector)
+    {
+        ElementArray<T>::write(s, vector.data(), vector.size());
+    }
+    static void read(Deserializer &s, std::vector<T> &vector)
+    {
+        ElementArray<T>::read(s, vector.data(), vector.size());
+    }
+};
+
+template <>
+struct VectorCoder<bool>
+{
+    static void write(Serializer &s, const std::vector<bool> &vector)
+    {
+        for (bool b : vector)
+            s << b;
+    }
+    static void read(Deserializer &s, std::vector<bool> &vector)
+    {
+        for (size_t i=0; i<vector.size(); ++i) {
+            bool b;
+            s >> b;
+            vector[i] = b;
+        }
+    }
+};
+
+template <typename T>
+Serializer &operator<<(Serializer &s, const std::vector<T> &vector)
+{
+    const uint32_t size = vector.size();
+    s << size;
+    VectorCoder<T>::write(s, vector);
+    return s;
+}
 
 template <typename T>
 Serializer &operator<<(Serializer &s, const List<T> &list)
 {
-    const uint32_t size = list.size();
+    return s << static_cast<const std::vector<T> &>(list);
+}
+
+// Arena containers have the wire formats of String, List, Set, Map and
+// Hash, so either can be read as the other
+template <>
+inline Serializer &operator<<(Serializer &s, const ArenaString &string)
+{
+    return s << StringView(string.data(), string.size());
+}
+
+template <typename T>
+Serializer &operator<<(Serializer &s, const ArenaVector<T> &vector)
+{
+    const uint32_t size = vector.size();
     s << size;
-    for (uint32_t i=0; i<size; ++i) {
-        s << list.at(i);
-    }
+    ElementArray<T>::write(s, vector.data(), size);
+    return s;
+}
+
+template <typename T, typename Compare>
+Serializer &operator<<(Serializer &s, const ArenaSet<T, Compare> &set)
+{
+    const uint32_t size = set.size();
+    s << size;
+    for (const T &t : set)
+        s << t;
+    return s;
+}
+
+template <typename Key, typename Value, typename Compare>
+Serializer &operator<<(Serializer &s, const ArenaMap<Key, Value, Compare> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    for (const auto &entry : map)
+        s << entry.first << entry.second;
+    return s;
+}
+
+template <typename Key, typename Value, typename Hasher>
+Serializer &operator<<(Serializer &s, const ArenaHash<Key, Value, Hasher> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    for (const auto &entry : map)
+        s << entry.first << entry.second;
     return s;
 }
 
@@ -348,6 +1095,55 @@ Serializer &operator<<(Serializer &s, const Hash<Key, Value> &map)
     return s;
 }
 
+template <typename Key, typename Value, typename Hasher>
+Serializer &operator<<(Serializer &s, const FlatHash<Key, Value, Hasher> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    for (typename FlatHash<Key, Value, Hasher>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        s << it->first << it->second;
+    }
+    return s;
+}
+
+template <typename T, typename Hasher>
+Serializer &operator<<(Serializer &s, const FlatHashSet<T, Hasher> &set)
+{
+    const uint32_t size = set.size();
+    s << size;
+    for (typename FlatHashSet<T, Hasher>::const_iterator it = set.begin(); it != set.end(); ++it) {
+        s << *it;
+    }
+    return s;
+}
+
+// Same wire format as Map and Set
+template <typename Key, typename Value, typename Compare>
+Serializer &operator<<(Serializer &s, const FlatMap<Key, Value, Compare> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    for (typename FlatMap<Key, Value, Compare>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        s << it->first << it->second;
+    }
+    return s;
+}
+
+template <typename T, typename Compare>
+Serializer &operator<<(Serializer &s, const FlatSet<T, Compare> &set)
+{
+    const uint32_t size = set.size();
+    s << size;
+    if (BulkCopy<T>::value && size > 1) {
+        VectorCoder<T>::write(s, set.values());
+        return s;
+    }
+    for (typename FlatSet<T, Compare>::const_iterator it = set.begin(); it != set.end(); ++it) {
+        s << *it;
+    }
+    return s;
+}
+
 template <typename First, typename Second>
 Serializer &operator<<(Serializer &s, const std::pair<First, Second> &pair)
 {
@@ -361,6 +1157,12 @@ Serializer &operator<<(Serializer &s, const Set<T> &set)
 {
     const uint32_t size = set.size();
     s << size;
+    if (BulkCopy<T>::value && size > 1) {
+        // gathered into the sorted array it is on the wire
+        const std::vector<T> sorted(set.begin(), set.end());
+        VectorCoder<T>::write(s, sorted);
+        return s;
+    }
     for (typename Set<T>::const_iterator it = set.begin(); it != set.end(); ++it) {
         s << *it;
     }
@@ -417,26 +1219,182 @@ Deserializer &operator>>(Deserializer &s, Hash<Key, Value> &map)
     return s;
 }
 
-template <typename T>
-Deserializer &operator>>(Deserializer &s, List<T> &list)
+template <typename Key, typename Value, typename Hasher>
+Deserializer &operator>>(Deserializer &s, FlatHash<Key, Value, Hasher> &map)
+{
+    uint32_t size;
+    s >> size;
+    map.clear();
+    if (size) {
+        map.reserve(size);
+        Key key;
+        Value value;
+        for (uint32_t i=0; i<size; ++i) {
+            s >> key >> value;
+            map[key] = std::move(value);
+        }
+    }
+    return s;
+}
+
+template <typename T, typename Hasher>
+Deserializer &operator>>(Deserializer &s, FlatHashSet<T, Hasher> &set)
 {
     uint32_t size;
     s >> size;
+    set.clear();
     if (size) {
-        list.resize(size);
+        set.reserve(size);
+        T t;
         for (uint32_t i=0; i<size; ++i) {
-            s >> list[i];
+            s >> t;
+            set.insert(t);
         }
     }
     return s;
 }
 
+template <typename Key, typename Value, typename Compare>
+Deserializer &operator>>(Deserializer &s, FlatMap<Key, Value, Compare> &map)
+{
+    uint32_t size;
+    s >> size;
+    std::vector<std::pair<Key, Value> > entries(size);
+    for (uint32_t i=0; i<size; ++i)
+        s >> entries[i].first >> entries[i].second;
+    // sorted already unless it was written with another Compare
+    map = FlatMap<Key, Value, Compare>(std::move(entries));
+    return s;
+}
+
+template <typename T, typename Compare>
+Deserializer &operator>>(Deserializer &s, FlatSet<T, Compare> &set)
+{
+    uint32_t size;
+    s >> size;
+    std::vector<T> values(size);
+    if (BulkCopy<T>::value && size > 1) {
+        VectorCoder<T>::read(s, values);
+    } else {
+        for (uint32_t i=0; i<size; ++i)
+            s >> values[i];
+    }
+    set = FlatSet<T, Compare>(std::move(values));
+    return s;
+}
+
+template <typename T>
+Deserializer &operator>>(Deserializer &s, std::vector<T> &vector)
+{
+    uint32_t size;
+    s >> size;
+    if (size) {
+        vector.resize(size);
+        VectorCoder<T>::read(s, vector);
+    }
+    return s;
+}
+
+template <typename T>
+Deserializer &operator>>(Deserializer &s, List<T> &list)
+{
+    return s >> static_cast<std::vector<T> &>(list);
+}
+
+// An Arena container without an arena gets the deserializer's
+template <typename Container>
+inline void adoptArena(Deserializer &s, Container &container)
+{
+    if (s.arena() && !container.get_allocator().arena())
+        container = Container(s.arena());
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, ArenaString &string)
+{
+    uint32_t size;
+    s >> size;
+    adoptArena(s, string);
+    string.resize(size);
+    if (size)
+        s.read(&string[0], size);
+    return s;
+}
+
+template <typename T>
+Deserializer &operator>>(Deserializer &s, ArenaVector<T> &vector)
+{
+    uint32_t size;
+    s >> size;
+    adoptArena(s, vector);
+    vector.clear();
+    vector.resize(size);
+    ElementArray<T>::read(s, vector.data(), size);
+    return s;
+}
+
+template <typename T, typename Compare>
+Deserializer &operator>>(Deserializer &s, ArenaSet<T, Compare> &set)
+{
+    uint32_t size;
+    s >> size;
+    adoptArena(s, set);
+    set.clear();
+    for (uint32_t i=0; i<size; ++i) {
+        T t = arenaConstruct<T>(set.get_allocator());
+        s >> t;
+        set.insert(set.end(), std::move(t));
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename Compare>
+Deserializer &operator>>(Deserializer &s, ArenaMap<Key, Value, Compare> &map)
+{
+    uint32_t size;
+    s >> size;
+    adoptArena(s, map);
+    map.clear();
+    for (uint32_t i=0; i<size; ++i) {
+        Key key = arenaConstruct<Key>(map.get_allocator());
+        Value value = arenaConstruct<Value>(map.get_allocator());
+        s >> key >> value;
+        map[std::move(key)] = std::move(value);
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename Hasher>
+Deserializer &operator>>(Deserializer &s, ArenaHash<Key, Value, Hasher> &map)
+{
+    uint32_t size;
+    s >> size;
+    adoptArena(s, map);
+    map.clear();
+    map.reserve(size);
+    for (uint32_t i=0; i<size; ++i) {
+        Key key = arenaConstruct<Key>(map.get_allocator());
+        Value value = arenaConstruct<Value>(map.get_allocator());
+        s >> key >> value;
+        map[std::move(key)] = std::move(value);
+    }
+    return s;
+}
+
 template <typename T>
 Deserializer &operator>>(Deserializer &s, Set<T> &set)
 {
     set.clear();
     uint32_t size;
     s >> size;
+    if (BulkCopy<T>::value && size > 1) {
+        // sorted, so every insert is at the end
+        std::vector<T> sorted(size);
+        VectorCoder<T>::read(s, sorted);
+        for (const T &t : sorted)
+            set.std::set<T>::insert(set.end(), t);
+        return s;
+    }
     if (size) {
         T t;
         for (uint32_t i=0; i<size; ++i) {
@@ -459,6 +1417,17 @@ inline Deserializer &operator>>(Deserializer &s, String &string)
     return s;
 }
 
+// Same wire format as String, decodes to a view into the deserializer's
+// source instead of allocating, see Deserializer::borrow()
+template <>
+inline Deserializer &operator>>(Deserializer &s, StringView &string)
+{
+    uint32_t size;
+    s >> size;
+    string = StringView(s.borrow(size), size);
+    return s;
+}
+
 template <typename First, typename Second>
 Deserializer &operator>>(Deserializer &s, std::pair<First, Second> &pair)
 {
@@ -470,6 +1439,24 @@ template <>
 inline Deserializer &operator>>(Deserializer &s, Path &path)
 {
     uint32_t size;
+    if (s.flags() & Serializer::InternPaths) {
+        uint32_t index;
+        s >> index;
+        String dir;
+        if (index == 1) {
+            s >> dir;
+            s.directories().append(dir);
+        } else if (index > 1 && index - 2 < static_cast<uint32_t>(s.directories().size())) {
+            dir = s.directories().at(index - 2);
+        }
+        s >> size;
+        path.resize(dir.size() + size);
+        if (dir.size())
+            memcpy(path.data(), dir.constData(), dir.size());
+        if (size)
+            s.read(path.data() + dir.size(), size);
+        return s;
+    }
     s >> size;
     path.resize(size);
     if (size) {
@@ -478,4 +1465,22 @@ inline Deserializer &operator>>(Deserializer &s, Path &path)
     return s;
 }
 
+template <>
+inline Deserializer &operator>>(Deserializer &s, Atom &atom)
+{
+    StringView string;
+    s >> string;
+    atom = Atom(string);
+    return s;
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, PathAtom &pathAtom)
+{
+    Path path;
+    s >> path;
+    pathAtom = PathAtom(path);
+    return s;
+}
+
 #endif
@@ -0,0 +1,151 @@
+#include "ShardedReadWriteLock.h"
+#include "ThreadPool.h"
+#include <assert.h>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <thread>
+#include <stdint.h>
+
+enum { CacheLine = 64 };
+
+ShardedReadWriteLock::ShardedReadWriteLock(int shards)
+    : mShards(0), mMask(0), mWriter(false)
+{
+    if (shards <= 0)
+        shards = ThreadPool::idealThreadCount();
+    unsigned int count = 1;
+    while (count < static_cast<unsigned int>(shards))
+        count <<= 1;
+    mMask = count - 1;
+
+    // the shards have to start on a cache line for the padding to help
+    char* mem = new char[(count + 1) * CacheLine];
+    char* aligned = mem + (CacheLine - (reinterpret_cast<uintptr_t>(mem) % CacheLine));
+    static_assert(sizeof(Shard) == CacheLine, "Shard must fill a cache line");
+    aligned[-1] = static_cast<char>(aligned - mem);
+    mShards = reinterpret_cast<Shard*>(aligned);
+    for (unsigned int i = 0; i < count; ++i) {
+        new (&mShards[i]) Shard();
+        mShards[i].readers.store(0, std::memory_order_relaxed);
+    }
+}
+
+ShardedReadWriteLock::~ShardedReadWriteLock()
+{
+    char* aligned = reinterpret_cast<char*>(mShards);
+    for (unsigned int i = 0; i <= mMask; ++i)
+        mShards[i].~Shard();
+    delete[] (aligned - aligned[-1]);
+}
+
+int ShardedReadWriteLock::shard() const
+{
+    // threads keep their shard, so a thread that's only reading never
+    // shares a counter with another one unless there are more threads
+    // than shards
+    const uint64_t hash = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return static_cast<int>(((hash * 0x9E3779B97F4A7C15ULL) >> 32) & mMask);
+}
+
+int ShardedReadWriteLock::lockForRead(int maxTime)
+{
+    const int idx = shard();
+    Shard& s = mShards[idx];
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(maxTime);
+    for (;;) {
+        // Both sides use sequentially consistent operations so that a
+        // reader and a writer can't both miss each other
+        s.readers.fetch_add(1);
+        if (!mWriter.load())
+            return idx;
+        s.readers.fetch_sub(1);
+
+        std::unique_lock<std::mutex> locker(mMutex);
+        while (mWriter.load()) {
+            if (maxTime > 0) {
+                if (mCond.wait_until(locker, deadline) == std::cv_status::timeout && mWriter.load())
+                    return -1;
+            } else {
+                mCond.wait(locker);
+            }
+        }
+    }
+}
+
+int ShardedReadWriteLock::tryLockForRead()
+{
+    const int idx = shard();
+    Shard& s = mShards[idx];
+    s.readers.fetch_add(1);
+    if (!mWriter.load())
+        return idx;
+    s.readers.fetch_sub(1);
+    return -1;
+}
+
+void ShardedReadWriteLock::unlockRead(int idx)
+{
+    assert(idx >= 0 && static_cast<unsigned int>(idx) <= mMask);
+    assert(mShards[idx].readers.load() > 0);
+    mShards[idx].readers.fetch_sub(1, std::memory_order_release);
+}
+
+bool ShardedReadWriteLock::waitForReaders(int maxTime)
+{
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(maxTime);
+    for (unsigned int i = 0; i <= mMask; ++i) {
+        int spins = 0;
+        while (mShards[i].readers.load()) {
+            if (++spins < 128)
+                continue;
+            if (maxTime > 0 && std::chrono::steady_clock::now() >= deadline)
+                return false;
+            std::this_thread::yield();
+        }
+    }
+    return true;
+}
+
+bool ShardedReadWriteLock::lockForWrite(int maxTime)
+{
+    if (maxTime > 0) {
+        if (!mWriteMutex.try_lock_for(std::chrono::milliseconds(maxTime)))
+            return false;
+    } else {
+        mWriteMutex.lock();
+    }
+    mWriter.store(true);
+    if (!waitForReaders(maxTime)) {
+        unlockWrite();
+        return false;
+    }
+    return true;
+}
+
+bool ShardedReadWriteLock::tryLockForWrite()
+{
+    if (!mWriteMutex.try_lock())
+        return false;
+    mWriter.store(true);
+    for (unsigned int i = 0; i <= mMask; ++i) {
+        if (mShards[i].readers.load()) {
+            unlockWrite();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ShardedReadWriteLock::unlockWrite()
+{
+    assert(mWriter.load());
+    {
+        std::lock_guard<std::mutex> locker(mMutex);
+        mWriter.store(false);
+    }
+    mCond.notify_all();
+    mWriteMutex.unlock();
+}
@@ -0,0 +1,50 @@
+#ifndef ShardedReadWriteLock_h
+#define ShardedReadWriteLock_h
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Reader/writer lock for data that's read far more often than it's
+// written. Each reader only touches the counter of its own shard, so
+// readers on different cores don't fight over a cache line. Writers
+// are expensive, they have to wait for every shard to drain.
+class ShardedReadWriteLock
+{
+public:
+    // shards <= 0 means one per cpu
+    ShardedReadWriteLock(int shards = 0);
+    ~ShardedReadWriteLock();
+
+    // Return the shard to pass to unlockRead(), or -1 if the lock
+    // couldn't be taken. maxTime is in ms, 0 waits forever.
+    int lockForRead(int maxTime = 0);
+    int tryLockForRead();
+    void unlockRead(int shard);
+
+    bool lockForWrite(int maxTime = 0);
+    bool tryLockForWrite();
+    void unlockWrite();
+
+private:
+    int shard() const;
+    bool waitForReaders(int maxTime);
+
+    struct Shard
+    {
+        std::atomic<int> readers;
+        char padding[64 - sizeof(std::atomic<int>)];
+    };
+
+    Shard* mShards;
+    unsigned int mMask;
+    std::atomic<bool> mWriter;
+    std::timed_mutex mWriteMutex;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+
+    ShardedReadWriteLock(const ShardedReadWriteLock&) = delete;
+    ShardedReadWriteLock& operator=(const ShardedReadWriteLock&) = delete;
+};
+
+#endif
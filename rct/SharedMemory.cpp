@@ -3,25 +3,59 @@
 #include "Rct.h"
 #include <rct-config.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
+#include <sys/stat.h>
 #include <assert.h>
+#include <atomic>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #define PROJID 3946
 
-SharedMemory::SharedMemory(key_t key, int size, CreateMode mode)
-    : mShm(-1), mOwner(false), mAddr(0), mKey(-1), mSize(0)
+static size_t readHugePageSize()
+{
+    size_t size = 2 * 1024 * 1024;
+    if (FILE *f = fopen("/proc/meminfo", "r")) {
+        char line[128];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                size = kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return size;
+}
+
+static size_t hugePageSize()
+{
+    static const size_t size = readHugePageSize();
+    return size;
+}
+
+SharedMemory::SharedMemory()
+    : mShm(-1), mFd(-1), mOwner(false), mFlags(NoFlag), mAddr(0), mKey(-1), mSize(0)
+{
+}
+
+SharedMemory::SharedMemory(key_t key, size_t size, CreateMode mode)
+    : mShm(-1), mFd(-1), mOwner(false), mFlags(NoFlag), mAddr(0), mKey(-1), mSize(0)
 {
     init(key, size, mode);
 }
 
-SharedMemory::SharedMemory(const Path& filename, int size, CreateMode mode)
-    : mShm(-1), mOwner(false), mAddr(0), mKey(-1), mSize(0)
+SharedMemory::SharedMemory(const Path& filename, size_t size, CreateMode mode)
+    : mShm(-1), mFd(-1), mOwner(false), mFlags(NoFlag), mAddr(0), mKey(-1), mSize(0)
 {
     init(ftok(filename.nullTerminated(), PROJID), size, mode);
 }
 
-bool SharedMemory::init(key_t key, int size, CreateMode mode)
+bool SharedMemory::init(key_t key, size_t size, CreateMode mode)
 {
     if (key == -1)
         return false;
@@ -59,6 +93,101 @@ bool SharedMemory::init(key_t key, int size, CreateMode mode)
     return true;
 }
 
+std::unique_ptr<SharedMemory> SharedMemory::open(const String &name, size_t size, CreateMode mode, unsigned int flags)
+{
+    std::unique_ptr<SharedMemory> memory(new SharedMemory);
+    const String path = name.startsWith('/') ? name : (String("/") + name);
+    if (mode == Recreate)
+        shm_unlink(path.constData());
+    if (mode != None && flags & HugePages)
+        size = ((size + hugePageSize() - 1) / hugePageSize()) * hugePageSize();
+    const int fd = shm_open(path.constData(), O_RDWR | (mode == None ? 0 : (O_CREAT | O_EXCL)), 0600);
+    if (fd == -1)
+        return memory;
+    if (mode != None && ftruncate(fd, size) == -1) {
+        error() << "Couldn't size shared memory" << path << Rct::strerror();
+        ::close(fd);
+        shm_unlink(path.constData());
+        return memory;
+    }
+    if (memory->initFd(fd, mode == None ? 0 : size, flags)) {
+        memory->mName = path;
+        memory->mOwner = (mode != None);
+    }
+    return memory;
+}
+
+std::unique_ptr<SharedMemory> SharedMemory::create(size_t size, unsigned int flags)
+{
+    std::unique_ptr<SharedMemory> memory(new SharedMemory);
+    int fd = -1;
+    if (flags & HugePages)
+        size = ((size + hugePageSize() - 1) / hugePageSize()) * hugePageSize();
+#ifdef HAVE_MEMFD_CREATE
+#ifdef MFD_HUGETLB
+    if (flags & HugePages) {
+        // huge pages are only reserved once mapped, so try that here
+        // rather than fail in attach()
+        fd = memfd_create("rct", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd != -1) {
+            void *address = ftruncate(fd, size) == -1 ? MAP_FAILED : mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                fd = -1;
+            } else {
+                munmap(address, size);
+                flags &= ~HugePages;
+            }
+        }
+    }
+#endif
+    if (fd == -1)
+        fd = memfd_create("rct", MFD_CLOEXEC);
+#else
+    // an unlinked POSIX segment is as good as anonymous
+    static std::atomic<unsigned int> counter(0);
+    const String path = String::format<64>("/rct-%d-%u", getpid(), counter++);
+    fd = shm_open(path.constData(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1)
+        shm_unlink(path.constData());
+#endif
+    if (fd == -1) {
+        error() << "Couldn't create shared memory" << Rct::strerror();
+        return memory;
+    }
+    if (!size || ftruncate(fd, size) == -1) {
+        ::close(fd);
+        return memory;
+    }
+    memory->initFd(fd, size, flags);
+    memory->mOwner = true;
+    return memory;
+}
+
+std::unique_ptr<SharedMemory> SharedMemory::fromFd(int fd, unsigned int flags)
+{
+    std::unique_ptr<SharedMemory> memory(new SharedMemory);
+    if (fd != -1)
+        memory->initFd(fd, 0, flags);
+    return memory;
+}
+
+bool SharedMemory::initFd(int fd, size_t size, unsigned int flags)
+{
+    if (!size) {
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+    }
+    mFd = fd;
+    mSize = size;
+    mFlags = flags;
+    return true;
+}
+
 SharedMemory::~SharedMemory()
 {
     cleanup();
@@ -69,6 +198,20 @@ void* SharedMemory::attach(AttachFlag flag, void* address)
     if (mAddr)
         return mAddr;
 
+    if (mFd != -1) {
+        void *addr = mmap(address, mSize, PROT_READ | (flag & Write ? PROT_WRITE : 0), MAP_SHARED, mFd, 0);
+        if (addr == MAP_FAILED) {
+            error() << Rct::strerror() << errno;
+            return 0;
+        }
+#ifdef MADV_HUGEPAGE
+        if (mFlags & HugePages)
+            madvise(addr, mSize, MADV_HUGEPAGE);
+#endif
+        mAddr = addr;
+        return mAddr;
+    }
+
     int flg = address ? SHM_RND : 0;
     if (!(flag & Write))
         flg |= SHM_RDONLY;
@@ -85,7 +228,11 @@ void SharedMemory::detach()
     if (!mAddr)
         return;
 
-    shmdt(mAddr);
+    if (mFd != -1) {
+        munmap(mAddr, mSize);
+    } else {
+        shmdt(mAddr);
+    }
     mAddr = 0;
 }
 
@@ -94,4 +241,10 @@ void SharedMemory::cleanup()
     detach();
     if (mShm != -1 && mOwner)
         shmctl(mShm, IPC_RMID, 0);
+    if (mFd != -1) {
+        if (mOwner && !mName.isEmpty())
+            shm_unlink(mName.constData());
+        ::close(mFd);
+        mFd = -1;
+    }
 }
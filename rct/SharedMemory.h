@@ -2,35 +2,66 @@
 #define SHAREDMEMORY_H
 
 #include <rct/Path.h>
+#include <memory>
 #include <sys/types.h>
 
+// A segment of memory shared between processes. The constructors make SysV
+// segments, the static functions make POSIX ones, either named with
+// shm_open() or anonymous with memfd_create(), which are handed to other
+// processes by passing fd() over a unix socket, see SocketClient.
 class SharedMemory
 {
 public:
     enum CreateMode { None, Create, Recreate };
     enum AttachFlag { Read = 0x0, Write = 0x1, ReadWrite = Write };
+    enum Flag {
+        NoFlag = 0x0,
+        // Backed by huge pages if the system has some reserved, which
+        // only anonymous memory can be, transparent huge pages otherwise.
+        // The size is rounded up to a multiple of the huge page size.
+        HugePages = 0x1
+    };
 
-    SharedMemory(key_t key, int size, CreateMode = None);
-    SharedMemory(const Path& filename, int size, CreateMode = None);
+    SharedMemory(key_t key, size_t size, CreateMode = None);
+    SharedMemory(const Path& filename, size_t size, CreateMode = None);
     ~SharedMemory();
 
+    // POSIX shared memory called name. Without a size an existing segment
+    // is attached at the size it has.
+    static std::unique_ptr<SharedMemory> open(const String &name, size_t size = 0,
+                                              CreateMode mode = None, unsigned int flags = NoFlag);
+    // Anonymous memory that goes away when the last fd to it is closed
+    static std::unique_ptr<SharedMemory> create(size_t size, unsigned int flags = NoFlag);
+    // Takes over an fd from open() or create() in another process
+    static std::unique_ptr<SharedMemory> fromFd(int fd, unsigned int flags = NoFlag);
+
     void* attach(AttachFlag flag, void* address = 0);
     void detach();
 
-    bool isValid() const { return mShm != -1; }
+    bool isValid() const { return mShm != -1 || mFd != -1; }
     key_t key() const { return mKey; }
+    // The POSIX name, if any, and fd, -1 for SysV segments
+    const String &name() const { return mName; }
+    int fd() const { return mFd; }
     void *address() const { return mAddr; }
-    int size() const { return mSize; }
+    size_t size() const { return mSize; }
 
     void cleanup();
 private:
-    bool init(key_t key, int size, CreateMode mode);
+    SharedMemory();
+    bool init(key_t key, size_t size, CreateMode mode);
+    bool initFd(int fd, size_t size, unsigned int flags);
 
-    int mShm;
+    int mShm, mFd;
     bool mOwner;
+    unsigned int mFlags;
     void* mAddr;
     key_t mKey;
-    int mSize;
+    size_t mSize;
+    String mName;
+
+    SharedMemory(const SharedMemory &) = delete;
+    SharedMemory &operator=(const SharedMemory &) = delete;
 };
 
 #endif
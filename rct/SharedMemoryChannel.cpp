@@ -0,0 +1,155 @@
+#include "SharedMemoryChannel.h"
+#include "EventLoop.h"
+#include "Log.h"
+#include "Message.h"
+#include "Thread.h"
+#include <condition_variable>
+#include <mutex>
+
+class ChannelThread : public Thread, public std::enable_shared_from_this<ChannelThread>
+{
+public:
+    ChannelThread(SharedMemoryChannel *channel)
+        : mChannel(channel), mLoop(EventLoop::eventLoop()), mStopped(false), mPosted(false)
+    {
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopped = true;
+        }
+        mCondition.notify_one();
+        mChannel->mRing.interrupt();
+    }
+
+protected:
+    virtual void run() override
+    {
+        const std::weak_ptr<ChannelThread> weak = shared_from_this();
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (mStopped)
+                    break;
+            }
+            if (!mChannel->mRing.waitForData())
+                continue;
+            EventLoop::SharedPtr loop = mLoop.lock();
+            if (!loop)
+                break;
+            std::unique_lock<std::mutex> lock(mMutex);
+            mPosted = true;
+            loop->callLater([weak]() {
+                    if (std::shared_ptr<ChannelThread> thread = weak.lock())
+                        thread->drained();
+                });
+            // the event loop has the ring until it's done with it
+            mCondition.wait(lock, [this]() { return !mPosted || mStopped; });
+        }
+    }
+
+private:
+    void drained()
+    {
+        mChannel->drain();
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPosted = false;
+        }
+        mCondition.notify_one();
+    }
+
+    SharedMemoryChannel *mChannel;
+    EventLoop::WeakPtr mLoop;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStopped, mPosted;
+};
+
+SharedMemoryChannel::SharedMemoryChannel(key_t key, Role role, uint32_t capacity, SharedMemory::CreateMode mode)
+    : mRole(role), mVersion(0)
+{
+    init(new SharedMemory(key, SpscRing::memorySize(capacity), mode), mode == SharedMemory::None ? 0 : capacity);
+}
+
+SharedMemoryChannel::SharedMemoryChannel(const Path &path, Role role, uint32_t capacity, SharedMemory::CreateMode mode)
+    : mRole(role), mVersion(0)
+{
+    init(new SharedMemory(path, SpscRing::memorySize(capacity), mode), mode == SharedMemory::None ? 0 : capacity);
+}
+
+SharedMemoryChannel::SharedMemoryChannel(std::unique_ptr<SharedMemory> memory, Role role, uint32_t capacity)
+    : mRole(role), mVersion(0)
+{
+    init(memory.release(), capacity);
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+    if (mThread) {
+        mThread->stop();
+        mThread->join();
+        mThread.reset();
+    }
+}
+
+void SharedMemoryChannel::init(SharedMemory *memory, uint32_t capacity)
+{
+    mMemory.reset(memory);
+    if (!mMemory || !mMemory->isValid())
+        return;
+    void *address = mMemory->attach(SharedMemory::ReadWrite);
+    if (!address)
+        return;
+    // the memory may have been rounded up to huge pages
+    if (capacity && (SpscRing::memorySize(capacity) > mMemory->size()
+                     || !SpscRing::create(address, SpscRing::memorySize(capacity)))) {
+        error() << "Invalid SharedMemoryChannel capacity" << capacity;
+        return;
+    }
+    mRing = SpscRing(address);
+    if (mRing.isValid() && mRole == Receiver) {
+        mThread = std::make_shared<ChannelThread>(this);
+        mThread->start();
+    }
+}
+
+bool SharedMemoryChannel::send(const void *data, int size, int maxTime)
+{
+    if (!mRing.isValid() || size < 0)
+        return false;
+    while (!mRing.write(data, size)) {
+        if (maxTime == -1 || !mRing.waitForSpace(size, maxTime))
+            return false;
+    }
+    return true;
+}
+
+bool SharedMemoryChannel::send(const Message &message, int maxTime)
+{
+    // there's no way to pass fds through the ring
+    if (message.attachmentCount())
+        return false;
+    const std::shared_ptr<const String> frame = message.frame(mVersion);
+    // Message::create() doesn't want the size that leads the frame
+    const int header = sizeof(uint32_t);
+    return frame && send(frame->constData() + header, frame->size() - header, maxTime);
+}
+
+void SharedMemoryChannel::drain()
+{
+    // give the rest of the event loop a turn now and then
+    enum { MaxFrames = 1024 };
+    uint32_t size;
+    const char *data;
+    for (int i = 0; i < MaxFrames && (data = mRing.peek(&size)); ++i) {
+        mDataAvailable(data, size);
+        if (!mNewMessage.isEmpty()) {
+            if (std::shared_ptr<Message> message = Message::create(mVersion, data, size))
+                mNewMessage(message);
+        }
+        mRing.pop();
+    }
+}
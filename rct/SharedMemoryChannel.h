@@ -0,0 +1,70 @@
+#ifndef SharedMemoryChannel_h
+#define SharedMemoryChannel_h
+
+#include <rct/Path.h>
+#include <rct/SharedMemory.h>
+#include <rct/ShmRing.h>
+#include <rct/SignalSlot.h>
+#include <functional>
+#include <memory>
+
+class ChannelThread;
+class Message;
+
+// One way channel between two processes over a SpscRing in a SharedMemory
+// segment, where frames are copied into the segment and read from it in
+// place, never through the kernel. Frames can be anything or a Message.
+//
+// The Receiver side delivers frames on the EventLoop that was current
+// when it was created. Like MessageQueue it has a thread that waits for
+// data, but on the ring's futex, and it only posts to the event loop when
+// the loop has run out of frames, which it then drains in one go.
+class SharedMemoryChannel
+{
+public:
+    enum Role { Sender, Receiver };
+
+    // One side creates the segment, capacity is the ring's, a power of two
+    SharedMemoryChannel(key_t key, Role role, uint32_t capacity, SharedMemory::CreateMode mode = SharedMemory::None);
+    SharedMemoryChannel(const Path &path, Role role, uint32_t capacity, SharedMemory::CreateMode mode = SharedMemory::None);
+    // On memory from SharedMemory::open() or create(), a ring is created
+    // in it with a capacity, the other side attaches with 0
+    SharedMemoryChannel(std::unique_ptr<SharedMemory> memory, Role role, uint32_t capacity = 0);
+    ~SharedMemoryChannel();
+
+    bool isValid() const { return mRing.isValid(); }
+    Role role() const { return mRole; }
+    uint32_t maxFrameSize() const { return mRing.isValid() ? mRing.maxFrameSize() : 0; }
+
+    // Waits up to maxTime ms for room, -1 doesn't wait and 0 waits forever
+    bool send(const void *data, int size, int maxTime = 0);
+    bool send(const String &data, int maxTime = 0) { return send(data.constData(), data.size(), maxTime); }
+    // Sends the frame a Connection of this version would, newMessage()
+    // on the other end gets the message back
+    bool send(const Message &message, int maxTime = 0);
+
+    // The Message version, as in Connection
+    void setVersion(int version) { mVersion = version; }
+    int version() const { return mVersion; }
+
+    // The frame is in the ring, in place, only for the duration of the call
+    Signal<std::function<void(const char *, int)> > &dataAvailable() { return mDataAvailable; }
+    Signal<std::function<void(const std::shared_ptr<Message> &)> > &newMessage() { return mNewMessage; }
+
+private:
+    void init(SharedMemory *memory, uint32_t capacity);
+    // On the event loop, until the ring is empty
+    void drain();
+
+    Role mRole;
+    int mVersion;
+    std::unique_ptr<SharedMemory> mMemory;
+    SpscRing mRing;
+    Signal<std::function<void(const char *, int)> > mDataAvailable;
+    Signal<std::function<void(const std::shared_ptr<Message> &)> > mNewMessage;
+    std::shared_ptr<ChannelThread> mThread;
+
+    friend class ChannelThread;
+};
+
+#endif
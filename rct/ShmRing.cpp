@@ -0,0 +1,402 @@
+#include "ShmRing.h"
+#include "Rct.h"
+#include <algorithm>
+#include <atomic>
+#include <limits.h>
+#include <new>
+#include <string.h>
+#include <unistd.h>
+#ifdef OS_Linux
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <time.h>
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "rings in shared memory need address free atomics");
+
+enum { CacheLine = 64 };
+
+static inline uint32_t align8(uint32_t size)
+{
+    return (size + 7) & ~7u;
+}
+
+// A futex word that's bumped to wake waiters, and the number of them
+struct RingSignal
+{
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> waiters;
+};
+
+static void futexWait(std::atomic<uint32_t> *word, uint32_t value, int maxTime)
+{
+#ifdef OS_Linux
+    timespec timeout;
+    if (maxTime > 0) {
+        timeout.tv_sec = maxTime / 1000;
+        timeout.tv_nsec = (maxTime % 1000) * 1000000;
+    }
+    // not FUTEX_PRIVATE_FLAG, the word may be shared with other processes
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value, maxTime > 0 ? &timeout : 0, 0, 0);
+#else
+    if (word->load(std::memory_order_acquire) == value)
+        usleep(maxTime > 0 ? std::min(maxTime, 1) * 1000 : 1000);
+#endif
+}
+
+static void futexWake(std::atomic<uint32_t> *word)
+{
+#ifdef OS_Linux
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#else
+    (void)word;
+#endif
+}
+
+// Called after publishing, the fence pairs with the one in waitFor() so
+// either the waiter sees what was published or this sees the waiter
+static inline void wake(RingSignal &signal, bool force = false)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (force || signal.waiters.load(std::memory_order_relaxed)) {
+        signal.sequence.fetch_add(1, std::memory_order_release);
+        futexWake(&signal.sequence);
+    }
+}
+
+template <typename Ready>
+static bool waitFor(RingSignal &signal, const std::atomic<uint32_t> &interrupts, int maxTime, Ready ready)
+{
+    if (ready())
+        return true;
+    const uint64_t deadline = maxTime > 0 ? Rct::monoMs() + maxTime : 0;
+    const uint32_t interrupted = interrupts.load(std::memory_order_acquire);
+    signal.waiters.fetch_add(1, std::memory_order_relaxed);
+    bool ret = false;
+    for (;;) {
+        const uint32_t sequence = signal.sequence.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            ret = true;
+            break;
+        }
+        if (interrupts.load(std::memory_order_acquire) != interrupted)
+            break;
+        int timeout = 0;
+        if (deadline) {
+            const uint64_t now = Rct::monoMs();
+            if (now >= deadline)
+                break;
+            timeout = static_cast<int>(deadline - now);
+        }
+        futexWait(&signal.sequence, sequence, timeout);
+    }
+    signal.waiters.fetch_sub(1, std::memory_order_relaxed);
+    return ret;
+}
+
+enum {
+    SpscMagic = 0x52435453, // RCTS
+    MpmcMagic = 0x5243544d, // RCTM
+    Wrap = 0xffffffff
+};
+
+struct SpscRingHeader
+{
+    std::atomic<uint32_t> magic;
+    uint32_t capacity;
+    std::atomic<uint32_t> interrupts;
+    alignas(CacheLine) std::atomic<uint64_t> head;
+    alignas(CacheLine) std::atomic<uint64_t> tail;
+    alignas(CacheLine) RingSignal data;
+    alignas(CacheLine) RingSignal space;
+};
+
+size_t SpscRing::memorySize(uint32_t capacity)
+{
+    return sizeof(SpscRingHeader) + capacity;
+}
+
+bool SpscRing::create(void *memory, size_t size)
+{
+    if (!memory || size <= sizeof(SpscRingHeader))
+        return false;
+    const size_t capacity = size - sizeof(SpscRingHeader);
+    if (capacity < CacheLine || capacity > (1u << 31) || (capacity & (capacity - 1)))
+        return false;
+    SpscRingHeader *header = new (memory) SpscRingHeader;
+    header->capacity = capacity;
+    header->interrupts.store(0, std::memory_order_relaxed);
+    header->head.store(0, std::memory_order_relaxed);
+    header->tail.store(0, std::memory_order_relaxed);
+    header->data.sequence.store(0, std::memory_order_relaxed);
+    header->data.waiters.store(0, std::memory_order_relaxed);
+    header->space.sequence.store(0, std::memory_order_relaxed);
+    header->space.waiters.store(0, std::memory_order_relaxed);
+    header->magic.store(SpscMagic, std::memory_order_release);
+    return true;
+}
+
+SpscRing::SpscRing(void *memory)
+    : mHeader(0), mData(0), mHead(0), mTail(0)
+{
+    SpscRingHeader *header = static_cast<SpscRingHeader *>(memory);
+    if (header && header->magic.load(std::memory_order_acquire) == SpscMagic) {
+        mHeader = header;
+        mData = static_cast<char *>(memory) + sizeof(SpscRingHeader);
+        mHead = header->head.load(std::memory_order_acquire);
+        mTail = header->tail.load(std::memory_order_acquire);
+    }
+}
+
+bool SpscRing::isEmpty() const
+{
+    return mHeader->head.load(std::memory_order_acquire) == mHeader->tail.load(std::memory_order_acquire);
+}
+
+uint32_t SpscRing::maxFrameSize() const
+{
+    // anything bigger might not fit at the end nor at the start
+    return mHeader->capacity / 2 - sizeof(uint32_t);
+}
+
+// The bytes a frame at tail takes, with what's skipped to wrap around
+uint32_t SpscRing::frameSpace(uint32_t size, uint64_t tail) const
+{
+    const uint32_t capacity = mHeader->capacity;
+    const uint32_t offset = tail & (capacity - 1);
+    const uint32_t frame = align8(sizeof(uint32_t) + size);
+    return offset + frame > capacity ? capacity - offset + frame : frame;
+}
+
+bool SpscRing::write(const void *data, uint32_t size)
+{
+    if (size > maxFrameSize())
+        return false;
+    const uint32_t capacity = mHeader->capacity;
+    const uint64_t tail = mHeader->tail.load(std::memory_order_relaxed);
+    const uint32_t space = frameSpace(size, tail);
+    if (tail + space - mHead > capacity) {
+        mHead = mHeader->head.load(std::memory_order_acquire);
+        if (tail + space - mHead > capacity)
+            return false;
+    }
+    uint32_t offset = tail & (capacity - 1);
+    if (space != align8(sizeof(uint32_t) + size)) {
+        const uint32_t wrap = Wrap;
+        memcpy(mData + offset, &wrap, sizeof(wrap));
+        offset = 0;
+    }
+    memcpy(mData + offset, &size, sizeof(size));
+    memcpy(mData + offset + sizeof(size), data, size);
+    mHeader->tail.store(tail + space, std::memory_order_release);
+    wake(mHeader->data);
+    return true;
+}
+
+bool SpscRing::waitForSpace(uint32_t size, int maxTime)
+{
+    if (size > maxFrameSize())
+        return false;
+    return waitFor(mHeader->space, mHeader->interrupts, maxTime, [this, size]() {
+            const uint64_t tail = mHeader->tail.load(std::memory_order_relaxed);
+            return tail + frameSpace(size, tail) - mHeader->head.load(std::memory_order_acquire) <= mHeader->capacity;
+        });
+}
+
+const char *SpscRing::peek(uint32_t *size)
+{
+    uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+    if (head == mTail) {
+        mTail = mHeader->tail.load(std::memory_order_acquire);
+        if (head == mTail)
+            return 0;
+    }
+    const uint32_t capacity = mHeader->capacity;
+    uint32_t offset = head & (capacity - 1);
+    uint32_t frame;
+    memcpy(&frame, mData + offset, sizeof(frame));
+    if (frame == Wrap) {
+        // the producer always writes a frame after the marker
+        head += capacity - offset;
+        mHeader->head.store(head, std::memory_order_release);
+        offset = 0;
+        memcpy(&frame, mData, sizeof(frame));
+    }
+    *size = frame;
+    return mData + offset + sizeof(frame);
+}
+
+void SpscRing::pop()
+{
+    const uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+    uint32_t frame;
+    memcpy(&frame, mData + (head & (mHeader->capacity - 1)), sizeof(frame));
+    mHeader->head.store(head + align8(sizeof(frame) + frame), std::memory_order_release);
+    wake(mHeader->space);
+}
+
+bool SpscRing::read(String &frame)
+{
+    uint32_t size;
+    const char *data = peek(&size);
+    if (!data)
+        return false;
+    frame.assign(data, size);
+    pop();
+    return true;
+}
+
+bool SpscRing::waitForData(int maxTime)
+{
+    return waitFor(mHeader->data, mHeader->interrupts, maxTime, [this]() { return !isEmpty(); });
+}
+
+void SpscRing::interrupt()
+{
+    mHeader->interrupts.fetch_add(1, std::memory_order_release);
+    wake(mHeader->data, true);
+    wake(mHeader->space, true);
+}
+
+// Dmitry Vyukov's bounded queue. A slot's sequence is the position it can
+// be written at next, or that plus one once it's been written and can be
+// read.
+struct MpmcRing::Slot
+{
+    std::atomic<uint64_t> sequence;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct MpmcRingHeader
+{
+    std::atomic<uint32_t> magic;
+    uint32_t slots, slotSize, stride;
+    std::atomic<uint32_t> interrupts;
+    alignas(CacheLine) std::atomic<uint64_t> enqueue;
+    alignas(CacheLine) std::atomic<uint64_t> dequeue;
+    alignas(CacheLine) RingSignal data;
+    alignas(CacheLine) RingSignal space;
+};
+
+size_t MpmcRing::memorySize(uint32_t slots, uint32_t slotSize)
+{
+    return sizeof(MpmcRingHeader) + static_cast<size_t>(slots) * (sizeof(Slot) + align8(slotSize));
+}
+
+bool MpmcRing::create(void *memory, size_t size, uint32_t slots, uint32_t slotSize)
+{
+    if (!memory || !slots || (slots & (slots - 1)) || !slotSize || size < memorySize(slots, slotSize))
+        return false;
+    MpmcRingHeader *header = new (memory) MpmcRingHeader;
+    header->slots = slots;
+    header->slotSize = slotSize;
+    header->stride = sizeof(Slot) + align8(slotSize);
+    header->interrupts.store(0, std::memory_order_relaxed);
+    header->enqueue.store(0, std::memory_order_relaxed);
+    header->dequeue.store(0, std::memory_order_relaxed);
+    header->data.sequence.store(0, std::memory_order_relaxed);
+    header->data.waiters.store(0, std::memory_order_relaxed);
+    header->space.sequence.store(0, std::memory_order_relaxed);
+    header->space.waiters.store(0, std::memory_order_relaxed);
+    char *slotData = static_cast<char *>(memory) + sizeof(MpmcRingHeader);
+    for (uint32_t i = 0; i < slots; ++i)
+        new (slotData + (static_cast<size_t>(i) * header->stride)) Slot { { i }, 0, 0 };
+    header->magic.store(MpmcMagic, std::memory_order_release);
+    return true;
+}
+
+MpmcRing::MpmcRing(void *memory)
+    : mHeader(0), mSlots(0)
+{
+    MpmcRingHeader *header = static_cast<MpmcRingHeader *>(memory);
+    if (header && header->magic.load(std::memory_order_acquire) == MpmcMagic) {
+        mHeader = header;
+        mSlots = static_cast<char *>(memory) + sizeof(MpmcRingHeader);
+    }
+}
+
+MpmcRing::Slot *MpmcRing::slot(uint64_t pos) const
+{
+    return reinterpret_cast<Slot *>(mSlots + ((pos & (mHeader->slots - 1)) * mHeader->stride));
+}
+
+bool MpmcRing::isEmpty() const
+{
+    const uint64_t pos = mHeader->dequeue.load(std::memory_order_relaxed);
+    return slot(pos)->sequence.load(std::memory_order_acquire) != pos + 1;
+}
+
+uint32_t MpmcRing::maxFrameSize() const
+{
+    return mHeader->slotSize;
+}
+
+bool MpmcRing::write(const void *data, uint32_t size)
+{
+    if (size > mHeader->slotSize)
+        return false;
+    uint64_t pos = mHeader->enqueue.load(std::memory_order_relaxed);
+    Slot *s;
+    for (;;) {
+        s = slot(pos);
+        const int64_t diff = static_cast<int64_t>(s->sequence.load(std::memory_order_acquire) - pos);
+        if (!diff) {
+            if (mHeader->enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = mHeader->enqueue.load(std::memory_order_relaxed);
+        }
+    }
+    s->size = size;
+    memcpy(reinterpret_cast<char *>(s + 1), data, size);
+    s->sequence.store(pos + 1, std::memory_order_release);
+    wake(mHeader->data);
+    return true;
+}
+
+bool MpmcRing::waitForSpace(int maxTime)
+{
+    return waitFor(mHeader->space, mHeader->interrupts, maxTime, [this]() {
+            const uint64_t pos = mHeader->enqueue.load(std::memory_order_relaxed);
+            return slot(pos)->sequence.load(std::memory_order_acquire) == pos;
+        });
+}
+
+bool MpmcRing::read(String &frame)
+{
+    uint64_t pos = mHeader->dequeue.load(std::memory_order_relaxed);
+    Slot *s;
+    for (;;) {
+        s = slot(pos);
+        const int64_t diff = static_cast<int64_t>(s->sequence.load(std::memory_order_acquire) - (pos + 1));
+        if (!diff) {
+            if (mHeader->dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = mHeader->dequeue.load(std::memory_order_relaxed);
+        }
+    }
+    frame.assign(reinterpret_cast<const char *>(s + 1), s->size);
+    s->sequence.store(pos + mHeader->slots, std::memory_order_release);
+    wake(mHeader->space);
+    return true;
+}
+
+bool MpmcRing::waitForData(int maxTime)
+{
+    return waitFor(mHeader->data, mHeader->interrupts, maxTime, [this]() { return !isEmpty(); });
+}
+
+void MpmcRing::interrupt()
+{
+    mHeader->interrupts.fetch_add(1, std::memory_order_release);
+    wake(mHeader->data, true);
+    wake(mHeader->space, true);
+}
@@ -0,0 +1,98 @@
+#ifndef ShmRing_h
+#define ShmRing_h
+
+#include <rct/String.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct SpscRingHeader;
+struct MpmcRingHeader;
+
+// Lock-free rings of frames in memory that may be mapped by more than one
+// process, typically a SharedMemory segment, see SharedMemoryChannel. A
+// ring is laid out in the memory itself, the objects are just views of
+// it: one side calls create() on the memory, after that any number of
+// SpscRing or MpmcRing objects can be made on it in any process.
+//
+// Waiting for data or room is a futex on Linux, where a process that
+// waits costs the one that writes a syscall only while it waits.
+
+// One producer and one consumer. Frames are variable sized and stored
+// contiguously, so the consumer can use them in place with peek().
+class SpscRing
+{
+public:
+    // capacity is the bytes for frames, a power of two
+    static size_t memorySize(uint32_t capacity);
+    static bool create(void *memory, size_t size);
+
+    // Attaches to memory create() initialized, isValid() is false
+    // otherwise
+    SpscRing(void *memory = 0);
+
+    bool isValid() const { return mHeader; }
+    bool isEmpty() const;
+    // Frames up to this size always fit once the consumer catches up
+    uint32_t maxFrameSize() const;
+
+    // Producer side. False if there's no room for the frame right now
+    bool write(const void *data, uint32_t size);
+    bool write(const String &data) { return write(data.constData(), data.size()); }
+    // Until there's room for a frame of size bytes, maxTime is in ms and
+    // 0 waits forever. False on timeout or interrupt().
+    bool waitForSpace(uint32_t size, int maxTime = 0);
+
+    // Consumer side. The oldest frame, in the ring and valid until pop(),
+    // or 0 if there is none
+    const char *peek(uint32_t *size);
+    void pop();
+    bool read(String &frame);
+    // Until there's a frame, like waitForSpace()
+    bool waitForData(int maxTime = 0);
+
+    // Wakes everyone waiting on the ring
+    void interrupt();
+
+private:
+    uint32_t frameSpace(uint32_t size, uint64_t tail) const;
+
+    SpscRingHeader *mHeader;
+    char *mData;
+    // each side's last look at the other one's position
+    uint64_t mHead, mTail;
+};
+
+// Any number of producers and consumers, on a ring of fixed size slots.
+// A producer or consumer that dies halfway through a write or read leaves
+// its slot claimed and the ring stuck there.
+class MpmcRing
+{
+public:
+    // slots is a power of two
+    static size_t memorySize(uint32_t slots, uint32_t slotSize);
+    static bool create(void *memory, size_t size, uint32_t slots, uint32_t slotSize);
+
+    MpmcRing(void *memory = 0);
+
+    bool isValid() const { return mHeader; }
+    bool isEmpty() const;
+    uint32_t maxFrameSize() const;
+
+    bool write(const void *data, uint32_t size);
+    bool write(const String &data) { return write(data.constData(), data.size()); }
+    bool waitForSpace(int maxTime = 0);
+
+    bool read(String &frame);
+    bool waitForData(int maxTime = 0);
+
+    void interrupt();
+
+private:
+    struct Slot;
+    Slot *slot(uint64_t pos) const;
+
+    MpmcRingHeader *mHeader;
+    char *mSlots;
+};
+
+#endif
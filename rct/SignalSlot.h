@@ -1,12 +1,26 @@
 #ifndef SIGNALSLOT_H
 #define SIGNALSLOT_H
 
-#include <map>
+#include <algorithm>
+#include <memory>
 #include <mutex>
+#include <type_traits>
+#include <vector>
 #include <assert.h>
 #include "EventLoop.h"
 
-template<typename Signature>
+// Emitting takes a reference to the current connections and calls them
+// without copying them or taking the signal's mutex, so a slot may connect
+// and disconnect. Connecting and disconnecting publish a changed copy
+// instead, emissions that are already running keep calling the
+// connections they started with. The reference is taken with
+// std::atomic_load(), which in libstdc++ briefly locks one of a pool of
+// mutexes picked by address, it is not lock free.
+//
+// With ThreadSafe false, see LocalSignal, there is no mutex and the
+// connections are changed in place when no emission is using them. For
+// signals that are only used from one thread.
+template<typename Signature, bool ThreadSafe = true>
 class Signal
 {
 public:
@@ -18,16 +32,20 @@ public:
     template<typename Call>
     Key connect(Call&& call)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        connections.insert(std::make_pair(++id, std::forward<Call>(call)));
+        std::lock_guard<Mutex> locker(mutex);
+        std::shared_ptr<Connections> conn = modify();
+        conn->push_back(std::make_pair(++id, Signature(std::forward<Call>(call))));
+        store(conn);
         return id;
     }
 
     template<size_t Value, typename Call, typename std::enable_if<Value == EventLoop::Async, int>::type = 0>
     Key connect(Call&& call)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        connections.insert(std::make_pair(++id, SignatureWrapper(std::forward<Call>(call))));
+        std::lock_guard<Mutex> locker(mutex);
+        std::shared_ptr<Connections> conn = modify();
+        conn->push_back(std::make_pair(++id, Signature(SignatureWrapper(std::forward<Call>(call)))));
+        store(conn);
         return id;
     }
 
@@ -36,36 +54,55 @@ public:
     template<size_t Value, typename Call, typename std::enable_if<Value == EventLoop::Move, int>::type = 0>
     Key connect(Call&& call)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        assert(connections.empty());
-        connections.insert(std::make_pair(++id, SignatureMoveWrapper(std::forward<Call>(call))));
+        std::lock_guard<Mutex> locker(mutex);
+        std::shared_ptr<Connections> conn = modify();
+        assert(conn->empty());
+        conn->push_back(std::make_pair(++id, Signature(SignatureMoveWrapper(std::forward<Call>(call)))));
+        store(conn);
         return id;
     }
 
     bool disconnect(Key key)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        return connections.erase(key) == 1;
+        std::lock_guard<Mutex> locker(mutex);
+        const std::shared_ptr<const Connections> current = load();
+        if (!current)
+            return false;
+        // connections are appended, so they're sorted by key
+        const typename Connections::const_iterator it = std::lower_bound(current->begin(), current->end(), key, KeyLess());
+        if (it == current->end() || it->first != key)
+            return false;
+        const size_t index = it - current->begin();
+        std::shared_ptr<Connections> conn = modify();
+        conn->erase(conn->begin() + index);
+        store(conn);
+        return true;
     }
 
     int disconnect()
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        const int ret = connections.size();
-        connections.clear();
-        return ret;
+        std::lock_guard<Mutex> locker(mutex);
+        const std::shared_ptr<const Connections> current = load();
+        if (!current)
+            return 0;
+        store(std::shared_ptr<Connections>());
+        return current->size();
+    }
+
+    bool isEmpty() const
+    {
+        const std::shared_ptr<const Connections> conn = load();
+        return !conn || conn->empty();
     }
 
     // ignore result_type for now
     template<typename... Args>
     void operator()(Args&&... args)
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
-        }
-        for (auto& connection : conn) {
+        const std::shared_ptr<const Connections> conn = load();
+        if (!conn)
+            return;
+        for (auto& connection : *conn) {
             connection.second(std::forward<Args>(args)...);
         }
     }
@@ -73,12 +110,10 @@ public:
     template<typename... Args>
     void operator()(const Args&... args)
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
-        }
-        for (auto& connection : conn) {
+        const std::shared_ptr<const Connections> conn = load();
+        if (!conn)
+            return;
+        for (auto& connection : *conn) {
             connection.second(std::forward<const Args &>(args)...);
         }
     }
@@ -86,12 +121,10 @@ public:
     template<typename... Args>
     void operator()()
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
-        }
-        for (auto& connection : conn) {
+        const std::shared_ptr<const Connections> conn = load();
+        if (!conn)
+            return;
+        for (auto& connection : *conn) {
             connection.second();
         }
     }
@@ -140,9 +173,53 @@ private:
     };
 
 private:
+    typedef std::vector<std::pair<Key, Signature> > Connections;
+
+    struct KeyLess
+    {
+        bool operator()(const std::pair<Key, Signature> &connection, Key key) const { return connection.first < key; }
+    };
+
+    struct NoMutex
+    {
+        void lock() { }
+        void unlock() { }
+    };
+    typedef typename std::conditional<ThreadSafe, std::mutex, NoMutex>::type Mutex;
+
+    std::shared_ptr<Connections> load() const
+    {
+        return ThreadSafe ? std::atomic_load(&connections) : connections;
+    }
+
+    void store(const std::shared_ptr<Connections> &conn)
+    {
+        if (ThreadSafe) {
+            std::atomic_store(&connections, conn);
+        } else {
+            connections = conn;
+        }
+    }
+
+    // The connections to change and store(), with the mutex held
+    std::shared_ptr<Connections> modify()
+    {
+        std::shared_ptr<Connections> conn = load();
+        if (!conn)
+            return std::make_shared<Connections>();
+        // the member and conn, anything more is an emission
+        if (ThreadSafe || conn.use_count() > 2)
+            return std::make_shared<Connections>(*conn);
+        return conn;
+    }
+
     Key id;
-    std::mutex mutex;
-    std::map<Key, Signature> connections;
+    Mutex mutex;
+    std::shared_ptr<Connections> connections;
 };
 
+// For objects that stay on one thread, typically bound to one EventLoop
+template<typename Signature>
+using LocalSignal = Signal<Signature, false>;
+
 #endif
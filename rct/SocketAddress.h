@@ -0,0 +1,120 @@
+#ifndef SocketAddress_h
+#define SocketAddress_h
+
+#include <rct/String.h>
+#include <functional>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// An IPv4 or IPv6 address and port in binary form. Unlike a host String
+// it's compared, hashed and passed to sendto() without any conversion.
+class SocketAddress
+{
+public:
+    SocketAddress() { memset(&mAddress, '\0', sizeof(mAddress)); }
+    SocketAddress(const sockaddr* addr, socklen_t size)
+    {
+        memset(&mAddress, '\0', sizeof(mAddress));
+        if (size <= sizeof(mAddress) && (addr->sa_family == AF_INET || addr->sa_family == AF_INET6))
+            memcpy(&mAddress, addr, size);
+    }
+
+    // numeric addresses only, see DnsResolver for names
+    static SocketAddress fromString(const String& ip, uint16_t port = 0)
+    {
+        SocketAddress ret;
+        if (inet_pton(AF_INET, ip.constData(), &ret.mAddress.in4.sin_addr) == 1) {
+            ret.mAddress.in4.sin_family = AF_INET;
+        } else if (inet_pton(AF_INET6, ip.constData(), &ret.mAddress.in6.sin6_addr) == 1) {
+            ret.mAddress.in6.sin6_family = AF_INET6;
+        } else {
+            return SocketAddress();
+        }
+        ret.setPort(port);
+        return ret;
+    }
+
+    bool isValid() const { return mAddress.sa.sa_family == AF_INET || mAddress.sa.sa_family == AF_INET6; }
+    bool isIPv6() const { return mAddress.sa.sa_family == AF_INET6; }
+
+    uint16_t port() const { return ntohs(isIPv6() ? mAddress.in6.sin6_port : mAddress.in4.sin_port); }
+    void setPort(uint16_t port)
+    {
+        if (isIPv6()) {
+            mAddress.in6.sin6_port = htons(port);
+        } else {
+            mAddress.in4.sin_port = htons(port);
+        }
+    }
+
+    String toString() const
+    {
+        if (!isValid())
+            return String();
+        char ip[INET6_ADDRSTRLEN];
+        if (isIPv6()) {
+            inet_ntop(AF_INET6, &mAddress.in6.sin6_addr, ip, sizeof(ip));
+        } else {
+            inet_ntop(AF_INET, &mAddress.in4.sin_addr, ip, sizeof(ip));
+        }
+        return String(ip);
+    }
+
+    const sockaddr* sockAddr() const { return &mAddress.sa; }
+    socklen_t size() const
+    {
+        if (!isValid())
+            return 0;
+        return isIPv6() ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    }
+
+    // for recvfrom() and friends to fill in
+    sockaddr* data() { return &mAddress.sa; }
+    static socklen_t capacity() { return sizeof(Storage); }
+
+    bool operator==(const SocketAddress& other) const
+    {
+        return size() == other.size() && !memcmp(&mAddress, &other.mAddress, size());
+    }
+    bool operator!=(const SocketAddress& other) const { return !operator==(other); }
+    bool operator<(const SocketAddress& other) const
+    {
+        const socklen_t s = size(), o = other.size();
+        if (s != o)
+            return s < o;
+        return memcmp(&mAddress, &other.mAddress, s) < 0;
+    }
+
+private:
+    union Storage {
+        sockaddr sa;
+        sockaddr_in in4;
+        sockaddr_in6 in6;
+    } mAddress;
+};
+
+namespace std
+{
+template <> struct hash<SocketAddress>
+{
+    typedef SocketAddress argument_type;
+    typedef size_t result_type;
+
+    size_t operator()(const SocketAddress& value) const
+    {
+        // FNV-1a
+        size_t h = static_cast<size_t>(14695981039346656037ULL);
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(value.sockAddr());
+        for (socklen_t i = 0; i < value.size(); ++i) {
+            h ^= data[i];
+            h *= static_cast<size_t>(1099511628211ULL);
+        }
+        return h;
+    }
+};
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include "Rct.h"
 #include "EventLoop.h"
 #include "Log.h"
+#include "DnsResolver.h"
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,41 +11,69 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <rct-config.h>
+#ifdef HAVE_IO_URING
+#  include "IoUring.h"
+#endif
 
 #define eintrwrap(VAR, BLOCK)                   \
     do {                                        \
         VAR = BLOCK;                            \
     } while (VAR == -1 && errno == EINTR)
 
+static inline void setNoDelay(int fd)
+{
+    int flags = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(int));
+}
+
 SocketClient::SocketClient(unsigned int mode)
-    : fd(-1), socketPort(0), socketState(Disconnected), socketMode(None), wMode(Asynchronous), writeWait(false)
+    : fd(-1), socketPort(0), socketState(Disconnected), socketMode(None), wMode(Asynchronous), writeWait(false),
+      ioRead(0), ioWrite(0), writeOffset(0), frameOffset(0), corked(false),
+      frameBytes(0), ioWriteSize(0), writePosition(0), highMark(0), lowMark(0), pauseReadsWhenFull(false),
+      writeFull(false), readPaused(false), resolving(false), resolveId(0),
+      datagramCount(32), datagramSize(2048), readSize(BufferPool::MinSlab), readLimit(DefaultReadBudget),
+      readScheduled(false)
 {
     blocking = (mode & Blocking);
+    noDelay = (mode & NoDelay);
 }
 
 SocketClient::SocketClient(int f, unsigned int mode)
-    : fd(f), socketPort(0), socketState(Connected), socketMode(mode), wMode(Asynchronous), writeWait(false)
+    : fd(f), socketPort(0), socketState(Connected), socketMode(mode & ~Prepared), wMode(Asynchronous), writeWait(false),
+      ioRead(0), ioWrite(0), writeOffset(0), frameOffset(0), corked(false),
+      frameBytes(0), ioWriteSize(0), writePosition(0), highMark(0), lowMark(0), pauseReadsWhenFull(false),
+      writeFull(false), readPaused(false), resolving(false), resolveId(0),
+      datagramCount(32), datagramSize(2048), readSize(BufferPool::MinSlab), readLimit(DefaultReadBudget),
+      readScheduled(false)
 {
     assert(fd >= 0);
 #ifdef HAVE_NOSIGPIPE
     int flags = 1;
     ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
 #endif
+    if ((socketMode & (Tcp|NoDelay)) == (Tcp|NoDelay))
+        setNoDelay(fd);
 #ifdef HAVE_CLOEXEC
-    setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
+    if (!(mode & Prepared))
+        setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
     blocking = (mode & Blocking);
+    noDelay = (mode & NoDelay);
 
     if (!blocking) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->registerSocket(fd, EventLoop::SocketRead,
-                                 std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
-            if (!setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            if (!startIo()) {
+                loop->registerSocket(fd, EventLoop::SocketRead,
+                                     std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+            }
+            if (!(mode & Prepared) && !setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
                 signalError(shared_from_this(), InitializeError);
                 close();
                 return;
@@ -60,10 +89,18 @@ SocketClient::~SocketClient()
 
 void SocketClient::close()
 {
+    if (resolving) {
+        resolving = false;
+        writeWait = false;
+        socketState = Disconnected;
+    }
+    pendingDatagrams.clear();
+    closeFds();
     if (fd == -1)
         return;
     socketState = Disconnected;
     if (!blocking) {
+        stopIo();
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
             loop->unregisterSocket(fd);
     }
@@ -73,138 +110,80 @@ void SocketClient::close()
     fd = -1;
 }
 
-class Resolver
-{
-public:
-    Resolver();
-    Resolver(const String& host, uint16_t port, const SocketClient::SharedPtr& socket);
-    ~Resolver();
-
-    void resolve(const String& host, uint16_t port, const SocketClient::SharedPtr& socket);
-
-    addrinfo* res;
-    sockaddr* addr;
-    size_t size;
-};
-
-Resolver::Resolver()
-    : res(0), addr(0), size(0)
-{
-}
-
-Resolver::Resolver(const String& host, uint16_t port, const SocketClient::SharedPtr& socket)
-    : res(0), addr(0), size(0)
+bool SocketClient::connect(const String& host, uint16_t port)
 {
-    resolve(host, port, socket);
-}
+    SocketClient::SharedPtr tcpSocket = shared_from_this();
+    DnsResolver* resolver = DnsResolver::instance();
+    DnsResolver::Address addr;
+    DnsResolver::Result result = resolver->lookup(host, addr);
+    if (result == DnsResolver::Pending && (blocking || !EventLoop::eventLoop()))
+        result = resolver->resolve(host, addr) ? DnsResolver::Resolved : DnsResolver::Failed;
+    switch (result) {
+    case DnsResolver::Resolved:
+        return connectTo(host, port, addr);
+    case DnsResolver::Failed:
+        signalError(tcpSocket, DnsError);
+        close();
+        return false;
+    case DnsResolver::Pending:
+        break;
+    }
 
-void Resolver::resolve(const String& host, uint16_t port, const SocketClient::SharedPtr& socket)
-{
-    // first, see if this parses as an IP address
-    {
-        struct in_addr inaddr4;
-        struct in6_addr inaddr6;
-        struct { int af; void* dst; } addrs[2] = {
-            { AF_INET, &inaddr4 },
-            { AF_INET6, &inaddr6 }
-        };
-        for (int i = 0; i < 2; ++i) {
-            if (inet_pton(addrs[i].af, host.constData(), addrs[i].dst) == 1) {
-                // yes, use that
-                if (addrs[i].af == AF_INET) {
-                    sockaddr_in* newaddr = new sockaddr_in;
-                    memset(newaddr, '\0', sizeof(sockaddr_in));
-                    memcpy(&newaddr->sin_addr, &inaddr4, sizeof(struct in_addr));
-                    newaddr->sin_family = AF_INET;
-                    newaddr->sin_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in);
-                } else {
-                    assert(addrs[i].af == AF_INET6);
-                    sockaddr_in6* newaddr = new sockaddr_in6;
-                    memset(newaddr, '\0', sizeof(sockaddr_in6));
-                    memcpy(&newaddr->sin6_addr, &inaddr6, sizeof(struct in6_addr));
-                    newaddr->sin6_family = AF_INET6;
-                    newaddr->sin6_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in6);
-                }
+    // The name is looked up off the loop. Until it's known the socket is
+    // Connecting and writes are queued, then it either connects as usual
+    // or fails with DnsError.
+    const unsigned int id = ++resolveId;
+    resolving = true;
+    writeWait = true;
+    socketState = Connecting;
+    socketPort = port;
+    address = host;
+    SocketClient::WeakPtr weak = tcpSocket;
+    resolver->resolve(host, [weak, id, host, port](bool ok, const DnsResolver::Address& resolved) {
+            SocketClient::SharedPtr socket = weak.lock();
+            if (!socket || !socket->resolving || socket->resolveId != id)
+                return;
+            socket->resolving = false;
+            socket->writeWait = false;
+            if (!ok) {
+                socket->socketState = Disconnected;
+                socket->signalError(socket, DnsError);
                 return;
             }
-        }
-    }
-
-    // not an ip address, try to resolve it
-    addrinfo hints, *p;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // AF_INET or AF_INET6 to force version
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(host.constData(), NULL, &hints, &res) != 0) {
-        // bad
-        socket->signalError(socket, SocketClient::DnsError);
-        socket->close();
-        return;
-    }
-
-    for (p = res; p; p = p->ai_next) {
-        if (p->ai_family == AF_INET) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in*>(addr)->sin_port = htons(port);
-            size = sizeof(sockaddr_in);
-            break;
-        } else if (p->ai_family == AF_INET6) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in6*>(addr)->sin6_port = htons(port);
-            size = sizeof(sockaddr_in6);
-            break;
-        }
-    }
-
-    if (!addr) {
-        socket->signalError(socket, SocketClient::DnsError);
-        socket->close();
-        freeaddrinfo(res);
-        res = 0;
-        return;
-    }
-}
-
-Resolver::~Resolver()
-{
-    if (res)
-        freeaddrinfo(res); // free the linked list
-    else if (addr) {
-        if (size == sizeof(sockaddr_in))
-            delete reinterpret_cast<sockaddr_in*>(addr);
-        else
-            delete reinterpret_cast<sockaddr_in6*>(addr);
-    }
+            socket->connectTo(host, port, resolved);
+        });
+    return true;
 }
 
-bool SocketClient::connect(const String& host, uint16_t port)
+bool SocketClient::connectTo(const String& host, uint16_t port, SocketAddress addr)
 {
     SocketClient::SharedPtr tcpSocket = shared_from_this();
-    Resolver resolver(host, port, tcpSocket);
-    if (!resolver.addr)
-        return false;
+    addr.setPort(port);
 
     unsigned int mode = Tcp;
-    if (resolver.size == sizeof(sockaddr_in6))
+    if (addr.isIPv6())
         mode |= IPv6;
 
-    if (!init(mode))
+    if (!init(mode)) {
+        socketState = Disconnected;
         return false;
+    }
 
     int e;
-    eintrwrap(e, ::connect(fd, resolver.addr, resolver.size));
+    eintrwrap(e, ::connect(fd, addr.sockAddr(), addr.size()));
     socketPort = port;
     address = host;
     if (e == 0) { // we're done
         socketState = Connected;
+        if (!blocking && startIo()) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                loop->unregisterSocket(fd);
+        }
 
         signalConnected(tcpSocket);
+        // written while the name was being resolved
+        if (fd != -1 && ioLoop.expired() && pendingWrite())
+            write(0, 0);
     } else {
         if (errno != EINPROGRESS) {
             // bad
@@ -213,8 +192,8 @@ bool SocketClient::connect(const String& host, uint16_t port)
             return false;
         }
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
             writeWait = true;
+            loop->updateSocket(fd, pollMode());
         }
         socketState = Connecting;
     }
@@ -239,6 +218,10 @@ bool SocketClient::connect(const String& path)
     address = path;
     if (e == 0) { // we're done
         socketState = Connected;
+        if (!blocking && startIo()) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                loop->unregisterSocket(fd);
+        }
 
         signalConnected(unixSocket);
     } else {
@@ -249,8 +232,8 @@ bool SocketClient::connect(const String& path)
             return false;
         }
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
             writeWait = true;
+            loop->updateSocket(fd, pollMode());
         }
         socketState = Connecting;
     }
@@ -371,14 +354,292 @@ String SocketClient::sockName(uint16_t* port) const
     return getNameHelper(fd, ::getsockname, port);
 }
 
+void SocketClient::appendWrite(const unsigned char* data, unsigned int size)
+{
+    // bytes that have been sent are skipped rather than moved out of the
+    // way, the tail only moves down when the buffer would have to grow
+    if (writeOffset && writeBuffer.size() + size > writeBuffer.capacity())
+        compactWrite();
+    writeBuffer.reserve(writeBuffer.size() + size);
+    memcpy(writeBuffer.end(), data, size);
+    writeBuffer.resize(writeBuffer.size() + size);
+}
+
+void SocketClient::consumeWrite(unsigned int size)
+{
+    writeOffset += size;
+    assert(writeOffset <= writeBuffer.size());
+    if (writeOffset == writeBuffer.size()) {
+        writeBuffer.clear();
+        writeOffset = 0;
+    }
+}
+
+void SocketClient::compactWrite()
+{
+    if (!writeOffset)
+        return;
+    const unsigned int pending = writeBuffer.size() - writeOffset;
+    memmove(writeBuffer.data(), writeBuffer.data() + writeOffset, pending);
+    writeBuffer.resize(pending);
+    writeOffset = 0;
+}
+
 bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned char* data, unsigned int size)
+{
+    const bool ret = sendTo(host, port, data, size);
+    checkWatermarks();
+    return ret;
+}
+
+bool SocketClient::sendTo(const String& host, uint16_t port, const unsigned char* data, unsigned int size)
 {
     assert((!size) == (!data));
+#ifdef HAVE_IO_URING
+    if (!port && !ioLoop.expired()) {
+        // queued behind whatever is in flight, Synchronous
+        // doesn't apply to completion based sockets
+        if (size)
+            appendWrite(data, size);
+        return corked ? fd != -1 : submitIoWrite();
+    }
+#endif
+    if (!port && corked) {
+        // sent by uncork()
+        if (size) {
+            if (writeFrames.isEmpty()) {
+                appendWrite(data, size);
+            } else {
+                queueFrame(std::make_shared<const String>(reinterpret_cast<const char*>(data), size));
+            }
+        }
+        return isConnected();
+    }
+    if (!port && (!writeFrames.isEmpty() || !pendingFds.isEmpty())) {
+        // has to queue behind the frames, or go out in pieces that end
+        // where the next fds start
+        struct iovec vec;
+        vec.iov_base = const_cast<unsigned char*>(data);
+        vec.iov_len = size;
+        return writev(&vec, size ? 1 : 0);
+    }
+    if (port) {
+        // datagrams go out in order so once one has to wait for its
+        // host the ones after it wait too
+        DnsResolver* resolver = DnsResolver::instance();
+        DnsResolver::Address to;
+        DnsResolver::Result result = DnsResolver::Pending;
+        if (pendingDatagrams.isEmpty()) {
+            result = resolver->lookup(host, to);
+            if (result == DnsResolver::Pending && (blocking || !EventLoop::eventLoop()))
+                result = resolver->resolve(host, to) ? DnsResolver::Resolved : DnsResolver::Failed;
+        }
+        switch (result) {
+        case DnsResolver::Resolved:
+            to.setPort(port);
+            return sendData(&to, data, size);
+        case DnsResolver::Failed:
+            signalError(shared_from_this(), DnsError);
+            close();
+            return false;
+        case DnsResolver::Pending:
+            break;
+        }
+        if (fd == -1)
+            return false;
+        pendingDatagrams.push_back(PendingDatagram());
+        PendingDatagram& datagram = pendingDatagrams.back();
+        datagram.host = host;
+        datagram.port = port;
+        datagram.data.assign(reinterpret_cast<const char*>(data), size);
+        if (pendingDatagrams.size() == 1)
+            flushDatagrams();
+        return true;
+    }
+    return sendData(0, data, size);
+}
+
+void SocketClient::flushDatagrams()
+{
+    DnsResolver* resolver = DnsResolver::instance();
+    while (!pendingDatagrams.isEmpty() && fd != -1) {
+        const PendingDatagram& datagram = pendingDatagrams.front();
+        DnsResolver::Address to = datagram.address;
+        switch (datagram.host.isEmpty() ? DnsResolver::Resolved : resolver->lookup(datagram.host, to)) {
+        case DnsResolver::Pending: {
+            SocketClient::WeakPtr weak = shared_from_this();
+            resolver->resolve(datagram.host, [weak](bool, const DnsResolver::Address&) {
+                    if (SocketClient::SharedPtr socket = weak.lock())
+                        socket->flushDatagrams();
+                });
+            return; }
+        case DnsResolver::Failed:
+            pendingDatagrams.clear();
+            signalError(shared_from_this(), DnsError);
+            close();
+            return;
+        case DnsResolver::Resolved:
+            break;
+        }
+        to.setPort(datagram.port);
+        const PendingDatagram sending = std::move(pendingDatagrams.front());
+        pendingDatagrams.pop_front();
+        if (!sendData(&to, reinterpret_cast<const unsigned char*>(sending.data.constData()), sending.data.size()))
+            return;
+    }
+}
+
+bool SocketClient::writeTo(const SocketAddress& address, const unsigned char* data, unsigned int size)
+{
+    if (pendingDatagrams.isEmpty())
+        return sendData(&address, data, size);
+    if (fd == -1)
+        return false;
+    pendingDatagrams.push_back(PendingDatagram());
+    PendingDatagram& datagram = pendingDatagrams.back();
+    datagram.port = address.port();
+    datagram.address = address;
+    datagram.data.assign(reinterpret_cast<const char*>(data), size);
+    return true;
+}
+
+int SocketClient::writeTo(const Datagram* datagrams, int count)
+{
+    if (fd == -1)
+        return 0;
+    if (!pendingDatagrams.isEmpty()) {
+        for (int i = 0; i < count; ++i)
+            writeTo(datagrams[i].address, datagrams[i].data, datagrams[i].size);
+        return count;
+    }
+
+#ifdef HAVE_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+
     SocketClient::SharedPtr socketPtr = shared_from_this();
+    int sent = 0;
+    while (sent < count) {
+        int e;
+        unsigned int bytes = 0;
+#ifdef HAVE_SENDMMSG
+        mmsghdr msgs[MaxDatagramBatch];
+        struct iovec vecs[MaxDatagramBatch];
+        const int n = std::min<int>(count - sent, MaxDatagramBatch);
+        memset(msgs, '\0', n * sizeof(mmsghdr));
+        for (int i = 0; i < n; ++i) {
+            const Datagram& datagram = datagrams[sent + i];
+            vecs[i].iov_base = const_cast<unsigned char*>(datagram.data);
+            vecs[i].iov_len = datagram.size;
+            msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>(datagram.address.sockAddr());
+            msgs[i].msg_hdr.msg_namelen = datagram.address.size();
+            msgs[i].msg_hdr.msg_iov = &vecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        eintrwrap(e, ::sendmmsg(fd, msgs, n, sendFlags));
+        if (e > 0) {
+            for (int i = 0; i < e; ++i)
+                bytes += msgs[i].msg_len;
+        }
+#else
+        const Datagram& datagram = datagrams[sent];
+        eintrwrap(e, ::sendto(fd, datagram.data, datagram.size, sendFlags,
+                              datagram.address.sockAddr(), datagram.address.size()));
+        if (e != -1) {
+            bytes = e;
+            e = 1;
+        }
+#endif
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            // bad
+            signalError(socketPtr, WriteError);
+            close();
+            break;
+        }
+        sent += e;
+        signalBytesWritten(socketPtr, bytes);
+        if (fd == -1)
+            break;
+    }
+    return sent;
+}
+
+void SocketClient::setDatagramBatch(int count, unsigned int maxSize)
+{
+    assert(count > 0 && maxSize > 0);
+    datagramCount = std::min<int>(count, MaxDatagramBatch);
+    datagramSize = maxSize;
+    datagramBuffer.clear();
+}
 
-    Resolver resolver;
-    if (port != 0)
-        resolver.resolve(host, port, socketPtr);
+bool SocketClient::readDatagrams()
+{
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    datagramBuffer.reserve(datagramCount * datagramSize);
+    unsigned char* buffer = datagramBuffer.data();
+    Datagram datagrams[MaxDatagramBatch];
+#ifdef HAVE_RECVMMSG
+    mmsghdr msgs[MaxDatagramBatch];
+    struct iovec vecs[MaxDatagramBatch];
+#endif
+    // edge triggered, so until there's nothing left
+    for (;;) {
+        int e;
+#ifdef HAVE_RECVMMSG
+        memset(msgs, '\0', datagramCount * sizeof(mmsghdr));
+        for (int i = 0; i < datagramCount; ++i) {
+            vecs[i].iov_base = buffer + (i * datagramSize);
+            vecs[i].iov_len = datagramSize;
+            msgs[i].msg_hdr.msg_name = datagrams[i].address.data();
+            msgs[i].msg_hdr.msg_namelen = SocketAddress::capacity();
+            msgs[i].msg_hdr.msg_iov = &vecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        eintrwrap(e, ::recvmmsg(fd, msgs, datagramCount, MSG_DONTWAIT, 0));
+        for (int i = 0; i < e; ++i) {
+            datagrams[i].data = buffer + (i * datagramSize);
+            datagrams[i].size = std::min<unsigned int>(msgs[i].msg_len, datagramSize);
+        }
+#else
+        socklen_t fromLen = SocketAddress::capacity();
+        eintrwrap(e, ::recvfrom(fd, buffer, datagramSize, 0, datagrams[0].address.data(), &fromLen));
+        if (e != -1) {
+            datagrams[0].data = buffer;
+            datagrams[0].size = e;
+            e = 1;
+        }
+#endif
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            // bad
+            signalError(socketPtr, ReadError);
+            close();
+            return false;
+        }
+
+        signalReadyReadDatagrams(socketPtr, static_cast<const Datagram*>(datagrams), e);
+        if (!signalReadyReadFrom.isEmpty()) {
+            for (int i = 0; i < e && fd != -1; ++i) {
+                Buffer data;
+                data.reserve(datagrams[i].size);
+                memcpy(data.data(), datagrams[i].data, datagrams[i].size);
+                data.resize(datagrams[i].size);
+                signalReadyReadFrom(socketPtr, datagrams[i].address.toString(), datagrams[i].address.port(), std::move(data));
+            }
+        }
+        if (fd == -1)
+            return false;
+    }
+}
+
+bool SocketClient::sendData(const SocketAddress* to, const unsigned char* data, unsigned int size)
+{
+    SocketClient::SharedPtr socketPtr = shared_from_this();
 
     int e;
     unsigned int total = 0;
@@ -390,91 +651,74 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
 #endif
 
     if (!writeWait) {
-        if (!writeBuffer.isEmpty()) {
-            while (total < writeBuffer.size()) {
-                assert(writeBuffer.size() > total);
-                if (resolver.addr) {
-                    eintrwrap(e, ::sendto(fd, writeBuffer.data() + total, writeBuffer.size() - total,
-                                          sendFlags, resolver.addr, resolver.size));
-                } else {
-                    eintrwrap(e, ::write(fd, writeBuffer.data() + total, writeBuffer.size() - total));
-                }
-                if (e == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        if (wMode == Synchronous) {
-                            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                                if (total) {
-                                    if (total < writeBuffer.size()) {
-                                        memmove(writeBuffer.data(), writeBuffer.data() + total, writeBuffer.size() - total);
-                                    }
-                                    writeBuffer.resize(writeBuffer.size() - total);
-                                    total = 0;
-                                }
-                                if (loop->processSocket(fd) & EventLoop::SocketWrite)
-                                    break;
-                                if (fd == -1)
-                                    return false;
-                            }
-                        }
-                        assert(!writeWait);
+        while (writeOffset < writeBuffer.size()) {
+            const unsigned char* pending = writeBuffer.data() + writeOffset;
+            const unsigned int pendingSize = writeBuffer.size() - writeOffset;
+            if (to) {
+                eintrwrap(e, ::sendto(fd, pending, pendingSize, sendFlags, to->sockAddr(), to->size()));
+            } else {
+                eintrwrap(e, ::write(fd, pending, pendingSize));
+                if (e > 0)
+                    writePosition += e;
+            }
+            if (e == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (wMode == Synchronous) {
                         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
-                            writeWait = true;
+                            if (loop->processSocket(fd) & EventLoop::SocketWrite)
+                                break;
+                            if (fd == -1)
+                                return false;
                         }
-                        break;
-                    } else {
-                        // bad
-                        signalError(shared_from_this(), WriteError);
-                        close();
-                        return false;
                     }
+                    assert(!writeWait);
+                    if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                        writeWait = true;
+                        loop->updateSocket(fd, pollMode());
+                    }
+                    break;
+                } else {
+                    // bad
+                    signalError(shared_from_this(), WriteError);
+                    close();
+                    return false;
                 }
-                signalBytesWritten(socketPtr, e);
-                total += e;
-            }
-            if (total) {
-                assert(total <= writeBuffer.size());
-                if (total < writeBuffer.size()) {
-                    memmove(writeBuffer.data(), writeBuffer.data() + total, writeBuffer.size() - total);
-                }
-                writeBuffer.resize(writeBuffer.size() - total);
             }
+            consumeWrite(e);
+            signalBytesWritten(socketPtr, e);
         }
 
         if (fd == -1 || !data) {
             return fd != -1;
         }
-        total = 0;
 
         assert(data != 0 && size > 0);
 
         if (writeBuffer.isEmpty()) {
             for (;;) {
                 assert(size > total);
-                if (resolver.addr) {
+                if (to) {
                     eintrwrap(e, ::sendto(fd, data + total, size - total,
-                                          sendFlags, resolver.addr, resolver.size));
+                                          sendFlags, to->sockAddr(), to->size()));
                 } else {
                     eintrwrap(e, ::write(fd, data + total, size - total));
+                    if (e > 0)
+                        writePosition += e;
                 }
                 if (e == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
                         if (wMode == Synchronous) {
                             if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
                                 // store the rest
-                                const unsigned int rem = size - total;
-                                writeBuffer.reserve(writeBuffer.size() + rem);
-                                memcpy(writeBuffer.end(), data + total, rem);
-                                writeBuffer.resize(writeBuffer.size() + rem);
-
+                                appendWrite(data + total, size - total);
                                 (void)loop->processSocket(fd);
                                 return isConnected();
                             }
                         }
                         assert(!writeWait);
                         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
                             writeWait = true;
+                            loop->updateSocket(fd, pollMode());
                         }
                         break;
                     } else {
@@ -497,10 +741,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
 
     if (total < size) {
         // store the rest
-        const unsigned int rem = size - total;
-        writeBuffer.reserve(writeBuffer.size() + rem);
-        memcpy(writeBuffer.end(), data + total, rem);
-        writeBuffer.resize(writeBuffer.size() + rem);
+        appendWrite(data + total, size - total);
     }
     return true;
 }
@@ -510,25 +751,420 @@ bool SocketClient::write(const void *data, unsigned int size)
     return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size);
 }
 
-static String addrToString(const sockaddr* addr, bool IPv6)
+bool SocketClient::write(const std::shared_ptr<const String> &frame)
 {
-    String ip(INET6_ADDRSTRLEN, '\0');
-    if (IPv6) {
-        const sockaddr_in6* addr6 = reinterpret_cast<const sockaddr_in6*>(addr);
-        inet_ntop(AF_INET6, &addr6->sin6_addr, &ip[0], ip.size());
-    } else {
-        const sockaddr_in* addr4 = reinterpret_cast<const sockaddr_in*>(addr);
-        inet_ntop(AF_INET, &addr4->sin_addr, &ip[0], ip.size());
+    if (!frame || frame->isEmpty())
+        return write(0, 0);
+#ifdef HAVE_IO_URING
+    if (!ioLoop.expired())
+        return write(frame->constData(), frame->size());
+#endif
+    if (!isConnected())
+        return false;
+    queueFrame(frame);
+    return writev(0, 0);
+}
+
+bool SocketClient::writeFds(const int *fds, int count, const void *data, unsigned int size)
+{
+    if (!(socketMode & Unix) || !size || count < 0 || count > MaxFds || !isConnected())
+        return false;
+    if (count) {
+        PendingFds pending;
+        pending.position = writePosition + pendingWrite();
+        pending.fds.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            int copy;
+            eintrwrap(copy, ::fcntl(fds[i], F_DUPFD_CLOEXEC, 0));
+            if (copy == -1) {
+                for (int f : pending.fds)
+                    ::close(f);
+                return false;
+            }
+            pending.fds.append(copy);
+        }
+        pendingFds.push_back(std::move(pending));
+    }
+    struct iovec vec;
+    vec.iov_base = const_cast<void*>(data);
+    vec.iov_len = size;
+    return writev(&vec, 1);
+}
+
+List<int> SocketClient::takeFds(int count)
+{
+    List<int> ret;
+    if (count >= receivedFds.size()) {
+        std::swap(ret, receivedFds);
+    } else if (count > 0) {
+        ret.assign(receivedFds.begin(), receivedFds.begin() + count);
+        receivedFds.erase(receivedFds.begin(), receivedFds.begin() + count);
+    }
+    return ret;
+}
+
+void SocketClient::closeFds()
+{
+    for (const PendingFds &pending : pendingFds) {
+        for (int f : pending.fds)
+            ::close(f);
+    }
+    pendingFds.clear();
+    for (int f : receivedFds)
+        ::close(f);
+    receivedFds.clear();
+}
+
+int SocketClient::readData(unsigned char *data, unsigned int size)
+{
+    int e;
+    if (!(socketMode & Unix)) {
+        eintrwrap(e, ::read(fd, data, size));
+        return e;
+    }
+    struct iovec vec;
+    vec.iov_base = data;
+    vec.iov_len = size;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * MaxFds)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+#ifdef MSG_CMSG_CLOEXEC
+    const int flags = MSG_CMSG_CLOEXEC;
+#else
+    const int flags = 0;
+#endif
+    eintrwrap(e, ::recvmsg(fd, &msg, flags));
+    if (e == -1)
+        return e;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        const int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned char *fds = CMSG_DATA(cmsg);
+        for (int i = 0; i < count; ++i) {
+            int f;
+            memcpy(&f, fds + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+            setFlags(f, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+            receivedFds.append(f);
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+        ::error() << "SocketClient dropped file descriptors that didn't fit";
+    return e;
+}
+
+void SocketClient::queueFrame(const std::shared_ptr<const String> &frame)
+{
+    writeFrames.push_back(frame);
+    frameBytes += frame->size();
+}
+
+void SocketClient::setWatermarks(unsigned int high, unsigned int low, bool pauseReads)
+{
+    assert(!high || low < high);
+    highMark = high;
+    lowMark = low;
+    pauseReadsWhenFull = pauseReads;
+    if (!high && writeFull) {
+        writeFull = false;
+        updatePollMode();
+    }
+    checkWatermarks();
+}
+
+void SocketClient::checkWatermarks()
+{
+    if (!highMark || !isConnected())
+        return;
+    const unsigned int pending = pendingWrite();
+    if (!writeFull && pending >= highMark) {
+        writeFull = true;
+        if (pauseReadsWhenFull)
+            updatePollMode();
+        signalWriteBufferFull(shared_from_this());
+    } else if (writeFull && pending <= lowMark) {
+        writeFull = false;
+        if (pauseReadsWhenFull)
+            updatePollMode();
+        signalWriteBufferDrained(shared_from_this());
+    }
+}
+
+void SocketClient::setReadEnabled(bool on)
+{
+    if (readPaused != on)
+        return;
+    readPaused = !on;
+    updatePollMode();
+}
+
+unsigned int SocketClient::pollMode() const
+{
+    unsigned int mode = isReadEnabled() ? EventLoop::SocketRead : 0;
+    if (writeWait)
+        mode |= EventLoop::SocketWrite|EventLoop::SocketOneShot;
+    return mode;
+}
+
+void SocketClient::updatePollMode()
+{
+    if (fd == -1 || blocking)
+        return;
+#ifdef HAVE_IO_URING
+    if (!ioLoop.expired()) {
+        // a read that's already been submitted isn't cancelled since
+        // whatever it has received would be lost, it's just not renewed
+        if (isReadEnabled() && !ioRead)
+            submitIoRead();
+        return;
+    }
+#endif
+    if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+        loop->updateSocket(fd, pollMode());
+}
+
+void SocketClient::cork()
+{
+    corked = true;
+}
+
+bool SocketClient::uncork()
+{
+    if (!corked)
+        return isConnected();
+    corked = false;
+    return write(0, 0);
+}
+
+bool SocketClient::writev(const struct iovec* vecs, int count, bool more)
+{
+    const bool ret = sendv(vecs, count, more);
+    checkWatermarks();
+    return ret;
+}
+
+bool SocketClient::sendv(const struct iovec* vecs, int count, bool more)
+{
+    unsigned int size = 0;
+    for (int i = 0; i < count; ++i)
+        size += vecs[i].iov_len;
+    if (!size && writeFrames.isEmpty() && pendingFds.isEmpty())
+        return write(0, 0);
+
+    if (!isConnected())
+        return false;
+
+#ifdef HAVE_IO_URING
+    if (!ioLoop.expired()) {
+        for (int i = 0; i < count; ++i) {
+            if (vecs[i].iov_len)
+                appendWrite(static_cast<const unsigned char*>(vecs[i].iov_base), vecs[i].iov_len);
+        }
+        return corked ? true : submitIoWrite();
+    }
+#endif
+
+    // Queued data is always sent before the new segments, writeBuffer
+    // before writeFrames. Everything goes out in as few writev() calls as
+    // possible and only the unsent part of the new segments is copied.
+    enum { MaxSegments = 64 };
+    struct iovec out[MaxSegments];
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    int first = 0;
+    size_t skip = 0; // bytes of vecs[first] that have been written
+    bool blocked = false;
+    int e;
+    while (!writeWait && !corked) {
+        int n = 0;
+        unsigned int queued = 0;
+        if (writeOffset < writeBuffer.size()) {
+            queued = writeBuffer.size() - writeOffset;
+            out[n].iov_base = writeBuffer.data() + writeOffset;
+            out[n++].iov_len = queued;
+        }
+        unsigned int offset = frameOffset;
+        for (PooledLinkedList<std::shared_ptr<const String> >::const_iterator it = writeFrames.begin();
+             it != writeFrames.end() && n < MaxSegments; ++it) {
+            out[n].iov_base = const_cast<char*>((*it)->constData()) + offset;
+            out[n++].iov_len = (*it)->size() - offset;
+            offset = 0;
+        }
+        for (int i = first; i < count && n < MaxSegments; ++i) {
+            const size_t off = (i == first ? skip : 0);
+            if (vecs[i].iov_len == off)
+                continue;
+            out[n].iov_base = static_cast<char*>(vecs[i].iov_base) + off;
+            out[n++].iov_len = vecs[i].iov_len - off;
+        }
+        if (n == 0)
+            break;
+        // fds go with the first byte of a write that stops short of the
+        // next ones, which the receiving end won't read past in one go
+        bool withFds = false;
+        if (!pendingFds.isEmpty()) {
+            LinkedList<PendingFds>::const_iterator next = pendingFds.begin();
+            if (next->position == writePosition) {
+                withFds = true;
+                ++next;
+            }
+            if (next != pendingFds.end()) {
+                uint64_t limit = next->position - writePosition;
+                for (int i = 0; i < n; ++i) {
+                    if (out[i].iov_len >= limit) {
+                        out[i].iov_len = limit;
+                        n = i + 1;
+                        break;
+                    }
+                    limit -= out[i].iov_len;
+                }
+            }
+        }
+        if (withFds) {
+            const List<int> &fds = pendingFds.front().fds;
+            union {
+                char buffer[CMSG_SPACE(sizeof(int) * MaxFds)];
+                struct cmsghdr align;
+            } control;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = out;
+            msg.msg_iovlen = n;
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+            eintrwrap(e, ::sendmsg(fd, &msg, 0));
+            if (e > 0) {
+                for (int f : fds)
+                    ::close(f);
+                pendingFds.pop_front();
+            }
+#ifdef MSG_MORE
+        } else if (more && (socketMode & Tcp)) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = out;
+            msg.msg_iovlen = n;
+            eintrwrap(e, ::sendmsg(fd, &msg, MSG_MORE));
+#endif
+        } else {
+            eintrwrap(e, ::writev(fd, out, n));
+        }
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked = true;
+                break;
+            }
+            // bad
+            signalError(socketPtr, WriteError);
+            close();
+            return false;
+        }
+
+        writePosition += e;
+        unsigned int written = e;
+        if (queued) {
+            const unsigned int fromQueue = std::min(written, queued);
+            consumeWrite(fromQueue);
+            written -= fromQueue;
+        }
+        while (written && !writeFrames.isEmpty()) {
+            const unsigned int rem = writeFrames.front()->size() - frameOffset;
+            if (written < rem) {
+                frameOffset += written;
+                frameBytes -= written;
+                written = 0;
+            } else {
+                written -= rem;
+                frameOffset = 0;
+                frameBytes -= rem;
+                writeFrames.pop_front();
+            }
+        }
+        while (written && first < count) {
+            const size_t rem = vecs[first].iov_len - skip;
+            if (written < rem) {
+                skip += written;
+                written = 0;
+            } else {
+                written -= rem;
+                skip = 0;
+                ++first;
+            }
+        }
+        signalBytesWritten(socketPtr, e);
+        if (fd == -1)
+            return false;
+    }
+
+    for (int i = first; i < count; ++i) {
+        const size_t off = (i == first ? skip : 0);
+        if (vecs[i].iov_len == off)
+            continue;
+        const char *data = static_cast<const char*>(vecs[i].iov_base) + off;
+        if (writeFrames.isEmpty()) {
+            appendWrite(reinterpret_cast<const unsigned char*>(data), vecs[i].iov_len - off);
+        } else {
+            queueFrame(std::make_shared<const String>(data, vecs[i].iov_len - off));
+        }
+    }
+    if (blocked) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            if (wMode == Synchronous) {
+                (void)loop->processSocket(fd);
+                return isConnected();
+            }
+            writeWait = true;
+            loop->updateSocket(fd, pollMode());
+        }
+    }
+    return true;
+}
+
+void SocketClient::setReadBudget(unsigned int bytes)
+{
+    readLimit = bytes;
+}
+
+void SocketClient::adaptReadSize(unsigned int total)
+{
+    // double while reads fill their slab, halve when they use a quarter
+    if (total >= readSize && readSize < BufferPool::MaxSlab) {
+        readSize *= 2;
+    } else if (total < readSize / 4 && readSize > BufferPool::MinSlab) {
+        readSize /= 2;
     }
-    ip.resize(strlen(ip.constData()));
-    return ip;
 }
 
-static uint16_t addrToPort(const sockaddr* addr, bool IPv6)
+void SocketClient::scheduleRead()
 {
-    if (IPv6)
-        return ntohs(reinterpret_cast<const sockaddr_in6*>(addr)->sin6_port);
-    return ntohs(reinterpret_cast<const sockaddr_in*>(addr)->sin_port);
+    // the socket is edge triggered, it won't say again that there's
+    // data before the rest has been read
+    if (readScheduled)
+        return;
+    if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+        readScheduled = true;
+        const std::weak_ptr<SocketClient> weak = shared_from_this();
+        loop->callLater([weak]() {
+                if (SocketClient::SharedPtr client = weak.lock()) {
+                    client->readScheduled = false;
+                    if (client->fd != -1 && client->isReadEnabled())
+                        client->socketCallback(client->fd, EventLoop::SocketRead);
+                }
+            });
+    }
 }
 
 void SocketClient::socketCallback(int f, int mode)
@@ -546,79 +1182,69 @@ void SocketClient::socketCallback(int f, int mode)
 
     if (writeWait && (mode & EventLoop::SocketWrite)) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead);
             writeWait = false;
+            loop->updateSocket(fd, pollMode());
         }
     }
 
-    sockaddr_in fromAddr4;
-    sockaddr_in6 fromAddr6;
-    sockaddr* fromAddr = 0;
-    socklen_t fromLen = 0;
-    const bool isIPv6 = socketMode & IPv6;
-
     if (mode & EventLoop::SocketRead) {
-
-        enum { BlockSize = 1024, AllocateAt = 512 };
-        int e;
-
-        unsigned int total = 0;
-        for(;;) {
-            unsigned int rem = readBuffer.capacity() - readBuffer.size();
-            // printf("reading, remaining size %u\n", rem);
-            if (rem <= AllocateAt) {
-                // printf("allocating more\n");
-                readBuffer.reserve(readBuffer.size() + BlockSize);
-                rem = readBuffer.capacity() - readBuffer.size();
-                // printf("Rem is now %d\n", rem);
-            }
-            if (socketMode & Udp) {
-                if (isIPv6) {
-                    fromLen = sizeof(fromAddr6);
-                    fromAddr = reinterpret_cast<sockaddr*>(&fromAddr6);
-                    eintrwrap(e, ::recvfrom(fd, readBuffer.end(), rem, 0, fromAddr, &fromLen));
-                } else {
-                    fromLen = sizeof(fromAddr4);
-                    fromAddr = reinterpret_cast<sockaddr*>(&fromAddr4);
-                    eintrwrap(e, ::recvfrom(fd, readBuffer.end(), rem, 0, fromAddr, &fromLen));
+        if (socketMode & Udp) {
+            if (!readDatagrams())
+                return;
+        } else {
+            enum { AllocateAt = 512 };
+            int e;
+
+            unsigned int total = 0;
+            bool more = false;
+            for(;;) {
+                unsigned int rem = readBuffer.capacity() - readBuffer.size();
+                if (rem <= AllocateAt) {
+                    // what's left from before has to grow, a fresh buffer
+                    // gets a slab sized by how much the last reads brought
+                    if (!readBuffer.capacity()) {
+                        BufferPool::take(readBuffer, readSize);
+                    } else {
+                        readBuffer.reserve(readBuffer.size() + readSize);
+                    }
+                    rem = readBuffer.capacity() - readBuffer.size();
                 }
-            } else {
-                eintrwrap(e, ::read(fd, readBuffer.end(), rem));
-            }
-            if (e == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;
-                } else {
-                    // bad
-                    signalError(socketPtr, ReadError);
+                e = readData(readBuffer.end(), rem);
+                if (e == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    } else {
+                        // bad
+                        signalError(socketPtr, ReadError);
+                        close();
+                        return;
+                    }
+                } else if (e == 0) {
+                    // socket closed
+                    if (total)
+                        signalReadyRead(socketPtr, std::move(readBuffer));
+                    signalDisconnected(socketPtr);
                     close();
                     return;
+                } else {
+                    total += e;
+                    readBuffer.resize(readBuffer.size() + e);
+                    if (readLimit && total >= readLimit && !blocking) {
+                        more = true;
+                        break;
+                    }
                 }
-            } else if (e == 0) {
-                // socket closed
-                if (total) {
-                    if (!fromLen)
-                        signalReadyRead(socketPtr, std::move(readBuffer));
-                }
-                signalDisconnected(socketPtr);
-                close();
-                return;
-            } else if (fromLen) {
-                readBuffer.resize(e);
-                signalReadyReadFrom(socketPtr, addrToString(fromAddr, isIPv6), addrToPort(fromAddr, isIPv6), std::move(readBuffer));
-                readBuffer.clear();
-            } else {
-                total += e;
-                readBuffer.resize(total);
             }
+            adaptReadSize(total);
+            if (total)
+                signalReadyRead(socketPtr, std::move(readBuffer));
+            if (more && fd != -1)
+                scheduleRead();
         }
-        assert(total <= readBuffer.capacity());
-        if (!fromLen)
-            signalReadyRead(socketPtr, std::move(readBuffer));
 
         if (writeWait) {
             if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                loop->updateSocket(fd, pollMode());
             }
         }
     }
@@ -636,6 +1262,11 @@ void SocketClient::socketCallback(int f, int mode)
             if (!err) {
                 // connected
                 socketState = Connected;
+                if (startIo()) {
+                    if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                        loop->unregisterSocket(fd);
+                    writeWait = false;
+                }
                 signalConnected(socketPtr);
             } else {
                 // failed to connect
@@ -648,6 +1279,121 @@ void SocketClient::socketCallback(int f, int mode)
     }
 }
 
+bool SocketClient::startIo()
+{
+#ifdef HAVE_IO_URING
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    // io_uring reads would lose the fds UNIX sockets can carry
+    if (!loop || !loop->ioUring() || fd == -1 || blocking || (socketMode & (Udp|Unix)))
+        return false;
+    assert(ioLoop.expired());
+    ioLoop = loop;
+    // io_uring takes ownership of what it writes, so queued frames
+    // are copied
+    for (const std::shared_ptr<const String> &frame : writeFrames) {
+        appendWrite(reinterpret_cast<const unsigned char*>(frame->constData()) + frameOffset, frame->size() - frameOffset);
+        frameOffset = 0;
+    }
+    writeFrames.clear();
+    frameBytes = 0;
+    if (isReadEnabled())
+        submitIoRead();
+    if (!writeBuffer.isEmpty() && !corked)
+        submitIoWrite();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SocketClient::stopIo()
+{
+#ifdef HAVE_IO_URING
+    if (EventLoop::SharedPtr loop = ioLoop.lock()) {
+        if (ioRead)
+            loop->ioUring()->cancel(ioRead);
+        if (ioWrite)
+            loop->ioUring()->cancel(ioWrite);
+    }
+    ioLoop.reset();
+    ioRead = ioWrite = 0;
+#endif
+}
+
+void SocketClient::submitIoRead()
+{
+#ifdef HAVE_IO_URING
+    assert(!ioRead);
+    if (EventLoop::SharedPtr loop = ioLoop.lock()) {
+        ioRead = loop->ioUring()->read(fd, std::bind(&SocketClient::ioReadFinished, this,
+                                                     std::placeholders::_1, std::placeholders::_2));
+    }
+#endif
+}
+
+bool SocketClient::submitIoWrite()
+{
+#ifdef HAVE_IO_URING
+    if (fd == -1)
+        return false;
+    if (ioWrite || writeBuffer.isEmpty())
+        return true;
+    if (EventLoop::SharedPtr loop = ioLoop.lock()) {
+        compactWrite();
+        ioWriteSize = writeBuffer.size();
+        ioWrite = loop->ioUring()->write(fd, std::move(writeBuffer),
+                                         std::bind(&SocketClient::ioWriteFinished, this, std::placeholders::_1));
+        if (ioWrite)
+            return true;
+    }
+    signalError(shared_from_this(), WriteError);
+    close();
+#endif
+    return false;
+}
+
+void SocketClient::ioReadFinished(int result, const unsigned char* data)
+{
+    ioRead = 0;
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    if (result > 0) {
+        if (!readBuffer.capacity()) {
+            BufferPool::take(readBuffer, result);
+        } else {
+            readBuffer.reserve(readBuffer.size() + result);
+        }
+        memcpy(readBuffer.end(), data, result);
+        readBuffer.resize(readBuffer.size() + result);
+        signalReadyRead(socketPtr, std::move(readBuffer));
+        if (fd != -1 && !ioRead && isReadEnabled())
+            submitIoRead();
+    } else if (!result) {
+        signalDisconnected(socketPtr);
+        close();
+    } else {
+        errno = -result;
+        signalError(socketPtr, ReadError);
+        close();
+    }
+}
+
+void SocketClient::ioWriteFinished(int result)
+{
+    ioWrite = 0;
+    ioWriteSize = 0;
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    if (result < 0) {
+        errno = -result;
+        signalError(socketPtr, WriteError);
+        close();
+        return;
+    }
+    signalBytesWritten(socketPtr, result);
+    if (!corked)
+        submitIoWrite();
+    checkWatermarks();
+}
+
 bool SocketClient::init(unsigned int mode)
 {
     int domain = -1, type = -1;
@@ -672,6 +1418,8 @@ bool SocketClient::init(unsigned int mode)
         // bad
         return false;
     }
+    if ((mode & (Udp|Tcp|Unix)) == Tcp && noDelay)
+        setNoDelay(fd);
 #ifdef HAVE_NOSIGPIPE
     int flags = 1;
     ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
@@ -690,7 +1438,7 @@ bool SocketClient::init(unsigned int mode)
         }
     }
 
-    socketMode = mode;
+    socketMode = mode | (noDelay ? NoDelay : 0);
     return true;
 }
 
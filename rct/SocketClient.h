@@ -4,7 +4,12 @@
 #include "SignalSlot.h"
 #include "Buffer.h"
 #include "String.h"
+#include "LinkedList.h"
+#include "List.h"
+#include "DnsResolver.h"
+#include "SocketAddress.h"
 #include <memory>
+#include <sys/uio.h>
 
 class SocketClient : public std::enable_shared_from_this<SocketClient>
 {
@@ -18,20 +23,28 @@ public:
         Udp = 0x2,
         Unix = 0x4,
         IPv6 = 0x8,
-        Blocking = 0x10
+        Blocking = 0x10,
+        // the fd passed to the constructor is already non-blocking and
+        // close-on-exec, as accept4() makes it
+        Prepared = 0x20,
+        // TCP_NODELAY, for request/response traffic that can't wait for the
+        // peer's delayed ack
+        NoDelay = 0x40
     };
 
     SocketClient(unsigned int mode = 0);
     SocketClient(int fd, unsigned int mode);
     ~SocketClient();
 
-    int takeFD() { const int f = fd; fd = -1; return f; }
+    int takeFD() { stopIo(); const int f = fd; fd = -1; return f; }
 
     enum State { Disconnected, Connecting, Connected };
     State state() const { return socketState; }
     unsigned int mode() const { return socketMode; }
 
     bool connect(const String& path); // UNIX
+    // Names that aren't cached are resolved off the loop, connected() or
+    // error() with DnsError follows. Blocking sockets resolve in place.
     bool connect(const String& host, uint16_t port); // TCP
     bool bind(uint16_t port); // UDP
 
@@ -39,7 +52,8 @@ public:
     String path() const { return (socketMode & Unix ? address : String()); }
     uint16_t port() const { return socketPort; }
 
-    bool isConnected() const { return fd != -1; }
+    // also true while the host name of a connect() is being resolved
+    bool isConnected() const { return fd != -1 || resolving; }
     int socket() const { return fd; }
 
     enum WriteMode {
@@ -54,6 +68,51 @@ public:
     // TCP/UNIX
     bool write(const void *data, unsigned int num);
     bool write(const String &data) { return write(&data[0], data.size()); }
+    // gathers the segments, and anything still queued, into one writev()
+    // more means the rest of the message follows right away, TCP holds the
+    // last partial segment back (MSG_MORE) until a write without it
+    bool writev(const struct iovec* vecs, int count, bool more = false);
+    // Queues frame by reference rather than copying what the kernel
+    // doesn't take right away. frame must not change once it's been passed.
+    bool write(const std::shared_ptr<const String> &frame);
+
+    // UNIX. The fds are sent along with the first byte of data, which
+    // mustn't be empty, after anything that's already queued. They're
+    // dup()ed, the caller keeps its own. At most MaxFds at a time.
+    enum { MaxFds = 253 };
+    bool writeFds(const int *fds, int count, const void *data, unsigned int size);
+
+    // fds that came with what has been read so far, in the order they were
+    // sent. They belong to the client, and are closed with it, until
+    // they're taken.
+    int receivedFdCount() const { return receivedFds.size(); }
+    List<int> takeFds(int count);
+
+    // While corked, stream writes are only queued. uncork() sends
+    // everything queued in as few writev() calls as the kernel allows.
+    void cork();
+    bool uncork();
+    bool isCorked() const { return corked; }
+
+    // Bytes that have been written but not yet taken by the kernel
+    unsigned int pendingWrite() const { return writeBuffer.size() - writeOffset + frameBytes + ioWriteSize; }
+
+    // writeBufferFull() is emitted when pendingWrite() reaches high and
+    // writeBufferDrained() when it's back down to low. With pauseReads,
+    // reading stops while the buffer is full so a peer that doesn't take
+    // its responses can't make us queue more, see setReadEnabled() for
+    // io_uring sockets. high 0 turns it off.
+    void setWatermarks(unsigned int high, unsigned int low, bool pauseReads = false);
+    unsigned int highWatermark() const { return highMark; }
+    unsigned int lowWatermark() const { return lowMark; }
+    bool isWriteBufferFull() const { return writeFull; }
+
+    // Stops or resumes reading, the socket stays registered for errors
+    // and for writing. On io_uring sockets a read that's already been
+    // submitted isn't cancelled, so what it receives, one buffer at most,
+    // is still delivered after reading was turned off.
+    void setReadEnabled(bool on);
+    bool isReadEnabled() const { return !readPaused && !(pauseReadsWhenFull && writeFull); }
 
     String peerName(uint16_t* port = 0) const;
     String peerString() const
@@ -76,12 +135,36 @@ public:
         return String();
     }
 
-    // UDP
+    // Stream sockets read at most this many bytes per event before they
+    // let the other sockets on the loop have a go, 0 reads until there's
+    // nothing left. Reads go into slabs from BufferPool, sized after how
+    // much the last few events brought.
+    enum { DefaultReadBudget = 512 * 1024 };
+    void setReadBudget(unsigned int bytes);
+    unsigned int readBudget() const { return readLimit; }
+
+    // UDP, datagrams to hosts that have to be resolved are queued until
+    // the name is known
     bool writeTo(const String& host, uint16_t port, const unsigned char* data, unsigned int num);
     bool writeTo(const String& host, uint16_t port, const String& data)
     {
         return writeTo(host, port, reinterpret_cast<const unsigned char*>(&data[0]), data.size());
     }
+    bool writeTo(const SocketAddress& address, const unsigned char* data, unsigned int num);
+
+    struct Datagram
+    {
+        SocketAddress address;
+        const unsigned char* data;
+        unsigned int size;
+    };
+    // Sends each datagram to its address in as few sendmmsg() calls as
+    // possible. Returns how many were sent, the rest would have blocked.
+    int writeTo(const Datagram* datagrams, int count);
+
+    // Datagrams are received count at a time, into slots of maxSize bytes.
+    // Longer ones are truncated.
+    void setDatagramBatch(int count, unsigned int maxSize);
 
     // UDP Multicast
     bool addMembership(const String& ip);
@@ -94,9 +177,13 @@ public:
 
     Signal<std::function<void(const SocketClient::SharedPtr&, Buffer&&)> >& readyRead() { return signalReadyRead; }
     Signal<std::function<void(const SocketClient::SharedPtr&, const String&, uint16_t, Buffer&&)> >& readyReadFrom() { return signalReadyReadFrom; }
+    // everything one recvmmsg() returned, the data is only valid during the call
+    Signal<std::function<void(const SocketClient::SharedPtr&, const Datagram*, int)> >& readyReadDatagrams() { return signalReadyReadDatagrams; }
     Signal<std::function<void(const SocketClient::SharedPtr&)> >& connected() { return signalConnected; }
     Signal<std::function<void(const SocketClient::SharedPtr&)> >& disconnected() { return signalDisconnected; }
     Signal<std::function<void(const SocketClient::SharedPtr&, int)> >& bytesWritten() { return signalBytesWritten; }
+    Signal<std::function<void(const SocketClient::SharedPtr&)> >& writeBufferFull() { return signalWriteBufferFull; }
+    Signal<std::function<void(const SocketClient::SharedPtr&)> >& writeBufferDrained() { return signalWriteBufferDrained; }
 
     enum Error {
         InitializeError,
@@ -115,6 +202,15 @@ public:
 private:
     bool init(unsigned int mode);
 
+    // Completion based I/O through the loop's io_uring for connected
+    // stream sockets, see EventLoop::EnableIoUring
+    bool startIo();
+    void stopIo();
+    void submitIoRead();
+    bool submitIoWrite();
+    void ioReadFinished(int result, const unsigned char* data);
+    void ioWriteFinished(int result);
+
     int fd;
     uint16_t socketPort;
     State socketState;
@@ -122,19 +218,83 @@ private:
     WriteMode wMode;
     bool writeWait;
     String address;
-    bool blocking;
+    bool blocking, noDelay;
+    EventLoop::WeakPtr ioLoop;
+    uint64_t ioRead, ioWrite;
 
     Signal<std::function<void(const SocketClient::SharedPtr&, Buffer&&)> > signalReadyRead;
     Signal<std::function<void(const SocketClient::SharedPtr&, const String&, uint16_t, Buffer&&)> > signalReadyReadFrom;
+    Signal<std::function<void(const SocketClient::SharedPtr&, const Datagram*, int)> > signalReadyReadDatagrams;
     Signal<std::function<void(const SocketClient::SharedPtr&)> >signalConnected, signalDisconnected;
+    Signal<std::function<void(const SocketClient::SharedPtr&)> > signalWriteBufferFull, signalWriteBufferDrained;
     Signal<std::function<void(const SocketClient::SharedPtr&, Error)> > signalError;
     Signal<std::function<void(const SocketClient::SharedPtr&, int)> > signalBytesWritten;
     Buffer readBuffer, writeBuffer;
+    // bytes at the front of writeBuffer that have already been sent
+    unsigned int writeOffset;
+    // queued after writeBuffer, frameOffset is how much of the first
+    // frame has been sent
+    PooledLinkedList<std::shared_ptr<const String> > writeFrames;
+    unsigned int frameOffset;
+    bool corked;
+    // bytes in writeFrames past frameOffset, and in the io_uring write
+    unsigned int frameBytes, ioWriteSize;
+    // stream bytes written so far, and the writeFds() that are still
+    // queued by the position of the byte they go with
+    uint64_t writePosition;
+    struct PendingFds
+    {
+        uint64_t position;
+        List<int> fds;
+    };
+    LinkedList<PendingFds> pendingFds;
+    List<int> receivedFds;
+    unsigned int highMark, lowMark;
+    bool pauseReadsWhenFull, writeFull, readPaused;
+    // connect() waiting for DnsResolver, resolveId tells stale answers apart
+    bool resolving;
+    unsigned int resolveId;
+    // host is empty when address is already known
+    struct PendingDatagram
+    {
+        String host;
+        uint16_t port;
+        SocketAddress address;
+        String data;
+    };
+    LinkedList<PendingDatagram> pendingDatagrams;
+
+    bool connectTo(const String& host, uint16_t port, SocketAddress addr);
+    bool sendData(const SocketAddress* to, const unsigned char* data, unsigned int size);
+    void flushDatagrams();
+    enum { MaxDatagramBatch = 64 };
+    int datagramCount;
+    unsigned int datagramSize;
+    Buffer datagramBuffer;
+    bool readDatagrams();
+
+    // the slab size for the next read event, see adaptReadSize()
+    unsigned int readSize, readLimit;
+    bool readScheduled;
+    void adaptReadSize(unsigned int total);
+    void scheduleRead();
+
+    bool sendTo(const String& host, uint16_t port, const unsigned char* data, unsigned int size);
+    bool sendv(const struct iovec* vecs, int count, bool more);
+    void queueFrame(const std::shared_ptr<const String> &frame);
+    void checkWatermarks();
+    unsigned int pollMode() const;
+    void updatePollMode();
+
+    void appendWrite(const unsigned char* data, unsigned int size);
+    void consumeWrite(unsigned int size);
+    void compactWrite();
 
     int writeData(const unsigned char *data, int size);
+    // read() that keeps the fds of UNIX sockets
+    int readData(unsigned char *data, unsigned int size);
+    void closeFds();
     void socketCallback(int, int);
-
-    friend class Resolver;
 };
 
 #endif
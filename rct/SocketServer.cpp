@@ -20,7 +20,7 @@
     } while (VAR == -1 && errno == EINTR)
 
 SocketServer::SocketServer()
-    : fd(-1), isIPv6(false)
+    : fd(-1), isIPv6(false), noDelay(false), listenBacklog(128), maxAccepts(64)
 {}
 
 SocketServer::~SocketServer()
@@ -42,11 +42,12 @@ void SocketServer::close()
     }
 }
 
-bool SocketServer::listen(uint16_t port, Mode mode)
+bool SocketServer::listen(uint16_t port, unsigned int mode)
 {
     close();
 
     isIPv6 = (mode & IPv6);
+    noDelay = (mode & NoDelay);
 
     fd = ::socket(isIPv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -73,6 +74,19 @@ bool SocketServer::listen(uint16_t port, Mode mode)
         close();
         return false;
     }
+    if (mode & ReusePort) {
+#ifdef HAVE_REUSEPORT
+        flags = 1;
+        e = ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flags, sizeof(int));
+#else
+        e = -1;
+#endif
+        if (e == -1) {
+            serverError(this, InitializeError);
+            close();
+            return false;
+        }
+    }
 #ifdef HAVE_CLOEXEC
     SocketClient::setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
@@ -149,9 +163,7 @@ bool SocketServer::commonBindAndListen(sockaddr* addr, size_t size)
 
 bool SocketServer::commonListen()
 {
-    // ### should be able to customize the backlog
-    enum { Backlog = 128 };
-    if (::listen(fd, Backlog) < 0) {
+    if (::listen(fd, listenBacklog) < 0) {
         fprintf(stderr, "::listen() failed with errno: %s\n",
                 Rct::strerror().constData());
 
@@ -161,7 +173,9 @@ bool SocketServer::commonListen()
     }
 
     if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-        loop->registerSocket(fd, EventLoop::SocketRead,
+        // level triggered so that what's left after acceptLimit()
+        // is reported again
+        loop->registerSocket(fd, EventLoop::SocketRead|EventLoop::SocketLevelTriggered,
                              //|EventLoop::SocketWrite,
                              std::bind(&SocketServer::socketCallback,
                                        this,
@@ -177,13 +191,37 @@ bool SocketServer::commonListen()
     return true;
 }
 
+#ifdef HAVE_ACCEPT4
+// accept4() already made it non-blocking and close-on-exec
+static const unsigned int AcceptedMode = SocketClient::Prepared;
+#else
+static const unsigned int AcceptedMode = 0;
+#endif
+
 SocketClient::SharedPtr SocketServer::nextConnection()
 {
     if (accepted.empty())
         return 0;
     const int fd = accepted.front();
     accepted.pop();
-    return SocketClient::SharedPtr(new SocketClient(fd, path.isEmpty() ? SocketClient::Tcp : SocketClient::Unix));
+    unsigned int mode = AcceptedMode;
+    if (!path.isEmpty()) {
+        mode |= SocketClient::Unix;
+    } else {
+        mode |= SocketClient::Tcp;
+        if (noDelay)
+            mode |= SocketClient::NoDelay;
+    }
+    return SocketClient::SharedPtr(new SocketClient(fd, mode));
+}
+
+List<SocketClient::SharedPtr> SocketServer::takeConnections()
+{
+    List<SocketClient::SharedPtr> ret;
+    ret.reserve(accepted.size());
+    while (!accepted.empty())
+        ret.append(nextConnection());
+    return ret;
 }
 
 void SocketServer::socketCallback(int /*fd*/, int mode)
@@ -204,12 +242,16 @@ void SocketServer::socketCallback(int /*fd*/, int mode)
     if (! ( mode & EventLoop::SocketRead ) )
         return;
 
-    for (;;) {
+    int count = 0;
+    while (!maxAccepts || count < maxAccepts) {
+#ifdef HAVE_ACCEPT4
+        eintrwrap(e, ::accept4(fd, client, &size, SOCK_NONBLOCK|SOCK_CLOEXEC));
+#else
         eintrwrap(e, ::accept(fd, client, &size));
+#endif
         if (e == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
-            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
             serverError(this, AcceptError);
             close();
             return;
@@ -217,6 +259,12 @@ void SocketServer::socketCallback(int /*fd*/, int mode)
 
         //EventLoop::eventLoop()->unregisterSocket( fd );
         accepted.push(e);
-        serverNewConnection(this);
+        ++count;
     }
+
+    if (!count)
+        return;
+    serverNewConnections(this, count);
+    for (int i = 0; i < count && !accepted.empty(); ++i)
+        serverNewConnection(this);
 }
@@ -3,6 +3,7 @@
 
 #include "SignalSlot.h"
 #include "SocketClient.h"
+#include "List.h"
 #include <memory>
 #include <rct/Path.h>
 #include <queue>
@@ -18,17 +19,38 @@ public:
     SocketServer();
     ~SocketServer();
 
-    enum Mode { IPv4, IPv6 };
+    enum Mode {
+        IPv4 = 0x0,
+        IPv6 = 0x1,
+        ReusePort = 0x2, // SO_REUSEPORT, lets several servers share a port
+        NoDelay = 0x4 // accepted connections get SocketClient::NoDelay
+    };
 
     void close();
-    bool listen(uint16_t port, Mode mode = IPv4); // TCP
+    bool listen(uint16_t port, unsigned int mode = IPv4); // TCP
     bool listen(const Path &path); // UNIX
     bool listenfd(int fd);         // UNIX
     bool isListening() const { return fd != -1; }
 
+    // Must be called before listen(), the default is 128
+    void setBacklog(int backlog) { listenBacklog = backlog; }
+    int backlog() const { return listenBacklog; }
+
+    // At most this many connections are accepted each time the loop reports
+    // the socket readable, the rest wait for the next round so a storm of
+    // connects can't starve everything else on the loop. 0 means no limit.
+    void setAcceptLimit(int limit) { maxAccepts = limit; }
+    int acceptLimit() const { return maxAccepts; }
+
     SocketClient::SharedPtr nextConnection();
+    // everything accepted that nextConnection() hasn't returned yet
+    List<SocketClient::SharedPtr> takeConnections();
 
+    // emitted once per accepted connection
     Signal<std::function<void(SocketServer*)> >& newConnection() { return serverNewConnection; }
+    // emitted once per round with everything that was accepted, before
+    // newConnection(), connections not taken are left for nextConnection()
+    Signal<std::function<void(SocketServer*, int)> >& newConnections() { return serverNewConnections; }
 
     enum Error { InitializeError, BindError, ListenError, AcceptError };
     Signal<std::function<void(SocketServer*, Error)> >& error() { return serverError; }
@@ -40,10 +62,12 @@ private:
 
 private:
     int fd;
-    bool isIPv6;
+    bool isIPv6, noDelay;
     Path path;
     std::queue<int> accepted;
+    int listenBacklog, maxAccepts;
     Signal<std::function<void(SocketServer*)> > serverNewConnection;
+    Signal<std::function<void(SocketServer*, int)> > serverNewConnections;
     Signal<std::function<void(SocketServer*, Error)> > serverError;
 };
 
@@ -2,15 +2,17 @@
 #define StopWatch_h
 
 #include <stdint.h>
-#include <sys/time.h>
 #include <rct/Rct.h>
 
 class StopWatch
 {
 public:
+    // Coarse is milliseconds from Rct::coarseMonoMs(), only as fine as
+    // the kernel tick but cheaper to read
     enum Precision {
         Millisecond,
-        Microsecond
+        Microsecond,
+        Coarse
     };
     StopWatch(Precision prec = Millisecond)
         : mPrecision(prec), mStart(current(prec))
@@ -29,13 +31,12 @@ public:
 
     static unsigned long long current(Precision prec)
     {
-        timeval t;
-        Rct::gettime(&t); // monotonic
-        if (prec == Millisecond) {
-            return (t.tv_sec * 1000) + (t.tv_usec / 1000);
-        } else {
-            return (t.tv_sec * 1000000) + t.tv_usec;
+        switch (prec) {
+        case Millisecond: return Rct::monoMs();
+        case Microsecond: break;
+        case Coarse: return Rct::coarseMonoMs();
         }
+        return Rct::monoUs();
     }
 
     unsigned long long elapsed() const
@@ -1,4 +1,15 @@
 #include "String.h"
+#include "rct-config.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RCT_STRING_AVX2
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 #ifdef RCT_HAVE_ZLIB
 #include <zlib.h>
 enum { BufferSize = 1024 * 32 };
@@ -95,6 +106,7 @@ String String::uncompress(const char *data, int size)
 
 String String::toHex(const void *pAddressIn, int lSize)
 {
+    static const char *const upperDigits = "0123456789ABCDEF";
     String ret;
     char szBuf[100];
     int lIndent = 1;
@@ -117,19 +129,29 @@ String String::toHex(const void *pAddressIn, int lSize)
         if (lOutLen > 16)
             lOutLen = 16;
 
-        // create a 64-character formatted output line:
-        snprintf(szBuf,
-                 sizeof(szBuf),
-                 " >                            "
-                 "                      "
-                 "    %08lX",
-                 static_cast<long unsigned int>(pTmp - pAddress));
+        // create a 64-character formatted output line, the offset fits
+        // in 8 digits since lSize is an int
+        static const char blank[] = " >                            "
+                                    "                      "
+                                    "    ";
+        static_assert(sizeof(blank) == 57, "The offset starts at 56");
+        memcpy(szBuf, blank, sizeof(blank) - 1);
+        unsigned long offset = static_cast<unsigned long>(pTmp - pAddress);
+        for (int i = 63; i >= 56; --i) {
+            szBuf[i] = upperDigits[offset & 0xf];
+            offset >>= 4;
+        }
+        szBuf[64] = '\0';
         lOutLen2 = lOutLen;
 
         for (lIndex = 1 + lIndent, lIndex2 = 53 - 15 + lIndent, lRelPos = 0; lOutLen2; lOutLen2--, lIndex += 2, lIndex2++) {
             ucTmp = *pTmp++;
 
-            sprintf(szBuf + lIndex, "%02X ", (unsigned short)ucTmp);
+            // what sprintf("%02X ") wrote, with its terminator
+            szBuf[lIndex] = upperDigits[ucTmp >> 4];
+            szBuf[lIndex + 1] = upperDigits[ucTmp & 0xf];
+            szBuf[lIndex + 2] = ' ';
+            szBuf[lIndex + 3] = '\0';
             if (!isprint(ucTmp))
                 ucTmp = '.'; // nonprintable char
             szBuf[lIndex2] = ucTmp;
@@ -154,3 +176,282 @@ String String::toHex(const void *pAddressIn, int lSize)
     }
     return ret;
 }
+
+static inline char asciiLower(char ch)
+{
+    return ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+}
+
+static inline char asciiUpper(char ch)
+{
+    return ch >= 'a' && ch <= 'z' ? ch - ('a' - 'A') : ch;
+}
+
+static inline bool asciiEqual(const char *a, const char *b, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        if (asciiLower(a[i]) != asciiLower(b[i]))
+            return false;
+    }
+    return true;
+}
+
+// The kernels look for bytes that are either of two values, the lower and
+// upper case of a character. For substrings (the "generic SIMD" approach)
+// candidates are the positions where both the first and the last
+// character of the needle match, only those are compared in full.
+// Returning end means not found.
+typedef const char *(*FindCharFunc)(const char *pos, const char *end, char a, char b);
+typedef const char *(*FindStringFunc)(const char *pos, const char *end, const char *needle, int needleSize,
+                                      String::CaseSensitivity cs);
+
+static inline bool matches(const char *pos, const char *needle, int needleSize, String::CaseSensitivity cs)
+{
+    return cs == String::CaseSensitive ? !memcmp(pos, needle, needleSize) : asciiEqual(pos, needle, needleSize);
+}
+
+static const char *findCharScalar(const char *pos, const char *end, char a, char b)
+{
+    while (pos < end && *pos != a && *pos != b)
+        ++pos;
+    return pos;
+}
+
+static const char *findStringScalar(const char *pos, const char *end, const char *needle, int needleSize,
+                                    String::CaseSensitivity cs)
+{
+    const char first = asciiLower(*needle);
+    for (const char *last = end - needleSize; pos <= last; ++pos) {
+        if ((cs == String::CaseSensitive ? *pos == *needle : asciiLower(*pos) == first)
+            && matches(pos, needle, needleSize, cs)) {
+            return pos;
+        }
+    }
+    return end;
+}
+
+#if defined(__SSE2__)
+static const char *findCharSSE2(const char *pos, const char *end, char a, char b)
+{
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    while (end - pos >= 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+    return findCharScalar(pos, end, a, b);
+}
+
+static const char *findStringSSE2(const char *pos, const char *end, const char *needle, int needleSize,
+                                  String::CaseSensitivity cs)
+{
+    const bool ci = cs == String::CaseInsensitive;
+    const char first = needle[0], last = needle[needleSize - 1];
+    const __m128i firstA = _mm_set1_epi8(ci ? asciiLower(first) : first), firstB = _mm_set1_epi8(ci ? asciiUpper(first) : first);
+    const __m128i lastA = _mm_set1_epi8(ci ? asciiLower(last) : last), lastB = _mm_set1_epi8(ci ? asciiUpper(last) : last);
+    // 16 candidates at a time while their last characters are in range
+    while (end - pos >= needleSize + 15) {
+        const __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        const __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos + needleSize - 1));
+        const __m128i hit = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(head, firstA), _mm_cmpeq_epi8(head, firstB)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(tail, lastA), _mm_cmpeq_epi8(tail, lastB)));
+        unsigned mask = _mm_movemask_epi8(hit);
+        while (mask) {
+            const char *candidate = pos + __builtin_ctz(mask);
+            if (matches(candidate + 1, needle + 1, needleSize - 2, cs))
+                return candidate;
+            mask &= mask - 1;
+        }
+        pos += 16;
+    }
+    return findStringScalar(pos, end, needle, needleSize, cs);
+}
+#endif
+
+#ifdef RCT_STRING_AVX2
+__attribute__((target("avx2")))
+static const char *findCharAVX2(const char *pos, const char *end, char a, char b)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    while (end - pos >= 32) {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+        const unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)));
+        if (mask)
+            return pos + __builtin_ctz(mask);
+        pos += 32;
+    }
+    return findCharScalar(pos, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char *findStringAVX2(const char *pos, const char *end, const char *needle, int needleSize,
+                                  String::CaseSensitivity cs)
+{
+    const bool ci = cs == String::CaseInsensitive;
+    const char first = needle[0], last = needle[needleSize - 1];
+    const __m256i firstA = _mm256_set1_epi8(ci ? asciiLower(first) : first), firstB = _mm256_set1_epi8(ci ? asciiUpper(first) : first);
+    const __m256i lastA = _mm256_set1_epi8(ci ? asciiLower(last) : last), lastB = _mm256_set1_epi8(ci ? asciiUpper(last) : last);
+    while (end - pos >= needleSize + 31) {
+        const __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+        const __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos + needleSize - 1));
+        const __m256i hit = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(head, firstA), _mm256_cmpeq_epi8(head, firstB)),
+                                             _mm256_or_si256(_mm256_cmpeq_epi8(tail, lastA), _mm256_cmpeq_epi8(tail, lastB)));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        while (mask) {
+            const char *candidate = pos + __builtin_ctz(mask);
+            if (matches(candidate + 1, needle + 1, needleSize - 2, cs))
+                return candidate;
+            mask &= mask - 1;
+        }
+        pos += 32;
+    }
+    return findStringScalar(pos, end, needle, needleSize, cs);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+// 4 bits per byte, see the "shift right and narrow" movemask replacement
+static inline uint64_t neonMask(uint8x16_t hit)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+}
+
+static const char *findCharNEON(const char *pos, const char *end, char a, char b)
+{
+    const uint8x16_t va = vdupq_n_u8(a), vb = vdupq_n_u8(b);
+    while (end - pos >= 16) {
+        const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(pos));
+        const uint64_t mask = neonMask(vorrq_u8(vceqq_u8(chunk, va), vceqq_u8(chunk, vb)));
+        if (mask)
+            return pos + (__builtin_ctzll(mask) >> 2);
+        pos += 16;
+    }
+    return findCharScalar(pos, end, a, b);
+}
+
+static const char *findStringNEON(const char *pos, const char *end, const char *needle, int needleSize,
+                                  String::CaseSensitivity cs)
+{
+    const bool ci = cs == String::CaseInsensitive;
+    const char first = needle[0], last = needle[needleSize - 1];
+    const uint8x16_t firstA = vdupq_n_u8(ci ? asciiLower(first) : first), firstB = vdupq_n_u8(ci ? asciiUpper(first) : first);
+    const uint8x16_t lastA = vdupq_n_u8(ci ? asciiLower(last) : last), lastB = vdupq_n_u8(ci ? asciiUpper(last) : last);
+    while (end - pos >= needleSize + 15) {
+        const uint8x16_t head = vld1q_u8(reinterpret_cast<const uint8_t *>(pos));
+        const uint8x16_t tail = vld1q_u8(reinterpret_cast<const uint8_t *>(pos + needleSize - 1));
+        uint64_t mask = neonMask(vandq_u8(vorrq_u8(vceqq_u8(head, firstA), vceqq_u8(head, firstB)),
+                                          vorrq_u8(vceqq_u8(tail, lastA), vceqq_u8(tail, lastB))));
+        while (mask) {
+            const char *candidate = pos + (__builtin_ctzll(mask) >> 2);
+            if (matches(candidate + 1, needle + 1, needleSize - 2, cs))
+                return candidate;
+            mask &= ~(0xfull << (__builtin_ctzll(mask) & ~3));
+        }
+        pos += 16;
+    }
+    return findStringScalar(pos, end, needle, needleSize, cs);
+}
+#endif
+
+static FindCharFunc findCharFunc()
+{
+#ifdef RCT_STRING_AVX2
+    // may run from another static initializer
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return findCharAVX2;
+#endif
+#if defined(__SSE2__)
+    return findCharSSE2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return findCharNEON;
+#else
+    return findCharScalar;
+#endif
+}
+
+static FindStringFunc findStringFunc()
+{
+#ifdef RCT_STRING_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return findStringAVX2;
+#endif
+#if defined(__SSE2__)
+    return findStringSSE2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return findStringNEON;
+#else
+    return findStringScalar;
+#endif
+}
+
+const char *String::find(const char *data, int size, char ch, CaseSensitivity cs)
+{
+    if (size <= 0)
+        return 0;
+    const char lower = asciiLower(ch), upper = asciiUpper(ch);
+    if (cs == CaseSensitive || lower == upper)
+        return static_cast<const char *>(memchr(data, ch, size));
+    static const FindCharFunc findChar = findCharFunc();
+    const char *end = data + size;
+    const char *ret = findChar(data, end, lower, upper);
+    return ret == end ? 0 : ret;
+}
+
+const char *String::find(const char *data, int size, const char *needle, int needleSize, CaseSensitivity cs)
+{
+    if (needleSize <= 0 || needleSize > size)
+        return needleSize ? 0 : data;
+    if (needleSize == 1)
+        return find(data, size, *needle, cs);
+#ifdef HAVE_MEMMEM
+    // two-way, linear in the worst case, and vectorized by the C library
+    if (cs == CaseSensitive)
+        return static_cast<const char *>(memmem(data, size, needle, needleSize));
+#endif
+    static const FindStringFunc findString = findStringFunc();
+    const char *end = data + size;
+    const char *ret = findString(data, end, needle, needleSize, cs);
+    return ret == end ? 0 : ret;
+}
+
+const char *String::findLast(const char *data, int size, char ch, CaseSensitivity cs)
+{
+    if (size <= 0)
+        return 0;
+    const char lower = cs == CaseSensitive ? ch : asciiLower(ch);
+    const char upper = cs == CaseSensitive ? ch : asciiUpper(ch);
+    for (int i = size - 1; i >= 0; --i) {
+        if (data[i] == lower || data[i] == upper)
+            return data + i;
+    }
+    return 0;
+}
+
+const char *String::findLast(const char *data, int size, const char *needle, int needleSize, CaseSensitivity cs)
+{
+    if (needleSize <= 0 || needleSize > size)
+        return needleSize ? 0 : data + size;
+    const char first = cs == CaseSensitive ? *needle : asciiLower(*needle);
+    for (int i = size - needleSize; i >= 0; --i) {
+        if ((cs == CaseSensitive ? data[i] : asciiLower(data[i])) == first && matches(data + i, needle, needleSize, cs))
+            return data + i;
+    }
+    return 0;
+}
+
+String String::hex(const void *data, int len)
+{
+    static const char *const digits = "0123456789abcdef";
+    String ret(len * 2, '\0');
+    const unsigned char *in = static_cast<const unsigned char *>(data);
+    char *out = ret.data();
+    for (int i = 0; i < len; ++i) {
+        *out++ = digits[in[i] >> 4];
+        *out++ = digits[in[i] & 0xf];
+    }
+    return ret;
+}
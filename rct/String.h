@@ -9,6 +9,7 @@
 #include <string>
 #include <stdarg.h>
 #include <time.h>
+#include <algorithm>
 #include <rct/List.h>
 #include <strings.h>
 
@@ -72,33 +73,37 @@ public:
     {
         if (cs == CaseSensitive)
             return mString.rfind(ch, from == -1 ? std::string::npos : size_t(from));
+        if (from == -1 || from >= size())
+            from = size() - 1;
+        if (from < 0)
+            return -1;
         const char *data = mString.c_str();
-        if (from == -1)
-            from = mString.size() - 1;
-        ch = tolower(ch);
-        while (from >= 0) {
-            if (tolower(data[from]) == ch)
-                return from;
-            --from;
-        }
-        return -1;
+        const char *found = findLast(data, from + 1, ch, cs);
+        return found ? found - data : -1;
     }
 
     int indexOf(char ch, int from = 0, CaseSensitivity cs = CaseSensitive) const
     {
         if (cs == CaseSensitive)
             return mString.find(ch, from);
+        if (from < 0)
+            from = 0;
+        if (from >= size())
+            return -1;
         const char *data = mString.c_str();
-        ch = tolower(ch);
-        const int size = mString.size();
-        while (from < size) {
-            if (tolower(data[from]) == ch)
-                return from;
-            ++from;
-        }
-        return -1;
+        const char *found = find(data + from, size() - from, ch, cs);
+        return found ? found - data : -1;
     }
 
+    // The first ch or needle in data, or 0. Vectorized, with the widest
+    // instructions the CPU has. Case insensitive means ASCII case here.
+    static const char *find(const char *data, int size, char ch, CaseSensitivity cs = CaseSensitive);
+    static const char *find(const char *data, int size, const char *needle, int needleSize, CaseSensitivity cs = CaseSensitive);
+    // The last ch or needle in data, or 0. With the same ASCII case folding
+    // as find().
+    static const char *findLast(const char *data, int size, char ch, CaseSensitivity cs = CaseSensitive);
+    static const char *findLast(const char *data, int size, const char *needle, int needleSize, CaseSensitivity cs = CaseSensitive);
+
     bool contains(const String &other, CaseSensitivity cs = CaseSensitive) const
     {
         return indexOf(other, 0, cs) != -1;
@@ -138,21 +143,15 @@ public:
             return lastIndexOf(ba.first(), from, cs);
         if (cs == CaseSensitive)
             return mString.rfind(ba.mString, from == -1 ? std::string::npos : size_t(from));
-        if (from == -1)
-            from = mString.size() - 1;
-        const String lowered = ba.toLower();
-        const int needleSize = lowered.size();
-        int matched = 0;
-        while (from >= 0) {
-            if (lowered.at(needleSize - matched - 1) != tolower(at(from))) {
-                matched = 0;
-            } else if (++matched == needleSize) {
-                return from;
-            }
-
-            --from;
-        }
-        return -1;
+        // the match starts at or before from, like rfind()
+        int pos = size() - ba.size();
+        if (from != -1 && from < pos)
+            pos = from;
+        if (pos < 0)
+            return -1;
+        const char *data = constData();
+        const char *found = findLast(data, pos + ba.size(), ba.constData(), ba.size(), cs);
+        return found ? found - data : -1;
     }
 
     int indexOf(const String &ba, int from = 0, CaseSensitivity cs = CaseSensitive) const
@@ -161,21 +160,17 @@ public:
             return -1;
         if (ba.size() == 1)
             return indexOf(ba.first(), from, cs);
-        if (cs == CaseSensitive)
-            return mString.find(ba.mString, from);
-
-        const String lowered = ba.toLower();
-        const int count = size();
-        int matched = 0;
-
-        for (int i=from; i<count; ++i) {
-            if (lowered.at(matched) != tolower(at(i))) {
-                matched = 0;
-            } else if (++matched == lowered.size()) {
-                return i - matched + 1;
-            }
+        if (from < 0) {
+            // std::string::find() takes it as npos
+            if (cs == CaseSensitive)
+                return -1;
+            from = 0;
         }
-        return -1;
+        if (from >= size())
+            return -1;
+        const char *data = constData();
+        const char *found = find(data + from, size() - from, ba.constData(), ba.size(), cs);
+        return found ? found - data : -1;
     }
 
     char first() const
@@ -513,13 +508,14 @@ public:
 
     int replace(char from, char to)
     {
+        if (from == to)
+            return std::count(mString.begin(), mString.end(), from);
         int count = 0;
-        for (int i=size() - 1; i>=0; --i) {
-            char &ch = operator[](i);
-            if (ch == from) {
-                ch = to;
-                ++count;
-            }
+        char *data = &mString[0];
+        char *end = data + mString.size();
+        while ((data = static_cast<char *>(memchr(data, from, end - data)))) {
+            *data++ = to;
+            ++count;
         }
         return count;
     }
@@ -664,6 +660,8 @@ public:
     String toHex() const { return toHex(*this); }
     static String toHex(const String &hex) { return toHex(hex.constData(), hex.size()); }
     static String toHex(const void *data, int len);
+    // Two lowercase hex digits per byte, without toHex()'s dump formatting
+    static String hex(const void *data, int len);
 
     static String number(int8_t num, int base = 10) { return String::number(static_cast<int64_t>(num), base); }
     static String number(uint8_t num, int base = 10) { return String::number(static_cast<int64_t>(num), base); }
@@ -833,8 +831,11 @@ inline const String operator+(const String &l, const String &r)
 
 namespace std
 {
-template <> struct hash<String> : public unary_function<String, size_t>
+template <> struct hash<String>
 {
+    typedef String argument_type;
+    typedef size_t result_type;
+
     size_t operator()(const String& value) const
     {
         std::hash<std::string> h;
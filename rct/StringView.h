@@ -0,0 +1,278 @@
+#ifndef StringView_h
+#define StringView_h
+
+#include <rct/String.h>
+#include <cstring>
+#include <ctype.h>
+#include <stdint.h>
+#include <functional>
+
+class StringSplit;
+
+// Non-owning view of a run of characters. Nothing is copied so the view is
+// only valid for as long as the memory it points into.
+class StringView
+{
+public:
+    StringView()
+        : mData(0), mSize(0)
+    {}
+    StringView(const char *data, int len = -1)
+        : mData(data), mSize(len == -1 ? (data ? strlen(data) : 0) : len)
+    {}
+    StringView(const String &string)
+        : mData(string.constData()), mSize(string.size())
+    {}
+
+    const char *data() const { return mData; }
+    int size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+
+    const char *begin() const { return mData; }
+    const char *end() const { return mData + mSize; }
+    char at(int i) const { return mData[i]; }
+    char operator[](int i) const { return mData[i]; }
+
+    StringView mid(int from, int len = -1) const
+    {
+        if (from >= mSize)
+            return StringView();
+        if (len == -1 || from + len > mSize)
+            len = mSize - from;
+        return StringView(mData + from, len);
+    }
+    StringView left(int len) const { return mid(0, len); }
+    StringView right(int len) const { return len >= mSize ? *this : mid(mSize - len); }
+
+    bool startsWith(const StringView &str) const
+    {
+        return mSize >= str.mSize && !memcmp(mData, str.mData, str.mSize);
+    }
+    bool endsWith(const StringView &str) const
+    {
+        return mSize >= str.mSize && !memcmp(mData + mSize - str.mSize, str.mData, str.mSize);
+    }
+
+    int indexOf(char ch, int from = 0) const
+    {
+        if (from >= mSize)
+            return -1;
+        const void *found = memchr(mData + from, ch, mSize - from);
+        return found ? static_cast<const char*>(found) - mData : -1;
+    }
+
+    int indexOf(const StringView &str, int from = 0) const
+    {
+        if (str.isEmpty() || from >= mSize)
+            return -1;
+        const char *found = String::find(mData + from, mSize - from, str.mData, str.mSize);
+        return found ? found - mData : -1;
+    }
+
+    bool contains(char ch) const { return indexOf(ch) != -1; }
+    bool contains(const StringView &str) const { return indexOf(str) != -1; }
+
+    StringView trimmed() const
+    {
+        int start = 0;
+        int end = mSize;
+        while (start < end && isspace(static_cast<unsigned char>(mData[start])))
+            ++start;
+        while (end > start && isspace(static_cast<unsigned char>(mData[end - 1])))
+            --end;
+        return StringView(mData + start, end - start);
+    }
+
+    // Base 10 and, unlike String's, without needing a terminator. ok is
+    // false unless the whole view is the number.
+    uint64_t toULongLong(bool *ok = 0) const
+    {
+        uint64_t ret = 0;
+        int i = 0;
+        bool valid = mSize > 0;
+        for (; i < mSize && valid; ++i) {
+            const unsigned digit = static_cast<unsigned char>(mData[i]) - '0';
+            if (digit > 9 || ret > (UINT64_MAX - digit) / 10) {
+                valid = false;
+            } else {
+                ret = (ret * 10) + digit;
+            }
+        }
+        if (ok)
+            *ok = valid;
+        return valid ? ret : 0;
+    }
+    int64_t toLongLong(bool *ok = 0) const
+    {
+        const bool negative = mSize && mData[0] == '-';
+        bool valid;
+        const uint64_t ret = (negative || (mSize && mData[0] == '+') ? mid(1) : *this).toULongLong(&valid);
+        if (valid && ret > static_cast<uint64_t>(INT64_MAX) + negative)
+            valid = false;
+        if (ok)
+            *ok = valid;
+        if (!valid)
+            return 0;
+        return negative ? static_cast<int64_t>(0 - ret) : static_cast<int64_t>(ret);
+    }
+
+    // Lazy versions of String::split(), the tokens point into this view
+    StringSplit split(char ch, unsigned int flags = String::NoSplitFlag) const;
+    StringSplit split(const StringView &separator, unsigned int flags = String::NoSplitFlag) const;
+
+    int compare(const StringView &other) const
+    {
+        const int ret = memcmp(mData, other.mData, std::min(mSize, other.mSize));
+        if (ret)
+            return ret;
+        return mSize < other.mSize ? -1 : (mSize > other.mSize ? 1 : 0);
+    }
+    bool operator==(const StringView &other) const
+    {
+        return mSize == other.mSize && !memcmp(mData, other.mData, mSize);
+    }
+    bool operator!=(const StringView &other) const { return !operator==(other); }
+    bool operator<(const StringView &other) const { return compare(other) < 0; }
+    bool operator>(const StringView &other) const { return compare(other) > 0; }
+
+    String toString() const { return String(mData, mSize); }
+
+private:
+    const char *mData;
+    int mSize;
+};
+
+// Hands out the tokens of String::split() one at a time, as views into
+// the string being split:
+//
+//     StringTokenizer tokenizer(line, ' ', String::SkipEmpty);
+//     StringView token;
+//     while (tokenizer.next(token))
+//         ...
+class StringTokenizer
+{
+public:
+    StringTokenizer(const StringView &string, char separator, unsigned int flags = String::NoSplitFlag)
+        : mString(string), mChar(separator), mCharSeparator(true), mFlags(flags), mPos(0), mDone(false)
+    {}
+    StringTokenizer(const StringView &string, const StringView &separator, unsigned int flags = String::NoSplitFlag)
+        : mString(string), mSeparator(separator), mChar(0), mCharSeparator(false), mFlags(flags), mPos(0), mDone(false)
+    {}
+
+    bool next(StringView &token)
+    {
+        while (!mDone) {
+            const int next = mCharSeparator ? mString.indexOf(mChar, mPos) : mString.indexOf(mSeparator, mPos);
+            if (next == -1) {
+                token = StringView(mString.data() + mPos, mString.size() - mPos);
+                mDone = true;
+            } else {
+                token = StringView(mString.data() + mPos, next - mPos);
+                mPos = next + (mCharSeparator ? 1 : mSeparator.size());
+            }
+            if (!token.isEmpty() || !(mFlags & String::SkipEmpty))
+                return true;
+        }
+        return false;
+    }
+
+    bool atEnd() const { return mDone; }
+    // What hasn't been tokenized yet
+    StringView remaining() const { return mDone ? StringView() : mString.mid(mPos); }
+
+private:
+    StringView mString, mSeparator;
+    char mChar;
+    bool mCharSeparator;
+    unsigned int mFlags;
+    int mPos;
+    bool mDone;
+};
+
+// StringTokenizer as a range, for range based for loops:
+//
+//     for (const StringView &dir : StringView(getenv("PATH")).split(':'))
+//         ...
+class StringSplit
+{
+public:
+    StringSplit(const StringView &string, char separator, unsigned int flags = String::NoSplitFlag)
+        : mTokenizer(string, separator, flags)
+    {}
+    StringSplit(const StringView &string, const StringView &separator, unsigned int flags = String::NoSplitFlag)
+        : mTokenizer(string, separator, flags)
+    {}
+
+    class iterator
+    {
+    public:
+        iterator() : mTokenizer(StringView(), '\0'), mAtEnd(true) {}
+        explicit iterator(const StringTokenizer &tokenizer) : mTokenizer(tokenizer), mAtEnd(false) { ++*this; }
+
+        const StringView &operator*() const { return mToken; }
+        const StringView *operator->() const { return &mToken; }
+        iterator &operator++()
+        {
+            mAtEnd = !mTokenizer.next(mToken);
+            return *this;
+        }
+        bool operator==(const iterator &other) const
+        {
+            return mAtEnd == other.mAtEnd && (mAtEnd || mTokenizer.remaining().data() == other.mTokenizer.remaining().data());
+        }
+        bool operator!=(const iterator &other) const { return !operator==(other); }
+
+    private:
+        StringTokenizer mTokenizer;
+        StringView mToken;
+        bool mAtEnd;
+    };
+    typedef iterator const_iterator;
+
+    iterator begin() const { return iterator(mTokenizer); }
+    iterator end() const { return iterator(); }
+
+    template <typename T = String>
+    List<T> toList() const
+    {
+        List<T> ret;
+        for (const StringView &token : *this)
+            ret.append(T(token.data(), token.size()));
+        return ret;
+    }
+
+private:
+    StringTokenizer mTokenizer;
+};
+
+inline StringSplit StringView::split(char ch, unsigned int flags) const
+{
+    return StringSplit(*this, ch, flags);
+}
+
+inline StringSplit StringView::split(const StringView &separator, unsigned int flags) const
+{
+    return StringSplit(*this, separator, flags);
+}
+
+namespace std
+{
+template <> struct hash<StringView>
+{
+    typedef StringView argument_type;
+    typedef size_t result_type;
+
+    size_t operator()(const StringView& value) const
+    {
+        // FNV-1a
+        size_t h = static_cast<size_t>(14695981039346656037ULL);
+        for (const char *ch = value.begin(); ch != value.end(); ++ch) {
+            h ^= static_cast<unsigned char>(*ch);
+            h *= static_cast<size_t>(1099511628211ULL);
+        }
+        return h;
+    }
+};
+}
+
+#endif
@@ -1,6 +1,9 @@
 #include "Thread.h"
 #include "Log.h"
 #include "rct-config.h"
+#ifdef HAVE_PTHREAD_SETAFFINITY
+#  include <sched.h>
+#endif
 
 Thread::Thread()
     : mAutoDelete(false), mRunning(false), mLoop(EventLoop::eventLoop())
@@ -70,6 +73,31 @@ bool Thread::join()
     return ok;
 }
 
+bool Thread::setAffinity(int cpu)
+{
+    return setAffinity(List<int>(1, cpu));
+}
+
+bool Thread::setAffinity(const List<int>& cpus)
+{
+    if (!mRunning || cpus.isEmpty())
+        return false;
+#ifdef HAVE_PTHREAD_SETAFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(mThread, sizeof(set), &set) != 0) {
+        error() << "pthread_setaffinity_np failed for cpus" << cpus;
+        return false;
+    }
+    return true;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
 void Thread::finish()
 {
     join();
@@ -2,6 +2,7 @@
 #define THREAD_H
 
 #include "EventLoop.h"
+#include "List.h"
 #include <pthread.h>
 #include <mutex>
 
@@ -15,6 +16,12 @@ public:
     void start(Priority priority = Normal, size_t stackSize = 0);
     bool join();
 
+    // Pins the running thread to a single cpu, or lets it run on any of
+    // cpus. Returns false when the platform doesn't support thread
+    // affinity or the thread isn't running.
+    bool setAffinity(int cpu);
+    bool setAffinity(const List<int>& cpus);
+
     void setAutoDelete(bool on)
     {
         std::lock_guard<std::mutex> lock(mMutex);
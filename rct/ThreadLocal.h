@@ -1,6 +1,9 @@
 #ifndef THREADLOCAL_H
 #define THREADLOCAL_H
 
+#include "rct-config.h"
+#include <new>
+#include <utility>
 #include <pthread.h>
 
 template<typename T>
@@ -14,7 +17,15 @@ public:
 
     void clear() { pthread_key_delete(mKey); }
 
-    void set(const T& t) { setData(new T(t)); }
+    // assigns to the thread's value when it has one
+    void set(const T& t)
+    {
+        if (T* current = get()) {
+            *current = t;
+        } else {
+            setData(new T(t));
+        }
+    }
     // takes ownership
     void set(T* t) { setData(t); }
 
@@ -53,4 +64,134 @@ private:
     pthread_key_t mKey;
 };
 
+// One T per thread for every Tag, in the thread's own storage rather than
+// behind a pthread key, so get() is an access relative to the thread
+// pointer and no allocation. The value is constructed by set(), emplace()
+// or local() and destroyed when the thread exits or remove() is called.
+// Every StaticThreadLocal of the same T and Tag is the same variable, pass
+// a Tag for each cache that needs its own.
+template<typename T, typename Tag = T>
+class StaticThreadLocal
+{
+public:
+    static bool has() { return get() != 0; }
+
+#ifdef HAVE_THREAD_LOCAL
+    static T* get() { Slot& s = slot(); return s.constructed ? s.object() : 0; }
+    // Whether the thread is exiting and its value has been destroyed,
+    // local() would construct one that's never destroyed then
+    static bool isDestroyed() { return destroyed(); }
+
+    template<typename... Args>
+    static T& emplace(Args&&... args)
+    {
+        Slot& s = slot();
+        s.destroy();
+        new (s.storage) T(std::forward<Args>(args)...);
+        s.constructed = true;
+        return *s.object();
+    }
+    static void remove() { slot().destroy(); }
+#else
+    static T* get() { return reinterpret_cast<T*>(pthread_getspecific(key())); }
+    // pthread calls deleteValue() again for a value that's set while the
+    // thread's values are destroyed, so it's never too late for local()
+    static bool isDestroyed() { return false; }
+
+    template<typename... Args>
+    static T& emplace(Args&&... args)
+    {
+        T* t = new T(std::forward<Args>(args)...);
+        remove();
+        pthread_setspecific(key(), t);
+        return *t;
+    }
+    static void remove()
+    {
+        delete get();
+        pthread_setspecific(key(), 0);
+    }
+#endif
+
+    static T& set(const T& t)
+    {
+        if (T* current = get()) {
+            *current = t;
+            return *current;
+        }
+        return emplace(t);
+    }
+    static T& set(T&& t)
+    {
+        if (T* current = get()) {
+            *current = std::move(t);
+            return *current;
+        }
+        return emplace(std::move(t));
+    }
+
+    // The thread's value, default constructed the first time
+    static T& local()
+    {
+        if (T* t = get())
+            return *t;
+        return emplace();
+    }
+
+    T* operator->() const { return &local(); }
+    T& operator*() const { return local(); }
+
+private:
+#ifdef HAVE_THREAD_LOCAL
+    struct Slot
+    {
+        ~Slot()
+        {
+            destroy();
+            destroyed() = true;
+        }
+
+        T* object() { return reinterpret_cast<T*>(storage); }
+        void destroy()
+        {
+            if (constructed) {
+                constructed = false;
+                object()->~T();
+            }
+        }
+
+        alignas(T) unsigned char storage[sizeof(T)];
+        bool constructed;
+    };
+    static Slot& slot()
+    {
+        // constant initialized, only the destructor is registered on first use
+        static thread_local Slot s;
+        return s;
+    }
+    // apart from the slot, it has to be readable once that's destroyed
+    static bool& destroyed()
+    {
+        static thread_local bool d = false;
+        return d;
+    }
+#else
+    static pthread_key_t key()
+    {
+        static const pthread_key_t k = createKey();
+        return k;
+    }
+    static pthread_key_t createKey()
+    {
+        pthread_key_t k;
+        pthread_key_create(&k, deleteValue);
+        return k;
+    }
+    static void deleteValue(void* val)
+    {
+        delete reinterpret_cast<T*>(val);
+    }
+#endif
+};
+
 #endif
@@ -1,14 +1,27 @@
 #include "ThreadPool.h"
+#include "CpuTopology.h"
+#include "CpuUsage.h"
+#include "Futex.h"
 #include "Thread.h"
 #include "Log.h"
+#include "Metrics.h"
+#include "Rct.h"
+#include "Trace.h"
+#include "Value.h"
 #include "rct-config.h"
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
+#include <pthread.h>
+#include <stdint.h>
 #if defined (OS_FreeBSD) || defined (OS_NetBSD) || defined (OS_OpenBSD)
 #   include <sys/types.h>
 #   include <sys/sysctl.h>
 #elif defined (OS_Linux)
 #   include <unistd.h>
+#   ifdef HAVE_SCHED_GETAFFINITY
+#       include <sched.h>
+#   endif
 #elif defined (OS_Darwin)
 #   include <sys/param.h>
 #   include <sys/sysctl.h>
@@ -20,31 +33,126 @@ using std::shared_ptr;
 
 ThreadPool* ThreadPool::sInstance = 0;
 
+// Per thread queue in WorkStealing mode. Jobs are bucketed by the highest
+// set bit of their priority, the same unsigned order jobLessThan() uses,
+// and taken oldest first from the highest bucket, jobs with a deadline
+// before the others. Removed jobs stay until they're popped, or until a
+// push finds them at either end of their bucket.
+class ThreadPoolQueue
+{
+public:
+    ThreadPoolQueue() : mMask(0) {}
+
+    enum { Buckets = 33 };
+    static int bucket(int priority)
+    {
+        const unsigned int p = static_cast<unsigned int>(priority);
+        return p ? 32 - __builtin_clz(p) : 0;
+    }
+
+    void push(const std::shared_ptr<ThreadPool::Job> &job)
+    {
+        const int b = bucket(job->mPriority);
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::deque<std::shared_ptr<ThreadPool::Job> > &jobs = mBuckets[b];
+        while (!jobs.empty() && !jobs.front()->mQueued)
+            jobs.pop_front();
+        while (!jobs.empty() && !jobs.back()->mQueued)
+            jobs.pop_back();
+        if (jobs.empty() || jobs.back()->mDeadline <= job->mDeadline) {
+            jobs.push_back(job);
+        } else {
+            jobs.insert(std::upper_bound(jobs.begin(), jobs.end(), job, deadlineLessThan), job);
+        }
+        mMask.store(mMask.load(std::memory_order_relaxed) | (1ULL << b), std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<ThreadPool::Job> pop()
+    {
+        // checked without the lock so that idle thieves don't contend
+        if (!mMask.load(std::memory_order_relaxed))
+            return std::shared_ptr<ThreadPool::Job>();
+        std::lock_guard<std::mutex> lock(mMutex);
+        const uint64_t mask = mMask.load(std::memory_order_relaxed);
+        if (!mask)
+            return std::shared_ptr<ThreadPool::Job>();
+        const int b = 63 - __builtin_clzll(mask);
+        std::shared_ptr<ThreadPool::Job> job = std::move(mBuckets[b].front());
+        mBuckets[b].pop_front();
+        if (mBuckets[b].empty())
+            mMask.store(mask & ~(1ULL << b), std::memory_order_relaxed);
+        return job;
+    }
+
+    int clear()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        int ret = 0;
+        for (int i = 0; i < Buckets; ++i) {
+            for (const std::shared_ptr<ThreadPool::Job> &job : mBuckets[i]) {
+                if (job->mQueued.exchange(false))
+                    ++ret;
+            }
+            mBuckets[i].clear();
+        }
+        mMask.store(0, std::memory_order_relaxed);
+        return ret;
+    }
+
+private:
+    static bool deadlineLessThan(const std::shared_ptr<ThreadPool::Job> &l, const std::shared_ptr<ThreadPool::Job> &r)
+    {
+        return l->mDeadline < r->mDeadline;
+    }
+
+    std::mutex mMutex;
+    std::atomic<uint64_t> mMask;
+    std::deque<std::shared_ptr<ThreadPool::Job> > mBuckets[Buckets];
+};
+
 class ThreadPoolThread : public Thread
 {
 public:
-    ThreadPoolThread(ThreadPool* pool);
+    ThreadPoolThread(ThreadPool* pool, int index);
     ThreadPoolThread(const std::shared_ptr<ThreadPool::Job> &job);
 
     void stop();
 
+    static ThreadPoolThread* current();
+
 protected:
     virtual void run() override;
 
 private:
+    void runShared();
+    void runWorkStealing();
+
     std::shared_ptr<ThreadPool::Job> mJob;
     ThreadPool* mPool;
-    bool mStopped;
+    const int mIndex;
+    std::atomic<bool> mStopped;
+
+    friend class ThreadPool;
 };
 
-ThreadPoolThread::ThreadPoolThread(ThreadPool* pool)
-    : mPool(pool), mStopped(false)
+// sadly GCC < 4.8 doesn't support thread_local
+static pthread_key_t currentThreadKey;
+static std::once_flag currentThreadOnce;
+
+ThreadPoolThread* ThreadPoolThread::current()
+{
+    std::call_once(currentThreadOnce, []() { pthread_key_create(&currentThreadKey, 0); });
+    return static_cast<ThreadPoolThread*>(pthread_getspecific(currentThreadKey));
+}
+
+ThreadPoolThread::ThreadPoolThread(ThreadPool* pool, int index)
+    : mPool(pool), mIndex(index), mStopped(false)
 {
     setAutoDelete(false);
 }
 
 ThreadPoolThread::ThreadPoolThread(const std::shared_ptr<ThreadPool::Job> &job)
-    : mJob(job), mPool(0), mStopped(false)
+    : mJob(job), mPool(0), mIndex(-1), mStopped(false)
 {
     setAutoDelete(false);
 }
@@ -60,33 +168,103 @@ void ThreadPoolThread::run()
 {
     if (mJob) {
         mJob->mMutex.lock();
-        mJob->run();
+        if (mJob->isCancelled()) {
+            mJob->mState = ThreadPool::Job::Cancelled;
+        } else {
+            mJob->run();
+        }
         mJob->mMutex.unlock();
         return;
     }
+    {
+        std::lock_guard<std::mutex> lock(mPool->mMutex);
+        CpuUsage::registerThread(mPool->mName + '/' + String::number(mIndex));
+    }
+    if (mPool->mFlags & ThreadPool::WorkStealing) {
+        current();
+        pthread_setspecific(currentThreadKey, this);
+        runWorkStealing();
+        pthread_setspecific(currentThreadKey, 0);
+    } else {
+        runShared();
+    }
+    CpuUsage::unregisterThread();
+}
+
+void ThreadPoolThread::runShared()
+{
     bool first = true;
     for (;;) {
-        std::unique_lock<std::mutex> lock(mPool->mMutex);
         if (!first) {
             --mPool->mBusyThreads;
+            if (!mPool->mPending)
+                mPool->spin(this);
         } else {
             first = false;
         }
-        while (mPool->mJobs.empty() && !mStopped)
-            mPool->mCond.wait(lock);
+        std::unique_lock<std::mutex> lock(mPool->mMutex);
+        std::shared_ptr<ThreadPool::Job> job;
+        while (!mStopped) {
+            if (mPool->mJobs.empty()) {
+                ++mPool->mSleeping;
+                bool timedOut = false;
+                if (mPool->mMaxThreads > 0) {
+                    timedOut = mPool->mCond.wait_for(lock, std::chrono::milliseconds(mPool->mIdleTimeout)) == std::cv_status::timeout;
+                } else {
+                    mPool->mCond.wait(lock);
+                }
+                --mPool->mSleeping;
+                if (timedOut && mPool->mJobs.empty() && !mStopped && mPool->retire(this))
+                    return;
+                continue;
+            }
+            job = std::move(mPool->mJobs.front());
+            mPool->mJobs.pop_front();
+            if (mPool->claim(job.get()))
+                break;
+            job.reset();
+        }
         if (mStopped)
             break;
-        std::deque<std::shared_ptr<ThreadPool::Job> >::iterator item = mPool->mJobs.begin();
-        assert(item != mPool->mJobs.end());
-        std::shared_ptr<ThreadPool::Job> job = *item;
-        mPool->mJobs.erase(item);
         {
             std::lock_guard<std::mutex> joblock(job->mMutex);
             job->mState = ThreadPool::Job::Running;
         }
         ++mPool->mBusyThreads;
         lock.unlock();
-        job->run();
+        mPool->runJob(job.get());
+        {
+            std::lock_guard<std::mutex> joblock(job->mMutex);
+            job->mState = ThreadPool::Job::Finished;
+        }
+    }
+}
+
+void ThreadPoolThread::runWorkStealing()
+{
+    while (!mStopped) {
+        std::shared_ptr<ThreadPool::Job> job = mPool->takeJob(mIndex);
+        if (!job && mPool->mSpinTime) {
+            mPool->spin(this);
+            job = mPool->takeJob(mIndex);
+        }
+        if (!job) {
+            std::unique_lock<std::mutex> lock(mPool->mMutex);
+            // start() bumps mPending before it looks at mSleeping and we
+            // do the opposite, so one of us sees the other
+            ++mPool->mSleeping;
+            if (!mPool->mPending && !mStopped)
+                mPool->mCond.wait(lock);
+            --mPool->mSleeping;
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> joblock(job->mMutex);
+            job->mState = ThreadPool::Job::Running;
+        }
+        ++mPool->mBusyThreads;
+        mPool->runJob(job.get());
+        --mPool->mBusyThreads;
         {
             std::lock_guard<std::mutex> joblock(job->mMutex);
             job->mState = ThreadPool::Job::Finished;
@@ -94,25 +272,102 @@ void ThreadPoolThread::run()
     }
 }
 
-ThreadPool::ThreadPool(int concurrentJobs, Thread::Priority priority, size_t threadStackSize)
-    : mConcurrentJobs(concurrentJobs), mBusyThreads(0),
-      mPriority(priority), mThreadStackSize(threadStackSize)
+struct ThreadPool::Metrics
+{
+    Histogram queueDepth, waitTime, runTime;
+};
+
+ThreadPool::ThreadPool(int concurrentJobs, Thread::Priority priority, size_t threadStackSize, unsigned int flags)
+    : mConcurrentJobs(concurrentJobs), mFlags(flags), mMinThreads(0), mMaxThreads(0),
+      mIdleTimeout(0), mSpinTime(0), mBusyThreads(0), mQueueCount(0), mActiveQueues(0),
+      mNextQueue(0), mPending(0), mSleeping(0), mPriority(priority), mThreadStackSize(threadStackSize), mAffinity(NoAffinity), mName("ThreadPool")
 {
     if (!sInstance)
         sInstance = this;
+    if (mFlags & EnableMetrics)
+        mMetrics.reset(new Metrics);
     for (int i = 0; i < mConcurrentJobs; ++i) {
-        mThreads.push_back(new ThreadPoolThread(this));
+        mThreads.push_back(new ThreadPoolThread(this, i));
         mThreads.back()->start(mPriority, mThreadStackSize);
     }
+    mActiveQueues = std::min<int>(mConcurrentJobs, MaxQueues);
+}
+
+void ThreadPool::setName(const String &name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mName = name;
+    for (ThreadPoolThread *thread : mThreads)
+        CpuUsage::setThreadName(thread->self(), name + '/' + String::number(thread->mIndex));
+}
+
+void ThreadPool::setAffinity(Affinity affinity, const List<int> &cpus)
+{
+    List<int> order;
+    switch (affinity) {
+    case NoAffinity:
+        break;
+    case Compact:
+    case Scatter: {
+        const CpuTopology &topology = CpuTopology::instance();
+        for (int cpu : (affinity == Compact ? topology.compactOrder() : topology.scatterOrder())) {
+            if (cpus.isEmpty() || cpus.contains(cpu))
+                order.append(cpu);
+        }
+        break; }
+    case CpuSet:
+        order = cpus;
+        break;
+    }
+    if (affinity != NoAffinity && order.isEmpty()) {
+        error() << "ThreadPool::setAffinity no usable cpus in" << cpus;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    const bool reset = mAffinity != NoAffinity && affinity == NoAffinity;
+    mAffinity = affinity;
+    mAffinityCpus = order;
+    if (reset) {
+        // threads don't lose a pinning on their own, give them everything
+        // the process may run on again
+        for (const CpuTopology::Cpu &cpu : CpuTopology::instance().cpus())
+            mAffinityCpus.append(cpu.id);
+    }
+    int i = 0;
+    for (ThreadPoolThread *thread : mThreads)
+        applyAffinity(thread, i++);
+    if (reset)
+        mAffinityCpus.clear();
+}
+
+void ThreadPool::setNode(int node)
+{
+    setAffinity(CpuSet, CpuTopology::instance().nodeCpus(node));
+}
+
+void ThreadPool::applyAffinity(ThreadPoolThread *thread, int index)
+{
+    if (mAffinityCpus.isEmpty())
+        return;
+    if (mAffinity == Compact || mAffinity == Scatter) {
+        thread->setAffinity(mAffinityCpus.at(index % mAffinityCpus.size()));
+    } else {
+        thread->setAffinity(mAffinityCpus);
+    }
 }
 
 ThreadPool::~ThreadPool()
 {
     if (sInstance == this)
         sInstance = 0;
-    std::unique_lock<std::mutex> lock(mMutex);
-    mJobs.clear();
-    lock.unlock();
+    clearBackLog();
+    {
+        // no more retiring, mThreads stays put from here
+        std::lock_guard<std::mutex> lock(mMutex);
+        mMaxThreads = 0;
+        reapThreads();
+    }
     for (List<ThreadPoolThread*>::iterator it = mThreads.begin();
          it != mThreads.end(); ++it) {
         ThreadPoolThread* t = *it;
@@ -120,74 +375,271 @@ ThreadPool::~ThreadPool()
         t->join();
         delete t;
     }
+    for (int i = 0; i < mQueueCount; ++i)
+        delete mQueues[i];
 }
 
 void ThreadPool::setConcurrentJobs(int concurrentJobs)
 {
-    if (concurrentJobs == mConcurrentJobs)
+    std::unique_lock<std::mutex> lock(mMutex);
+    mMaxThreads = 0;
+    reapThreads();
+    while (mThreads.size() < concurrentJobs)
+        addThread();
+    while (mThreads.size() > concurrentJobs) {
+        ThreadPoolThread* t = mThreads.back();
+        mThreads.pop_back();
+        mConcurrentJobs = mThreads.size();
+        lock.unlock();
+        t->stop();
+        t->join();
+        lock.lock();
+        delete t;
+    }
+    mActiveQueues = std::min<int>(mConcurrentJobs, MaxQueues);
+}
+
+void ThreadPool::setAdaptive(int minThreads, int maxThreads, int idleTimeout)
+{
+    if (mFlags & WorkStealing) {
+        error() << "ThreadPool::setAdaptive isn't supported with WorkStealing";
         return;
-    if (concurrentJobs > mConcurrentJobs) {
-        std::lock_guard<std::mutex> lock(mMutex);
-        for (int i = mConcurrentJobs; i < concurrentJobs; ++i) {
-            mThreads.push_back(new ThreadPoolThread(this));
-            mThreads.back()->start(mPriority, mThreadStackSize);
-        }
-        mConcurrentJobs = concurrentJobs;
-    } else {
-        std::unique_lock<std::mutex> lock(mMutex);
-        for (int i = mConcurrentJobs; i > concurrentJobs; --i) {
-            ThreadPoolThread* t = mThreads.back();
-            mThreads.pop_back();
-            lock.unlock();
-            t->stop();
-            t->join();
-            lock.lock();
-            delete t;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMinThreads = std::max(0, minThreads);
+    mMaxThreads = std::max(std::max(1, mMinThreads), maxThreads);
+    mIdleTimeout = std::max(1, idleTimeout);
+    reapThreads();
+    while (mThreads.size() < mMinThreads)
+        addThread();
+    // sleeping threads pick up the new timeout
+    mCond.notify_all();
+}
+
+void ThreadPool::addThread()
+{
+    const int index = mThreads.size();
+    mThreads.push_back(new ThreadPoolThread(this, index));
+    mThreads.back()->start(mPriority, mThreadStackSize);
+    applyAffinity(mThreads.back(), index);
+    mConcurrentJobs = mThreads.size();
+}
+
+void ThreadPool::reapThreads()
+{
+    // they're done with the pool once they're in mRetired
+    for (ThreadPoolThread *t : mRetired) {
+        t->join();
+        delete t;
+    }
+    mRetired.clear();
+}
+
+bool ThreadPool::retire(ThreadPoolThread *thread)
+{
+    if (!mMaxThreads || mThreads.size() <= mMinThreads)
+        return false;
+    reapThreads();
+    mThreads.remove(thread);
+    mRetired.append(thread);
+    mConcurrentJobs = mThreads.size();
+    return true;
+}
+
+static inline void cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+void ThreadPool::spin(const ThreadPoolThread *thread) const
+{
+    const int usecs = mSpinTime;
+    if (!usecs)
+        return;
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+    for (int i = 1; !mPending && !thread->mStopped; ++i) {
+        cpuRelax();
+        if (!(i % 64) && std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+}
+
+ThreadPoolQueue* ThreadPool::queue(int index)
+{
+    index %= MaxQueues;
+    if (index < mQueueCount.load(std::memory_order_acquire))
+        return mQueues[index];
+    std::lock_guard<std::mutex> lock(mMutex);
+    while (mQueueCount <= index) {
+        mQueues[mQueueCount] = new ThreadPoolQueue;
+        mQueueCount.fetch_add(1, std::memory_order_release);
+    }
+    return mQueues[index];
+}
+
+std::shared_ptr<ThreadPool::Job> ThreadPool::takeJob(int index)
+{
+    // not skipped when nothing is pending, whatever is still queued then
+    // was removed or cancelled and popping it lets go of it. An empty
+    // queue is looked at without its lock.
+    std::shared_ptr<Job> job;
+    const int count = mQueueCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+        ThreadPoolQueue *q = i ? mQueues[(index + i) % count] : queue(index);
+        while ((job = q->pop())) {
+            if (claim(job.get()))
+                return job;
         }
-        mConcurrentJobs = concurrentJobs;
     }
+    return job;
+}
+
+bool ThreadPool::claim(Job *job)
+{
+    if (!job->mQueued.exchange(false))
+        return false;
+    --mPending;
+    if (job->isCancelled()) {
+        std::lock_guard<std::mutex> lock(job->mMutex);
+        job->mState = Job::Cancelled;
+        return false;
+    }
+    return true;
 }
 
 bool ThreadPool::jobLessThan(const std::shared_ptr<Job> &l, const std::shared_ptr<Job> &r)
 {
-    return static_cast<unsigned>(l->mPriority) > static_cast<unsigned>(r->mPriority);
+    if (l->mPriority != r->mPriority)
+        return static_cast<unsigned>(l->mPriority) > static_cast<unsigned>(r->mPriority);
+    return l->mDeadline < r->mDeadline;
 }
 
 void ThreadPool::start(const std::shared_ptr<Job> &job, int priority)
+{
+    start(job, Job::Deadline::max(), priority);
+}
+
+void ThreadPool::start(const std::shared_ptr<Job> &job, Job::Deadline deadline, int priority)
 {
     job->mPriority = priority;
+    job->mDeadline = deadline;
+    if (mMetrics)
+        job->mQueuedAt = Rct::monoUs();
     if (priority == Guaranteed) {
         ThreadPoolThread *t = new ThreadPoolThread(job);
         t->start(mPriority, mThreadStackSize);
         return;
     }
 
+    if (mFlags & WorkStealing) {
+        ThreadPoolThread* current = ThreadPoolThread::current();
+        int index;
+        if (current && current->mPool == this) {
+            index = current->mIndex;
+        } else {
+            index = mNextQueue++ % std::max(1, mActiveQueues.load());
+        }
+        job->mPool = this;
+        const int pending = ++mPending;
+        if (mMetrics)
+            mMetrics->queueDepth.add(pending);
+        job->mQueued = true;
+        queue(index)->push(job);
+        if (mSleeping) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCond.notify_one();
+        }
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(mMutex);
-    if (mJobs.empty()) {
+    job->mPool = this;
+    job->mQueued = true;
+    // after everything that doesn't go before it, so equal jobs stay in order
+    if (mJobs.empty() || !jobLessThan(job, mJobs.back())) {
         mJobs.push_back(job);
     } else {
-        if (mJobs.at(mJobs.size() - 1)->mPriority >= priority) {
-            mJobs.push_back(job);
-        } else if (mJobs.at(0)->mPriority < priority) {
-            mJobs.push_front(job);
-        } else {
-            mJobs.push_back(job);
-            std::sort(mJobs.begin(), mJobs.end(), jobLessThan);
-        }
+        mJobs.insert(std::upper_bound(mJobs.begin(), mJobs.end(), job, jobLessThan), job);
+    }
+    ++mPending;
+    if (mMetrics)
+        mMetrics->queueDepth.add(mPending);
+    if (mMaxThreads > 0 && mThreads.size() < mMaxThreads
+        && mPending > mThreads.size() - mBusyThreads) {
+        reapThreads();
+        addThread();
     }
-    mCond.notify_one();
+    // spinning threads see mPending, only sleeping ones need waking
+    if (mSleeping)
+        mCond.notify_one();
 }
 
 bool ThreadPool::remove(const std::shared_ptr<Job> &job)
 {
-    std::lock_guard<std::mutex> lock(mMutex);
-    std::deque<std::shared_ptr<Job> >::iterator it = std::find(mJobs.begin(), mJobs.end(), job);
-    if (it == mJobs.end())
+    if (job->mPool != this || !job->mQueued.exchange(false))
         return false;
-    mJobs.erase(it);
+    --mPending;
     return true;
 }
 
+struct ParallelState
+{
+    ParallelState(int count, const std::function<void(int)>* func)
+        : next(0), chunks(count), fn(func), done(count)
+    {}
+
+    std::atomic<int> next;
+    const int chunks;
+    const std::function<void(int)>* fn;
+    Latch done;
+
+    void run()
+    {
+        // fn belongs to the caller of parallelRun() and is only touched for
+        // a claimed chunk, helpers that start after it returned see none
+        int chunk;
+        while ((chunk = next++) < chunks) {
+            (*fn)(chunk);
+            done.countDown();
+        }
+    }
+};
+
+class ParallelJob : public ThreadPool::Job
+{
+public:
+    ParallelJob(const std::shared_ptr<ParallelState> &state)
+        : mState(state)
+    {}
+protected:
+    virtual void run() override { mState->run(); }
+private:
+    std::shared_ptr<ParallelState> mState;
+};
+
+void ThreadPool::parallelRun(int chunks, const std::function<void(int)>& fn)
+{
+    if (chunks <= 0)
+        return;
+    // an adaptive pool grows as the helpers are started
+    const int helpers = std::min(chunks, mMaxThreads > 0 ? mMaxThreads : mConcurrentJobs) - 1;
+    if (helpers <= 0) {
+        for (int i = 0; i < chunks; ++i)
+            fn(i);
+        return;
+    }
+    std::shared_ptr<ParallelState> state = std::make_shared<ParallelState>(chunks, &fn);
+    for (int i = 0; i < helpers; ++i)
+        start(std::make_shared<ParallelJob>(state));
+    state->run();
+    state->done.wait();
+}
+
 int ThreadPool::idealThreadCount()
 {
 #if defined (OS_FreeBSD) || defined (OS_NetBSD) || defined (OS_OpenBSD)
@@ -200,6 +652,15 @@ int ThreadPool::idealThreadCount()
         return 1;
     return cores;
 #elif defined (OS_Linux)
+#ifdef HAVE_SCHED_GETAFFINITY
+    // taskset, cgroup cpusets and the like leave fewer cpus than are online
+    cpu_set_t set;
+    if (!sched_getaffinity(0, sizeof(set), &set)) {
+        const int count = CPU_COUNT(&set);
+        if (count > 0)
+            return count;
+    }
+#endif
     return (int)sysconf(_SC_NPROCESSORS_ONLN);
 #elif defined (OS_Darwin)
     int cores;
@@ -257,25 +718,94 @@ ThreadPool* ThreadPool::instance()
     return sInstance;
 }
 
+ThreadPool* ThreadPool::nodeInstance(int node)
+{
+    static std::mutex mutex;
+    static List<ThreadPool*> pools;
+    const CpuTopology &topology = CpuTopology::instance();
+    if (node < 0 || node >= topology.nodeCount())
+        return 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pools.isEmpty())
+        pools.resize(topology.nodeCount(), 0);
+    ThreadPool *&pool = pools[node];
+    if (!pool) {
+        const List<int> cpus = topology.nodeCpus(node);
+        pool = new ThreadPool(std::max(1, cpus.size()));
+        if (!cpus.isEmpty())
+            pool->setAffinity(Compact, cpus);
+    }
+    return pool;
+}
+
 ThreadPool::Job::Job()
-    : mPriority(0), mState(NotStarted)
+    : mPriority(0), mDeadline(Deadline::max()), mQueuedAt(0), mState(NotStarted),
+      mQueued(false), mCancelled(false), mPool(0)
 {
 }
 
+void ThreadPool::Job::cancel()
+{
+    mCancelled = true;
+    ThreadPool *pool = mPool;
+    if (pool && mQueued.exchange(false)) {
+        --pool->mPending;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mState = Cancelled;
+    }
+}
+
 void ThreadPool::clearBackLog()
 {
+    const int count = mQueueCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i)
+        mPending -= mQueues[i]->clear();
     std::lock_guard<std::mutex> lock(mMutex);
+    for (const std::shared_ptr<Job> &job : mJobs) {
+        if (job->mQueued.exchange(false))
+            --mPending;
+    }
     mJobs.clear();
 }
 
 int ThreadPool::busyThreads() const
 {
-    std::lock_guard<std::mutex> lock(mMutex);
     return mBusyThreads;
 }
 
+void ThreadPool::runJob(Job *job)
+{
+    RCT_TRACE("ThreadPool::Job::run");
+    if (!mMetrics) {
+        job->run();
+        return;
+    }
+    const uint64_t started = Rct::monoUs();
+    mMetrics->waitTime.add(started - job->mQueuedAt);
+    job->run();
+    mMetrics->runTime.add(Rct::monoUs() - started);
+}
+
+Value ThreadPool::metrics() const
+{
+    Value ret;
+    if (!mMetrics)
+        return ret;
+    ret["time"] = Rct::monoUs();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ret["threads"] = static_cast<int>(mThreads.size());
+    }
+    ret["busy"] = busyThreads();
+    ret["pending"] = backlogSize();
+    ret["queueDepth"] = mMetrics->queueDepth.toValue();
+    ret["waitTime"] = mMetrics->waitTime.toValue();
+    ret["runTime"] = mMetrics->runTime.toValue();
+    return ret;
+}
+
 int ThreadPool::backlogSize() const
 {
-    std::lock_guard<std::mutex> lock(mMutex);
-    return mJobs.size();
+    return std::max(0, mPending.load());
 }
@@ -2,26 +2,105 @@
 #define ThreadPool_h
 
 #include "List.h"
+#include "String.h"
 #include "Thread.h"
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
+#include <vector>
 
 class ThreadPoolThread;
+class ThreadPoolQueue;
+class Value;
 
 class ThreadPool
 {
 public:
+    enum Flag {
+        None = 0x0,
+        // Every thread has its own queue and takes work from the others
+        // when it runs dry. Jobs started from inside a job stay on the
+        // thread that started them. Priorities are only kept apart in powers
+        // of two, and only within a queue.
+        WorkStealing = 0x1,
+        // keep the histograms metrics() returns
+        EnableMetrics = 0x2
+    };
+
     ThreadPool(int concurrentJobs,
                Thread::Priority priority = Thread::Normal,
-               size_t stackSize = 0);
+               size_t stackSize = 0,
+               unsigned int flags = None);
     ~ThreadPool();
 
+    // Turns off adaptive sizing
     void setConcurrentJobs(int concurrentJobs);
+
+    // The threads register with CpuUsage as name/index, "ThreadPool" by
+    // default
+    void setName(const String &name);
+    String name() const { std::lock_guard<std::mutex> lock(mMutex); return mName; }
+
+    // Keeps between minThreads and maxThreads threads. A thread is added
+    // when a job is started and there are more jobs waiting than idle
+    // threads, and a thread that had nothing to do for idleTimeout ms
+    // exits. Ignored for WorkStealing pools, their queues belong to their
+    // threads.
+    void setAdaptive(int minThreads, int maxThreads, int idleTimeout = 10000);
+    bool isAdaptive() const { std::lock_guard<std::mutex> lock(mMutex); return mMaxThreads > 0; }
+    // Threads that run out of work poll for this many microseconds before
+    // they go to sleep. Jobs started meanwhile are picked up without a
+    // wakeup, at the price of burning a cpu while there are none. 0, the
+    // default, sleeps right away.
+    void setSpinTime(int usecs) { mSpinTime = std::max(0, usecs); }
+    int spinTime() const { return mSpinTime; }
+
+    enum Affinity {
+        NoAffinity,
+        // Thread i is pinned to the i'th cpu of CpuTopology::compactOrder()
+        // or scatterOrder(), wrapping around when there are more threads
+        // than cpus. Compact keeps threads that share data close, Scatter
+        // gives each one as much cache and memory bandwidth as possible.
+        Compact,
+        Scatter,
+        // Every thread may run on any of the given cpus
+        CpuSet
+    };
+    // Applies to the running threads and to those started later. For
+    // Compact and Scatter a non-empty cpus limits which cpus are used.
+    void setAffinity(Affinity affinity, const List<int> &cpus = List<int>());
+    Affinity affinity() const { std::lock_guard<std::mutex> lock(mMutex); return mAffinity; }
+    // Keeps the threads on the cpus of a NUMA node. Memory is placed on
+    // the node of the thread that first touches it, so jobs that allocate
+    // what they work on get local memory.
+    void setNode(int node);
+
     void clearBackLog();
     int backlogSize() const;
 
+    class Job;
+
+    // Shared between jobs that should stop together, e.g. all the work for
+    // a request that a newer one has superseded
+    class CancellationToken
+    {
+    public:
+        CancellationToken() : mCancelled(std::make_shared<std::atomic<bool> >(false)) {}
+
+        void cancel() { *mCancelled = true; }
+        bool isCancelled() const { return *mCancelled; }
+    private:
+        std::shared_ptr<std::atomic<bool> > mCancelled;
+
+        friend class Job;
+    };
+
     class Job
     {
     public:
@@ -31,44 +110,179 @@ public:
         enum State {
             NotStarted,
             Running,
-            Finished
+            Finished,
+            Cancelled
         };
         State state() const { std::lock_guard<std::mutex> lock(mMutex); return mState; }
+
+        // A job that's queued is dropped, its state becomes Cancelled. A
+        // running one has to check isCancelled() and return early by itself.
+        void cancel();
+        bool isCancelled() const { return mCancelled || (mToken && *mToken); }
+        // set before the job is started
+        void setCancellationToken(const CancellationToken &token) { mToken = token.mCancelled; }
+
+        typedef std::chrono::steady_clock::time_point Deadline;
+        Deadline deadline() const { return mDeadline; }
     protected:
         virtual void run() = 0;
         std::mutex &mutex() const { return mMutex; }
 
     private:
         int mPriority;
+        Deadline mDeadline;
+        // Rct::monoUs() at start(), only set when there are metrics
+        uint64_t mQueuedAt;
         State mState;
         mutable std::mutex mMutex;
+        // whoever clears mQueued owns taking the job off the queue, a taken
+        // job is left in the queue and skipped
+        std::atomic<bool> mQueued, mCancelled;
+        std::atomic<ThreadPool*> mPool;
+        std::shared_ptr<std::atomic<bool> > mToken;
 
         friend class ThreadPool;
         friend class ThreadPoolThread;
+        friend class ThreadPoolQueue;
     };
 
     enum { Guaranteed = -1 };
 
     void start(const std::shared_ptr<Job> &job, int priority = 0);
+    // Among jobs of the same priority the one with the earliest deadline
+    // runs first, jobs without one come after those with one. In
+    // WorkStealing mode that holds within a thread's queue.
+    void start(const std::shared_ptr<Job> &job, Job::Deadline deadline, int priority = 0);
 
+    // Takes a job that hasn't started off the queue in constant time
     bool remove(const std::shared_ptr<Job> &job);
 
+    // Runs func on the pool, the future gets its result
+    template <typename Func>
+    std::future<typename std::result_of<Func()>::type> submit(Func&& func, int priority = 0)
+    {
+        typedef typename std::result_of<Func()>::type Result;
+        std::shared_ptr<TaskJob<Result> > job = std::make_shared<TaskJob<Result> >(std::forward<Func>(func));
+        std::future<Result> ret = job->task.get_future();
+        start(job, priority);
+        return ret;
+    }
+
+    // Calls fn(i) for every i in [begin, end) and returns when all of them
+    // have. The range is split into chunks of grain items that the pool's
+    // threads and the calling thread claim one at a time, so there's one
+    // Job per helping thread rather than one per item. Safe to call from
+    // inside a job, the caller works through the chunks itself.
+    template <typename Func>
+    void parallelFor(int begin, int end, int grain, const Func& fn)
+    {
+        if (grain < 1)
+            grain = 1;
+        const int chunks = end > begin ? ((end - begin) + grain - 1) / grain : 0;
+        parallelRun(chunks, [begin, end, grain, &fn](int chunk) {
+                const int from = begin + (chunk * grain);
+                const int to = std::min(end, from + grain);
+                for (int i = from; i < to; ++i)
+                    fn(i);
+            });
+    }
+
+    // reduce(..., map(i)) over [begin, end). Every chunk is reduced on its
+    // own, starting from identity, and the chunks are then combined in
+    // order so the result doesn't depend on scheduling.
+    template <typename T, typename Map, typename Reduce>
+    T parallelReduce(int begin, int end, int grain, const T& identity, const Map& map, const Reduce& reduce)
+    {
+        if (grain < 1)
+            grain = 1;
+        const int chunks = end > begin ? ((end - begin) + grain - 1) / grain : 0;
+        std::vector<T> partial(chunks, identity);
+        parallelRun(chunks, [begin, end, grain, &map, &reduce, &partial](int chunk) {
+                const int from = begin + (chunk * grain);
+                const int to = std::min(end, from + grain);
+                T& value = partial[chunk];
+                for (int i = from; i < to; ++i)
+                    value = reduce(value, map(i));
+            });
+        T ret = identity;
+        for (const T& value : partial)
+            ret = reduce(ret, value);
+        return ret;
+    }
+
+    // fn(chunk) for every chunk in [0, chunks), what the helpers above use
+    void parallelRun(int chunks, const std::function<void(int)>& fn);
+
+    // The number of cpus this process is allowed to run on
     static int idealThreadCount();
     static ThreadPool* instance();
+    // A pool with one thread per cpu of the node, created on first use
+    static ThreadPool* nodeInstance(int node);
 
     int busyThreads() const;
+
+    // For EnableMetrics pools, the queue depth seen by every start() and
+    // how long jobs waited and ran in microseconds
+    Value metrics() const;
 private:
+    template <typename Result>
+    class TaskJob : public Job
+    {
+    public:
+        template <typename Func>
+        TaskJob(Func&& func) : task(std::forward<Func>(func)) {}
+        std::packaged_task<Result()> task;
+    protected:
+        virtual void run() override { task(); }
+    };
+
     static bool jobLessThan(const std::shared_ptr<Job> &l, const std::shared_ptr<Job> &r);
+    // for jobs popped off a queue, false if someone else took it first or
+    // it was cancelled
+    bool claim(Job *job);
+
+    // WorkStealing
+    enum { MaxQueues = 256 };
+    ThreadPoolQueue* queue(int index);
+    std::shared_ptr<Job> takeJob(int index);
+
+    void applyAffinity(ThreadPoolThread *thread, int index);
+
+    // call with mMutex held
+    void addThread();
+    void reapThreads();
+    bool retire(ThreadPoolThread *thread);
+    void spin(const ThreadPoolThread *thread) const;
+
+    void runJob(Job *job);
 
 private:
     int mConcurrentJobs;
+    const unsigned int mFlags;
     mutable std::mutex mMutex;
     std::condition_variable mCond;
     std::deque<std::shared_ptr<Job> > mJobs;
     List<ThreadPoolThread*> mThreads;
-    int mBusyThreads;
+    // threads that retired themselves, joined by the next one to resize
+    List<ThreadPoolThread*> mRetired;
+    int mMinThreads, mMaxThreads, mIdleTimeout;
+    std::atomic<int> mSpinTime;
+    std::atomic<int> mBusyThreads;
+    // queues are created as threads are and never go away, a thread that
+    // was stopped leaves its jobs to be stolen
+    ThreadPoolQueue* mQueues[MaxQueues];
+    std::atomic<int> mQueueCount, mActiveQueues;
+    std::atomic<unsigned int> mNextQueue;
+    // jobs waiting and threads waiting for them, in both modes
+    std::atomic<int> mPending, mSleeping;
     const Thread::Priority mPriority;
     const size_t mThreadStackSize;
+    Affinity mAffinity;
+    // one cpu per thread for Compact and Scatter, the set for CpuSet
+    List<int> mAffinityCpus;
+    struct Metrics;
+    std::unique_ptr<Metrics> mMetrics;
+    String mName;
 
     static ThreadPool* sInstance;
 
@@ -2,12 +2,12 @@
 #include "EventLoop.h"
 
 Timer::Timer()
-    : timerId(0)
+    : timerId(0), timerSlack(0)
 {
 }
 
 Timer::Timer(int interval, int flags)
-    : timerId(0)
+    : timerId(0), timerSlack(0)
 {
     restart(interval, flags);
 }
@@ -25,7 +25,7 @@ void Timer::restart(int interval, int flags, const std::shared_ptr<EventLoop> &l
         if (timerId)
             loop->unregisterTimer(timerId);
         timerId = loop->registerTimer(std::bind(&Timer::timerFired, this, std::placeholders::_1),
-                                      interval, flags);
+                                      interval, flags, timerSlack);
     }
 }
 
@@ -8,7 +8,12 @@ class EventLoop;
 class Timer
 {
 public:
-    enum { SingleShot = 0x1 };
+    enum {
+        SingleShot = 0x1,
+        // interval is in microseconds rather than milliseconds, on
+        // Linux these timers are armed through a timerfd
+        HighResolution = 0x2
+    };
 
     Timer();
     Timer(int interval, int flags = 0);
@@ -17,6 +22,12 @@ public:
     void restart(int interval, int flags = 0, const std::shared_ptr<EventLoop> &eventLoop = std::shared_ptr<EventLoop>());
     void stop();
 
+    // How much later than the interval the timer may fire, in the same
+    // unit, so that periodic timers such as keepalives share wakeups. Takes
+    // effect with the next restart().
+    void setSlack(int slack) { timerSlack = slack; }
+    int slack() const { return timerSlack; }
+
     Signal<std::function<void(Timer*)> >& timeout() { return signalTimeout; }
 
     bool isRunning() const { return timerId; }
@@ -26,7 +37,7 @@ private:
     void timerFired(int id);
 
 private:
-    int timerId;
+    int timerId, timerSlack;
     Signal<std::function<void(Timer*)> > signalTimeout;
 };
 
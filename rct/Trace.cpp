@@ -0,0 +1,199 @@
+#include "Trace.h"
+#include "List.h"
+#include "rct-config.h"
+#include <algorithm>
+#include <mutex>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(OS_Linux)
+#  include <sys/syscall.h>
+#endif
+
+std::atomic<bool> Trace::sEnabled(false);
+
+struct TraceEvent
+{
+    const char *name, *category;
+    uint64_t start, duration;
+};
+
+// One per thread that has recorded a span. The owning thread is the only
+// writer so its mutex is only ever contended while a trace is written out.
+// Buffers outlive their threads so a dump still has their spans, but only
+// the ones of the last MaxExitedBuffers threads that exited are kept.
+struct TraceBuffer
+{
+    TraceBuffer(int size, uint64_t t)
+        : events(new TraceEvent[size]), capacity(size), count(0), tid(t)
+    {}
+    ~TraceBuffer() { delete[] events; }
+
+    std::mutex mutex;
+    TraceEvent *events;
+    const int capacity;
+    // all that were recorded, the ring has the last capacity of them
+    uint64_t count;
+    const uint64_t tid;
+};
+
+enum { MaxExitedBuffers = 64 };
+
+static std::mutex sBuffersMutex;
+static List<TraceBuffer*> sBuffers;
+// the buffers of threads that have exited, oldest first
+static List<TraceBuffer*> sExitedBuffers;
+static std::atomic<int> sEventsPerThread(16384);
+static pthread_key_t sBufferKey;
+static std::once_flag sBufferKeyOnce;
+
+static uint64_t threadId()
+{
+#if defined(OS_Linux)
+    return syscall(SYS_gettid);
+#else
+    static std::atomic<uint64_t> sNext(1);
+    return sNext++;
+#endif
+}
+
+static void removeBuffer(TraceBuffer *buffer)
+{
+    sBuffers.remove(buffer);
+    delete buffer;
+}
+
+static void threadExited(void *data)
+{
+    TraceBuffer *buffer = static_cast<TraceBuffer*>(data);
+    std::lock_guard<std::mutex> lock(sBuffersMutex);
+    if (!buffer->count) {
+        removeBuffer(buffer);
+        return;
+    }
+    sExitedBuffers.append(buffer);
+    if (sExitedBuffers.size() > MaxExitedBuffers)
+        removeBuffer(sExitedBuffers.takeFirst());
+}
+
+static TraceBuffer *threadBuffer()
+{
+    std::call_once(sBufferKeyOnce, []() { pthread_key_create(&sBufferKey, threadExited); });
+    TraceBuffer *buffer = static_cast<TraceBuffer*>(pthread_getspecific(sBufferKey));
+    if (!buffer) {
+        buffer = new TraceBuffer(sEventsPerThread, threadId());
+        pthread_setspecific(sBufferKey, buffer);
+        std::lock_guard<std::mutex> lock(sBuffersMutex);
+        sBuffers.append(buffer);
+    }
+    return buffer;
+}
+
+void Trace::start(int eventsPerThread)
+{
+    sEventsPerThread = std::max(1, eventsPerThread);
+    sEnabled = true;
+}
+
+void Trace::stop()
+{
+    sEnabled = false;
+}
+
+void Trace::clear()
+{
+    std::lock_guard<std::mutex> lock(sBuffersMutex);
+    for (TraceBuffer *buffer : sExitedBuffers)
+        removeBuffer(buffer);
+    sExitedBuffers.clear();
+    for (TraceBuffer *buffer : sBuffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        buffer->count = 0;
+    }
+}
+
+uint64_t Trace::now()
+{
+    timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (spec.tv_sec * static_cast<uint64_t>(1000000000)) + spec.tv_nsec;
+}
+
+void Trace::record(const char *name, const char *category, uint64_t start, uint64_t duration)
+{
+    TraceBuffer *buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    TraceEvent &event = buffer->events[buffer->count++ % buffer->capacity];
+    event.name = name;
+    event.category = category;
+    event.start = start;
+    event.duration = duration;
+}
+
+static void writeString(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (const char *ch = str; *ch; ++ch) {
+        const unsigned char c = *ch;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool Trace::write(FILE *f)
+{
+    // copied out so no thread is held up while this is formatted, and so
+    // the buffers of threads that exit meanwhile can go away
+    List<std::pair<uint64_t, List<TraceEvent> > > threads;
+    {
+        std::lock_guard<std::mutex> lock(sBuffersMutex);
+        threads.reserve(sBuffers.size());
+        for (TraceBuffer *buffer : sBuffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            const uint64_t count = buffer->count;
+            const uint64_t from = count > static_cast<uint64_t>(buffer->capacity) ? count - buffer->capacity : 0;
+            threads.append(std::make_pair(buffer->tid, List<TraceEvent>()));
+            List<TraceEvent> &events = threads.last().second;
+            events.reserve(count - from);
+            for (uint64_t i = from; i < count; ++i)
+                events.append(buffer->events[i % buffer->capacity]);
+        }
+    }
+    const int pid = getpid();
+    bool first = true;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+    for (const std::pair<uint64_t, List<TraceEvent> > &thread : threads) {
+        for (const TraceEvent &event : thread.second) {
+            fputs(first ? "\n{\"name\":" : ",\n{\"name\":", f);
+            first = false;
+            writeString(f, event.name);
+            fputs(",\"cat\":", f);
+            writeString(f, event.category);
+            // ts and dur are in microseconds
+            fprintf(f, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%llu,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+                    pid, static_cast<unsigned long long>(thread.first),
+                    static_cast<unsigned long long>(event.start / 1000),
+                    static_cast<unsigned long long>(event.start % 1000),
+                    static_cast<unsigned long long>(event.duration / 1000),
+                    static_cast<unsigned long long>(event.duration % 1000));
+        }
+    }
+    fputs("\n]}\n", f);
+    return !ferror(f);
+}
+
+bool Trace::write(const Path &path)
+{
+    FILE *f = fopen(path.constData(), "w");
+    if (!f)
+        return false;
+    const bool ret = write(f);
+    return fclose(f) == 0 && ret;
+}
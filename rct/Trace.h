@@ -0,0 +1,66 @@
+#ifndef Trace_h
+#define Trace_h
+
+#include <rct/Path.h>
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+// Records spans of time per thread while tracing is on and writes them out
+// in the Chrome trace event format, which chrome://tracing and the Perfetto
+// UI both open. Every thread has a ring of its most recent spans so a long
+// running process can be traced and then dumped after a latency spike.
+//
+// rct itself puts spans around ThreadPool jobs, posted events, socket
+// callbacks and Message::create().
+class Trace
+{
+public:
+    // eventsPerThread spans are kept for every thread, older ones are
+    // overwritten
+    static void start(int eventsPerThread = 16384);
+    static void stop();
+    static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+    // forgets what has been recorded so far
+    static void clear();
+
+    static bool write(const Path &path);
+    static bool write(FILE *f);
+
+    // nanoseconds, the clock span times are in
+    static uint64_t now();
+    // name and category have to stay valid until the trace has been
+    // written, string literals are what they're meant to be
+    static void record(const char *name, const char *category, uint64_t start, uint64_t duration);
+
+private:
+    static std::atomic<bool> sEnabled;
+};
+
+// Records a span from construction to destruction
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, const char *category = "rct")
+        : mName(name), mCategory(category), mStart(Trace::isEnabled() ? Trace::now() : 0)
+    {
+    }
+    ~TraceSpan()
+    {
+        if (mStart)
+            Trace::record(mName, mCategory, mStart, Trace::now() - mStart);
+    }
+
+private:
+    const char *mName, *mCategory;
+    const uint64_t mStart;
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+#define RCT_TRACE_CAT2(a, b) a##b
+#define RCT_TRACE_CAT(a, b) RCT_TRACE_CAT2(a, b)
+#define RCT_TRACE(...) TraceSpan RCT_TRACE_CAT(traceSpan, __LINE__)(__VA_ARGS__)
+
+#endif
@@ -1,17 +1,20 @@
 #include "Value.h"
-#include "../cJSON/cJSON.h"
+#include "JSONParser.h"
+#include <float.h>
+#include <limits.h>
 
 void Value::clear()
 {
     switch (mType) {
     case Type_String:
-        stringPtr()->~String();
+        if (mInlineLength < 0)
+            sharedString()->~SharedString();
         break;
     case Type_Map:
-        mapPtr()->~Map<String, Value>();
+        sharedMap()->~SharedMap();
         break;
     case Type_List:
-        listPtr()->~List<Value>();
+        sharedList()->~SharedList();
         break;
     case Type_Custom:
         customPtr()->~shared_ptr<Custom>();
@@ -21,21 +24,38 @@ void Value::clear()
     }
 
     mType = Type_Invalid;
+    mInlineLength = -1;
+    mUnsigned = false;
+    mUnsharable = false;
 }
 
 void Value::copy(const Value &other)
 {
     assert(isNull());
     mType = other.mType;
+    mInlineLength = other.mInlineLength;
+    mUnsigned = other.mUnsigned;
     switch (mType) {
     case Type_String:
-        new (mData.stringBuf) String(*other.stringPtr());
+        if (mInlineLength < 0) {
+            new (mData.stringBuf) SharedString(*other.sharedString());
+        } else {
+            memcpy(&mData, &other.mData, sizeof(mData));
+        }
         break;
     case Type_Map:
-        new (mData.mapBuf) Map<String, Value>(*other.mapPtr());
+        if (other.mUnsharable) {
+            new (mData.mapBuf) SharedMap(makeShared<Map<String, Value> >(*other.mapPtr()));
+        } else {
+            new (mData.mapBuf) SharedMap(*other.sharedMap());
+        }
         break;
     case Type_List:
-        new (mData.listBuf) List<Value>(*other.listPtr());
+        if (other.mUnsharable) {
+            new (mData.listBuf) SharedList(makeShared<List<Value> >(*other.listPtr()));
+        } else {
+            new (mData.listBuf) SharedList(*other.sharedList());
+        }
         break;
     case Type_Custom:
         new (mData.customBuf) std::shared_ptr<Custom>(*other.customPtr());
@@ -46,93 +66,327 @@ void Value::copy(const Value &other)
     }
 }
 
-static Value fromCJSON(const cJSON *object)
+void Value::move(Value &other)
 {
-    assert(object);
-    switch (object->type) {
-    case cJSON_False:
-        return Value(false);
-    case cJSON_True:
-        return Value(true);
-    case cJSON_NULL:
-        break;
-    case cJSON_Number:
-        if (object->valueint == object->valuedouble)
-            return Value(object->valueint);
-        return Value(object->valuedouble);
-    case cJSON_String:
-        return Value(String(object->valuestring));
-    case cJSON_Array: {
-        List<Value> values;
-        for (const cJSON *child = object->child; child; child = child->next) {
-            values.append(fromCJSON(child));
+    assert(isNull());
+    mType = other.mType;
+    mInlineLength = other.mInlineLength;
+    mUnsigned = other.mUnsigned;
+    mUnsharable = other.mUnsharable;
+    switch (mType) {
+    case Type_String:
+        if (mInlineLength < 0) {
+            new (mData.stringBuf) SharedString(std::move(*other.sharedString()));
+        } else {
+            memcpy(&mData, &other.mData, sizeof(mData));
         }
-        return values; }
-    case cJSON_Object: {
-        Map<String, Value> values;
-        for (const cJSON *child = object->child; child; child = child->next)
-            values[child->string] = fromCJSON(child);
-        return values; }
-    }
-    return Value();
+        break;
+    case Type_Map:
+        new (mData.mapBuf) SharedMap(std::move(*other.sharedMap()));
+        break;
+    case Type_List:
+        new (mData.listBuf) SharedList(std::move(*other.sharedList()));
+        break;
+    case Type_Custom:
+        new (mData.customBuf) std::shared_ptr<Custom>(std::move(*other.customPtr()));
+        break;
+    default:
+        memcpy(&mData, &other.mData, sizeof(mData));
+        break;
+    }
+    other.clear();
 }
 
-Value Value::fromJSON(const char *json, bool *ok)
+// Builds the Value in place as the parser goes, every value is
+// constructed where it ends up
+class ValueBuilder : public JSONParser::Handler
 {
-    cJSON *obj = cJSON_Parse(json);
-    if (!obj) {
-        if (ok)
-            *ok = false;
-        return Value();
+public:
+    ValueBuilder(Value &root)
+        : mRoot(root)
+    {}
+
+    virtual bool onNull() override
+    {
+        slot();
+        return true;
+    }
+    virtual bool onBoolean(bool value) override
+    {
+        Value &v = slot();
+        v.mType = Value::Type_Boolean;
+        v.mData.boolean = value;
+        return true;
+    }
+    virtual bool onInteger(int64_t value) override
+    {
+        if (value < INT_MIN || value > INT_MAX)
+            return onDouble(static_cast<double>(value));
+        Value &v = slot();
+        v.mType = Value::Type_Integer;
+        v.mData.int64 = value;
+        return true;
+    }
+    virtual bool onDouble(double value) override
+    {
+        // integral numbers in range are integers, like with cJSON
+        if (value >= INT_MIN && value <= INT_MAX && static_cast<int>(value) == value)
+            return onInteger(static_cast<int>(value));
+        Value &v = slot();
+        v.mType = Value::Type_Double;
+        v.mData.dbl = value;
+        return true;
+    }
+    virtual bool onString(const char *string, int length) override
+    {
+        slot().setString(string, length);
+        return true;
+    }
+    virtual bool onKey(const char *key, int length) override
+    {
+        mKey.assign(key, length);
+        return true;
+    }
+    virtual bool onBeginMap() override
+    {
+        Value &v = slot();
+        v.initMap();
+        mStack.push_back(&v);
+        return true;
+    }
+    virtual bool onEndMap() override
+    {
+        mStack.pop_back();
+        return true;
+    }
+    virtual bool onBeginList() override
+    {
+        Value &v = slot();
+        v.initList();
+        mStack.push_back(&v);
+        return true;
+    }
+    virtual bool onEndList() override
+    {
+        mStack.pop_back();
+        return true;
+    }
+
+private:
+    // Where the next value goes, invalid. The containers on the stack
+    // don't move while their children are added since only the innermost
+    // one grows, and none of them are shared yet.
+    Value &slot()
+    {
+        if (mStack.empty())
+            return mRoot;
+        Value *parent = mStack.back();
+        if (parent->mType == Value::Type_List) {
+            List<Value> *list = parent->listPtr();
+            list->emplace_back();
+            return list->back();
+        }
+        // the last of duplicate keys wins
+        Value &ret = (*parent->mapPtr())[mKey];
+        ret.clear();
+        return ret;
     }
 
-    const Value ret = ::fromCJSON(obj);
+    Value &mRoot;
+    String mKey;
+    std::vector<Value*> mStack;
+};
+
+static Value parseJSON(const char *json, int length, bool *ok)
+{
+    Value ret;
+    ValueBuilder builder(ret);
+    JSONParser parser(&builder);
+    const bool parsed = parser.parse(json, length);
     if (ok)
-        *ok = true;
-    cJSON_Delete(obj);
+        *ok = parsed;
+    if (!parsed)
+        return Value();
     return ret;
 }
 
-cJSON *Value::toCJSON(const Value &value)
+Value Value::fromJSON(const String &json, bool *ok)
 {
-    switch (value.type()) {
-    case Value::Type_Boolean: return value.toBool() ? cJSON_CreateTrue() : cJSON_CreateFalse();
-    case Value::Type_Integer: return cJSON_CreateNumber(value.toInteger());
-    case Value::Type_Double: return cJSON_CreateNumber(value.toDouble());
-    case Value::Type_String: return cJSON_CreateString(value.toString().constData());
-    case Value::Type_List: {
-        cJSON *array = cJSON_CreateArray();
-        for (const auto &v : *value.listPtr())
-            cJSON_AddItemToArray(array, toCJSON(v));
-        return array; }
-    case Value::Type_Map: {
-        cJSON *object = cJSON_CreateObject();
-        for (const auto &v : *value.mapPtr())
-            cJSON_AddItemToObject(object, v.first.constData(), v.second.toCJSON(v.second));
-        return object; }
-    case Value::Type_Invalid:
-        break;
-    case Value::Type_Undefined:
-        break;
-    case Value::Type_Custom:
-        if (std::shared_ptr<Value::Custom> custom = value.toCustom()) {
-            cJSON *ret = cJSON_CreateString(custom->toString().constData());
-            if (ret) {
-                ret->type = cJSON_RawString;
-                return ret;
+    return parseJSON(json.constData(), json.size(), ok);
+}
+
+Value Value::fromJSON(const char *json, bool *ok)
+{
+    return parseJSON(json, -1, ok);
+}
+
+Value Value::fromJSONFile(const Path &path, bool *ok)
+{
+    Value ret;
+    ValueBuilder builder(ret);
+    JSONParser parser(&builder);
+    const bool parsed = parser.parseFile(path);
+    if (ok)
+        *ok = parsed;
+    if (!parsed)
+        return Value();
+    return ret;
+}
+
+// The output is the same as cJSON's, strings end at a null byte and quote
+// is false for the raw strings of Custom values
+static void writeString(String &out, const char *str, int length, bool quote)
+{
+    if (quote)
+        out.append('"');
+    const char *end = str + length;
+    while (str < end) {
+        const char *run = str;
+        while (str < end && static_cast<unsigned char>(*str) > 31 && (*str != '"' || !quote) && *str != '\\')
+            ++str;
+        if (str > run)
+            out.append(run, str - run);
+        if (str == end || !*str)
+            break;
+        const unsigned char ch = *str++;
+        switch (ch) {
+        case '\\': out.append("\\\\", 2); break;
+        case '"': out.append("\\\"", 2); break;
+        case '\b': out.append("\\b", 2); break;
+        case '\f': out.append("\\f", 2); break;
+        case '\n': out.append("\\n", 2); break;
+        case '\r': out.append("\\r", 2); break;
+        case '\t': out.append("\\t", 2); break;
+        default: {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            out.append(buf, 6);
+            break; }
+        }
+    }
+    if (quote)
+        out.append('"');
+}
+
+static void writeInteger(String &out, int value)
+{
+    char buf[16];
+    char *pos = buf + sizeof(buf);
+    // negated as unsigned so INT_MIN is fine
+    unsigned int abs = value < 0 ? 0u - static_cast<unsigned int>(value) : static_cast<unsigned int>(value);
+    do {
+        *--pos = '0' + (abs % 10);
+        abs /= 10;
+    } while (abs);
+    if (value < 0)
+        *--pos = '-';
+    out.append(pos, buf + sizeof(buf) - pos);
+}
+
+static void writeDouble(String &out, double d)
+{
+    if (d <= INT_MAX && d >= INT_MIN && fabs(static_cast<double>(static_cast<int>(d)) - d) <= DBL_EPSILON) {
+        writeInteger(out, static_cast<int>(d));
+        return;
+    }
+    char buf[512];
+    int len;
+    if (fabs(floor(d) - d) <= DBL_EPSILON && fabs(d) < 1.0e60) {
+        len = snprintf(buf, sizeof(buf), "%.0f", d);
+    } else if (fabs(d) < 1.0e-6 || fabs(d) > 1.0e9) {
+        len = snprintf(buf, sizeof(buf), "%e", d);
+    } else {
+        len = snprintf(buf, sizeof(buf), "%f", d);
+    }
+    out.append(buf, std::min<int>(len, sizeof(buf) - 1));
+}
+
+void Value::writeJSON(String &out, int depth, bool pretty) const
+{
+    switch (mType) {
+    case Type_Boolean:
+        if (mData.boolean) {
+            out.append("true", 4);
+        } else {
+            out.append("false", 5);
+        }
+        return;
+    case Type_Integer:
+        writeInteger(out, static_cast<int>(mData.int64));
+        return;
+    case Type_Double:
+        writeDouble(out, mData.dbl);
+        return;
+    case Type_String:
+        writeString(out, stringData(), stringSize(), true);
+        return;
+    case Type_List: {
+        const List<Value> &list = *listPtr();
+        out.append('[');
+        for (int i = 0; i < list.size(); ++i) {
+            if (i) {
+                out.append(',');
+                if (pretty)
+                    out.append(' ');
+            }
+            list[i].writeJSON(out, depth + 1, pretty);
+        }
+        out.append(']');
+        return; }
+    case Type_Map: {
+        const Map<String, Value> &map = *mapPtr();
+        out.append('{');
+        if (map.isEmpty()) {
+            if (pretty) {
+                out.append('\n');
+                for (int i = 0; i < depth - 1; ++i)
+                    out.append('\t');
+            }
+            out.append('}');
+            return;
+        }
+        ++depth;
+        if (pretty)
+            out.append('\n');
+        size_t remaining = map.size();
+        for (const auto &it : map) {
+            if (pretty) {
+                for (int i = 0; i < depth; ++i)
+                    out.append('\t');
             }
+            writeString(out, it.first.constData(), it.first.size(), true);
+            out.append(':');
+            if (pretty)
+                out.append('\t');
+            it.second.writeJSON(out, depth, pretty);
+            if (--remaining)
+                out.append(',');
+            if (pretty)
+                out.append('\n');
         }
+        if (pretty) {
+            for (int i = 0; i < depth - 1; ++i)
+                out.append('\t');
+        }
+        out.append('}');
+        return; }
+    case Type_Custom:
+        if (const std::shared_ptr<Custom> &custom = *customPtr()) {
+            const String string = custom->toString();
+            writeString(out, string.constData(), string.size(), false);
+            return;
+        }
+        break;
+    case Type_Invalid:
+    case Type_Undefined:
         break;
     }
-    return cJSON_CreateNull();
+    out.append("null", 4);
 }
 
 String Value::toJSON(bool pretty) const
 {
-    cJSON *json = toCJSON(*this);
-    char *formatted = (pretty ? cJSON_Print(json) : cJSON_PrintUnformatted(json));
-    cJSON_Delete(json);
-    const String ret = formatted;
-    free(formatted);
+    String ret;
+    writeJSON(ret, 0, pretty);
     return ret;
 }
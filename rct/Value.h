@@ -6,21 +6,38 @@
 #include <rct/Serializer.h>
 #include <rct/Map.h>
 #include <rct/List.h>
+#include <rct/Metrics.h>
 #include <math.h>
+#include <memory>
 
-struct cJSON;
+// Strings of up to InlineStringSize bytes are stored in the Value itself,
+// longer ones and the contents of maps and lists are shared between copies
+// so copying a Value never copies its tree. A map or list is copied the
+// first time a Value that shares it is modified, or right away once the
+// non-const operator[] has handed out a reference into it.
 class Value
 {
 public:
     struct Custom;
-    inline Value() : mType(Type_Invalid) {}
-    inline Value(int i) : mType(Type_Integer) { mData.integer = i; }
-    inline Value(int64_t i) : mType(Type_Integer) { mData.int64 = i; }
-    inline Value(uint64_t i) : mType(Type_Integer) { mData.uint64 = i; }
-    inline Value(double d) : mType(Type_Double) { mData.dbl = d; }
-    inline Value(bool b) : mType(Type_Boolean) { mData.boolean = b; }
-    inline Value(const std::shared_ptr<Custom> &custom) : mType(Type_Custom) { new (mData.customBuf) std::shared_ptr<Custom>(custom); }
-    inline Value(const String &string) : mType(Type_String) { new (mData.stringBuf) String(string); }
+    enum { InlineStringSize = 15 };
+
+    inline Value() : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false) {}
+    inline Value(int i) : mType(Type_Integer), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { mData.int64 = i; }
+    inline Value(int64_t i) : mType(Type_Integer), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { mData.int64 = i; }
+    inline Value(uint64_t i) : mType(Type_Integer), mInlineLength(-1), mUnsigned(true), mUnsharable(false) { mData.uint64 = i; }
+    inline Value(double d) : mType(Type_Double), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { mData.dbl = d; }
+    inline Value(bool b) : mType(Type_Boolean), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { mData.boolean = b; }
+    inline Value(const std::shared_ptr<Custom> &custom) : mType(Type_Custom), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { new (mData.customBuf) std::shared_ptr<Custom>(custom); }
+    inline Value(const String &string) : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { setString(string.constData(), string.size()); }
+    inline Value(String &&string) : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
+    {
+        if (string.size() <= InlineStringSize) {
+            setString(string.constData(), string.size());
+        } else {
+            new (mData.stringBuf) SharedString(makeString(std::move(string)));
+            mType = Type_String;
+        }
+    }
 
     struct Custom : std::enable_shared_from_this<Custom>
     {
@@ -33,30 +50,43 @@ public:
 
         const int type;
     };
-    inline Value(const char *str, int len = -1) : mType(Type_String)
+    inline Value(const char *str, int len = -1) : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
     {
         if (len == -1)
             len = strlen(str);
-        new (mData.stringBuf) String(str, len);
+        setString(str, len);
+    }
+    inline Value(const Value &other) : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false) { copy(other); }
+    inline Value(const Map<String, Value> &map) : mType(Type_Map), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
+    {
+        new (mData.mapBuf) SharedMap(makeShared<Map<String, Value> >(map));
+    }
+    inline Value(Map<String, Value> &&map) : mType(Type_Map), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
+    {
+        new (mData.mapBuf) SharedMap(makeShared<Map<String, Value> >(std::move(map)));
     }
-    inline Value(const Value &other) : mType(Type_Invalid) { copy(other); }
-    inline Value(const Map<String, Value> &map) : mType(Type_Map) { new (mData.mapBuf) Map<String, Value>(map); }
     template <typename T> inline Value(const List<T> &list)
-        : mType(Type_List)
+        : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
     {
-        new (mData.listBuf) List<Value>(list.size());
+        List<Value> *l = initList();
+        l->resize(list.size());
         int i = 0;
-        List<Value> *l = listPtr();
-
         for (const T &t : list)
             (*l)[i++] = t;
     }
-    inline Value(const List<Value> &list) : mType(Type_List) { new (mData.listBuf) List<Value>(list); }
-    Value(Value &&other);
+    inline Value(const List<Value> &list) : mType(Type_List), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
+    {
+        new (mData.listBuf) SharedList(makeShared<List<Value> >(list));
+    }
+    inline Value(List<Value> &&list) : mType(Type_List), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
+    {
+        new (mData.listBuf) SharedList(makeShared<List<Value> >(std::move(list)));
+    }
+    Value(Value &&other) noexcept;
     ~Value() { clear(); }
 
-    inline Value &operator=(const Value &other) { clear(); copy(other); return *this; }
-    Value & operator=(Value&& other);
+    Value &operator=(const Value &other);
+    Value & operator=(Value&& other) noexcept;
 
     inline bool isNull() const { return mType == Type_Invalid; }
     inline bool isValid() const { return mType != Type_Invalid; }
@@ -90,6 +120,9 @@ public:
     inline uint64_t toUInt64() const;
     inline double toDouble() const;
     inline String toString() const;
+    // The String a long string shares with the copies of its Value rather
+    // than a copy of it, null for other types
+    inline std::shared_ptr<const String> toSharedString() const;
     inline std::shared_ptr<Custom> toCustom() const;
     inline Map<String, Value> toMap() const;
     template <typename T>
@@ -105,6 +138,10 @@ public:
     template <typename T> T operator[](int idx) const;
     template <typename T> T operator[](const String &key) const;
     const Value &operator[](int idx) const;
+    // The non-const operator[]s make this Value's list or map its own
+    // before returning a reference into it. From then on copies of this
+    // Value copy the list or map, so writing through the reference never
+    // changes a copy.
     Value &operator[](int idx);
     void push_back(const Value &value);
     const Value &operator[](const String &key) const;
@@ -117,52 +154,145 @@ public:
     inline Value convert(Type type, bool *ok) const;
     template <typename T> static Value create(const T &t) { return Value(t); }
     void clear();
-    static Value fromJSON(const String &json, bool *ok = 0) { return fromJSON(json.constData(), ok); }
+    static Value fromJSON(const String &json, bool *ok = 0);
     static Value fromJSON(const char *json, bool *ok = 0);
+    static Value fromJSONFile(const Path &path, bool *ok = 0);
     String toJSON(bool pretty = false) const;
     static Value undefined() { return Value(Type_Undefined); }
 private:
-    explicit Value(Type type) : mType(type) {}
+    explicit Value(Type type) : mType(type), mInlineLength(-1), mUnsigned(false), mUnsharable(false) {}
+
+    typedef std::shared_ptr<const String> SharedString;
+    typedef std::shared_ptr<Map<String, Value> > SharedMap;
+    typedef std::shared_ptr<List<Value> > SharedList;
 
-    static cJSON *toCJSON(const Value &value);
+    // What copies share is counted as Allocations::Values while counting
+    // is on, and for strings their characters too
+    template <typename T, typename... Args>
+    static std::shared_ptr<T> makeShared(Args &&...args)
+    {
+        if (!Allocations::isEnabled())
+            return std::make_shared<T>(std::forward<Args>(args)...);
+        return std::allocate_shared<T>(CountingAllocator<T, Allocations::Values>(), std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    static SharedString makeString(Args &&...args)
+    {
+        if (!Allocations::isEnabled())
+            return std::make_shared<const String>(std::forward<Args>(args)...);
+        const String *string = new String(std::forward<Args>(args)...);
+        const size_t bytes = sizeof(String) + string->size() + 1;
+        Allocations::add(Allocations::Values, bytes);
+        return SharedString(string, [bytes](const String *str) {
+                Allocations::remove(Allocations::Values, bytes);
+                delete str;
+            }, CountingAllocator<String, Allocations::Values>());
+    }
+
+    friend class MessagePackWriter;
+    friend class ValueBuilder;
+    void writeJSON(String &out, int depth, bool pretty) const;
     void copy(const Value &other);
-    String *stringPtr() { return reinterpret_cast<String*>(mData.stringBuf); }
-    const String *stringPtr() const { return reinterpret_cast<const String*>(mData.stringBuf); }
-    Map<String, Value> *mapPtr() { return reinterpret_cast<Map<String, Value>*>(mData.mapBuf); }
-    const Map<String, Value> *mapPtr() const { return reinterpret_cast<const Map<String, Value>*>(mData.mapBuf); }
-    List<Value> *listPtr() { return reinterpret_cast<List<Value>*>(mData.listBuf); }
-    const List<Value> *listPtr() const { return reinterpret_cast<const List<Value>*>(mData.listBuf); }
+    void move(Value &other);
+    // Expects an invalid Value
+    void setString(const char *data, int length)
+    {
+        if (length <= InlineStringSize) {
+            memcpy(mData.inlineString, data, length);
+            mData.inlineString[length] = '\0';
+            mInlineLength = length;
+        } else {
+            new (mData.stringBuf) SharedString(makeString(data, length));
+        }
+        mType = Type_String;
+    }
+    Map<String, Value> *initMap()
+    {
+        new (mData.mapBuf) SharedMap(makeShared<Map<String, Value> >());
+        mType = Type_Map;
+        return sharedMap()->get();
+    }
+    List<Value> *initList()
+    {
+        new (mData.listBuf) SharedList(makeShared<List<Value> >());
+        mType = Type_List;
+        return sharedList()->get();
+    }
+
+    // null terminated
+    const char *stringData() const { return mInlineLength >= 0 ? mData.inlineString : (*sharedString())->constData(); }
+    int stringSize() const { return mInlineLength >= 0 ? mInlineLength : (*sharedString())->size(); }
+    SharedString *sharedString() { return reinterpret_cast<SharedString*>(mData.stringBuf); }
+    const SharedString *sharedString() const { return reinterpret_cast<const SharedString*>(mData.stringBuf); }
+    SharedMap *sharedMap() { return reinterpret_cast<SharedMap*>(mData.mapBuf); }
+    const SharedMap *sharedMap() const { return reinterpret_cast<const SharedMap*>(mData.mapBuf); }
+    SharedList *sharedList() { return reinterpret_cast<SharedList*>(mData.listBuf); }
+    const SharedList *sharedList() const { return reinterpret_cast<const SharedList*>(mData.listBuf); }
+    // The non-const ones are for modifying and make a copy first if it's shared
+    Map<String, Value> *mapPtr()
+    {
+        SharedMap &map = *sharedMap();
+        if (map.use_count() > 1)
+            map = makeShared<Map<String, Value> >(*map);
+        return map.get();
+    }
+    const Map<String, Value> *mapPtr() const { return sharedMap()->get(); }
+    List<Value> *listPtr()
+    {
+        SharedList &list = *sharedList();
+        if (list.use_count() > 1)
+            list = makeShared<List<Value> >(*list);
+        return list.get();
+    }
+    const List<Value> *listPtr() const { return sharedList()->get(); }
     std::shared_ptr<Custom> *customPtr() { return reinterpret_cast<std::shared_ptr<Custom>*>(mData.customBuf); }
     const std::shared_ptr<Custom> *customPtr() const { return reinterpret_cast<const std::shared_ptr<Custom>*>(mData.customBuf); }
 
     Type mType;
+    // the length of a string in inlineString, -1 when it's shared
+    signed char mInlineLength;
+    // an integer that came in as a uint64_t, for values past INT64_MAX
+    bool mUnsigned;
+    // a non-const operator[] handed out a reference into the list or map,
+    // so copies get a tree of their own rather than sharing this one
+    bool mUnsharable;
+    // integers are always stored as int64
     union {
-        int integer;
         int64_t int64;
         uint64_t uint64;
         double dbl;
         bool boolean;
-        char stringBuf[sizeof(String)];
-        char mapBuf[sizeof(Map<String, Value>)];
-        char listBuf[sizeof(List<Value>)];
+        char inlineString[InlineStringSize + 1];
+        char stringBuf[sizeof(SharedString)];
+        char mapBuf[sizeof(SharedMap)];
+        char listBuf[sizeof(SharedList)];
         char customBuf[sizeof(std::shared_ptr<Custom>)];
     } mData;
 };
 
-inline Value::Value(Value &&other)
-    : mType(Type_Invalid)
+inline Value::Value(Value &&other) noexcept
+    : mType(Type_Invalid), mInlineLength(-1), mUnsigned(false), mUnsharable(false)
 {
-    copy(other);
-    memset(&other.mData, '\0', sizeof(mData));
-    other.mType = Type_Invalid;
+    move(other);
 }
 
-inline Value &Value::operator=(Value &&other)
+inline Value &Value::operator=(const Value &other)
 {
-    clear();
-    copy(other);
-    memset(&other.mData, '\0', sizeof(mData));
-    other.mType = Type_Invalid;
+    if (this != &other) {
+        // other may be part of this
+        Value copied(other);
+        clear();
+        move(copied);
+    }
+    return *this;
+}
+
+inline Value &Value::operator=(Value &&other) noexcept
+{
+    if (this != &other) {
+        clear();
+        move(other);
+    }
     return *this;
 }
 
@@ -187,12 +317,12 @@ template <> inline int Value::convert<int>(bool *ok) const
     if (ok)
         *ok = true;
     switch (mType) {
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return static_cast<int>(mData.int64);
     case Type_Double: return static_cast<int>(round(mData.dbl));
     case Type_Boolean: return mData.boolean;
     case Type_String: {
         char *end;
-        const int ret = strtol(stringPtr()->constData(), &end, 10);
+        const int ret = strtol(stringData(), &end, 10);
         if (!*end)
             return ret;
         break; }
@@ -217,7 +347,7 @@ template <> inline int64_t Value::convert<int64_t>(bool *ok) const
     case Type_Boolean: return mData.boolean;
     case Type_String: {
         char *end;
-        const int64_t ret = strtoll(stringPtr()->constData(), &end, 10);
+        const int64_t ret = strtoll(stringData(), &end, 10);
         if (!*end)
             return ret;
         break; }
@@ -242,7 +372,7 @@ template <> inline uint64_t Value::convert<uint64_t>(bool *ok) const
     case Type_Boolean: return mData.boolean;
     case Type_String: {
         char *end;
-        const uint64_t ret = strtoull(stringPtr()->constData(), &end, 10);
+        const uint64_t ret = strtoull(stringData(), &end, 10);
         if (!*end)
             return ret;
         break; }
@@ -283,7 +413,7 @@ template <> inline bool Value::convert<bool>(bool *ok) const
         *ok = true;
 
     switch (mType) {
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return static_cast<int>(mData.int64);
     case Type_Double: return mData.dbl;
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -313,12 +443,12 @@ template <> inline double Value::convert<double>(bool *ok) const
         *ok = true;
 
     switch (mType) {
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return static_cast<int>(mData.int64);
     case Type_Double: return mData.dbl;
     case Type_Boolean: return mData.boolean;
     case Type_String: {
         char *end;
-        const double ret = strtod(stringPtr()->constData(), &end);
+        const double ret = strtod(stringData(), &end);
         if (!*end)
             return ret;
         break; }
@@ -340,10 +470,13 @@ template <> inline String Value::convert<String>(bool *ok) const
         *ok = true;
 
     switch (mType) {
-    case Type_Integer: return String::number(mData.integer);
+    case Type_Integer: return String::number(static_cast<int>(mData.int64));
     case Type_Double: return String::number(mData.dbl);
     case Type_Boolean: return mData.boolean ? "true" : "false";
-    case Type_String: return *stringPtr();
+    case Type_String:
+        if (mInlineLength >= 0)
+            return String(mData.inlineString, mInlineLength);
+        return **sharedString();
     case Type_Invalid: break;
     case Type_Undefined: return "undefined";
     case Type_Custom: break;
@@ -421,6 +554,14 @@ inline int64_t Value::toInt64() const { return convert<int64_t>(0); }
 inline uint64_t Value::toUInt64() const { return convert<uint64_t>(0); }
 inline double Value::toDouble() const { return convert<double>(0); }
 inline String Value::toString() const { return convert<String>(0); }
+inline std::shared_ptr<const String> Value::toSharedString() const
+{
+    if (mType != Type_String)
+        return std::shared_ptr<const String>();
+    if (mInlineLength >= 0)
+        return makeString(mData.inlineString, mInlineLength);
+    return *sharedString();
+}
 inline std::shared_ptr<Value::Custom> Value::toCustom() const { return convert<std::shared_ptr<Custom> >(0); }
 inline Map<String, Value> Value::toMap() const { return convert<Map<String, Value> >(0); }
 inline List<Value> Value::toList() const { return convert<List<Value> >(0); }
@@ -524,23 +665,20 @@ inline const Value &Value::operator[](int idx) const
 
 inline Value &Value::operator[](int idx)
 {
-    if (mType == Type_Invalid) {
-        new (mData.listBuf) List<Value>;
-        mType = Type_List;
-    } else {
-        assert(mType == Type_List);
-    }
+    mUnsharable = true;
+    if (mType == Type_Invalid)
+        return (*initList())[idx];
+    assert(mType == Type_List);
     return (*listPtr())[idx];
 }
 
 inline void Value::push_back(const Value &value)
 {
     if (mType == Type_Invalid) {
-        new (mData.listBuf) List<Value>;
-        mType = Type_List;
-    } else {
-        assert(mType == Type_List);
+        initList()->push_back(value);
+        return;
     }
+    assert(mType == Type_List);
     listPtr()->push_back(value);
 }
 
@@ -552,12 +690,10 @@ inline const Value &Value::operator[](const String &key) const
 
 inline Value &Value::operator[](const String &key)
 {
-    if (mType == Type_Invalid) {
-        new (mData.mapBuf) Map<String, Value>;
-        mType = Type_Map;
-    } else {
-        assert(mType == Type_Map);
-    }
+    mUnsharable = true;
+    if (mType == Type_Invalid)
+        return (*initMap())[key];
+    assert(mType == Type_Map);
     return (*mapPtr())[key];
 }
 template <typename T>
@@ -611,8 +747,17 @@ inline Serializer& operator<<(Serializer& serializer, const Value& value)
     case Value::Type_Double: serializer << value.toDouble(); break;
     case Value::Type_Boolean: serializer << value.toBool(); break;
     case Value::Type_String: serializer << value.toString(); break;
-    case Value::Type_Map: serializer << value.toMap(); break;
-    case Value::Type_List: serializer << value.toList(); break;
+    case Value::Type_Map:
+        // the wire format of a Map, without copying it first
+        serializer << static_cast<uint32_t>(value.count());
+        for (const auto &it : value)
+            serializer << it.first << it.second;
+        break;
+    case Value::Type_List:
+        serializer << static_cast<uint32_t>(value.count());
+        for (auto it = value.listBegin(); it != value.listEnd(); ++it)
+            serializer << *it;
+        break;
     case Value::Type_Custom: error() << "Trying to serialize pointer"; break;
     case Value::Type_Invalid: break;
     case Value::Type_Undefined: break;
@@ -629,9 +774,9 @@ inline Deserializer& operator>>(Deserializer& deserializer, Value& value)
     case Value::Type_Integer: { int v; deserializer >> v; value = v; break; }
     case Value::Type_Double: { double v; deserializer >> v; value = v; break; }
     case Value::Type_Boolean: { bool v; deserializer >> v; value = v; break; }
-    case Value::Type_String: { String v; deserializer >> v; value = v; break; }
-    case Value::Type_Map: { Map<String, Value> v; deserializer >> v; value = v; break; }
-    case Value::Type_List: { List<Value> v; deserializer >> v; value = v; break; }
+    case Value::Type_String: { String v; deserializer >> v; value = Value(std::move(v)); break; }
+    case Value::Type_Map: { Map<String, Value> v; deserializer >> v; value = Value(std::move(v)); break; }
+    case Value::Type_List: { List<Value> v; deserializer >> v; value = Value(std::move(v)); break; }
     case Value::Type_Custom: value.clear(); error() << "Trying to deserialize pointer"; break;
     case Value::Type_Invalid: value.clear(); break;
     case Value::Type_Undefined: value = Value::undefined(); break;
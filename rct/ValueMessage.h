@@ -0,0 +1,36 @@
+#ifndef ValueMessage_h
+#define ValueMessage_h
+
+#include <rct/Message.h>
+#include <rct/MessagePack.h>
+#include <rct/StringView.h>
+#include <rct/Value.h>
+
+// Carries a Value encoded as MessagePack, so peers that aren't built on
+// rct can read and write it too
+class ValueMessage : public Message
+{
+public:
+    enum { MessageId = ValueMessageId };
+
+    ValueMessage(const Value &value = Value())
+        : Message(MessageId), mValue(value)
+    {
+    }
+
+    const Value &value() const { return mValue; }
+    void setValue(const Value &value) { mValue = value; }
+
+    virtual void encode(Serializer &serializer) const override { serializer << MessagePackWriter::encode(mValue); }
+    virtual void decode(Deserializer &deserializer) override
+    {
+        StringView data;
+        deserializer >> data;
+        // invalid if the data is
+        mValue = MessagePackReader::decode(data.data(), data.size());
+    }
+private:
+    Value mValue;
+};
+
+#endif
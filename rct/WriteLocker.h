@@ -2,24 +2,45 @@
 #define WRITELOCKER_H
 
 #include <rct/ReadWriteLock.h>
+#include <rct/SeqLock.h>
+#include <rct/ShardedReadWriteLock.h>
 
 class WriteLocker
 {
 public:
     WriteLocker(ReadWriteLock* lock)
-        : mLock(lock)
+        : mLock(lock), mSharded(0), mSeq(0)
     {
         if (mLock && !mLock->lockForWrite())
             mLock = 0;
     }
+    WriteLocker(ShardedReadWriteLock* lock)
+        : mLock(0), mSharded(lock), mSeq(0)
+    {
+        if (mSharded && !mSharded->lockForWrite())
+            mSharded = 0;
+    }
+    // readers of a SeqLock don't lock, they use SeqLock::load()
+    WriteLocker(SeqLockBase* lock)
+        : mLock(0), mSharded(0), mSeq(lock)
+    {
+        if (mSeq && !mSeq->lockForWrite())
+            mSeq = 0;
+    }
     ~WriteLocker()
     {
         if (mLock)
             mLock->unlock();
+        else if (mSharded)
+            mSharded->unlockWrite();
+        else if (mSeq)
+            mSeq->unlock();
     }
 
 private:
     ReadWriteLock* mLock;
+    ShardedReadWriteLock* mSharded;
+    SeqLockBase* mSeq;
 
 };
 
@@ -0,0 +1,79 @@
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <rct/Value.h>
+#include <stdio.h>
+
+// Parses the documents in this directory, which came with cJSON, and
+// checks that writing them out and parsing that again gives the same
+// document.
+
+static int sFailures = 0;
+
+static void check(bool ok, const char *what, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "%d: %s failed\n", line, what);
+        ++sFailures;
+    }
+}
+#define CHECK(expr) check((expr), #expr, __LINE__)
+
+static bool roundTrip(const Value &value)
+{
+    bool ok;
+    for (int pretty = 0; pretty < 2; ++pretty) {
+        const String json = value.toJSON(pretty);
+        const Value parsed = Value::fromJSON(json, &ok);
+        if (!ok || parsed.toJSON(pretty) != json)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const Path dir = argc > 1 ? Path(argv[1]) : Path(__FILE__).parentDir();
+    for (int i = 1; i <= 5; ++i) {
+        const Path file = dir.ensureTrailingSlash() + String::format<16>("test%d", i);
+        bool ok;
+        const Value value = Value::fromJSONFile(file, &ok);
+        if (!ok) {
+            fprintf(stderr, "Failed to parse %s\n", file.constData());
+            ++sFailures;
+            continue;
+        }
+        CHECK(value.isMap() || value.isList());
+        CHECK(roundTrip(value));
+        const Value fromString = Value::fromJSON(file.readAll(), &ok);
+        CHECK(ok && fromString.toJSON() == value.toJSON());
+    }
+
+    bool ok;
+    Value value = Value::fromJSON("\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\\u0041\"", &ok);
+    CHECK(ok && value.toString() == "a\"b\\c/d\b\f\n\r\tA");
+    CHECK(roundTrip(value));
+
+    // U+00E9, U+20AC and U+1F600 as a surrogate pair
+    value = Value::fromJSON("[\"\\u00e9\", \"\\u20ac\", \"\\ud83d\\ude00\"]", &ok);
+    CHECK(ok && value.count() == 3);
+    CHECK(value.at(0).toString() == "\xc3\xa9");
+    CHECK(value.at(1).toString() == "\xe2\x82\xac");
+    CHECK(value.at(2).toString() == "\xf0\x9f\x98\x80");
+    CHECK(roundTrip(value));
+    // like cJSON, a lone surrogate is dropped
+    value = Value::fromJSON("\"a\\udc00b\"", &ok);
+    CHECK(ok && value.toString() == "ab");
+
+    const char *invalid[] = { "[1,]", "{\"a\" 1}", "[1", "{\"a\":}", 0 };
+    for (int i = 0; invalid[i]; ++i) {
+        Value::fromJSON(invalid[i], &ok);
+        if (ok) {
+            fprintf(stderr, "Accepted %s\n", invalid[i]);
+            ++sFailures;
+        }
+    }
+
+    if (sFailures)
+        fprintf(stderr, "%d failures\n", sFailures);
+    return sFailures ? 1 : 0;
+}
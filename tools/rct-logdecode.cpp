@@ -0,0 +1,20 @@
+#include <rct/BinaryLog.h>
+#include <stdio.h>
+#include <string.h>
+
+// Prints the events of files written by BinaryLogOutput
+int main(int argc, char **argv)
+{
+    if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+        fprintf(stderr, "Usage: %s <file>...\n", argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!BinaryLogOutput::decode(argv[i], stdout)) {
+            fprintf(stderr, "%s: Can't decode %s\n", argv[0], argv[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
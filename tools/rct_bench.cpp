@@ -0,0 +1,306 @@
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/Map.h>
+#include <rct/Message.h>
+#include <rct/Metrics.h>
+#include <rct/Path.h>
+#include <rct/ResponseMessage.h>
+#include <rct/Serializer.h>
+#include <rct/SocketServer.h>
+#include <rct/String.h>
+#include <rct/ThreadPool.h>
+#include <rct/Timer.h>
+#include <rct/Value.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Microbenchmarks of rct's core primitives. Every benchmark is run with more
+// and more iterations until one run takes at least --min-time ms, and the
+// results of that run are printed as JSON on stdout so they can be compared
+// between builds.
+
+// Runs the operation iterations times. Benchmarks of something with a
+// latency worth knowing add every operation's time, in ns, to latency.
+typedef void (*BenchmarkFunction)(uint64_t iterations, Histogram &latency);
+
+static EventLoop::SharedPtr sLoop;
+static Path sTempDir;
+
+static uint64_t nowNs()
+{
+    timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (spec.tv_sec * static_cast<uint64_t>(1000000000)) + spec.tv_nsec;
+}
+
+static void eventLoopPost(uint64_t iterations, Histogram &)
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sLoop->callLater([&count, iterations]() {
+                if (++count == iterations)
+                    sLoop->quit();
+            });
+    }
+    sLoop->exec();
+}
+
+static void eventLoopTimers(uint64_t iterations, Histogram &)
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        sLoop->registerTimer([&count, iterations](int) {
+                if (++count == iterations)
+                    sLoop->quit();
+            }, 0, Timer::SingleShot);
+    }
+    sLoop->exec();
+}
+
+static void connectionRoundTrip(uint64_t iterations, Histogram &latency)
+{
+    const Path socketFile = sTempDir + "socket";
+    SocketServer server;
+    if (!server.listen(socketFile)) {
+        fprintf(stderr, "Can't listen on %s\n", socketFile.constData());
+        return;
+    }
+    std::shared_ptr<Connection> serverConnection;
+    server.newConnection().connect([&serverConnection](SocketServer *s) {
+            serverConnection = Connection::create(s->nextConnection());
+            serverConnection->newMessage().connect([](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection) {
+                    connection->send(*message);
+                });
+        });
+
+    const ResponseMessage message(String(64, 'x'));
+    uint64_t count = 0, sent = 0;
+    std::shared_ptr<Connection> client = Connection::create();
+    client->connected().connect([&](const std::shared_ptr<Connection> &connection) {
+            sent = nowNs();
+            connection->send(message);
+        });
+    client->newMessage().connect([&](const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &connection) {
+            latency.add(nowNs() - sent);
+            if (++count == iterations) {
+                sLoop->quit();
+            } else {
+                sent = nowNs();
+                connection->send(message);
+            }
+        });
+    if (!client->connectUnix(socketFile)) {
+        fprintf(stderr, "Can't connect to %s\n", socketFile.constData());
+        return;
+    }
+    sLoop->exec();
+    client->close();
+    if (serverConnection)
+        serverConnection->close();
+    Path::rm(socketFile);
+}
+
+static void serializerNested(uint64_t iterations, Histogram &)
+{
+    Map<String, List<int> > map;
+    for (int i = 0; i < 16; ++i) {
+        List<int> &list = map[String::number(i)];
+        for (int j = 0; j < 16; ++j)
+            list.append(i * j);
+    }
+    String out;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        out.clear();
+        {
+            Serializer serializer(out);
+            serializer << map;
+        }
+        Map<String, List<int> > decoded;
+        Deserializer deserializer(out);
+        deserializer >> decoded;
+    }
+}
+
+static void valueJson(uint64_t iterations, Histogram &)
+{
+    Value value;
+    for (int i = 0; i < 32; ++i) {
+        Value item;
+        item["id"] = i;
+        item["name"] = String::format<32>("item %d", i);
+        item["ratio"] = i / 3.0;
+        item["enabled"] = (i % 2) == 0;
+        for (int j = 0; j < 4; ++j)
+            item["tags"].push_back(String::number(j));
+        value["items"].push_back(item);
+    }
+    const String json = value.toJSON();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        const Value parsed = Value::fromJSON(json);
+        if (parsed.toJSON().size() != json.size())
+            fprintf(stderr, "JSON round trip changed the document\n");
+    }
+}
+
+static void threadPoolSubmit(uint64_t iterations, Histogram &latency)
+{
+    static ThreadPool pool(ThreadPool::idealThreadCount());
+    for (uint64_t i = 0; i < iterations; ++i) {
+        const uint64_t started = nowNs();
+        pool.submit([]() { return 0; }).get();
+        latency.add(nowNs() - started);
+    }
+}
+
+static void stringSplit(uint64_t iterations, Histogram &)
+{
+    String csv;
+    for (int i = 0; i < 128; ++i) {
+        if (i)
+            csv += ',';
+        csv += String::number(i * 1000);
+    }
+    size_t count = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+        count += csv.split(',').size();
+    if (count != iterations * 128)
+        fprintf(stderr, "String::split returned the wrong count\n");
+}
+
+static void stringIndexOf(uint64_t iterations, Histogram &)
+{
+    String haystack(4096, 'a');
+    haystack += "needle";
+    const String needle("needle");
+    for (uint64_t i = 0; i < iterations; ++i) {
+        if (haystack.indexOf(needle) != 4096)
+            fprintf(stderr, "String::indexOf didn't find the needle\n");
+    }
+}
+
+static Path::VisitResult countVisited(const Path &path, void *userData)
+{
+    ++*static_cast<int*>(userData);
+    return path.isDir() ? Path::Recurse : Path::Continue;
+}
+
+static void pathVisit(uint64_t iterations, Histogram &)
+{
+    const Path root = sTempDir + "tree/";
+    if (!root.isDir()) {
+        for (int i = 0; i < 10; ++i) {
+            const Path dir = root + String::format<16>("dir%d/", i);
+            Path::mkdir(dir, Path::Recursive);
+            for (int j = 0; j < 50; ++j)
+                Path::write(dir + String::format<16>("file%d", j), String());
+        }
+    }
+    for (uint64_t i = 0; i < iterations; ++i) {
+        int count = 0;
+        root.visit(countVisited, &count);
+        if (count != 510)
+            fprintf(stderr, "Path::visit found %d entries\n", count);
+    }
+}
+
+struct Benchmark
+{
+    const char *name;
+    BenchmarkFunction function;
+};
+
+static const Benchmark sBenchmarks[] = {
+    { "EventLoop::post", eventLoopPost },
+    { "EventLoop::registerTimer", eventLoopTimers },
+    { "Connection round trip", connectionRoundTrip },
+    { "Serializer nested containers", serializerNested },
+    { "Value JSON round trip", valueJson },
+    { "ThreadPool::submit", threadPoolSubmit },
+    { "String::split", stringSplit },
+    { "String::indexOf", stringIndexOf },
+    { "Path::visit", pathVisit },
+    { 0, 0 }
+};
+
+static Value run(const Benchmark &benchmark, uint64_t minTime)
+{
+    Histogram latency;
+    uint64_t iterations = 1, elapsed = 0;
+    for (;;) {
+        latency.reset();
+        const uint64_t started = nowNs();
+        benchmark.function(iterations, latency);
+        elapsed = nowNs() - started;
+        if (elapsed >= minTime)
+            break;
+        // aim a bit past the minimum so the next run is most likely the last
+        const double scale = elapsed ? (minTime * 1.2) / elapsed : 100;
+        iterations = std::max<uint64_t>(iterations * 2, iterations * std::min(scale, 100.0));
+    }
+    Value ret;
+    ret["name"] = benchmark.name;
+    ret["iterations"] = iterations;
+    ret["nsPerOp"] = static_cast<double>(elapsed) / iterations;
+    ret["opsPerSecond"] = iterations * 1000000000.0 / elapsed;
+    if (latency.count())
+        ret["latency"] = latency.toValue();
+    return ret;
+}
+
+static void usage(FILE *f, const char *argv0)
+{
+    fprintf(f,
+            "Usage: %s [options]\n"
+            "  --filter <text>   Only run benchmarks whose name contains text\n"
+            "  --min-time <ms>   Minimum time of the measured run (default 500)\n"
+            "  --list            List the benchmarks\n"
+            "  --pretty          Indent the JSON\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    String filter;
+    uint64_t minTime = 500;
+    bool pretty = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            minTime = strtoull(argv[++i], 0, 10);
+        } else if (!strcmp(argv[i], "--pretty")) {
+            pretty = true;
+        } else if (!strcmp(argv[i], "--list")) {
+            for (const Benchmark *benchmark = sBenchmarks; benchmark->name; ++benchmark)
+                printf("%s\n", benchmark->name);
+            return 0;
+        } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage(stdout, argv[0]);
+            return 0;
+        } else {
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    sLoop = std::make_shared<EventLoop>();
+    sLoop->init(EventLoop::MainEventLoop);
+    sTempDir = String::format<64>("/tmp/rct_bench.%d/", getpid());
+    Path::mkdir(sTempDir);
+
+    Value results;
+    for (const Benchmark *benchmark = sBenchmarks; benchmark->name; ++benchmark) {
+        if (!filter.isEmpty() && !strstr(benchmark->name, filter.constData()))
+            continue;
+        fprintf(stderr, "%s...\n", benchmark->name);
+        results["benchmarks"].push_back(run(*benchmark, minTime * 1000000));
+    }
+    printf("%s\n", results.toJSON(pretty).constData());
+
+    Path::rmdir(sTempDir);
+    sLoop.reset();
+    return 0;
+}
@@ -0,0 +1,355 @@
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/EventLoopGroup.h>
+#include <rct/Message.h>
+#include <rct/Metrics.h>
+#include <rct/Set.h>
+#include <rct/SocketServer.h>
+#include <rct/String.h>
+#include <rct/Value.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Load generator for SocketServer and Connection. An echo server runs on
+// one EventLoopGroup, or in another process with --connect, and clients on
+// a second group keep a number of messages in flight on each connection.
+// Throughput and round trip latency are printed as JSON when it's done.
+
+static uint64_t nowNs()
+{
+    timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (spec.tv_sec * static_cast<uint64_t>(1000000000)) + spec.tv_nsec;
+}
+
+// The payload and the flags the echo should be sent back with
+class LoadMessage : public Message
+{
+public:
+    enum { MessageId = 100 };
+
+    LoadMessage(const String &data = String(), uint8_t flags = None)
+        : Message(MessageId, flags), mData(data), mEchoFlags(flags & Compressed)
+    {}
+
+    const String &data() const { return mData; }
+    uint8_t echoFlags() const { return mEchoFlags; }
+
+    virtual int encodedSize() const override
+    {
+        if (flags() & Compressed)
+            return -1;
+        return Serializer::encodedSize(mData) + Serializer::sizeOf<uint8_t>();
+    }
+    virtual void encode(Serializer &serializer) const override { serializer << mData << mEchoFlags; }
+    virtual void decode(Deserializer &deserializer) override { deserializer >> mData >> mEchoFlags; }
+
+private:
+    String mData;
+    uint8_t mEchoFlags;
+};
+
+struct Options
+{
+    Options()
+        : connections(64), clientThreads(0), serverThreads(0), pipeline(1),
+          duration(10), port(47623), compressPercent(0), cache(false)
+    {}
+
+    int connections, clientThreads, serverThreads, pipeline, duration;
+    uint16_t port;
+    String connect, unixSocket;
+    List<int> sizes;
+    int compressPercent;
+    bool cache;
+};
+
+struct Stats
+{
+    Stats() : sent(0), received(0), bytes(0), connected(0), failed(0) {}
+
+    std::atomic<uint64_t> sent, received, bytes;
+    std::atomic<int> connected, failed;
+    Histogram latency;
+};
+
+static std::atomic<bool> sStopping(false);
+
+// One client connection and the send times of its messages in flight.
+// Replies come back in order so the oldest one is the one answered.
+struct Client
+{
+    std::shared_ptr<Connection> connection;
+    std::deque<uint64_t> inFlight;
+    unsigned int next;
+};
+
+class ClientLoop
+{
+public:
+    ClientLoop(const Options &options, Stats &stats, int index)
+        : mOptions(options), mStats(stats), mIndex(index)
+    {
+        // every size, and for compressPercent of them the compressed
+        // variant, for the clients to take turns with
+        for (int size : options.sizes) {
+            for (int i = 0; i < 100; ++i) {
+                uint8_t flags = i < options.compressPercent ? Message::Compressed : Message::None;
+                if (options.cache)
+                    flags |= Message::MessageCache;
+                // compressible but not entirely uniform
+                String data(size, ' ');
+                for (int j = 0; j < size; ++j)
+                    data[j] = 'a' + ((j * 7) % 26);
+                mMessages.append(std::make_shared<LoadMessage>(data, flags));
+            }
+        }
+    }
+
+    void connect(int count)
+    {
+        for (int i = 0; i < count; ++i) {
+            Client *client = new Client;
+            client->next = (mIndex * 31 + i * 17) % mMessages.size();
+            client->connection = Connection::create();
+            client->connection->connected().connect([this, client](const std::shared_ptr<Connection> &) {
+                    ++mStats.connected;
+                    for (int j = 0; j < mOptions.pipeline; ++j)
+                        send(client);
+                });
+            client->connection->newMessage().connect([this, client](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+                    onReply(client, message);
+                });
+            client->connection->disconnected().connect([this](const std::shared_ptr<Connection> &) {
+                    if (!sStopping)
+                        ++mStats.failed;
+                });
+            const bool ok = mOptions.unixSocket.isEmpty()
+                ? client->connection->connectTcp(mOptions.connect.isEmpty() ? String("127.0.0.1") : mOptions.connect, mOptions.port)
+                : client->connection->connectUnix(mOptions.unixSocket);
+            if (!ok) {
+                ++mStats.failed;
+                delete client;
+                continue;
+            }
+            mClients.append(client);
+        }
+    }
+
+    void close()
+    {
+        for (Client *client : mClients) {
+            if (client->connection->isConnected())
+                client->connection->close();
+            delete client;
+        }
+        mClients.clear();
+    }
+
+private:
+    void send(Client *client)
+    {
+        const std::shared_ptr<LoadMessage> &message = mMessages.at(client->next);
+        client->next = (client->next + 1) % mMessages.size();
+        client->inFlight.push_back(nowNs());
+        ++mStats.sent;
+        client->connection->send(*message);
+    }
+
+    void onReply(Client *client, const std::shared_ptr<Message> &message)
+    {
+        if (client->inFlight.empty())
+            return;
+        mStats.latency.add(nowNs() - client->inFlight.front());
+        client->inFlight.pop_front();
+        ++mStats.received;
+        if (message->messageId() == LoadMessage::MessageId)
+            mStats.bytes += std::static_pointer_cast<LoadMessage>(message)->data().size();
+        if (!sStopping)
+            send(client);
+    }
+
+    const Options &mOptions;
+    Stats &mStats;
+    const int mIndex;
+    List<std::shared_ptr<LoadMessage> > mMessages;
+    List<Client*> mClients;
+};
+
+static std::mutex sServerMutex;
+static Set<std::shared_ptr<Connection> > sServerConnections;
+
+static void onNewConnection(SocketServer *server)
+{
+    while (SocketClient::SharedPtr socket = server->nextConnection()) {
+        std::shared_ptr<Connection> connection = Connection::create(socket);
+        connection->newMessage().connect([](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+                if (message->messageId() != LoadMessage::MessageId)
+                    return;
+                const std::shared_ptr<LoadMessage> load = std::static_pointer_cast<LoadMessage>(message);
+                conn->send(LoadMessage(load->data(), load->echoFlags()));
+            });
+        connection->disconnected().connect([](const std::shared_ptr<Connection> &conn) {
+                std::lock_guard<std::mutex> lock(sServerMutex);
+                sServerConnections.remove(conn);
+            });
+        std::lock_guard<std::mutex> lock(sServerMutex);
+        sServerConnections.insert(connection);
+    }
+}
+
+static void usage(FILE *f, const char *argv0)
+{
+    fprintf(f,
+            "Usage: %s [options]\n"
+            "  --connections <n>     Client connections (default 64)\n"
+            "  --client-threads <n>  Client event loops (default one per cpu)\n"
+            "  --server-threads <n>  Server event loops (default one per cpu)\n"
+            "  --pipeline <n>        Messages in flight per connection (default 1)\n"
+            "  --duration <s>        Seconds to run for (default 10)\n"
+            "  --size <n[,n...]>     Payload sizes to take turns with (default 64)\n"
+            "  --compress <percent>  Share of messages sent Compressed (default 0)\n"
+            "  --cache               Send messages with MessageCache\n"
+            "  --port <port>         TCP port (default 47623)\n"
+            "  --unix <path>         Use a Unix socket instead of TCP\n"
+            "  --connect <host>      Load an echo server that's already running\n"
+            "  --server              Only run the echo server\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    bool serverOnly = false;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : 0;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(stdout, argv[0]);
+            return 0;
+        } else if (!strcmp(arg, "--cache")) {
+            options.cache = true;
+            continue;
+        } else if (!strcmp(arg, "--server")) {
+            serverOnly = true;
+            continue;
+        } else if (!value) {
+            usage(stderr, argv[0]);
+            return 1;
+        }
+        ++i;
+        if (!strcmp(arg, "--connections")) {
+            options.connections = atoi(value);
+        } else if (!strcmp(arg, "--client-threads")) {
+            options.clientThreads = atoi(value);
+        } else if (!strcmp(arg, "--server-threads")) {
+            options.serverThreads = atoi(value);
+        } else if (!strcmp(arg, "--pipeline")) {
+            options.pipeline = std::max(1, atoi(value));
+        } else if (!strcmp(arg, "--duration")) {
+            options.duration = atoi(value);
+        } else if (!strcmp(arg, "--size")) {
+            for (const String &size : String(value).split(','))
+                options.sizes.append(std::max(0, atoi(size.constData())));
+        } else if (!strcmp(arg, "--compress")) {
+            options.compressPercent = std::min(100, std::max(0, atoi(value)));
+        } else if (!strcmp(arg, "--port")) {
+            options.port = atoi(value);
+        } else if (!strcmp(arg, "--unix")) {
+            options.unixSocket = value;
+        } else if (!strcmp(arg, "--connect")) {
+            options.connect = value;
+        } else {
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if (options.sizes.isEmpty())
+        options.sizes.append(64);
+    Message::registerMessage<LoadMessage>();
+
+    EventLoopGroup server;
+    SocketServer::SharedPtr unixServer;
+    if (options.connect.isEmpty()) {
+        if (options.unixSocket.isEmpty()) {
+            server.start(options.serverThreads);
+            if (!server.listen(options.port, SocketServer::IPv4, [](int, const SocketServer::SharedPtr &s) {
+                        s->newConnection().connect(onNewConnection);
+                    })) {
+                fprintf(stderr, "Can't listen on port %d\n", options.port);
+                return 1;
+            }
+        } else {
+            // a Unix socket can't be shared, one loop serves it
+            server.start(1);
+            std::atomic<bool> listening(false);
+            server.runOnEach([&](int) {
+                    Path::rm(options.unixSocket);
+                    unixServer.reset(new SocketServer);
+                    unixServer->newConnection().connect(onNewConnection);
+                    listening = unixServer->listen(options.unixSocket);
+                });
+            if (!listening) {
+                fprintf(stderr, "Can't listen on %s\n", options.unixSocket.constData());
+                return 1;
+            }
+        }
+        if (serverOnly) {
+            for (;;)
+                pause();
+        }
+    }
+
+    Stats stats;
+    EventLoopGroup clients;
+    clients.start(options.clientThreads);
+    List<ClientLoop*> loops;
+    for (int i = 0; i < clients.size(); ++i)
+        loops.append(new ClientLoop(options, stats, i));
+    const uint64_t started = nowNs();
+    clients.runOnEach([&](int index) {
+            const int count = options.connections / clients.size() + (index < options.connections % clients.size() ? 1 : 0);
+            loops.at(index)->connect(count);
+        });
+
+    sleep(options.duration);
+    sStopping = true;
+    const uint64_t elapsed = nowNs() - started;
+    const uint64_t received = stats.received, bytes = stats.bytes;
+    // give what's in flight a moment before the connections go
+    usleep(100 * 1000);
+    clients.runOnEach([&](int index) { loops.at(index)->close(); });
+    clients.stop();
+    if (server.isRunning()) {
+        server.runOnEach([&](int) {
+                unixServer.reset();
+                std::lock_guard<std::mutex> lock(sServerMutex);
+                sServerConnections.clear();
+            });
+        server.stop();
+    }
+    for (ClientLoop *loop : loops)
+        delete loop;
+
+    Value result;
+    result["connections"] = options.connections;
+    result["connected"] = stats.connected.load();
+    result["failed"] = stats.failed.load();
+    result["pipeline"] = options.pipeline;
+    result["seconds"] = elapsed / 1000000000.0;
+    result["sent"] = stats.sent.load();
+    result["received"] = received;
+    result["messagesPerSecond"] = received * 1000000000.0 / elapsed;
+    result["payloadMBPerSecond"] = bytes * 1000.0 / elapsed;
+    // nanoseconds
+    result["latency"] = stats.latency.toValue();
+    printf("%s\n", result.toJSON(true).constData());
+    if (!options.unixSocket.isEmpty() && options.connect.isEmpty())
+        Path::rm(options.unixSocket);
+    return stats.connected ? 0 : 1;
+}